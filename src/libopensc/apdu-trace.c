@@ -0,0 +1,244 @@
+/*
+ * apdu-trace.c: Binary APDU trace ring buffer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "internal.h"
+
+/*
+ * Recording an APDU must not change the timing of the code being traced,
+ * so the hot path takes no lock and does no formatting: a slot is claimed
+ * with an atomic increment and a memory barrier orders the record before
+ * its sequence number. Where the trace file can be mapped, several
+ * contexts and processes configured with the same file share one ring.
+ */
+#if defined(_WIN32)
+#define TRACE_CLAIM(p)	((unsigned long long)InterlockedIncrement64((volatile LONGLONG *)(p)) - 1)
+#define TRACE_BARRIER()	MemoryBarrier()
+#elif defined(__GNUC__)
+#define TRACE_CLAIM(p)	__sync_fetch_and_add((p), 1ULL)
+#define TRACE_BARRIER()	__sync_synchronize()
+#else
+#define TRACE_CLAIM(p)	((*(p))++)
+#define TRACE_BARRIER()
+#endif
+
+struct sc_apdu_trace {
+	struct sc_apdu_trace_header *header;
+	struct sc_apdu_trace_record *records;
+	size_t size;
+	unsigned int pid;
+#ifndef HAVE_SYS_MMAN_H
+	char *filename;		/* written out by sc_apdu_trace_close() */
+#endif
+};
+
+static unsigned long long trace_wall_clock(void)
+{
+#ifdef HAVE_SYS_TIME_H
+	struct timeval tv;
+
+	if (gettimeofday(&tv, NULL) == 0)
+		return (unsigned long long)tv.tv_sec * 1000000 + (unsigned long long)tv.tv_usec;
+#endif
+	return (unsigned long long)time(NULL) * 1000000;
+}
+
+static int trace_header_valid(const struct sc_apdu_trace_header *header, size_t records)
+{
+	return memcmp(header->magic, SC_APDU_TRACE_MAGIC, sizeof header->magic) == 0
+		&& header->version == SC_APDU_TRACE_VERSION
+		&& header->record_size == sizeof(struct sc_apdu_trace_record)
+		&& header->capacity == records;
+}
+
+static void trace_header_init(struct sc_apdu_trace_header *header, size_t records)
+{
+	memset(header, 0, sizeof *header);
+	memcpy(header->magic, SC_APDU_TRACE_MAGIC, sizeof header->magic);
+	header->version = SC_APDU_TRACE_VERSION;
+	header->record_size = sizeof(struct sc_apdu_trace_record);
+	header->capacity = (unsigned int)records;
+	header->start_time = trace_wall_clock();
+	header->start_mono = sc_stats_now();
+}
+
+#ifdef HAVE_SYS_MMAN_H
+static int trace_map(sc_context_t *ctx, struct sc_apdu_trace *trace,
+		const char *filename, size_t records)
+{
+	struct stat st;
+	void *map;
+	int fd, reuse;
+
+	fd = open(filename, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		sc_log(ctx, "Cannot open APDU trace file '%s'", filename);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	reuse = fstat(fd, &st) == 0 && (size_t)st.st_size == trace->size;
+	if (!reuse && (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)trace->size) != 0)) {
+		close(fd);
+		return SC_ERROR_INTERNAL;
+	}
+	map = mmap(NULL, trace->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	trace->header = map;
+	if (!reuse || !trace_header_valid(trace->header, records)) {
+		memset(map, 0, trace->size);
+		trace_header_init(trace->header, records);
+	}
+	return SC_SUCCESS;
+}
+#endif
+
+int sc_apdu_trace_open(sc_context_t *ctx, const char *filename, size_t records)
+{
+	struct sc_apdu_trace *trace;
+	int r = SC_SUCCESS;
+
+	if (ctx == NULL || filename == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (records == 0 || records > 0x100000)
+		records = SC_APDU_TRACE_DEFAULT_RECORDS;
+
+	sc_apdu_trace_close(ctx);
+
+	trace = calloc(1, sizeof *trace);
+	if (trace == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	trace->size = sizeof(struct sc_apdu_trace_header)
+		+ records * sizeof(struct sc_apdu_trace_record);
+#ifdef _WIN32
+	trace->pid = (unsigned int)GetCurrentProcessId();
+#else
+	trace->pid = (unsigned int)getpid();
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+	r = trace_map(ctx, trace, filename, records);
+#else
+	trace->header = calloc(1, trace->size);
+	trace->filename = strdup(filename);
+	if (trace->header == NULL || trace->filename == NULL)
+		r = SC_ERROR_OUT_OF_MEMORY;
+	else
+		trace_header_init(trace->header, records);
+#endif
+	if (r != SC_SUCCESS) {
+		sc_log(ctx, "APDU trace disabled: %s", sc_strerror(r));
+#ifndef HAVE_SYS_MMAN_H
+		free(trace->header);
+		free(trace->filename);
+#endif
+		free(trace);
+		return r;
+	}
+
+	trace->records = (struct sc_apdu_trace_record *)(trace->header + 1);
+	ctx->apdu_trace = trace;
+	sc_log(ctx, "Recording APDUs to '%s' (%u records)", filename, trace->header->capacity);
+	return SC_SUCCESS;
+}
+
+void sc_apdu_trace_close(sc_context_t *ctx)
+{
+	struct sc_apdu_trace *trace = ctx->apdu_trace;
+
+	if (trace == NULL)
+		return;
+	ctx->apdu_trace = NULL;
+
+#ifdef HAVE_SYS_MMAN_H
+	munmap(trace->header, trace->size);
+#else
+	{
+		FILE *f = fopen(trace->filename, "wb");
+
+		if (f != NULL) {
+			fwrite(trace->header, 1, trace->size, f);
+			fclose(f);
+		}
+	}
+	free(trace->header);
+	free(trace->filename);
+#endif
+	free(trace);
+}
+
+void sc_apdu_trace_add(sc_reader_t *reader, const sc_apdu_t *apdu,
+		unsigned long long start, int rv)
+{
+	struct sc_apdu_trace *trace = reader->ctx->apdu_trace;
+	struct sc_apdu_trace_record *rec;
+	unsigned long long idx, now;
+
+	if (trace == NULL)
+		return;
+
+	now = sc_stats_now();
+	idx = TRACE_CLAIM(&trace->header->head);
+	rec = &trace->records[idx % trace->header->capacity];
+
+	rec->seq = 0;
+	TRACE_BARRIER();
+	rec->timestamp = start;
+	rec->duration_us = now > start ? (unsigned int)(now - start) : 0;
+	rec->pid = trace->pid;
+	rec->lc = (unsigned int)apdu->lc;
+	rec->le = (unsigned int)apdu->le;
+	rec->resplen = (unsigned int)apdu->resplen;
+	rec->rv = rv;
+	rec->cse = (unsigned char)apdu->cse;
+	rec->cla = apdu->cla;
+	rec->ins = apdu->ins;
+	rec->p1 = apdu->p1;
+	rec->p2 = apdu->p2;
+	rec->sw1 = (unsigned char)apdu->sw1;
+	rec->sw2 = (unsigned char)apdu->sw2;
+	rec->reserved = 0;
+	strncpy(rec->reader, reader->name ? reader->name : "", sizeof rec->reader - 1);
+	rec->reader[sizeof rec->reader - 1] = '\0';
+	TRACE_BARRIER();
+	rec->seq = idx + 1;
+}
@@ -358,6 +358,7 @@ static int
 sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 {
 	struct sc_context *ctx  = card->ctx;
+	unsigned long long start;
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
@@ -370,13 +371,20 @@ sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 	       apdu->data);
 #ifdef ENABLE_SM
 	if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT
-		   	&& (apdu->flags & SC_APDU_FLAGS_NO_SM) == 0) {
+		   	&& (apdu->flags & SC_APDU_FLAGS_NO_SM) == 0
+			&& (card->sm_ctx.sm_flags & SM_FLAGS_GET_RESPONSE) == 0) {
 		LOG_FUNC_RETURN(ctx, sc_sm_single_transmit(card, apdu));
 	}
 #endif
 
 	/* send APDU to the reader driver */
+	start = sc_stats_now();
+	if (ctx->apdu_latency)
+		msleep(ctx->apdu_latency);
 	rv = card->reader->ops->transmit(card->reader, apdu);
+	sc_stats_apdu(card->reader, start, rv);
+	if (ctx->apdu_trace)
+		sc_apdu_trace_add(card->reader, apdu, start, rv);
 	LOG_TEST_RET(ctx, rv, "unable to transmit APDU");
 
 	LOG_FUNC_RETURN(ctx, rv);
@@ -422,6 +430,9 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 	size_t le, minlen, buflen;
 	unsigned char *buf;
 	int rv;
+#ifdef ENABLE_SM
+	unsigned int sm_flags = card->sm_ctx.sm_flags;
+#endif
 
 	LOG_FUNC_CALLED(ctx);
 	if (apdu->le == 0) {
@@ -449,16 +460,34 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 	/* we try to read at least as much as bytes as promised in the response bytes */
 	minlen = le;
 
+#ifdef ENABLE_SM
+	/* The rest of a response protected by SM is part of that response: it
+	 * is fetched without wrapping the GET RESPONSE and unwrapped once
+	 * with the whole answer. */
+	if (apdu->flags & SC_APDU_FLAGS_NO_SM)
+		card->sm_ctx.sm_flags |= SM_FLAGS_GET_RESPONSE;
+#endif
+
 	do {
-		unsigned char resp[256];
+		unsigned char bounce[256];
+		unsigned char *resp;
 		size_t resp_len = le;
 
 		/* call GET RESPONSE to get more date from the card;
-		 * note: GET RESPONSE returns the left amount of data (== SW2) */
-		memset(resp, 0, sizeof(resp));
+		 * note: GET RESPONSE returns the left amount of data (== SW2).
+		 * The data goes straight to its place in apdu->resp unless the
+		 * card may send more than the caller asked for. */
+		if (buflen >= le) {
+			resp = buf;
+		} else {
+			resp = bounce;
+			memset(bounce, 0, sizeof(bounce));
+		}
 		rv = card->ops->get_response(card, &resp_len, resp);
 		if (rv < 0)   {
 #ifdef ENABLE_SM
+			if (!(sm_flags & SM_FLAGS_GET_RESPONSE))
+				card->sm_ctx.sm_flags &= ~SM_FLAGS_GET_RESPONSE;
 			if (resp_len)   {
 				sc_log_hex(ctx, "SM response data", resp, resp_len);
 				sc_sm_update_apdu_response(card, resp, resp_len, rv, apdu);
@@ -472,7 +501,8 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 		if (buflen < le)
 			le = buflen;
 
-		memcpy(buf, resp, le);
+		if (resp != buf)
+			memcpy(buf, resp, le);
 		buf    += le;
 		buflen -= le;
 
@@ -488,6 +518,10 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 			 * until we have read enough bytes */
 			le = minlen;
 	} while (rv != 0 && minlen != 0);
+#ifdef ENABLE_SM
+	if (!(sm_flags & SM_FLAGS_GET_RESPONSE))
+		card->sm_ctx.sm_flags &= ~SM_FLAGS_GET_RESPONSE;
+#endif
 
 	/* we've read all data, let's return 0x9000 */
 	apdu->resplen = buf - apdu->resp;
@@ -498,6 +532,76 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 }
 
 
+static struct sc_le_memo *
+sc_le_memo_find(struct sc_card *card, const struct sc_apdu *apdu)
+{
+	unsigned int i;
+
+	for (i = 0; i < card->le_memo_count; i++) {
+		struct sc_le_memo *memo = &card->le_memo[i];
+
+		if (memo->cla == apdu->cla && memo->ins == apdu->ins
+				&& memo->p1 == apdu->p1 && memo->p2 == apdu->p2)
+			return memo;
+	}
+	return NULL;
+}
+
+
+/* Remember the size of the response to a command the card did not
+ * answer at once, the next command with the same header asks for it */
+static void
+sc_le_memo_learn(struct sc_card *card, const struct sc_apdu *apdu, size_t le)
+{
+	struct sc_le_memo *memo = sc_le_memo_find(card, apdu);
+
+	if (memo == NULL) {
+		if (card->le_memo_count < SC_CARD_LE_MEMO_SIZE) {
+			memo = &card->le_memo[card->le_memo_count++];
+		} else {
+			memo = &card->le_memo[card->le_memo_next];
+			card->le_memo_next = (card->le_memo_next + 1) % SC_CARD_LE_MEMO_SIZE;
+		}
+		memo->cla = apdu->cla;
+		memo->ins = apdu->ins;
+		memo->p1  = apdu->p1;
+		memo->p2  = apdu->p2;
+	}
+	memo->le = le;
+	sc_log(card->ctx, "Le %"SC_FORMAT_LEN_SIZE_T"u learnt for %02X %02X %02X %02X",
+			le, apdu->cla, apdu->ins, apdu->p1, apdu->p2);
+}
+
+
+/* Use the response size learnt for the command, if it fits in the buffer
+ * and in the APDU. Commands protected by SM keep their Le, the card sees
+ * a different one. */
+static void
+sc_le_memo_apply(struct sc_card *card, struct sc_apdu *apdu)
+{
+	struct sc_le_memo *memo;
+	int cse = apdu->cse & SC_APDU_SHORT_MASK;
+
+	if (card->le_memo_count == 0 || apdu->le == 0
+			|| (cse != SC_APDU_CASE_2_SHORT && cse != SC_APDU_CASE_4_SHORT)
+			|| (apdu->flags & SC_APDU_FLAGS_NO_RETRY_WL))
+		return;
+#ifdef ENABLE_SM
+	if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT
+			&& (apdu->flags & SC_APDU_FLAGS_NO_SM) == 0)
+		return;
+#endif
+
+	memo = sc_le_memo_find(card, apdu);
+	if (memo == NULL || memo->le == apdu->le || memo->le > apdu->resplen
+			|| memo->le > sc_get_max_recv_size(card)
+			|| (!(apdu->cse & SC_APDU_EXT) && memo->le > SC_MAX_APDU_RESP_SIZE))
+		return;
+
+	apdu->le = memo->le;
+}
+
+
 /** Sends a single APDU to the card reader and calls GET RESPONSE to get the return data if necessary.
  *  @param  card  sc_card_t object for the smartcard
  *  @param  apdu  APDU to be sent
@@ -508,10 +612,14 @@ sc_transmit(sc_card_t *card, sc_apdu_t *apdu)
 {
 	struct sc_context *ctx  = card->ctx;
 	size_t       olen  = apdu->resplen;
+	size_t       le;
 	int          r;
 
 	LOG_FUNC_CALLED(ctx);
 
+	sc_le_memo_apply(card, apdu);
+	le = apdu->le;
+
 	r = sc_single_transmit(card, apdu);
 	LOG_TEST_RET(ctx, r, "transmit APDU failed");
 
@@ -519,44 +627,52 @@ sc_transmit(sc_card_t *card, sc_apdu_t *apdu)
 	 * 1. the card returned 0x6Cxx: in this case APDU will be re-transmitted with Le set to SW2
 	 * (possible only if response buffer size is larger than new Le = SW2)
 	 */
-	if (apdu->sw1 == 0x6C && (apdu->flags & SC_APDU_FLAGS_NO_RETRY_WL) == 0)
+	if (apdu->sw1 == 0x6C && (apdu->flags & SC_APDU_FLAGS_NO_RETRY_WL) == 0) {
 		r = sc_set_le_and_transmit(card, apdu, olen);
+		if (r == SC_SUCCESS && apdu->sw1 == 0x90 && apdu->sw2 == 0x00)
+			sc_le_memo_learn(card, apdu, apdu->le);
+	}
 	LOG_TEST_RET(ctx, r, "cannot re-transmit APDU ");
 
 	/* 2. the card returned 0x61xx: more data can be read from the card
 	 *    using the GET RESPONSE command (mostly used in the T0 protocol).
 	 *    Unless the SC_APDU_FLAGS_NO_GET_RESP is set we try to read as
 	 *    much data as possible using GET RESPONSE.
+	 *    With T=0 a case 4 command has no Le, there is nothing to learn.
 	 */
-	if (apdu->sw1 == 0x61 && (apdu->flags & SC_APDU_FLAGS_NO_GET_RESP) == 0)
+	if (apdu->sw1 == 0x61 && (apdu->flags & SC_APDU_FLAGS_NO_GET_RESP) == 0) {
 		r = sc_get_response(card, apdu, olen);
+		if (r == SC_SUCCESS && le != 0 && apdu->resplen > le
+				&& card->reader->active_protocol != SC_PROTO_T0)
+			sc_le_memo_learn(card, apdu, apdu->resplen);
+	}
 	LOG_TEST_RET(ctx, r, "cannot get all data with 'GET RESPONSE'");
 
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
 
-int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
+/* Transmit a checked APDU, splitting it with command chaining if
+ * requested. The card must be locked. */
+static int sc_transmit_apdu_locked(sc_card_t *card, sc_apdu_t *apdu)
 {
 	int r = SC_SUCCESS;
 
-	if (card == NULL || apdu == NULL)
-		return SC_ERROR_INVALID_ARGUMENTS;
-
-	LOG_FUNC_CALLED(card->ctx);
-
-	/* determine the APDU type if necessary, i.e. to use
-	 * short or extended APDUs  */
-	sc_detect_apdu_cse(card, apdu);
-	/* basic APDU consistency check */
-	r = sc_check_apdu(card, apdu);
-	if (r != SC_SUCCESS)
-		return SC_ERROR_INVALID_ARGUMENTS;
-
-	r = sc_lock(card);	/* acquire card lock*/
-	if (r != SC_SUCCESS) {
-		sc_log(card->ctx, "unable to acquire lock");
-		return r;
+	/* SELECT not sent by sc_select_file(), CREATE FILE and DELETE FILE
+	 * change the current file behind the back of the select cache */
+	if (card->cache.select_valid && (apdu->ins == 0xE0 || apdu->ins == 0xE4
+				|| (apdu->ins == 0xA4 && !card->cache.select_running)))
+		sc_select_cache_drop(card);
+	/* a short EF identifier in P1 selects that EF, only a selected DF
+	 * stays current */
+	if ((apdu->ins == 0xB0 || apdu->ins == 0xD0 || apdu->ins == 0xD6) && (apdu->p1 & 0x80)
+			&& !(card->cache.select_valid && card->cache.select_file
+				&& card->cache.select_file->type == SC_FILE_TYPE_DF)) {
+		sc_select_cache_drop(card);
+		free(card->cache.read_ahead);
+		card->cache.read_ahead = NULL;
+		card->cache.read_ahead_len = 0;
+		card->cache.read_ahead_size = 0;
 	}
 
 	if ((apdu->flags & SC_APDU_FLAGS_CHAINING) != 0) {
@@ -624,20 +740,156 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 		r = sc_transmit(card, apdu);
 	}
 
+	if (card->aid_probe)
+		sc_aid_probe_note(card, apdu, r);
+
+	return r;
+}
+
+static void sc_transmit_check_reset(sc_card_t *card, int r)
+{
 	if (r == SC_ERROR_CARD_RESET || r == SC_ERROR_READER_REATTACHED) {
 		sc_invalidate_cache(card);
+		card->cache.foreign_access = 1;
+		card->pin_events++;
+		sc_sm_session_lost(card);
 		/* give card driver a chance to react on resets */
 		if (card->ops->card_reader_lock_obtained)
 			card->ops->card_reader_lock_obtained(card, 1);
 	}
+}
+
+int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
+{
+	int r = SC_SUCCESS;
+
+	if (card == NULL || apdu == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	LOG_FUNC_CALLED(card->ctx);
+	SC_PROBE5(apdu_start, card, apdu->cla, apdu->ins, apdu->p1, apdu->p2);
+
+	/* determine the APDU type if necessary, i.e. to use
+	 * short or extended APDUs  */
+	sc_detect_apdu_cse(card, apdu);
+	/* basic APDU consistency check */
+	r = sc_check_apdu(card, apdu);
+	if (r != SC_SUCCESS) {
+		SC_PROBE4(apdu_done, card, SC_ERROR_INVALID_ARGUMENTS, 0, 0);
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
+
+	r = sc_lock(card);	/* acquire card lock*/
+	if (r != SC_SUCCESS) {
+		sc_log(card->ctx, "unable to acquire lock");
+		SC_PROBE4(apdu_done, card, r, 0, 0);
+		return r;
+	}
+
+	r = sc_transmit_apdu_locked(card, apdu);
+	sc_transmit_check_reset(card, r);
 
 	/* all done => release lock */
+	if (sc_unlock(card) != SC_SUCCESS)
+		sc_log(card->ctx, "sc_unlock failed");
+
+	SC_PROBE4(apdu_done, card, r, apdu->sw1, apdu->sw2);
+	return r;
+}
+
+int sc_transmit_apdus(sc_card_t *card, sc_apdu_t *apdus, size_t count)
+{
+	size_t i;
+	int r = SC_SUCCESS;
+
+	if (card == NULL || (apdus == NULL && count != 0))
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	LOG_FUNC_CALLED(card->ctx);
+	sc_log(card->ctx, "%"SC_FORMAT_LEN_SIZE_T"u APDUs", count);
+
+	/* check the complete batch before anything is sent */
+	for (i = 0; i < count; i++) {
+		sc_detect_apdu_cse(card, &apdus[i]);
+		if (sc_check_apdu(card, &apdus[i]) != SC_SUCCESS) {
+			sc_log(card->ctx, "APDU %"SC_FORMAT_LEN_SIZE_T"u is inconsistent", i);
+			return SC_ERROR_INVALID_ARGUMENTS;
+		}
+	}
+
+	r = sc_lock(card);
+	if (r != SC_SUCCESS) {
+		sc_log(card->ctx, "unable to acquire lock");
+		return r;
+	}
+
+	for (i = 0; i < count && r == SC_SUCCESS; i++)
+		r = sc_transmit_apdu_locked(card, &apdus[i]);
+	sc_transmit_check_reset(card, r);
+
 	if (sc_unlock(card) != SC_SUCCESS)
 		sc_log(card->ctx, "sc_unlock failed");
 
 	return r;
 }
 
+int sc_transmit_remote_data(sc_card_t *card, struct sc_remote_data *rdata,
+		struct sc_remote_apdu **last)
+{
+	struct sc_remote_apdu *rapdu, *done = NULL;
+	int r = SC_SUCCESS;
+
+	if (last)
+		*last = NULL;
+	if (card == NULL || rdata == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	LOG_FUNC_CALLED(card->ctx);
+	sc_log(card->ctx, "%i remote APDUs", rdata->length);
+
+	/* check the complete chain before anything is sent; an element without
+	 * instruction byte terminates the chain */
+	for (rapdu = rdata->data; rapdu && rapdu->apdu.ins; rapdu = rapdu->next) {
+		sc_detect_apdu_cse(card, &rapdu->apdu);
+		if (sc_check_apdu(card, &rapdu->apdu) != SC_SUCCESS) {
+			sc_log(card->ctx, "remote APDU 0x%02X is inconsistent", rapdu->apdu.ins);
+			return SC_ERROR_INVALID_ARGUMENTS;
+		}
+	}
+
+	r = sc_lock(card);
+	if (r != SC_SUCCESS) {
+		sc_log(card->ctx, "unable to acquire lock");
+		return r;
+	}
+
+	/* send back-to-back; only a status word other than 9000 of an element
+	 * that is not flagged as SC_REMOTE_APDU_FLAG_NOT_FATAL stops the chain */
+	for (rapdu = rdata->data; rapdu && rapdu->apdu.ins; rapdu = rapdu->next) {
+		done = rapdu;
+		r = sc_transmit_apdu_locked(card, &rapdu->apdu);
+		if (r != SC_SUCCESS)
+			break;
+		if (rapdu->apdu.sw1 == 0x90 && rapdu->apdu.sw2 == 0x00)
+			continue;
+		if (!(rapdu->flags & SC_REMOTE_APDU_FLAG_NOT_FATAL)
+				&& sc_check_sw(card, rapdu->apdu.sw1, rapdu->apdu.sw2) < 0)
+			break;
+	}
+	sc_transmit_check_reset(card, r);
+
+	if (sc_unlock(card) != SC_SUCCESS)
+		sc_log(card->ctx, "sc_unlock failed");
+
+	if (last)
+		*last = done;
+	/* the status of the last element sent determines the result */
+	if (r == SC_SUCCESS && done)
+		r = sc_check_sw(card, done->apdu.sw1, done->apdu.sw2);
+
+	LOG_FUNC_RETURN(card->ctx, r);
+}
+
 
 int
 sc_bytes2apdu(sc_context_t *ctx, const u8 *buf, size_t len, sc_apdu_t *apdu)
@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_ASN1
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -38,6 +40,9 @@ static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 		       int choice, int depth);
 static int asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
 		       u8 **ptr, size_t *size, int depth);
+struct asn1_pieces;
+static int asn1_encode_list(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		       struct asn1_pieces *pcs, int depth);
 static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
 		const u8 * data, size_t datalen, u8 ** out, size_t * outlen);
 
@@ -1039,11 +1044,15 @@ int sc_asn1_write_element(sc_context_t *ctx, unsigned int tag,
 	return asn1_write_element(ctx, tag, data, datalen, out, outlen);
 }
 
-static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
-	const u8 * data, size_t datalen, u8 ** out, size_t * outlen)
+/* Writes the tag and length octets of an element with datalen bytes of
+ * contents to hdr, which has room for ASN1_HEADER_MAX bytes */
+#define ASN1_HEADER_MAX	(3 + 1 + sizeof(size_t))
+
+static int asn1_encode_header(sc_context_t *ctx, unsigned int tag,
+	size_t datalen, u8 *hdr, size_t *hdrlen)
 {
 	unsigned char t;
-	unsigned char *buf, *p;
+	unsigned char *p;
 	int c = 0;
 	unsigned short_tag;
 	unsigned char tag_char[3] = {0, 0, 0};
@@ -1086,16 +1095,11 @@ static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
 		t |= SC_ASN1_TAG_CONSTRUCTED;
 	if (datalen > 127) {
 		c = 1;
-		while (datalen >> (c << 3))
+		while (c < (int)sizeof(size_t) && datalen >> (c << 3))
 			c++;
 	}
 
-	*outlen = tag_len + 1 + c + datalen;
-	buf = malloc(*outlen);
-	if (buf == NULL)
-		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_ERROR_OUT_OF_MEMORY);
-
-	*out = p = buf;
+	p = hdr;
 	*p++ = t;
 	for (ii=1;ii<tag_len;ii++)
 		*p++ = tag_char[tag_len - ii - 1];
@@ -1108,13 +1112,107 @@ static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
 	else   {
 		*p++ = datalen & 0x7F;
 	}
+	*hdrlen = p - hdr;
+
+	return SC_SUCCESS;
+}
+
+static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
+	const u8 * data, size_t datalen, u8 ** out, size_t * outlen)
+{
+	u8 hdr[ASN1_HEADER_MAX];
+	size_t hdrlen;
+	int r;
+
+	r = asn1_encode_header(ctx, tag, datalen, hdr, &hdrlen);
+	if (r)
+		return r;
+
+	*outlen = hdrlen + datalen;
+	*out = malloc(*outlen);
+	if (*out == NULL)
+		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_ERROR_OUT_OF_MEMORY);
+
+	memcpy(*out, hdr, hdrlen);
 	if (datalen && data) {
-		memcpy(p, data, datalen);
+		memcpy(*out + hdrlen, data, datalen);
 	}
 
 	return SC_SUCCESS;
 }
 
+/*
+ * The encoder works in two passes. The first one encodes the primitive
+ * values and collects them, together with the tag and length octets of
+ * every element, in a list of pieces; the length of a constructed element
+ * is known once its contents have been collected. The second pass copies
+ * the pieces into a single buffer, so nested structures are not copied
+ * again for each level of nesting.
+ */
+struct asn1_piece {
+	u8 *buf;	/* contents, owned; NULL for tag and length octets */
+	size_t len;
+	u8 hdr[ASN1_HEADER_MAX];
+};
+
+struct asn1_pieces {
+	sc_context_t *ctx;
+	struct asn1_piece *p;
+	size_t count, alloc;
+	size_t total;
+};
+
+static int asn1_pieces_add(struct asn1_pieces *pcs, u8 *buf, size_t len)
+{
+	struct asn1_piece *piece;
+
+	if (pcs->count == pcs->alloc) {
+		size_t alloc = pcs->alloc ? 2 * pcs->alloc : 32;
+
+		piece = sc_mem_realloc(pcs->ctx, SC_MEM_ASN1, pcs->p, alloc * sizeof(*piece));
+		if (piece == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		pcs->p = piece;
+		pcs->alloc = alloc;
+	}
+	piece = &pcs->p[pcs->count++];
+	piece->buf = buf;
+	piece->len = len;
+	pcs->total += len;
+	return SC_SUCCESS;
+}
+
+static void asn1_pieces_truncate(struct asn1_pieces *pcs, size_t count)
+{
+	while (pcs->count > count) {
+		struct asn1_piece *piece = &pcs->p[--pcs->count];
+
+		pcs->total -= piece->len;
+		free(piece->buf);
+	}
+}
+
+static int asn1_pieces_flatten(struct asn1_pieces *pcs, u8 **ptr, size_t *size)
+{
+	u8 *buf = NULL, *p;
+	size_t ii;
+
+	if (pcs->total) {
+		buf = malloc(pcs->total);
+		if (buf == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		for (p = buf, ii = 0; ii < pcs->count; ii++) {
+			struct asn1_piece *piece = &pcs->p[ii];
+
+			memcpy(p, piece->buf ? piece->buf : piece->hdr, piece->len);
+			p += piece->len;
+		}
+	}
+	*ptr = buf;
+	*size = pcs->total;
+	return SC_SUCCESS;
+}
+
 static const struct sc_asn1_entry c_asn1_path_ext[3] = {
 	{ "aid",  SC_ASN1_OCTET_STRING, SC_ASN1_APP | 0x0F, 0, NULL, NULL },
 	{ "path", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_OCTET_STRING, 0, NULL, NULL },
@@ -1196,7 +1294,7 @@ static int asn1_decode_path(sc_context_t *ctx, const u8 *in, size_t len,
 }
 
 static int asn1_encode_path(sc_context_t *ctx, const sc_path_t *path,
-			    u8 **buf, size_t *bufsize, int depth, unsigned int parent_flags)
+			    struct asn1_pieces *pcs, int depth, unsigned int parent_flags)
 {
 	int r;
  	struct sc_asn1_entry asn1_path[5];
@@ -1210,7 +1308,7 @@ static int asn1_encode_path(sc_context_t *ctx, const sc_path_t *path,
 		sc_format_asn1_entry(asn1_path + 1, (void *) &tpath.index, NULL, 1);
 		sc_format_asn1_entry(asn1_path + 2, (void *) &tpath.count, NULL, 1);
 	}
-	r = asn1_encode(ctx, asn1_path, buf, bufsize, depth + 1);
+	r = asn1_encode_list(ctx, asn1_path, pcs, depth + 1);
 	return r;
 }
 
@@ -1416,7 +1514,7 @@ static int asn1_decode_p15_object(sc_context_t *ctx, const u8 *in,
 }
 
 static int asn1_encode_p15_object(sc_context_t *ctx, const struct sc_asn1_pkcs15_object *obj,
-				  u8 **buf, size_t *bufsize, int depth)
+				  struct asn1_pieces *pcs, int depth)
 {
 	struct sc_pkcs15_object p15_obj = *obj->p15_obj;
 	struct sc_asn1_entry    asn1_c_attr[6], asn1_p15_obj[5];
@@ -1467,7 +1565,7 @@ static int asn1_encode_p15_object(sc_context_t *ctx, const struct sc_asn1_pkcs15
 		sc_format_asn1_entry(asn1_p15_obj + 2, obj->asn1_subclass_attr, NULL, 1);
 	sc_format_asn1_entry(asn1_p15_obj + 3, obj->asn1_type_attr, NULL, 1);
 
-	r = asn1_encode(ctx, asn1_p15_obj, buf, bufsize, depth + 1);
+	r = asn1_encode_list(ctx, asn1_p15_obj, pcs, depth + 1);
 	return r;
 }
 
@@ -1558,6 +1656,14 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 				obj++;
 			}
 
+			/* Reference the source buffer if requested */
+			if ((entry->flags & (SC_ASN1_ALLOC | SC_ASN1_REF)) == (SC_ASN1_ALLOC | SC_ASN1_REF)) {
+				u8 **buf = (u8 **) parm;
+				*buf = objlen > 0 ? (u8 *) obj : NULL;
+				*len = objlen;
+				break;
+			}
+
 			/* Allocate buffer if needed */
 			if (entry->flags & SC_ASN1_ALLOC) {
 				u8 **buf = (u8 **) parm;
@@ -1765,7 +1871,7 @@ int sc_asn1_decode_choice(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 }
 
 static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entry,
-			     u8 **obj, size_t *objlen, int depth)
+			     struct asn1_pieces *pcs, int depth)
 {
 	void *parm = entry->parm;
 	int (*callback_func)(sc_context_t *nctx, void *arg, u8 **nobj,
@@ -1774,9 +1880,15 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 	int r = 0;
 	u8 * buf = NULL;
 	size_t buflen = 0;
+	size_t mark = pcs->count, start = pcs->total;
 
 	callback_func = parm;
 
+	/* the tag and length octets, filled in once the contents are known */
+	r = asn1_pieces_add(pcs, NULL, 0);
+	if (r)
+		return r;
+
 	sc_debug(ctx, SC_LOG_DEBUG_ASN1, "%*.*sencoding '%s'%s\n",
 	       	depth, depth, "", entry->name,
 		(entry->flags & SC_ASN1_PRESENT)? "" : " (not present)");
@@ -1801,7 +1913,8 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 						entry->name,
 						choice->name,
 						list->name);
-					return SC_ERROR_INVALID_ASN1_OBJECT;
+					r = SC_ERROR_INVALID_ASN1_OBJECT;
+					goto err;
 				}
 				choice = list;
 			}
@@ -1809,18 +1922,19 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 		}
 		if (choice == NULL)
 			goto no_object;
-		return asn1_encode_entry(ctx, choice, obj, objlen, depth + 1);
+		asn1_pieces_truncate(pcs, mark);
+		return asn1_encode_entry(ctx, choice, pcs, depth + 1);
 	}
 
 	if (entry->type != SC_ASN1_NULL && parm == NULL) {
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "unexpected parm == NULL\n");
-		return SC_ERROR_INVALID_ASN1_OBJECT;
+		r = SC_ERROR_INVALID_ASN1_OBJECT;
+		goto err;
 	}
 
 	switch (entry->type) {
 	case SC_ASN1_STRUCT:
-		r = asn1_encode(ctx, (const struct sc_asn1_entry *) parm, &buf,
-				&buflen, depth + 1);
+		r = asn1_encode_list(ctx, (const struct sc_asn1_entry *) parm, pcs, depth + 1);
 		break;
 	case SC_ASN1_NULL:
 		buf = NULL;
@@ -1896,7 +2010,7 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 		r = sc_asn1_encode_object_id(&buf, &buflen, (struct sc_object_id *) parm);
 		break;
 	case SC_ASN1_PATH:
-		r = asn1_encode_path(ctx, (const sc_path_t *) parm, &buf, &buflen, depth, entry->flags);
+		r = asn1_encode_path(ctx, (const sc_path_t *) parm, pcs, depth, entry->flags);
 		break;
 	case SC_ASN1_PKCS15_ID:
 		{
@@ -1912,14 +2026,16 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 		}
 		break;
 	case SC_ASN1_PKCS15_OBJECT:
-		r = asn1_encode_p15_object(ctx, (const struct sc_asn1_pkcs15_object *) parm, &buf, &buflen, depth);
+		r = asn1_encode_p15_object(ctx, (const struct sc_asn1_pkcs15_object *) parm, pcs, depth);
 		break;
 	case SC_ASN1_ALGORITHM_ID:
 		r = sc_asn1_encode_algorithm_id(ctx, &buf, &buflen, (const struct sc_algorithm_id *) parm, depth);
 		break;
 	case SC_ASN1_SE_INFO:
-		if (!len)
-			return SC_ERROR_INVALID_ASN1_OBJECT;
+		if (!len) {
+			r = SC_ERROR_INVALID_ASN1_OBJECT;
+			break;
+		}
 		r = asn1_encode_se_info(ctx, (struct sc_pkcs15_sec_env_info **)parm, *len, &buf, &buflen, depth);
 		break;
 	case SC_ASN1_CALLBACK:
@@ -1927,15 +2043,26 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 		break;
 	default:
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "invalid ASN.1 type: %d\n", entry->type);
-		return SC_ERROR_INVALID_ASN1_OBJECT;
+		r = SC_ERROR_INVALID_ASN1_OBJECT;
+		goto err;
 	}
 	if (r) {
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "encoding of ASN.1 object '%s' failed: %s\n", entry->name,
 		      sc_strerror(r));
-		if (buf)
+		free(buf);
+		goto err;
+	}
+	if (buflen) {
+		r = asn1_pieces_add(pcs, buf, buflen);
+		if (r) {
 			free(buf);
-		return r;
+			goto err;
+		}
+	}
+	else {
+		free(buf);
 	}
+	buf = NULL;
 
 	/* Treatment of OPTIONAL elements:
 	 *  -	if the encoding has 0 length, and the element is OPTIONAL,
@@ -1948,78 +2075,71 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 	 *  -	any other empty objects are considered bogus
 	 */
 no_object:
+	buflen = pcs->total - start;
 	if (!buflen && entry->flags & SC_ASN1_OPTIONAL && !(entry->flags & SC_ASN1_PRESENT)) {
 		/* This happens when we try to encode e.g. the
 		 * subClassAttributes, which may be empty */
-		*obj = NULL;
-		*objlen = 0;
+		asn1_pieces_truncate(pcs, mark);
 		r = 0;
-	} else if (!buflen && (entry->flags & SC_ASN1_EMPTY_ALLOWED)) {
-		*obj = NULL;
-		*objlen = 0;
-		r = asn1_write_element(ctx, entry->tag, buf, buflen, obj, objlen);
-		if (r)
-			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "error writing ASN.1 tag and length: %s\n", sc_strerror(r));
-	} else if (buflen || entry->type == SC_ASN1_NULL || entry->tag & SC_ASN1_CONS) {
-		r = asn1_write_element(ctx, entry->tag, buf, buflen, obj, objlen);
-		if (r)
+	} else if ((!buflen && (entry->flags & SC_ASN1_EMPTY_ALLOWED))
+			|| buflen || entry->type == SC_ASN1_NULL || entry->tag & SC_ASN1_CONS) {
+		struct asn1_piece *hdr = &pcs->p[mark];
+
+		r = asn1_encode_header(ctx, entry->tag, buflen, hdr->hdr, &hdr->len);
+		if (r) {
 			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "error writing ASN.1 tag and length: %s\n",
 					sc_strerror(r));
+			goto err;
+		}
+		pcs->total += hdr->len;
 	} else if (!(entry->flags & SC_ASN1_PRESENT)) {
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "cannot encode non-optional ASN.1 object: not given by caller\n");
 		r = SC_ERROR_INVALID_ASN1_OBJECT;
+		goto err;
 	} else {
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "cannot encode empty non-optional ASN.1 object\n");
 		r = SC_ERROR_INVALID_ASN1_OBJECT;
+		goto err;
 	}
-	if (buf)
-		free(buf);
-	if (r >= 0)
-		sc_debug(ctx, SC_LOG_DEBUG_ASN1,
-			 "%*.*slength of encoded item=%"SC_FORMAT_LEN_SIZE_T"u\n",
-			 depth, depth, "", *objlen);
+	sc_debug(ctx, SC_LOG_DEBUG_ASN1,
+		 "%*.*slength of encoded item=%"SC_FORMAT_LEN_SIZE_T"u\n",
+		 depth, depth, "", pcs->total - start);
+	return r;
+
+err:
+	asn1_pieces_truncate(pcs, mark);
 	return r;
 }
 
-static int asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
-		      u8 **ptr, size_t *size, int depth)
+static int asn1_encode_list(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		      struct asn1_pieces *pcs, int depth)
 {
-	int r, idx = 0;
-	u8 *obj = NULL, *buf = NULL, *tmp;
-	size_t total = 0, objsize;
+	int r, idx;
 
 	for (idx = 0; asn1[idx].name != NULL; idx++) {
-		r = asn1_encode_entry(ctx, &asn1[idx], &obj, &objsize, depth);
-		if (r) {
-			if (obj)
-				free(obj);
-			if (buf)
-				free(buf);
+		r = asn1_encode_entry(ctx, &asn1[idx], pcs, depth);
+		if (r)
 			return r;
-		}
-		/* in case of an empty (optional) element continue with
-		 * the next asn1 element */
-		if (!objsize)
-			continue;
-		tmp = (u8 *) realloc(buf, total + objsize);
-		if (!tmp) {
-			if (obj)
-				free(obj);
-			if (buf)
-				free(buf);
-			return SC_ERROR_OUT_OF_MEMORY;
-		}
-		buf = tmp;
-		memcpy(buf + total, obj, objsize);
-		free(obj);
-		obj = NULL;
-		total += objsize;
 	}
-	*ptr = buf;
-	*size = total;
 	return 0;
 }
 
+static int asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		      u8 **ptr, size_t *size, int depth)
+{
+	struct asn1_pieces pcs;
+	int r;
+
+	memset(&pcs, 0, sizeof(pcs));
+	pcs.ctx = ctx;
+	r = asn1_encode_list(ctx, asn1, &pcs, depth);
+	if (r == 0)
+		r = asn1_pieces_flatten(&pcs, ptr, size);
+	asn1_pieces_truncate(&pcs, 0);
+	sc_mem_free(pcs.p);
+	return r;
+}
+
 int sc_asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
 		   u8 **ptr, size_t *size)
 {
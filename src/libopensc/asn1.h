@@ -142,6 +142,9 @@ int sc_asn1_sig_value_sequence_to_rs(struct sc_context *ctx,
 #define SC_ASN1_ALLOC			0x00000004
 #define SC_ASN1_UNSIGNED		0x00000008
 #define SC_ASN1_EMPTY_ALLOWED           0x00000010
+/* With SC_ASN1_ALLOC: return a pointer into the decoded buffer instead of
+ * a copy (OCTET STRING only). The caller keeps the buffer alive. */
+#define SC_ASN1_REF			0x00000020
 
 #define SC_ASN1_BOOLEAN                 1
 #define SC_ASN1_INTEGER                 2
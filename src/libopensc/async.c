@@ -0,0 +1,422 @@
+/*
+ * async.c: Asynchronous card operations
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "internal.h"
+
+/*
+ * A reader with asynchronous requests gets an I/O thread, which runs them
+ * one after the other through the blocking API. An event loop can thus
+ * drive many readers with one thread per reader instead of one thread per
+ * operation in flight. A request completes by calling its callback on the
+ * I/O thread; the handle returned to the caller can be polled or waited
+ * for as well.
+ *
+ * Without pthreads the requests run synchronously when they are submitted.
+ */
+#ifdef HAVE_PTHREAD
+#define SC_ASYNC_THREAD
+#endif
+
+enum {
+	SC_ASYNC_TRANSMIT,
+	SC_ASYNC_COMPUTE_SIGNATURE,
+	SC_ASYNC_DECIPHER,
+	SC_ASYNC_READ_BINARY,
+	SC_ASYNC_CALL
+};
+
+struct sc_async_op {
+	int type;
+	sc_card_t *card;
+	sc_apdu_t *apdu;
+	const u8 *in;
+	size_t inlen;
+	u8 *out;
+	size_t outlen;
+	unsigned int idx;
+	unsigned long flags;
+	int (*fn)(void *);
+	void *fn_arg;
+
+	sc_async_callback_t callback;
+	void *arg;
+
+	int result;
+	int done;
+	int refs;	/* the queue and the handle of the caller */
+	struct sc_async_worker *worker;
+	struct sc_async_op *next;
+};
+
+#ifdef SC_ASYNC_THREAD
+struct sc_async_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* new requests or stop */
+	pthread_cond_t done;	/* completed requests */
+	struct sc_async_op *head, *tail;
+	struct sc_async_op *current;
+	int stop;
+};
+#endif
+
+static void async_run(struct sc_async_op *op)
+{
+	switch (op->type) {
+	case SC_ASYNC_TRANSMIT:
+		op->result = sc_transmit_apdu(op->card, op->apdu);
+		break;
+	case SC_ASYNC_COMPUTE_SIGNATURE:
+		op->result = sc_compute_signature(op->card, op->in, op->inlen,
+				op->out, op->outlen);
+		break;
+	case SC_ASYNC_DECIPHER:
+		op->result = sc_decipher(op->card, op->in, op->inlen,
+				op->out, op->outlen);
+		break;
+	case SC_ASYNC_READ_BINARY:
+		op->result = sc_read_binary(op->card, op->idx, op->out,
+				op->outlen, op->flags);
+		break;
+	case SC_ASYNC_CALL:
+		op->result = op->fn(op->fn_arg);
+		break;
+	default:
+		op->result = SC_ERROR_INTERNAL;
+		break;
+	}
+}
+
+#ifdef SC_ASYNC_THREAD
+static void *async_worker_main(void *arg)
+{
+	struct sc_async_worker *w = arg;
+	struct sc_async_op *op;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (w->head == NULL && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+		/* the queue is run down before stopping */
+		if (w->head == NULL)
+			break;
+		op = w->head;
+		w->head = op->next;
+		if (w->head == NULL)
+			w->tail = NULL;
+		w->current = op;
+		pthread_mutex_unlock(&w->lock);
+
+		async_run(op);
+		if (op->callback)
+			op->callback(op->arg, op->result);
+
+		pthread_mutex_lock(&w->lock);
+		op->done = 1;
+		w->current = NULL;
+		pthread_cond_broadcast(&w->done);
+		if (--op->refs == 0)
+			free(op);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+static struct sc_async_worker *async_worker(sc_reader_t *reader)
+{
+	sc_context_t *ctx = reader->ctx;
+	struct sc_async_worker *w;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	w = reader->async;
+	if (w == NULL) {
+		w = calloc(1, sizeof *w);
+		if (w != NULL) {
+			pthread_mutex_init(&w->lock, NULL);
+			pthread_cond_init(&w->cond, NULL);
+			pthread_cond_init(&w->done, NULL);
+			if (pthread_create(&w->thread, NULL, async_worker_main, w) != 0) {
+				pthread_cond_destroy(&w->done);
+				pthread_cond_destroy(&w->cond);
+				pthread_mutex_destroy(&w->lock);
+				free(w);
+				w = NULL;
+			} else {
+				reader->async = w;
+			}
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+	return w;
+}
+
+static int async_pending(struct sc_async_worker *w, sc_card_t *card)
+{
+	struct sc_async_op *op;
+
+	if (w->current && w->current->card == card)
+		return 1;
+	for (op = w->head; op != NULL; op = op->next)
+		if (op->card == card)
+			return 1;
+	return 0;
+}
+#endif
+
+static int async_submit(struct sc_async_op *op, sc_async_op_t **handle)
+{
+#ifdef SC_ASYNC_THREAD
+	struct sc_async_worker *w;
+
+	w = async_worker(op->card->reader);
+	if (w == NULL) {
+		free(op);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+
+	op->worker = w;
+	op->refs = handle ? 2 : 1;
+	pthread_mutex_lock(&w->lock);
+	if (w->tail)
+		w->tail->next = op;
+	else
+		w->head = op;
+	w->tail = op;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+#else
+	async_run(op);
+	op->done = 1;
+	if (op->callback)
+		op->callback(op->arg, op->result);
+	if (handle == NULL)
+		free(op);
+#endif
+
+	if (handle)
+		*handle = op;
+	return SC_SUCCESS;
+}
+
+static struct sc_async_op *async_new(sc_card_t *card, int type,
+		sc_async_callback_t callback, void *arg)
+{
+	struct sc_async_op *op;
+
+	if (card == NULL || card->reader == NULL)
+		return NULL;
+	op = calloc(1, sizeof *op);
+	if (op == NULL)
+		return NULL;
+	op->type = type;
+	op->card = card;
+	op->callback = callback;
+	op->arg = arg;
+	return op;
+}
+
+int sc_async_transmit(sc_card_t *card, sc_apdu_t *apdu,
+		sc_async_callback_t callback, void *arg, sc_async_op_t **handle)
+{
+	struct sc_async_op *op;
+
+	if (card == NULL || apdu == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	op = async_new(card, SC_ASYNC_TRANSMIT, callback, arg);
+	if (op == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	op->apdu = apdu;
+	return async_submit(op, handle);
+}
+
+int sc_async_compute_signature(sc_card_t *card, const u8 *data, size_t datalen,
+		u8 *out, size_t outlen,
+		sc_async_callback_t callback, void *arg, sc_async_op_t **handle)
+{
+	struct sc_async_op *op;
+
+	if (card == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	op = async_new(card, SC_ASYNC_COMPUTE_SIGNATURE, callback, arg);
+	if (op == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	op->in = data;
+	op->inlen = datalen;
+	op->out = out;
+	op->outlen = outlen;
+	return async_submit(op, handle);
+}
+
+int sc_async_decipher(sc_card_t *card, const u8 *crgram, size_t crgram_len,
+		u8 *out, size_t outlen,
+		sc_async_callback_t callback, void *arg, sc_async_op_t **handle)
+{
+	struct sc_async_op *op;
+
+	if (card == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	op = async_new(card, SC_ASYNC_DECIPHER, callback, arg);
+	if (op == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	op->in = crgram;
+	op->inlen = crgram_len;
+	op->out = out;
+	op->outlen = outlen;
+	return async_submit(op, handle);
+}
+
+int sc_async_read_binary(sc_card_t *card, unsigned int idx, u8 *buf,
+		size_t count, unsigned long flags,
+		sc_async_callback_t callback, void *arg, sc_async_op_t **handle)
+{
+	struct sc_async_op *op;
+
+	if (card == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	op = async_new(card, SC_ASYNC_READ_BINARY, callback, arg);
+	if (op == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	op->idx = idx;
+	op->out = buf;
+	op->outlen = count;
+	op->flags = flags;
+	return async_submit(op, handle);
+}
+
+int sc_async_call(sc_card_t *card, int (*fn)(void *), void *fn_arg,
+		sc_async_op_t **handle)
+{
+	struct sc_async_op *op;
+
+	if (card == NULL || fn == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	op = async_new(card, SC_ASYNC_CALL, NULL, NULL);
+	if (op == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	op->fn = fn;
+	op->fn_arg = fn_arg;
+	return async_submit(op, handle);
+}
+
+int sc_async_done(sc_async_op_t *op, int *result)
+{
+	int done;
+
+	if (op == NULL)
+		return 0;
+#ifdef SC_ASYNC_THREAD
+	pthread_mutex_lock(&op->worker->lock);
+#endif
+	done = op->done;
+	if (done && result)
+		*result = op->result;
+#ifdef SC_ASYNC_THREAD
+	pthread_mutex_unlock(&op->worker->lock);
+#endif
+	return done;
+}
+
+int sc_async_wait(sc_async_op_t *op)
+{
+	int result;
+
+	if (op == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+#ifdef SC_ASYNC_THREAD
+	pthread_mutex_lock(&op->worker->lock);
+	while (!op->done)
+		pthread_cond_wait(&op->worker->done, &op->worker->lock);
+	result = op->result;
+	pthread_mutex_unlock(&op->worker->lock);
+#else
+	result = op->result;
+#endif
+	return result;
+}
+
+void sc_async_release(sc_async_op_t *op)
+{
+#ifdef SC_ASYNC_THREAD
+	struct sc_async_worker *w;
+
+	if (op == NULL)
+		return;
+	/* a pending request is freed by the I/O thread once it completed */
+	w = op->worker;
+	pthread_mutex_lock(&w->lock);
+	if (--op->refs == 0)
+		free(op);
+	pthread_mutex_unlock(&w->lock);
+#else
+	free(op);
+#endif
+}
+
+void sc_async_flush(sc_card_t *card)
+{
+#ifdef SC_ASYNC_THREAD
+	struct sc_async_worker *w;
+
+	if (card == NULL || card->reader == NULL)
+		return;
+	w = card->reader->async;
+	if (w == NULL)
+		return;
+	pthread_mutex_lock(&w->lock);
+	while (async_pending(w, card))
+		pthread_cond_wait(&w->done, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+#else
+	(void)card;
+#endif
+}
+
+void sc_async_stop(sc_reader_t *reader)
+{
+#ifdef SC_ASYNC_THREAD
+	struct sc_async_worker *w;
+
+	if (reader == NULL || reader->async == NULL)
+		return;
+	w = reader->async;
+	reader->async = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	pthread_cond_destroy(&w->done);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+#else
+	(void)reader;
+#endif
+}
@@ -33,7 +33,7 @@ static const u8 base64_table[66] =
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
 	"0123456789+/=";
 
-static const u8 bin_table[128] = {
+static const u8 bin_table[256] = {
         0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
         0xFF,0xE0,0xD0,0xFF,0xFF,0xD0,0xFF,0xFF,
         0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
@@ -50,6 +50,22 @@ static const u8 bin_table[128] = {
         0x21,0x22,0x23,0x24,0x25,0x26,0x27,0x28,
         0x29,0x2A,0x2B,0x2C,0x2D,0x2E,0x2F,0x30,
         0x31,0x32,0x33,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
 };
 
 static void to_base64(unsigned int i, u8 *out, unsigned int fillers)
@@ -110,7 +126,10 @@ int sc_base64_encode(const u8 *in, size_t len, u8 *out, size_t outlen, size_t li
 		len -= 3;
 		if (outlen < 4)
 			return SC_ERROR_BUFFER_TOO_SMALL;
-		to_base64(i, out, 0);
+		out[0] = base64_table[i >> 18];
+		out[1] = base64_table[(i >> 12) & 0x3f];
+		out[2] = base64_table[(i >> 6) & 0x3f];
+		out[3] = base64_table[i & 0x3f];
 		out += 4;
 		outlen -= 4;
 		chars += 4;
@@ -150,14 +169,36 @@ int sc_base64_encode(const u8 *in, size_t len, u8 *out, size_t outlen, size_t li
 
 int sc_base64_decode(const char *in, u8 *out, size_t outlen)
 {
-	int len = 0, r, skip;
+	int len = 0, r, skip, finished, s;
 	unsigned int i;
 
-	while ((r = from_base64(in, &i, &skip)) > 0) {
-		int finished = 0, s = 16;
+	for (;;) {
+		const u8 *p = (const u8 *)in;
+		u8 b0, b1, b2, b3;
 
-		if (r < 3)
-			finished = 1;
+		/* Fast path for the common case of four plain characters; a
+		 * \0 maps to 0xFF, so the string is never read past its end */
+		if (outlen >= 3
+				&& (b0 = bin_table[p[0]]) < 0x40
+				&& (b1 = bin_table[p[1]]) < 0x40
+				&& (b2 = bin_table[p[2]]) < 0x40
+				&& (b3 = bin_table[p[3]]) < 0x40) {
+			*out++ = (b0 << 2) | (b1 >> 4);
+			*out++ = (b1 << 4) | (b2 >> 2);
+			*out++ = (b2 << 6) | b3;
+			outlen -= 3;
+			len += 3;
+			in += 4;
+			if (*in == 0)
+				return len;
+			continue;
+		}
+
+		r = from_base64(in, &i, &skip);
+		if (r <= 0)
+			break;
+		finished = r < 3;
+		s = 16;
 		while (r--) {
 			if (outlen <= 0)
 				return SC_ERROR_BUFFER_TOO_SMALL;
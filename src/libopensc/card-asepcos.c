@@ -16,6 +16,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
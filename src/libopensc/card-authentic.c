@@ -20,6 +20,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
@@ -2121,7 +2123,7 @@ authentic_sm_execute (struct sc_card *card, struct sm_info *sm_info,
 {
 	struct sc_context *ctx = card->ctx;
 	struct sc_remote_data rdata;
-	int rv, ii;
+	int rv;
 
 	if (!card->sm_ctx.module.ops.get_apdus)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
@@ -2134,19 +2136,7 @@ authentic_sm_execute (struct sc_card *card, struct sm_info *sm_info,
 
 	sc_log(ctx, "GET_APDUS: rv %i; rdata length %i", rv, rdata.length);
 
-	for (ii=0; ii < rdata.length; ii++)   {
-		struct sc_apdu *apdu = &((rdata.data + ii)->apdu);
-
-		if (!apdu->ins)
-			break;
-		rv = sc_transmit_apdu(card, apdu);
-		if (rv < 0)
-			break;
-
-		rv = sc_check_sw(card, apdu->sw1, apdu->sw2);
-		if (rv < 0)
-			break;
-	}
+	rv = sc_transmit_remote_data(card, &rdata, NULL);
 
 	rdata.free(&rdata);
 	LOG_FUNC_RETURN(ctx, rv);
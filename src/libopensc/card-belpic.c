@@ -80,6 +80,8 @@
  * language-selection  functionality.
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
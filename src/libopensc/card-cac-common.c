@@ -20,6 +20,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -108,8 +110,14 @@ cac_private_data_t *cac_new_private_data(void)
 
 void cac_free_private_data(cac_private_data_t *priv)
 {
+	cac_cache_entry_t *entry, *next;
+
+	for (entry = priv->cache_list; entry != NULL; entry = next) {
+		next = entry->next;
+		free(entry->data);
+		free(entry);
+	}
 	free(priv->cac_id);
-	free(priv->cache_buf);
 	free(priv->aca_path);
 	list_destroy(&priv->pki_list);
 	list_destroy(&priv->general_list);
@@ -117,6 +125,81 @@ void cac_free_private_data(cac_private_data_t *priv)
 	return;
 }
 
+static int cac_cache_path_equal(const sc_path_t *a, const sc_path_t *b)
+{
+	return a->type == b->type
+		&& a->len == b->len && !memcmp(a->value, b->value, a->len)
+		&& a->aid.len == b->aid.len && !memcmp(a->aid.value, b->aid.value, a->aid.len);
+}
+
+/*
+ * Remember the newly selected object and, if it was decoded before, point
+ * cache_buf at the saved copy so read_binary does not go to the card again.
+ * CAC objects do not change while the card is in use, so entries stay valid
+ * until the card is released.
+ */
+void cac_cache_select(cac_private_data_t *priv, const sc_path_t *path)
+{
+	cac_cache_entry_t *entry, **prev;
+
+	priv->cache_path = *path;
+	priv->cache_buf = NULL;
+	priv->cache_buf_len = 0;
+	priv->cached = 0;
+
+	for (prev = &priv->cache_list; (entry = *prev) != NULL; prev = &entry->next) {
+		if (!cac_cache_path_equal(&entry->path, path))
+			continue;
+		/* move to the front so it is the last to be evicted */
+		*prev = entry->next;
+		entry->next = priv->cache_list;
+		priv->cache_list = entry;
+
+		priv->cache_buf = entry->data;
+		priv->cache_buf_len = entry->data_len;
+		priv->cached = 1;
+		return;
+	}
+}
+
+/*
+ * Take ownership of cache_buf, which read_binary just filled for the
+ * selected object, and keep it for later selections of the same path.
+ * The least recently used objects are dropped once the cache grows over
+ * CAC_CACHE_MAX_SIZE; the new entry itself is always kept.
+ */
+int cac_cache_store(cac_private_data_t *priv)
+{
+	cac_cache_entry_t *entry, **prev;
+	size_t size;
+
+	entry = calloc(1, sizeof(cac_cache_entry_t));
+	if (entry == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	entry->path = priv->cache_path;
+	entry->data = priv->cache_buf;
+	entry->data_len = priv->cache_buf_len;
+	entry->next = priv->cache_list;
+	priv->cache_list = entry;
+	priv->cache_size += entry->data_len;
+	priv->cached = 1;
+
+	size = entry->data_len;
+	for (prev = &entry->next; (entry = *prev) != NULL; ) {
+		if (size + entry->data_len > CAC_CACHE_MAX_SIZE) {
+			*prev = entry->next;
+			priv->cache_size -= entry->data_len;
+			free(entry->data);
+			free(entry);
+			continue;
+		}
+		size += entry->data_len;
+		prev = &entry->next;
+	}
+	return SC_SUCCESS;
+}
+
 int cac_add_object_to_list(list_t *list, const cac_object_t *object)
 {
 	if (list_append(list, object) < 0)
@@ -39,6 +39,17 @@ typedef struct cac_object {
 	sc_path_t path;
 } cac_object_t;
 
+/* a decoded CAC object, kept across selections of other objects */
+typedef struct cac_cache_entry {
+	sc_path_t path;
+	u8 *data;
+	size_t data_len;
+	struct cac_cache_entry *next;
+} cac_cache_entry_t;
+
+/* upper bound on the memory held by decoded objects of one card */
+#define CAC_CACHE_MAX_SIZE	(128 * 1024)
+
 /*
  * CAC private data per card state
  */
@@ -48,6 +59,9 @@ typedef struct cac_private_data {
 	u8 *cache_buf;			/* cached version of the currently selected file */
 	size_t cache_buf_len;		/* length of the cached selected file */
 	int cached;			/* is the cached selected file valid */
+	sc_path_t cache_path;		/* path of the currently selected file */
+	cac_cache_entry_t *cache_list;	/* decoded objects, most recently used first */
+	size_t cache_size;		/* sum of data_len over cache_list */
 	cac_cuid_t cuid;                /* card unique ID from the CCC */
 	u8 *cac_id;                     /* card serial number */
 	size_t cac_id_len;              /* card serial number len */
@@ -83,6 +97,8 @@ static const cac_cuid_t cac_cac_cuid = {
 
 cac_private_data_t *cac_new_private_data(void);
 void cac_free_private_data(cac_private_data_t *priv);
+void cac_cache_select(cac_private_data_t *priv, const sc_path_t *path);
+int cac_cache_store(cac_private_data_t *priv);
 int cac_add_object_to_list(list_t *list, const cac_object_t *object);
 const char *get_cac_label(int index);
 
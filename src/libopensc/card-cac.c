@@ -26,6 +26,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -458,12 +460,13 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 	cac_private_data_t * priv = CAC_DATA(card);
 	int r = 0;
 	u8 *tl = NULL, *val = NULL;
-	const u8 *tl_ptr, *val_ptr, *tl_start;
-	u8 *tlv_ptr;
+	const u8 *val_ptr;
+	u8 *tlv_ptr, *tlv_end;
 	const u8 *cert_ptr;
-	size_t tl_len, val_len, tlv_len;
-	size_t len, tl_head_len, cert_len;
+	size_t tl_len, val_len;
+	size_t len, cert_len;
 	u8 cert_type, tag;
+	struct sc_simpletlv_iter it;
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
@@ -481,13 +484,8 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 	}
 
 	sc_log(card->ctx, 
-		 "clearing cache idx=%d count=%"SC_FORMAT_LEN_SIZE_T"u",
+		 "reading object idx=%d count=%"SC_FORMAT_LEN_SIZE_T"u",
 		 idx, count);
-	if (priv->cache_buf) {
-		free(priv->cache_buf);
-		priv->cache_buf = NULL;
-		priv->cache_buf_len = 0;
-	}
 
 
 	if (priv->object_type <= 0)
@@ -504,39 +502,33 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 
 	switch (priv->object_type) {
 	case CAC_OBJECT_TYPE_TLV_FILE:
-		tlv_len = tl_len + val_len;
-		priv->cache_buf = malloc(tlv_len);
+		/* the headers can only get shorter, values are never longer
+		 * than what we have read */
+		priv->cache_buf = malloc(tl_len + val_len);
 		if (priv->cache_buf == NULL) {
 			r = SC_ERROR_OUT_OF_MEMORY;
 			goto done;
 		}
-		priv->cache_buf_len = tlv_len;
-
-		for (tl_ptr = tl, val_ptr=val, tlv_ptr = priv->cache_buf;
-				tl_len >= 2 && tlv_len > 0;
-				val_len -= len, tlv_len -= len, val_ptr += len, tlv_ptr += len) {
-			/* get the tag and the length */
-			tl_start = tl_ptr;
-			r = sc_simpletlv_read_tag(&tl_ptr, tl_len, &tag, &len);
-			if (r != SC_SUCCESS && r != SC_ERROR_TLV_END_OF_CONTENTS)
-				break;
-			tl_head_len = (tl_ptr - tl_start);
-			sc_simpletlv_put_tag(tag, len, tlv_ptr, tlv_len, &tlv_ptr);
-			tlv_len -= tl_head_len;
-			tl_len -= tl_head_len;
+		tlv_ptr = priv->cache_buf;
+		tlv_end = priv->cache_buf + tl_len + val_len;
 
+		/* join the tags and values in one pass, straight from the read buffers */
+		sc_simpletlv_iter_init_split(&it, tl, tl_len, val, val_len);
+		while ((r = sc_simpletlv_iter_next(&it, &tag, &val_ptr, &len)) != 0) {
+			if (r == SC_ERROR_INVALID_TLV_OBJECT)
+				break;
 			/* don't crash on bad data */
-			if (val_len < len) {
-				sc_log(card->ctx, "Received too long value %"SC_FORMAT_LEN_SIZE_T"u, "
-				    "while only %"SC_FORMAT_LEN_SIZE_T"u left. Truncating", len, val_len);
-				len = val_len;
-			}
-			/* if we run out of return space, truncate */
-			if (tlv_len < len) {
-				len = tlv_len;
+			if (r == SC_ERROR_TLV_END_OF_CONTENTS) {
+				sc_log(card->ctx, "Received too long value for tag 0x%02x, "
+				    "only %"SC_FORMAT_LEN_SIZE_T"u bytes left. Truncating", tag, len);
 			}
+			if (sc_simpletlv_put_tag(tag, len, tlv_ptr, tlv_end - tlv_ptr,
+					&tlv_ptr) != SC_SUCCESS)
+				break;
 			memcpy(tlv_ptr, val_ptr, len);
+			tlv_ptr += len;
 		}
+		priv->cache_buf_len = tlv_ptr - priv->cache_buf;
 		break;
 
 	case CAC_OBJECT_TYPE_CERT:
@@ -547,27 +539,14 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 		cert_len = 0;
 		cert_ptr = NULL;
 		cert_type = 0;
-		for (tl_ptr = tl, val_ptr = val; tl_len >= 2;
-		    val_len -= len, val_ptr += len, tl_len -= tl_head_len) {
-			tl_start = tl_ptr;
-			r = sc_simpletlv_read_tag(&tl_ptr, tl_len, &tag, &len);
-			if (r != SC_SUCCESS && r != SC_ERROR_TLV_END_OF_CONTENTS)
-				break;
-			tl_head_len = tl_ptr - tl_start;
-
-			/* incomplete value */
-			if (val_len < len) {
-				sc_log(card->ctx, "Read incomplete value %"SC_FORMAT_LEN_SIZE_T"u, "
-				    "while only %"SC_FORMAT_LEN_SIZE_T"u left", len, val_len);
-				break;
-			}
-
+		sc_simpletlv_iter_init_split(&it, tl, tl_len, val, val_len);
+		while ((r = sc_simpletlv_iter_next(&it, &tag, &val_ptr, &len)) == 1) {
 			if (tag == CAC_TAG_CERTIFICATE) {
 				cert_len = len;
 				cert_ptr = val_ptr;
 			}
 			if (tag == CAC_TAG_CERTINFO) {
-				if ((len >= 1) && (val_len >=1)) {
+				if (len >= 1) {
 					cert_type = *val_ptr;
 				}
 			}
@@ -575,6 +554,10 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 				sc_log_hex(card->ctx, "MSCUID", val_ptr, len);
 			}
 		}
+		if (r == SC_ERROR_TLV_END_OF_CONTENTS) {
+			sc_log(card->ctx, "Read incomplete value for tag 0x%02x, "
+			    "only %"SC_FORMAT_LEN_SIZE_T"u bytes left", tag, len);
+		}
 		/* if the info byte is 1, then the cert is compressed, decompress it */
 		if ((cert_type & 0x3) == 1) {
 #ifdef ENABLE_ZLIB
@@ -587,13 +570,12 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 			if (r)
 				goto done;
 		} else if (cert_len > 0) {
-			priv->cache_buf = malloc(cert_len);
-			if (priv->cache_buf == NULL) {
-				r = SC_ERROR_OUT_OF_MEMORY;
-				goto done;
-			}
+			/* the certificate is the bulk of the value buffer,
+			 * keep that instead of copying it out */
+			memmove(val, cert_ptr, cert_len);
+			priv->cache_buf = val;
 			priv->cache_buf_len = cert_len;
-			memcpy(priv->cache_buf, cert_ptr, cert_len);
+			val = NULL;
 		} else {
 			sc_log(card->ctx, "Can't read zero-length certificate");
 			goto done;
@@ -612,11 +594,18 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 	}
 
 	/* OK we've read the data, now copy the required portion out to the callers buffer */
-	priv->cached = 1;
+	r = cac_cache_store(priv);
+	if (r < 0)
+		goto done;
 	len = MIN(count, priv->cache_buf_len-idx);
 	memcpy(buf, &priv->cache_buf[idx], len);
 	r = len;
 done:
+	if (!priv->cached) {
+		free(priv->cache_buf);
+		priv->cache_buf = NULL;
+		priv->cache_buf_len = 0;
+	}
 	if (tl)
 		free(tl);
 	if (val)
@@ -1099,13 +1088,8 @@ static int cac_select_file_by_type(sc_card_t *card, const sc_path_t *in_path, sc
 			priv->object_type = CAC_OBJECT_TYPE_CERT;
 		}
 
-		/* forget any old cached values */
-		if (priv->cache_buf) {
-			free(priv->cache_buf);
-			priv->cache_buf = NULL;
-		}
-		priv->cache_buf_len = 0;
-		priv->cached = 0;
+		/* pick up the decoded object if we have read it before */
+		cac_cache_select(priv, in_path);
 	}
 
 	if (in_path->aid.len) {
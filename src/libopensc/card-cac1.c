@@ -26,6 +26,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -151,11 +153,8 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 	}
 
 	sc_log(card->ctx, 
-		"clearing cache idx=%d count=%"SC_FORMAT_LEN_SIZE_T"u",
+		"reading object idx=%d count=%"SC_FORMAT_LEN_SIZE_T"u",
 		idx, count);
-	free(priv->cache_buf);
-	priv->cache_buf = NULL;
-	priv->cache_buf_len = 0;
 
 	r = cac_cac1_get_certificate(card, &val, &val_len);
 	if (r < 0)
@@ -191,12 +190,19 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 	}
 
 	/* OK we've read the data, now copy the required portion out to the callers buffer */
-	priv->cached = 1;
+	r = cac_cache_store(priv);
+	if (r < 0)
+		goto done;
 	len = MIN(count, priv->cache_buf_len-idx);
 	if (len && priv->cache_buf)
 		memcpy(buf, &priv->cache_buf[idx], len);
 	r = len;
 done:
+	if (!priv->cached) {
+		free(priv->cache_buf);
+		priv->cache_buf = NULL;
+		priv->cache_buf_len = 0;
+	}
 	if (val)
 		free(val);
 	LOG_FUNC_RETURN(card->ctx, r);
@@ -253,13 +259,8 @@ static int cac_select_file_by_type(sc_card_t *card, const sc_path_t *in_path, sc
 	 * and object type here:
 	 */
 	if (priv) { /* don't record anything if we haven't been initialized yet */
-		/* forget any old cached values */
-		if (priv->cache_buf) {
-			free(priv->cache_buf);
-			priv->cache_buf = NULL;
-		}
-		priv->cache_buf_len = 0;
-		priv->cached = 0;
+		/* pick up the decoded object if we have read it before */
+		cac_cache_select(priv, in_path);
 	}
 
 	if (in_path->aid.len) {
@@ -24,13 +24,17 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -69,6 +73,7 @@
  *  COOLKEY hardware and APDU constants
  */
 #define COOLKEY_MAX_CHUNK_SIZE 240 /* must be less than 255-8 */
+#define COOLKEY_MAX_READ_CHUNK_SIZE 255 /* READ OBJECT has a one byte length */
 
 /* ISO 7816 CLA values used by COOLKEY */
 #define ISO7816_CLASS           0x00
@@ -740,6 +745,9 @@ typedef struct coolkey_private_data {
 	coolkey_cuid_t cuid;			/* card unique ID from the CCC */
 	sc_cardctl_coolkey_object_t *obj;	/* pointer to the current selected object */
 	list_t objects_list;			/* list of objects on the token */
+	coolkey_object_info_t *object_info;	/* objects as listed by the applet */
+	size_t object_info_count;
+	char disk_cache_key[17];		/* hash of CPLC, life cycle and object list, empty if objects are not cached on disk */
 	unsigned short key_id;			/* key id set by select */
 	int	algorithm;			/* saved from set_security_env */
 	int operation;				/* saved from set_security_env */
@@ -799,6 +807,7 @@ static void coolkey_free_private_data(coolkey_private_data_t *priv)
 	list_iterator_stop(l);
 
 	list_destroy(&priv->objects_list);
+	free(priv->object_info);
 	if (priv->token_name) {
 		free(priv->token_name);
 	}
@@ -1070,8 +1079,7 @@ coolkey_get_life_cycle(sc_card_t *card, coolkey_life_cycle_t *life_cycle)
 static int coolkey_select_applet(sc_card_t *card)
 {
 	u8 aid[] = { 0x62, 0x76, 0x01, 0xff, 0x00, 0x00, 0x00 };
-	return coolkey_apdu_io(card, ISO7816_CLASS, ISO7816_INS_SELECT_FILE, 4, 0,
-			&aid[0], sizeof(aid), NULL, NULL,  NULL, 0);
+	return sc_select_aid(card, aid, sizeof(aid), NULL, NULL);
 }
 
 static void
@@ -1099,17 +1107,22 @@ static int coolkey_read_object(sc_card_t *card, unsigned long object_id, size_t
 	u8 *out_ptr;
 	size_t left = 0;
 	size_t len;
+	size_t chunk;
 	int r;
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
 	ulong2bebytes(&params.object_id[0], object_id);
 
+	/* the nonce only goes into the command, so reads are limited by
+	 * what the card returns in a single short APDU */
+	chunk = MIN(COOLKEY_MAX_READ_CHUNK_SIZE, sc_get_max_recv_size(card));
+
 	out_ptr = out_buf;
 	left = out_len;
 	do {
 		ulong2bebytes(&params.offset[0], offset);
-		params.length = MIN(left, COOLKEY_MAX_CHUNK_SIZE);
+		params.length = MIN(left, chunk);
 		len = left;
 		r = coolkey_apdu_io(card, COOLKEY_CLASS, COOLKEY_INS_READ_OBJECT, 0, 0,
 			(u8 *)&params, sizeof(params), &out_ptr, &len, nonce, nonce_size);
@@ -1132,6 +1145,176 @@ fail:
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+/*
+ * Public objects are kept in the OpenSC cache directory, so that other
+ * processes do not need to read them from the card again. The cache key
+ * covers the CPLC data, the applet's life cycle and protocol version and
+ * the complete object list with lengths and ACLs.
+ */
+static int
+coolkey_object_is_public(coolkey_private_data_t *priv, unsigned long object_id)
+{
+	size_t i;
+
+	for (i = 0; i < priv->object_info_count; i++) {
+		if (bebytes2ulong(priv->object_info[i].object_id) == object_id)
+			return priv->object_info[i].read_acl[0] == 0
+				&& priv->object_info[i].read_acl[1] == 0;
+	}
+	return 0;
+}
+
+static int
+coolkey_disk_cache_path(sc_card_t *card, coolkey_private_data_t *priv,
+		unsigned long object_id, char *path, size_t path_len)
+{
+	size_t len;
+	int r;
+
+	if (priv->disk_cache_key[0] == '\0')
+		return SC_ERROR_NOT_SUPPORTED;
+	if (!coolkey_object_is_public(priv, object_id))
+		return SC_ERROR_NOT_SUPPORTED;
+
+	r = sc_get_cache_dir(card->ctx, path, path_len);
+	if (r != SC_SUCCESS)
+		return r;
+	len = strlen(path);
+	r = snprintf(path + len, path_len - len, "%ccoolkey-%s-%08lx",
+#ifdef _WIN32
+			'\\',
+#else
+			'/',
+#endif
+			priv->disk_cache_key, object_id);
+	if (r < 0 || (size_t)r >= path_len - len)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/* reads a cached object, which must be exactly buf_len bytes long */
+static int
+coolkey_disk_cache_read(sc_card_t *card, coolkey_private_data_t *priv,
+		unsigned long object_id, u8 *buf, size_t buf_len)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int r = SC_ERROR_INVALID_DATA;
+
+	if (coolkey_disk_cache_path(card, priv, object_id, path, sizeof path) != SC_SUCCESS)
+		return SC_ERROR_NOT_SUPPORTED;
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fread(buf, 1, buf_len, f) == buf_len && fgetc(f) == EOF)
+		r = SC_SUCCESS;
+	fclose(f);
+	return r;
+}
+
+static void
+coolkey_disk_cache_write(sc_card_t *card, coolkey_private_data_t *priv,
+		unsigned long object_id, const u8 *buf, size_t buf_len)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	FILE *f;
+	int ok;
+
+	if (coolkey_disk_cache_path(card, priv, object_id, path, sizeof path) != SC_SUCCESS)
+		return;
+
+	snprintf(tmp, sizeof tmp, "%s.%lu", path, (unsigned long)getpid());
+	f = fopen(tmp, "wb");
+	if (f == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(card->ctx) < 0)
+			return;
+		f = fopen(tmp, "wb");
+	}
+	if (f == NULL)
+		return;
+	ok = fwrite(buf, 1, buf_len, f) == buf_len;
+	if (fclose(f) != 0)
+		ok = 0;
+#ifdef _WIN32
+	if (!ok || !MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING))
+#else
+	if (!ok || rename(tmp, path) != 0)
+#endif
+		remove(tmp);
+}
+
+/*
+ * Read a complete object, from the disk cache if possible.
+ */
+static int coolkey_read_full_object(sc_card_t *card, coolkey_private_data_t *priv,
+			unsigned long object_id, u8 *out_buf, size_t out_len)
+{
+	int r;
+
+	if (coolkey_disk_cache_read(card, priv, object_id, out_buf, out_len) == SC_SUCCESS) {
+		sc_log(card->ctx, "object %08lx from disk cache, len=%"SC_FORMAT_LEN_SIZE_T"u",
+		       object_id, out_len);
+		return (int)out_len;
+	}
+
+	r = coolkey_read_object(card, object_id, 0, out_buf, out_len,
+		priv->nonce, sizeof(priv->nonce));
+	if (r == (int)out_len)
+		coolkey_disk_cache_write(card, priv, object_id, out_buf, out_len);
+	return r;
+}
+
+/*
+ * Enable the disk cache if configured.
+ */
+static void
+coolkey_disk_cache_init(sc_card_t *card, coolkey_private_data_t *priv,
+		const coolkey_cuid_t *cplc_cuid)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL; /* FNV-1a */
+	const u8 *p;
+	u8 version[3];
+	size_t i;
+
+	version[0] = priv->life_cycle;
+	version[1] = priv->protocol_version_major;
+	version[2] = priv->protocol_version_minor;
+
+	for (p = (const u8 *)cplc_cuid, i = 0; i < sizeof *cplc_cuid; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	for (i = 0; i < sizeof version; i++) {
+		hash ^= version[i];
+		hash *= 0x100000001b3ULL;
+	}
+	p = (const u8 *)priv->object_info;
+	for (i = 0; i < priv->object_info_count * sizeof *priv->object_info; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	snprintf(priv->disk_cache_key, sizeof priv->disk_cache_key, "%016llx", hash);
+	sc_log(card->ctx, "Coolkey objects are cached with key %s", priv->disk_cache_key);
+}
+
+static int
+coolkey_disk_cache_enabled(sc_card_t *card)
+{
+	int enabled = 0;
+	size_t i, j;
+
+	for (i = 0; card->ctx->conf_blocks[i]; i++) {
+		scconf_block **blocks = scconf_find_blocks(card->ctx->conf,
+				card->ctx->conf_blocks[i], "card_driver", "coolkey");
+		if (!blocks)
+			continue;
+		for (j = 0; blocks[j]; j++)
+			enabled = scconf_get_bool(blocks[j], "use_file_caching", enabled);
+		free(blocks);
+	}
+	return enabled;
+}
+
 /*
  * Write a COOLKEY coolkey object.
  */
@@ -1209,8 +1392,7 @@ static int coolkey_read_binary(sc_card_t *card, unsigned int idx,
 	}
 
 
-	r = coolkey_read_object(card, priv->obj->id, 0, data, priv->obj->length,
-		priv->nonce, sizeof(priv->nonce));
+	r = coolkey_read_full_object(card, priv, priv->obj->id, data, priv->obj->length);
 	if (r < 0)
 		goto done;
 
@@ -1381,8 +1563,7 @@ coolkey_fill_object(sc_card_t *card, sc_cardctl_coolkey_object_t *obj)
 	if (new_obj_data == NULL) {
 		return SC_ERROR_OUT_OF_MEMORY;
 	}
-	r = coolkey_read_object(card, obj->id, 0, new_obj_data, buf_len,
-				priv->nonce, sizeof(priv->nonce));
+	r = coolkey_read_full_object(card, priv, obj->id, new_obj_data, buf_len);
 	if (r != (int)buf_len) {
 		free(new_obj_data);
 		if (r < 0) {
@@ -2131,6 +2312,68 @@ coolkey_list_object(sc_card_t *card, u8 seq, coolkey_object_info_t *object_info)
 
 }
 
+/*
+ * Walk down the list of objects on the token and remember it in priv.
+ */
+static int coolkey_list_objects(sc_card_t *card, coolkey_private_data_t *priv)
+{
+	coolkey_object_info_t object_info;
+	coolkey_object_info_t *tmp;
+	int r;
+
+	r = coolkey_list_object(card, COOLKEY_LIST_RESET, &object_info);
+	while (r >= 0) {
+		/* The card did not return what we expected: Lets try other objects */
+		if ((size_t)r < (sizeof(object_info)))
+			break;
+
+		/* Avoid insanely large data */
+		if (bebytes2ulong(object_info.object_length) > MAX_FILE_SIZE)
+			return SC_ERROR_CORRUPTED_DATA;
+
+		tmp = realloc(priv->object_info,
+				(priv->object_info_count + 1) * sizeof(*priv->object_info));
+		if (tmp == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		priv->object_info = tmp;
+		priv->object_info[priv->object_info_count++] = object_info;
+
+		/* Read next object: error is handled on the cycle condition and below after cycle */
+		r = coolkey_list_object(card, COOLKEY_LIST_NEXT, &object_info);
+	}
+	if (r != SC_ERROR_FILE_END_REACHED) {
+		/* This means the card does not cooperate at all: bail out */
+		if (r >= 0) {
+			r = SC_ERROR_INVALID_CARD;
+		}
+		return r;
+	}
+	return SC_SUCCESS;
+}
+
+/*
+ * Read the CUID from the CPLC data of the card manager.
+ */
+static int coolkey_get_cplc_cuid(sc_card_t *card, coolkey_cuid_t *cuid)
+{
+	global_platform_cplc_data_t cplc_data;
+	int r;
+
+	/* select the card manager, because a card with applet only will have
+	   already selected the coolkey applet */
+	r = gp_select_card_manager(card);
+	if (r < 0) {
+		return r;
+	}
+
+	r = gp_get_cplc_data(card, &cplc_data);
+	if (r < 0) {
+		return r;
+	}
+	coolkey_make_cuid_from_cplc(cuid, &cplc_data);
+	return SC_SUCCESS;
+}
+
 /*
  * Initialize the Coolkey data structures.
  */
@@ -2139,8 +2382,10 @@ static int coolkey_initialize(sc_card_t *card)
 	int r;
 	coolkey_private_data_t *priv = NULL;
 	coolkey_life_cycle_t life_cycle;
-	coolkey_object_info_t object_info;
+	coolkey_cuid_t cplc_cuid;
+	int have_cplc = 0;
 	int combined_processed = 0;
+	size_t i;
 
 	/* already found? */
 	if (card->drv_data) {
@@ -2169,25 +2414,33 @@ static int coolkey_initialize(sc_card_t *card)
 	priv->pin_count = life_cycle.pin_count;
 	priv->life_cycle = life_cycle.life_cycle;
 
-	/* walk down the list of objects and read them off the token */
-	r = coolkey_list_object(card, COOLKEY_LIST_RESET, &object_info);
-	while (r >= 0) {
+	r = coolkey_list_objects(card, priv);
+	if (r < 0) {
+		goto cleanup;
+	}
+
+	/* the disk cache key needs the CPLC data, so that cards with the
+	 * same objects are not mixed up */
+	if (coolkey_disk_cache_enabled(card)) {
+		if (coolkey_get_cplc_cuid(card, &cplc_cuid) == SC_SUCCESS) {
+			have_cplc = 1;
+			coolkey_disk_cache_init(card, priv, &cplc_cuid);
+		}
+		r = coolkey_select_applet(card);
+		if (r < 0) {
+			goto cleanup;
+		}
+	}
+
+	/* read the objects off the token */
+	for (i = 0; i < priv->object_info_count; i++) {
 		unsigned long object_id;
 		unsigned long object_len;
 
-		/* The card did not return what we expected: Lets try other objects */
-		if ((size_t)r < (sizeof(object_info)))
-			break;
-
 		/* TODO also look at the ACL... */
 
-		object_id = bebytes2ulong(object_info.object_id);
-		object_len = bebytes2ulong(object_info.object_length);
-		/* Avoid insanely large data */
-		if (object_len > MAX_FILE_SIZE) {
-			r = SC_ERROR_CORRUPTED_DATA;
-			goto cleanup;
-		}
+		object_id = bebytes2ulong(priv->object_info[i].object_id);
+		object_len = bebytes2ulong(priv->object_info[i].object_length);
 
 		/* the combined object is a single object that can store the other objects.
 		 * most coolkeys provisioned by TPS has a single combined object that is
@@ -2199,18 +2452,18 @@ static int coolkey_initialize(sc_card_t *card)
 			u8 *object = malloc(object_len);
 			if (object == NULL) {
 				r = SC_ERROR_OUT_OF_MEMORY;
-				break;
+				goto cleanup;
 			}
-			r = coolkey_read_object(card, COOLKEY_COMBINED_OBJECT_ID, 0, object, object_len,
-				priv->nonce, sizeof(priv->nonce));
+			r = coolkey_read_full_object(card, priv, COOLKEY_COMBINED_OBJECT_ID,
+				object, object_len);
 			if (r < 0) {
 				free(object);
-				break;
+				goto cleanup;
 			}
 			r = coolkey_process_combined_object(card, priv, object, r);
 			free(object);
 			if (r != SC_SUCCESS) {
-				break;
+				goto cleanup;
 			}
 			combined_processed = 1;
 		} else {
@@ -2219,33 +2472,17 @@ static int coolkey_initialize(sc_card_t *card)
 			if (r != SC_SUCCESS)
 				sc_log(card->ctx, "coolkey_add_object() returned %d", r);
 		}
-
-		/* Read next object: error is handled on the cycle condition and below after cycle */
-		r = coolkey_list_object(card, COOLKEY_LIST_NEXT, &object_info);
-	}
-	if (r != SC_ERROR_FILE_END_REACHED) {
-		/* This means the card does not cooperate at all: bail out */
-		if (r >= 0) {
-			r = SC_ERROR_INVALID_CARD;
-		}
-		goto cleanup;
 	}
 	/* if we didn't pull the cuid from the combined object, then grab it now */
 	if (!combined_processed) {
-		global_platform_cplc_data_t cplc_data;
-		/* select the card manager, because a card with applet only will have
-		   already selected the coolkey applet */
-
-		r = gp_select_card_manager(card);
-		if (r < 0) {
-			goto cleanup;
-		}
-
-		r = gp_get_cplc_data(card, &cplc_data);
-		if (r < 0) {
-			goto cleanup;
+		if (have_cplc) {
+			priv->cuid = cplc_cuid;
+		} else {
+			r = coolkey_get_cplc_cuid(card, &priv->cuid);
+			if (r < 0) {
+				goto cleanup;
+			}
 		}
-		coolkey_make_cuid_from_cplc(&priv->cuid, &cplc_data);
 		priv->token_name = (u8 *)strdup("COOLKEY");
 		if (priv->token_name == NULL) {
 			r = SC_ERROR_OUT_OF_MEMORY;
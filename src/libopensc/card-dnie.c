@@ -22,6 +22,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #define __CARD_DNIE_C__
 
 #ifdef HAVE_CONFIG_H
@@ -440,6 +442,34 @@ static int dnie_get_environment(
 }
 #endif
 
+/**
+ * Check whether the secure channel is to be opened when the card is bound.
+ *
+ * Reads the "early_secure_channel" option of the dnie card_driver block.
+ *
+ * @param card Pointer to card structure
+ * @return 1 if the channel is opened in dnie_init(), else 0
+ */
+static int dnie_get_early_secure_channel(sc_card_t * card)
+{
+	int i, early = 0;
+	scconf_block **blocks, *blk;
+	sc_context_t *ctx = card->ctx;
+
+	for (i = 0; ctx->conf_blocks[i]; i++) {
+		blocks = scconf_find_blocks(ctx->conf, ctx->conf_blocks[i],
+				"card_driver", "dnie");
+		if (!blocks)
+			continue;
+		blk = blocks[0];
+		free(blocks);
+		if (blk == NULL)
+			continue;
+		early = scconf_get_bool(blk, "early_secure_channel", early);
+	}
+	return early;
+}
+
 /************************** cardctl defined operations *******************/
 
 /** 
@@ -823,6 +853,25 @@ err:
 	LOG_FUNC_RETURN(ctx, rv);
 }
 
+/**
+ * Re-establish the secure channel after the card was reset.
+ *
+ * Called before the first APDU to be wrapped after a reset. The session
+ * keys are gone with the reset, so the key agreement is run in plain; a
+ * channel that was not up yet is left to be opened on demand.
+ *
+ * @param card Pointer to card structure
+ * @return SC_SUCCES if ok; else error code
+ */
+static int dnie_sm_open(struct sc_card *card)
+{
+	if (card->sm_ctx.sm_mode != SM_MODE_TRANSMIT)
+		return SC_SUCCESS;
+	card->sm_ctx.sm_mode = SM_MODE_NONE;
+	return cwa_create_secure_channel(card,
+			GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_ON);
+}
+
 /**
  * OpenDNIe card structures initialization.
  *
@@ -852,6 +901,7 @@ static int dnie_init(struct sc_card *card)
 
 	/** Secure messaging initialization section **/
 	memset(&(card->sm_ctx), 0, sizeof(sm_context_t));
+	card->sm_ctx.ops.open = dnie_sm_open;
 	card->sm_ctx.ops.get_sm_apdu = dnie_sm_get_wrapped_apdu;
 	card->sm_ctx.ops.free_sm_apdu = dnie_sm_free_wrapped_apdu;
 	card->sm_ctx.sm_mode = SM_MODE_NONE;
@@ -877,6 +927,16 @@ static int dnie_init(struct sc_card *card)
 
 	GET_DNIE_PRIV_DATA(card)->cwa_provider = provider;
 
+	/* With async_token_binding this runs in the binding thread, so the
+	 * key agreement is done before the first PIN verification needs it */
+	if (dnie_get_early_secure_channel(card)) {
+		res = cwa_create_secure_channel(card, provider, CWA_SM_WARM);
+		if (res != SC_SUCCESS) {
+			sc_log(card->ctx, "Cannot open the secure channel yet: %d", res);
+			res = SC_SUCCESS;
+		}
+	}
+
 	LOG_FUNC_RETURN(card->ctx, res);
 }
 
@@ -2107,8 +2167,8 @@ static int dnie_pin_change(struct sc_card *card, struct sc_pin_cmd_data * data)
 {
 	int res=SC_SUCCESS;
 	LOG_FUNC_CALLED(card->ctx);
-	/* Ensure that secure channel is established from reset */
-	res = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_ON);
+	/* Ensure that secure channel is established, reusing an open one */
+	res = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_WARM);
 	LOG_TEST_RET(card->ctx, res, "Establish SM failed");
 	LOG_FUNC_RETURN(card->ctx,SC_ERROR_NOT_SUPPORTED);
 }
@@ -2134,13 +2194,16 @@ static int dnie_pin_verify(struct sc_card *card,
 	int padding = 0;
 
 	LOG_FUNC_CALLED(card->ctx);
-	/* ensure that secure channel is established from reset */
+	/* ensure that secure channel is established. DNIe 3.0 needs a
+	 * channel of its own for the PIN, older cards reuse an open one */
 	if (card->atr.value[15] >= DNIE_30_VERSION) {
 		/* the provider should be prepared for using PIN information */
 		sc_log(card->ctx, "DNIe 3.0 detected doing PIN initialization");
 		dnie_change_cwa_provider_to_pin(card);
+		res = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_ON);
+	} else {
+		res = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_WARM);
 	}
-	res = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_ON);
 	LOG_TEST_RET(card->ctx, res, "Establish SM failed");
 
 	data->apdu = &apdu;	/* prepare apdu struct */
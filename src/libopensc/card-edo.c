@@ -17,6 +17,9 @@
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -16,6 +16,8 @@
 
 /* Initially written by Weitao Sun (weitao@ftsafe.com) 2008 */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -19,6 +19,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -98,6 +100,9 @@ typedef struct epass2003_exdata_st {
 	unsigned char sk_enc[16];	/* encrypt session key */
 	unsigned char sk_mac[16];	/* mac session key */
 	unsigned char icv_mac[16];	/* instruction counter vector(for sm) */
+	EVP_CIPHER_CTX *sm_enc;		/* CBC encryption keyed with sk_enc */
+	EVP_CIPHER_CTX *sm_dec;		/* CBC decryption keyed with sk_enc */
+	EVP_CIPHER_CTX *sm_mac;		/* CBC encryption keyed with sk_mac */
 	unsigned char currAlg;		/* current Alg */
 	unsigned int  ecAlgFlags; 	/* Ec Alg mechanism type*/
 } epass2003_exdata;
@@ -172,7 +177,7 @@ static const struct sc_card_error epass2003_errors[] = {
 static int epass2003_transmit_apdu(struct sc_card *card, struct sc_apdu *apdu);
 static int epass2003_select_file(struct sc_card *card, const sc_path_t * in_path, sc_file_t ** file_out);
 int epass2003_refresh(struct sc_card *card);
-static int hash_data(const unsigned char *data, size_t datalen, unsigned char *hash, unsigned int mechanismType);
+static int hash_data(struct sc_card *card, const unsigned char *data, size_t datalen, unsigned char *hash, unsigned int mechanismType);
 
 static int
 epass2003_check_sw(struct sc_card *card, unsigned int sw1, unsigned int sw2)
@@ -220,6 +225,8 @@ openssl_enc(const EVP_CIPHER * cipher, const unsigned char *key, const unsigned
 	int outl_tmp = 0;
 	unsigned char iv_tmp[EVP_MAX_IV_LENGTH] = { 0 };
 
+	if (cipher == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
 	memcpy(iv_tmp, iv, EVP_MAX_IV_LENGTH);
 	ctx = EVP_CIPHER_CTX_new();
 	if (ctx == NULL)
@@ -250,6 +257,8 @@ openssl_dec(const EVP_CIPHER * cipher, const unsigned char *key, const unsigned
 	int outl_tmp = 0;
 	unsigned char iv_tmp[EVP_MAX_IV_LENGTH] = { 0 };
 
+	if (cipher == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
 	memcpy(iv_tmp, iv, EVP_MAX_IV_LENGTH);
 	ctx = EVP_CIPHER_CTX_new();
 	if (ctx == NULL)
@@ -271,33 +280,50 @@ out:
 }
 
 
+/* Runs one CBC operation through a context keyed by sm_session_init(),
+ * restarting it at 'iv' without setting up the key schedule again */
 static int
-aes128_encrypt_ecb(const unsigned char *key, int keysize,
+sm_session_cbc(EVP_CIPHER_CTX *ctx, const unsigned char *iv,
 		const unsigned char *input, size_t length, unsigned char *output)
 {
-	unsigned char iv[EVP_MAX_IV_LENGTH] = { 0 };
-	return openssl_enc(EVP_aes_128_ecb(), key, iv, input, length, output);
+	int outl = 0;
+	int outl_tmp = 0;
+
+	if (ctx == NULL)
+		return SC_ERROR_INTERNAL;
+	if (!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1))
+		return SC_ERROR_INTERNAL;
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+	if (!EVP_CipherUpdate(ctx, output, &outl, input, length))
+		return SC_ERROR_INTERNAL;
+
+	if (!EVP_CipherFinal_ex(ctx, output + outl, &outl_tmp))
+		return SC_ERROR_INTERNAL;
+
+	return SC_SUCCESS;
 }
 
 
 static int
-aes128_encrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[16],
+aes128_encrypt_ecb(struct sc_card *card, const unsigned char *key, int keysize,
 		const unsigned char *input, size_t length, unsigned char *output)
 {
-	return openssl_enc(EVP_aes_128_cbc(), key, iv, input, length, output);
+	unsigned char iv[EVP_MAX_IV_LENGTH] = { 0 };
+	return openssl_enc(sc_evp_cipher(card->ctx, "AES-128-ECB"), key, iv, input, length, output);
 }
 
 
 static int
-aes128_decrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[16],
+aes128_encrypt_cbc(struct sc_card *card, const unsigned char *key, int keysize, unsigned char iv[16],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
-	return openssl_dec(EVP_aes_128_cbc(), key, iv, input, length, output);
+	return openssl_enc(sc_evp_cipher(card->ctx, "AES-128-CBC"), key, iv, input, length, output);
 }
 
 
 static int
-des3_encrypt_ecb(const unsigned char *key, int keysize,
+des3_encrypt_ecb(struct sc_card *card, const unsigned char *key, int keysize,
 		const unsigned char *input, int length, unsigned char *output)
 {
 	unsigned char iv[EVP_MAX_IV_LENGTH] = { 0 };
@@ -311,12 +337,12 @@ des3_encrypt_ecb(const unsigned char *key, int keysize,
 		memcpy(&bKey[0], key, 24);
 	}
 
-	return openssl_enc(EVP_des_ede3(), bKey, iv, input, length, output);
+	return openssl_enc(sc_evp_cipher(card->ctx, "DES-EDE3"), bKey, iv, input, length, output);
 }
 
 
 static int
-des3_encrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
+des3_encrypt_cbc(struct sc_card *card, const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
 	unsigned char bKey[24] = { 0 };
@@ -329,40 +355,23 @@ des3_encrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX
 		memcpy(&bKey[0], key, 24);
 	}
 
-	return openssl_enc(EVP_des_ede3_cbc(), bKey, iv, input, length, output);
-}
-
-
-static int
-des3_decrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
-		const unsigned char *input, size_t length, unsigned char *output)
-{
-	unsigned char bKey[24] = { 0 };
-	if (keysize == 16) {
-		memcpy(&bKey[0], key, 16);
-		memcpy(&bKey[16], key, 8);
-	}
-	else {
-		memcpy(&bKey[0], key, 24);
-	}
-
-	return openssl_dec(EVP_des_ede3_cbc(), bKey, iv, input, length, output);
+	return openssl_enc(sc_evp_cipher(card->ctx, "DES-EDE3-CBC"), bKey, iv, input, length, output);
 }
 
 
 static int
-des_encrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
+des_encrypt_cbc(struct sc_card *card, const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
-	return openssl_enc(EVP_des_cbc(), key, iv, input, length, output);
+	return openssl_enc(sc_evp_cipher(card->ctx, "DES-CBC"), key, iv, input, length, output);
 }
 
 
 static int
-des_decrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
+des_decrypt_cbc(struct sc_card *card, const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
-	return openssl_dec(EVP_des_cbc(), key, iv, input, length, output);
+	return openssl_dec(sc_evp_cipher(card->ctx, "DES-CBC"), key, iv, input, length, output);
 }
 
 
@@ -374,6 +383,8 @@ openssl_dig(const EVP_MD * digest, const unsigned char *input, size_t length,
 	EVP_MD_CTX *ctx = NULL;
 	unsigned outl = 0;
 
+	if (digest == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
 	ctx = EVP_MD_CTX_create();
 	if (ctx == NULL) {
 		r = SC_ERROR_OUT_OF_MEMORY;
@@ -401,15 +412,15 @@ err:
 
 
 static int
-sha1_digest(const unsigned char *input, size_t length, unsigned char *output)
+sha1_digest(struct sc_card *card, const unsigned char *input, size_t length, unsigned char *output)
 {
-	return openssl_dig(EVP_sha1(), input, length, output);
+	return openssl_dig(sc_evp_md(card->ctx, "SHA1"), input, length, output);
 }
 
 static int
-sha256_digest(const unsigned char *input, size_t length, unsigned char *output)
+sha256_digest(struct sc_card *card, const unsigned char *input, size_t length, unsigned char *output)
 {
-	return openssl_dig(EVP_sha256(), input, length, output);
+	return openssl_dig(sc_evp_md(card->ctx, "SHA256"), input, length, output);
 }
 
 
@@ -457,12 +468,12 @@ gen_init_key(struct sc_card *card, unsigned char *key_enc, unsigned char *key_ma
 
 	/* Step 2,3 - Create S-ENC/S-MAC Session Key */
 	if (KEY_TYPE_AES == key_type) {
-		aes128_encrypt_ecb(key_enc, 16, data, 16, exdata->sk_enc);
-		aes128_encrypt_ecb(key_mac, 16, data, 16, exdata->sk_mac);
+		aes128_encrypt_ecb(card, key_enc, 16, data, 16, exdata->sk_enc);
+		aes128_encrypt_ecb(card, key_mac, 16, data, 16, exdata->sk_mac);
 	}
 	else {
-		des3_encrypt_ecb(key_enc, 16, data, 16, exdata->sk_enc);
-		des3_encrypt_ecb(key_mac, 16, data, 16, exdata->sk_mac);
+		des3_encrypt_ecb(card, key_enc, 16, data, 16, exdata->sk_enc);
+		des3_encrypt_ecb(card, key_mac, 16, data, 16, exdata->sk_mac);
 	}
 
 	memcpy(data, g_random, 8);
@@ -473,9 +484,9 @@ gen_init_key(struct sc_card *card, unsigned char *key_enc, unsigned char *key_ma
 
 	/* calculate host cryptogram */
 	if (KEY_TYPE_AES == key_type)
-		aes128_encrypt_cbc(exdata->sk_enc, 16, iv, data, 16 + blocksize, cryptogram);
+		aes128_encrypt_cbc(card, exdata->sk_enc, 16, iv, data, 16 + blocksize, cryptogram);
 	else
-		des3_encrypt_cbc(exdata->sk_enc, 16, iv, data, 16 + blocksize, cryptogram);
+		des3_encrypt_cbc(card, exdata->sk_enc, 16, iv, data, 16 + blocksize, cryptogram);
 
 	/* verify card cryptogram */
 	if (0 != memcmp(&cryptogram[16], &result[20], 8))
@@ -513,10 +524,10 @@ verify_init_key(struct sc_card *card, unsigned char *ran_key, unsigned char key_
 
 	/* calculate host cryptogram */
 	if (KEY_TYPE_AES == key_type) {
-		aes128_encrypt_cbc(exdata->sk_enc, 16, iv, data, 16 + blocksize,
+		aes128_encrypt_cbc(card, exdata->sk_enc, 16, iv, data, 16 + blocksize,
 				   cryptogram);
 	} else {
-		des3_encrypt_cbc(exdata->sk_enc, 16, iv, data, 16 + blocksize,
+		des3_encrypt_cbc(card, exdata->sk_enc, 16, iv, data, 16 + blocksize,
 				 cryptogram);
 	}
 
@@ -528,10 +539,10 @@ verify_init_key(struct sc_card *card, unsigned char *ran_key, unsigned char key_
 	/* calculate mac icv */
 	memset(iv, 0x00, 16);
 	if (KEY_TYPE_AES == key_type) {
-		aes128_encrypt_cbc(exdata->sk_mac, 16, iv, data, 16, mac);
+		aes128_encrypt_cbc(card, exdata->sk_mac, 16, iv, data, 16, mac);
 		i = 0;
 	} else {
-		des3_encrypt_cbc(exdata->sk_mac, 16, iv, data, 16, mac);
+		des3_encrypt_cbc(card, exdata->sk_mac, 16, iv, data, 16, mac);
 		i = 8;
 	}
 	/* save mac icv */
@@ -558,6 +569,60 @@ verify_init_key(struct sc_card *card, unsigned char *ran_key, unsigned char key_
 }
 
 
+static void
+sm_session_free(epass2003_exdata *exdata)
+{
+	EVP_CIPHER_CTX_free(exdata->sm_enc);
+	EVP_CIPHER_CTX_free(exdata->sm_dec);
+	EVP_CIPHER_CTX_free(exdata->sm_mac);
+	exdata->sm_enc = NULL;
+	exdata->sm_dec = NULL;
+	exdata->sm_mac = NULL;
+}
+
+
+/* Keys the contexts used to wrap and unwrap every APDU of the session
+ * with the session keys established by mutual_auth() */
+static int
+sm_session_init(struct sc_card *card)
+{
+	epass2003_exdata *exdata = (epass2003_exdata *)card->drv_data;
+	const EVP_CIPHER *cipher, *mac_cipher;
+	unsigned char key[24] = { 0 };
+
+	sm_session_free(exdata);
+
+	if (KEY_TYPE_AES == exdata->smtype) {
+		cipher = sc_evp_cipher(card->ctx, "AES-128-CBC");
+		mac_cipher = cipher;
+		memcpy(key, exdata->sk_enc, 16);
+	}
+	else {
+		cipher = sc_evp_cipher(card->ctx, "DES-EDE3-CBC");
+		mac_cipher = sc_evp_cipher(card->ctx, "DES-CBC");
+		memcpy(&key[0], exdata->sk_enc, 16);
+		memcpy(&key[16], exdata->sk_enc, 8);
+	}
+	if (cipher == NULL || mac_cipher == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	exdata->sm_enc = EVP_CIPHER_CTX_new();
+	exdata->sm_dec = EVP_CIPHER_CTX_new();
+	exdata->sm_mac = EVP_CIPHER_CTX_new();
+	if (exdata->sm_enc == NULL || exdata->sm_dec == NULL || exdata->sm_mac == NULL
+			|| !EVP_EncryptInit_ex(exdata->sm_enc, cipher, NULL, key, NULL)
+			|| !EVP_DecryptInit_ex(exdata->sm_dec, cipher, NULL, key, NULL)
+			|| !EVP_EncryptInit_ex(exdata->sm_mac, mac_cipher, NULL, exdata->sk_mac, NULL)) {
+		sc_mem_clear(key, sizeof(key));
+		sm_session_free(exdata);
+		return SC_ERROR_INTERNAL;
+	}
+	sc_mem_clear(key, sizeof(key));
+
+	return SC_SUCCESS;
+}
+
+
 static int
 mutual_auth(struct sc_card *card, unsigned char *key_enc,
 			unsigned char *key_mac)
@@ -581,6 +646,9 @@ mutual_auth(struct sc_card *card, unsigned char *key_enc,
 	r = verify_init_key(card, ran_key, exdata->smtype);
 	LOG_TEST_RET(ctx, r, "verify_init_key failed");
 
+	r = sm_session_init(card);
+	LOG_TEST_RET(ctx, r, "sm_session_init failed");
+
 	LOG_FUNC_RETURN(ctx, r);
 }
 
@@ -650,10 +718,8 @@ construct_data_tlv(struct sc_card *card, struct sc_apdu *apdu, unsigned char *ap
 	memcpy(data_tlv, &apdu_buf[block_size], tlv_more);
 
 	/* encrypt Data */
-	if (KEY_TYPE_AES == key_type)
-		aes128_encrypt_cbc(exdata->sk_enc, 16, iv, pad, pad_len, apdu_buf + block_size + tlv_more);
-	else
-		des3_encrypt_cbc(exdata->sk_enc, 16, iv, pad, pad_len, apdu_buf + block_size + tlv_more);
+	if (0 != sm_session_cbc(exdata->sm_enc, iv, pad, pad_len, apdu_buf + block_size + tlv_more))
+		return -1;
 
 	memcpy(data_tlv + tlv_more, apdu_buf + block_size + tlv_more, pad_len);
 	*data_tlv_len = tlv_more + pad_len;
@@ -735,17 +801,17 @@ construct_mac_tlv(struct sc_card *card, unsigned char *apdu_buf, size_t data_tlv
 	/* calculate MAC */
 	memset(icv, 0, sizeof(icv));
 	memcpy(icv, exdata->icv_mac, 16);
+	if (0 != sm_session_cbc(exdata->sm_mac, icv, apdu_buf, mac_len, mac))
+		return -1;
 	if (KEY_TYPE_AES == key_type) {
-		aes128_encrypt_cbc(exdata->sk_mac, 16, icv, apdu_buf, mac_len, mac);
 		memcpy(mac_tlv + 2, &mac[mac_len - 16], 8);
 	}
 	else {
 		unsigned char iv[EVP_MAX_IV_LENGTH] = { 0 };
 		unsigned char tmp[8] = { 0 };
-		des_encrypt_cbc(exdata->sk_mac, 8, icv, apdu_buf, mac_len, mac);
-		des_decrypt_cbc(&exdata->sk_mac[8], 8, iv, &mac[mac_len - 8], 8, tmp);
+		des_decrypt_cbc(card, &exdata->sk_mac[8], 8, iv, &mac[mac_len - 8], 8, tmp);
 		memset(iv, 0x00, sizeof iv);
-		des_encrypt_cbc(exdata->sk_mac, 8, iv, tmp, 8, mac_tlv + 2);
+		des_encrypt_cbc(card, exdata->sk_mac, 8, iv, tmp, 8, mac_tlv + 2);
 	}
 
 	*mac_tlv_len = 2 + 8;
@@ -942,10 +1008,8 @@ decrypt_response(struct sc_card *card, unsigned char *in, size_t inlen, unsigned
 		return -1;
 
 	/* decrypt */
-	if (KEY_TYPE_AES == exdata->smtype)
-		aes128_decrypt_cbc(exdata->sk_enc, 16, iv, &in[i], cipher_len - 1, plaintext);
-	else
-		des3_decrypt_cbc(exdata->sk_enc, 16, iv, &in[i], cipher_len - 1, plaintext);
+	if (0 != sm_session_cbc(exdata->sm_dec, iv, &in[i], cipher_len - 1, plaintext))
+		return -1;
 
 	/* unpadding */
 	while (0x80 != plaintext[cipher_len - 2] && (cipher_len - 2 > 0))
@@ -1225,8 +1289,10 @@ epass2003_finish(sc_card_t *card)
 {
 	epass2003_exdata *exdata = (epass2003_exdata *)card->drv_data;
 
-	if (exdata)
+	if (exdata) {
+		sm_session_free(exdata);
 		free(exdata);
+	}
 	return SC_SUCCESS;
 }
 
@@ -1710,7 +1776,7 @@ static int epass2003_decipher(struct sc_card *card, const u8 * data, size_t data
 	{
 		if(exdata->ecAlgFlags & SC_ALGORITHM_ECDSA_HASH_SHA1)
 		{
-			r = hash_data(data, datalen, sbuf, SC_ALGORITHM_ECDSA_HASH_SHA1);
+			r = hash_data(card, data, datalen, sbuf, SC_ALGORITHM_ECDSA_HASH_SHA1);
 			LOG_TEST_RET(card->ctx, r, "hash_data failed"); 
 			sc_format_apdu(card, &apdu, SC_APDU_CASE_3,0x2A, 0x9E, 0x9A);
 			apdu.data = sbuf;
@@ -1719,7 +1785,7 @@ static int epass2003_decipher(struct sc_card *card, const u8 * data, size_t data
 		}
 		else if (exdata->ecAlgFlags & SC_ALGORITHM_ECDSA_HASH_SHA256)
 		{
-			r = hash_data(data, datalen, sbuf, SC_ALGORITHM_ECDSA_HASH_SHA256);
+			r = hash_data(card, data, datalen, sbuf, SC_ALGORITHM_ECDSA_HASH_SHA256);
 			LOG_TEST_RET(card->ctx, r, "hash_data failed");
 			sc_format_apdu(card, &apdu, SC_APDU_CASE_3,0x2A, 0x9E, 0x9A);
 			apdu.data = sbuf;
@@ -2260,7 +2326,7 @@ internal_write_rsa_key(struct sc_card *card, unsigned short fid, struct sc_pkcs1
 
 
 static int
-hash_data(const unsigned char *data, size_t datalen, unsigned char *hash, unsigned int mechanismType)
+hash_data(struct sc_card *card, const unsigned char *data, size_t datalen, unsigned char *hash, unsigned int mechanismType)
 {
 
 	if ((NULL == data) || (NULL == hash))
@@ -2271,7 +2337,7 @@ hash_data(const unsigned char *data, size_t datalen, unsigned char *hash, unsign
 		unsigned char data_hash[24] = { 0 };
 		size_t len = 0;
 
-		sha1_digest(data, datalen, data_hash);
+		sha1_digest(card, data, datalen, data_hash);
 		len = REVERSE_ORDER4(datalen);
 		memcpy(&data_hash[20], &len, 4);
 		memcpy(hash, data_hash, 24);
@@ -2281,7 +2347,7 @@ hash_data(const unsigned char *data, size_t datalen, unsigned char *hash, unsign
 		unsigned char data_hash[36] = { 0 };
 		size_t len = 0;
 
-		sha256_digest(data, datalen, data_hash);
+		sha256_digest(card, data, datalen, data_hash);
 		len = REVERSE_ORDER4(datalen);
 		memcpy(&data_hash[32], &len, 4);
 		memcpy(hash, data_hash, 36);
@@ -2362,7 +2428,7 @@ internal_install_pin(struct sc_card *card, sc_epass2003_wkey_data * pin)
 	int r;
 	unsigned char hash[HASH_LEN] = { 0 };
 
-	r = hash_data(pin->key_data.es_secret.key_val, pin->key_data.es_secret.key_len, hash, SC_ALGORITHM_ECDSA_HASH_SHA1);
+	r = hash_data(card, pin->key_data.es_secret.key_val, pin->key_data.es_secret.key_len, hash, SC_ALGORITHM_ECDSA_HASH_SHA1);
 	LOG_TEST_RET(card->ctx, r, "hash data failed");
 
 	r = install_secret_key(card, 0x04, pin->key_data.es_secret.kid,
@@ -2672,10 +2738,10 @@ external_key_auth(struct sc_card *card, unsigned char kid,
 	r = sc_get_challenge(card, random, 8);
 	LOG_TEST_RET(card->ctx, r, "get challenge external_key_auth failed");
 
-	r = hash_data(data, datalen, hash, SC_ALGORITHM_ECDSA_HASH_SHA1);
+	r = hash_data(card, data, datalen, hash, SC_ALGORITHM_ECDSA_HASH_SHA1);
 	LOG_TEST_RET(card->ctx, r, "hash data failed");
 
-	des3_encrypt_cbc(hash, HASH_LEN, iv, random, 8, tmp_data);
+	des3_encrypt_cbc(card, hash, HASH_LEN, iv, random, 8, tmp_data);
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0x82, 0x01, 0x80 | kid);
 	apdu.lc = apdu.datalen = 8;
 	apdu.data = tmp_data;
@@ -2699,7 +2765,7 @@ update_secret_key(struct sc_card *card, unsigned char ktype, unsigned char kid,
 	unsigned char tmp_data[256] = { 0 };
 	unsigned char maxtries = 0;
 
-	r = hash_data(data, datalen, hash, SC_ALGORITHM_ECDSA_HASH_SHA1);
+	r = hash_data(card, data, datalen, hash, SC_ALGORITHM_ECDSA_HASH_SHA1);
 	LOG_TEST_RET(card->ctx, r, "hash data failed");
 
 	r = get_external_key_maxtries(card, &maxtries);
@@ -27,6 +27,8 @@ Some features are undocumented like the format used to store certificates. They
 */
 
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -144,11 +146,23 @@ typedef struct _CARD_CACHE_FILE_FORMAT
 
 } CARD_CACHE_FILE_FORMAT, *PCARD_CACHE_FILE_FORMAT;
 
+// a DO read from the card, valid as long as the cardcf file is unchanged
+struct gids_cached_file {
+	int fileIdentifier;
+	int dataObjectIdentifier;
+	u8 *data;
+	size_t datalen;
+	struct gids_cached_file *next;
+};
+
 struct gids_private_data {
 	u8 masterfile[MAX_GIDS_FILE_SIZE];
 	size_t masterfilesize;
 	u8 cmapfile[MAX_GIDS_FILE_SIZE];
 	size_t cmapfilesize;
+	struct gids_cached_file *cachedfiles;
+	u8 cardcf[6];
+	int cardcfchecked;	// the cache was checked against the cardcf in this transaction
 	unsigned short currentEFID;
 	unsigned short currentDO;
 	int state;
@@ -223,6 +237,41 @@ static int gids_find_available_DO(sc_card_t *card, u8* masterfile, size_t master
 	return SC_ERROR_NOT_ENOUGH_MEMORY;
 }
 
+// FILE CACHE
+///////////////////////////////////////////
+// The masterfile, the cmapfile and the DOs read through gids_get_cached_DO
+// are kept in memory. The cardcf file, which every application modifying
+// the card has to update, is read once per transaction to detect changes.
+
+// forget a cached DO
+static void gids_cache_remove(struct gids_private_data* data, int fileIdentifier, int dataObjectIdentifier) {
+	struct gids_cached_file **pp = &data->cachedfiles;
+
+	while (*pp) {
+		struct gids_cached_file *cached = *pp;
+		if (cached->fileIdentifier == fileIdentifier && cached->dataObjectIdentifier == dataObjectIdentifier) {
+			*pp = cached->next;
+			free(cached->data);
+			free(cached);
+		} else {
+			pp = &cached->next;
+		}
+	}
+}
+
+// forget all cached data, including the masterfile and the cmapfile
+static void gids_cache_clear(struct gids_private_data* data) {
+	while (data->cachedfiles) {
+		struct gids_cached_file *cached = data->cachedfiles;
+		data->cachedfiles = cached->next;
+		free(cached->data);
+		free(cached);
+	}
+	data->masterfilesize = sizeof(data->masterfile);
+	data->cmapfilesize = sizeof(data->cmapfile);
+	data->cardcfchecked = 0;
+}
+
 // read a DO from the card
 static int gids_get_DO(sc_card_t* card, int fileIdentifier, int dataObjectIdentifier, u8* response, size_t *responselen) {
 	sc_apdu_t apdu;
@@ -290,13 +339,87 @@ static int gids_put_DO(sc_card_t* card, int fileIdentifier, int dataObjectIdenti
 	LOG_TEST_RET(card->ctx, r, "gids put data failed");
 	LOG_TEST_RET(card->ctx,  sc_check_sw(card, apdu.sw1, apdu.sw2), "invalid return");
 
+	if (card->drv_data)
+		gids_cache_remove((struct gids_private_data*) card->drv_data, fileIdentifier, dataObjectIdentifier);
 	return SC_SUCCESS;
 }
 
+static int gids_read_gidsfile_without_cache(sc_card_t* card, u8* masterfile, size_t masterfilesize, char *directory, char *filename, u8* response, size_t *responselen);
+
+// compare the cardcf file with the one the cached data belongs to
+static void gids_check_cache(sc_card_t* card) {
+	struct gids_private_data* data = (struct gids_private_data*) card->drv_data;
+	u8 cardcf[6];
+	size_t cardcfsize = sizeof(cardcf);
+	int r;
+
+	if (data->cardcfchecked && card->lock_count > 0)
+		return;
+	if (data->masterfilesize == sizeof(data->masterfile)) {
+		// nothing cached yet
+		gids_cache_clear(data);
+		return;
+	}
+	r = gids_read_gidsfile_without_cache(card, data->masterfile, data->masterfilesize, "", "cardcf", cardcf, &cardcfsize);
+	if (r < 0 || cardcfsize != sizeof(cardcf)) {
+		sc_log(card->ctx, "unable to check the cardcf, dropping the file cache");
+		gids_cache_clear(data);
+		return;
+	}
+	if (memcmp(cardcf, data->cardcf, sizeof(cardcf)) != 0) {
+		sc_log(card->ctx, "the card has been modified, dropping the file cache");
+		gids_cache_clear(data);
+		memcpy(data->cardcf, cardcf, sizeof(cardcf));
+		return;
+	}
+	// the result is only kept until the card is unlocked
+	data->cardcfchecked = card->lock_count > 0;
+}
+
+// read a DO, from the cache if the card has not been modified
+static int gids_get_cached_DO(sc_card_t* card, int fileIdentifier, int dataObjectIdentifier, u8* response, size_t *responselen) {
+	struct gids_private_data* data = (struct gids_private_data*) card->drv_data;
+	struct gids_cached_file *cached;
+	int r;
+
+	gids_check_cache(card);
+	for (cached = data->cachedfiles; cached; cached = cached->next) {
+		if (cached->fileIdentifier == fileIdentifier && cached->dataObjectIdentifier == dataObjectIdentifier) {
+			if (cached->datalen > *responselen) {
+				LOG_FUNC_RETURN(card->ctx, SC_ERROR_BUFFER_TOO_SMALL);
+			}
+			memcpy(response, cached->data, cached->datalen);
+			*responselen = cached->datalen;
+			return SC_SUCCESS;
+		}
+	}
+
+	r = gids_get_DO(card, fileIdentifier, dataObjectIdentifier, response, responselen);
+	LOG_TEST_RET(card->ctx, r, "unable to get the DO");
+
+	// the cache can only be checked once the masterfile is known
+	if (data->masterfilesize == sizeof(data->masterfile))
+		return r;
+	cached = calloc(1, sizeof(struct gids_cached_file));
+	if (cached) {
+		cached->data = malloc(*responselen ? *responselen : 1);
+		if (!cached->data) {
+			free(cached);
+			return r;
+		}
+		memcpy(cached->data, response, *responselen);
+		cached->datalen = *responselen;
+		cached->fileIdentifier = fileIdentifier;
+		cached->dataObjectIdentifier = dataObjectIdentifier;
+		cached->next = data->cachedfiles;
+		data->cachedfiles = cached;
+	}
+	return r;
+}
+
 // select the GIDS applet
 static int gids_select_aid(sc_card_t* card, u8* aid, size_t aidlen, u8* response, size_t *responselen)
 {
-	sc_apdu_t apdu;
 	int r;
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
@@ -304,20 +427,9 @@ static int gids_select_aid(sc_card_t* card, u8* aid, size_t aidlen, u8* response
 		 "Got args: aid=%p, aidlen=%"SC_FORMAT_LEN_SIZE_T"u, response=%p, responselen=%"SC_FORMAT_LEN_SIZE_T"u\n",
 		 aid, aidlen, response, responselen ? *responselen : 0);
 
-	sc_format_apdu(card, &apdu,
-		response == NULL ? SC_APDU_CASE_3_SHORT : SC_APDU_CASE_4_SHORT, INS_SELECT, P1_SELECT_DF_BY_NAME, P2_SELECT_FIRST_OR_ONLY_OCCURENCE);
-	apdu.lc = aidlen;
-	apdu.data = aid;
-	apdu.datalen = aidlen;
-	apdu.resp = response;
-	apdu.resplen = responselen ? *responselen : 0;
-	apdu.le = response == NULL ? 0 : 256; /* could be 21  for fci */
-
-	r = sc_transmit_apdu(card, &apdu);
-	if (responselen)
-		*responselen = apdu.resplen;
+	r = sc_select_aid(card, aid, aidlen, response, responselen);
 	LOG_TEST_RET(card->ctx, r, "gids select failed");
-	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE,  sc_check_sw(card, apdu.sw1, apdu.sw2));
+	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
 // DIRECT FILE MANIPULATION
@@ -358,9 +470,13 @@ static int gids_write_gidsfile_without_cache(sc_card_t* card, u8* masterfile, si
 // read the masterfile from the card
 static int gids_read_masterfile(sc_card_t* card) {
 	struct gids_private_data* data = (struct gids_private_data*) card->drv_data;
+	size_t cardcfsize;
 	int r = SC_SUCCESS;
 
-	data->masterfilesize = sizeof(data->masterfile);
+	gids_check_cache(card);
+	if (data->masterfilesize != sizeof(data->masterfile)) {
+		return SC_SUCCESS;
+	}
 	r = gids_get_DO(card, MF_FI, MF_DO, data->masterfile, &data->masterfilesize);
 	if (r<0) {
 		data->masterfilesize = sizeof(data->masterfile);
@@ -370,6 +486,14 @@ static int gids_read_masterfile(sc_card_t* card) {
 		data->masterfilesize = sizeof(data->masterfile);
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_CARD);
 	}
+	// remember the state of the card the cache is built for
+	cardcfsize = sizeof(data->cardcf);
+	if (gids_read_gidsfile_without_cache(card, data->masterfile, data->masterfilesize, "", "cardcf",
+			data->cardcf, &cardcfsize) == SC_SUCCESS && cardcfsize == sizeof(data->cardcf)) {
+		data->cardcfchecked = card->lock_count > 0;
+	} else {
+		memset(data->cardcf, 0, sizeof(data->cardcf));
+	}
 	return r;
 }
 
@@ -380,8 +504,11 @@ static int gids_update_cardcf(sc_card_t* card, int file, int container) {
 	u8 cardcf[6];
 	int r;
 	size_t cardcfsize = sizeof(cardcf);
+	int uptodate;
 	r = gids_read_gidsfile_without_cache(card, data->masterfile, data->masterfilesize, "", "cardcf", cardcf, &cardcfsize);
 	LOG_TEST_RET(card->ctx, r, "unable to get the cardcf");
+	// the cache stays valid across our own modifications only
+	uptodate = cardcfsize == sizeof(cardcf) && memcmp(cardcf, data->cardcf, sizeof(cardcf)) == 0;
 
 	if (file) {
 		short filefreshness = cardcf[4] + cardcf[5] * 0x100;
@@ -397,6 +524,8 @@ static int gids_update_cardcf(sc_card_t* card, int file, int container) {
 	}
 	r = gids_write_gidsfile_without_cache(card, data->masterfile, data->masterfilesize, "", "cardcf", cardcf, 6);
 	LOG_TEST_RET(card->ctx, r, "unable to update the cardcf file");
+	if (uptodate)
+		memcpy(data->cardcf, cardcf, sizeof(cardcf));
 	return r;
 }
 
@@ -404,13 +533,14 @@ static int gids_update_cardcf(sc_card_t* card, int file, int container) {
 static int gids_read_gidsfile(sc_card_t* card, char *directory, char *filename, u8* response, size_t *responselen) {
 	struct gids_private_data* privatedata = (struct gids_private_data*) card->drv_data;
 	int r;
+	int fileIdentifier;
+	int dataObjectIdentifier;
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
-	if (privatedata->masterfilesize == sizeof(privatedata->masterfile)) {
-		r = gids_read_masterfile(card);
-		LOG_TEST_RET(card->ctx, r, "unable to get the masterfile");
-	}
-	r = gids_read_gidsfile_without_cache(card, privatedata->masterfile, privatedata->masterfilesize,
-		directory, filename, response, responselen);
+	r = gids_read_masterfile(card);
+	LOG_TEST_RET(card->ctx, r, "unable to get the masterfile");
+	r = gids_get_identifiers(card, privatedata->masterfile, privatedata->masterfilesize, directory, filename, &fileIdentifier, &dataObjectIdentifier);
+	LOG_TEST_RET(card->ctx, r, "unable to get the identifier for the gids file");
+	r = gids_get_cached_DO(card, fileIdentifier, dataObjectIdentifier, response, responselen);
 	LOG_TEST_RET(card->ctx, r, "unable to read the file");
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE,r);
 }
@@ -448,7 +578,10 @@ static int gids_read_cmapfile(sc_card_t* card) {
 	int r = SC_SUCCESS;
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
-	data->cmapfilesize = sizeof(data->cmapfile);
+	gids_check_cache(card);
+	if (data->cmapfilesize != sizeof(data->cmapfile)) {
+		return SC_SUCCESS;
+	}
 	r = gids_read_gidsfile(card, "mscp", "cmapfile", data->cmapfile, &data->cmapfilesize);
 	if (r<0) {
 		data->cmapfilesize = sizeof(data->cmapfile);
@@ -681,6 +814,7 @@ static int gids_finish(sc_card_t *card)
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 	/* free the private data */
 	if (card->drv_data) {
+		gids_cache_clear((struct gids_private_data*) card->drv_data);
 		free(card->drv_data);
 		card->drv_data = NULL;
 	}
@@ -1064,7 +1198,7 @@ static int gids_read_binary(sc_card_t *card, unsigned int offset,
 		// this function is called to read the certificate only
 		u8 buffer[SC_MAX_EXT_APDU_BUFFER_SIZE];
 		size_t buffersize = sizeof(buffer);
-		r = gids_get_DO(card, data->currentEFID, data->currentDO, buffer, &(buffersize));
+		r = gids_get_cached_DO(card, data->currentEFID, data->currentDO, buffer, &(buffersize));
 		if (r <0) return r;
 		if (buffersize < 4) {
 			LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_DATA);
@@ -1917,6 +2051,7 @@ static int gids_initialize(sc_card_t *card, sc_cardctl_gids_init_param_t* param)
 #endif
 	r = gids_put_DO(card, CARDID_FI, CARDID_DO, param->cardid, sizeof(param->cardid));
 	LOG_TEST_RET(card->ctx, r, "gids unable to save the cardid");
+	gids_cache_clear((struct gids_private_data*) card->drv_data);
 
 	//select applet
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_3, INS_SELECT, 0x00, 0x0C);
@@ -2125,6 +2260,10 @@ static int gids_card_reader_lock_obtained(sc_card_t *card, int was_reset)
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
+	// another application may have modified the card since the last transaction
+	if (card->drv_data && card->cache.foreign_access)
+		((struct gids_private_data*) card->drv_data)->cardcfchecked = 0;
+
 	if (was_reset > 0) {
 		u8 rbuf[SC_MAX_APDU_BUFFER_SIZE];
 		size_t resplen = sizeof(rbuf);
@@ -2141,6 +2280,7 @@ static struct sc_card_driver *sc_get_driver(void)
 		iso_ops = sc_get_iso7816_driver()->ops;
 
 	gids_ops.match_card = gids_match_card;
+	gids_ops.match_atr_hints = sc_atr_hints_iso_application;
 	gids_ops.init = gids_init;
 	gids_ops.finish = gids_finish;
 	gids_ops.read_binary = gids_read_binary;
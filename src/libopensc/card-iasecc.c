@@ -19,6 +19,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
@@ -117,6 +119,7 @@ static int iasecc_pin_get_policy (struct sc_card *card, struct sc_pin_cmd_data *
 static int iasecc_pin_is_verified(struct sc_card *card, struct sc_pin_cmd_data *pin_cmd, int *tries_left);
 static int iasecc_get_free_reference(struct sc_card *card, struct iasecc_ctl_get_free_reference *ctl_data);
 static int iasecc_sdo_put_data(struct sc_card *card, struct iasecc_sdo_update *update);
+static void iasecc_sdo_cache_clear(struct sc_card *card);
 
 #ifdef ENABLE_SM
 static int _iasecc_sm_read_binary(struct sc_card *card, unsigned int offs, unsigned char *buf, size_t count);
@@ -1437,6 +1440,7 @@ iasecc_finish(struct sc_card *card)
 		se_info = next;
 	}
 
+	iasecc_sdo_cache_clear(card);
 	free(card->drv_data);
 	card->drv_data = NULL;
 
@@ -2669,6 +2673,7 @@ iasecc_sdo_create(struct sc_card *card, struct iasecc_sdo *sdo)
 
 	sc_log(ctx, "iasecc_sdo_create(card:%p) %02X%02X%02X", card,
 			IASECC_SDO_TAG_HEADER, sdo->sdo_class | 0x80, sdo->sdo_ref);
+	iasecc_sdo_cache_clear(card);
 
 	data_len = iasecc_sdo_encode_create(ctx, sdo, &data);
 	LOG_TEST_RET(ctx, data_len, "iasecc_sdo_create() cannot encode SDO create data");
@@ -2737,6 +2742,7 @@ iasecc_sdo_delete(struct sc_card *card, struct iasecc_sdo *sdo)
 	data[3] = sdo->sdo_class | 0x80;
 	data[4] = sdo->sdo_ref;
 	sc_log(ctx, "delete SDO %02X%02X%02X", data[2], data[3], data[4]);
+	iasecc_sdo_cache_clear(card);
 
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0xDB, 0x3F, 0xFF);
 	apdu.data = data;
@@ -2764,6 +2770,8 @@ iasecc_sdo_put_data(struct sc_card *card, struct iasecc_sdo_update *update)
 	if (update->magic != SC_CARDCTL_IASECC_SDO_MAGIC_PUT_DATA)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_DATA, "Invalid SDO update data");
 
+	iasecc_sdo_cache_clear(card);
+
 	for(ii=0; update->fields[ii].tag && ii < IASECC_SDO_TAGS_UPDATE_MAX; ii++)   {
 		unsigned char *encoded = NULL;
 		int encoded_len;
@@ -2799,6 +2807,7 @@ iasecc_sdo_key_rsa_put_data(struct sc_card *card, struct iasecc_sdo_rsa_update *
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
+	iasecc_sdo_cache_clear(card);
 
 	if (update->sdo_prv_key)   {
 		sc_log(ctx, "encode private rsa in %p", &update->update_prv);
@@ -2881,6 +2890,92 @@ iasecc_sdo_tag_from_class(unsigned sdo_class)
 }
 
 
+/*
+ * GET DATA on an SDO is costly, in particular under secure messaging, and
+ * the same SDOs are read over and over while binding and on every PIN and
+ * key operation. Keep the raw responses, keyed by the current DF and the
+ * SDO class, reference and tag. Anything that writes SDOs drops the whole
+ * cache; PIN data is refetched after any PIN command since it carries the
+ * retry counter.
+ */
+static void
+iasecc_sdo_cache_clear(struct sc_card *card)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	struct iasecc_sdo_cache *entry, *next;
+
+	if (!prv)
+		return;
+	for (entry = prv->sdo_cache; entry; entry = next)   {
+		next = entry->next;
+		free(entry->data);
+		free(entry);
+	}
+	prv->sdo_cache = NULL;
+}
+
+
+static struct iasecc_sdo_cache *
+iasecc_sdo_cache_find(struct sc_card *card, int sdo_tag, struct iasecc_sdo *sdo)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	struct iasecc_sdo_cache *entry;
+	unsigned char sdo_class = sdo->sdo_class | IASECC_OBJECT_REF_LOCAL;
+	unsigned char sdo_ref = sdo->sdo_ref & 0x9F;
+
+	if (!prv || !card->cache.valid || !card->cache.current_df)
+		return NULL;
+
+	for (entry = prv->sdo_cache; entry; entry = entry->next)   {
+		if (entry->sdo_class != sdo_class || entry->sdo_ref != sdo_ref || entry->sdo_tag != sdo_tag)
+			continue;
+		if (entry->df.type != card->cache.current_df->path.type
+				|| !sc_compare_path(&entry->df, &card->cache.current_df->path))
+			continue;
+		if ((sdo_class & ~IASECC_OBJECT_REF_LOCAL) == IASECC_SDO_CLASS_CHV
+				&& entry->pin_events != card->pin_events)
+			continue;
+		return entry;
+	}
+
+	return NULL;
+}
+
+
+static void
+iasecc_sdo_cache_add(struct sc_card *card, int sdo_tag, struct iasecc_sdo *sdo,
+		int rv, const unsigned char *data, size_t data_len)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	struct iasecc_sdo_cache *entry;
+
+	if (!prv || !card->cache.valid || !card->cache.current_df)
+		return;
+
+	entry = calloc(1, sizeof(struct iasecc_sdo_cache));
+	if (!entry)
+		return;
+	if (data_len)   {
+		entry->data = malloc(data_len);
+		if (!entry->data)   {
+			free(entry);
+			return;
+		}
+		memcpy(entry->data, data, data_len);
+	}
+	entry->data_len = data_len;
+	entry->df = card->cache.current_df->path;
+	entry->sdo_class = sdo->sdo_class | IASECC_OBJECT_REF_LOCAL;
+	entry->sdo_ref = sdo->sdo_ref & 0x9F;
+	entry->sdo_tag = sdo_tag;
+	entry->pin_events = card->pin_events;
+	entry->rv = rv;
+
+	entry->next = prv->sdo_cache;
+	prv->sdo_cache = entry;
+}
+
+
 static int
 iasecc_sdo_get_tagged_data(struct sc_card *card, int sdo_tag, struct iasecc_sdo *sdo)
 {
@@ -2889,10 +2984,22 @@ iasecc_sdo_get_tagged_data(struct sc_card *card, int sdo_tag, struct iasecc_sdo
 	unsigned char sbuf[0x100];
 	size_t offs = sizeof(sbuf) - 1;
 	unsigned char rbuf[0x400];
+	struct iasecc_sdo_cache *cached;
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
 
+	cached = iasecc_sdo_cache_find(card, sdo_tag, sdo);
+	if (cached)   {
+		sc_log(ctx, "SDO %02X%02X tag %X from cache", cached->sdo_class, cached->sdo_ref, sdo_tag);
+		LOG_TEST_RET(ctx, cached->rv, "SDO get data error");
+
+		rv = iasecc_sdo_parse(card, cached->data, cached->data_len, sdo);
+		LOG_TEST_RET(ctx, rv, "cannot parse SDO data");
+
+		LOG_FUNC_RETURN(ctx, rv);
+	}
+
 	sbuf[offs--] = 0x80;
 	sbuf[offs--] = sdo_tag & 0xFF;
 	if ((sdo_tag >> 8) & 0xFF)
@@ -2923,6 +3030,9 @@ iasecc_sdo_get_tagged_data(struct sc_card *card, int sdo_tag, struct iasecc_sdo
 	rv = sc_transmit_apdu(card, &apdu);
 	LOG_TEST_RET(ctx, rv, "APDU transmit failed");
 	rv = sc_check_sw(card, apdu.sw1, apdu.sw2);
+	/* 'no public data' is as stable as the data itself */
+	if (rv == SC_SUCCESS || rv == SC_ERROR_INCORRECT_PARAMETERS)
+		iasecc_sdo_cache_add(card, sdo_tag, sdo, rv, apdu.resp, apdu.resplen);
 	LOG_TEST_RET(ctx, rv, "SDO get data error");
 
 	rv = iasecc_sdo_parse(card, apdu.resp, apdu.resplen, sdo);
@@ -2971,6 +3081,8 @@ iasecc_sdo_generate(struct sc_card *card, struct iasecc_sdo *sdo)
 	if (sdo->docp.acls_contact.size == 0)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_DATA, "Bewildered ... there are no ACLs");
 
+	iasecc_sdo_cache_clear(card);
+
 	scb = sdo->docp.scbs[IASECC_ACLS_RSAKEY_GENERATE];
 	sc_log(ctx, "'generate RSA key' SCB 0x%X", scb);
 	do   {
@@ -3026,6 +3138,17 @@ iasecc_sdo_generate(struct sc_card *card, struct iasecc_sdo *sdo)
 }
 
 
+static int
+iasecc_card_reader_lock_obtained(struct sc_card *card, int was_reset)
+{
+	/* another application may have changed SDOs since our last transaction */
+	if (card->drv_data && card->cache.foreign_access)
+		iasecc_sdo_cache_clear(card);
+
+	return SC_SUCCESS;
+}
+
+
 static int
 iasecc_get_chv_reference_from_se(struct sc_card *card, int *se_reference)
 {
@@ -3649,6 +3772,7 @@ sc_get_driver(void)
 	/*	delete_record: Not implemented	*/
 
 	iasecc_ops.read_public_key = iasecc_read_public_key;
+	iasecc_ops.card_reader_lock_obtained = iasecc_card_reader_lock_obtained;
 
 	return &iasecc_drv;
 }
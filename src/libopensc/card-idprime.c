@@ -20,6 +20,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -69,14 +71,20 @@ typedef struct idprime_object {
 	unsigned short length;
 } idprime_object_t;
 
+/* a file read completely when it was first selected */
+typedef struct idprime_cached_file {
+	sc_path_t path;
+	sc_file_t *file;		/* FCI with the size of the uncompressed data */
+	u8 *data;			/* uncompressed file contents */
+	size_t data_len;
+} idprime_cached_file_t;
+
 /*
  * IDPrime private data per card state
  */
 typedef struct idprime_private_data {
-	u8 *cache_buf;			/* cached version of the currently selected file */
-	size_t cache_buf_len;		/* length of the cached selected file */
-	int cached;			/* is the cached selected file valid */
-	size_t file_size;		/* this is real file size since IDPrime is quite strict about lengths */
+	list_t cached_files;		/* files read from the card */
+	idprime_cached_file_t *current_file;	/* cached version of the currently selected file */
 	list_t pki_list;		/* list of pki containers */
 	idprime_object_t *pki_current;	/* current pki object _ctl function */
 	int tinfo_present;		/* Token Info Label object is present*/
@@ -88,9 +96,20 @@ static size_t idprime_list_meter(const void *el) {
 	return sizeof(idprime_object_t);
 }
 
+static size_t idprime_cached_file_meter(const void *el) {
+	return sizeof(idprime_cached_file_t);
+}
+
 void idprime_free_private_data(idprime_private_data_t *priv)
 {
-	free(priv->cache_buf);
+	idprime_cached_file_t *cached;
+
+	while ((cached = list_fetch(&priv->cached_files)) != NULL) {
+		sc_file_free(cached->file);
+		free(cached->data);
+		free(cached);
+	}
+	list_destroy(&priv->cached_files);
 	list_destroy(&priv->pki_list);
 	free(priv);
 	return;
@@ -106,7 +125,9 @@ idprime_private_data_t *idprime_new_private_data(void)
 
 	/* Initialize PKI Applets list */
 	if (list_init(&priv->pki_list) != 0 ||
-	    list_attributes_copy(&priv->pki_list, idprime_list_meter, 1) != 0) {
+	    list_attributes_copy(&priv->pki_list, idprime_list_meter, 1) != 0 ||
+	    list_init(&priv->cached_files) != 0 ||
+	    list_attributes_copy(&priv->cached_files, idprime_cached_file_meter, 1) != 0) {
 		idprime_free_private_data(priv);
 		return NULL;
 	}
@@ -156,6 +177,28 @@ static int idprime_select_index(sc_card_t *card)
 	return r;
 }
 
+/* Read the currently selected file with as few READ BINARY commands as
+ * the reader and card allow */
+static int idprime_read_file(sc_card_t *card, u8 *buf, size_t length)
+{
+	size_t max_le = sc_get_max_recv_size(card);
+	size_t done = 0;
+	int r;
+
+	while (done < length) {
+		r = iso_ops->read_binary(card, (unsigned int) done, buf + done,
+			MIN(max_le, length - done), 0);
+		if (r < 0) {
+			return r;
+		}
+		if (r == 0) {
+			break;
+		}
+		done += r;
+	}
+	return (int) done;
+}
+
 static int idprime_process_index(sc_card_t *card, idprime_private_data_t *priv, int length)
 {
 	u8 *buf = NULL;
@@ -168,7 +211,7 @@ static int idprime_process_index(sc_card_t *card, idprime_private_data_t *priv,
 		goto done;
 	}
 
-	r = iso_ops->read_binary(card, 0, buf, length, 0);
+	r = idprime_read_file(card, buf, length);
 	if (r < 1) {
 		r = SC_ERROR_WRONG_LENGTH;
 		goto done;
@@ -305,7 +348,7 @@ static int idprime_init(sc_card_t *card)
 	_sc_card_add_rsa_alg(card, 1024, flags, 0);
 	_sc_card_add_rsa_alg(card, 2048, flags, 0);
 
-	card->caps |= SC_CARD_CAP_ISO7816_PIN_INFO;
+	card->caps |= SC_CARD_CAP_ISO7816_PIN_INFO | SC_CARD_CAP_NEGOTIATE_APDU;
 
 	LOG_FUNC_RETURN(card->ctx, 0);
 }
@@ -488,33 +531,106 @@ static int idprime_card_ctl(sc_card_t *card, unsigned long cmd, void *ptr)
 
 #define HEADER_LEN 4
 
+/* Read the whole selected file, uncompress it if needed and remember it
+ * for further selections of the same path */
+static int idprime_cache_file(sc_card_t *card, const sc_path_t *path, sc_file_t *file)
+{
+	idprime_private_data_t * priv = card->drv_data;
+	idprime_cached_file_t cached;
+	u8 *raw = NULL;
+	int r;
+
+	memset(&cached, 0, sizeof(cached));
+	if (file->size == 0 || file->size > MAX_FILE_SIZE) {
+		/* leave this one to the plain read_binary() */
+		return SC_SUCCESS;
+	}
+	raw = malloc(file->size);
+	if (raw == NULL) {
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+	}
+	/* this is real file size since IDPrime is quite strict about lengths */
+	r = idprime_read_file(card, raw, file->size);
+	if (r < 0) {
+		free(raw);
+		LOG_FUNC_RETURN(card->ctx, r);
+	}
+
+	if (r >= HEADER_LEN && raw[0] == 0x01 && raw[1] == 0x00) {
+#ifdef ENABLE_ZLIB
+		size_t expectedsize = raw[2] + raw[3] * 0x100;
+		int rv = sc_decompress_alloc(&cached.data, &cached.data_len,
+			raw + HEADER_LEN, r - HEADER_LEN, COMPRESSION_AUTO);
+		free(raw);
+		if (rv != SC_SUCCESS) {
+			sc_log(card->ctx, "Zlib error: %d", rv);
+			LOG_FUNC_RETURN(card->ctx, rv);
+		}
+		if (cached.data_len != expectedsize) {
+			sc_log(card->ctx,
+				 "expected size: %"SC_FORMAT_LEN_SIZE_T"u real size: %"SC_FORMAT_LEN_SIZE_T"u",
+				 expectedsize, cached.data_len);
+			free(cached.data);
+			LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_DATA);
+		}
+		/* Fix the information in the file structure to not confuse upper layers */
+		file->size = expectedsize;
+#else
+		free(raw);
+		sc_log(card->ctx, "compression not supported, no zlib");
+		return SC_ERROR_NOT_SUPPORTED;
+#endif /* ENABLE_ZLIB */
+	} else {
+		/* assuming uncompressed certificate */
+		cached.data = raw;
+		cached.data_len = r;
+	}
+
+	cached.path = *path;
+	sc_file_dup(&cached.file, file);
+	if (cached.file == NULL || list_append(&priv->cached_files, &cached) < 0) {
+		sc_file_free(cached.file);
+		free(cached.data);
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+	}
+	priv->current_file = list_get_at(&priv->cached_files, list_size(&priv->cached_files) - 1);
+	return SC_SUCCESS;
+}
+
 static int idprime_select_file(sc_card_t *card, const sc_path_t *in_path, sc_file_t **file_out)
 {
-	int r, len;
+	int r;
+	unsigned int i;
 	idprime_private_data_t * priv = card->drv_data;
-	u8 data[HEADER_LEN];
-	size_t data_len = HEADER_LEN;
+	idprime_cached_file_t *cached;
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
-	/* forget any old cached values */
-	if (priv->cache_buf) {
-		free(priv->cache_buf);
-		priv->cache_buf = NULL;
+	priv->current_file = NULL;
+
+	/* files we already read are served from memory */
+	if (file_out != NULL) {
+		for (i = 0; i < list_size(&priv->cached_files); i++) {
+			cached = list_get_at(&priv->cached_files, i);
+			if (cached && sc_compare_path(&cached->path, in_path)) {
+				sc_file_dup(file_out, cached->file);
+				if (*file_out == NULL) {
+					LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+				}
+				priv->current_file = cached;
+				LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+			}
+		}
 	}
-	priv->cache_buf_len = 0;
-	priv->cached = 0;
 
 	r = iso_ops->select_file(card, in_path, file_out);
 	if (r == SC_SUCCESS && file_out != NULL) {
-		/* Try to read first bytes of the file to fix FCI in case of
-		 * compressed certififcate */
-		len = iso_ops->read_binary(card, 0, data, data_len, 0);
-		if (len == HEADER_LEN && data[0] == 0x01 && data[1] == 0x00) {
-			/* Cache the real file size for the caching read_binary() */
-			priv->file_size = (*file_out)->size;
-			/* Fix the information in the file structure to not confuse upper layers */
-			(*file_out)->size = (data[3]<<8) | data[2];
+		/* Read the file in one go, which also fixes the FCI in case
+		 * of compressed certificate */
+		r = idprime_cache_file(card, in_path, *file_out);
+		if (r != SC_SUCCESS) {
+			sc_file_free(*file_out);
+			*file_out = NULL;
 		}
 	}
 	/* Return the exit code of the select command */
@@ -526,61 +642,20 @@ static int idprime_read_binary(sc_card_t *card, unsigned int offset,
 	unsigned char *buf, size_t count, unsigned long flags)
 {
 	struct idprime_private_data *priv = card->drv_data;
-	int r;
+	idprime_cached_file_t *cached = priv->current_file;
 	int size;
 
 	sc_log(card->ctx, "called; %"SC_FORMAT_LEN_SIZE_T"u bytes at offset %d",
 		count, offset);
 
-	if (!priv->cached && offset == 0) {
-		// this function is called to read and uncompress the certificate
-		u8 buffer[SC_MAX_EXT_APDU_BUFFER_SIZE];
-		if (sizeof(buffer) < count) {
-			LOG_FUNC_RETURN(card->ctx, SC_ERROR_INTERNAL);
-		}
-		/* Read what was reported by FCI from select command */
-		r = iso_ops->read_binary(card, 0, buffer, priv->file_size, flags);
-		if (r < 0) {
-			LOG_FUNC_RETURN(card->ctx, r);
-		}
-		if (r < 4) {
-			LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_DATA);
-		}
-		if (buffer[0] == 1 && buffer[1] == 0) {
-#ifdef ENABLE_ZLIB
-			size_t expectedsize = buffer[2] + buffer[3] * 0x100;
-			r = sc_decompress_alloc(&priv->cache_buf, &(priv->cache_buf_len),
-				buffer+4, priv->file_size-4, COMPRESSION_AUTO);
-			if (r != SC_SUCCESS) {
-				sc_log(card->ctx, "Zlib error: %d", r);
-				LOG_FUNC_RETURN(card->ctx, r);
-			}
-			if (priv->cache_buf_len != expectedsize) {
-				sc_log(card->ctx,
-					 "expected size: %"SC_FORMAT_LEN_SIZE_T"u real size: %"SC_FORMAT_LEN_SIZE_T"u",
-					 expectedsize, priv->cache_buf_len);
-				LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_DATA);
-			}
-#else
-			sc_log(card->ctx, "compression not supported, no zlib");
-			return SC_ERROR_NOT_SUPPORTED;
-#endif /* ENABLE_ZLIB */
-		} else {
-			/* assuming uncompressed certificate */
-			priv->cache_buf = malloc(r);
-			if (priv->cache_buf == NULL) {
-				return SC_ERROR_OUT_OF_MEMORY;
-			}
-			memcpy(priv->cache_buf, buffer, r);
-			priv->cache_buf_len = r;
-		}
-		priv->cached = 1;
+	if (cached == NULL) {
+		return iso_ops->read_binary(card, offset, buf, count, flags);
 	}
-	if (offset >= priv->cache_buf_len) {
+	if (offset >= cached->data_len) {
 		return 0;
 	}
-	size = (int) MIN((priv->cache_buf_len - offset), count);
-	memcpy(buf, priv->cache_buf + offset, size);
+	size = (int) MIN((cached->data_len - offset), count);
+	memcpy(buf, cached->data + offset, size);
 	return size;
 }
 
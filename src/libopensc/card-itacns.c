@@ -26,6 +26,8 @@
  * http://www.cnipa.gov.it/html/docs/CNS%20Functional%20Specification%201.1.5_11012010.pdf
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #include "internal.h"
 #include "cardctl.h"
 #include "itacns.h"
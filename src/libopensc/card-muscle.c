@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -144,6 +146,29 @@ static void muscle_parse_acls(const sc_file_t* file, unsigned short* read_perm,
 	*delete_perm =  muscle_parse_singleAcl(sc_file_get_acl_entry(file, SC_AC_OP_DELETE));
 }
 
+/* Record a newly created object in the file system cache instead of listing
+ * all objects again; if the outcome is unknown the cache is dropped. */
+static int muscle_cache_created(mscfs_t *fs, msc_id objectId, int objectSize,
+		unsigned short read_perm, unsigned short write_perm,
+		unsigned short delete_perm, int r)
+{
+	mscfs_file_t file_data;
+
+	if(r < 0) {
+		mscfs_clear_cache(fs);
+		return r;
+	}
+	memset(&file_data, 0, sizeof file_data);
+	file_data.objectId = objectId;
+	file_data.size = objectSize;
+	file_data.read = read_perm;
+	file_data.write = write_perm;
+	file_data.delete = delete_perm;
+	if(mscfs_cache_add(fs, &file_data) < 0)
+		mscfs_clear_cache(fs);
+	return 0;
+}
+
 static int muscle_create_directory(sc_card_t *card, sc_file_t *file)
 {
 	mscfs_t *fs = MUSCLE_FS(card);
@@ -167,9 +192,7 @@ static int muscle_create_directory(sc_card_t *card, sc_file_t *file)
 
 	muscle_parse_acls(file, &read_perm, &write_perm, &delete_perm);
 	r = msc_create_object(card, objectId, objectSize, read_perm, write_perm, delete_perm);
-	mscfs_clear_cache(fs);
-	if(r >= 0) return 0;
-	return r;
+	return muscle_cache_created(fs, objectId, objectSize, read_perm, write_perm, delete_perm, r);
 }
 
 
@@ -191,9 +214,7 @@ static int muscle_create_file(sc_card_t *card, sc_file_t *file)
 
 	mscfs_lookup_local(fs, file->id, &objectId);
 	r = msc_create_object(card, objectId, objectSize, read_perm, write_perm, delete_perm);
-	mscfs_clear_cache(fs);
-	if(r >= 0) return 0;
-	return r;
+	return muscle_cache_created(fs, objectId, objectSize, read_perm, write_perm, delete_perm, r);
 }
 
 static int muscle_read_binary(sc_card_t *card, unsigned int idx, u8* buf, size_t count, unsigned long flags)
@@ -206,6 +227,8 @@ static int muscle_read_binary(sc_card_t *card, unsigned int idx, u8* buf, size_t
 
 	r = mscfs_check_selection(fs, -1);
 	if(r < 0) LOG_FUNC_RETURN(card->ctx, r);
+	if(fs->currentFileIndex < 0 || fs->currentFileIndex >= fs->cache.size)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_FILE_NOT_FOUND);
 	file = &fs->cache.array[fs->currentFileIndex];
 	objectId = file->objectId;
 	/* memcpy(objectId.id, file->objectId.id, 4); */
@@ -228,6 +251,8 @@ static int muscle_update_binary(sc_card_t *card, unsigned int idx, const u8* buf
 
 	r = mscfs_check_selection(fs, -1);
 	if(r < 0) LOG_FUNC_RETURN(card->ctx, r);
+	if(fs->currentFileIndex < 0 || fs->currentFileIndex >= fs->cache.size)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_FILE_NOT_FOUND);
 	file = &fs->cache.array[fs->currentFileIndex];
 
 	objectId = file->objectId;
@@ -253,8 +278,11 @@ static int muscle_update_binary(sc_card_t *card, unsigned int idx, const u8* buf
 		r = msc_update_object(card, objectId, 0, buffer, newFileSize);
 		if(r < 0) goto update_bin_free_buffer;
 		file->size = newFileSize;
+		file->read = file->write = file->delete = 0;
 update_bin_free_buffer:
 		free(buffer);
+		/* the object may be gone or only partially recreated */
+		if(r < 0) mscfs_clear_cache(fs);
 		LOG_FUNC_RETURN(card->ctx, r);
 	} else {
 		r = msc_update_object(card, objectId, idx, buf, count);
@@ -321,12 +349,20 @@ static int muscle_delete_file(sc_card_t *card, const sc_path_t *path_in)
 {
 	mscfs_t *fs = MUSCLE_FS(card);
 	mscfs_file_t *file_data = NULL;
-	int r = 0;
+	msc_id objectId;
+	int r = 0, ef, objectIndex;
 
-	r = mscfs_loadFileInfo(fs, path_in->value, path_in->len, &file_data, NULL);
+	r = mscfs_loadFileInfo(fs, path_in->value, path_in->len, &file_data, &objectIndex);
 	if(r < 0) SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE,r);
+	objectId = file_data->objectId;
+	ef = file_data->ef;
 	r = muscle_delete_mscfs_file(card, file_data);
-	mscfs_clear_cache(fs);
+	/* a failed or root deletion leaves an unknown set of objects behind */
+	if(r < 0 || objectIndex < 0
+			|| 0 == memcmp(objectId.id, "\x3F\x00\x3F\x00", 4))
+		mscfs_clear_cache(fs);
+	else
+		mscfs_cache_remove(fs, &objectId, ef);
 	if(r < 0) SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE,r);
 	return 0;
 }
@@ -832,6 +868,9 @@ static int muscle_card_reader_lock_obtained(sc_card_t *card, int was_reset)
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
 	if (was_reset > 0) {
+		/* another application may have changed the objects meanwhile */
+		if (card->drv_data)
+			mscfs_clear_cache(MUSCLE_FS(card));
 		if (msc_select_applet(card, muscleAppletId, sizeof muscleAppletId) != 1) {
 			r = SC_ERROR_INVALID_CARD;
 		}
@@ -851,6 +890,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	muscle_ops.check_sw = muscle_check_sw;
 	muscle_ops.pin_cmd = muscle_pin_cmd;
 	muscle_ops.match_card = muscle_match_card;
+	muscle_ops.match_atr_hints = sc_atr_hints_iso_application;
 	muscle_ops.init = muscle_init;
 	muscle_ops.finish = muscle_finish;
 
@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -1262,12 +1264,15 @@ static int myeid_transmit_decipher(struct sc_card *card, u8 p1, u8 p2,
 {
 	myeid_private_data_t *priv = card->drv_data;
 	struct sc_apdu apdu;
-	u8 rbuf[SC_MAX_EXT_APDU_BUFFER_SIZE];
-	u8 sbuf[SC_MAX_EXT_APDU_BUFFER_SIZE];
+	u8 *rbuf = NULL, *sbuf = NULL;
+	size_t rlen = 0;
 	int r;
 
 	LOG_FUNC_CALLED(card->ctx);
 
+	if (crgram_len + 1 > SC_MAX_EXT_APDU_BUFFER_SIZE)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_ARGUMENTS);
+
 	/* INS: 0x2A  PERFORM SECURITY OPERATION
 	 * P1:  0x00  Resp: No response (unwrapping)
 	 * P1:  0x80  Resp: Plain value
@@ -1275,8 +1280,9 @@ static int myeid_transmit_decipher(struct sc_card *card, u8 p1, u8 p2,
 	 * P2:  0x86  Cmd: Padding indicator byte followed by cryptogram */
 	sc_format_apdu(card, &apdu, p1 ? SC_APDU_CASE_4_SHORT : SC_APDU_CASE_3_SHORT, 0x2A, p1, p2);
 	if (p2 == 0x86) {
-		if (crgram_len+1 > sizeof(sbuf))
-			LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_ARGUMENTS);
+		sbuf = sc_card_get_buffer(card, crgram_len + 1);
+		if (sbuf == NULL)
+			LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
 		sbuf[0] = 0; /* Padding indicator: 0x00 = No further indication */
 		memcpy(sbuf + 1, crgram, crgram_len);
 		apdu.data = sbuf;
@@ -1286,8 +1292,16 @@ static int myeid_transmit_decipher(struct sc_card *card, u8 p1, u8 p2,
 		apdu.datalen = apdu.lc = crgram_len;
 	}
 	if (p1 != 0x00) {
+		/* the plain value is never longer than the cryptogram, but
+		 * leave room for whatever one response of the card holds */
+		rlen = MAX(crgram_len, sc_get_max_recv_size(card)) + 2;
+		rbuf = sc_card_get_buffer(card, rlen);
+		if (rbuf == NULL) {
+			sc_card_put_buffer(card, sbuf, crgram_len + 1);
+			LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+		}
 		apdu.resp = rbuf;
-		apdu.resplen = sizeof(rbuf);
+		apdu.resplen = rlen;
 		apdu.le = MIN(card->max_recv_size, crgram_len);
 	}
 
@@ -1297,17 +1311,21 @@ static int myeid_transmit_decipher(struct sc_card *card, u8 p1, u8 p2,
 		apdu.flags |= SC_APDU_FLAGS_CHAINING;
 		r = sc_transmit_apdu(card, &apdu);
 	}
-	LOG_TEST_RET(card->ctx, r, "APDU transmit failed");
-
-	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
-	LOG_TEST_RET(card->ctx, r, "DECIPHER returned error");
+	if (r == SC_SUCCESS)
+		r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 
-	if (out && outlen) {
-		outlen = MIN(apdu.resplen, outlen);
-		memcpy(out, apdu.resp, outlen);
-	} else {
-		outlen = 0;
+	if (r == SC_SUCCESS) {
+		if (out && outlen) {
+			outlen = MIN(apdu.resplen, outlen);
+			memcpy(out, apdu.resp, outlen);
+		} else {
+			outlen = 0;
+		}
 	}
+	if (sbuf != NULL)
+		sc_card_put_buffer(card, sbuf, crgram_len + 1);
+	sc_card_put_buffer(card, rbuf, rlen);
+	LOG_TEST_RET(card->ctx, r, "DECIPHER failed");
 	LOG_FUNC_RETURN(card->ctx, outlen);
 }
 
@@ -19,6 +19,9 @@
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -516,6 +519,19 @@ static int npa_pace_verify(struct sc_card *card,
 	}
 	npa_get_cached_pace_params(card, &pace_input, &pace_output);
 
+	/* Keep the channel that was established with the same secret, unless the
+	 * card dropped it meanwhile, e.g. because of an other application */
+	if (eac_pace_is_established(card, &pace_input)) {
+		if (SC_SUCCESS == sc_select_file(card, sc_get_mf_path(), NULL)) {
+			sc_log(card->ctx, "Reusing the established PACE channel.\n");
+			if (tries_left)
+				*tries_left = -1;
+			r = SC_SUCCESS;
+			goto err;
+		}
+		sc_sm_stop(card);
+	}
+
 	r = perform_pace(card, pace_input, &pace_output, EAC_TR_VERSION_2_02);
 
 	if (tries_left) {
@@ -580,6 +596,7 @@ static int npa_pace_verify(struct sc_card *card,
 	   }
 	}
 
+err:
 	npa_cache_or_free(card, &pace_output.ef_cardaccess,
 			&pace_output.ef_cardaccess_length, NULL, NULL);
 	free(pace_output.recent_car);
@@ -670,6 +687,9 @@ npa_reset_retry_counter(sc_card_t *card, enum s_type pin_id,
 	} else
 		r = sc_transmit_apdu(card, &apdu);
 
+	/* the secret of the current channel may not be valid any more */
+	eac_pace_clear_id(card);
+
 	if (p) {
 		sc_mem_clear(p, new_len);
 		free(p);
@@ -35,14 +35,22 @@
  * https://gnupg.org/ftp/specs/OpenPGP-smart-card-application-3.4.pdf
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #include "internal.h"
 #include "asn1.h"
@@ -121,6 +129,7 @@ static pgp_ec_curves_t	ec_curves_gnuk[] = {
 static int		pgp_get_card_features(sc_card_t *card);
 static int		pgp_finish(sc_card_t *card);
 static void		pgp_iterate_blobs(pgp_blob_t *, int, void (*func)());
+static void		pgp_prefetch_blobs(sc_card_t *card);
 
 static int		pgp_get_blob(sc_card_t *card, pgp_blob_t *blob,
 				 unsigned int id, pgp_blob_t **ret);
@@ -478,6 +487,9 @@ pgp_init(sc_card_t *card)
 		}
 	}
 
+	/* read the constructed DOs at once if configured */
+	pgp_prefetch_blobs(card);
+
 	/* get card_features from ATR & DOs */
 	pgp_get_card_features(card);
 
@@ -1056,6 +1068,25 @@ pgp_iterate_blobs(pgp_blob_t *blob, int level, void (*func)())
 }
 
 
+/**
+ * Internal: search the blobs below root that already have their contents,
+ * without accessing the card.
+ */
+static pgp_blob_t *
+pgp_find_cached_blob(pgp_blob_t *root, unsigned int id)
+{
+	pgp_blob_t *child, *found;
+
+	for (child = root->files; child; child = child->next) {
+		if (child->id == id && child->data != NULL)
+			return child;
+		if (child->files && (found = pgp_find_cached_blob(child, id)) != NULL)
+			return found;
+	}
+	return NULL;
+}
+
+
 /**
  * Internal: read a blob's contents from card.
  */
@@ -1074,6 +1105,14 @@ pgp_read_blob(sc_card_t *card, pgp_blob_t *blob)
 		size_t	buf_len = sizeof(buffer);
 		int r = SC_SUCCESS;
 
+		/* DOs like 5F52 are also part of a prefetched constructed DO */
+		if (priv->prefetch && blob->parent == priv->mf) {
+			pgp_blob_t *copy = pgp_find_cached_blob(priv->mf, blob->id);
+
+			if (copy != NULL)
+				return pgp_set_blob(blob, copy->data, copy->len);
+		}
+
 		/* buffer length for certificate */
 		if (blob->id == DO_CERT && priv->max_cert_size > 0) {
 			buf_len = MIN(priv->max_cert_size, sizeof(buffer));
@@ -1169,6 +1208,63 @@ pgp_enumerate_blob(sc_card_t *card, pgp_blob_t *blob)
 }
 
 
+/**
+ * Internal: enumerate a constructed blob and, from the data already read,
+ * all constructed blobs below it.
+ */
+static void
+pgp_enumerate_tree(sc_card_t *card, pgp_blob_t *blob)
+{
+	pgp_blob_t *child;
+
+	if (pgp_enumerate_blob(card, blob) < 0)
+		return;
+
+	for (child = blob->files; child; child = child->next)
+		if (child->data != NULL && child->id != DO_CERT
+				&& child->info && child->info->type == CONSTRUCTED)
+			pgp_enumerate_tree(card, child);
+}
+
+
+/**
+ * Internal: read the application related data (6E), cardholder related
+ * data (65) and security support template (7A) with one GET DATA each and
+ * build the blob tree from them, so that later lookups of the DOs within
+ * do not need to access the card. Also enables the cache of the public
+ * keys, see pgp_pubkey_cache_path().
+ */
+static void
+pgp_prefetch_blobs(sc_card_t *card)
+{
+	static const unsigned int tags[] = { 0x006e, DO_CARDHOLDER, 0x007a };
+	struct pgp_priv_data *priv = DRVDATA(card);
+	pgp_blob_t *child;
+	size_t i, j;
+
+	for (i = 0; card->ctx->conf_blocks[i]; i++) {
+		scconf_block **blocks = scconf_find_blocks(card->ctx->conf,
+				card->ctx->conf_blocks[i], "card_driver", "openpgp");
+		if (!blocks)
+			continue;
+		for (j = 0; blocks[j]; j++) {
+			priv->prefetch = scconf_get_bool(blocks[j],
+					"prefetch_data_objects", priv->prefetch);
+			priv->disk_cache = scconf_get_bool(blocks[j],
+					"use_file_caching", priv->disk_cache);
+		}
+		free(blocks);
+	}
+	if (!priv->prefetch)
+		return;
+
+	for (i = 0; i < sizeof tags / sizeof *tags; i++)
+		for (child = priv->mf->files; child; child = child->next)
+			if (child->id == tags[i])
+				pgp_enumerate_tree(card, child);
+}
+
+
 /**
  * Internal: find a blob by ID below a given parent, filling its contents when necessary.
  */
@@ -1223,6 +1319,12 @@ pgp_seek_blob(sc_card_t *card, pgp_blob_t *root, unsigned int id,
 	pgp_blob_t	*child;
 	int			r;
 
+	/* serve DOs of the prefetched tree without probing other DOs */
+	if (DRVDATA(card)->prefetch && (child = pgp_find_cached_blob(root, id)) != NULL) {
+		*ret = child;
+		return SC_SUCCESS;
+	}
+
 	if ((r = pgp_get_blob(card, root, id, ret)) == 0)
 		/* the sought blob is right under root */
 		return r;
@@ -1480,6 +1582,122 @@ pgp_read_binary(sc_card_t *card, unsigned int idx,
 }
 
 
+/**
+ * Internal: name of the file keeping a public key in the cache directory.
+ * The name contains the card's serial number and the fingerprint of the
+ * key (DO C5), a new key is read from the card again.
+ */
+static int
+pgp_pubkey_cache_path(sc_card_t *card, unsigned int tag, char *path, size_t path_len)
+{
+	pgp_blob_t *fp_blob;
+	size_t i, len, offset;
+	int r, empty = 1;
+
+	if (!DRVDATA(card)->disk_cache || card->serialnr.len == 0)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	/* fingerprints of the signature, decryption and authentication keys */
+	switch (tag) {
+	case DO_SIGN:	offset = 0;	break;
+	case DO_ENCR:	offset = 20;	break;
+	case DO_AUTH:	offset = 40;	break;
+	default:
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+	fp_blob = pgp_find_blob(card, 0x00C5);
+	if (fp_blob == NULL || fp_blob->data == NULL || fp_blob->len < offset + 20)
+		return SC_ERROR_NOT_SUPPORTED;
+	for (i = 0; i < 20; i++)
+		empty &= fp_blob->data[offset + i] == 0;
+	if (empty)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	r = sc_get_cache_dir(card->ctx, path, path_len);
+	if (r != SC_SUCCESS)
+		return r;
+	len = strlen(path);
+	r = snprintf(path + len, path_len - len, "%copenpgp-",
+#ifdef _WIN32
+			'\\');
+#else
+			'/');
+#endif
+	if (r < 0 || (size_t)r >= path_len - len)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	len += r;
+	if (path_len - len < 2 * card->serialnr.len + 2 * 20 + 7)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	sc_bin_to_hex(card->serialnr.value, card->serialnr.len, path + len, path_len - len, 0);
+	len = strlen(path);
+	snprintf(path + len, path_len - len, "-%04X-", tag);
+	len = strlen(path);
+	sc_bin_to_hex(fp_blob->data + offset, 20, path + len, path_len - len, 0);
+	return SC_SUCCESS;
+}
+
+
+/**
+ * Internal: read a public key from the cache directory.
+ */
+static int
+pgp_pubkey_cache_read(sc_card_t *card, unsigned int tag, u8 *buf, size_t buf_len)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	size_t len;
+	int c, r;
+
+	r = pgp_pubkey_cache_path(card, tag, path, sizeof path);
+	if (r != SC_SUCCESS)
+		return r;
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	len = fread(buf, 1, buf_len, f);
+	/* an empty or truncated file is read from the card again */
+	c = fgetc(f);
+	r = (len == 0 || c != EOF || ferror(f)) ? SC_ERROR_INVALID_DATA : (int)len;
+	fclose(f);
+	return r;
+}
+
+
+/**
+ * Internal: store a public key read from the card in the cache directory.
+ */
+static void
+pgp_pubkey_cache_write(sc_card_t *card, unsigned int tag, const u8 *buf, size_t buf_len)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	FILE *f;
+	int ok;
+
+	if (pgp_pubkey_cache_path(card, tag, path, sizeof path) != SC_SUCCESS)
+		return;
+
+	snprintf(tmp, sizeof tmp, "%s.%lu", path, (unsigned long)getpid());
+	f = fopen(tmp, "wb");
+	if (f == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(card->ctx) < 0)
+			return;
+		f = fopen(tmp, "wb");
+	}
+	if (f == NULL)
+		return;
+	ok = fwrite(buf, 1, buf_len, f) == buf_len;
+	if (fclose(f) != 0)
+		ok = 0;
+#ifdef _WIN32
+	if (!ok || !MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING))
+#else
+	if (!ok || rename(tmp, path) != 0)
+#endif
+		remove(tmp);
+}
+
+
 /**
  * Internal: get public key from card - as DF + sub-wEFs.
  */
@@ -1494,6 +1712,12 @@ pgp_get_pubkey(sc_card_t *card, unsigned int tag, u8 *buf, size_t buf_len)
 
 	sc_log(card->ctx, "called, tag=%04x\n", tag);
 
+	r = pgp_pubkey_cache_read(card, tag, buf, buf_len);
+	if (r > 0) {
+		sc_log(card->ctx, "public key %04X read from the cache directory", tag);
+		LOG_FUNC_RETURN(card->ctx, r);
+	}
+
 	sc_format_apdu(card, &apdu, apdu_case, 0x47, 0x81, 0);
 	apdu.lc = 2;
 	apdu.data = ushort2bebytes(idbuf, tag);
@@ -1508,6 +1732,9 @@ pgp_get_pubkey(sc_card_t *card, unsigned int tag, u8 *buf, size_t buf_len)
 	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 	LOG_TEST_RET(card->ctx, r, "Card returned error");
 
+	if (apdu.resplen > 0)
+		pgp_pubkey_cache_write(card, tag, buf, apdu.resplen);
+
 	LOG_FUNC_RETURN(card->ctx, (int)apdu.resplen);
 }
 
@@ -3465,6 +3692,7 @@ sc_get_openpgp_driver(void)
 
 	pgp_ops = *iso_ops;
 	pgp_ops.match_card	= pgp_match_card;
+	pgp_ops.match_atr_hints	= sc_atr_hints_iso_application;
 	pgp_ops.init		= pgp_init;
 	pgp_ops.finish		= pgp_finish;
 	pgp_ops.select_file	= pgp_select_file;
@@ -184,6 +184,9 @@ struct pgp_priv_data {
 	size_t			max_cert_size;
 	size_t			max_specialDO_size;
 
+	int			prefetch;	/* constructed DOs were read in pgp_init */
+	int			disk_cache;	/* public keys are kept in the cache directory */
+
 	sc_security_env_t	sec_env;
 };
 
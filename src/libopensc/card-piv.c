@@ -22,13 +22,17 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -185,6 +189,7 @@ typedef struct piv_private_data {
 	int object_test_verify; /* Can test this object to set verification state of card */
 	int yubico_version; /* 3 byte version number of NEO or Yubikey4  as integer */
 	unsigned int ccc_flags;	    /* From  CCC indicate if CAC card */
+	char disk_cache_key[17];    /* hash of CHUID and CCC, empty if objects are not cached on disk */
 } piv_private_data_t;
 
 #define PIV_DATA(card) ((piv_private_data_t*)card->drv_data)
@@ -485,10 +490,16 @@ static int piv_general_io(sc_card_t *card, int ins, int p1, int p2,
 	if (r != SC_SUCCESS)
 		LOG_FUNC_RETURN(card->ctx, r);
 
-	sc_format_apdu(card, &apdu,
-			recvbuf ? SC_APDU_CASE_4_SHORT: SC_APDU_CASE_3_SHORT,
-			ins, p1, p2);
-	apdu.flags |= SC_APDU_FLAGS_CHAINING;
+	if (!recvbuf && (card->caps & SC_CARD_CAP_APDU_EXT)
+			&& sendbuflen <= sc_get_max_send_size(card)) {
+		/* e.g. PUT DATA of a large object in one extended APDU */
+		sc_format_apdu(card, &apdu, SC_APDU_CASE_3, ins, p1, p2);
+	} else {
+		sc_format_apdu(card, &apdu,
+				recvbuf ? SC_APDU_CASE_4_SHORT: SC_APDU_CASE_3_SHORT,
+				ins, p1, p2);
+		apdu.flags |= SC_APDU_FLAGS_CHAINING;
+	}
 	apdu.lc = sendbuflen;
 	apdu.datalen = sendbuflen;
 	apdu.data = sendbuf;
@@ -644,26 +655,14 @@ err:
 
 static int piv_select_aid(sc_card_t* card, u8* aid, size_t aidlen, u8* response, size_t *responselen)
 {
-	sc_apdu_t apdu;
 	int r;
 
 	LOG_FUNC_CALLED(card->ctx);
 
-	sc_format_apdu(card, &apdu,
-		response == NULL ? SC_APDU_CASE_3_SHORT : SC_APDU_CASE_4_SHORT, 0xA4, 0x04, 0x00);
-	apdu.lc = aidlen;
-	apdu.data = aid;
-	apdu.datalen = aidlen;
-	apdu.resp = response;
-	apdu.resplen = responselen ? *responselen : 0;
-	apdu.le = response == NULL ? 0 : 256; /* could be 21  for fci */
-
-	r = sc_transmit_apdu(card, &apdu);
-	if (responselen)
-		*responselen = apdu.resplen;
+	r = sc_select_aid(card, aid, aidlen, response, responselen);
 	LOG_TEST_RET(card->ctx, r, "PIV select failed");
 
-	LOG_FUNC_RETURN(card->ctx, sc_check_sw(card, apdu.sw1, apdu.sw2));
+	LOG_FUNC_RETURN(card->ctx, r);
 }
 
 /* find the PIV AID on the card. If card->type already filled in,
@@ -902,6 +901,125 @@ err:
 }
 
 
+/*
+ * Objects that are public and do not change without the CHUID or CCC
+ * changing are kept in the OpenSC cache directory, so that other
+ * processes do not need to read the certificate containers again.
+ * An empty file records that the object is not on the card.
+ */
+#define PIV_DISK_CACHE_MAX	0x20000
+
+static int
+piv_disk_cache_path(sc_card_t *card, int enumtag, char *path, size_t path_len)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	size_t len;
+	int r;
+
+	if (priv->disk_cache_key[0] == '\0')
+		return SC_ERROR_NOT_SUPPORTED;
+	if (!(piv_objects[enumtag].flags & PIV_OBJECT_TYPE_CERT)
+			&& enumtag != PIV_OBJ_DISCOVERY
+			&& enumtag != PIV_OBJ_HISTORY
+			&& enumtag != PIV_OBJ_SEC_OBJ)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	r = sc_get_cache_dir(card->ctx, path, path_len);
+	if (r != SC_SUCCESS)
+		return r;
+	len = strlen(path);
+	r = snprintf(path + len, path_len - len, "%cpiv-%s-%02X%02X",
+#ifdef _WIN32
+			'\\',
+#else
+			'/',
+#endif
+			priv->disk_cache_key,
+			piv_objects[enumtag].containerid[0],
+			piv_objects[enumtag].containerid[1]);
+	if (r < 0 || (size_t)r >= path_len - len)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static int
+piv_disk_cache_read(sc_card_t *card, int enumtag, u8 **buf, size_t *buf_len)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	long size;
+	int r;
+
+	r = piv_disk_cache_path(card, enumtag, path, sizeof path);
+	if (r != SC_SUCCESS)
+		return r;
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	r = SC_ERROR_INVALID_DATA;
+	*buf = NULL;
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0
+			|| size > PIV_DISK_CACHE_MAX || fseek(f, 0, SEEK_SET) != 0)
+		goto out;
+	if (size > 0) {
+		*buf = malloc((size_t)size);
+		if (*buf == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto out;
+		}
+		if (fread(*buf, 1, (size_t)size, f) != (size_t)size) {
+			free(*buf);
+			*buf = NULL;
+			goto out;
+		}
+	}
+	*buf_len = (size_t)size;
+	r = SC_SUCCESS;
+out:
+	fclose(f);
+	return r;
+}
+
+static void
+piv_disk_cache_write(sc_card_t *card, int enumtag, const u8 *buf, size_t buf_len)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	FILE *f;
+	int ok;
+
+	if (piv_disk_cache_path(card, enumtag, path, sizeof path) != SC_SUCCESS)
+		return;
+
+	snprintf(tmp, sizeof tmp, "%s.%lu", path, (unsigned long)getpid());
+	f = fopen(tmp, "wb");
+	if (f == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(card->ctx) < 0)
+			return;
+		f = fopen(tmp, "wb");
+	}
+	if (f == NULL)
+		return;
+	ok = buf_len == 0 || fwrite(buf, 1, buf_len, f) == buf_len;
+	if (fclose(f) != 0)
+		ok = 0;
+#ifdef _WIN32
+	if (!ok || !MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING))
+#else
+	if (!ok || rename(tmp, path) != 0)
+#endif
+		remove(tmp);
+}
+
+static void
+piv_disk_cache_remove(sc_card_t *card, int enumtag)
+{
+	char path[PATH_MAX];
+
+	if (piv_disk_cache_path(card, enumtag, path, sizeof path) == SC_SUCCESS)
+		remove(path);
+}
+
 static int
 piv_get_cached_data(sc_card_t * card, int enumtag, u8 **buf, size_t *buf_len)
 {
@@ -951,11 +1069,28 @@ piv_get_cached_data(sc_card_t * card, int enumtag, u8 **buf, size_t *buf_len)
 		goto err;
 	}
 
+	if (piv_disk_cache_read(card, enumtag, &rbuf, &rbuflen) == SC_SUCCESS) {
+		sc_log(card->ctx, "#%d from disk cache, len=%"SC_FORMAT_LEN_SIZE_T"u",
+		       enumtag, rbuflen);
+		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
+		priv->obj_cache[enumtag].obj_len = rbuflen;
+		priv->obj_cache[enumtag].obj_data = rbuf;
+		if (rbuflen == 0) {
+			r = SC_ERROR_FILE_NOT_FOUND;
+			goto err;
+		}
+		*buf = rbuf;
+		*buf_len = rbuflen;
+		r = (int)rbuflen;
+		goto ok;
+	}
+
 	/* Not cached, try to get it, piv_get_data will allocate a buf */
 	sc_log(card->ctx, "get #%d",  enumtag);
 	rbuflen = 1;
 	r = piv_get_data(card, enumtag, &rbuf, &rbuflen);
 	if (r > 0) {
+		piv_disk_cache_write(card, enumtag, rbuf, r);
 		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
 		priv->obj_cache[enumtag].obj_len = r;
 		priv->obj_cache[enumtag].obj_data = rbuf;
@@ -976,6 +1111,7 @@ piv_get_cached_data(sc_card_t * card, int enumtag, u8 **buf, size_t *buf_len)
 			r = SC_ERROR_FILE_NOT_FOUND;
 			priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
 			priv->obj_cache[enumtag].obj_len = 0;
+			piv_disk_cache_write(card, enumtag, NULL, 0);
 		} else if ( r < 0) {
 			goto err;
 		}
@@ -1348,6 +1484,9 @@ static int piv_write_binary(sc_card_t *card, unsigned int idx,
 			r = piv_put_data(card, enumtag, priv->w_buf, priv->w_buf_len);
 			break;
 	}
+	/* the object changed, do not let other processes use the old copy */
+	piv_disk_cache_remove(card, enumtag);
+
 	/* if it worked, will cache it */
 	if (r >= 0 && priv->w_buf) {
 		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
@@ -3264,6 +3403,55 @@ static int piv_match_card_continued(sc_card_t *card)
 }
 
 
+/*
+ * Enable the disk cache if configured. The cache key is derived from the
+ * complete CHUID and CCC as read from the card, so a card that was
+ * re-issued or re-personalized does not use the objects of its past.
+ */
+static void piv_disk_cache_init(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	const int key_objs[] = { PIV_OBJ_CHUI, PIV_OBJ_CCC };
+	unsigned long long hash = 0xcbf29ce484222325ULL; /* FNV-1a */
+	int enabled = 0;
+	size_t i, j;
+
+	for (i = 0; card->ctx->conf_blocks[i]; i++) {
+		scconf_block **blocks = scconf_find_blocks(card->ctx->conf,
+				card->ctx->conf_blocks[i], "card_driver", "PIV-II");
+		if (!blocks)
+			continue;
+		for (j = 0; blocks[j]; j++)
+			enabled = scconf_get_bool(blocks[j], "use_file_caching", enabled);
+		free(blocks);
+	}
+	if (!enabled)
+		return;
+
+	for (i = 0; i < sizeof key_objs / sizeof *key_objs; i++) {
+		u8 *rbuf = NULL;
+		size_t rbuflen = 0;
+		int r = piv_get_cached_data(card, key_objs[i], &rbuf, &rbuflen);
+
+		if (r < 0) {
+			/* a CHUID is needed to tell the cards apart */
+			if (key_objs[i] == PIV_OBJ_CHUI) {
+				sc_log(card->ctx, "No CHUID, PIV objects are not cached");
+				return;
+			}
+			rbuflen = 0;
+		}
+		for (j = 0; j < rbuflen; j++) {
+			hash ^= rbuf[j];
+			hash *= 0x100000001b3ULL;
+		}
+		hash ^= 0xFF;
+		hash *= 0x100000001b3ULL;
+	}
+	snprintf(priv->disk_cache_key, sizeof priv->disk_cache_key, "%016llx", hash);
+	sc_log(card->ctx, "PIV objects are cached with key %s", priv->disk_cache_key);
+}
+
 static int piv_init(sc_card_t *card)
 {
 	int r = 0;
@@ -3333,6 +3521,18 @@ static int piv_init(sc_card_t *card)
 	 * may be set earlier or later then in the following code. 
 	 */
 
+	/* ISO 7816-4 third software function table in the historical bytes:
+	 * bit 0x40 of its third byte means "extended Lc and Le" */
+	if (card->reader->atr_info.hist_bytes_len > 1
+			&& card->reader->atr_info.hist_bytes[0] == 0x80u) {
+		size_t datalen;
+		const u8 *data = sc_compacttlv_find_tag(card->reader->atr_info.hist_bytes + 1,
+				card->reader->atr_info.hist_bytes_len - 1, 0x73, &datalen);
+
+		if (data != NULL && datalen >= 3 && (data[2] & 0x40))
+			card->caps |= SC_CARD_CAP_APDU_EXT;
+	}
+
 	sc_debug(card->ctx,SC_LOG_DEBUG_MATCH, "PIV_MATCH card->type:%d CI:%08x r:%d\n", card->type, priv->card_issues, r);
 	switch(card->type) {
 		case SC_CARD_TYPE_PIV_II_NEO:
@@ -3435,6 +3635,8 @@ static int piv_init(sc_card_t *card)
 	 * NIST 800-73-3 and NIST 800-73-2 so some older cards may 
 	 * not handle the request.
 	 */
+	piv_disk_cache_init(card);
+
 	piv_process_history(card);
 
 	piv_process_discovery(card);
@@ -3735,6 +3937,12 @@ static int piv_card_reader_lock_obtained(sc_card_t *card, int was_reset)
 		goto err;
 	}
 
+	/* nobody used the card since our last transaction */
+	if (was_reset <= 0 && !card->cache.foreign_access) {
+		r = 0;
+		goto err;
+	}
+
 	/* make sure our application is active */
 
 	/* first see if AID is active AID by reading discovery object '7E' */
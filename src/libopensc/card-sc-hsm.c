@@ -20,6 +20,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -828,6 +830,65 @@ static int sc_hsm_read_binary(sc_card_t *card,
 
 
 
+/*
+ * Read a complete EF by its file identifier. READ BINARY with odd INS takes
+ * the FID in P1/P2, so this saves the SELECT per file and fetches as much
+ * as the reader allows in each command.
+ */
+static int sc_hsm_read_ef(sc_card_t *card, sc_cardctl_sc_hsm_read_ef_t *params)
+{
+	sc_context_t *ctx = card->ctx;
+	sc_apdu_t apdu;
+	u8 cmdbuff[4];
+	size_t max_le = sc_get_max_recv_size(card);
+	size_t done = 0, chunk;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+
+	r = sc_lock(card);
+	LOG_TEST_RET(ctx, r, "sc_lock() failed");
+
+	while (done < params->len && done <= 0xffff) {
+		chunk = MIN(params->len - done, max_le);
+
+		cmdbuff[0] = 0x54;
+		cmdbuff[1] = 0x02;
+		cmdbuff[2] = (done >> 8) & 0xFF;
+		cmdbuff[3] = done & 0xFF;
+
+		sc_format_apdu(card, &apdu, SC_APDU_CASE_4, 0xB1, params->fid[0], params->fid[1]);
+		apdu.data = cmdbuff;
+		apdu.datalen = 4;
+		apdu.lc = 4;
+		apdu.le = chunk;
+		apdu.resplen = chunk;
+		apdu.resp = params->buf + done;
+
+		r = sc_transmit_apdu(card, &apdu);
+		if (r < 0)
+			break;
+		r = sc_check_sw(card, apdu.sw1, apdu.sw2);
+		if (r == SC_ERROR_FILE_END_REACHED)
+			r = SC_SUCCESS;
+		if (r < 0)
+			break;
+
+		done += apdu.resplen;
+		/* a short answer means we hit the end of the file */
+		if (apdu.resplen < chunk)
+			break;
+	}
+
+	sc_unlock(card);
+	LOG_TEST_RET(ctx, r, "Could not read EF");
+
+	params->len = done;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
+
 static int sc_hsm_write_ef(sc_card_t *card,
 			       int fid,
 			       unsigned int idx, const u8 *buf, size_t count)
@@ -1598,6 +1659,8 @@ static int sc_hsm_card_ctl(sc_card_t *card, unsigned long cmd, void *ptr)
 		return sc_hsm_wrap_key(card, (sc_cardctl_sc_hsm_wrapped_key_t *)ptr);
 	case SC_CARDCTL_SC_HSM_UNWRAP_KEY:
 		return sc_hsm_unwrap_key(card, (sc_cardctl_sc_hsm_wrapped_key_t *)ptr);
+	case SC_CARDCTL_SC_HSM_READ_EF:
+		return sc_hsm_read_ef(card, (sc_cardctl_sc_hsm_read_ef_t *)ptr);
 	}
 	return SC_ERROR_NOT_SUPPORTED;
 }
@@ -67,6 +67,7 @@ typedef struct sc_hsm_private_data {
 	u8 sopin[8];
 	u8 *EF_C_DevAut;
 	size_t EF_C_DevAut_len;
+	int file_cache_stale;		/* object list differs from the cached one */
 } sc_hsm_private_data_t;
 
 
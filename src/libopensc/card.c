@@ -29,10 +29,15 @@
 #endif
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "reader-tr03119.h"
 #include "internal.h"
 #include "asn1.h"
+#include "iso7816.h"
 #include "common/compat_strlcpy.h"
 
 #ifdef ENABLE_SM
@@ -123,6 +128,21 @@ void sc_format_apdu_ex(struct sc_apdu *apdu,
 	sc_format_apdu_cse_lc_le(apdu);
 }
 
+/* Ticket lock: sc_queue_take() hands out 'next', and the ticket equal to
+ * 'serving' has the turn. */
+struct sc_card_queue {
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+	unsigned long next;
+	unsigned long serving;
+	/* the holder of the turn has a lock on the card */
+	int locked;
+	/* the card lock of the previous holder waits for the next one */
+	int handed_over;
+};
+
 static sc_card_t * sc_card_new(sc_context_t *ctx)
 {
 	sc_card_t *card;
@@ -146,6 +166,18 @@ static sc_card_t * sc_card_new(sc_context_t *ctx)
 		return NULL;
 	}
 
+	card->queue = calloc(1, sizeof(struct sc_card_queue));
+	if (card->queue == NULL) {
+		sc_mutex_destroy(ctx, card->mutex);
+		free(card->ops);
+		free(card);
+		return NULL;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&((struct sc_card_queue *)card->queue)->mutex, NULL);
+	pthread_cond_init(&((struct sc_card_queue *)card->queue)->cond, NULL);
+#endif
+
 	card->type = -1;
 	card->app_count = -1;
 
@@ -154,13 +186,14 @@ static sc_card_t * sc_card_new(sc_context_t *ctx)
 
 static void sc_card_free(sc_card_t *card)
 {
+	int i;
+
 	sc_free_apps(card);
 	sc_free_ef_atr(card);
 
 	free(card->ops);
 
 	if (card->algorithms != NULL)   {
-		int i;
 		for (i=0; i<card->algorithm_count; i++)   {
 			struct sc_algorithm_info *info = (card->algorithms + i);
 			if (info->algorithm == SC_ALGORITHM_EC)   {
@@ -178,12 +211,26 @@ static void sc_card_free(sc_card_t *card)
 
 	sc_file_free(card->cache.current_ef);
 	sc_file_free(card->cache.current_df);
+	free(card->cache.read_ahead);
+	sc_file_free(card->cache.select_file);
+
+	for (i = 0; i < SC_CARD_BUFFERS; i++)
+		sc_mem_free(card->buffers[i].buf);
 
 	if (card->mutex != NULL) {
 		int r = sc_mutex_destroy(card->ctx, card->mutex);
 		if (r != SC_SUCCESS)
 			sc_log(card->ctx, "unable to destroy mutex");
 	}
+	if (card->queue != NULL) {
+#ifdef HAVE_PTHREAD
+		struct sc_card_queue *queue = card->queue;
+
+		pthread_cond_destroy(&queue->cond);
+		pthread_mutex_destroy(&queue->mutex);
+#endif
+		free(card->queue);
+	}
 	sc_mem_clear(card, sizeof(*card));
 	free(card);
 }
@@ -207,7 +254,7 @@ size_t sc_get_max_recv_size(const sc_card_t *card)
 
 	/*  Override card limitations with reader limitations. */
 	if (card->reader->max_recv_size != 0
-			&& (card->reader->max_recv_size < card->max_recv_size))
+			&& (card->reader->max_recv_size < max_recv_size))
 		max_recv_size = card->reader->max_recv_size;
 
 	return max_recv_size;
@@ -235,18 +282,392 @@ size_t sc_get_max_send_size(const sc_card_t *card)
 
 	/*  Override card limitations with reader limitations. */
 	if (card->reader->max_send_size != 0
-			&& (card->reader->max_send_size < card->max_send_size))
+			&& (card->reader->max_send_size < max_send_size))
 		max_send_size = card->reader->max_send_size;
 
 	return max_send_size;
 }
 
+u8 *sc_card_get_buffer(struct sc_card *card, size_t len)
+{
+	struct sc_card_buffer *slot = NULL;
+	size_t size;
+	int i;
+
+	if (card == NULL)
+		return NULL;
+
+	/* the buffers cover one negotiated C- or R-APDU plus a few bytes
+	 * for a padding indicator or the status word */
+	size = MAX(sc_get_max_send_size(card), sc_get_max_recv_size(card)) + 2;
+	if (len == 0 || len > size)
+		return sc_mem_alloc(card->ctx, SC_MEM_APDU, len ? len : 1);
+
+	if (sc_mutex_lock(card->ctx, card->mutex) != SC_SUCCESS)
+		return sc_mem_alloc(card->ctx, SC_MEM_APDU, len);
+	for (i = 0; i < SC_CARD_BUFFERS; i++) {
+		if (!card->buffers[i].busy) {
+			slot = &card->buffers[i];
+			break;
+		}
+	}
+	if (slot != NULL && slot->size < size) {
+		/* not used yet, or the limits grew since: the old content
+		 * has been cleared when the buffer was returned */
+		u8 *p = sc_mem_realloc(card->ctx, SC_MEM_APDU, slot->buf, size);
+		if (p == NULL) {
+			slot = NULL;
+		} else {
+			slot->buf = p;
+			slot->size = size;
+		}
+	}
+	if (slot != NULL)
+		slot->busy = 1;
+	sc_mutex_unlock(card->ctx, card->mutex);
+
+	return slot != NULL ? slot->buf : sc_mem_alloc(card->ctx, SC_MEM_APDU, len);
+}
+
+void sc_card_put_buffer(struct sc_card *card, u8 *buf, size_t used)
+{
+	int i;
+
+	if (buf == NULL)
+		return;
+	sc_mem_clear(buf, used);
+	if (card != NULL && sc_mutex_lock(card->ctx, card->mutex) == SC_SUCCESS) {
+		for (i = 0; i < SC_CARD_BUFFERS; i++) {
+			if (card->buffers[i].buf == buf && card->buffers[i].busy) {
+				card->buffers[i].busy = 0;
+				sc_mutex_unlock(card->ctx, card->mutex);
+				return;
+			}
+		}
+		sc_mutex_unlock(card->ctx, card->mutex);
+	}
+	sc_mem_free(buf);
+}
+
+/*
+ * Persistent memo of the driver that last accepted a given ATR in a given
+ * reader. It lives next to the PKCS#15 file cache and is only a hint: if
+ * the remembered driver does not accept the card, all drivers are probed.
+ * Each line of the file is "<ATR>\t<driver>\t<reader>".
+ */
+#define CARD_DRIVER_CACHE_FILE	"card_drivers"
+#define CARD_DRIVER_CACHE_LINE	(SC_MAX_ATR_SIZE * 2 + 512)
+
+static int card_driver_cache_filename(sc_context_t *ctx, char *buf, size_t bufsize)
+{
+	int r;
+
+	r = sc_get_cache_dir(ctx, buf, bufsize);
+	if (r != SC_SUCCESS)
+		return r;
+	if (strlen(buf) + sizeof(CARD_DRIVER_CACHE_FILE) + 1 > bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	strcat(buf, "/" CARD_DRIVER_CACHE_FILE);
+	return SC_SUCCESS;
+}
+
+/* Returns the length of the "<ATR>\t" prefix if the line is about the
+ * card's ATR and reader, 0 otherwise. */
+static size_t card_driver_cache_match(sc_card_t *card, const char *atr,
+		const char *line)
+{
+	const char *reader = card->reader->name ? card->reader->name : "";
+	const char *p;
+	size_t atr_len = strlen(atr);
+
+	if (strncmp(line, atr, atr_len) || line[atr_len] != '\t')
+		return 0;
+	p = strchr(line + atr_len + 1, '\t');
+	if (p == NULL || strcmp(p + 1, reader))
+		return 0;
+	return atr_len + 1;
+}
+
+static struct sc_card_driver *card_driver_cache_lookup(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	char fname[PATH_MAX], line[CARD_DRIVER_CACHE_LINE], *name, *end;
+	char atr[SC_MAX_ATR_SIZE * 2 + 1];
+	struct sc_card_driver *drv = NULL;
+	size_t offs, i;
+	FILE *f;
+
+	if (card_driver_cache_filename(ctx, fname, sizeof(fname)) != SC_SUCCESS)
+		return NULL;
+	sc_bin_to_hex(card->atr.value, card->atr.len, atr, sizeof(atr), 0);
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return NULL;
+
+	while (drv == NULL && fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		offs = card_driver_cache_match(card, atr, line);
+		if (offs == 0)
+			continue;
+		name = line + offs;
+		end = strchr(name, '\t');
+		if (end == NULL)
+			continue;
+		*end = '\0';
+		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+			if (!strcmp(ctx->card_drivers[i]->short_name, name)) {
+				drv = ctx->card_drivers[i];
+				break;
+			}
+		}
+	}
+	fclose(f);
+
+	return drv;
+}
+
+static void card_driver_cache_store(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	char fname[PATH_MAX], tmpname[PATH_MAX + 16], line[CARD_DRIVER_CACHE_LINE];
+	char atr[SC_MAX_ATR_SIZE * 2 + 1];
+	FILE *in, *out;
+	int r;
+
+	if (card_driver_cache_filename(ctx, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	sc_bin_to_hex(card->atr.value, card->atr.len, atr, sizeof(atr), 0);
+	snprintf(tmpname, sizeof(tmpname), "%s.%lu", fname, (unsigned long)getpid());
+
+	out = fopen(tmpname, "w");
+	if (out == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(ctx) < 0)
+			return;
+		out = fopen(tmpname, "w");
+	}
+	if (out == NULL)
+		return;
+
+	/* Keep the memo of other cards and readers */
+	in = fopen(fname, "r");
+	if (in != NULL) {
+		while (fgets(line, sizeof(line), in) != NULL) {
+			line[strcspn(line, "\r\n")] = '\0';
+			if (line[0] != '\0' && card_driver_cache_match(card, atr, line) == 0)
+				fprintf(out, "%s\n", line);
+		}
+		fclose(in);
+	}
+	fprintf(out, "%s\t%s\t%s\n", atr, card->driver->short_name,
+			card->reader->name ? card->reader->name : "");
+
+	r = ferror(out);
+	if (fclose(out) != 0 || r) {
+		unlink(tmpname);
+		return;
+	}
+#ifdef _WIN32
+	remove(fname);
+#endif
+	if (rename(tmpname, fname) != 0) {
+		sc_log(ctx, "failed to update %s", fname);
+		unlink(tmpname);
+	}
+}
+
+/* Returns 1 if the driver took the card, 0 if it did not and a negative
+ * error code if its initialization failed fatally. */
+static int connect_try_driver(sc_card_t *card, struct sc_card_driver *drv,
+		const struct sc_atr_hints *hints)
+{
+	sc_context_t *ctx = card->ctx;
+	const struct sc_card_operations *ops;
+	int r;
+
+	if (_sc_load_card_driver(ctx, drv) != SC_SUCCESS)
+		return 0;
+	ops = drv->ops;
+	sc_log(ctx, "trying driver '%s'", drv->short_name);
+	if (ops == NULL || ops->match_card == NULL)   {
+		return 0;
+	}
+	else if (!(ctx->flags & SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER)
+			&& !strcmp("default", drv->short_name))   {
+		sc_log(ctx , "ignore 'default' card driver");
+		return 0;
+	}
+	else if (ops->match_atr_hints != NULL && !ops->match_atr_hints(card, hints))   {
+		sc_log(ctx, "driver '%s' excluded by the ATR", drv->short_name);
+		return 0;
+	}
+
+	/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
+	*card->ops = *ops;
+	if (ops->match_card(card) != 1)
+		return 0;
+	sc_log(ctx, "matched: %s", drv->name);
+	SC_PROBE2(card_match, card, drv->short_name);
+	memcpy(card->ops, ops, sizeof(struct sc_card_operations));
+	card->driver = drv;
+	r = ops->init(card);
+	SC_PROBE3(card_init_done, card, r, drv->short_name);
+	if (r) {
+		sc_log(ctx, "driver '%s' init() failed: %s", drv->name, sc_strerror(r));
+		card->driver = NULL;
+		if (r == SC_ERROR_INVALID_CARD)
+			return 0;
+		return r;
+	}
+	return 1;
+}
+
+/*
+ * Find a compact-TLV data object of the historical bytes (ISO 7816-4)
+ */
+static const u8 *sc_hist_bytes_find_tag(const sc_reader_t *reader, u8 tag,
+		size_t *outlen)
+{
+	const u8 *hist = reader->atr_info.hist_bytes;
+	size_t hist_len = reader->atr_info.hist_bytes_len;
+
+	if (hist == NULL || hist_len < 2)
+		return NULL;
+
+	/* category indicator 0x00 ends with three status bytes, 0x10 carries
+	 * a DIR data reference, 0x80 is followed by compact-TLV only */
+	switch (hist[0]) {
+	case 0x00:
+		if (hist_len <= 4)
+			return NULL;
+		return sc_compacttlv_find_tag(hist + 1, hist_len - 4, tag, outlen);
+	case 0x10:
+		return sc_compacttlv_find_tag(hist + 2, hist_len - 2, tag, outlen);
+	case 0x80:
+		return sc_compacttlv_find_tag(hist + 1, hist_len - 1, tag, outlen);
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Card capabilities from the third software function table (tag 0x73) of
+ * the compact-TLV historical bytes (ISO 7816-4).
+ */
+static int sc_hist_bytes_card_capabilities(const sc_reader_t *reader)
+{
+	const u8 *caps;
+	size_t caps_len;
+
+	caps = sc_hist_bytes_find_tag(reader, 0x73, &caps_len);
+	if (caps == NULL || caps_len < 3)
+		return 0;
+	return caps[2];
+}
+
+static void sc_parse_atr_hints(const sc_reader_t *reader, struct sc_atr_hints *hints)
+{
+	/* PC/SC part 3: storage cards are announced with this RID */
+	static const u8 pcsc_storage_rid[] = { 0xA0, 0x00, 0x00, 0x03, 0x06 };
+
+	memset(hints, 0, sizeof *hints);
+	hints->category = -1;
+	if (reader->atr_info.hist_bytes == NULL || reader->atr_info.hist_bytes_len == 0)
+		return;
+
+	hints->category = reader->atr_info.hist_bytes[0];
+	hints->aid = sc_hist_bytes_find_tag(reader, 0x40, &hints->aid_len);
+	if (hints->aid != NULL && hints->aid_len >= sizeof pcsc_storage_rid
+			&& !memcmp(hints->aid, pcsc_storage_rid, sizeof pcsc_storage_rid))
+		hints->storage_card = 1;
+}
+
+int sc_atr_hints_iso_application(struct sc_card *card, const struct sc_atr_hints *hints)
+{
+	if (hints == NULL)
+		return 1;
+	/* memory cards behind a contactless reader know no SELECT */
+	if (hints->storage_card)
+		return 0;
+	return 1;
+}
+
+static void sc_card_negotiate_apdu_size(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	int caps = sc_hist_bytes_card_capabilities(card->reader);
+
+	if ((caps & ISO7816_CAP_EXTENDED_LENGTH_INFO) && card->ef_atr == NULL
+			&& sc_parse_ef_atr(card) != SC_SUCCESS)
+		sc_log(ctx, "EF.ATR/INFO announced but not readable");
+	if (card->ef_atr != NULL)
+		caps |= card->ef_atr->card_capabilities;
+
+	/* T=0 cannot carry extended APDUs without ENVELOPE */
+	if ((caps & ISO7816_CAP_EXTENDED_LENGTH)
+			&& card->reader->active_protocol != SC_PROTO_T0)
+		card->caps |= SC_CARD_CAP_APDU_EXT;
+
+	if (card->ef_atr != NULL) {
+		if (card->max_send_size == 0 && card->ef_atr->max_command_apdu > 0)
+			card->max_send_size = card->ef_atr->max_command_apdu;
+		if (card->max_recv_size == 0 && card->ef_atr->max_response_apdu > 0)
+			card->max_recv_size = card->ef_atr->max_response_apdu;
+	}
+
+	sc_log(ctx, "negotiated APDU sizes: extended length %s, card limits %"SC_FORMAT_LEN_SIZE_T"u/%"SC_FORMAT_LEN_SIZE_T"u",
+			(card->caps & SC_CARD_CAP_APDU_EXT) ? "yes" : "no",
+			card->max_send_size, card->max_recv_size);
+}
+
+struct sc_aid_probe {
+	struct sc_aid aid;
+	u8 sw1, sw2;
+	/* FCI returned by a successful SELECT with P2 = 00, if any */
+	u8 *fci;
+	size_t fci_len;
+	int fci_known;
+	struct sc_aid_probe *next;
+};
+
+struct sc_aid_probe_cache {
+	struct sc_aid_probe *entries;
+	/* application selected by the last SELECT, NULL if unknown */
+	struct sc_aid_probe *current;
+};
+
+static void sc_aid_probe_free(sc_card_t *card)
+{
+	struct sc_aid_probe *probe, *next;
+
+	if (card->aid_probe == NULL)
+		return;
+	for (probe = card->aid_probe->entries; probe != NULL; probe = next) {
+		next = probe->next;
+		free(probe->fci);
+		free(probe);
+	}
+	free(card->aid_probe);
+	card->aid_probe = NULL;
+}
+
+static struct sc_aid_probe *sc_aid_probe_find(sc_card_t *card,
+		const u8 *aid, size_t aidlen)
+{
+	struct sc_aid_probe *probe;
+
+	for (probe = card->aid_probe->entries; probe != NULL; probe = probe->next)
+		if (probe->aid.len == aidlen && memcmp(probe->aid.value, aid, aidlen) == 0)
+			return probe;
+	return NULL;
+}
+
 int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 {
 	sc_card_t *card;
 	sc_context_t *ctx;
 	struct sc_card_driver *driver;
-	int i, r = 0, idx, connected = 0;
+	unsigned long long apdus;
+	int i, r = 0, idx, connected = 0, locked = 0;
 
 	if (card_out == NULL || reader == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -254,6 +675,7 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
 	if (reader->ops->connect == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
+	apdus = sc_stats_reader_apdus(reader);
 
 	card = sc_card_new(ctx);
 	if (card == NULL)
@@ -271,6 +693,13 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 
 	memcpy(&card->atr, &reader->atr, sizeof(card->atr));
 	memcpy(&card->uid, &reader->uid, sizeof(card->uid));
+	/* the probe cache is shared by all drivers tried below, which is
+	 * why it is allocated before the card object is first copied. The
+	 * card stays locked while probing, so that no other application can
+	 * select another application behind the back of the cache. */
+	card->aid_probe = calloc(1, sizeof *card->aid_probe);
+	if (card->aid_probe != NULL && sc_lock(card) == SC_SUCCESS)
+		locked = 1;
 
 	_sc_parse_atr(reader);
 
@@ -303,15 +732,20 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 
 	if (driver != NULL) {
 		/* Forced driver, or matched via ATR mapping from config file */
+		r = _sc_load_card_driver(ctx, driver);
+		if (r < 0)
+			goto err;
 		card->driver = driver;
 
 		memcpy(card->ops, card->driver->ops, sizeof(struct sc_card_operations));
 		if (card->ops->match_card != NULL)
 			if (card->ops->match_card(card) != 1)
 				sc_log(ctx, "driver '%s' match_card() failed: %s (will continue anyway)", card->driver->name, sc_strerror(r));
+		SC_PROBE2(card_match, card, driver->short_name);
 
 		if (card->ops->init != NULL) {
 			r = card->ops->init(card);
+			SC_PROBE3(card_init_done, card, r, driver->short_name);
 			if (r) {
 				sc_log(ctx, "driver '%s' init() failed: %s", card->driver->name, sc_strerror(r));
 				goto err;
@@ -320,8 +754,25 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	}
 	else {
 		sc_card_t uninitialized = *card;
-		sc_log(ctx, "matching built-in ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		struct sc_card_driver *cached = NULL;
+		struct sc_atr_hints hints;
+
+		sc_parse_atr_hints(reader, &hints);
+
+		if (ctx->flags & SC_CTX_FLAG_CACHE_CARD_DRIVER)
+			cached = card_driver_cache_lookup(card);
+		if (cached != NULL) {
+			sc_log(ctx, "trying cached driver '%s'", cached->short_name);
+			r = connect_try_driver(card, cached, &hints);
+			if (r < 0)
+				goto err;
+			if (r == 0)
+				*card = uninitialized;
+		}
+
+		if (card->driver == NULL)
+			sc_log(ctx, "matching built-in ATRs");
+		for (i = 0; card->driver == NULL && ctx->card_drivers[i] != NULL; i++) {
 			/* FIXME If we had a clean API description, we'd propably get a
 			 * cleaner implementation of the driver's match_card and init,
 			 * which should normally *not* modify the card object if
@@ -335,37 +786,15 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 			 * `match_card()` and `init()`) */
 			*card = uninitialized;
 
-			struct sc_card_driver *drv = ctx->card_drivers[i];
-			const struct sc_card_operations *ops = drv->ops;
-
-			sc_log(ctx, "trying driver '%s'", drv->short_name);
-			if (ops == NULL || ops->match_card == NULL)   {
-				continue;
-			}
-			else if (!(ctx->flags & SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER)
-				   	&& !strcmp("default", drv->short_name))   {
-				sc_log(ctx , "ignore 'default' card driver");
-				continue;
-			}
-
-			/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
-			*card->ops = *ops;
-			if (ops->match_card(card) != 1)
+			if (ctx->card_drivers[i] == cached)
 				continue;
-			sc_log(ctx, "matched: %s", drv->name);
-			memcpy(card->ops, ops, sizeof(struct sc_card_operations));
-			card->driver = drv;
-			r = ops->init(card);
-			if (r) {
-				sc_log(ctx, "driver '%s' init() failed: %s", drv->name, sc_strerror(r));
-				if (r == SC_ERROR_INVALID_CARD) {
-					card->driver = NULL;
-					continue;
-				}
+			r = connect_try_driver(card, ctx->card_drivers[i], &hints);
+			if (r < 0)
 				goto err;
-			}
-			break;
+			if (r > 0 && (ctx->flags & SC_CTX_FLAG_CACHE_CARD_DRIVER))
+				card_driver_cache_store(card);
 		}
+		r = 0;
 	}
 	if (card->driver == NULL) {
 		sc_log(ctx, "unable to find driver for inserted card");
@@ -375,6 +804,9 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	if (card->name == NULL)
 		card->name = card->driver->name;
 
+	if (card->caps & SC_CARD_CAP_NEGOTIATE_APDU)
+		sc_card_negotiate_apdu_size(card);
+
 	/* initialize max_send_size/max_recv_size to a meaningful value */
 	card->max_recv_size = sc_get_max_recv_size(card);
 	card->max_send_size = sc_get_max_send_size(card);
@@ -392,14 +824,23 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 		goto err;
 	}
 #endif
+	if (locked)
+		sc_unlock(card);
+	sc_aid_probe_free(card);
 	*card_out = card;
+	sc_stats_operation(reader, &ctx->stats.connect, apdus);
 
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 err:
+	if (locked)
+		sc_unlock(card);
 	if (connected)
 		reader->ops->disconnect(reader);
-	if (card != NULL)
+	if (card != NULL) {
+		sc_aid_probe_free(card);
 		sc_card_free(card);
+	}
+	sc_stats_operation(reader, &ctx->stats.connect, apdus);
 	LOG_FUNC_RETURN(ctx, r);
 }
 
@@ -413,6 +854,7 @@ int sc_disconnect_card(sc_card_t *card)
 	ctx = card->ctx;
 	LOG_FUNC_CALLED(ctx);
 
+	sc_async_flush(card);
 	if (card->lock_count != 0)
 		return SC_ERROR_NOT_ALLOWED;
 	if (card->ops->finish) {
@@ -451,6 +893,9 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 
 	r = card->reader->ops->reset(card->reader, do_cold_reset);
 	sc_invalidate_cache(card);
+	card->pin_events++;
+	if (r == SC_SUCCESS)
+		sc_sm_session_lost(card);
 
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
@@ -461,20 +906,45 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 	return r;
 }
 
+int sc_card_reinit_after_fork(sc_card_t *card)
+{
+	int r;
+
+	if (card == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(card->ctx);
+
+	/* see sc_ctx_reinit_after_fork() */
+	card->mutex = NULL;
+	r = sc_mutex_create(card->ctx, &card->mutex);
+	LOG_TEST_RET(card->ctx, r, "Cannot create card mutex");
+
+	/* the transactions of the parent ended with its PC/SC handle */
+	card->lock_count = 0;
+	sc_invalidate_cache(card);
+
+	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+}
+
 int sc_lock(sc_card_t *card)
 {
 	int r = 0, r2 = 0;
 	int was_reset = 0;
 	int reader_lock_obtained  = 0;
+	unsigned long long start;
 
 	if (card == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
 	LOG_FUNC_CALLED(card->ctx);
+	SC_PROBE1(lock_start, card);
+	start = sc_stats_now();
 
 	r = sc_mutex_lock(card->ctx, card->mutex);
-	if (r != SC_SUCCESS)
+	if (r != SC_SUCCESS) {
+		SC_PROBE3(lock_done, card, r, card->lock_count);
 		return r;
+	}
 	if (card->lock_count == 0) {
 		if (card->reader->ops->lock != NULL) {
 			r = card->reader->ops->lock(card->reader);
@@ -487,15 +957,23 @@ int sc_lock(sc_card_t *card)
 			if (r == 0)
 				reader_lock_obtained = 1;
 		}
-		if (r == 0)
+		if (r == 0) {
 			card->cache.valid = 1;
+			card->cache.foreign_access = was_reset > 0
+				|| !(card->reader->flags & SC_READER_LOCK_KEPT);
+			if (card->cache.foreign_access && card->aid_probe)
+				card->aid_probe->current = NULL;
+		}
 	}
 	if (r == 0)
 		card->lock_count++;
 
 	if (r == 0 && was_reset > 0) {
+		card->pin_events++;
 #ifdef ENABLE_SM
-		if (card->sm_ctx.ops.open)
+		if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT)
+			sc_sm_session_lost(card);
+		else if (card->sm_ctx.ops.open)
 			card->sm_ctx.ops.open(card);
 #endif
 	}
@@ -505,11 +983,14 @@ int sc_lock(sc_card_t *card)
 		sc_log(card->ctx, "unable to release card->mutex lock");
 		r = r != SC_SUCCESS ? r : r2;
 	}
+	if (reader_lock_obtained)
+		sc_stats_timing(card->ctx, &card->ctx->stats.lock_wait, start);
 
 	/* give card driver a chance to do something when reader lock first obtained */
 	if (r == 0 && reader_lock_obtained == 1  && card->ops->card_reader_lock_obtained)
 		r = card->ops->card_reader_lock_obtained(card, was_reset);
 
+	SC_PROBE3(lock_done, card, r, card->lock_count);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -530,6 +1011,8 @@ int sc_unlock(sc_card_t *card)
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 	if (--card->lock_count == 0) {
+		/* another process may select files before the next lock */
+		sc_select_cache_drop(card);
 		if (card->flags & SC_CARD_FLAG_KEEP_ALIVE) {
 			/* Multiple processes accessing the card will most likely render
 			 * the card cache useless. To not have a bad cache, we explicitly
@@ -546,9 +1029,88 @@ int sc_unlock(sc_card_t *card)
 		r = (r == SC_SUCCESS) ? r2 : r;
 	}
 
+	SC_PROBE2(unlock, card, card->lock_count);
+	return r;
+}
+
+int sc_queue_take(sc_card_t *card, unsigned long *ticket)
+{
+	struct sc_card_queue *queue;
+
+	if (card == NULL || card->queue == NULL || ticket == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	queue = card->queue;
+	sc_stats_queue(card->ctx, 1);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&queue->mutex);
+#endif
+	*ticket = queue->next++;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&queue->mutex);
+#endif
+
+	return SC_SUCCESS;
+}
+
+int sc_queue_wait(sc_card_t *card, unsigned long ticket)
+{
+	struct sc_card_queue *queue;
+	unsigned long long start;
+	int handed_over, r;
+
+	if (card == NULL || card->queue == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	queue = card->queue;
+	start = sc_stats_now();
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->serving != ticket)
+		pthread_cond_wait(&queue->cond, &queue->mutex);
+#endif
+	handed_over = queue->handed_over;
+	queue->handed_over = 0;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&queue->mutex);
+#endif
+	sc_stats_queue(card->ctx, -1);
+	sc_stats_timing(card->ctx, &card->ctx->stats.queue_wait, start);
+
+	/* only the holder of the turn touches 'locked' */
+	r = handed_over ? SC_SUCCESS : sc_lock(card);
+	queue->locked = r == SC_SUCCESS;
+
 	return r;
 }
 
+int sc_queue_leave(sc_card_t *card)
+{
+	struct sc_card_queue *queue;
+	int locked;
+
+	if (card == NULL || card->queue == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	queue = card->queue;
+	locked = queue->locked;
+	queue->locked = 0;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&queue->mutex);
+#endif
+	queue->serving++;
+	/* keep the reader transaction open for the next in line */
+	queue->handed_over = locked && queue->serving != queue->next;
+	if (queue->handed_over)
+		locked = 0;
+#ifdef HAVE_PTHREAD
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->mutex);
+#endif
+
+	return locked ? sc_unlock(card) : SC_SUCCESS;
+}
+
 int sc_list_files(sc_card_t *card, u8 *buf, size_t buflen)
 {
 	int r;
@@ -616,13 +1178,251 @@ int sc_delete_file(sc_card_t *card, const sc_path_t *path)
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
-int sc_read_binary(sc_card_t *card, unsigned int idx,
-		   unsigned char *buf, size_t count, unsigned long flags)
+static void sc_drop_read_ahead(sc_card_t *card)
+{
+	free(card->cache.read_ahead);
+	card->cache.read_ahead = NULL;
+	card->cache.read_ahead_len = 0;
+	card->cache.read_ahead_size = 0;
+}
+
+void sc_select_cache_drop(sc_card_t *card)
+{
+	card->cache.select_valid = 0;
+	sc_file_free(card->cache.select_file);
+	card->cache.select_file = NULL;
+}
+
+/* Only paths that do not depend on the current DF can be compared */
+static int sc_select_cacheable(const sc_path_t *path)
+{
+	if (path->type == SC_PATH_TYPE_DF_NAME)
+		return path->len > 0;
+	if (path->type == SC_PATH_TYPE_PATH)
+		return path->len >= 2 && path->value[0] == 0x3F && path->value[1] == 0x00;
+	return 0;
+}
+
+static int sc_select_cache_match(sc_card_t *card, const sc_path_t *path, sc_file_t **file)
+{
+	const sc_path_t *cached = &card->cache.select_path;
+
+	if (!(card->ctx->flags & SC_CTX_FLAG_SELECT_CACHE) || !card->cache.select_valid
+			|| card->lock_count == 0)
+		return 0;
+	if (path->type != cached->type || path->len != cached->len
+			|| memcmp(path->value, cached->value, path->len) != 0
+			|| path->aid.len != cached->aid.len
+			|| memcmp(path->aid.value, cached->aid.value, path->aid.len) != 0
+			|| path->index != cached->index || path->count != cached->count)
+		return 0;
+	if (file == NULL)
+		return 1;
+	if (card->cache.select_file == NULL)
+		return 0;
+	sc_file_dup(file, card->cache.select_file);
+	return *file != NULL;
+}
+
+static void sc_select_cache_store(sc_card_t *card, const sc_path_t *path, sc_file_t *file)
+{
+	if (!(card->ctx->flags & SC_CTX_FLAG_SELECT_CACHE) || card->lock_count == 0
+			|| !sc_select_cacheable(path))
+		return;
+	card->cache.select_path = *path;
+	if (file)
+		sc_file_dup(&card->cache.select_file, file);
+	card->cache.select_valid = 1;
+}
+
+void sc_aid_probe_note(sc_card_t *card, const sc_apdu_t *apdu, int r)
+{
+	struct sc_aid_probe_cache *cache = card->aid_probe;
+	struct sc_aid_probe *probe;
+
+	if (r != SC_SUCCESS) {
+		/* the card may have been reset */
+		cache->current = NULL;
+		return;
+	}
+	if (apdu->ins != 0xA4)
+		return;
+	/* any other SELECT may leave the application */
+	cache->current = NULL;
+	if (apdu->p1 != 0x04 || (apdu->p2 & 0x03) != 0
+			|| apdu->datalen == 0 || apdu->datalen > SC_MAX_AID_SIZE)
+		return;
+
+	probe = sc_aid_probe_find(card, apdu->data, apdu->datalen);
+	if (probe == NULL) {
+		probe = calloc(1, sizeof *probe);
+		if (probe == NULL)
+			return;
+		memcpy(probe->aid.value, apdu->data, apdu->datalen);
+		probe->aid.len = apdu->datalen;
+		probe->next = cache->entries;
+		cache->entries = probe;
+	}
+	probe->sw1 = apdu->sw1;
+	probe->sw2 = apdu->sw2;
+	if (apdu->sw1 != 0x90 || apdu->sw2 != 0x00)
+		return;
+
+	cache->current = probe;
+	if (apdu->p2 == 0x00 && apdu->resp != NULL && apdu->le != 0) {
+		free(probe->fci);
+		probe->fci = NULL;
+		probe->fci_len = 0;
+		probe->fci_known = 0;
+		if (apdu->resplen > 0) {
+			probe->fci = malloc(apdu->resplen);
+			if (probe->fci == NULL)
+				return;
+			memcpy(probe->fci, apdu->resp, apdu->resplen);
+		}
+		probe->fci_len = apdu->resplen;
+		probe->fci_known = 1;
+	}
+}
+
+/* Answer a SELECT by AID from the probe cache; the card must be locked */
+static int sc_aid_probe_match(sc_card_t *card, const u8 *aid, size_t aidlen,
+		u8 *fci, size_t *fcilen, int *result)
+{
+	struct sc_aid_probe *probe;
+
+	if (card->aid_probe == NULL)
+		return 0;
+	probe = sc_aid_probe_find(card, aid, aidlen);
+	if (probe == NULL)
+		return 0;
+
+	if (probe->sw1 != 0x90 || probe->sw2 != 0x00) {
+		/* a rejected AID stays rejected until the card is removed */
+		if (fcilen)
+			*fcilen = 0;
+		*result = sc_check_sw(card, probe->sw1, probe->sw2);
+		return 1;
+	}
+
+	if (probe != card->aid_probe->current)
+		return 0;
+	if (fci != NULL) {
+		if (!probe->fci_known || fcilen == NULL || *fcilen < probe->fci_len)
+			return 0;
+		if (probe->fci_len)
+			memcpy(fci, probe->fci, probe->fci_len);
+		*fcilen = probe->fci_len;
+	} else if (fcilen) {
+		*fcilen = 0;
+	}
+	*result = SC_SUCCESS;
+	return 1;
+}
+
+int sc_select_aid(sc_card_t *card, const u8 *aid, size_t aidlen,
+		u8 *fci, size_t *fcilen)
+{
+	sc_apdu_t apdu;
+	int r;
+
+	if (card == NULL || aid == NULL || aidlen == 0 || aidlen > SC_MAX_AID_SIZE
+			|| (fci != NULL && fcilen == NULL))
+		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(card->ctx);
+
+	r = sc_lock(card);
+	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+
+	if (sc_aid_probe_match(card, aid, aidlen, fci, fcilen, &r)) {
+		sc_log(card->ctx, "SELECT answered from the probe cache: %d", r);
+		sc_stats_count(card->ctx, &card->ctx->stats.select_aid_cached, 1);
+		sc_unlock(card);
+		LOG_FUNC_RETURN(card->ctx, r);
+	}
+
+	sc_format_apdu(card, &apdu,
+		fci == NULL ? SC_APDU_CASE_3_SHORT : SC_APDU_CASE_4_SHORT, 0xA4, 0x04, 0x00);
+	apdu.lc = aidlen;
+	apdu.data = aid;
+	apdu.datalen = aidlen;
+	apdu.resp = fci;
+	apdu.resplen = fci ? *fcilen : 0;
+	apdu.le = fci == NULL ? 0 : MIN(*fcilen, 256);
+
+	r = sc_transmit_apdu(card, &apdu);
+	sc_unlock(card);
+	if (fcilen)
+		*fcilen = apdu.resplen;
+	LOG_TEST_RET(card->ctx, r, "APDU transmit failed");
+
+	LOG_FUNC_RETURN(card->ctx, sc_check_sw(card, apdu.sw1, apdu.sw2));
+}
+
+/* Read in chunks of the maximal response size; the card must be locked */
+static int sc_read_binary_chunks(sc_card_t *card, unsigned int idx,
+		unsigned char *buf, size_t count, unsigned long flags)
 {
 	size_t max_le = sc_get_max_recv_size(card);
 	size_t todo = count;
 	int r;
 
+	while (todo > 0) {
+		size_t chunk = todo > max_le ? max_le : todo;
+
+		r = card->ops->read_binary(card, idx, buf, chunk, flags);
+		if (r == 0 || r == SC_ERROR_FILE_END_REACHED)
+			break;
+		if ((idx > SIZE_MAX - (size_t) r)
+				|| (size_t) r > todo) {
+			/* `idx + r` or `todo - r` would overflow */
+			r = SC_ERROR_OFFSET_TOO_LARGE;
+		}
+		if (r < 0)
+			return r;
+
+		todo -= (size_t) r;
+		buf  += (size_t) r;
+		idx  += (size_t) r;
+	}
+
+	return (int)(count - todo);
+}
+
+/* Serve a read from the whole-EF buffer of the currently selected file,
+ * fetching the file first if needed. Returns the number of bytes copied,
+ * or a negative value if the read has to go to the card. */
+static int sc_read_binary_ahead(sc_card_t *card, unsigned int idx,
+		unsigned char *buf, size_t count)
+{
+	struct sc_card_cache *cache = &card->cache;
+	int r;
+
+	if (cache->read_ahead == NULL) {
+		cache->read_ahead = malloc(cache->read_ahead_size);
+		if (cache->read_ahead == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		r = sc_read_binary_chunks(card, 0, cache->read_ahead,
+				cache->read_ahead_size, 0);
+		if (r < 0)
+			return r;
+		cache->read_ahead_len = r;
+		sc_log(card->ctx, "read ahead %d of %"SC_FORMAT_LEN_SIZE_T"u bytes",
+				r, cache->read_ahead_size);
+	}
+
+	if (idx > cache->read_ahead_len || count > cache->read_ahead_len - idx)
+		return SC_ERROR_FILE_END_REACHED;
+	memcpy(buf, cache->read_ahead + idx, count);
+	return (int)count;
+}
+
+int sc_read_binary(sc_card_t *card, unsigned int idx,
+		   unsigned char *buf, size_t count, unsigned long flags)
+{
+	unsigned long long apdus;
+	int r;
+
 	if (card == NULL || card->ops == NULL || buf == NULL) {
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
@@ -645,11 +1445,53 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 	/* lock the card now to avoid deselection of the file */
 	r = sc_lock(card);
 	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+	sc_stats_count(card->ctx, &card->ctx->stats.read_binary_count, 1);
+	apdus = sc_stats_reader_apdus(card->reader);
+
+	if (card->cache.read_ahead_size && flags == 0) {
+		r = sc_read_binary_ahead(card, idx, buf, count);
+		if (r >= 0) {
+			sc_stats_operation(card->reader, &card->ctx->stats.read_binary, apdus);
+			sc_unlock(card);
+			sc_stats_count(card->ctx, &card->ctx->stats.read_binary_bytes, (size_t)r);
+			LOG_FUNC_RETURN(card->ctx, r);
+		}
+		/* not covered by the buffer: ask the card */
+		sc_drop_read_ahead(card);
+	}
+
+	r = sc_read_binary_chunks(card, idx, buf, count, flags);
+	sc_stats_operation(card->reader, &card->ctx->stats.read_binary, apdus);
+	sc_unlock(card);
+	if (r > 0)
+		sc_stats_count(card->ctx, &card->ctx->stats.read_binary_bytes, (size_t)r);
+
+	LOG_FUNC_RETURN(card->ctx, r);
+}
+
+/* Write in chunks of the maximal command size, or in chunks the driver
+ * sends with command chaining if the card takes chained writes; the card
+ * must be locked */
+static int sc_write_binary_chunks(sc_card_t *card,
+		int (*op)(sc_card_t *, unsigned int, const u8 *, size_t, unsigned long),
+		unsigned int idx, const u8 *buf, size_t count, unsigned long flags)
+{
+	size_t max_lc = sc_get_max_send_size(card);
+	size_t todo = count;
+	int r;
+
+	if (card->flags & SC_CARD_FLAG_CHAINED_WRITE
+#ifdef ENABLE_SM
+			/* the chained commands would be wrapped one by one */
+			&& card->sm_ctx.sm_mode != SM_MODE_TRANSMIT
+#endif
+			&& max_lc < SC_MAX_EXT_APDU_DATA_SIZE)
+		max_lc = SC_MAX_EXT_APDU_DATA_SIZE;
 
 	while (todo > 0) {
-		size_t chunk = todo > max_le ? max_le : todo;
+		size_t chunk = todo > max_lc ? max_lc : todo;
 
-		r = card->ops->read_binary(card, idx, buf, chunk, flags);
+		r = op(card, idx, buf, chunk, flags);
 		if (r == 0 || r == SC_ERROR_FILE_END_REACHED)
 			break;
 		if ((idx > SIZE_MAX - (size_t) r)
@@ -657,26 +1499,20 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 			/* `idx + r` or `todo - r` would overflow */
 			r = SC_ERROR_OFFSET_TOO_LARGE;
 		}
-		if (r < 0) {
-			sc_unlock(card);
-			LOG_FUNC_RETURN(card->ctx, r);
-		}
+		if (r < 0)
+			return r;
 
 		todo -= (size_t) r;
 		buf  += (size_t) r;
 		idx  += (size_t) r;
 	}
 
-	sc_unlock(card);
-
-	LOG_FUNC_RETURN(card->ctx, count - todo);
+	return (int)(count - todo);
 }
 
 int sc_write_binary(sc_card_t *card, unsigned int idx,
 		    const u8 *buf, size_t count, unsigned long flags)
 {
-	size_t max_lc = sc_get_max_send_size(card);
-	size_t todo = count;
 	int r;
 
 	if (card == NULL || card->ops == NULL || buf == NULL) {
@@ -693,38 +1529,17 @@ int sc_write_binary(sc_card_t *card, unsigned int idx,
 	/* lock the card now to avoid deselection of the file */
 	r = sc_lock(card);
 	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+	sc_drop_read_ahead(card);
 
-	while (todo > 0) {
-		size_t chunk = todo > max_lc ? max_lc : todo;
-
-		r = card->ops->write_binary(card, idx, buf, chunk, flags);
-		if (r == 0 || r == SC_ERROR_FILE_END_REACHED)
-			break;
-		if ((idx > SIZE_MAX - (size_t) r)
-				|| (size_t) r > todo) {
-			/* `idx + r` or `todo - r` would overflow */
-			r = SC_ERROR_OFFSET_TOO_LARGE;
-		}
-		if (r < 0) {
-			sc_unlock(card);
-			LOG_FUNC_RETURN(card->ctx, r);
-		}
-
-		todo -= (size_t) r;
-		buf  += (size_t) r;
-		idx  += (size_t) r;
-	}
-
+	r = sc_write_binary_chunks(card, card->ops->write_binary, idx, buf, count, flags);
 	sc_unlock(card);
 
-	LOG_FUNC_RETURN(card->ctx, count - todo);
+	LOG_FUNC_RETURN(card->ctx, r);
 }
 
 int sc_update_binary(sc_card_t *card, unsigned int idx,
 		     const u8 *buf, size_t count, unsigned long flags)
 {
-	size_t max_lc = sc_get_max_send_size(card);
-	size_t todo = count;
 	int r;
 
 	if (card == NULL || card->ops == NULL || buf == NULL) {
@@ -749,31 +1564,12 @@ int sc_update_binary(sc_card_t *card, unsigned int idx,
 	/* lock the card now to avoid deselection of the file */
 	r = sc_lock(card);
 	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+	sc_drop_read_ahead(card);
 
-	while (todo > 0) {
-		size_t chunk = todo > max_lc ? max_lc : todo;
-
-		r = card->ops->update_binary(card, idx, buf, chunk, flags);
-		if (r == 0 || r == SC_ERROR_FILE_END_REACHED)
-			break;
-		if ((idx > SIZE_MAX - (size_t) r)
-				|| (size_t) r > todo) {
-			/* `idx + r` or `todo - r` would overflow */
-			r = SC_ERROR_OFFSET_TOO_LARGE;
-		}
-		if (r < 0) {
-			sc_unlock(card);
-			LOG_FUNC_RETURN(card->ctx, r);
-		}
-
-		todo -= (size_t) r;
-		buf  += (size_t) r;
-		idx  += (size_t) r;
-	}
-
+	r = sc_write_binary_chunks(card, card->ops->update_binary, idx, buf, count, flags);
 	sc_unlock(card);
 
-	LOG_FUNC_RETURN(card->ctx, count - todo);
+	LOG_FUNC_RETURN(card->ctx, r);
 }
 
 
@@ -797,6 +1593,7 @@ int sc_erase_binary(struct sc_card *card, unsigned int idx, size_t count,  unsig
 	/* lock the card now to avoid deselection of the file */
 	r = sc_lock(card);
 	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+	sc_drop_read_ahead(card);
 
 	while (todo > 0) {
 		r = card->ops->erase_binary(card, idx, todo, flags);
@@ -862,9 +1659,31 @@ int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 	}
 	if (card->ops->select_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	sc_stats_count(card->ctx, &card->ctx->stats.select_count, 1);
+
+	/* The file is still selected: nothing else was selected since, and the
+	 * card was not released to other processes in between. The read-ahead
+	 * buffer belongs to this file as well. */
+	if (sc_select_cache_match(card, in_path, file)) {
+		sc_stats_count(card->ctx, &card->ctx->stats.select_cached, 1);
+		sc_log(card->ctx, "file is selected already");
+		LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+	}
+
+	sc_drop_read_ahead(card);
+	sc_select_cache_drop(card);
+	card->cache.select_running = 1;
 	r = card->ops->select_file(card, in_path, file);
+	card->cache.select_running = 0;
 	LOG_TEST_RET(card->ctx, r, "'SELECT' error");
 
+	/* A transparent EF of known size may be read in one go later on */
+	if ((card->ctx->flags & SC_CTX_FLAG_READ_AHEAD) && file && *file
+			&& (*file)->type == SC_FILE_TYPE_WORKING_EF
+			&& (*file)->ef_structure == SC_FILE_EF_TRANSPARENT
+			&& (*file)->size > 0 && (*file)->size <= SC_READ_AHEAD_MAX_SIZE)
+		card->cache.read_ahead_size = (*file)->size;
+
 	if (file) {
 		if (*file)
 			/* Remember file path */
@@ -875,6 +1694,8 @@ int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 			 * lazy.  */
 			r = SC_ERROR_INVALID_DATA;
 	}
+	if (r == SC_SUCCESS)
+		sc_select_cache_store(card, in_path, file ? *file : NULL);
 
 	LOG_FUNC_RETURN(card->ctx, r);
 }
@@ -1170,67 +1991,198 @@ sc_algorithm_info_t * sc_card_find_gostr3410_alg(sc_card_t *card,
 	return sc_card_find_alg(card, SC_ALGORITHM_GOSTR3410, key_length, NULL);
 }
 
-static int match_atr_table(sc_context_t *ctx, const struct sc_atr_table *table, struct sc_atr *atr)
+/*
+ * ATR tables compiled to binary values and masks, so that matching an ATR
+ * does not parse the hex strings of every table entry again. Entries are
+ * ordered by ATR length and, within a length, by their index in the table.
+ * Compiled tables live until the context is released, or until the table
+ * is changed with _sc_add_atr() or _sc_free_atr().
+ */
+struct sc_atr_cache_entry {
+	int index;
+	int masked;
+	u8 value[SC_MAX_ATR_SIZE];	/* already reduced with the mask */
+	u8 mask[SC_MAX_ATR_SIZE];
+};
+
+struct sc_atr_cache {
+	struct sc_atr_cache *next;
+	const struct sc_atr_table *table;
+	const char *first_atr;
+	/* entries of ATR length n are entries[start[n]] ... entries[start[n + 1] - 1] */
+	unsigned int start[SC_MAX_ATR_SIZE + 2];
+	struct sc_atr_cache_entry entries[1];
+};
+
+/* Parse "3B:02:14:50" into binary. The card ATR used to be compared with
+ * the table in this exact text format, so anything else never matches. */
+static int atr_table_hex_to_bin(const char *hex, u8 *bin, size_t *bin_len)
 {
-	u8 *card_atr_bin;
-	size_t card_atr_bin_len;
-	char card_atr_hex[3 * SC_MAX_ATR_SIZE];
-	size_t card_atr_hex_len;
-	unsigned int i = 0;
+	size_t hex_len = strlen(hex);
 
-	if (ctx == NULL || table == NULL || atr == NULL)
+	*bin_len = SC_MAX_ATR_SIZE;
+	if (sc_hex_to_bin(hex, bin, bin_len) != SC_SUCCESS
+			|| *bin_len == 0 || hex_len != 3 * *bin_len - 1)
 		return -1;
-	card_atr_bin = atr->value;
-	card_atr_bin_len = atr->len;
-	sc_bin_to_hex(card_atr_bin, card_atr_bin_len, card_atr_hex, sizeof(card_atr_hex), ':');
-	card_atr_hex_len = strlen(card_atr_hex);
-
-	sc_debug(ctx, SC_LOG_DEBUG_MATCH, "ATR     : %s", card_atr_hex);
-
-	for (i = 0; table[i].atr != NULL; i++) {
-		const char *tatr = table[i].atr;
-		const char *matr = table[i].atrmask;
-		size_t tatr_len = strlen(tatr);
-		u8 mbin[SC_MAX_ATR_SIZE], tbin[SC_MAX_ATR_SIZE];
-		size_t mbin_len, tbin_len, s, matr_len;
-		size_t fix_hex_len = card_atr_hex_len;
-		size_t fix_bin_len = card_atr_bin_len;
-
-		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "ATR try : %s", tatr);
-
-		if (tatr_len != fix_hex_len) {
-			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "ignored - wrong length");
+	return 0;
+}
+
+static struct sc_atr_cache *atr_table_compile(const struct sc_atr_table *table)
+{
+	struct sc_atr_cache *compiled;
+	struct sc_atr_cache_entry *parsed, *entry;
+	unsigned int count, n, len, next[SC_MAX_ATR_SIZE + 1];
+	size_t i, s, mbin_len, *lens;
+	u8 mbin[SC_MAX_ATR_SIZE];
+
+	for (count = 0; table[count].atr != NULL; count++)
+		;
+	compiled = calloc(1, sizeof(*compiled)
+			+ (count ? count - 1 : 0) * sizeof(struct sc_atr_cache_entry));
+	parsed = calloc(count + 1, sizeof(*parsed));
+	lens = calloc(count + 1, sizeof(*lens));
+	if (compiled == NULL || parsed == NULL || lens == NULL) {
+		free(compiled);
+		free(parsed);
+		free(lens);
+		return NULL;
+	}
+	compiled->table = table;
+	compiled->first_atr = table[0].atr;
+
+	/* parse the entries in table order, the unusable ones keep length 0 */
+	memset(next, 0, sizeof(next));
+	for (i = 0; i < count; i++) {
+		entry = &parsed[i];
+		if (atr_table_hex_to_bin(table[i].atr, entry->value, &lens[i]) < 0) {
+			lens[i] = 0;
 			continue;
 		}
-		if (matr != NULL) {
-			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "ATR mask: %s", matr);
-
-			matr_len = strlen(matr);
-			if (tatr_len != matr_len)
+		if (table[i].atrmask != NULL) {
+			if (atr_table_hex_to_bin(table[i].atrmask, mbin, &mbin_len) < 0
+					|| mbin_len != lens[i]) {
+				lens[i] = 0;
 				continue;
-			tbin_len = sizeof(tbin);
-			sc_hex_to_bin(tatr, tbin, &tbin_len);
-			mbin_len = sizeof(mbin);
-			sc_hex_to_bin(matr, mbin, &mbin_len);
-			if (mbin_len != fix_bin_len) {
-				sc_debug(ctx, SC_LOG_DEBUG_MATCH, "length of atr and atr mask do not match - ignored: %s - %s", tatr, matr);
-				continue;
-			}
-			for (s = 0; s < tbin_len; s++) {
-				/* reduce tatr with mask */
-				tbin[s] = (tbin[s] & mbin[s]);
-				/* create copy of card_atr_bin masked) */
-				mbin[s] = (card_atr_bin[s] & mbin[s]);
 			}
-			if (memcmp(tbin, mbin, tbin_len) != 0)
-				continue;
+			for (s = 0; s < mbin_len; s++)
+				entry->value[s] &= mbin[s];
+			memcpy(entry->mask, mbin, mbin_len);
+			entry->masked = 1;
+		}
+		entry->index = (int) i;
+		next[lens[i]]++;
+	}
+
+	/* bucket them by length, keeping the table order within a bucket */
+	next[0] = 0;
+	for (len = 0, n = 0; len <= SC_MAX_ATR_SIZE; len++) {
+		compiled->start[len] = n;
+		n += next[len];
+		next[len] = compiled->start[len];
+	}
+	compiled->start[SC_MAX_ATR_SIZE + 1] = n;
+	for (i = 0; i < count; i++)
+		if (lens[i])
+			compiled->entries[next[lens[i]]++] = parsed[i];
+
+	free(parsed);
+	free(lens);
+	return compiled;
+}
+
+/* Returns the compiled form of 'table', compiling it on first use. The
+ * caller holds ctx->mutex. */
+static struct sc_atr_cache *atr_table_get(sc_context_t *ctx, const struct sc_atr_table *table)
+{
+	struct sc_atr_cache *compiled;
+
+	for (compiled = ctx->atr_cache; compiled != NULL; compiled = compiled->next)
+		if (compiled->table == table && compiled->first_atr == table[0].atr)
+			return compiled;
+
+	compiled = atr_table_compile(table);
+	if (compiled != NULL) {
+		compiled->next = ctx->atr_cache;
+		ctx->atr_cache = compiled;
+	}
+	return compiled;
+}
+
+static void atr_table_forget(sc_context_t *ctx, const struct sc_atr_table *table)
+{
+	struct sc_atr_cache **pp, *compiled;
+
+	if (table == NULL)
+		return;
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (pp = &ctx->atr_cache; *pp != NULL; ) {
+		compiled = *pp;
+		if (compiled->table == table) {
+			*pp = compiled->next;
+			free(compiled);
 		} else {
-			if (strncasecmp(tatr, card_atr_hex, tatr_len) != 0)
+			pp = &compiled->next;
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
+void _sc_atr_cache_free(sc_context_t *ctx)
+{
+	while (ctx->atr_cache != NULL) {
+		struct sc_atr_cache *compiled = ctx->atr_cache;
+
+		ctx->atr_cache = compiled->next;
+		free(compiled);
+	}
+}
+
+static int match_atr_table(sc_context_t *ctx, const struct sc_atr_table *table, struct sc_atr *atr)
+{
+	const struct sc_atr_cache *compiled;
+	const struct sc_atr_cache_entry *entry;
+	unsigned int n, end;
+	size_t s;
+	int r = -1;
+
+	if (ctx == NULL || table == NULL || atr == NULL)
+		return -1;
+	if (atr->len == 0 || atr->len > SC_MAX_ATR_SIZE || table[0].atr == NULL)
+		return -1;
+
+	if (SC_LOG_ENABLED(ctx, SC_LOG_DEBUG_MATCH)) {
+		char card_atr_hex[3 * SC_MAX_ATR_SIZE];
+
+		sc_bin_to_hex(atr->value, atr->len, card_atr_hex, sizeof(card_atr_hex), ':');
+		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "ATR     : %s", card_atr_hex);
+	}
+
+	if (sc_mutex_lock(ctx, ctx->mutex) != SC_SUCCESS)
+		return -1;
+	compiled = atr_table_get(ctx, table);
+	if (compiled == NULL) {
+		sc_mutex_unlock(ctx, ctx->mutex);
+		return -1;
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+
+	end = compiled->start[atr->len + 1];
+	for (n = compiled->start[atr->len]; n < end; n++) {
+		entry = &compiled->entries[n];
+		if (entry->masked) {
+			for (s = 0; s < atr->len; s++)
+				if ((atr->value[s] & entry->mask[s]) != entry->value[s])
+					break;
+			if (s < atr->len)
 				continue;
+		} else if (memcmp(atr->value, entry->value, atr->len) != 0) {
+			continue;
 		}
-		return i;
+		r = entry->index;
+		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "ATR match: %s", table[r].atr);
+		break;
 	}
-	return -1;
+	return r;
 }
 
 int _sc_match_atr(sc_card_t *card, const struct sc_atr_table *table, int *type_out)
@@ -1281,6 +2233,7 @@ int _sc_add_atr(sc_context_t *ctx, struct sc_card_driver *driver, struct sc_atr_
 {
 	struct sc_atr_table *map, *dst;
 
+	atr_table_forget(ctx, driver->atr_map);
 	map = (struct sc_atr_table *) realloc(driver->atr_map,
 			(driver->natrs + 2) * sizeof(struct sc_atr_table));
 	if (!map)
@@ -1324,6 +2277,7 @@ int _sc_free_atr(sc_context_t *ctx, struct sc_card_driver *driver)
 {
 	unsigned int i;
 
+	atr_table_forget(ctx, driver->atr_map);
 	for (i = 0; i < driver->natrs; i++) {
 		struct sc_atr_table *src = &driver->atr_map[i];
 
@@ -1367,6 +2321,8 @@ scconf_block *sc_get_conf_block(sc_context_t *ctx, const char *name1, const char
 void sc_invalidate_cache(struct sc_card *card)
 {
 	if (card) {
+		free(card->cache.read_ahead);
+		sc_file_free(card->cache.select_file);
 		memset(&card->cache, 0, sizeof(card->cache));
 		card->cache.valid = 0;
 	}
@@ -1429,14 +2385,98 @@ sc_match_atr_block(sc_context_t *ctx, struct sc_card_driver *driver, struct sc_a
 }
 
 #ifdef ENABLE_SM
+/*
+ * External SM modules stay loaded and initialized until the context is
+ * released, so that cards reconnecting often (IAS/ECC, Authentic) do not
+ * dlopen() and initialize the module every time. The entries are shared by
+ * the cards using the module and protected by the context mutex.
+ */
+struct sc_sm_module_cache {
+	char *path;			/* as passed to sc_dlopen() */
+	void *handle;
+	struct sm_module_operations ops;
+	int initialized;		/* module_init() succeeded */
+	char *module_data;		/* with this module_data, may be NULL */
+	unsigned int refs;		/* cards using the module */
+	struct sc_sm_module_cache *next;
+};
+
+static struct sc_sm_module_cache *
+sc_sm_module_find(struct sc_context *ctx, void *handle)
+{
+	struct sc_sm_module_cache *entry;
+
+	for (entry = ctx->sm_modules; entry != NULL; entry = entry->next)
+		if (entry->handle == handle)
+			return entry;
+	return NULL;
+}
+
+void
+sc_sm_module_cache_free(struct sc_context *ctx)
+{
+	struct sc_sm_module_cache *entry;
+
+	while ((entry = ctx->sm_modules) != NULL) {
+		ctx->sm_modules = entry->next;
+		if (entry->refs)
+			sc_log(ctx, "SM module '%s' still used by %u cards", entry->path, entry->refs);
+		if (entry->initialized && entry->ops.module_cleanup)
+			entry->ops.module_cleanup(ctx);
+		sc_dlclose(entry->handle);
+		free(entry->module_data);
+		free(entry->path);
+		free(entry);
+	}
+}
+
+/* Initialize the module of the card once, or again if the configuration
+ * of the card asks for different module data */
+static int
+sc_card_sm_module_init(struct sc_card *card, const char *module_data)
+{
+	struct sc_context *ctx = card->ctx;
+	struct sc_sm_module_cache *entry;
+	int rv = SC_SUCCESS;
+
+	if (!card->sm_ctx.module.ops.module_init)
+		return SC_SUCCESS;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	entry = sc_sm_module_find(ctx, card->sm_ctx.module.handle);
+	if (entry != NULL && entry->initialized
+			&& (entry->module_data == NULL) == (module_data == NULL)
+			&& (module_data == NULL || !strcmp(entry->module_data, module_data))) {
+		sc_log(ctx, "SM module '%s' already initialized", entry->path);
+	} else {
+		rv = card->sm_ctx.module.ops.module_init(ctx, module_data);
+		if (entry != NULL) {
+			free(entry->module_data);
+			entry->module_data = module_data ? strdup(module_data) : NULL;
+			entry->initialized = rv == SC_SUCCESS
+				&& (module_data == NULL || entry->module_data != NULL);
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+	return rv;
+}
+
 static int
 sc_card_sm_unload(struct sc_card *card)
 {
-	if (card->sm_ctx.module.ops.module_cleanup)
-		card->sm_ctx.module.ops.module_cleanup(card->ctx);
+	struct sc_context *ctx = card->ctx;
+	struct sc_sm_module_cache *entry;
+
+	if (card->sm_ctx.module.handle == NULL)
+		return 0;
+
+	/* the module stays loaded for the next card */
+	sc_mutex_lock(ctx, ctx->mutex);
+	entry = sc_sm_module_find(ctx, card->sm_ctx.module.handle);
+	if (entry != NULL && entry->refs > 0)
+		entry->refs--;
+	sc_mutex_unlock(ctx, ctx->mutex);
 
-	if (card->sm_ctx.module.handle)
-		sc_dlclose(card->sm_ctx.module.handle);
 	card->sm_ctx.module.handle = NULL;
 	return 0;
 }
@@ -1446,6 +2486,7 @@ static int
 sc_card_sm_load(struct sc_card *card, const char *module_path, const char *in_module)
 {
 	struct sc_context *ctx = NULL;
+	struct sc_sm_module_cache *entry;
 	int rv = SC_ERROR_INTERNAL;
 	char *module = NULL;
 #ifdef _WIN32
@@ -1495,17 +2536,40 @@ sc_card_sm_load(struct sc_card *card, const char *module_path, const char *in_mo
 	if (!module)
 		return SC_ERROR_OUT_OF_MEMORY;
 
+	sc_card_sm_unload(card);
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (entry = ctx->sm_modules; entry != NULL; entry = entry->next)
+		if (!strcmp(entry->path, module))
+			break;
+	if (entry != NULL)   {
+		sc_log(ctx, "SM module '%s' already loaded", module);
+		entry->refs++;
+		card->sm_ctx.module.handle = entry->handle;
+		card->sm_ctx.module.ops = entry->ops;
+		sc_mutex_unlock(ctx, ctx->mutex);
+		card->sm_ctx.sm_mode = SM_MODE_ACL;
+		free(module);
+		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_VERBOSE, SC_SUCCESS);
+	}
+
 	sc_log(ctx, "try to load SM module '%s'", module);
+	entry = calloc(1, sizeof *entry);
 	do  {
-		struct sm_module_operations *mod_ops = &card->sm_ctx.module.ops;
+		struct sm_module_operations *mod_ops;
 		void *mod_handle;
 
-		card->sm_ctx.module.handle = sc_dlopen(module);
-		if (!card->sm_ctx.module.handle)   {
+		if (entry == NULL)   {
+			rv = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+		mod_ops = &entry->ops;
+		entry->handle = sc_dlopen(module);
+		if (!entry->handle)   {
 			sc_log(ctx, "cannot open dynamic library '%s': %s", module, sc_dlerror());
 			break;
 		}
-		mod_handle = card->sm_ctx.module.handle;
+		mod_handle = entry->handle;
 
 		mod_ops->initialize = sc_dlsym(mod_handle, "initialize");
 		if (!mod_ops->initialize)   {
@@ -1539,8 +2603,21 @@ sc_card_sm_load(struct sc_card *card, const char *module_path, const char *in_mo
 		break;
 	} while(0);
 
-	if (rv)
-		sc_card_sm_unload(card);
+	if (rv == 0)   {
+		entry->path = module;
+		module = NULL;
+		entry->refs = 1;
+		entry->next = ctx->sm_modules;
+		ctx->sm_modules = entry;
+		card->sm_ctx.module.handle = entry->handle;
+		card->sm_ctx.module.ops = entry->ops;
+	}
+	else if (entry != NULL)   {
+		if (entry->handle)
+			sc_dlclose(entry->handle);
+		free(entry);
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
 
 	card->sm_ctx.sm_mode = SM_MODE_ACL;
 	if (module)
@@ -1603,7 +2680,7 @@ sc_card_sm_check(struct sc_card *card)
 	if (card->sm_ctx.module.ops.module_init)   {
 		module_data = scconf_get_str(sm_conf_block, "module_data", NULL);
 
-		rv = card->sm_ctx.module.ops.module_init(ctx, module_data);
+		rv = sc_card_sm_module_init(card, module_data);
 		LOG_TEST_RET(ctx, rv, "Cannot initialize SM module");
 	}
 
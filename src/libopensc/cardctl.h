@@ -273,6 +273,7 @@ enum {
 	SC_CARDCTL_SC_HSM_IMPORT_DKEK_SHARE,
 	SC_CARDCTL_SC_HSM_WRAP_KEY,
 	SC_CARDCTL_SC_HSM_UNWRAP_KEY,
+	SC_CARDCTL_SC_HSM_READ_EF,
 
 	/*
 	 * DNIe specific calls
@@ -1073,6 +1074,12 @@ typedef struct sc_cardctl_sc_hsm_wrapped_key {
 	size_t wrapped_key_length;	/* Length of key blob */
 } sc_cardctl_sc_hsm_wrapped_key_t;
 
+typedef struct sc_cardctl_sc_hsm_read_ef {
+	u8 fid[2];					/* File identifier, no prior SELECT needed */
+	u8 *buf;					/* Buffer receiving the file content */
+	size_t len;					/* Size of buffer, set to bytes read */
+} sc_cardctl_sc_hsm_read_ef_t;
+
 /*
  * isoApplet
  */
@@ -179,21 +179,51 @@ int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int metho
 	}
 }
 
+/*
+ * Deflate cannot expand data by more than about 1032:1, so a gzip ISIZE
+ * trailer claiming more than that is garbage or belongs to another member.
+ */
+#define DEFLATE_MAX_RATIO	1032
+
+size_t sc_decompress_size_hint(const u8* in, size_t inLen, int method)
+{
+	size_t isize;
+
+	if (in == NULL)
+		return 0;
+	if (method == COMPRESSION_AUTO)
+		method = detect_method(in, inLen);
+	/* only gzip carries the length; 10 byte header, 8 byte trailer */
+	if (method != COMPRESSION_GZIP || inLen < 18)
+		return 0;
+
+	isize = (size_t)in[inLen - 4] | (size_t)in[inLen - 3] << 8
+		| (size_t)in[inLen - 2] << 16 | (size_t)in[inLen - 1] << 24;
+	if (isize == 0 || isize / DEFLATE_MAX_RATIO > inLen)
+		return 0;
+	return isize;
+}
+
 static int sc_decompress_zlib_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int gzip) {
 	/* Since uncompress does not offer a way to make it uncompress gzip... manually set it up */
 	z_stream gz;
 	int err;
 	int window_size = 15;
-	const size_t startSize = inLen < 1024 ? 2048 : inLen * 2;
-	const size_t blockSize = inLen < 1024 ? 512 : inLen / 2;
-	size_t bufferSize = startSize;
+	size_t bufferSize;
+	u8* buf;
+
+	if (!out || !outLen)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	/* With a usable ISIZE the output fits in one allocation and inflate
+	 * writes straight into it; otherwise start from a guess and double. */
+	bufferSize = gzip ? sc_decompress_size_hint(in, inLen, COMPRESSION_GZIP) : 0;
+	if (bufferSize == 0)
+		bufferSize = inLen < 1024 ? 2048 : inLen * 2;
 	if (gzip)
 		window_size += 0x20;
 	memset(&gz, 0, sizeof(gz));
 
-	if (!out || !outLen)
-		return SC_ERROR_INVALID_ARGUMENTS;
-	
 	gz.next_in = (u8*)in;
 	gz.avail_in = inLen;
 
@@ -202,45 +232,51 @@ static int sc_decompress_zlib_alloc(u8** out, size_t* outLen, const u8* in, size
 		return zerr_to_opensc(err);
 
 	*outLen = 0;
+	buf = realloc(*out, bufferSize);
+	if (!buf) {
+		inflateEnd(&gz);
+		free(*out);
+		*out = NULL;
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	*out = buf;
+	gz.next_out = buf;
+	gz.avail_out = bufferSize;
 
 	while (1) {
-		/* Setup buffer... */
-		size_t num;
-		u8* buf = realloc(*out, bufferSize);
+		err = inflate(&gz, Z_NO_FLUSH);
+		*outLen = gz.total_out;
+		if (err == Z_STREAM_END)
+			break;
+		/* Z_BUF_ERROR with input left over means only the output is full */
+		if ((err != Z_OK && err != Z_BUF_ERROR) || gz.avail_out != 0)
+			break;
+
+		buf = realloc(*out, bufferSize * 2);
 		if (!buf) {
-			free(*out);
-			*out = NULL;
-			return SC_ERROR_OUT_OF_MEMORY;
+			err = Z_MEM_ERROR;
+			break;
 		}
 		*out = buf;
 		gz.next_out = buf + *outLen;
-		gz.avail_out = bufferSize - *outLen;
+		gz.avail_out = bufferSize;
+		bufferSize *= 2;
+	}
 
-		err = inflate(&gz, Z_FULL_FLUSH);
-		if (err != Z_STREAM_END && err != Z_OK) {
-			free(*out);
-			*out = NULL;
-			break;
-		}
-		num = *outLen + gz.avail_out;
-		if (bufferSize > num) {
-			*outLen += bufferSize - num;
-			bufferSize += bufferSize - num + blockSize;
-		}
-		if (err == Z_STREAM_END) {
-			if (*outLen > 0) {
-				/* Shrink it down, if it fails, just use old data */
-				buf = realloc(buf, *outLen);
-				if (buf) {
-					*out = buf;
-				}
-			} else {
-				free(*out);
-				*out = NULL;
-				err = Z_DATA_ERROR;
-			}
-			break;
-		}
+	if (err == Z_STREAM_END && *outLen == 0)
+		err = Z_DATA_ERROR;
+	if (err != Z_STREAM_END) {
+		free(*out);
+		*out = NULL;
+		*outLen = 0;
+		/* a stream that just stops is truncated input */
+		if (err == Z_OK)
+			err = Z_DATA_ERROR;
+	} else if (*outLen < bufferSize) {
+		/* Shrink it down, if it fails, just use old data */
+		buf = realloc(*out, *outLen);
+		if (buf)
+			*out = buf;
 	}
 	inflateEnd(&gz);
 	return zerr_to_opensc(err);
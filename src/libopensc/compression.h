@@ -30,6 +30,8 @@
 
 int sc_compress(u8* out, size_t* outLen, const u8* in, size_t inLen, int method);
 
+/* Decompressed size announced by a gzip trailer, 0 if unknown */
+size_t sc_decompress_size_hint(const u8* in, size_t inLen, int method);
 int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method);
 int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int method);
 
@@ -29,6 +29,10 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 
 #ifdef _WIN32
 #include <windows.h>
@@ -36,10 +40,14 @@
 #include <direct.h>
 #include <io.h>
 #endif
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+#endif
 
 #include "common/libscdl.h"
 #include "common/compat_strlcpy.h"
 #include "internal.h"
+#include "pkcs15.h"
 #include "sc-ossl-compat.h"
 
 static int ignored_reader(sc_context_t *ctx, sc_reader_t *reader)
@@ -79,6 +87,7 @@ int _sc_delete_reader(sc_context_t *ctx, sc_reader_t *reader)
 	if (reader == NULL) {
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
+	sc_async_stop(reader);
 	if (reader->ops->release)
 			reader->ops->release(reader);
 	free(reader->name);
@@ -94,66 +103,146 @@ struct _sc_driver_entry {
 };
 
 static const struct _sc_driver_entry internal_card_drivers[] = {
+#if SC_CARD_DRIVER(CARDOS)
 	{ "cardos",	(void *(*)(void)) sc_get_cardos_driver },
+#endif
+#if SC_CARD_DRIVER(FLEX)
 	{ "flex",	(void *(*)(void)) sc_get_cryptoflex_driver },
+#endif
+#if SC_CARD_DRIVER(CYBERFLEX)
 	{ "cyberflex",	(void *(*)(void)) sc_get_cyberflex_driver },
+#endif
 #ifdef ENABLE_OPENSSL
+#if SC_CARD_DRIVER(GPK)
 	{ "gpk",	(void *(*)(void)) sc_get_gpk_driver },
 #endif
+#endif
+#if SC_CARD_DRIVER(GEMSAFEV1)
 	{ "gemsafeV1",	(void *(*)(void)) sc_get_gemsafeV1_driver },
+#endif
+#if SC_CARD_DRIVER(ASEPCOS)
 	{ "asepcos",	(void *(*)(void)) sc_get_asepcos_driver },
+#endif
+#if SC_CARD_DRIVER(STARCOS)
 	{ "starcos",	(void *(*)(void)) sc_get_starcos_driver },
+#endif
+#if SC_CARD_DRIVER(TCOS)
 	{ "tcos",	(void *(*)(void)) sc_get_tcos_driver },
+#endif
 #ifdef ENABLE_OPENSSL
+#if SC_CARD_DRIVER(OBERTHUR)
 	{ "oberthur",	(void *(*)(void)) sc_get_oberthur_driver },
+#endif
+#if SC_CARD_DRIVER(AUTHENTIC)
 	{ "authentic",	(void *(*)(void)) sc_get_authentic_driver },
+#endif
+#if SC_CARD_DRIVER(IASECC)
 	{ "iasecc",	(void *(*)(void)) sc_get_iasecc_driver },
 #endif
+#endif
+#if SC_CARD_DRIVER(BELPIC)
 	{ "belpic",	(void *(*)(void)) sc_get_belpic_driver },
+#endif
+#if SC_CARD_DRIVER(INCRYPTO34)
 	{ "incrypto34", (void *(*)(void)) sc_get_incrypto34_driver },
+#endif
+#if SC_CARD_DRIVER(AKIS)
 	{ "akis",	(void *(*)(void)) sc_get_akis_driver },
+#endif
 #ifdef ENABLE_OPENSSL
+#if SC_CARD_DRIVER(ENTERSAFE)
 	{ "entersafe",(void *(*)(void)) sc_get_entersafe_driver },
+#endif
 #ifdef ENABLE_SM
+#if SC_CARD_DRIVER(EPASS2003)
 	{ "epass2003",(void *(*)(void)) sc_get_epass2003_driver },
 #endif
 #endif
+#endif
+#if SC_CARD_DRIVER(RUTOKEN)
 	{ "rutoken",	(void *(*)(void)) sc_get_rutoken_driver },
+#endif
+#if SC_CARD_DRIVER(RUTOKEN_ECP)
 	{ "rutoken_ecp",(void *(*)(void)) sc_get_rtecp_driver },
+#endif
+#if SC_CARD_DRIVER(MYEID)
 	{ "myeid",      (void *(*)(void)) sc_get_myeid_driver },
+#endif
 #if defined(ENABLE_OPENSSL) && defined(ENABLE_SM)
+#if SC_CARD_DRIVER(DNIE)
 	{ "dnie",       (void *(*)(void)) sc_get_dnie_driver },
 #endif
+#endif
+#if SC_CARD_DRIVER(MASKTECH)
 	{ "masktech",	(void *(*)(void)) sc_get_masktech_driver },
+#endif
+#if SC_CARD_DRIVER(ATRUST_ACOS)
 	{ "atrust-acos",(void *(*)(void)) sc_get_atrust_acos_driver },
+#endif
+#if SC_CARD_DRIVER(WESTCOS)
 	{ "westcos",	(void *(*)(void)) sc_get_westcos_driver },
+#endif
+#if SC_CARD_DRIVER(ESTEID2018)
 	{ "esteid2018",	(void *(*)(void)) sc_get_esteid2018_driver },
+#endif
+#if SC_CARD_DRIVER(IDPRIME)
 	{ "idprime",	(void *(*)(void)) sc_get_idprime_driver },
+#endif
 #if defined(ENABLE_SM) && defined(ENABLE_OPENPACE)
+#if SC_CARD_DRIVER(EDO)
 	{ "edo",        (void *(*)(void)) sc_get_edo_driver },
 #endif
+#endif
 
 /* Here should be placed drivers that need some APDU transactions in the
  * driver's `match_card()` function. */
+#if SC_CARD_DRIVER(COOLKEY)
 	{ "coolkey",	(void *(*)(void)) sc_get_coolkey_driver },
+#endif
 	/* MUSCLE card applet returns 9000 on whatever AID is selected, see
 	 * https://github.com/JavaCardOS/MuscleCard-Applet/blob/master/musclecard/src/com/musclecard/CardEdge/CardEdge.java#L326
 	 * put the muscle driver first to cope with this bug. */
+#if SC_CARD_DRIVER(MUSCLE)
 	{ "muscle",	(void *(*)(void)) sc_get_muscle_driver },
+#endif
+#if SC_CARD_DRIVER(SC_HSM)
 	{ "sc-hsm",	(void *(*)(void)) sc_get_sc_hsm_driver },
+#endif
+#if SC_CARD_DRIVER(MCRD)
 	{ "mcrd",	(void *(*)(void)) sc_get_mcrd_driver },
+#endif
+#if SC_CARD_DRIVER(SETCOS)
 	{ "setcos",	(void *(*)(void)) sc_get_setcos_driver },
+#endif
+#if SC_CARD_DRIVER(PIV_II)
 	{ "PIV-II",	(void *(*)(void)) sc_get_piv_driver },
+#endif
+#if SC_CARD_DRIVER(CAC)
 	{ "cac",	(void *(*)(void)) sc_get_cac_driver },
+#endif
+#if SC_CARD_DRIVER(ITACNS)
 	{ "itacns",	(void *(*)(void)) sc_get_itacns_driver },
+#endif
+#if SC_CARD_DRIVER(ISOAPPLET)
 	{ "isoApplet",	(void *(*)(void)) sc_get_isoApplet_driver },
+#endif
 #ifdef ENABLE_ZLIB
+#if SC_CARD_DRIVER(GIDS)
 	{ "gids",	(void *(*)(void)) sc_get_gids_driver },
 #endif
+#endif
+#if SC_CARD_DRIVER(OPENPGP)
 	{ "openpgp",	(void *(*)(void)) sc_get_openpgp_driver },
+#endif
+#if SC_CARD_DRIVER(JPKI)
 	{ "jpki",	(void *(*)(void)) sc_get_jpki_driver },
+#endif
+#if SC_CARD_DRIVER(NPA)
 	{ "npa",	(void *(*)(void)) sc_get_npa_driver },
+#endif
+#if SC_CARD_DRIVER(CAC1)
 	{ "cac1",	(void *(*)(void)) sc_get_cac1_driver },
+#endif
 	/* The default driver should be last, as it handles all the
 	 * unrecognized cards. */
 	{ "default",	(void *(*)(void)) sc_get_default_driver },
@@ -161,8 +250,12 @@ static const struct _sc_driver_entry internal_card_drivers[] = {
 };
 
 static const struct _sc_driver_entry old_card_drivers[] = {
+#if SC_CARD_DRIVER(MIOCOS)
 	{ "miocos",	(void *(*)(void)) sc_get_miocos_driver },
+#endif
+#if SC_CARD_DRIVER(JCOP)
 	{ "jcop",	(void *(*)(void)) sc_get_jcop_driver },
+#endif
 	{ NULL, NULL }
 };
 
@@ -300,7 +393,11 @@ static void add_old_drvs(struct _sc_ctx_options *opts)
 
 static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
 {
+	int i;
+
 	ctx->debug = 0;
+	for (i = 0; i < SC_MAX_LOG_SUBSYSTEMS; i++)
+		ctx->debug_levels[i] = -1;
 	if (ctx->debug_file && (ctx->debug_file != stderr && ctx->debug_file != stdout))
 		fclose(ctx->debug_file);
 	ctx->debug_file = stderr;
@@ -322,6 +419,9 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
  */
 int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 {
+	size_t buffer = sc_log_writer_stop(ctx);
+	int r = SC_SUCCESS;
+
 	/* Close any existing handles */
 	if (ctx->debug_file && (ctx->debug_file != stderr && ctx->debug_file != stdout))   {
 		fclose(ctx->debug_file);
@@ -345,9 +445,11 @@ int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 	else {
 		ctx->debug_file = fopen(filename, "a");
 		if (ctx->debug_file == NULL)
-			return SC_ERROR_INTERNAL;
+			r = SC_ERROR_INTERNAL;
 	}
-	return SC_SUCCESS;
+	if (buffer)
+		sc_log_writer_start(ctx, buffer);
+	return r;
 }
 
 static void
@@ -367,10 +469,23 @@ set_drivers(struct _sc_ctx_options *opts, const scconf_list *list)
 	}
 }
 
+static const struct {
+	const char *name;
+	int id;
+} log_subsystems[] = {
+	{ "debug_reader", SC_LOG_SUBSYS_READER },
+	{ "debug_card", SC_LOG_SUBSYS_CARD },
+	{ "debug_sm", SC_LOG_SUBSYS_SM },
+	{ "debug_pkcs15", SC_LOG_SUBSYS_PKCS15 },
+	{ "debug_pkcs11", SC_LOG_SUBSYS_PKCS11 },
+	{ "debug_asn1", SC_LOG_SUBSYS_ASN1 },
+	{ NULL, 0 }
+};
+
 static int
 load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *opts)
 {
-	int err = 0;
+	int i, err = 0;
 	const scconf_list *list;
 	const char *val;
 	int debug;
@@ -382,6 +497,11 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 	debug = scconf_get_int(block, "debug", ctx->debug);
 	if (debug > ctx->debug)
 		ctx->debug = debug;
+	for (i = 0; log_subsystems[i].name != NULL; i++) {
+		debug = scconf_get_int(block, log_subsystems[i].name, -1);
+		if (debug > ctx->debug_levels[log_subsystems[i].id])
+			ctx->debug_levels[log_subsystems[i].id] = debug;
+	}
 
 	val = scconf_get_str(block, "debug_file", NULL);
 	if (val)   {
@@ -393,10 +513,14 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 #endif
 		sc_ctx_log_to_file(ctx, val);
 	}
-	else if (ctx->debug)   {
+	else if (sc_log_max_level(ctx))   {
 		sc_ctx_log_to_file(ctx, NULL);
 	}
 
+	debug = scconf_get_int(block, "debug_buffer", 0);
+	if (debug > 0 && sc_log_max_level(ctx) && !ctx->log_writer)
+		sc_log_writer_start(ctx, (size_t)debug * 1024);
+
 	if (scconf_get_bool (block, "disable_popups",
 				ctx->flags & SC_CTX_FLAG_DISABLE_POPUPS))
 		ctx->flags |= SC_CTX_FLAG_DISABLE_POPUPS;
@@ -409,6 +533,30 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 				ctx->flags & SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER))
 		ctx->flags |= SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER;
 
+	if (scconf_get_bool (block, "use_card_driver_cache",
+				ctx->flags & SC_CTX_FLAG_CACHE_CARD_DRIVER))
+		ctx->flags |= SC_CTX_FLAG_CACHE_CARD_DRIVER;
+
+	if (scconf_get_bool (block, "enable_read_ahead",
+				ctx->flags & SC_CTX_FLAG_READ_AHEAD))
+		ctx->flags |= SC_CTX_FLAG_READ_AHEAD;
+
+	if (scconf_get_bool (block, "enable_select_cache",
+				ctx->flags & SC_CTX_FLAG_SELECT_CACHE))
+		ctx->flags |= SC_CTX_FLAG_SELECT_CACHE;
+
+	val = scconf_get_str(block, "apdu_trace", NULL);
+	if (val && !ctx->apdu_trace)
+		sc_apdu_trace_open(ctx, val, (size_t)scconf_get_int(block,
+					"apdu_trace_records", SC_APDU_TRACE_DEFAULT_RECORDS));
+
+	val = scconf_get_str(block, "shared_stats", NULL);
+	if (val && !ctx->stats_shm)
+		sc_stats_shm_open(ctx, val);
+
+	ctx->apdu_latency = (unsigned int)scconf_get_int(block, "apdu_latency",
+			(int)ctx->apdu_latency);
+
 	list = scconf_find_list(block, "card_drivers");
 	set_drivers(opts, list);
 
@@ -525,6 +673,78 @@ static int load_card_driver_options(sc_context_t *ctx,
 	return SC_SUCCESS;
 }
 
+/*
+ * External card drivers are only loaded when a card is connected, most
+ * processes never see the cards they are for. Until then the driver
+ * list holds a stub without ops, named after the configuration entry.
+ */
+struct sc_lazy_card_driver {
+	struct sc_card_driver driver;
+	char *module_name;
+	int failed;
+	struct sc_lazy_card_driver *next;
+};
+
+static struct sc_card_driver *add_lazy_card_driver(sc_context_t *ctx, const char *name)
+{
+	struct sc_lazy_card_driver *lazy;
+
+	lazy = calloc(1, sizeof *lazy);
+	if (lazy == NULL)
+		return NULL;
+	lazy->module_name = strdup(name);
+	if (lazy->module_name == NULL) {
+		free(lazy);
+		return NULL;
+	}
+	lazy->driver.name = lazy->module_name;
+	lazy->driver.short_name = lazy->module_name;
+	lazy->next = ctx->lazy_card_drivers;
+	ctx->lazy_card_drivers = lazy;
+	return &lazy->driver;
+}
+
+int _sc_load_card_driver(sc_context_t *ctx, struct sc_card_driver *driver)
+{
+	struct sc_lazy_card_driver *lazy;
+	struct sc_card_driver *(*func)(void) = NULL;
+	struct sc_card_driver *(**tfunc)(void) = &func;
+	struct sc_card_driver *drv = NULL;
+	void *dll = NULL;
+	int r = SC_SUCCESS;
+
+	if (driver->ops != NULL)
+		return SC_SUCCESS;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (lazy = ctx->lazy_card_drivers; lazy != NULL; lazy = lazy->next)
+		if (&lazy->driver == driver)
+			break;
+	if (lazy == NULL || lazy->failed) {
+		r = SC_ERROR_OBJECT_NOT_FOUND;
+	} else if (driver->ops == NULL) {
+		*(void **)(tfunc) = load_dynamic_driver(ctx, &dll, lazy->module_name);
+		if (func != NULL)
+			drv = func();
+		if (drv == NULL || drv->ops == NULL) {
+			sc_log(ctx, "Unable to load '%s'.", lazy->module_name);
+			if (dll)
+				sc_dlclose(dll);
+			lazy->failed = 1;
+			r = SC_ERROR_OBJECT_NOT_FOUND;
+		} else {
+			/* the ATRs of the configuration stay with the stub */
+			driver->name = drv->name;
+			driver->short_name = drv->short_name;
+			driver->dll = dll;
+			driver->ops = drv->ops;
+			load_card_driver_options(ctx, driver);
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+	return r;
+}
+
 static int load_card_drivers(sc_context_t *ctx, struct _sc_ctx_options *opts)
 {
 	const struct _sc_driver_entry *ent;
@@ -536,8 +756,6 @@ static int load_card_drivers(sc_context_t *ctx, struct _sc_ctx_options *opts)
 
 	for (i = 0; i < opts->ccount; i++) {
 		struct sc_card_driver *(*func)(void) = NULL;
-		struct sc_card_driver *(**tfunc)(void) = &func;
-		void *dll = NULL;
 		int  j;
 
 		if (drv_count >= SC_MAX_CARD_DRIVERS - 1)   {
@@ -560,14 +778,15 @@ static int load_card_drivers(sc_context_t *ctx, struct _sc_ctx_options *opts)
 				}
 			}
 		}
-		/* if not initialized assume external module */
-		if (func == NULL)
-			*(void **)(tfunc) = load_dynamic_driver(ctx, &dll, ent->name);
-		/* if still null, assume driver not found */
+		/* if not initialized assume external module, loaded on first use */
 		if (func == NULL) {
-			sc_log(ctx, "Unable to load '%s'.", ent->name);
-			if (dll)
-				sc_dlclose(dll);
+			if (find_library(ctx, ent->name) == NULL
+					|| (ctx->card_drivers[drv_count] = add_lazy_card_driver(ctx, ent->name)) == NULL) {
+				sc_log(ctx, "Unable to load '%s'.", ent->name);
+				continue;
+			}
+			ctx->card_drivers[drv_count + 1] = NULL;
+			drv_count++;
 			continue;
 		}
 
@@ -577,7 +796,7 @@ static int load_card_drivers(sc_context_t *ctx, struct _sc_ctx_options *opts)
 			continue;
 		}
 
-		ctx->card_drivers[drv_count]->dll = dll;
+		ctx->card_drivers[drv_count]->dll = NULL;
 		ctx->card_drivers[drv_count]->atr_map = NULL;
 		ctx->card_drivers[drv_count]->natrs = 0;
 
@@ -653,6 +872,10 @@ static int load_card_atrs(sc_context_t *ctx)
 					flags = SC_CARD_FLAG_RNG;
 				else if (!strcmp(list->data, "keep_alive"))
 					flags = SC_CARD_FLAG_KEEP_ALIVE;
+				else if (!strcmp(list->data, "chained_write"))
+					flags = SC_CARD_FLAG_CHAINED_WRITE;
+				else if (!strcmp(list->data, "read_records"))
+					flags = SC_CARD_FLAG_READ_RECORDS;
 				else if (sscanf(list->data, "%x", &flags) != 1)
 					flags = 0;
 
@@ -667,12 +890,142 @@ static int load_card_atrs(sc_context_t *ctx)
 	return SC_SUCCESS;
 }
 
+/*
+ * The contexts of a process that read the same, unchanged configuration
+ * file share its parsed form. A shared configuration is never modified,
+ * contexts that want to change ctx->conf are created with
+ * SC_CTX_FLAG_PRIVATE_CONF.
+ */
+struct sc_shared_conf {
+	struct sc_shared_conf *next;
+	scconf_context *conf;
+	char *cache;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	time_t ctime;
+	unsigned int refs;
+};
+
+static struct sc_shared_conf *shared_confs = NULL;
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+static pthread_mutex_t shared_conf_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define shared_conf_lock()	pthread_mutex_lock(&shared_conf_mutex)
+#define shared_conf_unlock()	pthread_mutex_unlock(&shared_conf_mutex)
+#elif defined(_WIN32)
+static SRWLOCK shared_conf_mutex = SRWLOCK_INIT;
+#define shared_conf_lock()	AcquireSRWLockExclusive(&shared_conf_mutex)
+#define shared_conf_unlock()	ReleaseSRWLockExclusive(&shared_conf_mutex)
+#else
+#define shared_conf_lock()
+#define shared_conf_unlock()
+#endif
+
+static int shared_conf_matches(const struct sc_shared_conf *sc, const char *path,
+		const char *cache, const struct stat *st)
+{
+	if (strcmp(sc->conf->filename, path) != 0)
+		return 0;
+	if ((sc->cache == NULL) != (cache == NULL)
+			|| (cache != NULL && strcmp(sc->cache, cache) != 0))
+		return 0;
+	return sc->dev == st->st_dev && sc->ino == st->st_ino
+		&& sc->size == st->st_size && sc->mtime == st->st_mtime
+		&& sc->ctime == st->st_ctime;
+}
+
+/* Returns a reference to the parsed form of the file, or NULL */
+static scconf_context *shared_conf_get(const char *path, const char *cache,
+		const struct stat *st)
+{
+	struct sc_shared_conf *sc;
+	scconf_context *conf = NULL;
+
+	shared_conf_lock();
+	for (sc = shared_confs; sc != NULL; sc = sc->next) {
+		if (shared_conf_matches(sc, path, cache, st)) {
+			sc->refs++;
+			conf = sc->conf;
+			break;
+		}
+	}
+	shared_conf_unlock();
+	return conf;
+}
+
+/* Publishes a freshly parsed configuration and returns the one to use */
+static scconf_context *shared_conf_add(scconf_context *conf, const char *cache,
+		const struct stat *st)
+{
+	struct sc_shared_conf *sc;
+
+	shared_conf_lock();
+	for (sc = shared_confs; sc != NULL; sc = sc->next) {
+		if (shared_conf_matches(sc, conf->filename, cache, st)) {
+			/* another context parsed the file meanwhile */
+			sc->refs++;
+			shared_conf_unlock();
+			scconf_free(conf);
+			return sc->conf;
+		}
+	}
+	sc = calloc(1, sizeof(*sc));
+	if (sc != NULL && cache != NULL && (sc->cache = strdup(cache)) == NULL) {
+		free(sc);
+		sc = NULL;
+	}
+	if (sc != NULL) {
+		sc->conf = conf;
+		sc->dev = st->st_dev;
+		sc->ino = st->st_ino;
+		sc->size = st->st_size;
+		sc->mtime = st->st_mtime;
+		sc->ctime = st->st_ctime;
+		sc->refs = 1;
+		sc->next = shared_confs;
+		shared_confs = sc;
+	}
+	shared_conf_unlock();
+	/* without memory to share it the configuration stays private */
+	return conf;
+}
+
+static void shared_conf_release(scconf_context *conf)
+{
+	struct sc_shared_conf **p, *sc;
+
+	shared_conf_lock();
+	for (p = &shared_confs; *p != NULL; p = &(*p)->next) {
+		if ((*p)->conf == conf)
+			break;
+	}
+	sc = *p;
+	if (sc != NULL) {
+		if (--sc->refs > 0) {
+			shared_conf_unlock();
+			return;
+		}
+		*p = sc->next;
+	}
+	shared_conf_unlock();
+	if (sc != NULL) {
+		free(sc->cache);
+		free(sc);
+	}
+	scconf_free(conf);
+}
+
 static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 {
 	int i, r, count = 0;
 	scconf_block **blocks;
 	const char *conf_path = NULL;
+	const char *conf_cache = NULL;
 	const char *debug = NULL;
+	struct stat st;
+	int shared;
 #ifdef _WIN32
 	char temp_path[PATH_MAX];
 	size_t temp_len;
@@ -699,10 +1052,22 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	if (!conf_path)
 		conf_path = OPENSC_CONF_PATH;
 #endif
+	/* a compiled snapshot saves parsing the file in every process */
+	conf_cache = getenv("OPENSC_CONF_CACHE");
+	shared = !(ctx->flags & SC_CTX_FLAG_PRIVATE_CONF) && stat(conf_path, &st) == 0;
+	if (shared && (ctx->conf = shared_conf_get(conf_path, conf_cache, &st)) != NULL) {
+		sc_log(ctx, "Using the already parsed configuration file");
+		goto blocks;
+	}
 	ctx->conf = scconf_new(conf_path);
 	if (ctx->conf == NULL)
 		return;
-	r = scconf_parse(ctx->conf);
+	r = conf_cache ? scconf_load_compiled(ctx->conf, conf_cache) : 0;
+	if (r < 1) {
+		r = scconf_parse(ctx->conf);
+		if (r == 1 && conf_cache)
+			scconf_save_compiled(ctx->conf, conf_cache);
+	}
 #ifdef OPENSC_CONFIG_STRING
 	/* Parse the string if config file didn't exist */
 	if (r < 0)
@@ -720,6 +1085,9 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 		ctx->conf = NULL;
 		return;
 	}
+	if (shared)
+		ctx->conf = shared_conf_add(ctx->conf, conf_cache, &st);
+blocks:
 	/* needs to be after the log file is known */
 	sc_log(ctx, "Used configuration file '%s'", conf_path);
 	blocks = scconf_find_blocks(ctx->conf, NULL, "app", ctx->app_name);
@@ -753,6 +1121,32 @@ int sc_ctx_detect_readers(sc_context_t *ctx)
 	return r;
 }
 
+int sc_ctx_reinit_after_fork(sc_context_t *ctx)
+{
+	int r;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(ctx);
+
+	if (ctx->reader_driver->ops->fork_child == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
+
+	/* the mutexes may be held by threads of the parent, which do not
+	 * exist in the child, so they are replaced rather than destroyed */
+	ctx->mutex = NULL;
+	r = sc_mutex_create(ctx, &ctx->mutex);
+	LOG_TEST_RET(ctx, r, "Cannot create context mutex");
+	if (ctx->stats_mutex != NULL) {
+		ctx->stats_mutex = NULL;
+		r = sc_mutex_create(ctx, &ctx->stats_mutex);
+		LOG_TEST_RET(ctx, r, "Cannot create statistics mutex");
+	}
+
+	r = ctx->reader_driver->ops->fork_child(ctx);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
 sc_reader_t *sc_ctx_get_reader(sc_context_t *ctx, unsigned int i)
 {
 	return list_get_at(&ctx->readers, i);
@@ -807,6 +1201,7 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 	struct _sc_ctx_options	opts;
 	int			r;
 	char			*driver;
+	unsigned long long	start;
 
 	if (ctx_out == NULL || parm == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -826,8 +1221,8 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 		return SC_ERROR_OUT_OF_MEMORY;
 	}
 
-	ctx->flags = parm->flags;
 	set_defaults(ctx, &opts);
+	ctx->flags = parm->flags;
 
 	if (0 != list_init(&ctx->readers)) {
 		del_drvs(&opts);
@@ -838,7 +1233,11 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 	/* set thread context and create mutex object (if specified) */
 	if (parm->thread_ctx != NULL)
 		ctx->thread_ctx = parm->thread_ctx;
+	if (parm->ver >= 1)
+		ctx->allocator = parm->allocator;
 	r = sc_mutex_create(ctx, &ctx->mutex);
+	if (r == SC_SUCCESS)
+		r = sc_mutex_create(ctx, &ctx->stats_mutex);
 	if (r != SC_SUCCESS) {
 		del_drvs(&opts);
 		sc_release_context(ctx);
@@ -850,22 +1249,39 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 		CRYPTO_secure_malloc_init(OPENSSL_SECURE_MALLOC_SIZE, OPENSSL_SECURE_MALLOC_SIZE/8);
 	}
 #endif
+#ifdef ENABLE_OPENSSL
+	r = sc_evp_cache_init(ctx);
+	if (r != SC_SUCCESS) {
+		del_drvs(&opts);
+		sc_release_context(ctx);
+		return r;
+	}
+#endif
 
+	start = sc_stats_now();
 	process_config_file(ctx, &opts);
+	ctx->stats.startup.config_us = sc_stats_now() - start;
 	sc_log(ctx, "==================================="); /* first thing in the log */
 	sc_log(ctx, "opensc version: %s", sc_get_version());
 
+	if (sc_replay_trace_file(ctx) != NULL)
+		ctx->reader_driver = sc_get_replay_driver();
+	else
 #ifdef ENABLE_PCSC
-	ctx->reader_driver = sc_get_pcsc_driver();
+		ctx->reader_driver = sc_get_pcsc_driver();
 #elif defined(ENABLE_CRYPTOTOKENKIT)
-	ctx->reader_driver = sc_get_cryptotokenkit_driver();
+		ctx->reader_driver = sc_get_cryptotokenkit_driver();
 #elif defined(ENABLE_CTAPI)
-	ctx->reader_driver = sc_get_ctapi_driver();
+		ctx->reader_driver = sc_get_ctapi_driver();
 #elif defined(ENABLE_OPENCT)
-	ctx->reader_driver = sc_get_openct_driver();
+		ctx->reader_driver = sc_get_openct_driver();
+#else
+		ctx->reader_driver = sc_get_replay_driver();
 #endif
 
+	start = sc_stats_now();
 	r = ctx->reader_driver->ops->init(ctx);
+	ctx->stats.startup.reader_init_us = sc_stats_now() - start;
 	if (r != SC_SUCCESS)   {
 		del_drvs(&opts);
 		sc_release_context(ctx);
@@ -880,11 +1296,17 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 		scconf_list_destroy(list);
 	}
 
+	start = sc_stats_now();
 	load_card_drivers(ctx, &opts);
 	load_card_atrs(ctx);
+	ctx->stats.startup.drivers_us = sc_stats_now() - start;
 
 	del_drvs(&opts);
-	sc_ctx_detect_readers(ctx);
+	if (!(ctx->flags & SC_CTX_FLAG_DEFER_READER_DETECTION)) {
+		start = sc_stats_now();
+		sc_ctx_detect_readers(ctx);
+		ctx->stats.startup.detect_us = sc_stats_now() - start;
+	}
 	*ctx_out = ctx;
 
 	return SC_SUCCESS;
@@ -929,6 +1351,8 @@ int sc_release_context(sc_context_t *ctx)
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+	/* while the readers are still around */
+	sc_stats_shm_close(ctx);
 	while (list_size(&ctx->readers)) {
 		sc_reader_t *rdr = (sc_reader_t *) list_get_at(&ctx->readers, 0);
 		_sc_delete_reader(ctx, rdr);
@@ -945,8 +1369,22 @@ int sc_release_context(sc_context_t *ctx)
 		if (drv->dll)
 			sc_dlclose(drv->dll);
 	}
+	while (ctx->lazy_card_drivers != NULL) {
+		struct sc_lazy_card_driver *lazy = ctx->lazy_card_drivers;
+
+		ctx->lazy_card_drivers = lazy->next;
+		free(lazy->module_name);
+		free(lazy);
+	}
 	if (ctx->preferred_language != NULL)
 		free(ctx->preferred_language);
+	sc_profile_cache_free(ctx);
+	_sc_atr_cache_free(ctx);
+	_sc_dir_cache_free(ctx);
+	sc_pkcs15_conf_free(ctx);
+#ifdef ENABLE_SM
+	sc_sm_module_cache_free(ctx);
+#endif
 	if (ctx->mutex != NULL) {
 		int r = sc_mutex_destroy(ctx, ctx->mutex);
 		if (r != SC_SUCCESS) {
@@ -954,8 +1392,15 @@ int sc_release_context(sc_context_t *ctx)
 			return r;
 		}
 	}
+	if (ctx->stats_mutex != NULL)
+		sc_mutex_destroy(ctx, ctx->stats_mutex);
+	sc_apdu_trace_close(ctx);
+	sc_log_writer_stop(ctx);
+#ifdef ENABLE_OPENSSL
+	sc_evp_cache_free(ctx);
+#endif
 	if (ctx->conf != NULL)
-		scconf_free(ctx->conf);
+		shared_conf_release(ctx->conf);
 	if (ctx->debug_file && (ctx->debug_file != stdout && ctx->debug_file != stderr))
 		fclose(ctx->debug_file);
 	if (ctx->debug_filename != NULL)
@@ -968,6 +1413,177 @@ int sc_release_context(sc_context_t *ctx)
 	return SC_SUCCESS;
 }
 
+unsigned long long sc_stats_now(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000
+		+ (unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static void stats_add(struct sc_stats_timing *timing, unsigned long long us)
+{
+	static const unsigned long limits[SC_STATS_HISTOGRAM_SIZE] = SC_STATS_HISTOGRAM_LIMITS_US;
+	unsigned int i;
+
+	for (i = 0; i < SC_STATS_HISTOGRAM_SIZE - 1; i++)
+		if (us < limits[i])
+			break;
+	timing->histogram[i]++;
+	timing->count++;
+	timing->total_us += us;
+	if (us > timing->max_us)
+		timing->max_us = us;
+}
+
+static unsigned long long stats_elapsed(unsigned long long start)
+{
+	unsigned long long now = sc_stats_now();
+
+	return now > start ? now - start : 0;
+}
+
+void sc_stats_apdu(sc_reader_t *reader, unsigned long long start, int rv)
+{
+	sc_context_t *ctx = reader->ctx;
+	unsigned long long us = stats_elapsed(start);
+
+	sc_mutex_lock(ctx, ctx->stats_mutex);
+	stats_add(&reader->apdu_stats, us);
+	stats_add(&ctx->stats.apdu, us);
+	if (rv < 0)
+		ctx->stats.apdu_errors++;
+	sc_mutex_unlock(ctx, ctx->stats_mutex);
+	sc_stats_shm_publish(ctx, 0);
+}
+
+void sc_stats_timing(sc_context_t *ctx, struct sc_stats_timing *timing,
+		unsigned long long start)
+{
+	unsigned long long us = stats_elapsed(start);
+
+	sc_mutex_lock(ctx, ctx->stats_mutex);
+	stats_add(timing, us);
+	sc_mutex_unlock(ctx, ctx->stats_mutex);
+	sc_stats_shm_publish(ctx, 0);
+}
+
+void sc_stats_count(sc_context_t *ctx, unsigned long long *counter, size_t n)
+{
+	sc_mutex_lock(ctx, ctx->stats_mutex);
+	*counter += n;
+	sc_mutex_unlock(ctx, ctx->stats_mutex);
+}
+
+void sc_stats_queue(sc_context_t *ctx, int delta)
+{
+	sc_mutex_lock(ctx, ctx->stats_mutex);
+	if (delta < 0 && ctx->stats.queue_depth < (unsigned long long)-delta)
+		ctx->stats.queue_depth = 0;
+	else
+		ctx->stats.queue_depth += delta;
+	if (ctx->stats.queue_depth > ctx->stats.queue_depth_max)
+		ctx->stats.queue_depth_max = ctx->stats.queue_depth;
+	sc_mutex_unlock(ctx, ctx->stats_mutex);
+}
+
+unsigned long long sc_stats_reader_apdus(sc_reader_t *reader)
+{
+	unsigned long long count;
+
+	sc_mutex_lock(reader->ctx, reader->ctx->stats_mutex);
+	count = reader->apdu_stats.count;
+	sc_mutex_unlock(reader->ctx, reader->ctx->stats_mutex);
+
+	return count;
+}
+
+void sc_stats_operation(sc_reader_t *reader, struct sc_stats_operation *op,
+		unsigned long long apdus_before)
+{
+	sc_context_t *ctx = reader->ctx;
+	unsigned long long apdus;
+
+	sc_mutex_lock(ctx, ctx->stats_mutex);
+	/* the counters may have been reset in between */
+	apdus = reader->apdu_stats.count >= apdus_before
+		? reader->apdu_stats.count - apdus_before : reader->apdu_stats.count;
+	op->count++;
+	op->apdus += apdus;
+	if (apdus > op->max_apdus)
+		op->max_apdus = apdus;
+	sc_mutex_unlock(ctx, ctx->stats_mutex);
+}
+
+int sc_ctx_get_stats(sc_context_t *ctx, struct sc_stats *stats)
+{
+	if (ctx == NULL || stats == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	sc_mutex_lock(ctx, ctx->stats_mutex);
+	*stats = ctx->stats;
+	sc_mutex_unlock(ctx, ctx->stats_mutex);
+
+	return SC_SUCCESS;
+}
+
+int sc_reader_get_stats(sc_reader_t *reader, struct sc_stats_timing *apdu)
+{
+	if (reader == NULL || reader->ctx == NULL || apdu == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	sc_mutex_lock(reader->ctx, reader->ctx->stats_mutex);
+	*apdu = reader->apdu_stats;
+	sc_mutex_unlock(reader->ctx, reader->ctx->stats_mutex);
+
+	return SC_SUCCESS;
+}
+
+int sc_ctx_reset_stats(sc_context_t *ctx)
+{
+	unsigned long long queue_depth;
+	unsigned long long in_use[SC_MEM_COUNT];
+	unsigned int i;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	sc_mutex_lock(ctx, ctx->stats_mutex);
+	/* gauges, not counters */
+	queue_depth = ctx->stats.queue_depth;
+	for (i = 0; i < SC_MEM_COUNT; i++)
+		in_use[i] = ctx->stats.memory[i].in_use;
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	ctx->stats.queue_depth = queue_depth;
+	ctx->stats.queue_depth_max = queue_depth;
+	for (i = 0; i < SC_MEM_COUNT; i++)
+		ctx->stats.memory[i].in_use = ctx->stats.memory[i].peak = in_use[i];
+	for (i = 0; i < list_size(&ctx->readers); i++) {
+		sc_reader_t *reader = list_get_at(&ctx->readers, i);
+		if (reader)
+			memset(&reader->apdu_stats, 0, sizeof(reader->apdu_stats));
+	}
+	sc_mutex_unlock(ctx, ctx->stats_mutex);
+
+	return SC_SUCCESS;
+}
+
 int sc_set_card_driver(sc_context_t *ctx, const char *short_name)
 {
 	int i = 0, match = 0;
@@ -996,12 +1612,12 @@ int sc_get_cache_dir(sc_context_t *ctx, char *buf, size_t bufsize)
 {
 	char *homedir;
 	const char *cache_dir;
-        scconf_block *conf_block = NULL;
+	const struct sc_pkcs15_conf *conf;
 #ifdef _WIN32
 	char temp_path[PATH_MAX];
 #endif
-	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
-	cache_dir = scconf_get_str(conf_block, "file_cache_dir", NULL);
+	conf = sc_pkcs15_get_conf(ctx);
+	cache_dir = conf ? conf->file_cache_dir : NULL;
 	if (cache_dir != NULL) {
 		strlcpy(buf, cache_dir, bufsize);
 		return SC_SUCCESS;
@@ -22,6 +22,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_SM
+
 #define __CWA14890_C__
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -79,7 +81,7 @@ typedef struct cwa_tlv_st {
 static void cwa_trace_apdu(sc_card_t * card, sc_apdu_t * apdu, int flag)
 {
 	char buf[2048];
-	if (!card || !card->ctx || !apdu || card->ctx->debug < SC_LOG_DEBUG_NORMAL)
+	if (!card || !card->ctx || !apdu || !SC_LOG_ENABLED(card->ctx, SC_LOG_DEBUG_NORMAL))
 		return;
 	if (flag == 0) {	/* apdu command */
 		if (apdu->datalen > 0) {	/* apdu data to show */
@@ -994,7 +996,7 @@ static int cwa_verify_internal_auth(sc_card_t * card,
  *
  * @param card card info structure
  * @param provider cwa14890 info provider
- * @param flag requested init method ( OFF, COLD, WARM )
+ * @param flag requested init method ( OFF, ON, WARM )
  * @return SC_SUCCESS if OK; else error code
  */
 int cwa_create_secure_channel(sc_card_t * card,
@@ -1038,6 +1040,12 @@ int cwa_create_secure_channel(sc_card_t * card,
 		card->sm_ctx.sm_mode = SM_MODE_NONE;
 		sc_log(ctx, "Setting CWA SM status to none");
 		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	case CWA_SM_WARM:	/* reuse the channel if it is up */
+		if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT) {
+			sc_log(ctx, "CWA SM channel already established");
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+		/* fall through */
 	case CWA_SM_ON:	/* force sm initialization process */
 		sc_log(ctx, "CWA SM initialization requested");
 		break;
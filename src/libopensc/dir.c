@@ -23,11 +23,19 @@
 #endif
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
 
 #include "internal.h"
 #include "asn1.h"
+#include "pkcs15.h"
+#include "common/compat_strlcpy.h"
 
 struct app_entry {
 	const u8 *aid;
@@ -61,7 +69,7 @@ parse_dir_record(sc_card_t *card, u8 ** buf, size_t *buflen, int rec_nr)
 {
 	struct sc_context *ctx = card->ctx;
 	struct sc_asn1_entry asn1_dirrecord[5], asn1_dir[2];
-	scconf_block *conf_block = NULL;
+	const struct sc_pkcs15_conf *conf;
 	sc_app_info_t *app = NULL;
 	struct sc_aid aid;
 	u8 label[128], path[128], ddo[128];
@@ -85,20 +93,15 @@ parse_dir_record(sc_card_t *card, u8 ** buf, size_t *buflen, int rec_nr)
 		LOG_FUNC_RETURN(ctx, r);
 	LOG_TEST_RET(ctx, r, "EF(DIR) parsing failed");
 
-	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
-	if (conf_block)   {
-		scconf_block **blocks = NULL;
+	conf = sc_pkcs15_get_conf(ctx);
+	if (conf && conf->app_count)   {
+		const struct sc_pkcs15_conf_app *conf_app;
 		char aid_str[SC_MAX_AID_STRING_SIZE];
-		int ignore_app = 0;
 
 		sc_bin_to_hex(aid.value, aid.len, aid_str, sizeof(aid_str), 0);
-		blocks = scconf_find_blocks(card->ctx->conf, conf_block, "application", aid_str);
-		if (blocks)   {
-			ignore_app = (blocks[0] && scconf_get_str(blocks[0], "disable", 0));
-                        free(blocks);
-		 }
+		conf_app = sc_pkcs15_conf_find_app(conf, aid_str);
 
-		if (ignore_app)   {
+		if (conf_app && conf_app->disable)   {
 			sc_log(ctx, "Application '%s' ignored", aid_str);
 			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 		}
@@ -155,20 +158,295 @@ parse_dir_record(sc_card_t *card, u8 ** buf, size_t *buflen, int rec_nr)
 }
 
 
-int sc_enum_apps(sc_card_t *card)
+/*
+ * The content of EF.DIR is kept per context and, with use_file_caching, in
+ * the cache directory, for cards that can be told apart by their serial
+ * number or UID without sending a command. It is stored as it was read:
+ * entries of record number (1), length (2, big endian) and data, with
+ * record number 0 for a transparent EF.DIR.
+ */
+#define DIR_CACHE_PREFIX	"efdir-"
+#define DIR_CACHE_KEY_SIZE	(sizeof(DIR_CACHE_PREFIX) + SC_MAX_ATR_SIZE * 2 + 1 + SC_MAX_SERIALNR * 2 + 4)
+#define RANDOM_UID_INDICATOR	0x08
+
+struct sc_dir_cache {
+	struct sc_dir_cache *next;
+	char key[DIR_CACHE_KEY_SIZE];
+	u8 *data;
+	size_t len;
+};
+
+static int dir_cache_key(sc_card_t *card, char *key, size_t keysize)
+{
+	char atr[SC_MAX_ATR_SIZE * 2 + 1], id[SC_MAX_SERIALNR * 2 + 1];
+	const char *kind;
+
+	if (card->serialnr.len) {
+		kind = "s";
+		sc_bin_to_hex(card->serialnr.value, card->serialnr.len, id, sizeof(id), 0);
+	} else if (card->uid.len && card->uid.value[0] != RANDOM_UID_INDICATOR) {
+		kind = "u";
+		sc_bin_to_hex(card->uid.value, card->uid.len, id, sizeof(id), 0);
+	} else {
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+	sc_bin_to_hex(card->atr.value, card->atr.len, atr, sizeof(atr), 0);
+	snprintf(key, keysize, DIR_CACHE_PREFIX "%s-%s%s", atr, kind, id);
+	return SC_SUCCESS;
+}
+
+static int dir_cache_persistent(sc_context_t *ctx, const char *key, char *fname, size_t fname_size)
+{
+	const struct sc_pkcs15_conf *conf;
+
+	conf = sc_pkcs15_get_conf(ctx);
+	if (!conf || !conf->block || !conf->opts.use_file_cache)
+		return SC_ERROR_NOT_SUPPORTED;
+	if (sc_get_cache_dir(ctx, fname, fname_size) != SC_SUCCESS
+			|| strlen(fname) + strlen(key) + 2 > fname_size)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	strcat(fname, "/");
+	strcat(fname, key);
+	return SC_SUCCESS;
+}
+
+static int dir_cache_lookup(sc_card_t *card, const char *key, u8 **data, size_t *len)
+{
+	sc_context_t *ctx = card->ctx;
+	struct sc_dir_cache *entry;
+	char fname[PATH_MAX];
+	u8 *buf = NULL;
+	long size;
+	FILE *f;
+	int r = SC_ERROR_FILE_NOT_FOUND;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (entry = ctx->dir_cache; entry != NULL; entry = entry->next) {
+		if (strcmp(entry->key, key))
+			continue;
+		buf = malloc(entry->len ? entry->len : 1);
+		if (buf != NULL) {
+			memcpy(buf, entry->data, entry->len);
+			*data = buf;
+			*len = entry->len;
+			r = SC_SUCCESS;
+		}
+		break;
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+	if (r == SC_SUCCESS || dir_cache_persistent(ctx, key, fname, sizeof(fname)) != SC_SUCCESS)
+		return r;
+
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && size <= 16 * (MAX_FILE_SIZE + 3)
+			&& fseek(f, 0, SEEK_SET) == 0 && (buf = malloc(size)) != NULL) {
+		if (fread(buf, 1, size, f) == (size_t)size) {
+			*data = buf;
+			*len = size;
+			r = SC_SUCCESS;
+		} else {
+			free(buf);
+		}
+	}
+	fclose(f);
+	return r;
+}
+
+static void dir_cache_store(sc_card_t *card, const char *key, const u8 *data, size_t len, int persistent)
+{
+	sc_context_t *ctx = card->ctx;
+	struct sc_dir_cache *entry;
+	char fname[PATH_MAX], tmpname[PATH_MAX + 16];
+	FILE *f;
+	int r;
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL || (entry->data = malloc(len ? len : 1)) == NULL) {
+		free(entry);
+		return;
+	}
+	strlcpy(entry->key, key, sizeof(entry->key));
+	memcpy(entry->data, data, len);
+	entry->len = len;
+	sc_mutex_lock(ctx, ctx->mutex);
+	entry->next = ctx->dir_cache;
+	ctx->dir_cache = entry;
+	sc_mutex_unlock(ctx, ctx->mutex);
+
+	if (!persistent || dir_cache_persistent(ctx, key, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	snprintf(tmpname, sizeof(tmpname), "%s.%lu", fname, (unsigned long)getpid());
+	f = fopen(tmpname, "wb");
+	if (f == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(ctx) < 0)
+			return;
+		f = fopen(tmpname, "wb");
+	}
+	if (f == NULL)
+		return;
+	r = fwrite(data, 1, len, f) != len;
+	if (fclose(f) != 0 || r) {
+		unlink(tmpname);
+		return;
+	}
+#ifdef _WIN32
+	remove(fname);
+#endif
+	if (rename(tmpname, fname) != 0) {
+		sc_log(ctx, "failed to update %s", fname);
+		unlink(tmpname);
+	}
+}
+
+static void dir_cache_drop(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	struct sc_dir_cache **pp, *entry;
+	char key[DIR_CACHE_KEY_SIZE], fname[PATH_MAX];
+
+	if (dir_cache_key(card, key, sizeof(key)) != SC_SUCCESS)
+		return;
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (pp = &ctx->dir_cache; *pp != NULL; ) {
+		entry = *pp;
+		if (!strcmp(entry->key, key)) {
+			*pp = entry->next;
+			free(entry->data);
+			free(entry);
+		} else {
+			pp = &entry->next;
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+	if (dir_cache_persistent(ctx, key, fname, sizeof(fname)) == SC_SUCCESS)
+		unlink(fname);
+}
+
+void _sc_dir_cache_free(sc_context_t *ctx)
+{
+	while (ctx->dir_cache != NULL) {
+		struct sc_dir_cache *entry = ctx->dir_cache;
+
+		ctx->dir_cache = entry->next;
+		free(entry->data);
+		free(entry);
+	}
+}
+
+static int dir_content_add(u8 **content, size_t *content_len, int rec_nr,
+		const u8 *data, size_t len)
+{
+	u8 *p;
+
+	p = realloc(*content, *content_len + 3 + len);
+	if (p == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	p[*content_len] = (u8) rec_nr;
+	p[*content_len + 1] = (u8) (len >> 8);
+	p[*content_len + 2] = (u8) len;
+	memcpy(p + *content_len + 3, data, len);
+	*content = p;
+	*content_len += 3 + len;
+	return SC_SUCCESS;
+}
+
+static int parse_dir_content(sc_card_t *card, const u8 *content, size_t content_len)
+{
+	size_t len;
+	int rec_nr, r;
+	u8 *p;
+
+	while (content_len >= 3) {
+		rec_nr = content[0];
+		len = (content[1] << 8) | content[2];
+		if (len > content_len - 3)
+			return SC_ERROR_INVALID_DATA;
+		p = (u8 *) content + 3;
+		content += 3 + len;
+		content_len -= 3 + len;
+
+		if (rec_nr == 0) {
+			while (len > 0) {
+				if (card->app_count == SC_MAX_CARD_APPS) {
+					sc_log(card->ctx, "Too many applications on card");
+					break;
+				}
+				r = parse_dir_record(card, &p, &len, -1);
+				if (r)
+					break;
+			}
+		} else {
+			if (card->app_count == SC_MAX_CARD_APPS) {
+				sc_log(card->ctx, "Too many applications on card");
+				break;
+			}
+			parse_dir_record(card, &p, &len, rec_nr);
+		}
+	}
+	return SC_SUCCESS;
+}
+
+/* Reads the records of EF.DIR with a single READ RECORD(S) and stores the
+ * complete ones. Returns the number of the first record not read, or
+ * 'last' if there are no more. */
+static int read_dir_records(sc_card_t *card, unsigned int last,
+		u8 **content, size_t *content_len)
+{
+	size_t len = sc_get_max_recv_size(card), left;
+	const u8 *p, *rec;
+	unsigned int rec_nr = 1, cla, tag;
+	size_t taglen;
+	u8 *buf;
+	int r;
+
+	buf = malloc(len);
+	if (buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	r = sc_read_record(card, 1, buf, len, SC_RECORD_BY_REC_NR | SC_RECORD_ALL_FROM_NR);
+	if (r == SC_ERROR_RECORD_NOT_FOUND) {
+		free(buf);
+		return (int)last;
+	}
+	if (r < 0) {
+		free(buf);
+		return r;
+	}
+
+	p = buf;
+	left = (size_t)r;
+	while (left > 0 && rec_nr < last) {
+		rec = p;
+		if (sc_asn1_read_tag(&p, left, &cla, &tag, &taglen) != SC_SUCCESS
+				|| p == NULL || taglen > left - (size_t)(p - rec))
+			/* cut by Le: read the rest one by one */
+			break;
+		p += taglen;
+		r = dir_content_add(content, content_len, (int)rec_nr, rec, p - rec);
+		if (r < 0) {
+			free(buf);
+			return r;
+		}
+		left -= p - rec;
+		rec_nr++;
+	}
+	/* a response shorter than asked for holds the last record */
+	if (left == 0 && (size_t)(p - buf) < len)
+		rec_nr = last;
+	free(buf);
+	return (int)rec_nr;
+}
+
+static int read_dir_content(sc_card_t *card, u8 **content, size_t *content_len)
 {
 	struct sc_context *ctx = card->ctx;
 	sc_path_t path;
 	int ef_structure;
-	size_t file_size, jj;
-	int r, ii, idx;
+	size_t file_size, record_count;
+	int r;
 	struct sc_file *ef_dir = NULL;
 
-	LOG_FUNC_CALLED(ctx);
-
-	sc_free_apps(card);
-	card->app_count = 0;
-
 	sc_format_path("3F002F00", &path);
 	r = sc_select_file(card, &path, &ef_dir);
 	if (r < 0)
@@ -182,10 +460,10 @@ int sc_enum_apps(sc_card_t *card)
 
 	ef_structure = ef_dir->ef_structure;
 	file_size = ef_dir->size;
+	record_count = ef_dir->record_count;
 	sc_file_free(ef_dir);
 	if (ef_structure == SC_FILE_EF_TRANSPARENT) {
-		u8 *buf = NULL, *p;
-		size_t bufsize;
+		u8 *buf = NULL;
 
 		if (file_size == 0)
 			LOG_FUNC_RETURN(ctx, 0);
@@ -195,50 +473,73 @@ int sc_enum_apps(sc_card_t *card)
 		buf = malloc(file_size);
 		if (buf == NULL)
 			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-		p = buf;
 		r = sc_read_binary(card, 0, buf, file_size, 0);
 		if (r < 0) {
 			free(buf);
 			LOG_TEST_RET(ctx, r, "sc_read_binary() failed");
 		}
-		bufsize = r;
-		while (bufsize > 0) {
-			if (card->app_count == SC_MAX_CARD_APPS) {
-				sc_log(ctx, "Too many applications on card");
-				break;
-			}
-			r = parse_dir_record(card, &p, &bufsize, -1);
-			if (r)
-				break;
-		}
-		if (buf)
-			free(buf);
-
+		r = dir_content_add(content, content_len, 0, buf, r);
+		free(buf);
+		LOG_TEST_RET(ctx, r, "Cannot store EF(DIR) content");
 	}
 	else {	/* record structure */
-		unsigned char buf[256], *p;
-		unsigned int rec_nr;
-		size_t rec_size;
+		unsigned char buf[256];
+		unsigned int rec_nr, last = 16;
 
 		/* Arbitrary set '16' as maximal number of records to check out:
-		 * to avoid endless loop because of some incomplete cards/drivers */
-		for (rec_nr = 1; rec_nr < 16; rec_nr++) {
+		 * to avoid endless loop because of some incomplete cards/drivers.
+		 * If the FCP tells the number of records, stop after the last
+		 * one instead of asking the card for one more. */
+		if (record_count > 0 && record_count < last)
+			last = (unsigned int)record_count + 1;
+		rec_nr = 1;
+		if (card->flags & SC_CARD_FLAG_READ_RECORDS) {
+			r = read_dir_records(card, last, content, content_len);
+			LOG_TEST_RET(ctx, r, "read_record() failed");
+			/* continue after the records received */
+			rec_nr = (unsigned int)r;
+		}
+		for (; rec_nr < last; rec_nr++) {
 			r = sc_read_record(card, rec_nr, buf, sizeof(buf), SC_RECORD_BY_REC_NR);
 			if (r == SC_ERROR_RECORD_NOT_FOUND)
 				break;
 			LOG_TEST_RET(ctx, r, "read_record() failed");
 
-			if (card->app_count == SC_MAX_CARD_APPS) {
-				sc_log(ctx, "Too many applications on card");
-				break;
-			}
-
-			rec_size = r;
-			p = buf;
-			parse_dir_record(card, &p, &rec_size, (int)rec_nr);
+			r = dir_content_add(content, content_len, (int)rec_nr, buf, r);
+			LOG_TEST_RET(ctx, r, "Cannot store EF(DIR) content");
 		}
 	}
 
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+int sc_enum_apps(sc_card_t *card)
+{
+	struct sc_context *ctx = card->ctx;
+	char key[DIR_CACHE_KEY_SIZE];
+	u8 *content = NULL;
+	size_t content_len = 0, jj;
+	int r, ii, idx, cached = 0, use_cache;
+
+	LOG_FUNC_CALLED(ctx);
+
+	sc_free_apps(card);
+	card->app_count = 0;
+
+	use_cache = dir_cache_key(card, key, sizeof(key)) == SC_SUCCESS;
+	if (use_cache && dir_cache_lookup(card, key, &content, &content_len) == SC_SUCCESS) {
+		sc_log(ctx, "EF(DIR) content taken from cache");
+		cached = 1;
+		r = SC_SUCCESS;
+	} else {
+		r = read_dir_content(card, &content, &content_len);
+	}
+	if (r == SC_SUCCESS && use_cache && !cached)
+		dir_cache_store(card, key, content, content_len, 1);
+	parse_dir_content(card, content, content_len);
+	free(content);
+	LOG_TEST_RET(ctx, r, "Cannot read EF(DIR)");
+
 	/* Move known PKCS#15 applications to the head of the list */
 	for (ii=0, idx=0; ii<card->app_count; ii++)   {
 		for (jj=0; jj < sizeof(apps)/sizeof(apps[0]); jj++) {
@@ -273,6 +574,12 @@ void sc_free_apps(sc_card_t *card)
 	card->app_count = -1;
 }
 
+void sc_invalidate_apps(sc_card_t *card)
+{
+	dir_cache_drop(card);
+	sc_free_apps(card);
+}
+
 static int encode_dir_record(sc_context_t *ctx, const sc_app_info_t *app,
 			     u8 **buf, size_t *buflen)
 {
@@ -412,5 +719,6 @@ int sc_update_dir(sc_card_t *card, sc_app_info_t *app)
 	else
 		r = update_single_record(card, app);
 	sc_file_free(file);
+	dir_cache_drop(card);
 	return r;
 }
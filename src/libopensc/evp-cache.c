@@ -0,0 +1,181 @@
+/*
+ * evp-cache.c: OpenSSL digests and ciphers fetched once per context
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef ENABLE_OPENSSL		/* empty file without openssl */
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+
+#include "internal.h"
+
+/*
+ * With OpenSSL 3, every EVP_DigestInit_ex()/EVP_EncryptInit_ex() with one
+ * of the static EVP_sha256() style objects fetches the implementation from
+ * the providers again, which takes a global lock. The algorithms used by
+ * libopensc and the PKCS#11 module are therefore fetched once into a
+ * library context owned by the sc_context. The tables are only written
+ * while the context is created, so lookups need no lock.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(LIBRESSL_VERSION_NUMBER)
+#define SC_EVP_FETCH
+#include <openssl/provider.h>
+#endif
+
+static const struct {
+	const char *name;
+	const EVP_MD *(*md)(void);
+} sc_evp_digests[] = {
+	{ "SHA1",	EVP_sha1 },
+	{ "SHA224",	EVP_sha224 },
+	{ "SHA256",	EVP_sha256 },
+	{ "SHA384",	EVP_sha384 },
+	{ "SHA512",	EVP_sha512 },
+	{ "MD5",	EVP_md5 },
+#ifndef OPENSSL_NO_RIPEMD
+	{ "RIPEMD160",	EVP_ripemd160 },
+#endif
+};
+#define SC_EVP_DIGESTS	(sizeof sc_evp_digests / sizeof sc_evp_digests[0])
+
+static const struct {
+	const char *name;
+	const EVP_CIPHER *(*cipher)(void);
+} sc_evp_ciphers[] = {
+	{ "AES-128-ECB",	EVP_aes_128_ecb },
+	{ "AES-192-ECB",	EVP_aes_192_ecb },
+	{ "AES-256-ECB",	EVP_aes_256_ecb },
+	{ "AES-128-CBC",	EVP_aes_128_cbc },
+	{ "AES-192-CBC",	EVP_aes_192_cbc },
+	{ "AES-256-CBC",	EVP_aes_256_cbc },
+	{ "DES-EDE3",		EVP_des_ede3 },
+	{ "DES-EDE3-CBC",	EVP_des_ede3_cbc },
+	{ "DES-EDE",		EVP_des_ede },
+	{ "DES-EDE-CBC",	EVP_des_ede_cbc },
+	{ "DES-ECB",		EVP_des_ecb },
+	{ "DES-CBC",		EVP_des_cbc },
+};
+#define SC_EVP_CIPHERS	(sizeof sc_evp_ciphers / sizeof sc_evp_ciphers[0])
+
+#ifdef SC_EVP_FETCH
+struct sc_evp_cache {
+	OSSL_LIB_CTX *libctx;
+	OSSL_PROVIDER *default_provider;
+	OSSL_PROVIDER *legacy_provider;	/* single DES, RIPEMD-160 */
+	EVP_MD *md[SC_EVP_DIGESTS];
+	EVP_CIPHER *cipher[SC_EVP_CIPHERS];
+};
+#endif
+
+int sc_evp_cache_init(sc_context_t *ctx)
+{
+#ifdef SC_EVP_FETCH
+	struct sc_evp_cache *cache;
+	size_t i;
+
+	cache = calloc(1, sizeof *cache);
+	if (cache == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	cache->libctx = OSSL_LIB_CTX_new();
+	if (cache->libctx != NULL) {
+		cache->default_provider = OSSL_PROVIDER_load(cache->libctx, "default");
+		/* not available everywhere, the affected algorithms stay NULL */
+		cache->legacy_provider = OSSL_PROVIDER_load(cache->libctx, "legacy");
+	}
+	if (cache->default_provider == NULL) {
+		/* fetch from the default library context of the process */
+		sc_log(ctx, "Cannot create OpenSSL library context, using the default");
+		OSSL_LIB_CTX_free(cache->libctx);
+		cache->libctx = NULL;
+	}
+
+	for (i = 0; i < SC_EVP_DIGESTS; i++)
+		cache->md[i] = EVP_MD_fetch(cache->libctx, sc_evp_digests[i].name, NULL);
+	for (i = 0; i < SC_EVP_CIPHERS; i++)
+		cache->cipher[i] = EVP_CIPHER_fetch(cache->libctx, sc_evp_ciphers[i].name, NULL);
+
+	ctx->evp_cache = cache;
+#else
+	(void)ctx;
+#endif
+	return SC_SUCCESS;
+}
+
+void sc_evp_cache_free(sc_context_t *ctx)
+{
+#ifdef SC_EVP_FETCH
+	struct sc_evp_cache *cache = ctx->evp_cache;
+	size_t i;
+
+	if (cache == NULL)
+		return;
+	ctx->evp_cache = NULL;
+
+	for (i = 0; i < SC_EVP_DIGESTS; i++)
+		EVP_MD_free(cache->md[i]);
+	for (i = 0; i < SC_EVP_CIPHERS; i++)
+		EVP_CIPHER_free(cache->cipher[i]);
+	if (cache->legacy_provider != NULL)
+		OSSL_PROVIDER_unload(cache->legacy_provider);
+	if (cache->default_provider != NULL)
+		OSSL_PROVIDER_unload(cache->default_provider);
+	OSSL_LIB_CTX_free(cache->libctx);
+	free(cache);
+#else
+	(void)ctx;
+#endif
+}
+
+const EVP_MD *sc_evp_md(sc_context_t *ctx, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < SC_EVP_DIGESTS; i++) {
+		if (strcmp(sc_evp_digests[i].name, name) != 0)
+			continue;
+#ifdef SC_EVP_FETCH
+		if (ctx != NULL && ctx->evp_cache != NULL)
+			return ctx->evp_cache->md[i];
+#endif
+		return sc_evp_digests[i].md();
+	}
+
+	return EVP_get_digestbyname(name);
+}
+
+const EVP_CIPHER *sc_evp_cipher(sc_context_t *ctx, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < SC_EVP_CIPHERS; i++) {
+		if (strcmp(sc_evp_ciphers[i].name, name) != 0)
+			continue;
+#ifdef SC_EVP_FETCH
+		if (ctx != NULL && ctx->evp_cache != NULL)
+			return ctx->evp_cache->cipher[i];
+#endif
+		return sc_evp_ciphers[i].cipher();
+	}
+
+	return EVP_get_cipherbyname(name);
+}
+#endif /* ENABLE_OPENSSL */
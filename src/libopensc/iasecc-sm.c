@@ -19,6 +19,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_SM
+
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -90,20 +92,17 @@ iasecc_sm_transmit_apdus(struct sc_card *card, struct sc_remote_data *rdata,
 		unsigned char *out, size_t *out_len)
 {
 	struct sc_context *ctx = card->ctx;
-	struct sc_remote_apdu *rapdu = rdata->data;
+	struct sc_remote_apdu *rapdu, *last = NULL;
 	int rv = SC_SUCCESS, offs = 0;
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "iasecc_sm_transmit_apdus() rdata-length %i", rdata->length);
 
-	while (rapdu)   {
-		sc_log(ctx, "iasecc_sm_transmit_apdus() rAPDU flags 0x%lX", rapdu->apdu.flags);
-		rv = sc_transmit_apdu(card, &rapdu->apdu);
-		LOG_TEST_RET(ctx, rv, "iasecc_sm_transmit_apdus() failed to execute r-APDU");
-		rv = sc_check_sw(card, rapdu->apdu.sw1, rapdu->apdu.sw2);
-		if (rv < 0 && !(rapdu->flags & SC_REMOTE_APDU_FLAG_NOT_FATAL))
-			LOG_TEST_RET(ctx, rv, "iasecc_sm_transmit_apdus() fatal error %i");
+	rv = sc_transmit_remote_data(card, rdata, &last);
+	if (rv < 0 && (!last || !(last->flags & SC_REMOTE_APDU_FLAG_NOT_FATAL)))
+		LOG_TEST_RET(ctx, rv, "iasecc_sm_transmit_apdus() failed to execute r-APDUs");
 
+	for (rapdu = rdata->data; rapdu && last; rapdu = rapdu->next)   {
 		if (out && out_len && (rapdu->flags & SC_REMOTE_APDU_FLAG_RETURN_ANSWER))   {
 			int len = rapdu->apdu.resplen > (*out_len - offs) ? (*out_len - offs) : rapdu->apdu.resplen;
 
@@ -112,7 +111,8 @@ iasecc_sm_transmit_apdus(struct sc_card *card, struct sc_remote_data *rdata,
 			/* TODO: decode and gather data answers */
 		}
 
-		rapdu = rapdu->next;
+		if (rapdu == last)
+			break;
 	}
 
 	if (out_len)
@@ -337,7 +337,6 @@ iasecc_sm_cmd(struct sc_card *card, struct sc_remote_data *rdata)
 	struct sc_context *ctx = card->ctx;
 	struct sm_info *sm_info = &card->sm_ctx.info;
 	struct sm_cwa_session *session = &sm_info->session.cwa;
-	struct sc_remote_apdu *rapdu = NULL;
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
@@ -348,29 +347,9 @@ iasecc_sm_cmd(struct sc_card *card, struct sc_remote_data *rdata)
 	LOG_TEST_RET(ctx, rv, "iasecc_sm_cmd() 'GET APDUS' failed");
 
 	sc_log(ctx, "iasecc_sm_cmd() %i remote APDUs to transmit", rdata->length);
-	for (rapdu = rdata->data; rapdu; rapdu = rapdu->next)   {
-		struct sc_apdu *apdu = &rapdu->apdu;
-
-		sc_log(ctx,
-		       "iasecc_sm_cmd() apdu->ins:0x%X, resplen %"SC_FORMAT_LEN_SIZE_T"u",
-		       apdu->ins, apdu->resplen);
-		if (!apdu->ins)
-			break;
-		rv = sc_transmit_apdu(card, apdu);
-		if (rv < 0)   {
-			sc_log(ctx, "iasecc_sm_cmd() APDU transmit error rv:%i", rv);
-			break;
-		}
-
-		rv = sc_check_sw(card, apdu->sw1, apdu->sw2);
-		if (rv < 0 && !(rapdu->flags & SC_REMOTE_APDU_FLAG_NOT_FATAL))   {
-			sc_log(ctx, "iasecc_sm_cmd() APDU error rv:%i", rv);
-			break;
-		}
-		sc_log(ctx,
-		       "iasecc_sm_cmd() apdu->resplen %"SC_FORMAT_LEN_SIZE_T"u",
-		       apdu->resplen);
-	}
+	rv = sc_transmit_remote_data(card, rdata, NULL);
+	if (rv < 0)
+		sc_log(ctx, "iasecc_sm_cmd() APDU error rv:%i", rv);
 
 	LOG_FUNC_RETURN(ctx, rv);
 }
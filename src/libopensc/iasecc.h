@@ -124,6 +124,20 @@ struct iasecc_io_buffer_sizes {
 	size_t recv_sc;
 };
 
+/* Raw GET DATA response of one SDO tag, see iasecc_sdo_get_tagged_data() */
+struct iasecc_sdo_cache {
+	struct sc_path df;
+	unsigned char sdo_class, sdo_ref;
+	int sdo_tag;
+	unsigned pin_events;
+	int rv;
+
+	unsigned char *data;
+	size_t data_len;
+
+	struct iasecc_sdo_cache *next;
+};
+
 struct iasecc_private_data {
 	struct iasecc_version version;
 	struct iasecc_io_buffer_sizes max_sizes;
@@ -133,5 +147,6 @@ struct iasecc_private_data {
 	unsigned op_method, op_ref;
 
 	struct iasecc_se_info *se_info;
+	struct iasecc_sdo_cache *sdo_cache;
 };
 #endif
@@ -39,9 +39,11 @@ extern "C" {
 #include "libopensc/opensc.h"
 #include "libopensc/log.h"
 #include "libopensc/cards.h"
+#include "libopensc/probes.h"
 #include "scconf/scconf.h"
 
 #ifdef ENABLE_OPENSSL
+#include <openssl/evp.h>
 #include "libopensc/sc-ossl-compat.h"
 #endif
 
@@ -61,6 +63,15 @@ extern "C" {
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #endif
 
+/* Whether the card driver or emulator of the given name (upper case,
+ * '-' as '_') is built in, see configure --with-card-drivers. Use as
+ * #if SC_CARD_DRIVER(PIV_II) */
+#ifdef ENABLE_CARD_DRIVER_SELECTION
+#define SC_CARD_DRIVER(name)	ENABLE_CARD_DRIVER_##name
+#else
+#define SC_CARD_DRIVER(name)	1
+#endif
+
 struct sc_atr_table {
 	/* The atr fields are required to
 	 * be in aa:bb:cc hex format. */
@@ -84,6 +95,9 @@ int _sc_parse_atr(struct sc_reader *reader);
 /* Add an ATR to the card driver's struct sc_atr_table */
 int _sc_add_atr(struct sc_context *ctx, struct sc_card_driver *driver, struct sc_atr_table *src);
 int _sc_free_atr(struct sc_context *ctx, struct sc_card_driver *driver);
+/* Loads an external card driver which has only been configured so far.
+ * Does nothing for drivers with ops. */
+int _sc_load_card_driver(struct sc_context *ctx, struct sc_card_driver *driver);
 
 /**
  * Convert an unsigned long into 4 bytes in big endian order
@@ -136,6 +150,11 @@ void set_string(char **strp, const char *value);
 
 #define BYTES4BITS(num)  (((num) + 7) / 8)    /* number of bytes necessary to hold 'num' bits */
 
+/* Writes the 2 * in_len hex digits of in to out, without a terminating
+ * \0, and returns the position following them. Shared by the hex
+ * formatting functions in sc.c and log.c. */
+char *_sc_hex_put(char *out, const u8 *in, size_t in_len, int upper);
+
 /* Returns an scconf_block entry with matching ATR/ATRmask to the ATR specified,
  * NULL otherwise. Additionally, if card driver is not specified, search through
  * all card drivers user configured ATRs. */
@@ -144,6 +163,12 @@ scconf_block *_sc_match_atr_block(sc_context_t *ctx, struct sc_card_driver *driv
 /* Returns an index number if a match was found, -1 otherwise. table has to
  * be null terminated. */
 int _sc_match_atr(struct sc_card *card, const struct sc_atr_table *table, int *type_out);
+/* Releases the ATR tables compiled by _sc_match_atr() */
+void _sc_atr_cache_free(struct sc_context *ctx);
+/* Releases the EF.DIR content kept by sc_enum_apps() */
+void _sc_dir_cache_free(struct sc_context *ctx);
+/* Releases the configuration parsed by sc_pkcs15_get_conf() */
+void sc_pkcs15_conf_free(struct sc_context *ctx);
 
 int _sc_card_add_algorithm(struct sc_card *card, const struct sc_algorithm_info *info);
 int _sc_card_add_symmetric_alg(sc_card_t *card, unsigned int algorithm,
@@ -154,6 +179,27 @@ int _sc_card_add_ec_alg(struct sc_card *card, unsigned int key_length,
 		unsigned long flags, unsigned long ext_flags,
 		struct sc_object_id *curve_oid);
 
+/* Forget the path remembered by sc_select_file(), see
+ * SC_CTX_FLAG_SELECT_CACHE */
+void sc_select_cache_drop(struct sc_card *card);
+
+/* Record the result of an APDU while sc_connect_card() probes the drivers,
+ * see sc_select_aid() */
+void sc_aid_probe_note(struct sc_card *card, const struct sc_apdu *apdu, int r);
+
+/* What the historical bytes of the ATR tell about the card, parsed once
+ * by sc_connect_card() for the match_atr_hints() card operations */
+struct sc_atr_hints {
+	int category;		/* category indicator, -1 without historical bytes */
+	const u8 *aid;		/* application identifier (compact-TLV tag 0x4F) */
+	size_t aid_len;
+	int storage_card;	/* PC/SC part 3 memory card, RID A0 00 00 03 06 */
+};
+
+/* match_atr_hints() of the drivers that detect the card by selecting an
+ * application: returns 0 for cards without ISO 7816-4 applications */
+int sc_atr_hints_iso_application(struct sc_card *card, const struct sc_atr_hints *hints);
+
 /********************************************************************/
 /*                 pkcs1 padding/encoding functions                 */
 /********************************************************************/
@@ -237,6 +283,142 @@ int sc_mutex_destroy(const sc_context_t *ctx, void *mutex);
  */
 unsigned long sc_thread_id(const sc_context_t *ctx);
 
+/********************************************************************/
+/*             statistics                                           */
+/********************************************************************/
+
+/**
+ * Returns a monotonic time stamp in microseconds for measuring durations.
+ */
+unsigned long long sc_stats_now(void);
+/**
+ * Records the duration of an APDU round trip through 'reader' that
+ * started at 'start' (see sc_stats_now()).
+ */
+void sc_stats_apdu(sc_reader_t *reader, unsigned long long start, int rv);
+/**
+ * Records a duration that started at 'start' in one of ctx->stats' timings.
+ */
+void sc_stats_timing(sc_context_t *ctx, struct sc_stats_timing *timing,
+		unsigned long long start);
+/**
+ * Adds 'n' to one of ctx->stats' counters.
+ */
+void sc_stats_count(sc_context_t *ctx, unsigned long long *counter, size_t n);
+/**
+ * Adds 'delta' to the number of requests waiting in the card queues.
+ */
+void sc_stats_queue(sc_context_t *ctx, int delta);
+/**
+ * Returns the number of APDUs sent through 'reader' so far. Pass it to
+ * sc_stats_operation() once the operation is done.
+ */
+unsigned long long sc_stats_reader_apdus(sc_reader_t *reader);
+/**
+ * Records a call of a high level operation on 'reader' which started
+ * when sc_stats_reader_apdus() returned 'apdus_before'.
+ */
+void sc_stats_operation(sc_reader_t *reader, struct sc_stats_operation *op,
+		unsigned long long apdus_before);
+
+/**
+ * Starts recording APDUs of 'ctx' into a ring of 'records' entries in
+ * 'filename' (see struct sc_apdu_trace_header).
+ */
+int sc_apdu_trace_open(sc_context_t *ctx, const char *filename, size_t records);
+/**
+ * Stops recording APDUs and releases the trace of 'ctx'.
+ */
+void sc_apdu_trace_close(sc_context_t *ctx);
+/**
+ * Records an APDU that was transmitted through 'reader' starting at 'start'.
+ */
+void sc_apdu_trace_add(sc_reader_t *reader, const sc_apdu_t *apdu,
+		unsigned long long start, int rv);
+
+/**
+ * Claims an entry of the shared statistics file 'filename' for 'ctx' (see
+ * struct sc_stats_shm_header).
+ */
+int sc_stats_shm_open(sc_context_t *ctx, const char *filename);
+/**
+ * Copies the counters of 'ctx' into its shared entry, unless they were
+ * copied less than a second ago and 'force' is not set.
+ */
+void sc_stats_shm_publish(sc_context_t *ctx, int force);
+/**
+ * Publishes the counters a last time and marks the entry as exited.
+ */
+void sc_stats_shm_close(sc_context_t *ctx);
+
+/* The highest debug level of the context over all subsystems, see
+ * SC_LOG_SUBSYSTEM */
+int sc_log_max_level(const sc_context_t *ctx);
+
+/**
+ * Starts a thread writing the debug log of 'ctx' from a buffer of 'size'
+ * bytes, so that logging does not wait for the debug file.
+ */
+int sc_log_writer_start(sc_context_t *ctx, size_t size);
+/**
+ * Writes out the buffered log records and stops the writer of 'ctx'.
+ * Returns the size of its buffer, 0 if there was no writer.
+ */
+size_t sc_log_writer_stop(sc_context_t *ctx);
+/**
+ * Queues the formatted log record 'record' of 'len' bytes. Records which
+ * do not fit into the buffer are dropped and counted.
+ */
+int sc_log_writer_add(sc_context_t *ctx, const char *record, size_t len);
+
+/**
+ * Queues 'fn' on the I/O thread of the reader of 'card', see
+ * sc_async_transmit(). Its return value is the result of the request.
+ */
+int sc_async_call(sc_card_t *card, int (*fn)(void *), void *fn_arg,
+		sc_async_op_t **handle);
+/**
+ * Waits until the asynchronous requests of 'card' completed.
+ */
+void sc_async_flush(sc_card_t *card);
+/**
+ * Runs down the asynchronous requests of 'reader' and stops its I/O thread.
+ */
+void sc_async_stop(sc_reader_t *reader);
+
+/**
+ * Releases the pkcs15init profiles parsed for 'ctx'.
+ */
+void sc_profile_cache_free(sc_context_t *ctx);
+
+#ifdef ENABLE_SM
+/**
+ * Cleans up and unloads the external SM modules kept loaded for 'ctx'.
+ */
+void sc_sm_module_cache_free(sc_context_t *ctx);
+#endif
+
+#ifdef ENABLE_OPENSSL
+/**
+ * Fetches the OpenSSL algorithms of 'ctx' (see sc_evp_md()).
+ */
+int sc_evp_cache_init(sc_context_t *ctx);
+/**
+ * Releases the OpenSSL algorithms and library context of 'ctx'.
+ */
+void sc_evp_cache_free(sc_context_t *ctx);
+/**
+ * Returns the digest called 'name' (OpenSSL name, e.g. "SHA256"). Common
+ * digests are fetched only once per context, so that using them does not
+ * take the global locks of OpenSSL 3. Returns NULL if unavailable.
+ */
+const EVP_MD *sc_evp_md(sc_context_t *ctx, const char *name);
+/**
+ * Returns the cipher called 'name' (e.g. "AES-128-CBC"), see sc_evp_md().
+ */
+const EVP_CIPHER *sc_evp_cipher(sc_context_t *ctx, const char *name);
+#endif
+
 /********************************************************************/
 /*             internal APDU handling functions                     */
 /********************************************************************/
@@ -276,6 +458,10 @@ extern struct sc_reader_driver *sc_get_pcsc_driver(void);
 extern struct sc_reader_driver *sc_get_ctapi_driver(void);
 extern struct sc_reader_driver *sc_get_openct_driver(void);
 extern struct sc_reader_driver *sc_get_cryptotokenkit_driver(void);
+extern struct sc_reader_driver *sc_get_replay_driver(void);
+/* APDU trace to replay instead of using the readers, NULL if none is
+ * configured (OPENSC_REPLAY or file in reader_driver replay) */
+const char *sc_replay_trace_file(sc_context_t *ctx);
 
 #ifdef __cplusplus
 }
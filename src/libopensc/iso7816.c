@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #include "config.h"
 
 #include <assert.h>
@@ -179,6 +181,8 @@ iso7816_read_record(struct sc_card *card,
 	apdu.p2 = (flags & SC_RECORD_EF_ID_MASK) << 3;
 	if (flags & SC_RECORD_BY_REC_NR)
 		apdu.p2 |= 0x04;
+	if ((flags & SC_RECORD_BY_REC_NR) && (flags & SC_RECORD_ALL_FROM_NR))
+		apdu.p2 |= 0x01;
 
 	fixup_transceive_length(card, &apdu);
 	r = sc_transmit_apdu(card, &apdu);
@@ -986,7 +990,7 @@ iso7816_decipher(struct sc_card *card,
 	       "ISO7816 decipher: in-len %"SC_FORMAT_LEN_SIZE_T"u, out-len %"SC_FORMAT_LEN_SIZE_T"u",
 	       crgram_len, outlen);
 
-	sbuf = malloc(crgram_len + 1);
+	sbuf = sc_card_get_buffer(card, crgram_len + 1);
 	if (sbuf == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 
@@ -1006,8 +1010,7 @@ iso7816_decipher(struct sc_card *card,
 
 	fixup_transceive_length(card, &apdu);
 	r = sc_transmit_apdu(card, &apdu);
-	sc_mem_clear(sbuf, crgram_len + 1);
-	free(sbuf);
+	sc_card_put_buffer(card, sbuf, crgram_len + 1);
 	LOG_TEST_RET(card->ctx, r, "APDU transmit failed");
 
 	if (apdu.sw1 == 0x90 && apdu.sw2 == 0x00)
@@ -1283,7 +1286,8 @@ static struct sc_card_operations iso_ops = {
 	NULL,			/* read_public_key */
 	NULL,			/* card_reader_lock_obtained */
 	NULL,			/* wrap */
-	NULL			/* unwrap */
+	NULL,			/* unwrap */
+	NULL			/* match_atr_hints */
 };
 
 static struct sc_card_driver iso_driver = {
@@ -1300,11 +1304,32 @@ struct sc_card_driver * sc_get_iso7816_driver(void)
 
 #define ISO_READ_BINARY  0xB0
 #define ISO_P1_FLAG_SFID 0x80
+/* Worst case an SM wrapped response adds to the plain data: the cryptogram
+ * with padding indicator and up to one block of padding, the authenticated
+ * status bytes and the MAC including their TLV headers. */
+#define ISO_SM_RESP_OVERHEAD 48
+
+static size_t iso7816_read_binary_sfid_le(sc_card_t *card)
+{
+	size_t read = sc_get_max_recv_size(card);
+
+	if (!(card->caps & SC_CARD_CAP_APDU_EXT) && read > 0xff+1)
+		read = 0xff+1;
+#ifdef ENABLE_SM
+	if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT)
+		read = read > ISO_SM_RESP_OVERHEAD ? read - ISO_SM_RESP_OVERHEAD : 0;
+#endif
+	if (read < MAX_SM_APDU_RESP_SIZE)
+		read = MAX_SM_APDU_RESP_SIZE;
+
+	return read;
+}
+
 int iso7816_read_binary_sfid(sc_card_t *card, unsigned char sfid,
 		u8 **ef, size_t *ef_len)
 {
 	int r;
-	size_t read = MAX_SM_APDU_RESP_SIZE;
+	size_t read;
 	sc_apdu_t apdu;
 	u8 *p;
 
@@ -1314,54 +1339,51 @@ int iso7816_read_binary_sfid(sc_card_t *card, unsigned char sfid,
 	}
 	*ef_len = 0;
 
-#if MAX_SM_APDU_RESP_SIZE > (0xff+1)
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_2_EXT,
+	/* Every round-trip asks for as much as the card and, if active, the
+	 * secure messaging channel can return. The first command selects the EF
+	 * via its short file identifier, the following ones continue at the
+	 * current offset of the now selected EF. */
+	read = iso7816_read_binary_sfid_le(card);
+	sc_format_apdu(card, &apdu,
+			read > 0xff+1 ? SC_APDU_CASE_2_EXT : SC_APDU_CASE_2_SHORT,
 			ISO_READ_BINARY, ISO_P1_FLAG_SFID|sfid, 0);
-#else
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT,
-			ISO_READ_BINARY, ISO_P1_FLAG_SFID|sfid, 0);
-#endif
-	p = realloc(*ef, read);
-	if (!p) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto err;
-	}
-	*ef = p;
-	apdu.resp = *ef;
-	apdu.resplen = read;
-	apdu.le = read;
-
-	r = sc_transmit_apdu(card, &apdu);
-	if (r < 0)
-		goto err;
-	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
-	if (r < 0 && r != SC_ERROR_FILE_END_REACHED)
-		goto err;
-	/* emulate the behaviour of sc_read_binary */
-	r = apdu.resplen;
 
-	while(1) {
-		if (r >= 0 && ((size_t) r) != read) {
-			*ef_len += r;
-			break;
+	while (1) {
+		p = realloc(*ef, *ef_len + read);
+		if (!p) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto err;
 		}
-		if (r == 0 || r == SC_ERROR_FILE_END_REACHED)
-			break;
+		*ef = p;
+		apdu.resp = *ef + *ef_len;
+		apdu.resplen = read;
+		apdu.le = read;
+
+		r = sc_transmit_apdu(card, &apdu);
+		if (r < 0)
+			goto err;
+		r = sc_check_sw(card, apdu.sw1, apdu.sw2);
+		if (r == SC_ERROR_FILE_END_REACHED
+				|| (apdu.sw1 == 0x6B && apdu.sw2 == 0x00 && *ef_len > 0))
+			/* either a short read or the EF ended exactly at the
+			 * previous chunk */
+			r = SC_SUCCESS;
 		if (r < 0) {
 			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not read EF.");
 			goto err;
 		}
-		*ef_len += r;
 
-		p = realloc(*ef, *ef_len + read);
-		if (!p) {
-			r = SC_ERROR_OUT_OF_MEMORY;
+		*ef_len += apdu.resplen;
+		if (apdu.resplen != read || apdu.resplen == 0)
+			break;
+
+		if (*ef_len > 0x7FFF) {
+			/* offset not encodable in P1-P2 of the plain READ BINARY */
+			r = SC_ERROR_NOT_SUPPORTED;
 			goto err;
 		}
-		*ef = p;
-
-		r = sc_read_binary(card, *ef_len,
-				*ef + *ef_len, read, 0);
+		apdu.p1 = (*ef_len >> 8) & 0x7F;
+		apdu.p2 = *ef_len & 0xFF;
 	}
 
 	r = *ef_len;
@@ -0,0 +1,192 @@
+/*
+ * log-writer.c: Background writer for the debug log
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "internal.h"
+
+/*
+ * Log records are formatted by the caller and copied into a ring buffer,
+ * a thread writes them to the debug file. The caller therefore never
+ * waits for the disk, only for the copy. When the buffer is full the
+ * record is dropped and counted, the writer reports the number of lost
+ * records with the next ones it writes.
+ *
+ * On Windows the debug file is reopened for every record (see
+ * sc_do_log_va()), so the log is always written synchronously there.
+ */
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#define SC_LOG_WRITER
+#endif
+
+#ifdef SC_LOG_WRITER
+struct sc_log_writer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	FILE *file;
+	char *buf;
+	size_t size;
+	size_t head, tail;	/* running offsets, the buffer holds head - tail bytes */
+	unsigned long dropped;
+	int stop;
+};
+
+static void *log_writer_main(void *arg)
+{
+	struct sc_log_writer *w = arg;
+	unsigned long dropped;
+	size_t head, tail, from, len;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (w->head == w->tail && !w->dropped && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->head == w->tail && !w->dropped)
+			break;
+		head = w->head;
+		tail = w->tail;
+		dropped = w->dropped;
+		w->dropped = 0;
+		pthread_mutex_unlock(&w->lock);
+
+		/* the callers only write to the free part of the buffer */
+		if (dropped)
+			fprintf(w->file, "*** %lu log records dropped ***\n", dropped);
+		while (tail != head) {
+			from = tail % w->size;
+			len = head - tail;
+			if (len > w->size - from)
+				len = w->size - from;
+			fwrite(w->buf + from, 1, len, w->file);
+			tail += len;
+		}
+		fflush(w->file);
+
+		pthread_mutex_lock(&w->lock);
+		w->tail = tail;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+#endif
+
+int sc_log_writer_start(sc_context_t *ctx, size_t size)
+{
+#ifdef SC_LOG_WRITER
+	struct sc_log_writer *w;
+
+	if (ctx == NULL || size == 0)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (ctx->log_writer != NULL || ctx->debug_file == NULL)
+		return SC_SUCCESS;
+
+	w = calloc(1, sizeof *w);
+	if (w == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	w->buf = malloc(size);
+	if (w->buf == NULL) {
+		free(w);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	w->size = size;
+	w->file = ctx->debug_file;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->thread, NULL, log_writer_main, w) != 0) {
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		free(w->buf);
+		free(w);
+		return SC_ERROR_INTERNAL;
+	}
+	ctx->log_writer = w;
+	return SC_SUCCESS;
+#else
+	(void)ctx;
+	(void)size;
+	return SC_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+size_t sc_log_writer_stop(sc_context_t *ctx)
+{
+#ifdef SC_LOG_WRITER
+	struct sc_log_writer *w = ctx->log_writer;
+	size_t size;
+
+	if (w == NULL)
+		return 0;
+	ctx->log_writer = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	size = w->size;
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	free(w->buf);
+	free(w);
+	return size;
+#else
+	(void)ctx;
+	return 0;
+#endif
+}
+
+int sc_log_writer_add(sc_context_t *ctx, const char *record, size_t len)
+{
+#ifdef SC_LOG_WRITER
+	struct sc_log_writer *w = ctx->log_writer;
+	size_t at, first;
+
+	if (w == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->size - (w->head - w->tail) < len) {
+		w->dropped++;
+	} else {
+		at = w->head % w->size;
+		first = len < w->size - at ? len : w->size - at;
+		memcpy(w->buf + at, record, first);
+		memcpy(w->buf, record + first, len - first);
+		w->head += len;
+	}
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	return SC_SUCCESS;
+#else
+	(void)ctx;
+	(void)record;
+	(void)len;
+	return SC_ERROR_NOT_SUPPORTED;
+#endif
+}
@@ -72,6 +72,52 @@ void sc_do_log_noframe(sc_context_t *ctx, int level, const char *format, va_list
 	sc_do_log_va(ctx, level, NULL, 0, NULL, 0, format, args);
 }
 
+#ifndef _WIN32
+/* Formats the whole record at once for the log writer, without colors */
+static void sc_do_log_buffered(sc_context_t *ctx, const char *file, int line, const char *func, const char *format, va_list args)
+{
+	char	buf[4096 + 256];
+	struct tm *tm;
+	struct timeval tv;
+	char time_string[40];
+	size_t len;
+	int r;
+
+	gettimeofday (&tv, NULL);
+	tm = localtime (&tv.tv_sec);
+	strftime (time_string, sizeof(time_string), "%H:%M:%S", tm);
+	r = snprintf(buf, sizeof buf, "P:%lu; T:0x%lu %s.%03ld [%s] ",
+			(unsigned long)getpid(), (unsigned long)pthread_self(),
+			time_string, (long)tv.tv_usec / 1000, ctx->app_name);
+	len = r > 0 ? (size_t)r : 0;
+	if (file != NULL && len < sizeof buf) {
+		r = snprintf(buf + len, sizeof buf - len, "%s:%d:%s: ", file, line, func ? func : "");
+		len += r > 0 ? (size_t)r : 0;
+	}
+	if (len < sizeof buf) {
+		r = vsnprintf(buf + len, sizeof buf - len, format, args);
+		len += r > 0 ? (size_t)r : 0;
+	}
+	if (len >= sizeof buf)
+		len = sizeof buf - 1;
+	if (len == 0 || buf[len - 1] != '\n')
+		buf[len++] = '\n';
+
+	sc_log_writer_add(ctx, buf, len);
+}
+#endif
+
+/* The highest level of any subsystem, the callers have checked their own */
+int sc_log_max_level(const sc_context_t *ctx)
+{
+	int i, level = ctx->debug;
+
+	for (i = 0; i < SC_MAX_LOG_SUBSYSTEMS; i++)
+		if (ctx->debug_levels[i] > level)
+			level = ctx->debug_levels[i];
+	return level;
+}
+
 static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, int color, const char *format, va_list args)
 {
 	char	buf[4096];
@@ -83,7 +129,7 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 	char time_string[40];
 #endif
 
-	if (!ctx || ctx->debug < level)
+	if (!ctx || sc_log_max_level(ctx) < level)
 		return;
 
 #ifdef _WIN32
@@ -96,6 +142,13 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 	if (ctx->debug_file == NULL)
 		return;
 
+#ifndef _WIN32
+	if (ctx->log_writer != NULL) {
+		sc_do_log_buffered(ctx, file, line, func, format, args);
+		return;
+	}
+#endif
+
 #ifdef _WIN32
 	GetLocalTime(&st);
 	sc_color_fprintf(SC_COLOR_FG_GREEN|SC_COLOR_BOLD,
@@ -283,7 +336,11 @@ void _sc_debug_hex(sc_context_t *ctx, int type, const char *file, int line,
 		const char *func, const char *label, const u8 *data, size_t len)
 {
 	size_t blen = len * 5 + 128;
-	char *buf = malloc(blen);
+	char *buf;
+
+	if (!ctx || sc_log_max_level(ctx) < type)
+		return;
+	buf = malloc(blen);
 	if (buf == NULL)
 		return;
 
@@ -313,69 +370,79 @@ void sc_hex_dump(const u8 * in, size_t count, char *buf, size_t len)
 	if ((count * 5) > len)
 		return;
 	while (count) {
-		char ascbuf[17];
-		size_t i;
-
-		for (i = 0; i < count && i < 16; i++) {
-			sprintf(p, "%02X ", *in);
-			if (isprint(*in))
-				ascbuf[i] = *in;
-			else
-				ascbuf[i] = '.';
-			p += 3;
-			in++;
+		char *asc;
+		size_t i, n = count < 16 ? count : 16;
+
+		for (i = 0; i < n; i++) {
+			p = _sc_hex_put(p, in + i, 1, 1);
+			*p++ = ' ';
 		}
-		count -= i;
-		ascbuf[i] = 0;
 		for (; i < 16 && lines; i++) {
-			strcat(p, "   ");
+			memcpy(p, "   ", 3);
 			p += 3;
 		}
-		strcat(p, ascbuf);
-		p += strlen(p);
-		sprintf(p, "\n");
-		p++;
+		for (asc = p, i = 0; i < n; i++)
+			asc[i] = isprint(in[i]) ? in[i] : '.';
+		p += n;
+		*p++ = '\n';
+		in += n;
+		count -= n;
 		lines++;
 	}
+	*p = 0;
 }
 
+/* The buffer of sc_dump_hex() and sc_dump_oid() is per thread, so that
+ * concurrent loggers do not garble each other's output */
+#if defined(_MSC_VER)
+#define SC_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define SC_THREAD_LOCAL __thread
+#else
+#define SC_THREAD_LOCAL
+#endif
+
 const char *
-sc_dump_hex(const u8 * in, size_t count)
+sc_dump_hex_r(const u8 * in, size_t count, char *buf, size_t buflen)
 {
-	static char dump_buf[0x1000];
-	size_t ii, size = sizeof(dump_buf) - 0x10;
-	size_t offs = 0;
+	char *p = buf, *end;
+	size_t ii;
 
-	memset(dump_buf, 0, sizeof(dump_buf));
+	/* room for a separator, a byte, the ellipsis and the terminator */
+	if (buf == NULL || buflen < 10)
+		return "";
+	buf[0] = 0;
 	if (in == NULL)
-		return dump_buf;
-
-	for (ii=0; ii<count; ii++) {
-		if (ii && !(ii%16))   {
-			if (!(ii%48))
-				snprintf(dump_buf + offs, size - offs, "\n");
-			else
-				snprintf(dump_buf + offs, size - offs, " ");
-			offs = strlen(dump_buf);
-		}
+		return buf;
 
-		snprintf(dump_buf + offs, size - offs, "%02X", *(in + ii));
-		offs += 2;
+	end = buf + buflen - 9;
+	for (ii = 0; ii < count && p <= end; ii++) {
+		if (ii && !(ii%16))
+			*p++ = (ii%48) ? ' ' : '\n';
+		p = _sc_hex_put(p, in + ii, 1, 1);
+	}
 
-		if (offs > size)
-			break;
+	if (ii < count) {
+		memcpy(p, "....\n", 5);
+		p += 5;
 	}
+	*p = 0;
+
+	return buf;
+}
 
-	if (ii<count)
-		snprintf(dump_buf + offs, sizeof(dump_buf) - offs, "....\n");
+const char *
+sc_dump_hex(const u8 * in, size_t count)
+{
+	static SC_THREAD_LOCAL char dump_buf[0x1000];
 
-	return dump_buf;
+	return sc_dump_hex_r(in, count, dump_buf, sizeof(dump_buf));
 }
 
 const char *
 sc_dump_oid(const struct sc_object_id *oid)
 {
-	static char dump_buf[SC_MAX_OBJECT_ID_OCTETS * 20];
+	static SC_THREAD_LOCAL char dump_buf[SC_MAX_OBJECT_ID_OCTETS * 20];
         size_t ii;
 
 	memset(dump_buf, 0, sizeof(dump_buf));
@@ -40,6 +40,23 @@ enum {
 	SC_LOG_DEBUG_PIN,		/* PIN commands */
 };
 
+/* The parts of OpenSC whose debug level can be set on its own, see
+ * debug_reader etc. in opensc.conf. A source file tells its subsystem by
+ * defining SC_LOG_SUBSYSTEM before including any header. */
+enum {
+	SC_LOG_SUBSYS_CORE = 0,
+	SC_LOG_SUBSYS_READER,
+	SC_LOG_SUBSYS_CARD,
+	SC_LOG_SUBSYS_SM,
+	SC_LOG_SUBSYS_PKCS15,
+	SC_LOG_SUBSYS_PKCS11,
+	SC_LOG_SUBSYS_ASN1,
+};
+
+#ifndef SC_LOG_SUBSYSTEM
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CORE
+#endif
+
 #define SC_COLOR_FG_RED			0x0001
 #define SC_COLOR_FG_GREEN		0x0002
 #define SC_COLOR_FG_YELLOW		0x0004
@@ -59,9 +76,33 @@ enum {
 #define __FUNCTION__ NULL
 #endif
 
+/*
+ * The logging macros test the debug level of the caller's subsystem
+ * before evaluating their arguments, so calls like sc_print_path() or
+ * sc_strerror() cost nothing when the message would be dropped anyway. Building with
+ * OPENSC_DISABLE_DEBUG_LOG (configure --disable-debug-log) removes all
+ * messages of SC_LOG_DEBUG_NORMAL and above from the binary.
+ */
+#define SC_LOG_LEVEL(ctx) \
+	(((const struct sc_context *)(ctx))->debug_levels[SC_LOG_SUBSYSTEM] < 0 \
+	 ? ((const struct sc_context *)(ctx))->debug \
+	 : ((const struct sc_context *)(ctx))->debug_levels[SC_LOG_SUBSYSTEM])
+#define SC_LOG_WANTED(ctx, level) \
+	((ctx) != NULL && SC_LOG_LEVEL(ctx) >= (level))
+#ifdef OPENSC_DISABLE_DEBUG_LOG
+#define SC_LOG_ENABLED(ctx, level) \
+	((level) < SC_LOG_DEBUG_NORMAL && SC_LOG_WANTED(ctx, level))
+#else
+#define SC_LOG_ENABLED(ctx, level) SC_LOG_WANTED(ctx, level)
+#endif
+
 #if defined(__GNUC__)
-#define sc_debug(ctx, level, format, args...)	sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args)
-#define sc_log(ctx, format, args...)   sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, __FILE__, __LINE__, __FUNCTION__, format , ## args)
+#define sc_debug(ctx, level, format, args...) \
+	(SC_LOG_ENABLED(ctx, level) \
+	 ? sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args) : (void)0)
+#define sc_log(ctx, format, args...) \
+	(SC_LOG_ENABLED(ctx, SC_LOG_DEBUG_NORMAL) \
+	 ? sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, __FILE__, __LINE__, __FUNCTION__, format , ## args) : (void)0)
 #else
 #define sc_debug _sc_debug
 #define sc_log _sc_log
@@ -109,7 +150,8 @@ int sc_color_fprintf(int colors, struct sc_context *ctx, FILE * stream, const ch
  * @param[in] len   Length of \a data
  */
 #define sc_debug_hex(ctx, level, label, data, len) \
-    _sc_debug_hex(ctx, level, __FILE__, __LINE__, __FUNCTION__, label, data, len)
+    (SC_LOG_ENABLED(ctx, level) \
+     ? _sc_debug_hex(ctx, level, __FILE__, __LINE__, __FUNCTION__, label, data, len) : (void)0)
 #define sc_log_hex(ctx, label, data, len) \
     sc_debug_hex(ctx, SC_LOG_DEBUG_NORMAL, label, data, len)
 /** 
@@ -128,16 +170,23 @@ void _sc_debug_hex(struct sc_context *ctx, int level, const char *file, int line
         const char *func, const char *label, const u8 *data, size_t len);
 
 void sc_hex_dump(const u8 *buf, size_t len, char *out, size_t outlen);
+/* Formats in as hex into a per thread buffer, valid until the thread's
+ * next call */
 const char * sc_dump_hex(const u8 * in, size_t count);
+/* Like sc_dump_hex(), but formats into the caller's buffer, truncating
+ * long input */
+const char * sc_dump_hex_r(const u8 * in, size_t count, char *buf, size_t buflen);
 const char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_FUNC_CALLED(ctx, level) do { \
-	 sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
+	if (SC_LOG_ENABLED(ctx, level)) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
 } while (0)
 #define LOG_FUNC_CALLED(ctx) SC_FUNC_CALLED((ctx), SC_LOG_DEBUG_NORMAL)
 
 #define SC_FUNC_RETURN(ctx, level, r) do { \
 	int _ret = r; \
-	if (_ret <= 0) { \
+	if (!SC_LOG_ENABLED(ctx, level)) { \
+	} else if (_ret <= 0) { \
 		sc_do_log_color(ctx, level, __FILE__, __LINE__, __FUNCTION__, _ret ? SC_COLOR_FG_RED : 0, \
 			"returning with: %d (%s)\n", _ret, sc_strerror(_ret)); \
 	} else { \
@@ -151,8 +200,9 @@ const char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_TEST_RET(ctx, level, r, text) do { \
 	int _ret = (r); \
 	if (_ret < 0) { \
-		sc_do_log_color(ctx, level, __FILE__, __LINE__, __FUNCTION__, SC_COLOR_FG_RED, \
-			"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
+		if (SC_LOG_ENABLED(ctx, level)) \
+			sc_do_log_color(ctx, level, __FILE__, __LINE__, __FUNCTION__, SC_COLOR_FG_RED, \
+				"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
 		return _ret; \
 	} \
 } while(0)
@@ -161,8 +211,9 @@ const char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_TEST_GOTO_ERR(ctx, level, r, text) do { \
 	int _ret = (r); \
 	if (_ret < 0) { \
-		sc_do_log_color(ctx, level, __FILE__, __LINE__, __FUNCTION__, SC_COLOR_FG_RED, \
-			"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
+		if (SC_LOG_ENABLED(ctx, level)) \
+			sc_do_log_color(ctx, level, __FILE__, __LINE__, __FUNCTION__, SC_COLOR_FG_RED, \
+				"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
 		goto err; \
 	} \
 } while(0)
@@ -99,6 +99,22 @@ int mscfs_push_file(mscfs_t* fs, mscfs_file_t *file)
 	return 0;
 }
 
+/* Maps the object ID of the applet to the one used in the cache */
+static void mscfs_map_object(mscfs_file_t *file)
+{
+	/* Check if its a directory in the root */
+	u8* oid = file->objectId.id;
+	if(oid[2] == 0 && oid[3] == 0) {
+		oid[2] = oid[0];
+		oid[3] = oid[1];
+		oid[0] = 0x3F;
+		oid[1] = 0x00;
+		file->ef = 0;
+	} else  {
+		file->ef = 1; /* File is a working elementary file */
+	}
+}
+
 int mscfs_update_cache(mscfs_t* fs) {
 	mscfs_file_t file;
 	int r;
@@ -110,18 +126,7 @@ int mscfs_update_cache(mscfs_t* fs) {
 		return r;
 	while(1) {
 		if(!mscfs_is_ignored(fs, file.objectId)) {
-			/* Check if its a directory in the root */
-			u8* oid = file.objectId.id;
-			if(oid[2] == 0 && oid[3] == 0) {
-				oid[2] = oid[0];
-				oid[3] = oid[1];
-				oid[0] = 0x3F;
-				oid[1] = 0x00;
-				file.ef = 0;
-			} else  {
-				file.ef = 1; /* File is a working elementary file */
-			}
-			
+			mscfs_map_object(&file);
 			mscfs_push_file(fs, &file);
 		}
 		r = fs->listFile(&file, 0, fs->udata);
@@ -140,6 +145,73 @@ void mscfs_check_cache(mscfs_t* fs)
 	}
 }
 
+static int mscfs_cache_index(mscfs_t* fs, const msc_id *objectId, int ef)
+{
+	int x;
+	for(x = 0; x < fs->cache.size; x++) {
+		if(fs->cache.array[x].ef == ef
+				&& 0 == memcmp(fs->cache.array[x].objectId.id, objectId->id, 4))
+			return x;
+	}
+	return -1;
+}
+
+int mscfs_cache_add(mscfs_t* fs, const mscfs_file_t *file)
+{
+	mscfs_file_t entry = *file;
+	int x;
+
+	/* not listed yet, the next lookup will see the object anyway */
+	if(!fs->cache.array || mscfs_is_ignored(fs, entry.objectId))
+		return 0;
+
+	mscfs_map_object(&entry);
+	x = mscfs_cache_index(fs, &entry.objectId, entry.ef);
+	if(x >= 0) {
+		fs->cache.array[x] = entry;
+		return 0;
+	}
+	return mscfs_push_file(fs, &entry);
+}
+
+static void mscfs_cache_remove_index(mscfs_t* fs, int x)
+{
+	mscfs_cache_t *cache = &fs->cache;
+	memmove(&cache->array[x], &cache->array[x + 1],
+			sizeof(mscfs_file_t) * (cache->size - x - 1));
+	cache->size--;
+	if(fs->currentFileIndex == x) {
+		fs->currentFile[0] = fs->currentFile[1] = 0;
+		fs->currentFileIndex = -1;
+	} else if(fs->currentFileIndex > x) {
+		fs->currentFileIndex--;
+	}
+}
+
+void mscfs_cache_remove(mscfs_t* fs, const msc_id *objectId, int ef)
+{
+	msc_id id = *objectId;
+	int x;
+
+	if(!fs->cache.array)
+		return;
+
+	x = mscfs_cache_index(fs, &id, ef);
+	if(x >= 0)
+		mscfs_cache_remove_index(fs, x);
+	if(ef)
+		return;
+
+	/* the files of a directory are gone with it */
+	for(x = 0; x < fs->cache.size; ) {
+		if(fs->cache.array[x].ef
+				&& 0 == memcmp(fs->cache.array[x].objectId.id, id.id + 2, 2))
+			mscfs_cache_remove_index(fs, x);
+		else
+			x++;
+	}
+}
+
 int mscfs_lookup_path(mscfs_t* fs, const u8 *path, int pathlen, msc_id* objectId, int isDirectory)
 {
 	u8* oid = objectId->id;
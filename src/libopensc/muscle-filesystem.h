@@ -58,6 +58,11 @@ int mscfs_push_file(mscfs_t* fs, mscfs_file_t *file);
 int mscfs_update_cache(mscfs_t* fs);
 
 void mscfs_check_cache(mscfs_t* fs);
+/* Apply a change done through this card handle to a listed cache. The
+ * object ID of mscfs_cache_add() is the one of the applet, the one of
+ * mscfs_cache_remove() the one of the cache. */
+int mscfs_cache_add(mscfs_t* fs, const mscfs_file_t *file);
+void mscfs_cache_remove(mscfs_t* fs, const msc_id *objectId, int ef);
 
 int mscfs_lookup_path(mscfs_t* fs, const u8 *path, int pathlen, msc_id* objectId, int isDirectory);
 
@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_CARD
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -168,7 +170,7 @@ int msc_create_object(sc_card_t *card, msc_id objectId, size_t objectSize, unsig
 			SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_ALLOWED);
 		}
 	}
-	if (card->ctx->debug >= 2) {
+	if (SC_LOG_ENABLED(card->ctx, 2)) {
 		sc_log(card->ctx,  "got strange SWs: 0x%02X 0x%02X\n",
 		     apdu.sw1, apdu.sw2);
 	}
@@ -185,7 +187,7 @@ int msc_partial_update_object(sc_card_t *card, msc_id objectId, int offset, cons
 
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0x54, 0x00, 0x00);
 	apdu.lc = dataLength + 9;
-	if (card->ctx->debug >= 2)
+	if (SC_LOG_ENABLED(card->ctx, 2))
 		sc_log(card->ctx, 
 			 "WRITE: Offset: %x\tLength: %"SC_FORMAT_LEN_SIZE_T"u\n",
 			 offset, dataLength);
@@ -210,7 +212,7 @@ int msc_partial_update_object(sc_card_t *card, msc_id objectId, int offset, cons
 			SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_INVALID_ARGUMENTS);
 		}
 	}
-	if (card->ctx->debug >= 2) {
+	if (SC_LOG_ENABLED(card->ctx, 2)) {
 		sc_log(card->ctx,  "got strange SWs: 0x%02X 0x%02X\n",
 		     apdu.sw1, apdu.sw2);
 	}
@@ -249,7 +251,7 @@ int msc_delete_object(sc_card_t *card, msc_id objectId, int zero)
 			SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_ALLOWED);
 		}
 	}
-	if (card->ctx->debug >= 2) {
+	if (SC_LOG_ENABLED(card->ctx, 2)) {
 		sc_log(card->ctx,  "got strange SWs: 0x%02X 0x%02X\n",
 		     apdu.sw1, apdu.sw2);
 	}
@@ -475,7 +477,7 @@ int msc_get_challenge(sc_card_t *card, unsigned short dataLength, unsigned short
 		} else {
 			r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 			if (r) {
-				if (card->ctx->debug >= 2) {
+				if (SC_LOG_ENABLED(card->ctx, 2)) {
 					sc_log(card->ctx,  "got strange SWs: 0x%02X 0x%02X\n",
 					     apdu.sw1, apdu.sw2);
 				}
@@ -487,7 +489,7 @@ int msc_get_challenge(sc_card_t *card, unsigned short dataLength, unsigned short
 		if(apdu.sw1 != 0x90 || apdu.sw2 != 0x00) {
 			r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 			if (r) {
-				if (card->ctx->debug >= 2) {
+				if (SC_LOG_ENABLED(card->ctx, 2)) {
 					sc_log(card->ctx,  "got strange SWs: 0x%02X 0x%02X\n",
 					     apdu.sw1, apdu.sw2);
 				}
@@ -548,7 +550,7 @@ int msc_generate_keypair(sc_card_t *card, int privateKey, int publicKey, int alg
 	}
 	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 	if (r) {
-		if (card->ctx->debug >= 2) {
+		if (SC_LOG_ENABLED(card->ctx, 2)) {
 			sc_log(card->ctx,  "got strange SWs: 0x%02X 0x%02X\n",
 			     apdu.sw1, apdu.sw2);
 		}
@@ -575,7 +577,7 @@ int msc_extract_key(sc_card_t *card,
 	}
 	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 	if (r) {
-		if (card->ctx->debug >= 2) {
+		if (SC_LOG_ENABLED(card->ctx, 2)) {
 			sc_log(card->ctx,  "got strange SWs: 0x%02X 0x%02X\n",
 			     apdu.sw1, apdu.sw2);
 		}
@@ -681,7 +683,7 @@ int msc_compute_crypt_init(sc_card_t *card,
 	}
 	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 	if (r) {
-		if (card->ctx->debug >= 2) {
+		if (SC_LOG_ENABLED(card->ctx, 2)) {
 			sc_log(card->ctx,  "init: got strange SWs: 0x%02X 0x%02X\n",
 			     apdu.sw1, apdu.sw2);
 		}
@@ -731,7 +733,7 @@ int msc_compute_crypt_final(
 	}
 	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 	if (r) {
-		if (card->ctx->debug >= 2) {
+		if (SC_LOG_ENABLED(card->ctx, 2)) {
 			sc_log(card->ctx,  "final: got strange SWs: 0x%02X 0x%02X\n",
 			     apdu.sw1, apdu.sw2);
 		}
@@ -798,7 +800,7 @@ static int msc_compute_crypt_final_object(
 	}
 	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 	if (r) {
-		if (card->ctx->debug >= 2) {
+		if (SC_LOG_ENABLED(card->ctx, 2)) {
 			sc_log(card->ctx,  "final: got strange SWs: 0x%02X 0x%02X\n",
 			     apdu.sw1, apdu.sw2);
 		}
@@ -966,7 +968,7 @@ int msc_import_key(sc_card_t *card,
 	}
 	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 	if (r) {
-		if (card->ctx->debug >= 2) {
+		if (SC_LOG_ENABLED(card->ctx, 2)) {
 			sc_log(card->ctx,  "keyimport: got strange SWs: 0x%02X 0x%02X\n",
 			     apdu.sw1, apdu.sw2);
 		}
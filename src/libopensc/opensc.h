@@ -338,6 +338,9 @@ struct sc_ef_atr {
 	unsigned status;
 };
 
+struct sc_aid_probe_cache;
+struct sc_atr_hints;
+
 struct sc_card_cache {
 	struct sc_path current_path;
 
@@ -345,8 +348,26 @@ struct sc_card_cache {
         struct sc_file *current_df;
 
 	int valid;
+
+	/* whole content of the last selected transparent EF */
+	u8 *read_ahead;
+	size_t read_ahead_len;
+	size_t read_ahead_size;
+
+	/* last absolute path selected by sc_select_file() while the card was
+	 * locked, see SC_CTX_FLAG_SELECT_CACHE */
+	int select_valid;
+	int select_running;
+	struct sc_path select_path;
+	struct sc_file *select_file;
+
+	/* set by sc_lock() when another application may have used or reset
+	 * the card since the previous transaction of this context */
+	int foreign_access;
 };
 
+#define SC_READ_AHEAD_MAX_SIZE	0xFFFF
+
 #define SC_PROTO_T0		0x00000001
 #define SC_PROTO_T1		0x00000002
 #define SC_PROTO_RAW		0x00001000
@@ -368,6 +389,9 @@ struct sc_reader_driver {
 #define SC_READER_HAS_WAITING_AREA	0x00000010
 #define SC_READER_REMOVED			0x00000020
 #define SC_READER_ENABLE_ESCAPE		0x00000040
+/* the last lock continued the transaction of the previous one, or no
+ * other application can have used the card since then */
+#define SC_READER_LOCK_KEPT		0x00000080
 
 /* reader capabilities */
 #define SC_READER_CAP_DISPLAY	0x00000001
@@ -381,6 +405,159 @@ struct sc_reader_driver {
 #define SC_READER_SHORT_APDU_MAX_SEND_SIZE 255
 #define SC_READER_SHORT_APDU_MAX_RECV_SIZE 256
 
+/** Number of buckets of a timing histogram */
+#define SC_STATS_HISTOGRAM_SIZE	8
+/** Upper bounds (exclusive, in microseconds) of the histogram buckets;
+ *  the last bucket collects everything above */
+#define SC_STATS_HISTOGRAM_LIMITS_US \
+	{ 100, 1000, 5000, 10000, 50000, 100000, 1000000, 0 }
+
+/** Durations of a repeated operation */
+struct sc_stats_timing {
+	unsigned long long count;
+	unsigned long long total_us;
+	unsigned long long max_us;
+	unsigned long long histogram[SC_STATS_HISTOGRAM_SIZE];
+};
+
+/** APDU round trips of a high level operation */
+struct sc_stats_operation {
+	unsigned long long count;	/* calls */
+	unsigned long long apdus;	/* APDUs sent by all calls */
+	unsigned long long max_apdus;	/* APDUs sent by the most expensive call */
+};
+
+/** Subsystems whose allocations are accounted, see sc_mem_alloc() */
+#define SC_MEM_ASN1	0	/* ASN.1 encoding */
+#define SC_MEM_PKCS15	1	/* objects and DF contents of bound cards */
+#define SC_MEM_PKCS11	2	/* PKCS#11 sessions */
+#define SC_MEM_APDU	3	/* APDU scratch buffers of the cards */
+#define SC_MEM_COUNT	4
+
+/** Allocations of one subsystem */
+struct sc_stats_memory {
+	unsigned long long in_use;	/* bytes allocated now */
+	unsigned long long peak;	/* most bytes allocated at once */
+	unsigned long long allocs;	/* successful allocations */
+	unsigned long long failures;	/* allocations refused by the allocator */
+};
+
+/** Durations of the phases of sc_context_create(), in microseconds */
+struct sc_stats_startup {
+	unsigned long long config_us;	/* reading and parsing the configuration */
+	unsigned long long reader_init_us;	/* init() of the reader driver, e.g. PC/SC */
+	unsigned long long drivers_us;	/* loading the card drivers and ATRs */
+	unsigned long long detect_us;	/* reader detection, unless deferred */
+};
+
+/** Counters of one context, see sc_ctx_get_stats() */
+struct sc_stats {
+	struct sc_stats_timing apdu;	/* round trips of all readers */
+	unsigned long long apdu_errors;	/* transmissions failed by the reader */
+	struct sc_stats_timing lock_wait;	/* time spent in sc_lock() */
+	struct sc_stats_timing queue_wait;	/* time spent in sc_queue_wait() */
+	unsigned long long queue_depth;	/* requests waiting in the card queues now */
+	unsigned long long queue_depth_max;	/* most requests waiting at once */
+	unsigned long long select_count;	/* sc_select_file() calls */
+	unsigned long long read_binary_count;	/* sc_read_binary() calls */
+	unsigned long long read_binary_bytes;	/* bytes returned by sc_read_binary() */
+	unsigned long long file_cache_hits;	/* sc_pkcs15_read_file() served from the file cache */
+	unsigned long long file_cache_misses;	/* sc_pkcs15_read_file() read from the card */
+	unsigned long long select_cached;	/* sc_select_file() calls sent no SELECT */
+	unsigned long long select_aid_cached;	/* sc_select_aid() calls sent no SELECT */
+	struct sc_stats_operation connect;	/* sc_connect_card(), incl. driver matching */
+	struct sc_stats_operation pkcs15_bind;	/* sc_pkcs15_bind() */
+	struct sc_stats_operation read_binary;	/* sc_read_binary() */
+	struct sc_stats_operation pin_cmd;	/* sc_pin_cmd() */
+	struct sc_stats_operation compute_signature;	/* sc_compute_signature() */
+	struct sc_stats_operation decipher;	/* sc_decipher() */
+	struct sc_stats_memory memory[SC_MEM_COUNT];	/* indexed by SC_MEM_* */
+	struct sc_stats_startup startup;	/* sc_context_create() */
+};
+
+/*
+ * Binary APDU trace, see the apdu_trace option of opensc.conf.
+ *
+ * The trace file starts with a struct sc_apdu_trace_header followed by
+ * `capacity` records. Writers claim the slot `head % capacity` with an
+ * atomic increment of `head` and publish the record by storing `seq`
+ * (claimed index + 1) last, so a reader can order the records by `seq`
+ * and skip slots that were never written. Numbers are stored in host
+ * byte order.
+ */
+#define SC_APDU_TRACE_MAGIC		"OSCAPDUT"
+#define SC_APDU_TRACE_VERSION		1
+#define SC_APDU_TRACE_READER_LEN	24
+#define SC_APDU_TRACE_DEFAULT_RECORDS	4096
+
+struct sc_apdu_trace_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int record_size;	/* sizeof(struct sc_apdu_trace_record) */
+	unsigned int capacity;		/* number of records in the ring */
+	unsigned int reserved;
+	unsigned long long start_time;	/* wall clock at creation, us since the epoch */
+	unsigned long long start_mono;	/* sc_stats_now() clock at creation */
+	volatile unsigned long long head;	/* number of records ever claimed */
+};
+
+struct sc_apdu_trace_record {
+	unsigned long long seq;		/* 0 while unused */
+	unsigned long long timestamp;	/* sc_stats_now() clock at transmission */
+	unsigned int duration_us;
+	unsigned int pid;
+	unsigned int lc;		/* command data length */
+	unsigned int le;
+	unsigned int resplen;		/* response data length */
+	int rv;				/* result of the reader driver */
+	unsigned char cse, cla, ins, p1, p2, sw1, sw2, reserved;
+	char reader[SC_APDU_TRACE_READER_LEN];	/* truncated reader name */
+};
+
+/*
+ * Counters shared by the processes configured with the same file, see the
+ * shared_stats option of opensc.conf.
+ *
+ * The file starts with a struct sc_stats_shm_header followed by
+ * `capacity` entries, one per context. A process claims an entry by
+ * swapping its pid in, and sets `exited` once it released the context,
+ * leaving the counters until the entry is claimed again. The writer makes
+ * `seq` odd while it updates the entry, so a reader retries when `seq`
+ * was odd or changed while it copied the entry. Numbers are stored in
+ * host byte order.
+ */
+#define SC_STATS_SHM_MAGIC		"OSCSTATS"
+#define SC_STATS_SHM_VERSION		1
+#define SC_STATS_SHM_PROCESSES		64
+#define SC_STATS_SHM_READERS		8
+#define SC_STATS_SHM_NAME_LEN		32
+
+struct sc_stats_shm_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int entry_size;	/* sizeof(struct sc_stats_shm_entry) */
+	unsigned int capacity;		/* number of entries */
+	unsigned int reserved;
+};
+
+struct sc_stats_shm_reader {
+	char name[SC_STATS_SHM_NAME_LEN * 2];	/* truncated reader name */
+	struct sc_stats_timing apdu;
+};
+
+struct sc_stats_shm_entry {
+	volatile unsigned long long seq;	/* odd while being written */
+	volatile unsigned int pid;	/* 0 while unused */
+	unsigned int exited;		/* the context was released */
+	unsigned long long update_time;	/* wall clock of the last update, us since the epoch */
+	char app_name[SC_STATS_SHM_NAME_LEN];	/* as given to sc_context_create() */
+	char process[SC_STATS_SHM_NAME_LEN];	/* program name, where known */
+	struct sc_stats stats;
+	unsigned int nreaders;
+	unsigned int reserved;
+	struct sc_stats_shm_reader readers[SC_STATS_SHM_READERS];
+};
+
 typedef struct sc_reader {
 	struct sc_context *ctx;
 	const struct sc_reader_driver *driver;
@@ -404,6 +581,15 @@ typedef struct sc_reader {
 		int Fi, f, Di, N;
 		u8 FI, DI;
 	} atr_info;
+
+	struct sc_stats_timing apdu_stats;	/* round trips through this reader */
+
+	void *async;	/* I/O thread of the asynchronous requests, see sc_async_transmit() */
+
+	/* answer of the TR-03119 GetReaderPACECapabilities escape command,
+	 * valid if escape_detected is set, see sc_detect_escape_cmds() */
+	int escape_detected;
+	unsigned long escape_capabilities;
 } sc_reader_t;
 
 /* This will be the new interface for handling PIN commands.
@@ -504,6 +690,14 @@ struct sc_reader_operations {
 	int (*reset)(struct sc_reader *, int);
 	/* Used to pass in PC/SC handles to minidriver */
 	int (*use_reader)(struct sc_context *ctx, void *pcsc_context_handle, void *pcsc_card_handle);
+	/* Called in the child after fork(). The handles inherited from the
+	 * parent must be neither used nor released, new ones are opened for
+	 * the readers and the cards connected so far. */
+	int (*fork_child)(struct sc_context *ctx);
+	/* Refreshes the state of several readers at once, the following
+	 * detect_card_presence() of each of them returns that state. */
+	int (*detect_cards_presence)(struct sc_context *ctx,
+			struct sc_reader **readers, size_t count);
 };
 
 /*
@@ -524,6 +718,13 @@ struct sc_reader_operations {
 /* Hint SC_CARD_CAP_RNG */
 #define SC_CARD_FLAG_RNG		0x00000002
 #define SC_CARD_FLAG_KEEP_ALIVE	0x00000004
+/* Card accepts UPDATE BINARY and WRITE BINARY split with command
+ * chaining: sc_update_binary() and sc_write_binary() hand the driver up
+ * to SC_MAX_EXT_APDU_DATA_SIZE bytes at once */
+#define SC_CARD_FLAG_CHAINED_WRITE	0x00000008
+/* Card and driver return all records from a record number on for
+ * SC_RECORD_ALL_FROM_NR, see sc_read_record() */
+#define SC_CARD_FLAG_READ_RECORDS	0x00000010
 
 /*
  * Card capabilities
@@ -562,6 +763,11 @@ struct sc_reader_operations {
 /* Card (or card driver) supports key unwrapping operations */
 #define SC_CARD_CAP_UNWRAP_KEY			0x00001000
 
+/* Set by the driver in init() to let sc_connect_card() detect extended
+ * length support and the APDU size limits from the historical bytes and,
+ * if they point to it, EF.ATR/INFO. Limits the driver has set are kept. */
+#define SC_CARD_CAP_NEGOTIATE_APDU		0x00002000
+
 typedef struct sc_card {
 	struct sc_context *ctx;
 	struct sc_reader *reader;
@@ -584,6 +790,9 @@ typedef struct sc_card {
 	int algorithm_count;
 
 	int lock_count;
+	/* counts PIN commands, logouts and resets that may have changed the
+	 * security status of the card */
+	unsigned int pin_events;
 
 	struct sc_card_driver *driver;
 	struct sc_card_operations *ops;
@@ -596,7 +805,27 @@ typedef struct sc_card {
 	struct sc_serial_number serialnr;
 	struct sc_version version;
 
+	/* scratch buffers for APDU data, see sc_card_get_buffer() */
+	struct sc_card_buffer {
+		u8 *buf;
+		size_t size;
+		int busy;
+	} buffers[SC_CARD_BUFFERS];
+
 	void *mutex;
+	/* first-in first-out queue, see sc_queue_take() */
+	void *queue;
+	/* results of SELECT by AID while sc_connect_card() probes the
+	 * drivers, see sc_select_aid() */
+	struct sc_aid_probe_cache *aid_probe;
+	/* response sizes the card asked for with 6Cxx or returned in
+	 * pieces with 61xx, by command header; the oldest is replaced */
+	struct sc_le_memo {
+		u8 cla, ins, p1, p2;
+		size_t le;
+	} le_memo[SC_CARD_LE_MEMO_SIZE];
+	unsigned int le_memo_count;
+	unsigned int le_memo_next;
 #ifdef ENABLE_SM
 	struct sm_context sm_ctx;
 #endif
@@ -791,6 +1020,14 @@ struct sc_card_operations {
 	int (*wrap)(struct sc_card *card, u8 *out, size_t outlen);
 
 	int (*unwrap)(struct sc_card *card, const u8 *crgram, size_t crgram_len);
+
+	/** @brief Exclude the driver by the ATR alone.
+	 *
+	 * Called in sc_connect_card() before match_card() with what the
+	 * historical bytes tell about the card. Must return 0, if the card
+	 * cannot be handled with this driver, so that match_card() is not
+	 * called and sends no APDUs. */
+	int (*match_atr_hints)(struct sc_card *card, const struct sc_atr_hints *hints);
 };
 
 typedef struct sc_card_driver {
@@ -822,6 +1059,26 @@ typedef struct {
 	unsigned long (*thread_id)(void);
 } sc_thread_context_t;
 
+/**
+ * @struct sc_allocator_t
+ * Memory functions libopensc uses for the allocations accounted with
+ * sc_mem_alloc(). A function may refuse an allocation by returning NULL,
+ * for example to bound the memory of a context. Without alloc the C
+ * library is used, with it release is required.
+ */
+typedef struct {
+	/** the version number of this structure (0 for this version) */
+	unsigned int ver;
+	/** passed to the functions */
+	void *opaque;
+	/** allocates len bytes */
+	void *(*alloc)(void *opaque, size_t len);
+	/** resizes an allocation (can be NULL, then alloc and release are used) */
+	void *(*resize)(void *opaque, void *ptr, size_t len);
+	/** releases an allocation */
+	void (*release)(void *opaque, void *ptr);
+} sc_allocator_t;
+
 /** Stop modifying or using external resources
  *
  * Currently this is used to avoid freeing duplicated external resources for a
@@ -837,12 +1094,27 @@ typedef struct {
 #define SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER	0x00000008
 #define SC_CTX_FLAG_DISABLE_POPUPS			0x00000010
 #define SC_CTX_FLAG_DISABLE_COLORS			0x00000020
+#define SC_CTX_FLAG_CACHE_CARD_DRIVER			0x00000040
+#define SC_CTX_FLAG_READ_AHEAD				0x00000080
+#define SC_CTX_FLAG_SELECT_CACHE			0x00000100
+/* sc_context_create() does not detect the readers, the caller will call
+ * sc_ctx_detect_readers() */
+#define SC_CTX_FLAG_DEFER_READER_DETECTION		0x00000200
+/* the context gets a private copy of the configuration, which it may
+ * modify; otherwise ctx->conf is shared with the other contexts of the
+ * process that read the same file and must not be changed */
+#define SC_CTX_FLAG_PRIVATE_CONF			0x00000400
+
+#define SC_MAX_EMULATOR_CACHE		8
+#define SC_MAX_LOG_SUBSYSTEMS		7
 
 typedef struct sc_context {
 	scconf_context *conf;
 	scconf_block *conf_blocks[3];
 	char *app_name;
 	int debug;
+	/* the debug level of each SC_LOG_SUBSYS_*, -1 to follow debug */
+	int debug_levels[SC_MAX_LOG_SUBSYSTEMS];
 	unsigned long flags;
 
 	FILE *debug_file;
@@ -858,9 +1130,50 @@ typedef struct sc_context {
 	struct sc_card_driver *forced_driver;
 
 	sc_thread_context_t	*thread_ctx;
+	const sc_allocator_t	*allocator;
 	void *mutex;
 
 	unsigned int magic;
+
+	/* pkcs15 emulators that recently bound a card, keyed by ATR */
+	struct {
+		struct sc_atr atr;
+		const char *emulator;
+	} emulator_cache[SC_MAX_EMULATOR_CACHE];
+	unsigned int emulator_cache_next;
+
+	struct sc_stats stats;
+	void *stats_mutex;
+
+	struct sc_apdu_trace *apdu_trace;
+	/* entry in the shared statistics, see the shared_stats option */
+	struct sc_stats_shm *stats_shm;
+	/* milliseconds added to every APDU, see the apdu_latency option */
+	unsigned int apdu_latency;
+
+	/* OpenSSL algorithms fetched for this context, see sc_evp_md() */
+	struct sc_evp_cache *evp_cache;
+
+	/* background writer of the debug log, see the debug_buffer option */
+	struct sc_log_writer *log_writer;
+
+	/* external card drivers not loaded yet, see _sc_load_card_driver() */
+	struct sc_lazy_card_driver *lazy_card_drivers;
+
+	/* parsed pkcs15init profiles, see sc_profile_load() */
+	struct sc_profile_cache *profile_cache;
+
+	/* ATR tables compiled to binary, see _sc_match_atr() */
+	struct sc_atr_cache *atr_cache;
+
+	/* EF.DIR content of the cards seen, see sc_enum_apps() */
+	struct sc_dir_cache *dir_cache;
+
+	/* parsed framework pkcs15 block, see sc_pkcs15_get_conf() */
+	struct sc_pkcs15_conf *pkcs15_conf;
+
+	/* external SM modules loaded by the cards, see sc_card_sm_load() */
+	struct sc_sm_module_cache *sm_modules;
 } sc_context_t;
 
 /* APDU handling functions */
@@ -872,6 +1185,71 @@ typedef struct sc_context {
  */
 int sc_transmit_apdu(struct sc_card *card, struct sc_apdu *apdu);
 
+/** Sends several independent APDUs to the card, in order, under a single
+ *  card lock. Transmission stops at the first transport error; status words
+ *  are not interpreted and have to be checked by the caller for each APDU.
+ *  @param  card   struct sc_card object to which the APDUs should be send
+ *  @param  apdus  array of sc_apdu_t objects to be send
+ *  @param  count  number of APDUs in \a apdus
+ *  @return SC_SUCCESS if all APDUs were transmitted and an error code otherwise
+ */
+int sc_transmit_apdus(struct sc_card *card, struct sc_apdu *apdus, size_t count);
+
+/** Sends the chain of APDUs prepared by an SM module back-to-back under a
+ *  single card lock. The chain ends at its first element without
+ *  instruction byte. It stops early at a transport error or at an error
+ *  status of an element not flagged with SC_REMOTE_APDU_FLAG_NOT_FATAL.
+ *  @param  card   struct sc_card object to which the APDUs should be send
+ *  @param  rdata  chain of remote APDUs
+ *  @param  last   if not NULL, receives the last element that was sent
+ *  @return SC_SUCCESS if the last element sent succeeded, the transport
+ *          error or the error of its status word otherwise
+ */
+int sc_transmit_remote_data(struct sc_card *card, struct sc_remote_data *rdata,
+		struct sc_remote_apdu **last);
+
+/* Asynchronous card operations */
+
+typedef struct sc_async_op sc_async_op_t;
+/** Called on the I/O thread of the reader when a request completed, with
+ *  the return value of the blocking function. It must not block. */
+typedef void (*sc_async_callback_t)(void *arg, int result);
+
+/** Queues sc_transmit_apdu() on the I/O thread of the reader of the card.
+ *  The requests of a reader run in the order they were submitted. The
+ *  APDU and its buffers have to stay valid until the request completed.
+ *  @param  card      struct sc_card object to which the APDU should be send
+ *  @param  apdu      sc_apdu_t object of the APDU to be send
+ *  @param  callback  called on completion, may be NULL
+ *  @param  arg       passed to \a callback
+ *  @param  handle    receives a handle for sc_async_done() and
+ *                    sc_async_wait(), to be freed with sc_async_release();
+ *                    may be NULL
+ *  @return SC_SUCCESS if the request was queued and an error code otherwise
+ */
+int sc_async_transmit(struct sc_card *card, struct sc_apdu *apdu,
+		sc_async_callback_t callback, void *arg, sc_async_op_t **handle);
+/** Queues sc_compute_signature(), see sc_async_transmit() */
+int sc_async_compute_signature(struct sc_card *card, const u8 *data, size_t datalen,
+		u8 *out, size_t outlen,
+		sc_async_callback_t callback, void *arg, sc_async_op_t **handle);
+/** Queues sc_decipher(), see sc_async_transmit() */
+int sc_async_decipher(struct sc_card *card, const u8 *crgram, size_t crgram_len,
+		u8 *out, size_t outlen,
+		sc_async_callback_t callback, void *arg, sc_async_op_t **handle);
+/** Queues sc_read_binary(), see sc_async_transmit() */
+int sc_async_read_binary(struct sc_card *card, unsigned int idx, u8 *buf,
+		size_t count, unsigned long flags,
+		sc_async_callback_t callback, void *arg, sc_async_op_t **handle);
+/** Returns 1 and the result of the request in \a result if it completed,
+ *  0 if it is still pending. Does not block. */
+int sc_async_done(sc_async_op_t *handle, int *result);
+/** Blocks until the request completed and returns its result */
+int sc_async_wait(sc_async_op_t *handle);
+/** Frees the handle of a request. A pending request still completes.
+ *  Handles have to be released before the context. */
+void sc_async_release(sc_async_op_t *handle);
+
 void sc_format_apdu(struct sc_card *card, struct sc_apdu *apdu,
 		int cse, int ins, int p1, int p2);
 
@@ -941,7 +1319,8 @@ int sc_establish_context(sc_context_t **ctx, const char *app_name);
  * mutex information, to the sc_context_t creation.
  */
 typedef struct {
-	/** version number of this structure (0 for this version) */
+	/** version number of this structure (1 for this version, 0 for
+	 *  callers that do not set allocator) */
 	unsigned int  ver;
 	/** name of the application (used for finding application
 	 *  dependent configuration data). If NULL the name "default"
@@ -951,6 +1330,8 @@ typedef struct {
 	unsigned long flags;
 	/** mutex functions to use (optional) */
 	sc_thread_context_t *thread_ctx;
+	/** memory functions to use (optional, since version 1) */
+	const sc_allocator_t *allocator;
 } sc_context_param_t;
 
 /**
@@ -986,6 +1367,17 @@ int sc_release_context(sc_context_t *ctx);
  */
 int sc_ctx_detect_readers(sc_context_t *ctx);
 
+/**
+ * Prepares a context inherited from the parent for use in a child after
+ * fork(): the mutexes are created again and the reader driver opens its
+ * own handles to the readers and the connected cards. Must be called
+ * before the child starts other threads.
+ * @param  ctx  OpenSC context
+ * @return SC_SUCCESS on success and an error code otherwise,
+ *         SC_ERROR_NOT_SUPPORTED if the reader driver cannot do this.
+ */
+int sc_ctx_reinit_after_fork(sc_context_t *ctx);
+
 /**
  * In windows: get configuration option from environment or from registers.
  * @param env name of environment variable
@@ -1052,6 +1444,29 @@ int _sc_delete_reader(sc_context_t *ctx, sc_reader_t *reader);
  */
 int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename);
 
+/**
+ * Returns a snapshot of the context's timing counters
+ * @param  ctx    OpenSC context
+ * @param  stats  receives the counters
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_ctx_get_stats(sc_context_t *ctx, struct sc_stats *stats);
+
+/**
+ * Returns a snapshot of the APDU round trip times of a reader
+ * @param  reader  reader of the context
+ * @param  apdu    receives the timings
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_reader_get_stats(sc_reader_t *reader, struct sc_stats_timing *apdu);
+
+/**
+ * Resets the counters of the context and of all its readers
+ * @param  ctx  OpenSC context
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_ctx_reset_stats(sc_context_t *ctx);
+
 /**
  * Forces the use of a specified card driver
  * @param ctx OpenSC context
@@ -1073,6 +1488,15 @@ int sc_connect_card(sc_reader_t *reader, struct sc_card **card);
  */
 int sc_disconnect_card(struct sc_card *card);
 
+/**
+ * Prepares a card connected by the parent for use in a child after
+ * fork(), see sc_ctx_reinit_after_fork(). Locks taken by the parent are
+ * dropped and the cached card state is invalidated.
+ * @param  card  The card connected before fork()
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_card_reinit_after_fork(struct sc_card *card);
+
 /**
  * Checks if a card is present in a reader
  * @param reader Reader structure
@@ -1085,6 +1509,19 @@ int sc_disconnect_card(struct sc_card *card);
  */
 int sc_detect_card_presence(sc_reader_t *reader);
 
+/**
+ * Refreshes the state of several readers with a single request to the
+ * reader subsystem where the reader driver supports it. The following
+ * sc_detect_card_presence() of each of the readers returns the refreshed
+ * state without asking again.
+ * @param  ctx      OpenSC context
+ * @param  readers  readers to refresh
+ * @param  count    number of readers
+ * @return SC_SUCCESS on success and an error code otherwise, in which
+ *         case sc_detect_card_presence() checks the readers one by one.
+ */
+int sc_detect_cards_presence(sc_context_t *ctx, sc_reader_t **readers, size_t count);
+
 /**
  * Waits for an event on readers.
  *
@@ -1143,6 +1580,34 @@ int sc_lock(struct sc_card *card);
  * @retval SC_SUCCESS on success
  */
 int sc_unlock(struct sc_card *card);
+/**
+ * Takes a place in the first-in first-out queue of the card. Does not
+ * block, so it can be called while holding another lock that has to be
+ * released before waiting. Every ticket has to be passed to
+ * sc_queue_wait() and then to sc_queue_leave().
+ * @param  card    The card to queue for
+ * @param  ticket  Receives the place in the queue
+ * @retval SC_SUCCESS on success
+ */
+int sc_queue_take(struct sc_card *card, unsigned long *ticket);
+/**
+ * Blocks until all earlier tickets left the queue and locks the card
+ * (see sc_lock()). If the previous holder left while others were waiting,
+ * its lock is handed over instead, so the reader transaction stays open
+ * across queued requests. Without pthreads the queue never blocks.
+ * @param  card    The card
+ * @param  ticket  The ticket from sc_queue_take()
+ * @retval SC_SUCCESS on success, the error of sc_lock() otherwise; the
+ *         turn has to be ended by sc_queue_leave() in both cases
+ */
+int sc_queue_wait(struct sc_card *card, unsigned long ticket);
+/**
+ * Ends the turn of the current ticket. The card lock is handed over to the
+ * next ticket if there is one, or released otherwise.
+ * @param  card  The card
+ * @retval SC_SUCCESS on success
+ */
+int sc_queue_leave(struct sc_card *card);
 
 /**
  * @brief Calculate the maximum size of R-APDU payload (Ne).
@@ -1168,6 +1633,34 @@ size_t sc_get_max_recv_size(const sc_card_t *card);
  */
 size_t sc_get_max_send_size(const sc_card_t *card);
 
+/**
+ * @brief Borrow a scratch buffer for APDU data from the card.
+ *
+ * The card keeps a few buffers of sc_get_max_send_size() or
+ * sc_get_max_recv_size() bytes, whichever is larger, which are allocated on
+ * first use and reused for every following command. Larger requests and
+ * requests while all buffers are taken fall back to malloc().
+ *
+ * @param card card
+ * @param len  number of bytes needed
+ *
+ * @return buffer of at least len bytes or NULL if out of memory; to be
+ *         returned with sc_card_put_buffer()
+ */
+u8 *sc_card_get_buffer(struct sc_card *card, size_t len);
+
+/**
+ * @brief Return a buffer obtained with sc_card_get_buffer().
+ *
+ * The first used bytes of the buffer are cleared, as they may have held
+ * PINs or key material.
+ *
+ * @param card card
+ * @param buf  buffer, may be NULL
+ * @param used number of bytes written to the buffer
+ */
+void sc_card_put_buffer(struct sc_card *card, u8 *buf, size_t used);
+
 
 /********************************************************************/
 /*                ISO 7816-4 related functions                      */
@@ -1182,6 +1675,23 @@ size_t sc_get_max_send_size(const sc_card_t *card);
  */
 int sc_select_file(struct sc_card *card, const sc_path_t *path,
 		   sc_file_t **file);
+/**
+ * Selects an application by its AID with SELECT (P1 = 04, P2 = 00).
+ *
+ * While sc_connect_card() probes the card drivers, the results of all
+ * SELECT by AID commands are remembered: an AID that was rejected is not
+ * sent again, and the application selected last is not selected again.
+ * Outside of sc_connect_card() the command is always sent.
+ *
+ * @param  card    struct sc_card object on which to issue the command
+ * @param  aid     AID of the application
+ * @param  aidlen  length of the AID
+ * @param  fci     buffer for the returned FCI, or NULL
+ * @param  fcilen  size of the buffer, receives the length of the FCI
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_select_aid(struct sc_card *card, const u8 *aid, size_t aidlen,
+		u8 *fci, size_t *fcilen);
 /**
  * List file ids within a DF
  * @param  card    struct sc_card object on which to issue the command
@@ -1253,6 +1763,9 @@ int sc_erase_binary(struct sc_card *card, unsigned int idx,
 #define SC_RECORD_BY_REC_NR		0x00100UL
 /** use currently selected record */
 #define SC_RECORD_CURRENT		0UL
+/** with SC_RECORD_BY_REC_NR: read all records from the record number
+ * up to the last one (READ RECORD(S) with P2 '05'), concatenated */
+#define SC_RECORD_ALL_FROM_NR		0x00200UL
 
 /**
  * Reads a record from the current (i.e. selected) file.
@@ -1524,6 +2037,22 @@ int sc_base64_decode(const char *in, u8 *out, size_t outlen);
  */
 void sc_mem_clear(void *ptr, size_t len);
 void *sc_mem_secure_alloc(size_t len);
+/**
+ * Allocates memory with the allocator of the context and accounts it to
+ * a subsystem. The memory must be released with sc_mem_free() before
+ * the context is released.
+ * @param  ctx        OpenSC context, NULL for the C library without accounting
+ * @param  subsystem  SC_MEM_* subsystem the memory is accounted to
+ * @param  len        number of bytes
+ * @return the memory or NULL
+ */
+void *sc_mem_alloc(sc_context_t *ctx, unsigned int subsystem, size_t len);
+/** Like sc_mem_alloc(), the memory is zeroed */
+void *sc_mem_calloc(sc_context_t *ctx, unsigned int subsystem, size_t n, size_t size);
+/** Resizes memory of sc_mem_alloc(); ptr may be NULL */
+void *sc_mem_realloc(sc_context_t *ctx, unsigned int subsystem, void *ptr, size_t len);
+/** Releases memory of sc_mem_alloc(), sc_mem_calloc() or sc_mem_realloc() */
+void sc_mem_free(void *ptr);
 void sc_mem_secure_free(void *ptr, size_t len);
 int sc_mem_reverse(unsigned char *buf, size_t len);
 
@@ -1533,6 +2062,9 @@ int sc_make_cache_dir(sc_context_t *ctx);
 int sc_enum_apps(struct sc_card *card);
 struct sc_app_info *sc_find_app(struct sc_card *card, struct sc_aid *aid);
 void sc_free_apps(struct sc_card *card);
+/* Like sc_free_apps(), and forgets the cached EF.DIR content of the card;
+ * for code that changes EF.DIR other than with sc_update_dir() */
+void sc_invalidate_apps(struct sc_card *card);
 int sc_parse_ef_atr(struct sc_card *card);
 void sc_free_ef_atr(struct sc_card *card);
 int sc_parse_ef_gdo(struct sc_card *card,
@@ -144,44 +144,79 @@ sc_pkcs1_strip_01_padding(struct sc_context *ctx, const u8 *in_dat, size_t in_le
 }
 
 
+/*
+ * Constant-time helpers for the BT02 check: masks are all ones for true
+ * and all zeros for false, so the scan does not branch on the plaintext.
+ */
+static unsigned int ct_msb(unsigned int a)
+{
+	return 0 - (a >> (sizeof(a) * 8 - 1));
+}
+
+static unsigned int ct_is_zero(unsigned int a)
+{
+	return ct_msb(~a & (a - 1));
+}
+
+static unsigned int ct_eq(unsigned int a, unsigned int b)
+{
+	return ct_is_zero(a ^ b);
+}
+
+/* a >= b, for a and b below 2^31 */
+static unsigned int ct_ge(unsigned int a, unsigned int b)
+{
+	return ~ct_msb(a - b);
+}
+
+static unsigned int ct_select(unsigned int mask, unsigned int a, unsigned int b)
+{
+	return (mask & a) | (~mask & b);
+}
+
 /* remove pkcs1 BT02 padding (adding BT02 padding is currently not
- * needed/implemented) */
+ * needed/implemented). The padding is checked in constant time, so the
+ * time taken does not tell a padding oracle where it failed; only the
+ * result is returned. */
 int
 sc_pkcs1_strip_02_padding(sc_context_t *ctx, const u8 *data, size_t len, u8 *out, size_t *out_len)
 {
-	unsigned int	n = 0;
+	unsigned int	good, found = 0, zero_index = 0, skip, i;
+	size_t		msg_len;
 
 	LOG_FUNC_CALLED(ctx);
-	if (data == NULL || len < 3)
+	if (data == NULL || len < 3 || len > 0x7FFFFFFF)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INTERNAL);
 
-	/* skip leading zero byte */
-	if (*data == 0) {
-		data++;
-		len--;
+	/* a leading zero byte is optional */
+	skip = ct_is_zero(data[0]) & 1;
+	good = ct_eq(ct_select(0 - skip, data[1], data[0]), 0x02);
+
+	/* find the first zero byte after the block type */
+	for (i = 1; i < len; i++) {
+		unsigned int zero = ct_is_zero(data[i]) & ct_ge(i, skip + 1);
+
+		zero_index = ct_select(~found & zero, i, zero_index);
+		found |= zero;
 	}
-	if (data[0] != 0x02)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_WRONG_PADDING);
-	/* skip over padding bytes */
-	for (n = 1; n < len && data[n]; n++)
-		;
 	/* Must be at least 8 pad bytes */
-	if (n >= len || n < 9)
+	good &= found & ct_ge(zero_index - skip, 9);
+	if (!good)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_WRONG_PADDING);
-	n++;
+
 	if (out == NULL)
 		/* just check the padding */
 		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 
 	/* Now move decrypted contents to head of buffer */
-	if (*out_len < len - n)
+	msg_len = len - zero_index - 1;
+	if (*out_len < msg_len)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INTERNAL);
-	*out_len = len - n;
-	memmove(out, data + n, *out_len);
+	*out_len = msg_len;
+	memmove(out, data + zero_index + 1, msg_len);
 
-	sc_log(ctx, "stripped output(%"SC_FORMAT_LEN_SIZE_T"u): %s", len - n,
-	       sc_dump_hex(out, len - n));
-	LOG_FUNC_RETURN(ctx, len - n);
+	sc_log(ctx, "stripped output(%"SC_FORMAT_LEN_SIZE_T"u)", msg_len);
+	LOG_FUNC_RETURN(ctx, (int)msg_len);
 }
 
 /* add/remove DigestInfo prefix */
@@ -239,44 +274,44 @@ int sc_pkcs1_strip_digest_info_prefix(unsigned int *algorithm,
 
 #ifdef ENABLE_OPENSSL
 
-static const EVP_MD* hash_flag2md(unsigned int hash)
+static const EVP_MD* hash_flag2md(sc_context_t *ctx, unsigned int hash)
 {
 	switch (hash & SC_ALGORITHM_RSA_HASHES) {
 	case SC_ALGORITHM_RSA_HASH_SHA1:
-		return EVP_sha1();
+		return sc_evp_md(ctx, "SHA1");
 	case SC_ALGORITHM_RSA_HASH_SHA224:
-		return EVP_sha224();
+		return sc_evp_md(ctx, "SHA224");
 	case SC_ALGORITHM_RSA_HASH_SHA256:
-		return EVP_sha256();
+		return sc_evp_md(ctx, "SHA256");
 	case SC_ALGORITHM_RSA_HASH_SHA384:
-		return EVP_sha384();
+		return sc_evp_md(ctx, "SHA384");
 	case SC_ALGORITHM_RSA_HASH_SHA512:
-		return EVP_sha512();
+		return sc_evp_md(ctx, "SHA512");
 	default:
 		return NULL;
 	}
 }
 
-static const EVP_MD* mgf1_flag2md(unsigned int mgf1)
+static const EVP_MD* mgf1_flag2md(sc_context_t *ctx, unsigned int mgf1)
 {
 	switch (mgf1 & SC_ALGORITHM_MGF1_HASHES) {
 	case SC_ALGORITHM_MGF1_SHA1:
-		return EVP_sha1();
+		return sc_evp_md(ctx, "SHA1");
 	case SC_ALGORITHM_MGF1_SHA224:
-		return EVP_sha224();
+		return sc_evp_md(ctx, "SHA224");
 	case SC_ALGORITHM_MGF1_SHA256:
-		return EVP_sha256();
+		return sc_evp_md(ctx, "SHA256");
 	case SC_ALGORITHM_MGF1_SHA384:
-		return EVP_sha384();
+		return sc_evp_md(ctx, "SHA384");
 	case SC_ALGORITHM_MGF1_SHA512:
-		return EVP_sha512();
+		return sc_evp_md(ctx, "SHA512");
 	default:
 		return NULL;
 	}
 }
 
 /* add PKCS#1 v2.0 PSS padding */
-static int sc_pkcs1_add_pss_padding(unsigned int hash, unsigned int mgf1_hash,
+static int sc_pkcs1_add_pss_padding(sc_context_t *scctx, unsigned int hash, unsigned int mgf1_hash,
     const u8 *in, size_t in_len, u8 *out, size_t *out_len, size_t mod_bits)
 {
 	/* hLen = sLen in our case */
@@ -291,7 +326,7 @@ static int sc_pkcs1_add_pss_padding(unsigned int hash, unsigned int mgf1_hash,
 	if (*out_len < mod_length)
 		return SC_ERROR_BUFFER_TOO_SMALL;
 
-	md = hash_flag2md(hash);
+	md = hash_flag2md(scctx, hash);
 	if (md == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
 	hlen = EVP_MD_size(md);
@@ -331,7 +366,7 @@ static int sc_pkcs1_add_pss_padding(unsigned int hash, unsigned int mgf1_hash,
 	 *  *the first part is masked later */
 
 	/* Construct the DB mask block by block and XOR it in. */
-	mgf1_md = mgf1_flag2md(mgf1_hash);
+	mgf1_md = mgf1_flag2md(scctx, mgf1_hash);
 	if (mgf1_md == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
 	mgf1_hlen = EVP_MD_size(mgf1_md);
@@ -450,7 +485,7 @@ int sc_pkcs1_encode(sc_context_t *ctx, unsigned long flags,
 			 */
 			hash_algo = hash_len2algo(tmp_len);
 		}
-		rv = sc_pkcs1_add_pss_padding(hash_algo, mgf1_hash,
+		rv = sc_pkcs1_add_pss_padding(ctx, hash_algo, mgf1_hash,
 		    tmp, tmp_len, out, out_len, mod_bits);
 #else
 		rv = SC_ERROR_NOT_SUPPORTED;
@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS15
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -25,10 +27,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 #include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <process.h>
+#else
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#endif
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
@@ -37,47 +53,91 @@
 #include "pkcs15.h"
 #include "common/compat_strlcpy.h"
 
+/*
+ * All cached files of one token live in a single container file named
+ * after the token's serial number (or UID):
+ *
+ *   magic "P15C" | version (4) | key length (4) | entry count (4) |
+ *   invalidation key | index entries | payload
+ *
+ * Each index entry is a name length (2), payload offset (4) and payload
+ * length (4) followed by the name, which is derived from the AID and path
+ * of the cached file. All numbers are big endian. The invalidation key is
+ * the token's lastUpdate time; a container with a different key is stale
+ * and is replaced on the next write. The container is rewritten through
+ * a temporary file and renamed into place, so readers never observe a
+ * half written cache.
+ */
+#define CACHE_MAGIC		"P15C"
+#define CACHE_VERSION		1
+#define CACHE_HEADER_SIZE	16
+#define CACHE_ENTRY_SIZE	10
+#define CACHE_NAME_MAX		128
+
+struct sc_pkcs15_cache_entry {
+	const u8 *name;
+	size_t name_len;
+	size_t offset;
+	size_t len;
+};
+
+struct sc_pkcs15_file_cache {
+	char fname[PATH_MAX];
+	char key[128];
+
+	int loaded;
+	u8 *data;
+	size_t data_len;
+	int mapped;
+
+	struct sc_pkcs15_cache_entry *entries;
+	size_t num_entries;
+};
+
 #define RANDOM_UID_INDICATOR 0x08
 static int generate_cache_filename(struct sc_pkcs15_card *p15card,
-				   const sc_path_t *path,
 				   char *buf, size_t bufsize)
 {
 	char dir[PATH_MAX];
-	char *last_update = NULL;
+	char uid[SC_MAX_SERIALNR * 3 + 16];
 	int  r;
-	unsigned u;
 
 	if (p15card->tokeninfo->serial_number == NULL
 			&& (p15card->card->uid.len == 0
 				|| p15card->card->uid.value[0] == RANDOM_UID_INDICATOR))
 		return SC_ERROR_INVALID_ARGUMENTS;
 
-	assert(path->len <= SC_MAX_PATH_SIZE);
 	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
 	if (r)
 		return r;
 	snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "/");
 
-	last_update = sc_pkcs15_get_lastupdate(p15card);
-	if (!last_update)
-		last_update = "NODATE";
-
 	if (p15card->tokeninfo->serial_number) {
 		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
-				"%s_%s", p15card->tokeninfo->serial_number,
-				last_update);
+				"%s.p15c", p15card->tokeninfo->serial_number);
 	} else {
 		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
-				"uid-%s_%s", sc_dump_hex(
+				"uid-%s.p15c", sc_dump_hex_r(
 					p15card->card->uid.value,
-					p15card->card->uid.len), last_update);
+					p15card->card->uid.len, uid, sizeof(uid)));
 	}
 
+	strlcpy(buf, dir, bufsize);
+
+	return SC_SUCCESS;
+}
+
+static int generate_entry_name(const sc_path_t *path, char *buf, size_t bufsize)
+{
+	unsigned u;
+
+	assert(path->len <= SC_MAX_PATH_SIZE);
+	buf[0] = '\0';
+
 	if (path->aid.len &&
 		(path->type == SC_PATH_TYPE_FILE_ID || path->type == SC_PATH_TYPE_PATH))   {
-		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "_");
 		for (u = 0; u < path->aid.len; u++)
-			snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
+			snprintf(buf + strlen(buf), bufsize - strlen(buf),
 					"%02X",  path->aid.value[u]);
 	}
 	else if (path->type != SC_PATH_TYPE_PATH)  {
@@ -89,135 +149,690 @@ static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 
 		if (path->len > 2 && memcmp(path->value, "\x3F\x00", 2) == 0)
 			offs = 2;
-		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "_");
+		snprintf(buf + strlen(buf), bufsize - strlen(buf), "_");
 		for (u = 0; u < path->len - offs; u++)
-			snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
+			snprintf(buf + strlen(buf), bufsize - strlen(buf),
 					"%02X",  path->value[u + offs]);
 	}
 
-	if (!buf)
-		return SC_ERROR_BUFFER_TOO_SMALL;
-	strlcpy(buf, dir, bufsize);
+	return SC_SUCCESS;
+}
+
+/*
+ * Entries that are not files, see sc_pkcs15_cache_entry(). Their names
+ * start with a lower case letter, which keeps them apart from the names
+ * of generate_entry_name().
+ */
+static int cache_name_is_valid(const char *name)
+{
+	size_t i, len = strlen(name);
+
+	if (len == 0 || len >= CACHE_NAME_MAX || name[0] < 'a' || name[0] > 'z')
+		return 0;
+	for (i = 0; i < len; i++)
+		if (!isalnum((unsigned char)name[i]) && name[i] != '-')
+			return 0;
+	return 1;
+}
+
+static void cache_unload(struct sc_pkcs15_file_cache *cache)
+{
+#ifdef HAVE_SYS_MMAN_H
+	if (cache->mapped)
+		munmap(cache->data, cache->data_len);
+	else
+#endif
+		free(cache->data);
+	cache->data = NULL;
+	cache->data_len = 0;
+	cache->mapped = 0;
+	cache->loaded = 0;
+
+	free(cache->entries);
+	cache->entries = NULL;
+	cache->num_entries = 0;
+}
+
+static int cache_map(struct sc_pkcs15_file_cache *cache)
+{
+	struct stat stbuf;
+	int fd;
+
+	fd = open(cache->fname, O_RDONLY
+#ifdef O_BINARY
+			| O_BINARY
+#endif
+			);
+	if (fd < 0)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fstat(fd, &stbuf) || stbuf.st_size < CACHE_HEADER_SIZE)   {
+		close(fd);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	cache->data_len = (size_t)stbuf.st_size;
+
+#ifdef HAVE_SYS_MMAN_H
+	cache->data = mmap(NULL, cache->data_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (cache->data != MAP_FAILED)   {
+		cache->mapped = 1;
+		close(fd);
+		return SC_SUCCESS;
+	}
+	cache->data = NULL;
+#endif
+
+	cache->data = malloc(cache->data_len);
+	if (cache->data == NULL)   {
+		close(fd);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	if (read(fd, cache->data, (unsigned int)cache->data_len) != (int)cache->data_len)   {
+		close(fd);
+		free(cache->data);
+		cache->data = NULL;
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	close(fd);
 
 	return SC_SUCCESS;
 }
 
-int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
-				const sc_path_t *path,
-				u8 **buf, size_t *bufsize)
+static int cache_parse(struct sc_pkcs15_file_cache *cache)
+{
+	const u8 *p = cache->data, *end = cache->data + cache->data_len;
+	size_t key_len, count, i;
+
+	if (memcmp(p, CACHE_MAGIC, 4) || bebytes2ulong(p + 4) != CACHE_VERSION)
+		return SC_ERROR_INVALID_DATA;
+	key_len = bebytes2ulong(p + 8);
+	count = bebytes2ulong(p + 12);
+	p += CACHE_HEADER_SIZE;
+
+	if (key_len > (size_t)(end - p))
+		return SC_ERROR_INVALID_DATA;
+	if (key_len != strlen(cache->key) || memcmp(p, cache->key, key_len))
+		return SC_ERROR_WRONG_LENGTH;
+	p += key_len;
+
+	if (count > (size_t)(end - p) / CACHE_ENTRY_SIZE)
+		return SC_ERROR_INVALID_DATA;
+	cache->entries = calloc(count ? count : 1, sizeof *cache->entries);
+	if (cache->entries == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	for (i = 0; i < count; i++)   {
+		struct sc_pkcs15_cache_entry *e = &cache->entries[i];
+
+		if ((size_t)(end - p) < CACHE_ENTRY_SIZE)
+			return SC_ERROR_INVALID_DATA;
+		e->name_len = bebytes2ushort(p);
+		e->offset = bebytes2ulong(p + 2);
+		e->len = bebytes2ulong(p + 6);
+		p += CACHE_ENTRY_SIZE;
+
+		if (e->name_len > (size_t)(end - p))
+			return SC_ERROR_INVALID_DATA;
+		e->name = p;
+		p += e->name_len;
+
+		if (e->offset > cache->data_len || e->len > cache->data_len - e->offset)
+			return SC_ERROR_INVALID_DATA;
+	}
+	cache->num_entries = count;
+
+	return SC_SUCCESS;
+}
+
+/* Open the token's cache container once and keep it until the token's
+ * identity or lastUpdate changes (e.g. once TokenInfo has been parsed).
+ * A missing, stale or damaged container results in an empty cache. */
+static int cache_load(struct sc_pkcs15_card *p15card, struct sc_pkcs15_file_cache **out)
+{
+	struct sc_pkcs15_file_cache *cache = p15card->file_cache;
+	char fname[PATH_MAX], *last_update;
+	int r;
+
+	r = generate_cache_filename(p15card, fname, sizeof(fname));
+	if (r != SC_SUCCESS)
+		return r;
+	last_update = sc_pkcs15_get_lastupdate(p15card);
+	if (!last_update)
+		last_update = "NODATE";
+
+	if (cache == NULL)   {
+		cache = calloc(1, sizeof *cache);
+		if (cache == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		p15card->file_cache = cache;
+	}
+	if (strcmp(cache->fname, fname) || strcmp(cache->key, last_update))   {
+		cache_unload(cache);
+		strlcpy(cache->fname, fname, sizeof(cache->fname));
+		strlcpy(cache->key, last_update, sizeof(cache->key));
+	}
+
+	if (!cache->loaded)   {
+		r = cache_map(cache);
+		if (r == SC_SUCCESS)
+			r = cache_parse(cache);
+		if (r != SC_SUCCESS)   {
+			sc_log(p15card->card->ctx, "no usable cache container %s: %s",
+					cache->fname, sc_strerror(r));
+			cache_unload(cache);
+			if (r == SC_ERROR_OUT_OF_MEMORY)
+				return r;
+		}
+		else   {
+			sc_log(p15card->card->ctx, "loaded cache container %s with %"SC_FORMAT_LEN_SIZE_T"u entries",
+					cache->fname, cache->num_entries);
+		}
+		cache->loaded = 1;
+	}
+
+	*out = cache;
+	return SC_SUCCESS;
+}
+
+/*
+ * Client of the shared cache service, see pkcs15.h for the protocol.
+ * SC_ERROR_NOT_SUPPORTED means that the service is not reachable and
+ * the on-disk cache is used instead.
+ */
+#define SERVICE_TIMEOUT_SEC	1
+
+static int service_identity(struct sc_pkcs15_card *p15card,
+		char *container, size_t container_len, const char **key)
 {
 	char fname[PATH_MAX];
-	int rv;
-	FILE *f;
-	size_t count;
-	struct stat stbuf;
-	u8 *data = NULL;
+	const char *base;
+	int r;
 
-	if (path->len < 2)
-		return SC_ERROR_INVALID_ARGUMENTS;
+	r = generate_cache_filename(p15card, fname, sizeof(fname));
+	if (r != SC_SUCCESS)
+		return r;
+	base = strrchr(fname, '/');
+	strlcpy(container, base ? base + 1 : fname, container_len);
 
-	/* Accept full path or FILE-ID path with AID */
-	if ((path->type != SC_PATH_TYPE_PATH) && (path->type != SC_PATH_TYPE_FILE_ID || path->aid.len == 0))
-		return SC_ERROR_INVALID_ARGUMENTS;
+	*key = sc_pkcs15_get_lastupdate(p15card);
+	if (*key == NULL)
+		*key = "NODATE";
 
-	sc_log(p15card->card->ctx, "try to read cache for %s", sc_print_path(path));
-	rv = generate_cache_filename(p15card, path, fname, sizeof(fname));
+	return SC_SUCCESS;
+}
+
+#ifndef _WIN32
+static int service_connect(sc_context_t *ctx)
+{
+	struct sockaddr_un addr;
+	struct timeval tv;
+	char dir[PATH_MAX];
+	int fd, n;
+
+	if (sc_get_cache_dir(ctx, dir, sizeof(dir)) != SC_SUCCESS)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	n = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s",
+			dir, SC_PKCS15_CACHE_SERVICE_SOCKET);
+	if (n < 0 || (size_t)n >= sizeof(addr.sun_path))
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	tv.tv_sec = SERVICE_TIMEOUT_SEC;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+	n = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &n, sizeof(n));
+#endif
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int service_send(int fd, const u8 *buf, size_t len)
+{
+#ifdef MSG_NOSIGNAL
+	const int flags = MSG_NOSIGNAL;
+#else
+	const int flags = 0;
+#endif
+
+	while (len > 0) {
+		ssize_t n = send(fd, buf, len, flags);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+static int service_recv(int fd, u8 *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = recv(fd, buf, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+static size_t service_put_string(u8 *p, const char *str)
+{
+	size_t len = strlen(str);
+
+	ushort2bebytes(p, (unsigned short)len);
+	memcpy(p + 2, str, len);
+	return 2 + len;
+}
+
+static int service_request(struct sc_pkcs15_card *p15card, int op, const char *name,
+		const u8 *data, size_t data_len, u8 **out, size_t *out_len)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	u8 req[1 + 3 * (2 + SC_PKCS15_CACHE_SERVICE_MAX_STRING) + 4], status, lenbuf[4];
+	char container[SC_PKCS15_CACHE_SERVICE_MAX_STRING + 1];
+	const char *key;
+	size_t req_len = 0, len;
+	int fd, r;
+
+	r = service_identity(p15card, container, sizeof(container), &key);
+	if (r != SC_SUCCESS)
+		return r;
+	if (strlen(key) > SC_PKCS15_CACHE_SERVICE_MAX_STRING
+			|| strlen(name) > SC_PKCS15_CACHE_SERVICE_MAX_STRING
+			|| data_len > SC_PKCS15_CACHE_SERVICE_MAX_DATA)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	req[req_len++] = (u8)op;
+	req_len += service_put_string(req + req_len, container);
+	req_len += service_put_string(req + req_len, key);
+	req_len += service_put_string(req + req_len, name);
+	if (op == SC_PKCS15_CACHE_SERVICE_PUT) {
+		ulong2bebytes(req + req_len, (unsigned long)data_len);
+		req_len += 4;
+	}
+
+	fd = service_connect(ctx);
+	if (fd < 0)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	r = SC_ERROR_NOT_SUPPORTED;
+	if (service_send(fd, req, req_len)
+			|| (data_len && service_send(fd, data, data_len))
+			|| service_recv(fd, &status, 1))
+		goto out;
+
+	if (status != SC_PKCS15_CACHE_SERVICE_OK) {
+		r = SC_ERROR_FILE_NOT_FOUND;
+		goto out;
+	}
+	if (op != SC_PKCS15_CACHE_SERVICE_GET) {
+		r = SC_SUCCESS;
+		goto out;
+	}
+
+	if (service_recv(fd, lenbuf, sizeof(lenbuf)))
+		goto out;
+	len = bebytes2ulong(lenbuf);
+	if (len > SC_PKCS15_CACHE_SERVICE_MAX_DATA)
+		goto out;
+	*out = malloc(len ? len : 1);
+	if (*out == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	if (service_recv(fd, *out, len)) {
+		free(*out);
+		*out = NULL;
+		goto out;
+	}
+	*out_len = len;
+	r = SC_SUCCESS;
+
+out:
+	close(fd);
+	if (r == SC_ERROR_NOT_SUPPORTED)
+		sc_log(ctx, "cache service not available");
+	return r;
+}
+#else
+static int service_request(struct sc_pkcs15_card *p15card, int op, const char *name,
+		const u8 *data, size_t data_len, u8 **out, size_t *out_len)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+#endif
+
+static const struct sc_pkcs15_cache_entry *
+cache_lookup(const struct sc_pkcs15_file_cache *cache, const char *name)
+{
+	size_t i, len = strlen(name);
+
+	for (i = 0; i < cache->num_entries; i++)
+		if (cache->entries[i].name_len == len
+				&& !memcmp(cache->entries[i].name, name, len))
+			return &cache->entries[i];
+
+	return NULL;
+}
+
+void sc_pkcs15_cache_release(struct sc_pkcs15_card *p15card)
+{
+	if (p15card == NULL)
+		return;
+
+	free(p15card->immutable_files);
+	p15card->immutable_files = NULL;
+	p15card->num_immutable_files = 0;
+	if (p15card->file_cache == NULL)
+		return;
+
+	cache_unload(p15card->file_cache);
+	free(p15card->file_cache);
+	p15card->file_cache = NULL;
+}
+
+/*
+ * Reads 'count' bytes at 'offset' of the cache entry 'name', the whole
+ * entry if 'count' is negative.
+ */
+static int cache_read(struct sc_pkcs15_card *p15card, const char *name,
+		size_t offset, int count_in, u8 **buf, size_t *bufsize)
+{
+	struct sc_pkcs15_file_cache *cache;
+	const struct sc_pkcs15_cache_entry *entry;
+	int rv;
+	size_t count, src_len = 0;
+	u8 *data = NULL, *service_data = NULL;
+	const u8 *src;
+
+	if (p15card->opts.use_cache_service) {
+		rv = service_request(p15card, SC_PKCS15_CACHE_SERVICE_GET, name,
+				NULL, 0, &service_data, &src_len);
+		if (rv != SC_ERROR_NOT_SUPPORTED) {
+			if (rv != SC_SUCCESS)
+				return rv;
+			sc_log(p15card->card->ctx, "read file %s from cache service", name);
+			src = service_data;
+			goto found;
+		}
+	}
+
+	rv = cache_load(p15card, &cache);
 	if (rv != SC_SUCCESS)
 		return rv;
-	sc_log(p15card->card->ctx, "read cached file %s", fname);
 
-	f = fopen(fname, "rb");
-	if (!f)
+	entry = cache_lookup(cache, name);
+	if (entry == NULL)
 		return SC_ERROR_FILE_NOT_FOUND;
-	if (fstat(fileno(f), &stbuf))   {
-		fclose(f);
-		return  SC_ERROR_FILE_NOT_FOUND;
-	}
+	sc_log(p15card->card->ctx, "read cached file %s:%s", cache->fname, name);
+	src = cache->data + entry->offset;
+	src_len = entry->len;
 
-	if (path->count < 0) {
-		count = stbuf.st_size;
+found:
+	if (count_in < 0) {
+		count = src_len;
+		offset = 0;
 	}
 	else {
-		count = path->count;
-		if (path->index + count > (size_t)stbuf.st_size)   {
+		count = count_in;
+		if (offset > src_len || count > src_len - offset) {
 			rv = SC_ERROR_FILE_NOT_FOUND; /* cache file bad? */
-			goto err;
-		}
-
-		if (0 != fseek(f, (long)path->index, SEEK_SET)) {
-			rv = SC_ERROR_FILE_NOT_FOUND;
-			goto err;
+			goto out;
 		}
 	}
 
 	if (*buf == NULL) {
-		data = malloc((size_t)stbuf.st_size);
-		if (data == NULL)   {
+		data = malloc(count ? count : 1);
+		if (data == NULL) {
 			rv = SC_ERROR_OUT_OF_MEMORY;
-			goto err;
+			goto out;
 		}
 	}
 	else {
 		if (count > *bufsize) {
-			rv =  SC_ERROR_BUFFER_TOO_SMALL;
-			goto err;
+			rv = SC_ERROR_BUFFER_TOO_SMALL;
+			goto out;
 		}
 		data = *buf;
 	}
 
-	if (count != fread(data, 1, count, f)) {
-		rv = SC_ERROR_BUFFER_TOO_SMALL;
-		goto err;
-	}
+	memcpy(data, src + offset, count);
 	*buf = data;
 	*bufsize = count;
-
 	rv = SC_SUCCESS;
 
-err:
-	if (rv != SC_SUCCESS) {
-		if (data != *buf) {
-			free(data);
-		}
-	}
-
-	fclose(f);
+out:
+	free(service_data);
 	return rv;
 }
 
-int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
-			 const sc_path_t *path,
+int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
+				const sc_path_t *path,
+				u8 **buf, size_t *bufsize)
+{
+	char name[CACHE_NAME_MAX];
+	int rv;
+
+	if (path->len < 2)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	/* Accept full path or FILE-ID path with AID */
+	if ((path->type != SC_PATH_TYPE_PATH) && (path->type != SC_PATH_TYPE_FILE_ID || path->aid.len == 0))
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	sc_log(p15card->card->ctx, "try to read cache for %s", sc_print_path(path));
+	rv = generate_entry_name(path, name, sizeof(name));
+	if (rv != SC_SUCCESS)
+		return rv;
+
+	return cache_read(p15card, name, path->index, path->count, buf, bufsize);
+}
+
+int sc_pkcs15_read_cached_entry(struct sc_pkcs15_card *p15card,
+				const char *name, u8 **buf, size_t *bufsize)
+{
+	if (p15card == NULL || name == NULL || !cache_name_is_valid(name))
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	return cache_read(p15card, name, 0, -1, buf, bufsize);
+}
+
+static int cache_write_entry(FILE *f, const char *name, size_t name_len,
+		size_t offset, size_t len)
+{
+	u8 hdr[CACHE_ENTRY_SIZE];
+
+	ushort2bebytes(hdr, (unsigned short)name_len);
+	ulong2bebytes(hdr + 2, (unsigned long)offset);
+	ulong2bebytes(hdr + 6, (unsigned long)len);
+	if (fwrite(hdr, 1, sizeof hdr, f) != sizeof hdr
+			|| fwrite(name, 1, name_len, f) != name_len)
+		return SC_ERROR_INTERNAL;
+	return SC_SUCCESS;
+}
+
+static int cache_replace(const char *tmpname, const char *fname)
+{
+#ifdef _WIN32
+	if (!MoveFileExA(tmpname, fname, MOVEFILE_REPLACE_EXISTING))
+		return -1;
+	return 0;
+#else
+	return rename(tmpname, fname);
+#endif
+}
+
+static int cache_store(struct sc_pkcs15_card *p15card, const char *name,
 			 const u8 *buf, size_t bufsize)
 {
-	char fname[PATH_MAX];
+	struct sc_pkcs15_file_cache *cache;
+	const struct sc_pkcs15_cache_entry *old;
+	char tmpname[PATH_MAX + 16];
+	u8 hdr[CACHE_HEADER_SIZE];
+	size_t i, count, name_len, key_len, offset;
 	int r;
 	FILE *f;
-	size_t c;
 
-	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
-	if (r != 0)
+	if (p15card->opts.use_cache_service) {
+		r = service_request(p15card, SC_PKCS15_CACHE_SERVICE_PUT, name,
+				buf, bufsize, NULL, NULL);
+		if (r != SC_ERROR_NOT_SUPPORTED)
+			return r == SC_SUCCESS ? 0 : r;
+	}
+
+	r = cache_load(p15card, &cache);
+	if (r != SC_SUCCESS)
 		return r;
 
-	f = fopen(fname, "wb");
+	/* Existing entries keep their order, a replaced entry moves to the end */
+	old = cache_lookup(cache, name);
+	count = cache->num_entries + (old ? 0 : 1);
+	name_len = strlen(name);
+	key_len = strlen(cache->key);
+
+	snprintf(tmpname, sizeof(tmpname), "%s.%lu", cache->fname, (unsigned long)getpid());
+	f = fopen(tmpname, "wb");
 	/* If the open failed because the cache directory does
 	 * not exist, create it and a re-try the fopen() call.
 	 */
 	if (f == NULL && errno == ENOENT) {
 		if ((r = sc_make_cache_dir(p15card->card->ctx)) < 0)
 			return r;
-		f = fopen(fname, "wb");
+		f = fopen(tmpname, "wb");
 	}
 	if (f == NULL)
 		return 0;
 
-	c = fwrite(buf, 1, bufsize, f);
-	fclose(f);
-	if (c != bufsize) {
-		sc_log(p15card->card->ctx, 
-			 "fwrite() wrote only %"SC_FORMAT_LEN_SIZE_T"u bytes",
-			 c);
-		unlink(fname);
-		return SC_ERROR_INTERNAL;
+	memcpy(hdr, CACHE_MAGIC, 4);
+	ulong2bebytes(hdr + 4, CACHE_VERSION);
+	ulong2bebytes(hdr + 8, (unsigned long)key_len);
+	ulong2bebytes(hdr + 12, (unsigned long)count);
+	if (fwrite(hdr, 1, sizeof hdr, f) != sizeof hdr
+			|| fwrite(cache->key, 1, key_len, f) != key_len)   {
+		r = SC_ERROR_INTERNAL;
+		goto err;
+	}
+
+	/* payload starts after the complete index */
+	offset = CACHE_HEADER_SIZE + key_len + count * CACHE_ENTRY_SIZE + name_len;
+	for (i = 0; i < cache->num_entries; i++)
+		if (&cache->entries[i] != old)
+			offset += cache->entries[i].name_len;
+
+	for (i = 0; r == SC_SUCCESS && i < cache->num_entries; i++)   {
+		const struct sc_pkcs15_cache_entry *e = &cache->entries[i];
+
+		if (e == old)
+			continue;
+		r = cache_write_entry(f, (const char *)e->name, e->name_len, offset, e->len);
+		offset += e->len;
 	}
+	if (r == SC_SUCCESS)
+		r = cache_write_entry(f, name, name_len, offset, bufsize);
+
+	for (i = 0; r == SC_SUCCESS && i < cache->num_entries; i++)   {
+		const struct sc_pkcs15_cache_entry *e = &cache->entries[i];
+
+		if (e != old && fwrite(cache->data + e->offset, 1, e->len, f) != e->len)
+			r = SC_ERROR_INTERNAL;
+	}
+	if (r == SC_SUCCESS && fwrite(buf, 1, bufsize, f) != bufsize)
+		r = SC_ERROR_INTERNAL;
+
+err:
+	if (fclose(f) != 0 && r == SC_SUCCESS)
+		r = SC_ERROR_INTERNAL;
+	if (r == SC_SUCCESS && cache_replace(tmpname, cache->fname) != 0)
+		r = SC_ERROR_INTERNAL;
+	if (r != SC_SUCCESS) {
+		sc_log(p15card->card->ctx, "failed to write cache container %s", cache->fname);
+		unlink(tmpname);
+		return r;
+	}
+
+	/* the next lookup maps the new container */
+	cache_unload(cache);
+	return 0;
+}
+
+int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
+			 const sc_path_t *path,
+			 const u8 *buf, size_t bufsize)
+{
+	char name[CACHE_NAME_MAX];
+	int r;
+
+	r = generate_entry_name(path, name, sizeof(name));
+	if (r != SC_SUCCESS)
+		return r;
+
+	return cache_store(p15card, name, buf, bufsize);
+}
+
+int sc_pkcs15_cache_entry(struct sc_pkcs15_card *p15card,
+			  const char *name, const u8 *buf, size_t bufsize)
+{
+	if (p15card == NULL || name == NULL || !cache_name_is_valid(name))
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	return cache_store(p15card, name, buf, bufsize);
+}
+
+static int immutable_path_match(const sc_path_t *file, const sc_path_t *path)
+{
+	return sc_compare_path(file, path) && file->aid.len == path->aid.len
+		&& !memcmp(file->aid.value, path->aid.value, path->aid.len);
+}
+
+int sc_pkcs15_set_file_immutable(struct sc_pkcs15_card *p15card,
+				 const sc_path_t *path)
+{
+	sc_path_t *files;
+
+	if (p15card == NULL || path == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (sc_pkcs15_file_is_immutable(p15card, path))
+		return SC_SUCCESS;
+
+	files = realloc(p15card->immutable_files,
+			(p15card->num_immutable_files + 1) * sizeof(*files));
+	if (files == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	p15card->immutable_files = files;
+
+	/* the whole file, whatever part of it the object refers to */
+	files[p15card->num_immutable_files] = *path;
+	files[p15card->num_immutable_files].index = 0;
+	files[p15card->num_immutable_files].count = -1;
+	p15card->num_immutable_files++;
+	return SC_SUCCESS;
+}
+
+int sc_pkcs15_file_is_immutable(const struct sc_pkcs15_card *p15card,
+				const sc_path_t *path)
+{
+	size_t i;
+
+	if (p15card == NULL || path == NULL)
+		return 0;
+
+	for (i = 0; i < p15card->num_immutable_files; i++)
+		if (immutable_path_match(&p15card->immutable_files[i], path))
+			return 1;
 	return 0;
 }
@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS15
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -31,12 +33,16 @@
 #endif
 #include <assert.h>
 
+#ifdef ENABLE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
 #include "internal.h"
 #include "asn1.h"
 #include "pkcs15.h"
 
 static int
-parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_cert *cert)
+parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_cert *cert, int shared)
 {
 	int r;
 	struct sc_algorithm_id sig_alg;
@@ -91,10 +97,17 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "X.509 certificate not found");
 
 	data_len = objlen + (obj - buf);
-	cert->data.value = malloc(data_len);
-	if (!cert->data.value)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-	memcpy(cert->data.value, buf, data_len);
+	if (shared) {
+		/* the certificate starts the buffer, keep a reference */
+		cert->data.value = (u8 *)sc_pkcs15_buf_ref(buf);
+		cert->data.shared = 1;
+	}
+	else {
+		cert->data.value = malloc(data_len);
+		if (!cert->data.value)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+		memcpy(cert->data.value, buf, data_len);
+	}
 	cert->data.len = data_len;
 
 	r = sc_asn1_decode(ctx, asn1_cert, obj, objlen, NULL, NULL);
@@ -352,7 +365,7 @@ sc_pkcs15_pubkey_from_cert(struct sc_context *ctx,
 	if (cert == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 
-	rv = parse_x509_cert(ctx, cert_blob, cert);
+	rv = parse_x509_cert(ctx, cert_blob, cert, 0);
 
 	*out = cert->key;
 	cert->key = NULL;
@@ -362,14 +375,61 @@ sc_pkcs15_pubkey_from_cert(struct sc_context *ctx,
 }
 
 
+/*
+ * Certificates of the cert objects bound to the card are kept parsed, so
+ * that reading a certificate again (for the subject, the serial or the
+ * public key) is a lookup. Certificates described by a cert_info of the
+ * caller, e.g. by the emulators while they build the objects, are parsed
+ * for every call, since their owner may change them.
+ */
+struct sc_pkcs15_cert_cache {
+	struct sc_pkcs15_cert_cache *next;
+	const struct sc_pkcs15_cert_info *info;
+	struct sc_pkcs15_cert *cert;
+};
+
+static int
+cert_info_is_bound(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_cert_info *info)
+{
+	struct sc_pkcs15_object *obj;
+
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next)
+		if (obj->data == info && (obj->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_CERT)
+			return 1;
+	return 0;
+}
+
+void
+sc_pkcs15_invalidate_certificate(struct sc_pkcs15_card *p15card,
+		const struct sc_pkcs15_cert_info *info)
+{
+	struct sc_pkcs15_cert_cache **pp, *entry;
+
+	if (p15card == NULL)
+		return;
+	pp = &p15card->cert_cache;
+	while ((entry = *pp) != NULL) {
+		if (info != NULL && entry->info != info) {
+			pp = &entry->next;
+			continue;
+		}
+		*pp = entry->next;
+		sc_pkcs15_free_certificate(entry->cert);
+		free(entry);
+	}
+}
+
+
 int
 sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_cert_info *info,
 		struct sc_pkcs15_cert **cert_out)
 {
 	struct sc_context *ctx = NULL;
 	struct sc_pkcs15_cert *cert = NULL;
+	struct sc_pkcs15_cert_cache *entry;
 	struct sc_pkcs15_der der;
-	int r;
+	const u8 *ref = NULL;
+	int r, bound;
 
 	if (p15card == NULL || info == NULL || cert_out == NULL) {
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -377,12 +437,25 @@ sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs1
 	ctx = p15card->card->ctx;
 	LOG_FUNC_CALLED(ctx);
 
+	for (entry = p15card->cert_cache; entry != NULL; entry = entry->next) {
+		if (entry->info == info) {
+			entry->cert->refs++;
+			*cert_out = entry->cert;
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+	}
+	bound = cert_info_is_bound(p15card, info);
+
+	memset(&der, 0, sizeof(der));
 	if (info->value.len && info->value.value)   {
-		sc_der_copy(&der, &info->value);
+		/* parse_x509_cert() copies the direct value */
+		der = info->value;
 	}
 	else if (info->path.len) {
-		r = sc_pkcs15_read_file(p15card, &info->path, &der.value, &der.len);
+		/* the certificate keeps sharing the bytes of the cached file */
+		r = sc_pkcs15_read_file_ref(p15card, &info->path, &ref, &der.len, SC_PKCS15_READ_DER);
 		LOG_TEST_RET(ctx, r, "Unable to read certificate file.");
+		der.value = (u8 *)ref;
 	}
 	else   {
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OBJECT_NOT_FOUND);
@@ -390,16 +463,213 @@ sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs1
 
 	cert = malloc(sizeof(struct sc_pkcs15_cert));
 	if (cert == NULL) {
-		free(der.value);
+		sc_pkcs15_file_unref(ref);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 	}
 	memset(cert, 0, sizeof(struct sc_pkcs15_cert));
-	if (parse_x509_cert(ctx, &der, cert)) {
-		free(der.value);
+	r = parse_x509_cert(ctx, &der, cert, ref != NULL);
+	sc_pkcs15_file_unref(ref);
+	if (r) {
 		sc_pkcs15_free_certificate(cert);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ASN1_OBJECT);
 	}
-	free(der.value);
+
+	/* without memory for the entry the caller just gets its own copy */
+	entry = bound ? calloc(1, sizeof *entry) : NULL;
+	if (entry != NULL) {
+		entry->info = info;
+		entry->cert = cert;
+		entry->next = p15card->cert_cache;
+		p15card->cert_cache = entry;
+		cert->refs = 2;
+	}
+
+	*cert_out = cert;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
+/*
+ * The parts of a certificate the emulators derive their key objects from
+ * are kept in an entry of the file cache, named after the hash of the
+ * certificate: a version byte, then the SPKI, the subject and the
+ * extensions, each with a four byte length.
+ */
+#define CERT_KEY_ENTRY_VERSION	1
+#define CERT_KEY_ENTRY_FIELDS	3
+
+static int
+cert_key_entry_name(struct sc_context *ctx, const struct sc_pkcs15_der *der,
+		char *name, size_t name_len)
+{
+#ifdef ENABLE_OPENSSL
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len = 0, i;
+	const EVP_MD *sha256 = sc_evp_md(ctx, "SHA256");
+
+	if (sha256 == NULL || !EVP_Digest(der->value, der->len, md, &md_len, sha256, NULL))
+		return SC_ERROR_NOT_SUPPORTED;
+	if (name_len < sizeof("cert-") + 2 * md_len)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	snprintf(name, name_len, "cert-");
+	for (i = 0; i < md_len; i++)
+		snprintf(name + 5 + 2 * i, name_len - 5 - 2 * i, "%02x", md[i]);
+	return SC_SUCCESS;
+#else
+	return SC_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+static int
+cert_key_entry_decode(struct sc_context *ctx, const u8 *buf, size_t len,
+		struct sc_pkcs15_cert *cert)
+{
+	const u8 *field[CERT_KEY_ENTRY_FIELDS];
+	size_t field_len[CERT_KEY_ENTRY_FIELDS], i;
+
+	if (len < 1 || buf[0] != CERT_KEY_ENTRY_VERSION)
+		return SC_ERROR_INVALID_DATA;
+	buf++;
+	len--;
+	for (i = 0; i < CERT_KEY_ENTRY_FIELDS; i++) {
+		if (len < 4)
+			return SC_ERROR_INVALID_DATA;
+		field_len[i] = bebytes2ulong(buf);
+		if (field_len[i] > len - 4)
+			return SC_ERROR_INVALID_DATA;
+		field[i] = buf + 4;
+		buf += 4 + field_len[i];
+		len -= 4 + field_len[i];
+	}
+	if (len != 0 || field_len[0] == 0)
+		return SC_ERROR_INVALID_DATA;
+
+	if (sc_pkcs15_pubkey_from_spki_sequence(ctx, field[0], field_len[0], &cert->key) != SC_SUCCESS)
+		return SC_ERROR_INVALID_DATA;
+	if (field_len[1]) {
+		cert->subject = malloc(field_len[1]);
+		if (cert->subject == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		memcpy(cert->subject, field[1], field_len[1]);
+		cert->subject_len = field_len[1];
+	}
+	if (field_len[2]) {
+		cert->extensions = malloc(field_len[2]);
+		if (cert->extensions == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		memcpy(cert->extensions, field[2], field_len[2]);
+		cert->extensions_len = field_len[2];
+	}
+	return SC_SUCCESS;
+}
+
+static void
+cert_key_entry_store(struct sc_pkcs15_card *p15card, const char *name,
+		const struct sc_pkcs15_cert *cert)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	const u8 *field[CERT_KEY_ENTRY_FIELDS];
+	size_t field_len[CERT_KEY_ENTRY_FIELDS], len = 1, i;
+	u8 *spki = NULL, *buf, *p;
+
+	if (sc_pkcs15_encode_pubkey_as_spki(ctx, cert->key, &spki, &field_len[0]) != SC_SUCCESS)
+		return;
+	field[0] = spki;
+	field[1] = cert->subject;
+	field_len[1] = cert->subject ? cert->subject_len : 0;
+	field[2] = cert->extensions;
+	field_len[2] = cert->extensions ? cert->extensions_len : 0;
+	for (i = 0; i < CERT_KEY_ENTRY_FIELDS; i++)
+		len += 4 + field_len[i];
+
+	buf = malloc(len);
+	if (buf != NULL) {
+		p = buf;
+		*p++ = CERT_KEY_ENTRY_VERSION;
+		for (i = 0; i < CERT_KEY_ENTRY_FIELDS; i++) {
+			ulong2bebytes(p, (unsigned long)field_len[i]);
+			if (field_len[i])
+				memcpy(p + 4, field[i], field_len[i]);
+			p += 4 + field_len[i];
+		}
+		if (sc_pkcs15_cache_entry(p15card, name, buf, len) != SC_SUCCESS)
+			sc_log(ctx, "failed to cache the key of the certificate");
+		free(buf);
+	}
+	free(spki);
+}
+
+int
+sc_pkcs15_read_certificate_key(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_cert_info *info,
+		struct sc_pkcs15_cert **cert_out)
+{
+	struct sc_context *ctx = NULL;
+	struct sc_pkcs15_cert *cert = NULL;
+	struct sc_pkcs15_der der;
+	char name[96];
+	u8 *entry = NULL;
+	size_t entry_len = 0;
+	const u8 *ref = NULL;
+	int r;
+
+	if (p15card == NULL || info == NULL || cert_out == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	ctx = p15card->card->ctx;
+	LOG_FUNC_CALLED(ctx);
+
+	/* bound certificates are parsed once anyway */
+	if (!p15card->opts.use_file_cache || cert_info_is_bound(p15card, info)) {
+		r = sc_pkcs15_read_certificate(p15card, info, cert_out);
+		LOG_FUNC_RETURN(ctx, r);
+	}
+
+	memset(&der, 0, sizeof(der));
+	if (info->value.len && info->value.value) {
+		der = info->value;
+	}
+	else if (info->path.len) {
+		r = sc_pkcs15_read_file_ref(p15card, &info->path, &ref, &der.len, SC_PKCS15_READ_DER);
+		LOG_TEST_RET(ctx, r, "Unable to read certificate file.");
+		der.value = (u8 *)ref;
+	}
+	else {
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OBJECT_NOT_FOUND);
+	}
+
+	cert = calloc(1, sizeof(struct sc_pkcs15_cert));
+	if (cert == NULL) {
+		sc_pkcs15_file_unref(ref);
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	}
+
+	r = cert_key_entry_name(ctx, &der, name, sizeof(name));
+	if (r == SC_SUCCESS && sc_pkcs15_read_cached_entry(p15card, name, &entry, &entry_len) == SC_SUCCESS) {
+		r = cert_key_entry_decode(ctx, entry, entry_len, cert);
+		free(entry);
+		if (r == SC_SUCCESS) {
+			sc_log(ctx, "key of the certificate taken from cache entry %s", name);
+			sc_pkcs15_file_unref(ref);
+			*cert_out = cert;
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+		/* stale or broken entry, it is replaced below */
+		sc_log(ctx, "ignoring cache entry %s: %s", name, sc_strerror(r));
+		sc_pkcs15_free_pubkey(cert->key);
+		free(cert->subject);
+		free(cert->extensions);
+		memset(cert, 0, sizeof(struct sc_pkcs15_cert));
+		r = SC_SUCCESS;
+	}
+
+	if (parse_x509_cert(ctx, &der, cert, ref != NULL) != SC_SUCCESS) {
+		sc_pkcs15_file_unref(ref);
+		sc_pkcs15_free_certificate(cert);
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ASN1_OBJECT);
+	}
+	sc_pkcs15_file_unref(ref);
+
+	if (r == SC_SUCCESS)
+		cert_key_entry_store(p15card, name, cert);
 
 	*cert_out = cert;
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
@@ -453,7 +723,7 @@ sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obje
 	u8 id_value[128];
 	int id_type;
 	size_t id_value_len = sizeof(id_value);
-	int r;
+	int r, der_owned = 1;
 
 	sc_copy_asn1_entry(c_asn1_cred_ident, asn1_cred_ident);
 	sc_copy_asn1_entry(c_asn1_com_cert_attr, asn1_com_cert_attr);
@@ -472,14 +742,18 @@ sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obje
 	sc_format_asn1_entry(asn1_x509_cert_value_choice + 1, &der->value, &der->len, 0);
 	sc_format_asn1_entry(asn1_type_cert_attr + 0, asn1_x509_cert_attr, NULL, 0);
 	sc_format_asn1_entry(asn1_cert + 0, &cert_obj, NULL, 0);
+	if (obj->df_data)
+		asn1_x509_cert_value_choice[1].flags |= SC_ASN1_REF;
 
 	/* Fill in defaults */
 	memset(&info, 0, sizeof(info));
 	info.authority = 0;
 
 	r = sc_asn1_decode(ctx, asn1_cert, *buf, *buflen, buf, buflen);
+	if (sc_pkcs15_object_refs_df(obj, der->value))
+		der_owned = 0;
 	/* In case of error, trash the cert value (direct coding) */
-	if (r < 0 && der->value)
+	if (r < 0 && der->value && der_owned)
 		free(der->value);
 	if (r == SC_ERROR_ASN1_END_OF_CONTENTS)
 		return r;
@@ -487,7 +761,8 @@ sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obje
 
 	if (!p15card->app || !p15card->app->ddo.aid.len) {
 		if (!p15card->file_app) {
-			free(der->value);
+			if (der_owned)
+				free(der->value);
 			return SC_ERROR_INTERNAL;
 		}
 		r = sc_pkcs15_make_absolute_path(&p15card->file_app->path, &info.path);
@@ -505,7 +780,8 @@ sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obje
 			break;
 		case SC_PKCS15_CARD_OPTS_PRIV_CERT_IGNORE:
 			sc_log(ctx, "Ignoring certificate");
-			free(der->value);
+			if (der_owned)
+				free(der->value);
 			return 0;
 	}
 
@@ -645,12 +921,16 @@ sc_pkcs15_free_certificate(struct sc_pkcs15_cert *cert)
 	if (cert == NULL) {
 		return;
 	}
+	if (cert->refs > 1) {
+		cert->refs--;
+		return;
+	}
 
 	sc_pkcs15_free_pubkey(cert->key);
 	free(cert->subject);
 	free(cert->issuer);
 	free(cert->serial);
-	free(cert->data.value);
+	sc_pkcs15_der_clear(&cert->data);
 	free(cert->extensions);
 	free(cert);
 }
@@ -26,6 +26,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS15
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -430,7 +432,7 @@ coolkey_get_public_key_from_certificate(sc_pkcs15_card_t *p15card, sc_cardctl_co
 	if (r < 0) {
 		goto fail;
 	}
-	r = sc_pkcs15_read_certificate(p15card, &cert_info, &cert_out);
+	r = sc_pkcs15_read_certificate_key(p15card, &cert_info, &cert_out);
 	if (r < 0) {
 		goto fail;
 	}
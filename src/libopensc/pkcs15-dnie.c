@@ -19,6 +19,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS15
+
 #include <stdlib.h>
 #include <string.h>
 #if HAVE_CONFIG_H
@@ -206,6 +208,7 @@ static int sc_pkcs15emu_dnie_init(sc_pkcs15_card_t * p15card)
 
 	/* Decode EF.PrKDF, EF.PuKDF and EF.CDF */
 	for (df = p15card->df_list; df != NULL; df = df->next) {
+		sc_pkcs15_set_file_immutable(p15card, &df->path);
 		if (df->type == SC_PKCS15_PRKDF) {
 			rv = sc_pkcs15_parse_df(p15card, df);
 			if (rv != SC_SUCCESS) {
@@ -257,6 +260,8 @@ static int sc_pkcs15emu_dnie_init(sc_pkcs15_card_t * p15card)
 		if ( p15_obj->df && (p15_obj->df->type == SC_PKCS15_CDF) ) {
                     p15_info = (struct sc_pkcs15_cert_info *) p15_obj ->data;
 		    p15_info ->path.count = -1;
+		    if (!(p15_obj->flags & SC_PKCS15_CO_FLAG_PRIVATE))
+			sc_pkcs15_set_file_immutable(p15card, &p15_info->path);
 		}
 		/* Remove found public keys as cannot be read_binary()'d */
 		if ( p15_obj->df && (p15_obj->df->type == SC_PKCS15_PUKDF) ) {
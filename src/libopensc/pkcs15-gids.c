@@ -19,6 +19,8 @@
  */
 
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS15
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
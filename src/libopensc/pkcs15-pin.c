@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS15
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -314,6 +316,7 @@ sc_pkcs15_verify_pin(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *pi
 	 * is still open on card.
 	 */
 	if (pinlen == 0) {
+	    auth_info->status_time = 0;
 	    r = sc_pkcs15_get_pin_info(p15card, pin_obj);
 
 	    if (r == SC_SUCCESS && auth_info->logged_in == SC_PIN_STATE_LOGGED_IN)
@@ -694,6 +697,16 @@ int sc_pkcs15_get_pin_info(struct sc_pkcs15_card *p15card,
 
 	LOG_FUNC_CALLED(ctx);
 
+	/* Answer from the last query unless the security status may have
+	 * changed since: other applications are only covered by the time */
+	if (p15card->opts.pin_status_cache_time > 0 && pin_info->status_time
+			&& pin_info->status_events == card->pin_events
+			&& sc_stats_now() - pin_info->status_time
+				< (unsigned long long)p15card->opts.pin_status_cache_time * 1000) {
+		sc_log(ctx, "PIN status from cache");
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
 	r = sc_lock(card);
 	if (r != SC_SUCCESS)
 		return r;
@@ -716,6 +729,9 @@ int sc_pkcs15_get_pin_info(struct sc_pkcs15_card *p15card,
 		/* tries_left must be supported or sc_pin_cmd should not return SC_SUCCESS */
 		pin_info->tries_left = data.pin1.tries_left;
 		pin_info->logged_in = data.pin1.logged_in;
+		/* the lock may have noticed a reset, take the counter after it */
+		pin_info->status_time = sc_stats_now();
+		pin_info->status_events = card->pin_events;
 	}
 
 out:
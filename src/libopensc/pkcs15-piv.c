@@ -24,6 +24,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS15
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -241,144 +243,110 @@ static int piv_detect_card(sc_pkcs15_card_t *p15card)
 }
 
 
-static int sc_pkcs15emu_piv_init(sc_pkcs15_card_t *p15card)
+/* 
+ * NIST 800-73-1 lifted the restriction on 
+ * requiring pin protected certs. Thus the default is to
+ * not require this.
+ */
+/* certs will be pulled out from the cert objects */
+/* the number of cert, pubkey and prkey triplets */
+
+#define PIV_NUM_CERTS_AND_KEYS 24
+
+static const cdata certs[PIV_NUM_CERTS_AND_KEYS] = {
+	{"01", "Certificate for PIV Authentication", "0101cece", 0, 0},
+	{"02", "Certificate for Digital Signature", "0100cece", 0, 0},
+	{"03", "Certificate for Key Management", "0102cece", 0, 0},
+	{"04", "Certificate for Card Authentication", "0500cece", 0, 0},
+	{"05", "Retired Certificate for Key Management 1", "1001cece", 0, 0},
+	{"06", "Retired Certificate for Key Management 2", "1002cece", 0, 0},
+	{"07", "Retired Certificate for Key Management 3", "1003cece", 0, 0},
+	{"08", "Retired Certificate for Key Management 4", "1004cece", 0, 0},
+	{"09", "Retired Certificate for Key Management 5", "1005cece", 0, 0},
+	{"10", "Retired Certificate for Key Management 6", "1006cece", 0, 0},
+	{"11", "Retired Certificate for Key Management 7", "1007cece", 0, 0},
+	{"12", "Retired Certificate for Key Management 8", "1008cece", 0, 0},
+	{"13", "Retired Certificate for Key Management 9", "1009cece", 0, 0},
+	{"14", "Retired Certificate for Key Management 10", "100Acece", 0, 0},
+	{"15", "Retired Certificate for Key Management 11", "100Bcece", 0, 0},
+	{"16", "Retired Certificate for Key Management 12", "100Ccece", 0, 0},
+	{"17", "Retired Certificate for Key Management 13", "100Dcece", 0, 0},
+	{"18", "Retired Certificate for Key Management 14", "100Ecece", 0, 0},
+	{"19", "Retired Certificate for Key Management 15", "100Fcece", 0, 0},
+	{"20", "Retired Certificate for Key Management 16", "1010cece", 0, 0},
+	{"21", "Retired Certificate for Key Management 17", "1011cece", 0, 0},
+	{"22", "Retired Certificate for Key Management 18", "1012cece", 0, 0},
+	{"23", "Retired Certificate for Key Management 19", "1013cece", 0, 0},
+	{"24", "Retired Certificate for Key Management 20", "1014cece", 0, 0}
+};
+
+/*
+ * Set the token name to the name of the CN of the first certificate.
+ * Only the certificates up to the first usable one are read here, all
+ * others are left to piv_add_keys().
+ */
+static int piv_set_token_name(sc_pkcs15_card_t *p15card)
 {
+	sc_card_t *card = p15card->card;
+	int r, i;
 
-	/* The cert objects will return all the data */
-	/* Note: pkcs11 objects do not have CK_ID values */
+	for (i = 0; i < PIV_NUM_CERTS_AND_KEYS; i++) {
+		struct sc_pkcs15_cert_info cert_info;
+		sc_pkcs15_der_t   cert_der;
+		sc_pkcs15_cert_t *cert_out = NULL;
+		u8 * cn_name = NULL;
+		size_t cn_len = 0;
+		char *token_name;
+		static const struct sc_object_id cn_oid = {{ 2, 5, 4, 3, -1 }};
 
-	static const objdata objects[] = {
-	{"01", "Card Capability Container", 
-			"2.16.840.1.101.3.7.1.219.0", NULL, "DB00", 0},
-	{"02", "Card Holder Unique Identifier",
-			"2.16.840.1.101.3.7.2.48.0", NULL, "3000", 0},
-	{"03", "Unsigned Card Holder Unique Identifier",
-			"2.16.840.1.101.3.7.2.48.2", NULL, "3010", 0},
-	{"04", "X.509 Certificate for PIV Authentication",
-			"2.16.840.1.101.3.7.2.1.1", NULL, "0101", 0},
-	{"05", "Cardholder Fingerprints",
-			"2.16.840.1.101.3.7.2.96.16", "01", "6010", SC_PKCS15_CO_FLAG_PRIVATE},
-	{"06", "Printed Information",
-			"2.16.840.1.101.3.7.2.48.1", "01", "3001", SC_PKCS15_CO_FLAG_PRIVATE},
-	{"07", "Cardholder Facial Image", 
-			"2.16.840.1.101.3.7.2.96.48", "01", "6030", SC_PKCS15_CO_FLAG_PRIVATE},
-	{"08", "X.509 Certificate for Digital Signature",
-			"2.16.840.1.101.3.7.2.1.0",  NULL, "0100", 0},
-	{"09", "X.509 Certificate for Key Management", 
-			"2.16.840.1.101.3.7.2.1.2", NULL, "0102", 0},
-	{"10","X.509 Certificate for Card Authentication",
-			"2.16.840.1.101.3.7.2.5.0", NULL, "0500", 0},
-	{"11", "Security Object",
-			"2.16.840.1.101.3.7.2.144.0", NULL, "9000", 0},
-	{"12", "Discovery Object",
-			"2.16.840.1.101.3.7.2.96.80", NULL, "6050", 0},
-	{"13", "Key History Object",
-			"2.16.840.1.101.3.7.2.96.96", NULL, "6060", 0},
-	{"14", "Cardholder Iris Image",
-			"2.16.840.1.101.3.7.2.16.21", NULL, "1015", SC_PKCS15_CO_FLAG_PRIVATE},
+		memset(&cert_info, 0, sizeof(cert_info));
+		sc_format_path(certs[i].path, &cert_info.path);
 
-	{"15", "Retired X.509 Certificate for Key Management 1", 
-			"2.16.840.1.101.3.7.2.16.1", NULL, "1001", 0},
-	{"16", "Retired X.509 Certificate for Key Management 2", 
-			"2.16.840.1.101.3.7.2.16.2", NULL, "1002", 0},
-	{"17", "Retired X.509 Certificate for Key Management 3", 
-			"2.16.840.1.101.3.7.2.16.3", NULL, "1003", 0},
-	{"18", "Retired X.509 Certificate for Key Management 4", 
-			"2.16.840.1.101.3.7.2.16.4", NULL, "1004", 0},
-	{"19", "Retired X.509 Certificate for Key Management 5", 
-			"2.16.840.1.101.3.7.2.16.5", NULL, "1005", 0},
-	{"20", "Retired X.509 Certificate for Key Management 6", 
-			"2.16.840.1.101.3.7.2.16.6", NULL, "1006", 0},
-	{"21", "Retired X.509 Certificate for Key Management 7", 
-			"2.16.840.1.101.3.7.2.16.7", NULL, "1007", 0},
-	{"22", "Retired X.509 Certificate for Key Management 8", 
-			"2.16.840.1.101.3.7.2.16.8", NULL, "1008", 0},
-	{"23", "Retired X.509 Certificate for Key Management 9", 
-			"2.16.840.1.101.3.7.2.16.9", NULL, "1009", 0},
-	{"24", "Retired X.509 Certificate for Key Management 10", 
-			"2.16.840.1.101.3.7.2.16.10", NULL, "100A", 0},
-	{"25", "Retired X.509 Certificate for Key Management 11", 
-			"2.16.840.1.101.3.7.2.16.11", NULL, "100B", 0},
-	{"26", "Retired X.509 Certificate for Key Management 12", 
-			"2.16.840.1.101.3.7.2.16.12", NULL, "100C", 0},
-	{"27", "Retired X.509 Certificate for Key Management 13", 
-			"2.16.840.1.101.3.7.2.16.13", NULL, "100D", 0},
-	{"28", "Retired X.509 Certificate for Key Management 14", 
-			"2.16.840.1.101.3.7.2.16.14", NULL, "100E", 0},
-	{"29", "Retired X.509 Certificate for Key Management 15", 
-			"2.16.840.1.101.3.7.2.16.15", NULL, "100F", 0},
-	{"30", "Retired X.509 Certificate for Key Management 16", 
-			"2.16.840.1.101.3.7.2.16.16", NULL, "1010", 0},
-	{"31", "Retired X.509 Certificate for Key Management 17", 
-			"2.16.840.1.101.3.7.2.16.17", NULL, "1011", 0},
-	{"32", "Retired X.509 Certificate for Key Management 18", 
-			"2.16.840.1.101.3.7.2.16.18", NULL, "1012", 0},
-	{"33", "Retired X.509 Certificate for Key Management 19", 
-			"2.16.840.1.101.3.7.2.16.19", NULL, "1013", 0},
-	{"34", "Retired X.509 Certificate for Key Management 20", 
-			"2.16.840.1.101.3.7.2.16.20", NULL, "1014", 0},
-	{NULL, NULL, NULL, NULL, NULL, 0}
-};
-	/* 
-	 * NIST 800-73-1 lifted the restriction on 
-	 * requiring pin protected certs. Thus the default is to
-	 * not require this.
-	 */
-	/* certs will be pulled out from the cert objects */
-	/* the number of cert, pubkey and prkey triplets */
+		r = sc_card_ctl(card, SC_CARDCTL_PIV_OBJECT_PRESENT, &cert_info.path);
+		if (r == 1)
+			continue;
+		r = sc_pkcs15_read_file(p15card, &cert_info.path, &cert_der.value, &cert_der.len);
+		if (r)
+			continue;
 
-#define PIV_NUM_CERTS_AND_KEYS 24
+		cert_info.value.value = cert_der.value;
+		cert_info.value.len = cert_der.len;
+		cert_info.path.len = 0;
+		r = sc_pkcs15_read_certificate_key(p15card, &cert_info, &cert_out);
+		free(cert_der.value);
+		if (r < 0)
+			continue;
 
-	static const cdata certs[PIV_NUM_CERTS_AND_KEYS] = {
-		{"01", "Certificate for PIV Authentication", "0101cece", 0, 0},
-		{"02", "Certificate for Digital Signature", "0100cece", 0, 0},
-		{"03", "Certificate for Key Management", "0102cece", 0, 0},
-		{"04", "Certificate for Card Authentication", "0500cece", 0, 0},
-		{"05", "Retired Certificate for Key Management 1", "1001cece", 0, 0},
-		{"06", "Retired Certificate for Key Management 2", "1002cece", 0, 0},
-		{"07", "Retired Certificate for Key Management 3", "1003cece", 0, 0},
-		{"08", "Retired Certificate for Key Management 4", "1004cece", 0, 0},
-		{"09", "Retired Certificate for Key Management 5", "1005cece", 0, 0},
-		{"10", "Retired Certificate for Key Management 6", "1006cece", 0, 0},
-		{"11", "Retired Certificate for Key Management 7", "1007cece", 0, 0},
-		{"12", "Retired Certificate for Key Management 8", "1008cece", 0, 0},
-		{"13", "Retired Certificate for Key Management 9", "1009cece", 0, 0},
-		{"14", "Retired Certificate for Key Management 10", "100Acece", 0, 0},
-		{"15", "Retired Certificate for Key Management 11", "100Bcece", 0, 0},
-		{"16", "Retired Certificate for Key Management 12", "100Ccece", 0, 0},
-		{"17", "Retired Certificate for Key Management 13", "100Dcece", 0, 0},
-		{"18", "Retired Certificate for Key Management 14", "100Ecece", 0, 0},
-		{"19", "Retired Certificate for Key Management 15", "100Fcece", 0, 0},
-		{"20", "Retired Certificate for Key Management 16", "1010cece", 0, 0},
-		{"21", "Retired Certificate for Key Management 17", "1011cece", 0, 0},
-		{"22", "Retired Certificate for Key Management 18", "1012cece", 0, 0},
-		{"23", "Retired Certificate for Key Management 19", "1013cece", 0, 0},
-		{"24", "Retired Certificate for Key Management 20", "1014cece", 0, 0}
-	};
+		r = sc_pkcs15_get_name_from_dn(card->ctx, cert_out->subject,
+			cert_out->subject_len, &cn_oid, &cn_name, &cn_len);
+		sc_pkcs15_free_certificate(cert_out);
+		if (r != SC_SUCCESS)
+			continue;
 
-	static const pindata pins[] = {
-		{ "01", "PIN", "", 0x80,
-		  /* label, flag  and ref will change if using global pin */
-		  SC_PKCS15_PIN_TYPE_ASCII_NUMERIC,
-		  8, 4, 8, 
-		  SC_PKCS15_PIN_FLAG_NEEDS_PADDING |
-		  SC_PKCS15_PIN_FLAG_INITIALIZED |
-		  SC_PKCS15_PIN_FLAG_LOCAL, 
-		  -1, 0xFF,
-		  SC_PKCS15_CO_FLAG_PRIVATE },
-		{ "02", "PIV PUK", "", 0x81, 
-		  SC_PKCS15_PIN_TYPE_ASCII_NUMERIC,
-		  8, 4, 8, 
-		  SC_PKCS15_PIN_FLAG_NEEDS_PADDING |
-		  SC_PKCS15_PIN_FLAG_INITIALIZED |
-		  SC_PKCS15_PIN_FLAG_LOCAL | SC_PKCS15_PIN_FLAG_SO_PIN |
-		  SC_PKCS15_PIN_FLAG_UNBLOCKING_PIN, 
-		  -1, 0xFF, 
-		  SC_PKCS15_CO_FLAG_PRIVATE },
-		{ NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0}
-	};
+		token_name = malloc (cn_len+1);
+		if (!token_name) {
+			free(cn_name);
+			LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+		}
+		memcpy(token_name, cn_name, cn_len);
+		free(cn_name);
+		token_name[cn_len] = 0;
+		free(p15card->tokeninfo->label);
+		p15card->tokeninfo->label = token_name;
+		break;
+	}
 
+	return SC_SUCCESS;
+}
 
+/*
+ * Reads the certificates and creates the certificate, public and private
+ * key objects. This is deferred until one of these object types is first
+ * searched for, see piv_parse_df(), as it means reading and decompressing
+ * up to 24 certificates.
+ */
+static int piv_add_keys(sc_pkcs15_card_t *p15card)
+{
 	/*
 	 * The size of the key or the algid is not really known
 	 * but can be derived from the certificates. 
@@ -608,90 +576,11 @@ static int sc_pkcs15emu_piv_init(sc_pkcs15_card_t *p15card)
 	int    r, i;
 	sc_card_t *card = p15card->card;
 	sc_serial_number_t serial;
-	char buf[SC_MAX_SERIALNR * 2 + 1];
 	common_key_info ckis[PIV_NUM_CERTS_AND_KEYS];
 	int follows_nist_fascn = 0;
-	char *token_name = NULL;
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
-	memset(&serial, 0, sizeof(serial));
-
-	/* could read this off card if needed */
-
-	/* CSP does not like a - in the name */
-	set_string(&p15card->tokeninfo->label, "PIV_II");
-	set_string(&p15card->tokeninfo->manufacturer_id, MANU_ID);
-
-	/*
-	 * get serial number 
-	 * We will use the FASC-N from the CHUID
-	 * Note we are not verifying CHUID, belongs to this card
-	 * but need serial number for Mac tokend 
-	 */
-
-	r = sc_card_ctl(card, SC_CARDCTL_GET_SERIALNR, &serial);
-	if (r < 0) {
-		sc_log(card->ctx, "sc_card_ctl rc=%d",r);
-		set_string(&p15card->tokeninfo->serial_number, "00000000");
-	} else {
-		sc_bin_to_hex(serial.value, serial.len, buf, sizeof(buf), 0);
-		set_string(&p15card->tokeninfo->serial_number, buf);
-	}
-	/* US gov issued PIVs have CHUID with a FASCN that does not start with 9999 */
-	if (serial.len == 25 && !(serial.value[0] == 0xD4 && serial.value[1] == 0xE7 && serial.value[2] == 0x39 && (serial.value[3] | 0x7F) == 0xFF)) {
-	    follows_nist_fascn = 1;
-	}
-
-	sc_log(card->ctx,  "PIV-II adding objects...");
-
-	/* set other objects */
-	for (i = 0; objects[i].label; i++) {
-		struct sc_pkcs15_data_info obj_info;
-		struct sc_pkcs15_object    obj_obj;
-
-		memset(&obj_info, 0, sizeof(obj_info));
-		memset(&obj_obj, 0, sizeof(obj_obj));
-		sc_pkcs15_format_id(objects[i].id, &obj_info.id);
-		sc_format_path(objects[i].path, &obj_info.path);
-
-		/* See if the object can not be present on the card */
-		r = sc_card_ctl(card, SC_CARDCTL_PIV_OBJECT_PRESENT, &obj_info.path);
-		if (r == 1)
-			continue; /* Not on card, do not define the object */
-			
-		strncpy(obj_info.app_label, objects[i].label, SC_PKCS15_MAX_LABEL_SIZE - 1);
-		r = sc_format_oid(&obj_info.app_oid, objects[i].aoid);
-		if (r != SC_SUCCESS)
-			return r;
-
-		if (objects[i].auth_id)
-			sc_pkcs15_format_id(objects[i].auth_id, &obj_obj.auth_id);
-
-		strncpy(obj_obj.label, objects[i].label, SC_PKCS15_MAX_LABEL_SIZE - 1);
-		obj_obj.flags = objects[i].obj_flags;
-		
-		r = sc_pkcs15emu_object_add(p15card, SC_PKCS15_TYPE_DATA_OBJECT, 
-			&obj_obj, &obj_info); 
-		if (r < 0)
-			LOG_FUNC_RETURN(card->ctx, r);
-/* TODO
- * PIV key 9C requires the pin verify be done just before any
- * crypto operation using the key. 
- * 
- * Nss 3.12.7 does not check the CKA_ALWAYS_AUTHENTICATE attribute of a key
- * and will do a C_FindObjects with only CKA_VALUE looking for a certificate
- * it had found earlier after c_Login. The template does not add CKA_TYPE=cert.
- * This will cause the card-piv to read all the objects and will reset
- * the security status for the 9C key.
- * Mozilla Bug 357025 
- * Mozilla Bug 613507
- * on 5/16/2012, both scheduled for NSS 3.14 
- * 
- * We can not read all the objects, as some need the PIN!
- */  
-	}
-
 	/*
 	 * certs, pubkeys and priv keys are related and we assume
 	 * they are in order 
@@ -702,6 +591,13 @@ static int sc_pkcs15emu_piv_init(sc_pkcs15_card_t *p15card)
 	 * If no cert and no pubkey, skip adding them. 
  
 	 */
+	/* US gov issued PIVs have CHUID with a FASCN that does not start with 9999 */
+	memset(&serial, 0, sizeof(serial));
+	r = sc_card_ctl(card, SC_CARDCTL_GET_SERIALNR, &serial);
+	if (r >= 0 && serial.len == 25 && !(serial.value[0] == 0xD4 && serial.value[1] == 0xE7 && serial.value[2] == 0x39 && (serial.value[3] | 0x7F) == 0xFF)) {
+	    follows_nist_fascn = 1;
+	}
+
 	/* set certs */
 	sc_log(card->ctx,  "PIV-II adding certs...");
 	for (i = 0; i < PIV_NUM_CERTS_AND_KEYS; i++) {
@@ -756,7 +652,7 @@ static int sc_pkcs15emu_piv_init(sc_pkcs15_card_t *p15card)
 			}
 		}
 		/* following will find the cached cert in cert_info */
-		r =  sc_pkcs15_read_certificate(p15card, &cert_info, &cert_out);
+		r =  sc_pkcs15_read_certificate_key(p15card, &cert_info, &cert_out);
 		if (r < 0 || cert_out->key == NULL) {
 			sc_log(card->ctx,  "Failed to read/parse the certificate r=%d",r);
 			if (cert_out != NULL)
@@ -765,29 +661,6 @@ static int sc_pkcs15emu_piv_init(sc_pkcs15_card_t *p15card)
 			continue;
 		}
 
-		/* set the token name to the name of the CN of the first certificate */
-		if (!token_name) {
-			u8 * cn_name = NULL;
-			size_t cn_len = 0;
-			static const struct sc_object_id cn_oid = {{ 2, 5, 4, 3, -1 }};
-			r = sc_pkcs15_get_name_from_dn(card->ctx, cert_out->subject,
-				cert_out->subject_len, &cn_oid, &cn_name, &cn_len);
-			if (r == SC_SUCCESS) {
-				token_name = malloc (cn_len+1);
-				if (!token_name) {
-					sc_pkcs15_free_certificate(cert_out);
-					free(cn_name);
-					SC_FUNC_RETURN(card->ctx,
-						SC_ERROR_OUT_OF_MEMORY, r);
-				}
-				memcpy(token_name, cn_name, cn_len);
-				free(cn_name);
-				token_name[cn_len] = 0;
-				free(p15card->tokeninfo->label);
-				p15card->tokeninfo->label = token_name;
-			}
-		}
-
 		/* 
 		 * get keyUsage if present save in ckis[i]
 		 * Will only use it if this in a non FED issued card
@@ -922,70 +795,19 @@ static int sc_pkcs15emu_piv_init(sc_pkcs15_card_t *p15card)
 		}
 	}
 
-	/* set pins */
-	sc_log(card->ctx,  "PIV-II adding pins...");
-	for (i = 0; pins[i].label; i++) {
-		struct sc_pkcs15_auth_info pin_info;
-		struct sc_pkcs15_object   pin_obj;
-		const char * label;
-		int pin_ref;
+	/* set public keys */
+	/* We may only need this during initialization when genkey
+	 * gets the pubkey, but it can not be read from the card 
+	 * at a later time. The piv-tool can stash  pubkey in file
+	 */ 
+	sc_log(card->ctx,  "PIV-II adding pub keys...");
+	for (i = 0; i < PIV_NUM_CERTS_AND_KEYS; i++) {
+		struct sc_pkcs15_pubkey_info pubkey_info;
+		struct sc_pkcs15_object     pubkey_obj;
+		struct sc_pkcs15_pubkey *p15_key = NULL;
 
-		memset(&pin_info, 0, sizeof(pin_info));
-		memset(&pin_obj,  0, sizeof(pin_obj));
-
-		pin_info.auth_type = SC_PKCS15_PIN_AUTH_TYPE_PIN;
-		sc_pkcs15_format_id(pins[i].id, &pin_info.auth_id);
-		pin_info.attrs.pin.reference     = pins[i].ref;
-		pin_info.attrs.pin.flags         = pins[i].flags;
-		pin_info.attrs.pin.type          = pins[i].type;
-		pin_info.attrs.pin.min_length    = pins[i].minlen;
-		pin_info.attrs.pin.stored_length = pins[i].storedlen;
-		pin_info.attrs.pin.max_length    = pins[i].maxlen;
-		pin_info.attrs.pin.pad_char      = pins[i].pad_char;
-		sc_format_path(pins[i].path, &pin_info.path);
-		pin_info.tries_left    = -1;
-
-		label = pins[i].label;
-		if (i == 0 &&
-			sc_card_ctl(card, SC_CARDCTL_PIV_PIN_PREFERENCE,
-					&pin_ref) == 0 &&
-				pin_ref == 0x00) { /* must be 80 for PIV pin, or 00 for Global PIN */
-			pin_info.attrs.pin.reference = pin_ref;
-			pin_info.attrs.pin.flags &= ~SC_PKCS15_PIN_FLAG_LOCAL;
-			label = "Global PIN";
-		}
-sc_log(card->ctx,  "DEE Adding pin %d label=%s",i, label);
-		strncpy(pin_obj.label, label, SC_PKCS15_MAX_LABEL_SIZE - 1);
-		pin_obj.flags = pins[i].obj_flags;
-		if (i == 0 && pin_info.attrs.pin.reference == 0x80) {
-			/*
-			 * according to description of "RESET RETRY COUNTER"
-			 * command in specs PUK can only unblock PIV PIN
-			 */
-			pin_obj.auth_id.len = 1;
-			pin_obj.auth_id.value[0] = 2;
-		}
-
-		r = sc_pkcs15emu_add_pin_obj(p15card, &pin_obj, &pin_info);
-		if (r < 0)
-			LOG_FUNC_RETURN(card->ctx, r);
-	}
-
-
-
-	/* set public keys */
-	/* We may only need this during initialization when genkey
-	 * gets the pubkey, but it can not be read from the card 
-	 * at a later time. The piv-tool can stash  pubkey in file
-	 */ 
-	sc_log(card->ctx,  "PIV-II adding pub keys...");
-	for (i = 0; i < PIV_NUM_CERTS_AND_KEYS; i++) {
-		struct sc_pkcs15_pubkey_info pubkey_info;
-		struct sc_pkcs15_object     pubkey_obj;
-		struct sc_pkcs15_pubkey *p15_key = NULL;
-
-		memset(&pubkey_info, 0, sizeof(pubkey_info));
-		memset(&pubkey_obj,  0, sizeof(pubkey_obj));
+		memset(&pubkey_info, 0, sizeof(pubkey_info));
+		memset(&pubkey_obj,  0, sizeof(pubkey_obj));
 
 
 		sc_pkcs15_format_id(pubkeys[i].id, &pubkey_info.id);
@@ -1200,6 +1022,281 @@ sc_log(card->ctx,  "DEE Adding pin %d label=%s",i, label);
 			LOG_FUNC_RETURN(card->ctx, r);
 	}
 
+	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+}
+
+static int piv_parse_df(sc_pkcs15_card_t *p15card, sc_pkcs15_df_t *df)
+{
+	sc_pkcs15_df_t *d;
+
+	if (df->enumerated)
+		return SC_SUCCESS;
+	if (df->type != SC_PKCS15_PRKDF && df->type != SC_PKCS15_PUKDF
+			&& df->type != SC_PKCS15_CDF) {
+		df->enumerated = 1;
+		return SC_SUCCESS;
+	}
+
+	/* certificates, public and private keys are derived together */
+	for (d = p15card->df_list; d != NULL; d = d->next) {
+		if (d->type == SC_PKCS15_PRKDF || d->type == SC_PKCS15_PUKDF
+				|| d->type == SC_PKCS15_CDF)
+			d->enumerated = 1;
+	}
+
+	return piv_add_keys(p15card);
+}
+
+
+static int sc_pkcs15emu_piv_init(sc_pkcs15_card_t *p15card)
+{
+
+	/* The cert objects will return all the data */
+	/* Note: pkcs11 objects do not have CK_ID values */
+
+	static const objdata objects[] = {
+	{"01", "Card Capability Container", 
+			"2.16.840.1.101.3.7.1.219.0", NULL, "DB00", 0},
+	{"02", "Card Holder Unique Identifier",
+			"2.16.840.1.101.3.7.2.48.0", NULL, "3000", 0},
+	{"03", "Unsigned Card Holder Unique Identifier",
+			"2.16.840.1.101.3.7.2.48.2", NULL, "3010", 0},
+	{"04", "X.509 Certificate for PIV Authentication",
+			"2.16.840.1.101.3.7.2.1.1", NULL, "0101", 0},
+	{"05", "Cardholder Fingerprints",
+			"2.16.840.1.101.3.7.2.96.16", "01", "6010", SC_PKCS15_CO_FLAG_PRIVATE},
+	{"06", "Printed Information",
+			"2.16.840.1.101.3.7.2.48.1", "01", "3001", SC_PKCS15_CO_FLAG_PRIVATE},
+	{"07", "Cardholder Facial Image", 
+			"2.16.840.1.101.3.7.2.96.48", "01", "6030", SC_PKCS15_CO_FLAG_PRIVATE},
+	{"08", "X.509 Certificate for Digital Signature",
+			"2.16.840.1.101.3.7.2.1.0",  NULL, "0100", 0},
+	{"09", "X.509 Certificate for Key Management", 
+			"2.16.840.1.101.3.7.2.1.2", NULL, "0102", 0},
+	{"10","X.509 Certificate for Card Authentication",
+			"2.16.840.1.101.3.7.2.5.0", NULL, "0500", 0},
+	{"11", "Security Object",
+			"2.16.840.1.101.3.7.2.144.0", NULL, "9000", 0},
+	{"12", "Discovery Object",
+			"2.16.840.1.101.3.7.2.96.80", NULL, "6050", 0},
+	{"13", "Key History Object",
+			"2.16.840.1.101.3.7.2.96.96", NULL, "6060", 0},
+	{"14", "Cardholder Iris Image",
+			"2.16.840.1.101.3.7.2.16.21", NULL, "1015", SC_PKCS15_CO_FLAG_PRIVATE},
+
+	{"15", "Retired X.509 Certificate for Key Management 1", 
+			"2.16.840.1.101.3.7.2.16.1", NULL, "1001", 0},
+	{"16", "Retired X.509 Certificate for Key Management 2", 
+			"2.16.840.1.101.3.7.2.16.2", NULL, "1002", 0},
+	{"17", "Retired X.509 Certificate for Key Management 3", 
+			"2.16.840.1.101.3.7.2.16.3", NULL, "1003", 0},
+	{"18", "Retired X.509 Certificate for Key Management 4", 
+			"2.16.840.1.101.3.7.2.16.4", NULL, "1004", 0},
+	{"19", "Retired X.509 Certificate for Key Management 5", 
+			"2.16.840.1.101.3.7.2.16.5", NULL, "1005", 0},
+	{"20", "Retired X.509 Certificate for Key Management 6", 
+			"2.16.840.1.101.3.7.2.16.6", NULL, "1006", 0},
+	{"21", "Retired X.509 Certificate for Key Management 7", 
+			"2.16.840.1.101.3.7.2.16.7", NULL, "1007", 0},
+	{"22", "Retired X.509 Certificate for Key Management 8", 
+			"2.16.840.1.101.3.7.2.16.8", NULL, "1008", 0},
+	{"23", "Retired X.509 Certificate for Key Management 9", 
+			"2.16.840.1.101.3.7.2.16.9", NULL, "1009", 0},
+	{"24", "Retired X.509 Certificate for Key Management 10", 
+			"2.16.840.1.101.3.7.2.16.10", NULL, "100A", 0},
+	{"25", "Retired X.509 Certificate for Key Management 11", 
+			"2.16.840.1.101.3.7.2.16.11", NULL, "100B", 0},
+	{"26", "Retired X.509 Certificate for Key Management 12", 
+			"2.16.840.1.101.3.7.2.16.12", NULL, "100C", 0},
+	{"27", "Retired X.509 Certificate for Key Management 13", 
+			"2.16.840.1.101.3.7.2.16.13", NULL, "100D", 0},
+	{"28", "Retired X.509 Certificate for Key Management 14", 
+			"2.16.840.1.101.3.7.2.16.14", NULL, "100E", 0},
+	{"29", "Retired X.509 Certificate for Key Management 15", 
+			"2.16.840.1.101.3.7.2.16.15", NULL, "100F", 0},
+	{"30", "Retired X.509 Certificate for Key Management 16", 
+			"2.16.840.1.101.3.7.2.16.16", NULL, "1010", 0},
+	{"31", "Retired X.509 Certificate for Key Management 17", 
+			"2.16.840.1.101.3.7.2.16.17", NULL, "1011", 0},
+	{"32", "Retired X.509 Certificate for Key Management 18", 
+			"2.16.840.1.101.3.7.2.16.18", NULL, "1012", 0},
+	{"33", "Retired X.509 Certificate for Key Management 19", 
+			"2.16.840.1.101.3.7.2.16.19", NULL, "1013", 0},
+	{"34", "Retired X.509 Certificate for Key Management 20", 
+			"2.16.840.1.101.3.7.2.16.20", NULL, "1014", 0},
+	{NULL, NULL, NULL, NULL, NULL, 0}
+};
+
+	static const pindata pins[] = {
+		{ "01", "PIN", "", 0x80,
+		  /* label, flag  and ref will change if using global pin */
+		  SC_PKCS15_PIN_TYPE_ASCII_NUMERIC,
+		  8, 4, 8, 
+		  SC_PKCS15_PIN_FLAG_NEEDS_PADDING |
+		  SC_PKCS15_PIN_FLAG_INITIALIZED |
+		  SC_PKCS15_PIN_FLAG_LOCAL, 
+		  -1, 0xFF,
+		  SC_PKCS15_CO_FLAG_PRIVATE },
+		{ "02", "PIV PUK", "", 0x81, 
+		  SC_PKCS15_PIN_TYPE_ASCII_NUMERIC,
+		  8, 4, 8, 
+		  SC_PKCS15_PIN_FLAG_NEEDS_PADDING |
+		  SC_PKCS15_PIN_FLAG_INITIALIZED |
+		  SC_PKCS15_PIN_FLAG_LOCAL | SC_PKCS15_PIN_FLAG_SO_PIN |
+		  SC_PKCS15_PIN_FLAG_UNBLOCKING_PIN, 
+		  -1, 0xFF, 
+		  SC_PKCS15_CO_FLAG_PRIVATE },
+		{ NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0}
+	};
+
+
+	int    r, i;
+	sc_card_t *card = p15card->card;
+	sc_serial_number_t serial;
+	char buf[SC_MAX_SERIALNR * 2 + 1];
+	sc_path_t path;
+
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+
+	memset(&serial, 0, sizeof(serial));
+
+	/* could read this off card if needed */
+
+	/* CSP does not like a - in the name */
+	set_string(&p15card->tokeninfo->label, "PIV_II");
+	set_string(&p15card->tokeninfo->manufacturer_id, MANU_ID);
+
+	/*
+	 * get serial number 
+	 * We will use the FASC-N from the CHUID
+	 * Note we are not verifying CHUID, belongs to this card
+	 * but need serial number for Mac tokend 
+	 */
+
+	r = sc_card_ctl(card, SC_CARDCTL_GET_SERIALNR, &serial);
+	if (r < 0) {
+		sc_log(card->ctx, "sc_card_ctl rc=%d",r);
+		set_string(&p15card->tokeninfo->serial_number, "00000000");
+	} else {
+		sc_bin_to_hex(serial.value, serial.len, buf, sizeof(buf), 0);
+		set_string(&p15card->tokeninfo->serial_number, buf);
+	}
+	sc_log(card->ctx,  "PIV-II adding objects...");
+
+	/* set other objects */
+	for (i = 0; objects[i].label; i++) {
+		struct sc_pkcs15_data_info obj_info;
+		struct sc_pkcs15_object    obj_obj;
+
+		memset(&obj_info, 0, sizeof(obj_info));
+		memset(&obj_obj, 0, sizeof(obj_obj));
+		sc_pkcs15_format_id(objects[i].id, &obj_info.id);
+		sc_format_path(objects[i].path, &obj_info.path);
+
+		/* See if the object can not be present on the card */
+		r = sc_card_ctl(card, SC_CARDCTL_PIV_OBJECT_PRESENT, &obj_info.path);
+		if (r == 1)
+			continue; /* Not on card, do not define the object */
+			
+		strncpy(obj_info.app_label, objects[i].label, SC_PKCS15_MAX_LABEL_SIZE - 1);
+		r = sc_format_oid(&obj_info.app_oid, objects[i].aoid);
+		if (r != SC_SUCCESS)
+			return r;
+
+		if (objects[i].auth_id)
+			sc_pkcs15_format_id(objects[i].auth_id, &obj_obj.auth_id);
+
+		strncpy(obj_obj.label, objects[i].label, SC_PKCS15_MAX_LABEL_SIZE - 1);
+		obj_obj.flags = objects[i].obj_flags;
+		
+		r = sc_pkcs15emu_object_add(p15card, SC_PKCS15_TYPE_DATA_OBJECT, 
+			&obj_obj, &obj_info); 
+		if (r < 0)
+			LOG_FUNC_RETURN(card->ctx, r);
+/* TODO
+ * PIV key 9C requires the pin verify be done just before any
+ * crypto operation using the key. 
+ * 
+ * Nss 3.12.7 does not check the CKA_ALWAYS_AUTHENTICATE attribute of a key
+ * and will do a C_FindObjects with only CKA_VALUE looking for a certificate
+ * it had found earlier after c_Login. The template does not add CKA_TYPE=cert.
+ * This will cause the card-piv to read all the objects and will reset
+ * the security status for the 9C key.
+ * Mozilla Bug 357025 
+ * Mozilla Bug 613507
+ * on 5/16/2012, both scheduled for NSS 3.14 
+ * 
+ * We can not read all the objects, as some need the PIN!
+ */  
+	}
+
+	/* set pins */
+	sc_log(card->ctx,  "PIV-II adding pins...");
+	for (i = 0; pins[i].label; i++) {
+		struct sc_pkcs15_auth_info pin_info;
+		struct sc_pkcs15_object   pin_obj;
+		const char * label;
+		int pin_ref;
+
+		memset(&pin_info, 0, sizeof(pin_info));
+		memset(&pin_obj,  0, sizeof(pin_obj));
+
+		pin_info.auth_type = SC_PKCS15_PIN_AUTH_TYPE_PIN;
+		sc_pkcs15_format_id(pins[i].id, &pin_info.auth_id);
+		pin_info.attrs.pin.reference     = pins[i].ref;
+		pin_info.attrs.pin.flags         = pins[i].flags;
+		pin_info.attrs.pin.type          = pins[i].type;
+		pin_info.attrs.pin.min_length    = pins[i].minlen;
+		pin_info.attrs.pin.stored_length = pins[i].storedlen;
+		pin_info.attrs.pin.max_length    = pins[i].maxlen;
+		pin_info.attrs.pin.pad_char      = pins[i].pad_char;
+		sc_format_path(pins[i].path, &pin_info.path);
+		pin_info.tries_left    = -1;
+
+		label = pins[i].label;
+		if (i == 0 &&
+			sc_card_ctl(card, SC_CARDCTL_PIV_PIN_PREFERENCE,
+					&pin_ref) == 0 &&
+				pin_ref == 0x00) { /* must be 80 for PIV pin, or 00 for Global PIN */
+			pin_info.attrs.pin.reference = pin_ref;
+			pin_info.attrs.pin.flags &= ~SC_PKCS15_PIN_FLAG_LOCAL;
+			label = "Global PIN";
+		}
+sc_log(card->ctx,  "DEE Adding pin %d label=%s",i, label);
+		strncpy(pin_obj.label, label, SC_PKCS15_MAX_LABEL_SIZE - 1);
+		pin_obj.flags = pins[i].obj_flags;
+		if (i == 0 && pin_info.attrs.pin.reference == 0x80) {
+			/*
+			 * according to description of "RESET RETRY COUNTER"
+			 * command in specs PUK can only unblock PIV PIN
+			 */
+			pin_obj.auth_id.len = 1;
+			pin_obj.auth_id.value[0] = 2;
+		}
+
+		r = sc_pkcs15emu_add_pin_obj(p15card, &pin_obj, &pin_info);
+		if (r < 0)
+			LOG_FUNC_RETURN(card->ctx, r);
+	}
+
+
+
+	/* set the token name before the token is presented */
+	r = piv_set_token_name(p15card);
+	if (r < 0)
+		LOG_FUNC_RETURN(card->ctx, r);
+
+	/* certs, pubkeys and priv keys are added on first use */
+	sc_format_path("11001101", &path);
+	r = sc_pkcs15_add_df(p15card, SC_PKCS15_PRKDF, &path);
+	if (r >= 0)
+		r = sc_pkcs15_add_df(p15card, SC_PKCS15_PUKDF, &path);
+	if (r >= 0)
+		r = sc_pkcs15_add_df(p15card, SC_PKCS15_CDF, &path);
+	if (r < 0)
+		LOG_FUNC_RETURN(card->ctx, r);
+	p15card->ops.parse_df = piv_parse_df;
+
 	p15card->ops.get_guid = piv_get_guid;
 
 	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
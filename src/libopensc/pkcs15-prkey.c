@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS15
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -256,6 +258,8 @@ int sc_pkcs15_decode_prkdf_entry(struct sc_pkcs15_card *p15card,
 	sc_format_asn1_entry(asn1_com_key_attr + 5, asn1_supported_algorithms, NULL, 0);
 
 	sc_format_asn1_entry(asn1_com_prkey_attr + 0, &info.subject.value, &info.subject.len, 0);
+	if (obj->df_data)
+		asn1_com_prkey_attr[0].flags |= SC_ASN1_REF;
 
 	/* Fill in defaults */
 	memset(&info, 0, sizeof(info));
@@ -368,7 +372,8 @@ int sc_pkcs15_decode_prkdf_entry(struct sc_pkcs15_card *p15card,
 err:
 	if (r < 0) {
 		/* This might have allocated something. If so, clear it now */
-		free(info.subject.value);
+		if (!sc_pkcs15_object_refs_df(obj, info.subject.value))
+			free(info.subject.value);
 		sc_pkcs15_free_key_params(&info.params);
 	}
 
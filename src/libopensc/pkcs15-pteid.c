@@ -36,6 +36,8 @@
  *
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS15
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -199,6 +201,8 @@ static int sc_pkcs15emu_pteid_init(sc_pkcs15_card_t * p15card)
 
 	/* Decode EF.PrKDF, EF.PuKDF, EF.CDF and EF.AODF */
 	for (df = p15card->df_list; df != NULL; df = df->next) {
+		/* the card is read only, see tokeninfo flags */
+		sc_pkcs15_set_file_immutable(p15card, &df->path);
 		if (df->type == SC_PKCS15_PRKDF) {
 			rv = sc_pkcs15_parse_df(p15card, df);
 			if (rv != SC_SUCCESS) {
@@ -244,6 +248,13 @@ static int sc_pkcs15emu_pteid_init(sc_pkcs15_card_t * p15card)
 			p15_obj->flags = SC_PKCS15_CO_FLAG_PRIVATE;
 		}
 
+		if (p15_obj->df && p15_obj->df->type == SC_PKCS15_CDF
+				&& !(p15_obj->flags & SC_PKCS15_CO_FLAG_PRIVATE)) {
+			struct sc_pkcs15_cert_info *cert_info = (sc_pkcs15_cert_info_t *) p15_obj->data;
+
+			sc_pkcs15_set_file_immutable(p15card, &cert_info->path);
+		}
+
 
 		if ( p15_obj->df && (p15_obj->df->type == SC_PKCS15_AODF) ) {
 			static const char *pteid_pin_names[3] = {
@@ -307,6 +318,8 @@ static int sc_pkcs15emu_pteid_init(sc_pkcs15_card_t * p15card)
 			0,
 			0,
 		};
+		/* written once when the card is issued */
+		static const int object_immutable[5] = {0, 1, 0, 1, 0};
 		struct sc_pkcs15_data_info obj_info;
 		struct sc_pkcs15_object obj_obj;
 
@@ -319,6 +332,8 @@ static int sc_pkcs15emu_pteid_init(sc_pkcs15_card_t * p15card)
 			sc_pkcs15_format_id(object_authids[i], &obj_obj.auth_id);
 		strlcpy(obj_obj.label, object_labels[i], SC_PKCS15_MAX_LABEL_SIZE);
 		obj_obj.flags = object_flags[i];
+		if (object_immutable[i])
+			sc_pkcs15_set_file_immutable(p15card, &obj_info.path);
 
 		rv = sc_pkcs15emu_object_add(p15card, SC_PKCS15_TYPE_DATA_OBJECT, &obj_obj, &obj_info);
 		if (rv != SC_SUCCESS){
@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS15
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -158,8 +160,6 @@ static const struct sc_asn1_entry c_asn1_pubkey[C_ASN1_PUBKEY_SIZE] = {
 		{ NULL, 0, 0, 0, NULL, NULL }
 };
 
-int sc_pkcs15_pubkey_from_spki_sequence(sc_context_t *ctx, const u8 *buf, size_t buflen, sc_pkcs15_pubkey_t ** outpubkey);
-
 int
 sc_pkcs15_decode_pubkey_direct_value(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj)
 {
@@ -302,6 +302,11 @@ int sc_pkcs15_decode_pukdf_entry(struct sc_pkcs15_card *p15card,
 	sc_format_asn1_entry(asn1_com_key_attr + 4, &info->key_reference, NULL, 0);
 
 	sc_format_asn1_entry(asn1_pubkey + 0, asn1_pubkey_choice, NULL, 0);
+	if (obj->df_data) {
+		asn1_com_pubkey_attr[0].flags |= SC_ASN1_REF;
+		asn1_rsakey_value_choice[1].flags |= SC_ASN1_REF;
+		asn1_eckey_value_choice[1].flags |= SC_ASN1_REF;
+	}
 
 	/* Fill in defaults */
 	info->key_reference = -1;
@@ -371,6 +376,8 @@ int sc_pkcs15_decode_pukdf_entry(struct sc_pkcs15_card *p15card,
 
 err:
 	if (r < 0) {
+		if (info && sc_pkcs15_object_refs_df(obj, info->subject.value))
+			info->subject.value = NULL;
 		sc_pkcs15_free_pubkey_info(info);
 	}
 
@@ -914,6 +921,7 @@ sc_pkcs15_read_pubkey(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_obj
 	const struct sc_pkcs15_pubkey_info *info = NULL;
 	struct sc_pkcs15_pubkey *pubkey = NULL;
 	unsigned char *data = NULL;
+	const u8 *ref = NULL;
 	size_t	len;
 	int	algorithm, r;
 
@@ -981,13 +989,14 @@ sc_pkcs15_read_pubkey(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_obj
 	}
 	else if (info->path.len)   {
 		sc_log(ctx, "Read from EF and decode");
-		r = sc_pkcs15_read_file(p15card, &info->path, &data, &len);
+		/* decoding copies the key, so the file can be shared */
+		r = sc_pkcs15_read_file_ref(p15card, &info->path, &ref, &len, 0);
 		LOG_TEST_GOTO_ERR(ctx, r, "Failed to read public key file.");
 
-		if (algorithm == SC_ALGORITHM_EC && *data == (SC_ASN1_TAG_SEQUENCE | SC_ASN1_TAG_CONSTRUCTED))
-			r = sc_pkcs15_pubkey_from_spki_sequence(ctx, data, len, &pubkey);
+		if (algorithm == SC_ALGORITHM_EC && len && *ref == (SC_ASN1_TAG_SEQUENCE | SC_ASN1_TAG_CONSTRUCTED))
+			r = sc_pkcs15_pubkey_from_spki_sequence(ctx, ref, len, &pubkey);
 		else
-			r = sc_pkcs15_decode_pubkey(ctx, pubkey, data, len);
+			r = sc_pkcs15_decode_pubkey(ctx, pubkey, ref, len);
 		LOG_TEST_GOTO_ERR(ctx, r, "Decode public key error");
 	}
 	else {
@@ -1001,6 +1010,7 @@ err:
 	} else
 		*out = pubkey;
 	free(data);
+	sc_pkcs15_file_unref(ref);
 
 	LOG_FUNC_RETURN(ctx, r);
 }
@@ -1332,7 +1342,7 @@ sc_pkcs15_pubkey_from_spki_fields(struct sc_context *ctx, struct sc_pkcs15_pubke
 {
 
 	struct sc_pkcs15_pubkey *pubkey = NULL;
-	struct sc_pkcs15_der pk = { NULL, 0 };
+	struct sc_pkcs15_der pk = { NULL, 0, 0 };
 	struct sc_algorithm_id pk_alg;
 	struct sc_asn1_entry asn1_pkinfo[C_ASN1_PKINFO_ATTR_SIZE];
 	unsigned char *tmp_buf = NULL;
@@ -1474,78 +1484,103 @@ sc_pkcs15_pubkey_from_spki_file(struct sc_context *ctx, char * filename,
 }
 
 
-static struct ec_curve_info {
+#define EC_DER(s)	(const u8 *)(s), sizeof(s) - 1
+
+/* One entry per curve, with the DER encoding of its OID precomputed, so
+ * that EC parameters are looked up without converting the table */
+static const struct ec_curve_info {
 	const char *name;
 	const char *oid_str;
-	const char *oid_encoded;
+	const u8 *der;
+	size_t der_len;
 	size_t size;
 } ec_curve_infos[] = {
-		{"secp192r1",		"1.2.840.10045.3.1.1", "06082A8648CE3D030101", 192},
-		{"prime192v1",		"1.2.840.10045.3.1.1", "06082A8648CE3D030101", 192},
-		{"nistp192",		"1.2.840.10045.3.1.1", "06082A8648CE3D030101", 192},
-		{"ansiX9p192r1",	"1.2.840.10045.3.1.1", "06082A8648CE3D030101", 192},
-
-		{"secp224r1",		"1.3.132.0.33", "06052b81040021", 224},
-		{"nistp224",		"1.3.132.0.33", "06052b81040021", 224},
-
-		{"secp256r1",		"1.2.840.10045.3.1.7", "06082A8648CE3D030107", 256},
-		{"prime256v1",		"1.2.840.10045.3.1.7", "06082A8648CE3D030107", 256},
-		{"nistp256",		"1.2.840.10045.3.1.7", "06082A8648CE3D030107", 256},
-		{"ansiX9p256r1",	"1.2.840.10045.3.1.7", "06082A8648CE3D030107", 256},
-
-		{"secp384r1",		"1.3.132.0.34", "06052B81040022", 384},
-		{"prime384v1",		"1.3.132.0.34", "06052B81040022", 384},
-		{"nistp384",		"1.3.132.0.34", "06052B81040022", 384},
-		{"ansiX9p384r1",	"1.3.132.0.34", "06052B81040022", 384},
-
-		{"secp521r1",		"1.3.132.0.35", "06052B81040023", 521},
-		{"nistp521",		"1.3.132.0.35", "06052B81040023", 521},
-
-		{"brainpoolP192r1",	"1.3.36.3.3.2.8.1.1.3", "06092B2403030208010103", 192},
-		{"brainpoolP224r1",	"1.3.36.3.3.2.8.1.1.5", "06092B2403030208010105", 224},
-		{"brainpoolP256r1",	"1.3.36.3.3.2.8.1.1.7", "06092B2403030208010107", 256},
-		{"brainpoolP320r1",	"1.3.36.3.3.2.8.1.1.9", "06092B2403030208010109", 320},
-		{"brainpoolP384r1",	"1.3.36.3.3.2.8.1.1.11", "06092B240303020801010B", 384},
-		{"brainpoolP512r1",	"1.3.36.3.3.2.8.1.1.13", "06092B240303020801010D", 512},
-
-		{"secp192k1",		"1.3.132.0.31", "06052B8104001F", 192},
-		{"secp256k1",		"1.3.132.0.10", "06052B8104000A", 256},
-		{NULL, NULL, NULL, 0},
+		{"secp192r1",		"1.2.840.10045.3.1.1", EC_DER("\x06\x08\x2A\x86\x48\xCE\x3D\x03\x01\x01"), 192},
+		{"secp224r1",		"1.3.132.0.33", EC_DER("\x06\x05\x2B\x81\x04\x00\x21"), 224},
+		{"secp256r1",		"1.2.840.10045.3.1.7", EC_DER("\x06\x08\x2A\x86\x48\xCE\x3D\x03\x01\x07"), 256},
+		{"secp384r1",		"1.3.132.0.34", EC_DER("\x06\x05\x2B\x81\x04\x00\x22"), 384},
+		{"secp521r1",		"1.3.132.0.35", EC_DER("\x06\x05\x2B\x81\x04\x00\x23"), 521},
+
+		{"brainpoolP192r1",	"1.3.36.3.3.2.8.1.1.3", EC_DER("\x06\x09\x2B\x24\x03\x03\x02\x08\x01\x01\x03"), 192},
+		{"brainpoolP224r1",	"1.3.36.3.3.2.8.1.1.5", EC_DER("\x06\x09\x2B\x24\x03\x03\x02\x08\x01\x01\x05"), 224},
+		{"brainpoolP256r1",	"1.3.36.3.3.2.8.1.1.7", EC_DER("\x06\x09\x2B\x24\x03\x03\x02\x08\x01\x01\x07"), 256},
+		{"brainpoolP320r1",	"1.3.36.3.3.2.8.1.1.9", EC_DER("\x06\x09\x2B\x24\x03\x03\x02\x08\x01\x01\x09"), 320},
+		{"brainpoolP384r1",	"1.3.36.3.3.2.8.1.1.11", EC_DER("\x06\x09\x2B\x24\x03\x03\x02\x08\x01\x01\x0B"), 384},
+		{"brainpoolP512r1",	"1.3.36.3.3.2.8.1.1.13", EC_DER("\x06\x09\x2B\x24\x03\x03\x02\x08\x01\x01\x0D"), 512},
+
+		{"secp192k1",		"1.3.132.0.31", EC_DER("\x06\x05\x2B\x81\x04\x00\x1F"), 192},
+		{"secp256k1",		"1.3.132.0.10", EC_DER("\x06\x05\x2B\x81\x04\x00\x0A"), 256},
+		{NULL, NULL, NULL, 0, 0},
 };
 
+/* Other names of the curves above */
+static const struct {
+	const char *name;
+	const char *oid_str;
+} ec_curve_aliases[] = {
+		{"prime192v1",		"1.2.840.10045.3.1.1"},
+		{"nistp192",		"1.2.840.10045.3.1.1"},
+		{"ansiX9p192r1",	"1.2.840.10045.3.1.1"},
+		{"nistp224",		"1.3.132.0.33"},
+		{"prime256v1",		"1.2.840.10045.3.1.7"},
+		{"nistp256",		"1.2.840.10045.3.1.7"},
+		{"ansiX9p256r1",	"1.2.840.10045.3.1.7"},
+		{"prime384v1",		"1.3.132.0.34"},
+		{"nistp384",		"1.3.132.0.34"},
+		{"ansiX9p384r1",	"1.3.132.0.34"},
+		{"nistp521",		"1.3.132.0.35"},
+		{NULL, NULL},
+};
+
+static const struct ec_curve_info *
+ec_curve_by_der(const u8 *der, size_t der_len)
+{
+	const struct ec_curve_info *curve;
+
+	for (curve = ec_curve_infos; curve->name; curve++)
+		if (curve->der_len == der_len && !memcmp(curve->der, der, der_len))
+			return curve;
+	return NULL;
+}
+
+/* by name or by OID in ASCII form */
+static const struct ec_curve_info *
+ec_curve_by_name(const char *name)
+{
+	const struct ec_curve_info *curve;
+	int ii;
+
+	for (ii = 0; ec_curve_aliases[ii].name; ii++)
+		if (!strcmp(ec_curve_aliases[ii].name, name)) {
+			name = ec_curve_aliases[ii].oid_str;
+			break;
+		}
+	for (curve = ec_curve_infos; curve->name; curve++)
+		if (!strcmp(curve->name, name) || !strcmp(curve->oid_str, name))
+			return curve;
+	return NULL;
+}
+
 
 int
 sc_pkcs15_fix_ec_parameters(struct sc_context *ctx, struct sc_ec_parameters *ecparams)
 {
-	int rv, ii;
+	const struct ec_curve_info *curve;
+	int rv;
 
 	LOG_FUNC_CALLED(ctx);
 
 	/* In PKCS#11 EC parameters arrives in DER encoded form */
 	if (ecparams->der.value && ecparams->der.len)   {
-		for (ii=0; ec_curve_infos[ii].name; ii++)   {
-			struct sc_object_id id;
-			unsigned char *buf = NULL;
-			size_t len = 0;
-
-			sc_format_oid(&id, ec_curve_infos[ii].oid_str);
-			sc_encode_oid (ctx, &id, &buf, &len);
-
-			if (ecparams->der.len == len && !memcmp(ecparams->der.value, buf, len))   {
-				free(buf);
-				break;
-			}
-
-			free(buf);
-		}
+		curve = ec_curve_by_der(ecparams->der.value, ecparams->der.len);
 
 		/* TODO: support of explicit EC parameters form */
-		if (!ec_curve_infos[ii].name)
+		if (!curve)
 			LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Unsupported named curve");
 
-		sc_log(ctx, "Found known curve '%s'", ec_curve_infos[ii].name);
+		sc_log(ctx, "Found known curve '%s'", curve->name);
 		if (!ecparams->named_curve)   {
-			ecparams->named_curve = strdup(ec_curve_infos[ii].name);
+			ecparams->named_curve = strdup(curve->name);
 			if (!ecparams->named_curve)
 				LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 
@@ -1553,32 +1588,30 @@ sc_pkcs15_fix_ec_parameters(struct sc_context *ctx, struct sc_ec_parameters *ecp
 		}
 
 		if (!sc_valid_oid(&ecparams->id))
-			sc_format_oid(&ecparams->id, ec_curve_infos[ii].oid_str);
+			sc_format_oid(&ecparams->id, curve->oid_str);
 
-		ecparams->field_length = ec_curve_infos[ii].size;
+		ecparams->field_length = curve->size;
 		sc_log(ctx, "Curve length %"SC_FORMAT_LEN_SIZE_T"u",
 		       ecparams->field_length);
 	}
 	else if (ecparams->named_curve)   {	/* it can be name of curve or OID in ASCII form */
-		for (ii=0; ec_curve_infos[ii].name; ii++)   {
-			if (!strcmp(ec_curve_infos[ii].name, ecparams->named_curve))
-				break;
-			if (!strcmp(ec_curve_infos[ii].oid_str, ecparams->named_curve))
-				break;
-		}
-		if (!ec_curve_infos[ii].name)   {
+		curve = ec_curve_by_name(ecparams->named_curve);
+		if (!curve)   {
 			sc_log(ctx, "Named curve '%s' not supported", ecparams->named_curve);
 			LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
 		}
 
-		rv = sc_format_oid(&ecparams->id, ec_curve_infos[ii].oid_str);
+		rv = sc_format_oid(&ecparams->id, curve->oid_str);
 		LOG_TEST_RET(ctx, rv, "Invalid OID format");
 
-		ecparams->field_length = ec_curve_infos[ii].size;
+		ecparams->field_length = curve->size;
 
 		if (!ecparams->der.value || !ecparams->der.len)   {
-			rv = sc_encode_oid (ctx, &ecparams->id, &ecparams->der.value, &ecparams->der.len);
-			LOG_TEST_RET(ctx, rv, "Cannot encode object ID");
+			ecparams->der.value = malloc(curve->der_len);
+			if (!ecparams->der.value)
+				LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+			memcpy(ecparams->der.value, curve->der, curve->der_len);
+			ecparams->der.len = curve->der_len;
 		}
 	}
 	else
@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS15
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -219,6 +221,8 @@ static const struct sc_asn1_entry c_asn1_req[C_ASN1_REQ_SIZE] = {
 static int read_file(sc_pkcs15_card_t * p15card, u8 fid[2],
 		u8 *efbin, size_t *len, int optional)
 {
+	sc_hsm_private_data_t *priv = (sc_hsm_private_data_t *) p15card->card->drv_data;
+	sc_cardctl_sc_hsm_read_ef_t read_ef;
 	sc_path_t path;
 	int r;
 
@@ -227,16 +231,13 @@ static int read_file(sc_pkcs15_card_t * p15card, u8 fid[2],
 	path.aid = sc_hsm_aid;
 	/* we don't have a pre-known size of the file */
 	path.count = -1;
-	if (!p15card->opts.use_file_cache || !efbin
+	if (!p15card->opts.use_file_cache || !efbin || priv->file_cache_stale
 			|| SC_SUCCESS != sc_pkcs15_read_cached_file(p15card, &path, &efbin, len)) {
-		/* avoid re-selection of SC-HSM */
-		path.aid.len = 0;
-		r = sc_select_file(p15card->card, &path, NULL);
-		if (r < 0) {
-			sc_log(p15card->card->ctx, "Could not select EF");
-		} else {
-			r = sc_read_binary(p15card->card, 0, efbin, *len, 0);
-		}
+		/* read by FID, which neither needs a SELECT nor re-selects SC-HSM */
+		memcpy(read_ef.fid, fid, sizeof read_ef.fid);
+		read_ef.buf = efbin;
+		read_ef.len = *len;
+		r = sc_card_ctl(p15card->card, SC_CARDCTL_SC_HSM_READ_EF, &read_ef);
 
 		if (r < 0) {
 			sc_log(p15card->card->ctx, "Could not read EF");
@@ -248,12 +249,10 @@ static int read_file(sc_pkcs15_card_t * p15card, u8 fid[2],
 			 * missing. */
 			*len = 0;
 		} else {
-			*len = r;
+			*len = read_ef.len;
 		}
 
 		if (p15card->opts.use_file_cache) {
-			/* save this with our AID */
-			path.aid = sc_hsm_aid;
 			sc_pkcs15_cache_file(p15card, &path, efbin, *len);
 		}
 	}
@@ -263,6 +262,40 @@ static int read_file(sc_pkcs15_card_t * p15card, u8 fid[2],
 
 
 
+/*
+ * The object list returned by ENUMERATE OBJECTS changes whenever a key,
+ * certificate or data object is created or deleted. Keep a copy of it in
+ * the file cache and only trust the cached descriptors and certificates
+ * while the list on the card still matches.
+ */
+static void check_file_cache(sc_pkcs15_card_t * p15card, u8 *filelist, size_t filelistlength)
+{
+	sc_hsm_private_data_t *priv = (sc_hsm_private_data_t *) p15card->card->drv_data;
+	u8 cached[MAX_EXT_APDU_LENGTH], *ptr = cached;
+	size_t len = sizeof cached;
+	sc_path_t path;
+
+	if (!p15card->opts.use_file_cache)
+		return;
+
+	/* FID 0000 is reserved by ISO 7816-4 and never used by the card */
+	sc_path_set(&path, SC_PATH_TYPE_FILE_ID, (u8 *) "\x00\x00", 2, 0, 0);
+	path.aid = sc_hsm_aid;
+	path.count = -1;
+
+	if (SC_SUCCESS == sc_pkcs15_read_cached_file(p15card, &path, &ptr, &len)
+			&& len == filelistlength && !memcmp(cached, filelist, len)) {
+		priv->file_cache_stale = 0;
+		return;
+	}
+
+	sc_log(p15card->card->ctx, "Object list changed, refreshing cached files");
+	priv->file_cache_stale = 1;
+	sc_pkcs15_cache_file(p15card, &path, filelist, filelistlength);
+}
+
+
+
 /*
  * Decode a card verifiable certificate as defined in TR-03110.
  */
@@ -1031,6 +1064,8 @@ static int sc_pkcs15emu_sc_hsm_init (sc_pkcs15_card_t * p15card)
 	filelistlength = sc_list_files(card, filelist, sizeof(filelist));
 	LOG_TEST_RET(card->ctx, filelistlength, "Could not enumerate file and key identifier");
 
+	check_file_cache(p15card, filelist, filelistlength);
+
 	for (i = 0; i < filelistlength; i += 2) {
 		switch(filelist[i]) {
 		case KEY_PREFIX:
@@ -19,6 +19,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS15
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -123,6 +125,30 @@ static int select_key_file(struct sc_pkcs15_card *p15card,
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
+/* Select the key file, if the key has a path, and set the security
+ * environment. The card has to be locked by the caller. */
+static int set_key_env(struct sc_pkcs15_card *p15card,
+		const struct sc_pkcs15_object *obj,
+		sc_security_env_t *senv)
+{
+	int r = SC_SUCCESS;
+	sc_path_t path;
+
+	LOG_TEST_RET(p15card->card->ctx, get_file_path(obj, &path), "Failed to get key file path.");
+
+	if (path.len != 0 || path.aid.len != 0) {
+		r = select_key_file(p15card, obj, senv);
+		if (r < 0) {
+			sc_log(p15card->card->ctx,
+					"Unable to select private key file");
+		}
+	}
+	if (r == SC_SUCCESS)
+		r = sc_set_security_env(p15card->card, senv, 0);
+
+	return r;
+}
+
 static int use_key(struct sc_pkcs15_card *p15card,
 		const struct sc_pkcs15_object *obj,
 		sc_security_env_t *senv,
@@ -132,37 +158,36 @@ static int use_key(struct sc_pkcs15_card *p15card,
 		const u8 * in, size_t inlen, u8 * out, size_t outlen)
 {
 	int r = SC_SUCCESS;
-	int revalidated_cached_pin = 0;
+	int revalidated_cached_pin = 0, retried_reset = 0;
 	sc_path_t path;
 	LOG_TEST_RET(p15card->card->ctx, get_file_path(obj, &path), "Failed to get key file path.");
 
 	r = sc_lock(p15card->card);
 	LOG_TEST_RET(p15card->card->ctx, r, "sc_lock() failed");
 
-	do {
-		if (path.len != 0 || path.aid.len != 0) {
-			r = select_key_file(p15card, obj, senv);
-			if (r < 0) {
-				sc_log(p15card->card->ctx,
-						"Unable to select private key file");
-			}
-		}
-		if (r == SC_SUCCESS)
-			r = sc_set_security_env(p15card->card, senv, 0);
+	while (1) {
+		r = set_key_env(p15card, obj, senv);
 
 		if (r == SC_SUCCESS)
 			r = card_command(p15card->card, in, inlen, out, outlen);
 
-		if (revalidated_cached_pin)
-			/* only re-validate once */
-			break;
-		if (r == SC_ERROR_SECURITY_STATUS_NOT_SATISFIED) {
+		/* A reset loses the selection and the security status. Try
+		 * again and verify the cached PIN only if the card asks for it,
+		 * many cards keep the status of the PINs they need. */
+		if (r == SC_ERROR_CARD_RESET && !retried_reset) {
+			retried_reset = 1;
+			continue;
+		}
+		/* only re-validate once */
+		if (r == SC_ERROR_SECURITY_STATUS_NOT_SATISFIED && !revalidated_cached_pin) {
 			r = sc_pkcs15_pincache_revalidate(p15card, obj);
 			if (r < 0)
 				break;
 			revalidated_cached_pin = 1;
+			continue;
 		}
-	} while (revalidated_cached_pin);
+		break;
+	}
 
 	sc_unlock(p15card->card);
 
@@ -548,6 +573,71 @@ int sc_pkcs15_wrap(struct sc_pkcs15_card *p15card,
 #define USAGE_ANY_DECIPHER      (SC_PKCS15_PRKEY_USAGE_DECRYPT|\
                                  SC_PKCS15_PRKEY_USAGE_UNWRAP)
 
+/* Length of the signature made with the key */
+static int sign_key_length(sc_context_t *ctx, const struct sc_pkcs15_object *obj,
+		size_t *modlen)
+{
+	const struct sc_pkcs15_prkey_info *prkey = (const struct sc_pkcs15_prkey_info *) obj->data;
+
+	switch (obj->type) {
+		case SC_PKCS15_TYPE_PRKEY_RSA:
+			*modlen = (prkey->modulus_length + 7) / 8;
+			break;
+		case SC_PKCS15_TYPE_PRKEY_GOSTR3410:
+			*modlen = (prkey->modulus_length + 7) / 8 * 2;
+			break;
+		case SC_PKCS15_TYPE_PRKEY_EC:
+			*modlen = ((prkey->field_length +7) / 8) * 2;  /* 2*nLen */
+			break;
+		default:
+			LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Key type not supported");
+	}
+	return SC_SUCCESS;
+}
+
+/* Add the padding to the data in buf, or zero-pad or truncate it,
+ * as the card expects it */
+static int sign_encode_input(sc_context_t *ctx,
+		const struct sc_pkcs15_prkey_info *prkey,
+		const sc_security_env_t *senv, unsigned long flags,
+		unsigned long pad_flags, u8 *buf, size_t buflen,
+		size_t *inlen, size_t modlen)
+{
+	int r;
+
+	/* add the padding bytes (if necessary) */
+	if (pad_flags != 0) {
+		size_t tmplen = buflen;
+
+		/* XXX Assuming RSA key here */
+		r = sc_pkcs1_encode(ctx, pad_flags, buf, *inlen, buf, &tmplen,
+		    prkey->modulus_length);
+		LOG_TEST_RET(ctx, r, "Unable to add padding");
+		*inlen = tmplen;
+	}
+	else if ( senv->algorithm == SC_ALGORITHM_RSA &&
+	          (flags & SC_ALGORITHM_RSA_PADS) == SC_ALGORITHM_RSA_PAD_NONE) {
+		/* Add zero-padding if input is shorter than the modulus */
+		if (*inlen < modlen) {
+			if (modlen > buflen)
+				return SC_ERROR_BUFFER_TOO_SMALL;
+			memmove(buf+modlen-*inlen, buf, *inlen);
+			memset(buf, 0, modlen-*inlen);
+		}
+		*inlen = modlen;
+	}
+	/* PKCS#11 MECHANISMS V2.30: 6.3.1 EC Signatures
+	 * If the length of the hash value is larger than the bit length of n, only
+	 * the leftmost bits of the hash up to the length of n will be used. Any
+	 * truncation is done by the token.
+	 */
+	else if (senv->algorithm == SC_ALGORITHM_EC &&
+			(flags & SC_ALGORITHM_ECDSA_HASH_NONE) != 0) {
+		*inlen = MIN(*inlen, (prkey->field_length+7)/8);
+	}
+	return SC_SUCCESS;
+}
+
 int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 				const struct sc_pkcs15_object *obj,
 				unsigned long flags, const u8 *in, size_t inlen,
@@ -572,19 +662,8 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 	LOG_TEST_RET(ctx, r, "Could not initialize security environment");
 	senv.operation = SC_SEC_OPERATION_SIGN;
 
-	switch (obj->type) {
-		case SC_PKCS15_TYPE_PRKEY_RSA:
-			modlen = (prkey->modulus_length + 7) / 8;
-			break;
-		case SC_PKCS15_TYPE_PRKEY_GOSTR3410:
-			modlen = (prkey->modulus_length + 7) / 8 * 2;
-			break;
-		case SC_PKCS15_TYPE_PRKEY_EC:
-			modlen = ((prkey->field_length +7) / 8) * 2;  /* 2*nLen */ 
-			break;
-		default:
-			LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Key type not supported");
-	}
+	r = sign_key_length(ctx, obj, &modlen);
+	LOG_TEST_RET(ctx, r, "Could not get the signature length");
 
 	/* Probably never happens, but better make sure */
 	if (inlen > sizeof(buf) || outlen < modlen)
@@ -670,38 +749,13 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 	sc_log(ctx, "DEE flags:0x%8.8lx alg_info->flags:0x%8.8x pad:0x%8.8lx sec:0x%8.8lx",
 		flags, alg_info->flags, pad_flags, sec_flags);
 
-	/* add the padding bytes (if necessary) */
-	if (pad_flags != 0) {
-		size_t tmplen = sizeof(buf);
-
-		/* XXX Assuming RSA key here */
-		r = sc_pkcs1_encode(ctx, pad_flags, tmp, inlen, tmp, &tmplen,
-		    prkey->modulus_length);
-		LOG_TEST_RET(ctx, r, "Unable to add padding");
-		inlen = tmplen;
-	}
-	else if ( senv.algorithm == SC_ALGORITHM_RSA &&
-	          (flags & SC_ALGORITHM_RSA_PADS) == SC_ALGORITHM_RSA_PAD_NONE) {
-		/* Add zero-padding if input is shorter than the modulus */
-		if (inlen < modlen) {
-			if (modlen > sizeof(buf))
-				return SC_ERROR_BUFFER_TOO_SMALL;
-			memmove(tmp+modlen-inlen, tmp, inlen);
-			memset(tmp, 0, modlen-inlen);
-		}
-		inlen = modlen;
-	}
-	/* PKCS#11 MECHANISMS V2.30: 6.3.1 EC Signatures
-	 * If the length of the hash value is larger than the bit length of n, only
-	 * the leftmost bits of the hash up to the length of n will be used. Any
-	 * truncation is done by the token.
-	 */
-	else if (senv.algorithm == SC_ALGORITHM_EC &&
-			(flags & SC_ALGORITHM_ECDSA_HASH_NONE) != 0) {
-		inlen = MIN(inlen, (prkey->field_length+7)/8);
+	r = sign_encode_input(ctx, prkey, &senv, flags, pad_flags, tmp,
+			sizeof(buf), &inlen, modlen);
+	if (r != SC_SUCCESS) {
+		sc_mem_clear(buf, sizeof(buf));
+		LOG_FUNC_RETURN(ctx, r);
 	}
 
-
 	r = use_key(p15card, obj, &senv, sc_compute_signature, tmp, inlen,
 			out, outlen);
 	LOG_TEST_RET(ctx, r, "use_key() failed");
@@ -718,3 +772,204 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 
 	LOG_FUNC_RETURN(ctx, r);
 }
+
+struct sc_pkcs15_sign_ctx {
+	struct sc_pkcs15_card *p15card;
+	const struct sc_pkcs15_object *obj;
+	unsigned long flags;
+	unsigned long pad_flags;
+	sc_security_env_t senv;
+	size_t modlen;
+	/* every signature goes through sc_pkcs15_compute_signature() */
+	int per_signature;
+	/* the key is selected and the security environment is set */
+	int env_set;
+	/* the card keeps the security environment between signatures */
+	int keep_env;
+};
+
+/*
+ * Prepare a series of signatures with one key and algorithm. The card stays
+ * locked until sc_pkcs15_sign_ctx_free(), so that the key file is selected
+ * and the security environment is set only once instead of for every
+ * signature.
+ */
+int sc_pkcs15_sign_ctx_init(struct sc_pkcs15_card *p15card,
+				const struct sc_pkcs15_object *obj,
+				unsigned long flags,
+				struct sc_pkcs15_sign_ctx **sign_ctx)
+{
+	sc_context_t *ctx;
+	struct sc_pkcs15_sign_ctx *sctx;
+	const struct sc_pkcs15_prkey_info *prkey;
+	sc_algorithm_info_t *alg_info;
+	unsigned long sec_flags = 0;
+	int r;
+
+	if (p15card == NULL || p15card->card == NULL || obj == NULL || sign_ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	ctx = p15card->card->ctx;
+	LOG_FUNC_CALLED(ctx);
+
+	prkey = (const struct sc_pkcs15_prkey_info *) obj->data;
+	if (!(prkey->usage & (SC_PKCS15_PRKEY_USAGE_SIGN|SC_PKCS15_PRKEY_USAGE_SIGNRECOVER|
+					SC_PKCS15_PRKEY_USAGE_NONREPUDIATION)))
+		LOG_TEST_RET(ctx, SC_ERROR_NOT_ALLOWED, "This key cannot be used for signing");
+
+	sctx = calloc(1, sizeof(*sctx));
+	if (sctx == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	sctx->p15card = p15card;
+	sctx->obj = obj;
+	sctx->flags = flags;
+	sctx->keep_env = 1;
+
+	r = format_senv(p15card, obj, &sctx->senv, &alg_info);
+	if (r != SC_SUCCESS)
+		goto err;
+	sctx->senv.operation = SC_SEC_OPERATION_SIGN;
+
+	r = sign_key_length(ctx, obj, &sctx->modlen);
+	if (r != SC_SUCCESS)
+		goto err;
+
+	if ((alg_info->flags & SC_ALGORITHM_NEED_USAGE) &&
+		((prkey->usage & USAGE_ANY_SIGN) &&
+		(prkey->usage & USAGE_ANY_DECIPHER)) ) {
+		/* signing is emulated with a decipher operation */
+		sctx->per_signature = 1;
+	} else if ((flags == (SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE)) &&
+	    !(alg_info->flags & SC_ALGORITHM_RSA_RAW) &&
+	    !(alg_info->flags & SC_ALGORITHM_RSA_HASH_NONE) &&
+	    (alg_info->flags & SC_ALGORITHM_RSA_PAD_PKCS1)) {
+		/* the environment depends on the DigestInfo of each input */
+		sctx->per_signature = 1;
+	} else {
+		r = sc_get_encoding_flags(ctx, flags, alg_info->flags,
+				&sctx->pad_flags, &sec_flags);
+		if (r != SC_SUCCESS)
+			goto err;
+		sctx->senv.algorithm_flags = sec_flags;
+	}
+
+	r = sc_lock(p15card->card);
+	if (r != SC_SUCCESS)
+		goto err;
+
+	*sign_ctx = sctx;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+
+err:
+	free(sctx);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+/*
+ * Sign the data with the key of the signing context, like
+ * sc_pkcs15_compute_signature() does
+ */
+int sc_pkcs15_sign_ctx_compute(struct sc_pkcs15_sign_ctx *sctx,
+				const u8 *in, size_t inlen,
+				u8 *out, size_t outlen)
+{
+	struct sc_pkcs15_card *p15card;
+	const struct sc_pkcs15_prkey_info *prkey;
+	sc_context_t *ctx;
+	u8 buf[1024];
+	int reused, retried = 0, revalidated = 0, retried_reset = 0;
+	int r;
+
+	if (sctx == NULL || (in == NULL && inlen) || out == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	p15card = sctx->p15card;
+	ctx = p15card->card->ctx;
+	prkey = (const struct sc_pkcs15_prkey_info *) sctx->obj->data;
+	LOG_FUNC_CALLED(ctx);
+
+	if (sctx->per_signature) {
+		r = sc_pkcs15_compute_signature(p15card, sctx->obj, sctx->flags,
+				in, inlen, out, outlen);
+		LOG_FUNC_RETURN(ctx, r);
+	}
+
+	if (inlen > sizeof(buf) || outlen < sctx->modlen)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_BUFFER_TOO_SMALL);
+	memcpy(buf, in, inlen);
+
+	if (sctx->obj->type == SC_PKCS15_TYPE_PRKEY_GOSTR3410) {
+		r = sc_mem_reverse(buf, inlen);
+		LOG_TEST_RET(ctx, r, "Reverse memory error");
+	}
+
+	r = sign_encode_input(ctx, prkey, &sctx->senv, sctx->flags,
+			sctx->pad_flags, buf, sizeof(buf), &inlen, sctx->modlen);
+	if (r != SC_SUCCESS) {
+		sc_mem_clear(buf, sizeof(buf));
+		LOG_FUNC_RETURN(ctx, r);
+	}
+
+	while (1) {
+		reused = sctx->env_set;
+		r = SC_SUCCESS;
+		if (!sctx->env_set) {
+			r = set_key_env(p15card, sctx->obj, &sctx->senv);
+			if (r == SC_SUCCESS)
+				sctx->env_set = 1;
+		}
+		if (r == SC_SUCCESS)
+			r = sc_compute_signature(p15card->card, buf, inlen, out, outlen);
+		if (r >= 0)
+			break;
+
+		sctx->env_set = 0;
+		if (r == SC_ERROR_CARD_RESET && !retried_reset) {
+			/* set the environment again, see use_key() */
+			retried_reset = 1;
+			continue;
+		}
+		if (reused && !retried) {
+			/* the card may have dropped the environment after the
+			 * previous signature: set it again */
+			retried = 1;
+			continue;
+		}
+		if (r == SC_ERROR_SECURITY_STATUS_NOT_SATISFIED && !revalidated) {
+			r = sc_pkcs15_pincache_revalidate(p15card, sctx->obj);
+			if (r < 0)
+				break;
+			revalidated = 1;
+			continue;
+		}
+		break;
+	}
+	sc_mem_clear(buf, sizeof(buf));
+	LOG_TEST_RET(ctx, r, "sc_compute_signature() failed");
+
+	if (retried && !revalidated) {
+		sc_log(ctx, "Card does not keep the security environment, setting it for every signature");
+		sctx->keep_env = 0;
+	}
+	if (!sctx->keep_env)
+		sctx->env_set = 0;
+
+	/* Some cards may return RSA signature as integer without leading zero bytes */
+	if (sctx->obj->type == SC_PKCS15_TYPE_PRKEY_RSA && (unsigned)r < sctx->modlen) {
+		memmove(out + sctx->modlen - r, out, r);
+		memset(out, 0, sctx->modlen - r);
+		r = (int)sctx->modlen;
+	}
+
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+/*
+ * Release the signing context and the lock of the card
+ */
+void sc_pkcs15_sign_ctx_free(struct sc_pkcs15_sign_ctx *sctx)
+{
+	if (sctx == NULL)
+		return;
+	sc_unlock(sctx->p15card->card);
+	sc_mem_clear(sctx, sizeof(*sctx));
+	free(sctx);
+}
@@ -18,6 +18,9 @@
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS15
+
 #include "internal.h"
 #include "pkcs15.h"
 #include "pkcs11/pkcs11.h"
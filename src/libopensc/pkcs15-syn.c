@@ -19,6 +19,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS15
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -35,34 +37,86 @@
 #include "pkcs15-syn.h"
 
 struct sc_pkcs15_emulator_handler builtin_emulators[] = {
-	{ "westcos",	sc_pkcs15emu_westcos_init_ex	},
-	{ "openpgp",	sc_pkcs15emu_openpgp_init_ex	},
-	{ "starcert",	sc_pkcs15emu_starcert_init_ex	},
-	{ "tcos",	sc_pkcs15emu_tcos_init_ex	},
-	{ "esteid",	sc_pkcs15emu_esteid_init_ex	},
-	{ "itacns",	sc_pkcs15emu_itacns_init_ex	},
-	{ "PIV-II",     sc_pkcs15emu_piv_init_ex	},
-	{ "cac",        sc_pkcs15emu_cac_init_ex	},
-	{ "idprime",    sc_pkcs15emu_idprime_init_ex	},
-	{ "gemsafeGPK",	sc_pkcs15emu_gemsafeGPK_init_ex	},
-	{ "gemsafeV1",	sc_pkcs15emu_gemsafeV1_init_ex	},
-	{ "actalis",	sc_pkcs15emu_actalis_init_ex	},
-	{ "atrust-acos",sc_pkcs15emu_atrust_acos_init_ex},
-	{ "tccardos",	sc_pkcs15emu_tccardos_init_ex	},
-	{ "entersafe",  sc_pkcs15emu_entersafe_init_ex	},
-	{ "pteid",	sc_pkcs15emu_pteid_init_ex	},
-	{ "oberthur",   sc_pkcs15emu_oberthur_init_ex	},
-	{ "sc-hsm",	sc_pkcs15emu_sc_hsm_init_ex	},
-	{ "dnie",       sc_pkcs15emu_dnie_init_ex	},
-	{ "gids",       sc_pkcs15emu_gids_init_ex	},
-	{ "iasecc",	sc_pkcs15emu_iasecc_init_ex	},
-	{ "jpki",	sc_pkcs15emu_jpki_init_ex	},
-	{ "coolkey",    sc_pkcs15emu_coolkey_init_ex	},
-	{ "din66291",   sc_pkcs15emu_din_66291_init_ex	},
-	{ "esteid2018", sc_pkcs15emu_esteid2018_init_ex	},
-	{ "cardos",     sc_pkcs15emu_cardos_init_ex	},
-
-	{ NULL, NULL }
+#if SC_CARD_DRIVER(WESTCOS)
+	{ "westcos",	sc_pkcs15emu_westcos_init_ex,		"westcos" },
+#endif
+#if SC_CARD_DRIVER(OPENPGP)
+	{ "openpgp",	sc_pkcs15emu_openpgp_init_ex,		"openpgp" },
+#endif
+#if SC_CARD_DRIVER(STARCERT) || SC_CARD_DRIVER(STARCOS)
+	{ "starcert",	sc_pkcs15emu_starcert_init_ex,		"starcos" },
+#endif
+#if SC_CARD_DRIVER(TCOS)
+	{ "tcos",	sc_pkcs15emu_tcos_init_ex,		"tcos" },
+#endif
+#if SC_CARD_DRIVER(ESTEID) || SC_CARD_DRIVER(MCRD)
+	{ "esteid",	sc_pkcs15emu_esteid_init_ex,		"mcrd" },
+#endif
+#if SC_CARD_DRIVER(ITACNS) || SC_CARD_DRIVER(CARDOS)
+	{ "itacns",	sc_pkcs15emu_itacns_init_ex,		"itacns cardos" },
+#endif
+#if SC_CARD_DRIVER(PIV_II)
+	{ "PIV-II",	sc_pkcs15emu_piv_init_ex,		"PIV-II" },
+#endif
+#if SC_CARD_DRIVER(CAC) || SC_CARD_DRIVER(CAC1)
+	{ "cac",	sc_pkcs15emu_cac_init_ex,		"cac cac1" },
+#endif
+#if SC_CARD_DRIVER(IDPRIME)
+	{ "idprime",	sc_pkcs15emu_idprime_init_ex,		"idprime" },
+#endif
+#if SC_CARD_DRIVER(GEMSAFEGPK) || SC_CARD_DRIVER(GPK)
+	{ "gemsafeGPK",	sc_pkcs15emu_gemsafeGPK_init_ex,	"gpk" },
+#endif
+#if SC_CARD_DRIVER(GEMSAFEV1)
+	{ "gemsafeV1",	sc_pkcs15emu_gemsafeV1_init_ex,		"gemsafeV1" },
+#endif
+#if SC_CARD_DRIVER(ACTALIS) || SC_CARD_DRIVER(CARDOS)
+	{ "actalis",	sc_pkcs15emu_actalis_init_ex,		"cardos" },
+#endif
+#if SC_CARD_DRIVER(ATRUST_ACOS)
+	{ "atrust-acos",sc_pkcs15emu_atrust_acos_init_ex,	"atrust-acos" },
+#endif
+#if SC_CARD_DRIVER(TCCARDOS) || SC_CARD_DRIVER(CARDOS)
+	{ "tccardos",	sc_pkcs15emu_tccardos_init_ex,		"cardos" },
+#endif
+#if SC_CARD_DRIVER(ENTERSAFE)
+	{ "entersafe",	sc_pkcs15emu_entersafe_init_ex,		"entersafe" },
+#endif
+#if SC_CARD_DRIVER(PTEID) || SC_CARD_DRIVER(GEMSAFEV1)
+	{ "pteid",	sc_pkcs15emu_pteid_init_ex,		"gemsafeV1" },
+#endif
+#if SC_CARD_DRIVER(OBERTHUR)
+	{ "oberthur",	sc_pkcs15emu_oberthur_init_ex,		"oberthur" },
+#endif
+#if SC_CARD_DRIVER(SC_HSM)
+	{ "sc-hsm",	sc_pkcs15emu_sc_hsm_init_ex,		"sc-hsm" },
+#endif
+#if SC_CARD_DRIVER(DNIE)
+	{ "dnie",	sc_pkcs15emu_dnie_init_ex,		"dnie" },
+#endif
+#if SC_CARD_DRIVER(GIDS)
+	{ "gids",	sc_pkcs15emu_gids_init_ex,		"gids" },
+#endif
+#if SC_CARD_DRIVER(IASECC)
+	{ "iasecc",	sc_pkcs15emu_iasecc_init_ex,		"iasecc" },
+#endif
+#if SC_CARD_DRIVER(JPKI)
+	{ "jpki",	sc_pkcs15emu_jpki_init_ex,		"jpki" },
+#endif
+#if SC_CARD_DRIVER(COOLKEY)
+	{ "coolkey",	sc_pkcs15emu_coolkey_init_ex,		"coolkey" },
+#endif
+#if SC_CARD_DRIVER(DIN66291)
+	{ "din66291",	sc_pkcs15emu_din_66291_init_ex,		NULL },
+#endif
+#if SC_CARD_DRIVER(ESTEID2018)
+	{ "esteid2018",	sc_pkcs15emu_esteid2018_init_ex,	"esteid2018" },
+#endif
+#if SC_CARD_DRIVER(CARDOS)
+	{ "cardos",	sc_pkcs15emu_cardos_init_ex,		"cardos" },
+#endif
+
+	{ NULL, NULL, NULL }
 };
 
 static int parse_emu_block(sc_pkcs15_card_t *, struct sc_aid *, scconf_block *);
@@ -105,66 +159,181 @@ int sc_pkcs15_is_emulation_only(sc_card_t *card)
 	}
 }
 
+/* Check whether the emulator declares support for the driver of the card */
+static int
+emulator_accepts_driver(const struct sc_pkcs15_emulator_handler *emu, sc_card_t *card)
+{
+	const char *name, *p;
+	size_t len;
+
+	if (emu->drivers == NULL || card->driver == NULL || card->driver->short_name == NULL)
+		return 1;
+
+	name = card->driver->short_name;
+	len = strlen(name);
+	for (p = emu->drivers; p != NULL; p = strchr(p, ' ')) {
+		while (*p == ' ')
+			p++;
+		if (!strncmp(p, name, len) && (p[len] == ' ' || p[len] == '\0'))
+			return 1;
+	}
+	return 0;
+}
+
+static const char *
+emulator_cache_lookup(sc_context_t *ctx, const struct sc_atr *atr)
+{
+	const char *name = NULL;
+	unsigned int i;
+
+	if (atr->len == 0)
+		return NULL;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (i = 0; i < SC_MAX_EMULATOR_CACHE; i++) {
+		if (ctx->emulator_cache[i].emulator != NULL
+				&& ctx->emulator_cache[i].atr.len == atr->len
+				&& !memcmp(ctx->emulator_cache[i].atr.value, atr->value, atr->len)) {
+			name = ctx->emulator_cache[i].emulator;
+			break;
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+	return name;
+}
+
+static void
+emulator_cache_store(sc_context_t *ctx, const struct sc_atr *atr, const char *name)
+{
+	unsigned int i;
+
+	if (atr->len == 0)
+		return;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (i = 0; i < SC_MAX_EMULATOR_CACHE; i++) {
+		if (ctx->emulator_cache[i].emulator != NULL
+				&& ctx->emulator_cache[i].atr.len == atr->len
+				&& !memcmp(ctx->emulator_cache[i].atr.value, atr->value, atr->len))
+			break;
+	}
+	if (i == SC_MAX_EMULATOR_CACHE) {
+		i = ctx->emulator_cache_next;
+		ctx->emulator_cache_next = (i + 1) % SC_MAX_EMULATOR_CACHE;
+		ctx->emulator_cache[i].atr = *atr;
+	}
+	ctx->emulator_cache[i].emulator = name;
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
+static int
+try_builtin_emulator(sc_pkcs15_card_t *p15card, struct sc_aid *aid, int i)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+
+	if (!emulator_accepts_driver(&builtin_emulators[i], p15card->card)) {
+		sc_log(ctx, "skipping %s, card driver %s not supported",
+				builtin_emulators[i].name, p15card->card->driver->short_name);
+		return SC_ERROR_WRONG_CARD;
+	}
+	sc_log(ctx, "trying %s", builtin_emulators[i].name);
+	return builtin_emulators[i].handler(p15card, aid);
+}
+
+/* Try the builtin emulators, either all of them or the ones in the list.
+ * The emulator that last bound a card with the same ATR is tried first. */
+static int
+bind_builtin_emulators(sc_pkcs15_card_t *p15card, struct sc_aid *aid, const scconf_list *list)
+{
+	sc_card_t *card = p15card->card;
+	const scconf_list *item;
+	const char *cached_name;
+	int i, cached = -1, r = SC_ERROR_WRONG_CARD;
+
+	cached_name = emulator_cache_lookup(card->ctx, &card->atr);
+	for (i = 0; cached_name && builtin_emulators[i].name; i++) {
+		if (builtin_emulators[i].name != cached_name)
+			continue;
+		for (item = list; item; item = item->next)
+			if (!strcmp(item->data, cached_name))
+				break;
+		if (list == NULL || item != NULL)
+			cached = i;
+		break;
+	}
+	if (cached >= 0) {
+		sc_log(card->ctx, "%s bound this ATR before", cached_name);
+		r = try_builtin_emulator(p15card, aid, cached);
+		if (r == SC_SUCCESS)
+			return r;
+	}
+
+	if (list) {
+		/* get the list of enabled emulation drivers */
+		for (item = list; item; item = item->next) {
+			/* go through the list of builtin drivers */
+			const char *name = item->data;
+
+			for (i = 0; builtin_emulators[i].name; i++)
+				if (i != cached && !strcmp(builtin_emulators[i].name, name)) {
+					r = try_builtin_emulator(p15card, aid, i);
+					if (r == SC_SUCCESS)
+						/* we got a hit */
+						goto out;
+				}
+		}
+	} else {
+		for (i = 0; builtin_emulators[i].name; i++) {
+			if (i == cached)
+				continue;
+			r = try_builtin_emulator(p15card, aid, i);
+			if (r == SC_SUCCESS)
+				/* we got a hit */
+				goto out;
+		}
+	}
+	return r;
+
+out:
+	emulator_cache_store(card->ctx, &card->atr, builtin_emulators[i].name);
+	return r;
+}
+
 int
 sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card, struct sc_aid *aid)
 {
 	sc_context_t		*ctx = p15card->card->ctx;
-	scconf_block		*conf_block, **blocks, *blk;
+	const struct sc_pkcs15_conf *conf;
+	scconf_block		**blocks, *blk;
 	int			i, r = SC_ERROR_WRONG_CARD;
 
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
-	conf_block = NULL;
 
-	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
+	conf = sc_pkcs15_get_conf(ctx);
 
-	if (!conf_block) {
+	if (!conf || !conf->block) {
 		/* no conf file found => try builtin drivers  */
 		sc_log(ctx, "no conf file (or section), trying all builtin emulators");
-		for (i = 0; builtin_emulators[i].name; i++) {
-			sc_log(ctx, "trying %s", builtin_emulators[i].name);
-			r = builtin_emulators[i].handler(p15card, aid);
+		r = bind_builtin_emulators(p15card, aid, NULL);
+		if (r == SC_SUCCESS)
+			/* we got a hit */
+			goto out;
+	} else {
+		/* we have a conf file => let's use it */
+		const scconf_list *list = conf->builtin_emulators; /* FIXME: rename to enabled_emulators */
+
+		if (conf->enable_builtin_emulation) {
+			if (!list)
+				sc_log(ctx, "no emulator list in config file, trying all builtin emulators");
+			r = bind_builtin_emulators(p15card, aid, list);
 			if (r == SC_SUCCESS)
 				/* we got a hit */
 				goto out;
 		}
-	} else {
-		/* we have a conf file => let's use it */
-		int builtin_enabled;
-		const scconf_list *list, *item;
-
-		builtin_enabled = scconf_get_bool(conf_block, "enable_builtin_emulation", 1);
-		list = scconf_find_list(conf_block, "builtin_emulators"); /* FIXME: rename to enabled_emulators */
-
-		if (builtin_enabled && list) {
-			/* get the list of enabled emulation drivers */
-			for (item = list; item; item = item->next) {
-				/* go through the list of builtin drivers */
-				const char *name = item->data;
-
-				sc_log(ctx, "trying %s", name);
-				for (i = 0; builtin_emulators[i].name; i++)
-					if (!strcmp(builtin_emulators[i].name, name)) {
-						r = builtin_emulators[i].handler(p15card, aid);
-						if (r == SC_SUCCESS)
-							/* we got a hit */
-							goto out;
-					}
-			}
-		}
-		else if (builtin_enabled) {
-			sc_log(ctx, "no emulator list in config file, trying all builtin emulators");
-			for (i = 0; builtin_emulators[i].name; i++) {
-				sc_log(ctx, "trying %s", builtin_emulators[i].name);
-				r = builtin_emulators[i].handler(p15card, aid);
-				if (r == SC_SUCCESS)
-					/* we got a hit */
-					goto out;
-			}
-		}
 
 		/* search for 'emulate foo { ... }' entries in the conf file */
 		sc_log(ctx, "searching for 'emulate foo { ... }' blocks");
-		blocks = scconf_find_blocks(ctx->conf, conf_block, "emulate", NULL);
+		blocks = scconf_find_blocks(ctx->conf, conf->block, "emulate", NULL);
 		sc_log(ctx, "Blocks: %p", blocks);
 		for (i = 0; blocks && (blk = blocks[i]) != NULL; i++) {
 			const char *name = blk->name->data;
@@ -396,12 +565,10 @@ int sc_pkcs15emu_object_add(sc_pkcs15_card_t *p15card, unsigned int type,
 
 	SC_FUNC_CALLED(p15card->card->ctx, SC_LOG_DEBUG_VERBOSE);
 
-	obj = calloc(1, sizeof(*obj));
+	obj = sc_pkcs15_new_object(p15card, in_obj);
 	if (!obj) {
 		LOG_FUNC_RETURN(p15card->card->ctx, SC_ERROR_OUT_OF_MEMORY);
 	}
-
-	memcpy(obj, in_obj, sizeof(*obj));
 	obj->type = type;
 
 	switch (type & SC_PKCS15_TYPE_CLASS_MASK) {
@@ -427,13 +594,13 @@ int sc_pkcs15emu_object_add(sc_pkcs15_card_t *p15card, unsigned int type,
 		break;
 	default:
 		sc_log(p15card->card->ctx, "Unknown PKCS15 object type %d", type);
-		free(obj);
+		sc_pkcs15_discard_object(p15card, obj);
 		LOG_FUNC_RETURN(p15card->card->ctx, SC_ERROR_INVALID_ARGUMENTS);
 	}
 
 	obj->data = calloc(1, data_len);
 	if (obj->data == NULL) {
-		free(obj);
+		sc_pkcs15_discard_object(p15card, obj);
 		LOG_FUNC_RETURN(p15card->card->ctx, SC_ERROR_OUT_OF_MEMORY);
 	}
 	memcpy(obj->data, data, data_len);
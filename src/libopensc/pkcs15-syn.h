@@ -59,6 +59,9 @@ int sc_pkcs15emu_cardos_init_ex(sc_pkcs15_card_t *p15card,	struct sc_aid *);
 struct sc_pkcs15_emulator_handler {
 	const char *name;
 	int (*handler)(sc_pkcs15_card_t *, struct sc_aid *);
+	/* space separated short names of the card drivers the emulator
+	 * accepts, NULL if it may handle a card of any driver */
+	const char *drivers;
 };
 
 #ifdef __cplusplus
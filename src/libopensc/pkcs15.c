@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS15
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
@@ -761,6 +763,131 @@ sc_pkcs15_free_app(struct sc_pkcs15_card *p15card)
 }
 
 
+/*
+ * With zero-copy decoding the raw contents of the parsed DFs are kept for
+ * the lifetime of the objects: octet strings of the decoded entries point
+ * into them instead of being copied. The buffers are released in one go,
+ * after the objects, when the card is cleared or freed.
+ */
+struct sc_pkcs15_df_buffer {
+	u8 *data;
+	size_t len;
+	struct sc_pkcs15_df_buffer *next;
+};
+
+static void
+sc_pkcs15_free_df_buffers(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_df_buffer *dfb, *next;
+
+	for (dfb = p15card->df_buffers; dfb; dfb = next) {
+		next = dfb->next;
+		free(dfb->data);
+		free(dfb);
+	}
+	p15card->df_buffers = NULL;
+}
+
+
+/*
+ * Objects bound to a card are carved out of fixed size chunks, so that
+ * binding a card costs a few allocations instead of one per object and
+ * releasing it frees the chunks in one pass. Slots of objects freed
+ * before the card are not reused.
+ */
+#define OBJECT_ARENA_CHUNK	32
+
+struct sc_pkcs15_object_arena {
+	struct sc_pkcs15_object_arena *next;
+	unsigned int used;
+	struct sc_pkcs15_object objects[OBJECT_ARENA_CHUNK];
+};
+
+struct sc_pkcs15_object *
+sc_pkcs15_new_object(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_object *tmpl)
+{
+	struct sc_pkcs15_object_arena *chunk;
+	struct sc_pkcs15_object *obj;
+
+	if (p15card == NULL)
+		return NULL;
+
+	chunk = p15card->obj_arena;
+	if (chunk == NULL || chunk->used >= OBJECT_ARENA_CHUNK) {
+		chunk = sc_mem_calloc(p15card->card ? p15card->card->ctx : NULL,
+				SC_MEM_PKCS15, 1, sizeof(struct sc_pkcs15_object_arena));
+		if (chunk == NULL)
+			return NULL;
+		chunk->next = p15card->obj_arena;
+		p15card->obj_arena = chunk;
+	}
+
+	obj = &chunk->objects[chunk->used++];
+	if (tmpl)
+		memcpy(obj, tmpl, sizeof(*obj));
+	else
+		memset(obj, 0, sizeof(*obj));
+	obj->next = obj->prev = NULL;
+	obj->in_arena = 1;
+
+	return obj;
+}
+
+
+void
+sc_pkcs15_discard_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_object_arena *chunk;
+
+	if (obj == NULL)
+		return;
+	if (!obj->in_arena) {
+		free(obj);
+		return;
+	}
+
+	/* give back the slot if it is the last one handed out */
+	chunk = p15card ? p15card->obj_arena : NULL;
+	if (chunk && chunk->used && obj == &chunk->objects[chunk->used - 1])
+		chunk->used--;
+	memset(obj, 0, sizeof(*obj));
+}
+
+
+static void
+sc_pkcs15_free_object_arena(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_object_arena *chunk, *next;
+
+	for (chunk = p15card->obj_arena; chunk; chunk = next) {
+		next = chunk->next;
+		sc_mem_clear(chunk, sizeof(*chunk));
+		sc_mem_free(chunk);
+	}
+	p15card->obj_arena = NULL;
+}
+
+
+int
+sc_pkcs15_object_refs_df(const struct sc_pkcs15_object *obj, const void *ptr)
+{
+	const u8 *p = ptr;
+
+	if (obj == NULL || obj->df_data == NULL || p == NULL)
+		return 0;
+	return p >= obj->df_data && p < obj->df_data + obj->df_data_len;
+}
+
+
+static void
+sc_pkcs15_free_file_sfids(struct sc_pkcs15_card *p15card)
+{
+	free(p15card->file_sfids);
+	p15card->file_sfids = NULL;
+	p15card->num_file_sfids = 0;
+}
+
+
 void
 sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 {
@@ -776,9 +903,14 @@ sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 		free(p15card->md_data);
 
 	sc_pkcs15_remove_objects(p15card);
+	sc_pkcs15_free_df_buffers(p15card);
+	sc_pkcs15_free_object_arena(p15card);
 	sc_pkcs15_remove_dfs(p15card);
 	sc_pkcs15_free_unusedspace(p15card);
 	p15card->unusedspace_read = 0;
+	sc_pkcs15_cache_release(p15card);
+	sc_pkcs15_invalidate_files(p15card);
+	sc_pkcs15_free_file_sfids(p15card);
 
 	sc_file_free(p15card->file_app);
 	sc_file_free(p15card->file_tokeninfo);
@@ -806,7 +938,12 @@ sc_pkcs15_card_clear(struct sc_pkcs15_card *p15card)
 	p15card->tokeninfo->flags   = 0;
 
 	sc_pkcs15_remove_objects(p15card);
+	sc_pkcs15_free_df_buffers(p15card);
+	sc_pkcs15_free_object_arena(p15card);
 	sc_pkcs15_remove_dfs(p15card);
+	sc_pkcs15_cache_release(p15card);
+	sc_pkcs15_invalidate_files(p15card);
+	sc_pkcs15_free_file_sfids(p15card);
 
 	p15card->df_list = NULL;
 	sc_file_free(p15card->file_app);
@@ -909,7 +1046,7 @@ struct sc_app_info *
 sc_pkcs15_get_application_by_type(struct sc_card * card, char *app_type)
 {
 	struct sc_app_info *out = NULL;
-	scconf_block *conf_block = NULL;
+	const struct sc_pkcs15_conf *conf;
 	int i, rv;
 
 	if (!card)
@@ -921,27 +1058,20 @@ sc_pkcs15_get_application_by_type(struct sc_card * card, char *app_type)
 			return NULL;
 	}
 
-	conf_block = sc_get_conf_block(card->ctx, "framework", "pkcs15", 1);
-	if (!conf_block)
+	conf = sc_pkcs15_get_conf(card->ctx);
+	if (!conf || !conf->block)
 		return NULL;
 
 	for (i = 0; i < card->app_count; i++)   {
 		struct sc_app_info *app_info = card->app[i];
-		scconf_block **blocks = NULL;
+		const struct sc_pkcs15_conf_app *app;
 		char str_path[SC_MAX_AID_STRING_SIZE];
 
 		sc_bin_to_hex(app_info->aid.value, app_info->aid.len, str_path, sizeof(str_path), 0);
-		blocks = scconf_find_blocks(card->ctx->conf, conf_block, "application", str_path);
-		if (blocks)   {
-			if (blocks[0])   {
-				char *type = (char *)scconf_get_str(blocks[0], "type", app_type);
-				if (!strcmp(type, app_type))   {
-					out = app_info;
-					free(blocks);
-					break;
-				}
-			}
-			free(blocks);
+		app = sc_pkcs15_conf_find_app(conf, str_path);
+		if (app && (!app->type || !strcmp(app->type, app_type)))   {
+			out = app_info;
+			break;
 		}
 	}
 
@@ -1193,15 +1323,160 @@ end:
 }
 
 
+/*
+ * The framework pkcs15 block is consulted for every bound card, EF.DIR
+ * record and token. Its options are parsed once per context, the
+ * configuration does not change while the context exists.
+ */
+static struct sc_pkcs15_conf *
+sc_pkcs15_parse_conf(struct sc_context *ctx)
+{
+	struct sc_pkcs15_conf *conf;
+	scconf_block *block, **blocks;
+	const char *private_certificate;
+	int file_cache_memory;
+	size_t i, n;
+
+	conf = calloc(1, sizeof(struct sc_pkcs15_conf));
+	if (conf == NULL)
+		return NULL;
+
+	conf->opts.use_file_cache = 0;
+	conf->opts.use_pin_cache = 1;
+	conf->opts.pin_cache_counter = 10;
+	conf->opts.pin_cache_ignore_user_consent = 0;
+	conf->opts.zero_copy_decoding = 0;
+	conf->opts.use_cache_service = 0;
+	conf->opts.pin_status_cache_time = 0;
+	conf->opts.file_cache_memory = 256 * 1024;
+	conf->opts.pipeline_df_reads = 0;
+	conf->opts.cache_immutable_files = 0;
+	conf->opts.read_by_sfid = 0;
+	if (0 == strcmp(ctx->app_name, "tokend")) {
+		private_certificate = "ignore";
+		conf->opts.private_certificate = SC_PKCS15_CARD_OPTS_PRIV_CERT_IGNORE;
+	} else {
+		private_certificate = "protect";
+		conf->opts.private_certificate = SC_PKCS15_CARD_OPTS_PRIV_CERT_PROTECT;
+	}
+
+	block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
+	conf->block = block;
+	if (block) {
+		conf->opts.use_file_cache = scconf_get_bool(block, "use_file_caching", conf->opts.use_file_cache);
+		conf->opts.use_pin_cache = scconf_get_bool(block, "use_pin_caching", conf->opts.use_pin_cache);
+		conf->opts.pin_cache_counter = scconf_get_int(block, "pin_cache_counter", conf->opts.pin_cache_counter);
+		conf->opts.pin_cache_ignore_user_consent = scconf_get_bool(block, "pin_cache_ignore_user_consent",
+				conf->opts.pin_cache_ignore_user_consent);
+		conf->opts.zero_copy_decoding = scconf_get_bool(block, "zero_copy_decoding",
+				conf->opts.zero_copy_decoding);
+		conf->opts.use_cache_service = scconf_get_bool(block, "use_file_cache_service",
+				conf->opts.use_cache_service);
+		conf->opts.pin_status_cache_time = scconf_get_int(block, "pin_status_cache_time",
+				conf->opts.pin_status_cache_time);
+		file_cache_memory = scconf_get_int(block, "file_cache_memory",
+				(int)conf->opts.file_cache_memory);
+		conf->opts.file_cache_memory = file_cache_memory > 0 ? (size_t)file_cache_memory : 0;
+		conf->opts.pipeline_df_reads = scconf_get_bool(block, "pipeline_df_reads",
+				conf->opts.pipeline_df_reads);
+		conf->opts.cache_immutable_files = scconf_get_bool(block, "cache_immutable_files",
+				conf->opts.cache_immutable_files);
+		conf->opts.read_by_sfid = scconf_get_bool(block, "read_by_sfid",
+				conf->opts.read_by_sfid);
+		private_certificate = scconf_get_str(block, "private_certificate", private_certificate);
+	}
+	if (0 == strcmp(private_certificate, "protect"))
+		conf->opts.private_certificate = SC_PKCS15_CARD_OPTS_PRIV_CERT_PROTECT;
+	else if (0 == strcmp(private_certificate, "ignore"))
+		conf->opts.private_certificate = SC_PKCS15_CARD_OPTS_PRIV_CERT_IGNORE;
+	else if (0 == strcmp(private_certificate, "declassify"))
+		conf->opts.private_certificate = SC_PKCS15_CARD_OPTS_PRIV_CERT_DECLASSIFY;
+
+	conf->enable_emulation = scconf_get_bool(block, "enable_pkcs15_emulation", 1);
+	conf->try_emulation_first = scconf_get_bool(block, "try_emulation_first", 0);
+	conf->enable_builtin_emulation = scconf_get_bool(block, "enable_builtin_emulation", 1);
+	conf->builtin_emulators = scconf_find_list(block, "builtin_emulators");
+	conf->enable_init_token = scconf_get_bool(block, "pkcs11_enable_InitToken", 0);
+	conf->file_cache_dir = scconf_get_str(block, "file_cache_dir", NULL);
+
+	blocks = block ? scconf_find_blocks(ctx->conf, block, "application", NULL) : NULL;
+	for (n = 0; blocks && blocks[n]; n++)
+		;
+	if (n > 0) {
+		conf->apps = calloc(n, sizeof(struct sc_pkcs15_conf_app));
+		if (conf->apps == NULL) {
+			free(blocks);
+			free(conf);
+			return NULL;
+		}
+		for (i = 0; i < n; i++) {
+			struct sc_pkcs15_conf_app *app = &conf->apps[i];
+
+			app->name = blocks[i]->name ? blocks[i]->name->data : NULL;
+			app->type = scconf_get_str(blocks[i], "type", NULL);
+			app->model = scconf_get_str(blocks[i], "model", NULL);
+			app->disable = scconf_get_str(blocks[i], "disable", NULL) != NULL;
+		}
+		conf->app_count = n;
+	}
+	free(blocks);
+
+	return conf;
+}
+
+
+const struct sc_pkcs15_conf *
+sc_pkcs15_get_conf(struct sc_context *ctx)
+{
+	struct sc_pkcs15_conf *conf;
+
+	if (ctx == NULL)
+		return NULL;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	if (ctx->pkcs15_conf == NULL)
+		ctx->pkcs15_conf = sc_pkcs15_parse_conf(ctx);
+	conf = ctx->pkcs15_conf;
+	sc_mutex_unlock(ctx, ctx->mutex);
+
+	return conf;
+}
+
+
+const struct sc_pkcs15_conf_app *
+sc_pkcs15_conf_find_app(const struct sc_pkcs15_conf *conf, const char *name)
+{
+	size_t i;
+
+	if (conf == NULL || name == NULL)
+		return NULL;
+	for (i = 0; i < conf->app_count; i++)
+		if (conf->apps[i].name && !strcasecmp(conf->apps[i].name, name))
+			return &conf->apps[i];
+	return NULL;
+}
+
+
+void
+sc_pkcs15_conf_free(struct sc_context *ctx)
+{
+	if (ctx->pkcs15_conf == NULL)
+		return;
+	free(ctx->pkcs15_conf->apps);
+	free(ctx->pkcs15_conf);
+	ctx->pkcs15_conf = NULL;
+}
+
+
 int
 sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 		struct sc_pkcs15_card **p15card_out)
 {
 	struct sc_pkcs15_card *p15card = NULL;
 	struct sc_context *ctx;
-	scconf_block *conf_block = NULL;
-	int r, emu_first, enable_emu;
-	const char *private_certificate;
+	const struct sc_pkcs15_conf *conf;
+	unsigned long long apdus;
+	int r;
 
 	if (card == NULL || p15card_out == NULL) {
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -1210,56 +1485,42 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "application(aid:'%s')", aid ? sc_dump_hex(aid->value, aid->len) : "empty");
+	SC_PROBE1(pkcs15_bind_start, card);
 
 	p15card = sc_pkcs15_card_new();
-	if (p15card == NULL)
+	if (p15card == NULL) {
+		SC_PROBE2(pkcs15_bind_done, card, SC_ERROR_OUT_OF_MEMORY);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-
-	p15card->card = card;
-	p15card->opts.use_file_cache = 0;
-	p15card->opts.use_pin_cache = 1;
-	p15card->opts.pin_cache_counter = 10;
-	p15card->opts.pin_cache_ignore_user_consent = 0;
-	if(0 == strcmp(ctx->app_name, "tokend")) {
-		private_certificate = "ignore";
-		p15card->opts.private_certificate = SC_PKCS15_CARD_OPTS_PRIV_CERT_IGNORE;
-	} else {
-		private_certificate = "protect";
-		p15card->opts.private_certificate = SC_PKCS15_CARD_OPTS_PRIV_CERT_PROTECT;
 	}
 
-	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
-	if (conf_block) {
-		p15card->opts.use_file_cache = scconf_get_bool(conf_block, "use_file_caching", p15card->opts.use_file_cache);
-		p15card->opts.use_pin_cache = scconf_get_bool(conf_block, "use_pin_caching", p15card->opts.use_pin_cache);
-		p15card->opts.pin_cache_counter = scconf_get_int(conf_block, "pin_cache_counter", p15card->opts.pin_cache_counter);
-		p15card->opts.pin_cache_ignore_user_consent = scconf_get_bool(conf_block, "pin_cache_ignore_user_consent",
-				p15card->opts.pin_cache_ignore_user_consent);
-		private_certificate = scconf_get_str(conf_block, "private_certificate", private_certificate);
-	}
-	if (0 == strcmp(private_certificate, "protect")) {
-		p15card->opts.private_certificate = SC_PKCS15_CARD_OPTS_PRIV_CERT_PROTECT;
-	} else if (0 == strcmp(private_certificate, "ignore")) {
-		p15card->opts.private_certificate = SC_PKCS15_CARD_OPTS_PRIV_CERT_IGNORE;
-	} else if (0 == strcmp(private_certificate, "declassify")) {
-		p15card->opts.private_certificate = SC_PKCS15_CARD_OPTS_PRIV_CERT_DECLASSIFY;
+	conf = sc_pkcs15_get_conf(ctx);
+	if (conf == NULL) {
+		sc_pkcs15_card_free(p15card);
+		SC_PROBE2(pkcs15_bind_done, card, SC_ERROR_OUT_OF_MEMORY);
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 	}
-	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d private_certificate=%d",
-			p15card->opts.use_file_cache, p15card->opts.use_pin_cache,p15card->opts.pin_cache_counter,
-			p15card->opts.pin_cache_ignore_user_consent, p15card->opts.private_certificate);
+	p15card->card = card;
+	p15card->opts = conf->opts;
+	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_cache_service=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d private_certificate=%d zero_copy_decoding=%d pin_status_cache_time=%d file_cache_memory=%"SC_FORMAT_LEN_SIZE_T"u pipeline_df_reads=%d cache_immutable_files=%d read_by_sfid=%d",
+			p15card->opts.use_file_cache, p15card->opts.use_cache_service,
+			p15card->opts.use_pin_cache,p15card->opts.pin_cache_counter,
+			p15card->opts.pin_cache_ignore_user_consent, p15card->opts.private_certificate,
+			p15card->opts.zero_copy_decoding, p15card->opts.pin_status_cache_time,
+			p15card->opts.file_cache_memory, p15card->opts.pipeline_df_reads,
+			p15card->opts.cache_immutable_files, p15card->opts.read_by_sfid);
 
 	r = sc_lock(card);
 	if (r) {
 		sc_log(ctx, "sc_lock() failed: %s", sc_strerror(r));
 		sc_pkcs15_card_free(p15card);
+		SC_PROBE2(pkcs15_bind_done, card, r);
 		LOG_FUNC_RETURN(ctx, r);
 	}
+	apdus = sc_stats_reader_apdus(card->reader);
 
-	enable_emu = scconf_get_bool(conf_block, "enable_pkcs15_emulation", 1);
-	if (enable_emu) {
+	if (conf->enable_emulation) {
 		sc_log(ctx, "PKCS#15 emulation enabled");
-		emu_first = scconf_get_bool(conf_block, "try_emulation_first", 0);
-		if (emu_first || sc_pkcs15_is_emulation_only(card)) {
+		if (conf->try_emulation_first || sc_pkcs15_is_emulation_only(card)) {
 			r = sc_pkcs15_bind_synthetic(p15card, aid);
 			if (r == SC_SUCCESS)
 				goto done;
@@ -1282,11 +1543,15 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 	}
 done:
 	*p15card_out = p15card;
+	sc_stats_operation(card->reader, &ctx->stats.pkcs15_bind, apdus);
 	sc_unlock(card);
+	SC_PROBE2(pkcs15_bind_done, card, SC_SUCCESS);
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 error:
+	sc_stats_operation(card->reader, &ctx->stats.pkcs15_bind, apdus);
 	sc_unlock(card);
 	sc_pkcs15_card_free(p15card);
+	SC_PROBE2(pkcs15_bind_done, card, r);
 	LOG_FUNC_RETURN(ctx, r);
 }
 
@@ -1307,171 +1572,495 @@ sc_pkcs15_unbind(struct sc_pkcs15_card *p15card)
 }
 
 
-static int
-__sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_mask, unsigned int type,
-			int (*func)(sc_pkcs15_object_t *, void *), void *func_arg,
-			sc_pkcs15_object_t **ret, size_t ret_size)
-{
-	struct sc_pkcs15_object *obj = NULL;
-	struct sc_pkcs15_df	*df = NULL;
-	unsigned int	df_mask = 0;
-	size_t		match_count = 0;
-	int r;
-
-	if (type)
-		class_mask |= SC_PKCS15_TYPE_TO_CLASS(type);
-
-	/* Make sure the class mask we have makes sense */
-	if (class_mask == 0
-			|| (class_mask & ~(
-					SC_PKCS15_SEARCH_CLASS_PRKEY |
-					SC_PKCS15_SEARCH_CLASS_PUBKEY |
-					SC_PKCS15_SEARCH_CLASS_SKEY |
-					SC_PKCS15_SEARCH_CLASS_CERT |
-					SC_PKCS15_SEARCH_CLASS_DATA |
-					SC_PKCS15_SEARCH_CLASS_AUTH))) {
-		LOG_FUNC_RETURN(p15card->card->ctx, SC_ERROR_INVALID_ARGUMENTS);
-	}
-
-	if (class_mask & SC_PKCS15_SEARCH_CLASS_PRKEY)
-		df_mask |= (1 << SC_PKCS15_PRKDF);
-	if (class_mask & SC_PKCS15_SEARCH_CLASS_PUBKEY)
-		df_mask |= (1 << SC_PKCS15_PUKDF) | (1 << SC_PKCS15_PUKDF_TRUSTED);
-	if (class_mask & SC_PKCS15_SEARCH_CLASS_CERT)
-		df_mask |= (1 << SC_PKCS15_CDF) | (1 << SC_PKCS15_CDF_TRUSTED) | (1 << SC_PKCS15_CDF_USEFUL);
-	if (class_mask & SC_PKCS15_SEARCH_CLASS_DATA)
-		df_mask |= (1 << SC_PKCS15_DODF);
-	if (class_mask & SC_PKCS15_SEARCH_CLASS_AUTH)
-		df_mask |= (1 << SC_PKCS15_AODF);
-	if (class_mask & SC_PKCS15_SEARCH_CLASS_SKEY)
-		df_mask |= (1 << SC_PKCS15_SKDF);
-
-	/* Make sure all the DFs we want to search have been
-	 * enumerated. */
-	for (df = p15card->df_list; df != NULL; df = df->next) {
-		if (!(df_mask & (1 << df->type)))   {
-			continue;
-		}
-		if (df->enumerated)
-			continue;
-		/* Enumerate the DF's, so p15card->obj_list is populated. */
-		if (p15card->ops.parse_df)
-			r = p15card->ops.parse_df(p15card, df);
-		else
-			r = sc_pkcs15_parse_df(p15card, df);
-		if (r != SC_SUCCESS)
-			continue;
-	}
-
-	/* And now loop over all objects */
-	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
-		/* Check object type */
-		if (!(class_mask & SC_PKCS15_TYPE_TO_CLASS(obj->type)))
-			continue;
-		if (type != 0
-		 && obj->type != type
-		 && (obj->type & SC_PKCS15_TYPE_CLASS_MASK) != type)
-			continue;
-
-		/* Potential candidate, apply search function */
-		if (func != NULL && func(obj, func_arg) <= 0)
-			continue;
-		/* Okay, we have a match. */
-		match_count++;
-		if (!ret || ret_size <= 0)
-			continue;
-		ret[match_count-1] = obj;
-		if (ret_size <= match_count)
-			break;
-	}
-
-	return match_count;
-}
-
+/*
+ * Index of the objects by class and ID. It is built by the first lookup by
+ * ID and kept up to date by sc_pkcs15_add_object()/sc_pkcs15_remove_object().
+ * The sequence numbers follow the order of obj_list, so that a lookup
+ * returns the same object as a linear search would.
+ */
+#define OBJECT_INDEX_MIN_SIZE	32
 
-int
-sc_pkcs15_get_objects(struct sc_pkcs15_card *p15card, unsigned int type,
-		struct sc_pkcs15_object **ret, size_t ret_size)
-{
-	return sc_pkcs15_get_objects_cond(p15card, type, NULL, NULL, ret, ret_size);
-}
+struct sc_pkcs15_object_index_node {
+	struct sc_pkcs15_object *obj;
+	unsigned long seq;
+	struct sc_pkcs15_object_index_node *next;
+};
 
+struct sc_pkcs15_object_index {
+	struct sc_pkcs15_object_index_node **buckets;
+	size_t size;		/* power of two */
+	size_t count;
+	unsigned long next_seq;
+};
 
-static int
-compare_obj_id(struct sc_pkcs15_object *obj, const struct sc_pkcs15_id *id)
+static const struct sc_pkcs15_id *
+object_index_id(const struct sc_pkcs15_object *obj)
 {
 	void *data = obj->data;
 
+	if (data == NULL)
+		return NULL;
 	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
 	case SC_PKCS15_TYPE_CERT:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_cert_info *) data)->id, id);
+		return &((struct sc_pkcs15_cert_info *) data)->id;
 	case SC_PKCS15_TYPE_PRKEY:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_prkey_info *) data)->id, id);
+		return &((struct sc_pkcs15_prkey_info *) data)->id;
 	case SC_PKCS15_TYPE_PUBKEY:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_pubkey_info *) data)->id, id);
+		return &((struct sc_pkcs15_pubkey_info *) data)->id;
 	case SC_PKCS15_TYPE_SKEY:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_skey_info *) data)->id, id);
+		return &((struct sc_pkcs15_skey_info *) data)->id;
 	case SC_PKCS15_TYPE_AUTH:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_auth_info *) data)->auth_id, id);
+		return &((struct sc_pkcs15_auth_info *) data)->auth_id;
 	case SC_PKCS15_TYPE_DATA_OBJECT:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_data_info *) data)->id, id);
+		return &((struct sc_pkcs15_data_info *) data)->id;
 	}
-	return 0;
+	return NULL;
 }
 
-
-static int
-sc_obj_app_oid(struct sc_pkcs15_object *obj, const struct sc_object_id *app_oid)
+static size_t
+object_index_hash(unsigned int class_type, const struct sc_pkcs15_id *id, size_t size)
 {
-	if ((obj->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_DATA_OBJECT)
-		return sc_compare_oid(&((struct sc_pkcs15_data_info *) obj->data)->app_oid, app_oid);
-	return 0;
-}
+	/* FNV-1a */
+	unsigned long h = 2166136261UL;
+	size_t i, len = id->len > SC_PKCS15_MAX_ID_SIZE ? SC_PKCS15_MAX_ID_SIZE : id->len;
 
+	h = (h ^ (class_type >> 8)) * 16777619UL;
+	for (i = 0; i < len; i++)
+		h = (h ^ id->value[i]) * 16777619UL;
+	return (size_t)(h & (size - 1));
+}
 
 static int
-compare_obj_usage(struct sc_pkcs15_object *obj, unsigned int mask, unsigned int value)
+object_index_resize(struct sc_pkcs15_object_index *index, size_t size)
 {
-	void		*data = obj->data;
-	unsigned int	usage;
+	struct sc_pkcs15_object_index_node **buckets, *node, *next;
+	size_t i, n;
 
-	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
-	case SC_PKCS15_TYPE_PRKEY:
-		usage = ((struct sc_pkcs15_prkey_info *) data)->usage;
-		break;
-	case SC_PKCS15_TYPE_PUBKEY:
-		usage = ((struct sc_pkcs15_pubkey_info *) data)->usage;
-		break;
-	default:
-		return 0;
+	buckets = calloc(size, sizeof *buckets);
+	if (buckets == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	for (i = 0; i < index->size; i++) {
+		for (node = index->buckets[i]; node; node = next) {
+			next = node->next;
+			n = object_index_hash(node->obj->type & SC_PKCS15_TYPE_CLASS_MASK,
+					object_index_id(node->obj), size);
+			node->next = buckets[n];
+			buckets[n] = node;
+		}
 	}
-	return (usage & mask & value) != 0;
+	free(index->buckets);
+	index->buckets = buckets;
+	index->size = size;
+	return SC_SUCCESS;
 }
 
-
 static int
-compare_obj_flags(struct sc_pkcs15_object *obj, unsigned int mask, unsigned int value)
+object_index_insert(struct sc_pkcs15_object_index *index, struct sc_pkcs15_object *obj)
 {
-	struct sc_pkcs15_auth_info *auth_info;
-	unsigned int	flags;
+	struct sc_pkcs15_object_index_node *node;
+	const struct sc_pkcs15_id *id = object_index_id(obj);
+	size_t n;
 
-	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
-	case SC_PKCS15_TYPE_AUTH:
-		auth_info = (struct sc_pkcs15_auth_info *) obj->data;
-		if (auth_info->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN)
-			return 0;
-		flags = auth_info->attrs.pin.flags;
-		break;
-	default:
-		return 0;
-	}
-	return !((flags ^ value) & mask);
-}
+	/* objects without an ID never match a lookup by ID */
+	if (id == NULL)
+		return SC_SUCCESS;
 
+	if (index->count >= index->size
+			&& object_index_resize(index, index->size ? 2 * index->size : OBJECT_INDEX_MIN_SIZE))
+		return SC_ERROR_OUT_OF_MEMORY;
 
-static int
-compare_obj_reference(struct sc_pkcs15_object *obj, int value)
-{
+	node = calloc(1, sizeof *node);
+	if (node == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	node->obj = obj;
+	node->seq = index->next_seq++;
+	n = object_index_hash(obj->type & SC_PKCS15_TYPE_CLASS_MASK, id, index->size);
+	node->next = index->buckets[n];
+	index->buckets[n] = node;
+	index->count++;
+	return SC_SUCCESS;
+}
+
+static int
+object_index_unlink(struct sc_pkcs15_object_index *index, size_t n, struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_object_index_node **node, *found;
+
+	for (node = &index->buckets[n]; *node; node = &(*node)->next) {
+		if ((*node)->obj == obj) {
+			found = *node;
+			*node = found->next;
+			index->count--;
+			free(found);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void
+object_index_remove(struct sc_pkcs15_object_index *index, struct sc_pkcs15_object *obj)
+{
+	const struct sc_pkcs15_id *id = object_index_id(obj);
+	size_t i;
+
+	if (id == NULL || index->size == 0)
+		return;
+	if (object_index_unlink(index, object_index_hash(obj->type & SC_PKCS15_TYPE_CLASS_MASK,
+				id, index->size), obj))
+		return;
+	/* the ID was changed without invalidating the index */
+	for (i = 0; i < index->size; i++)
+		if (object_index_unlink(index, i, obj))
+			return;
+}
+
+static void
+object_index_free(struct sc_pkcs15_object_index *index)
+{
+	struct sc_pkcs15_object_index_node *node, *next;
+	size_t i;
+
+	if (index == NULL)
+		return;
+	for (i = 0; i < index->size; i++) {
+		for (node = index->buckets[i]; node; node = next) {
+			next = node->next;
+			free(node);
+		}
+	}
+	free(index->buckets);
+	free(index);
+}
+
+void
+sc_pkcs15_invalidate_object_index(struct sc_pkcs15_card *p15card)
+{
+	if (p15card == NULL)
+		return;
+	object_index_free(p15card->obj_index);
+	p15card->obj_index = NULL;
+}
+
+static struct sc_pkcs15_object_index *
+object_index_get(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_object_index *index;
+	struct sc_pkcs15_object *obj;
+
+	if (p15card->obj_index)
+		return p15card->obj_index;
+
+	index = calloc(1, sizeof *index);
+	if (index == NULL)
+		return NULL;
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
+		if (object_index_insert(index, obj) != SC_SUCCESS) {
+			object_index_free(index);
+			return NULL;
+		}
+	}
+	p15card->obj_index = index;
+	return index;
+}
+
+static int sc_pkcs15_parse_df_buffer(struct sc_pkcs15_card *, struct sc_pkcs15_df *,
+		u8 *, size_t);
+
+/* A DF read on the I/O thread of the reader, see sc_async_call() */
+struct sc_pkcs15_df_read {
+	struct sc_pkcs15_card *p15card;
+	struct sc_pkcs15_df *df;
+	u8 *buf;
+	size_t len;
+	sc_async_op_t *op;
+};
+
+static int
+sc_pkcs15_df_read_run(void *arg)
+{
+	struct sc_pkcs15_df_read *rd = arg;
+
+	return sc_pkcs15_read_file(rd->p15card, &rd->df->path, &rd->buf, &rd->len);
+}
+
+/* Queue the reads of all the DFs to enumerate at once and decode each one
+ * as soon as it arrived, while the card sends the next ones. Only the I/O
+ * thread uses the card until all reads completed. Returns an error if the
+ * DFs have to be parsed one by one. */
+static int
+sc_pkcs15_parse_dfs_pipelined(struct sc_pkcs15_card *p15card, unsigned int df_mask)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_df_read *rds;
+	struct sc_pkcs15_df *df;
+	size_t i, count = 0;
+	int r;
+
+	for (df = p15card->df_list; df != NULL; df = df->next)
+		if ((df_mask & (1 << df->type)) && !df->enumerated)
+			count++;
+	if (count < 2)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	rds = calloc(count, sizeof *rds);
+	if (rds == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	for (i = 0, df = p15card->df_list; df != NULL; df = df->next) {
+		if (!(df_mask & (1 << df->type)) || df->enumerated)
+			continue;
+		rds[i].p15card = p15card;
+		rds[i].df = df;
+		if (sc_async_call(p15card->card, sc_pkcs15_df_read_run, &rds[i], &rds[i].op) != SC_SUCCESS)
+			break;
+		i++;
+	}
+	count = i;
+	sc_log(ctx, "%"SC_FORMAT_LEN_SIZE_T"u DF reads queued", count);
+
+	for (i = 0; i < count; i++) {
+		r = sc_async_wait(rds[i].op);
+		sc_async_release(rds[i].op);
+		if (r < 0) {
+			sc_log(ctx, "Cannot read DF %s: %s",
+					sc_print_path(&rds[i].df->path), sc_strerror(r));
+			continue;
+		}
+		sc_pkcs15_parse_df_buffer(p15card, rds[i].df, rds[i].buf, rds[i].len);
+	}
+	free(rds);
+
+	/* the DFs which could not be queued are parsed one by one */
+	return SC_SUCCESS;
+}
+
+/* Make sure all the DFs we want to search have been enumerated. */
+static void
+__sc_pkcs15_enumerate_dfs(struct sc_pkcs15_card *p15card, unsigned int class_mask)
+{
+	struct sc_pkcs15_df	*df = NULL;
+	unsigned int	df_mask = 0;
+
+	if (class_mask & SC_PKCS15_SEARCH_CLASS_PRKEY)
+		df_mask |= (1 << SC_PKCS15_PRKDF);
+	if (class_mask & SC_PKCS15_SEARCH_CLASS_PUBKEY)
+		df_mask |= (1 << SC_PKCS15_PUKDF) | (1 << SC_PKCS15_PUKDF_TRUSTED);
+	if (class_mask & SC_PKCS15_SEARCH_CLASS_CERT)
+		df_mask |= (1 << SC_PKCS15_CDF) | (1 << SC_PKCS15_CDF_TRUSTED) | (1 << SC_PKCS15_CDF_USEFUL);
+	if (class_mask & SC_PKCS15_SEARCH_CLASS_DATA)
+		df_mask |= (1 << SC_PKCS15_DODF);
+	if (class_mask & SC_PKCS15_SEARCH_CLASS_AUTH)
+		df_mask |= (1 << SC_PKCS15_AODF);
+	if (class_mask & SC_PKCS15_SEARCH_CLASS_SKEY)
+		df_mask |= (1 << SC_PKCS15_SKDF);
+
+	if (p15card->opts.pipeline_df_reads && !p15card->ops.parse_df
+			&& sc_pkcs15_parse_dfs_pipelined(p15card, df_mask) == SC_SUCCESS)
+		return;
+
+	for (df = p15card->df_list; df != NULL; df = df->next) {
+		if (!(df_mask & (1 << df->type)))   {
+			continue;
+		}
+		if (df->enumerated)
+			continue;
+		/* Enumerate the DF's, so p15card->obj_list is populated. */
+		if (p15card->ops.parse_df)
+			p15card->ops.parse_df(p15card, df);
+		else
+			sc_pkcs15_parse_df(p15card, df);
+	}
+}
+
+static int
+__sc_pkcs15_type_matches(struct sc_pkcs15_object *obj, unsigned int class_mask, unsigned int type)
+{
+	/* Check object type */
+	if (!(class_mask & SC_PKCS15_TYPE_TO_CLASS(obj->type)))
+		return 0;
+	if (type != 0
+	 && obj->type != type
+	 && (obj->type & SC_PKCS15_TYPE_CLASS_MASK) != type)
+		return 0;
+	return 1;
+}
+
+static int compare_obj_key(struct sc_pkcs15_object *obj, void *arg);
+
+/* Find the first object of one class matching a search key with an ID */
+static int
+__sc_pkcs15_search_index(struct sc_pkcs15_card *p15card, unsigned int class_mask, unsigned int type,
+			struct sc_pkcs15_search_key *sk, sc_pkcs15_object_t **ret)
+{
+	struct sc_pkcs15_object_index *index;
+	struct sc_pkcs15_object_index_node *node, *found = NULL;
+	size_t n;
+
+	index = object_index_get(p15card);
+	if (index == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (index->size == 0)
+		return 0;
+
+	n = object_index_hash(type & SC_PKCS15_TYPE_CLASS_MASK, sk->id, index->size);
+	for (node = index->buckets[n]; node; node = node->next) {
+		if (found && found->seq < node->seq)
+			continue;
+		if (!__sc_pkcs15_type_matches(node->obj, class_mask, type))
+			continue;
+		if (compare_obj_key(node->obj, sk) <= 0)
+			continue;
+		found = node;
+	}
+	if (found == NULL)
+		return 0;
+	*ret = found->obj;
+	return 1;
+}
+
+static int
+__sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_mask, unsigned int type,
+			int (*func)(sc_pkcs15_object_t *, void *), void *func_arg,
+			sc_pkcs15_object_t **ret, size_t ret_size)
+{
+	struct sc_pkcs15_object *obj = NULL;
+	size_t		match_count = 0;
+	int r;
+
+	if (type)
+		class_mask |= SC_PKCS15_TYPE_TO_CLASS(type);
+
+	/* Make sure the class mask we have makes sense */
+	if (class_mask == 0
+			|| (class_mask & ~(
+					SC_PKCS15_SEARCH_CLASS_PRKEY |
+					SC_PKCS15_SEARCH_CLASS_PUBKEY |
+					SC_PKCS15_SEARCH_CLASS_SKEY |
+					SC_PKCS15_SEARCH_CLASS_CERT |
+					SC_PKCS15_SEARCH_CLASS_DATA |
+					SC_PKCS15_SEARCH_CLASS_AUTH))) {
+		LOG_FUNC_RETURN(p15card->card->ctx, SC_ERROR_INVALID_ARGUMENTS);
+	}
+
+	__sc_pkcs15_enumerate_dfs(p15card, class_mask);
+
+	/* Single object of a single class by ID: use the index */
+	if (type != 0 && class_mask == (unsigned int) SC_PKCS15_TYPE_TO_CLASS(type)
+			&& func == compare_obj_key && func_arg != NULL
+			&& ((struct sc_pkcs15_search_key *) func_arg)->id != NULL
+			&& ret != NULL && ret_size == 1) {
+		r = __sc_pkcs15_search_index(p15card, class_mask, type,
+				(struct sc_pkcs15_search_key *) func_arg, ret);
+		if (r >= 0)
+			return r;
+	}
+
+	/* And now loop over all objects */
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
+		if (!__sc_pkcs15_type_matches(obj, class_mask, type))
+			continue;
+
+		/* Potential candidate, apply search function */
+		if (func != NULL && func(obj, func_arg) <= 0)
+			continue;
+		/* Okay, we have a match. */
+		match_count++;
+		if (!ret || ret_size <= 0)
+			continue;
+		ret[match_count-1] = obj;
+		if (ret_size <= match_count)
+			break;
+	}
+
+	return match_count;
+}
+
+
+int
+sc_pkcs15_get_objects(struct sc_pkcs15_card *p15card, unsigned int type,
+		struct sc_pkcs15_object **ret, size_t ret_size)
+{
+	return sc_pkcs15_get_objects_cond(p15card, type, NULL, NULL, ret, ret_size);
+}
+
+
+static int
+compare_obj_id(struct sc_pkcs15_object *obj, const struct sc_pkcs15_id *id)
+{
+	void *data = obj->data;
+
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_CERT:
+		return sc_pkcs15_compare_id(&((struct sc_pkcs15_cert_info *) data)->id, id);
+	case SC_PKCS15_TYPE_PRKEY:
+		return sc_pkcs15_compare_id(&((struct sc_pkcs15_prkey_info *) data)->id, id);
+	case SC_PKCS15_TYPE_PUBKEY:
+		return sc_pkcs15_compare_id(&((struct sc_pkcs15_pubkey_info *) data)->id, id);
+	case SC_PKCS15_TYPE_SKEY:
+		return sc_pkcs15_compare_id(&((struct sc_pkcs15_skey_info *) data)->id, id);
+	case SC_PKCS15_TYPE_AUTH:
+		return sc_pkcs15_compare_id(&((struct sc_pkcs15_auth_info *) data)->auth_id, id);
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		return sc_pkcs15_compare_id(&((struct sc_pkcs15_data_info *) data)->id, id);
+	}
+	return 0;
+}
+
+
+static int
+sc_obj_app_oid(struct sc_pkcs15_object *obj, const struct sc_object_id *app_oid)
+{
+	if ((obj->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_DATA_OBJECT)
+		return sc_compare_oid(&((struct sc_pkcs15_data_info *) obj->data)->app_oid, app_oid);
+	return 0;
+}
+
+
+static int
+compare_obj_usage(struct sc_pkcs15_object *obj, unsigned int mask, unsigned int value)
+{
+	void		*data = obj->data;
+	unsigned int	usage;
+
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		usage = ((struct sc_pkcs15_prkey_info *) data)->usage;
+		break;
+	case SC_PKCS15_TYPE_PUBKEY:
+		usage = ((struct sc_pkcs15_pubkey_info *) data)->usage;
+		break;
+	default:
+		return 0;
+	}
+	return (usage & mask & value) != 0;
+}
+
+
+static int
+compare_obj_flags(struct sc_pkcs15_object *obj, unsigned int mask, unsigned int value)
+{
+	struct sc_pkcs15_auth_info *auth_info;
+	unsigned int	flags;
+
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_AUTH:
+		auth_info = (struct sc_pkcs15_auth_info *) obj->data;
+		if (auth_info->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN)
+			return 0;
+		flags = auth_info->attrs.pin.flags;
+		break;
+	default:
+		return 0;
+	}
+	return !((flags ^ value) & mask);
+}
+
+
+static int
+compare_obj_reference(struct sc_pkcs15_object *obj, int value)
+{
 	struct sc_pkcs15_auth_info *auth_info;
 	void		*data = obj->data;
 	int		reference;
@@ -1845,6 +2434,9 @@ sc_pkcs15_add_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *ob
 	if (!obj)
 		return 0;
 	obj->next = obj->prev = NULL;
+	if (p15card->obj_index
+			&& object_index_insert(p15card->obj_index, obj) != SC_SUCCESS)
+		sc_pkcs15_invalidate_object_index(p15card);
 	if (p15card->obj_list == NULL) {
 		p15card->obj_list = obj;
 		return 0;
@@ -1863,7 +2455,13 @@ sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object
 {
 	if (!obj)
 		return;
-	else if (obj->prev == NULL)
+
+	if (p15card->obj_index)
+		object_index_remove(p15card->obj_index, obj);
+	if ((obj->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_CERT)
+		sc_pkcs15_invalidate_certificate(p15card, obj->data);
+
+	if (obj->prev == NULL)
 		p15card->obj_list = obj->next;
 	else
 		obj->prev->next = obj->next;
@@ -1877,6 +2475,8 @@ sc_pkcs15_remove_objects(struct sc_pkcs15_card *p15card)
 {
 	struct sc_pkcs15_object *cur = NULL, *next = NULL;
 
+	sc_pkcs15_invalidate_object_index(p15card);
+	sc_pkcs15_invalidate_certificate(p15card, NULL);
 	if (!p15card || !p15card->obj_list)
 		return;
 	for (cur = p15card->obj_list; cur; cur = next)   {
@@ -1888,11 +2488,40 @@ sc_pkcs15_remove_objects(struct sc_pkcs15_card *p15card)
 }
 
 
+/* Detach the attributes that point into the DF buffer, they are
+ * released together with the card. */
+static void
+sc_pkcs15_drop_df_refs(struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_der *der = NULL;
+
+	if (obj->df_data == NULL || obj->data == NULL)
+		return;
+
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		der = &((struct sc_pkcs15_prkey_info *)obj->data)->subject;
+		break;
+	case SC_PKCS15_TYPE_PUBKEY:
+		der = &((struct sc_pkcs15_pubkey_info *)obj->data)->subject;
+		break;
+	case SC_PKCS15_TYPE_CERT:
+		der = &((struct sc_pkcs15_cert_info *)obj->data)->value;
+		break;
+	}
+	if (der && sc_pkcs15_object_refs_df(obj, der->value)) {
+		der->value = NULL;
+		der->len = 0;
+	}
+}
+
+
 void
 sc_pkcs15_free_object(struct sc_pkcs15_object *obj)
 {
 	if (!obj)
 		return;
+	sc_pkcs15_drop_df_refs(obj);
 	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
 	case SC_PKCS15_TYPE_PRKEY:
 		sc_pkcs15_free_prkey_info((sc_pkcs15_prkey_info_t *)obj->data);
@@ -1920,7 +2549,10 @@ sc_pkcs15_free_object(struct sc_pkcs15_object *obj)
 
 	sc_pkcs15_free_object_content(obj);
 
-	free(obj);
+	if (obj->in_arena)
+		memset(obj, 0, sizeof(*obj));
+	else
+		free(obj);
 }
 
 
@@ -2039,63 +2671,98 @@ sc_pkcs15_encode_df(struct sc_context *ctx, struct sc_pkcs15_card *p15card, stru
 }
 
 
+typedef int (*sc_pkcs15_df_decoder_t)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
+		const u8 **nbuf, size_t *nbufsize);
+
+static sc_pkcs15_df_decoder_t
+sc_pkcs15_df_decoder(unsigned int type)
+{
+	switch (type) {
+	case SC_PKCS15_PRKDF:
+		return sc_pkcs15_decode_prkdf_entry;
+	case SC_PKCS15_PUKDF:
+		return sc_pkcs15_decode_pukdf_entry;
+	case SC_PKCS15_SKDF:
+		return sc_pkcs15_decode_skdf_entry;
+	case SC_PKCS15_CDF:
+	case SC_PKCS15_CDF_TRUSTED:
+	case SC_PKCS15_CDF_USEFUL:
+		return sc_pkcs15_decode_cdf_entry;
+	case SC_PKCS15_DODF:
+		return sc_pkcs15_decode_dodf_entry;
+	case SC_PKCS15_AODF:
+		return sc_pkcs15_decode_aodf_entry;
+	}
+	return NULL;
+}
+
+
 int
 sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	unsigned char *buf;
-	const unsigned char *p;
 	size_t bufsize;
 	int r;
-	struct sc_pkcs15_object *obj = NULL;
-	int (* func)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
-		     const u8 **nbuf, size_t *nbufsize) = NULL;
 
 	sc_log(ctx, "called; path=%s, type=%d, enum=%d", sc_print_path(&df->path), df->type, df->enumerated);
 
 	if (df->enumerated)
 		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 
-	switch (df->type) {
-	case SC_PKCS15_PRKDF:
-		func = sc_pkcs15_decode_prkdf_entry;
-		break;
-	case SC_PKCS15_PUKDF:
-		func = sc_pkcs15_decode_pukdf_entry;
-		break;
-	case SC_PKCS15_SKDF:
-		func = sc_pkcs15_decode_skdf_entry;
-		break;
-	case SC_PKCS15_CDF:
-	case SC_PKCS15_CDF_TRUSTED:
-	case SC_PKCS15_CDF_USEFUL:
-		func = sc_pkcs15_decode_cdf_entry;
-		break;
-	case SC_PKCS15_DODF:
-		func = sc_pkcs15_decode_dodf_entry;
-		break;
-	case SC_PKCS15_AODF:
-		func = sc_pkcs15_decode_aodf_entry;
-		break;
+	if (sc_pkcs15_df_decoder(df->type) == NULL) {
+		sc_log(ctx, "unknown DF type: %d", df->type);
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
 	}
+	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize);
+	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
+
+	LOG_FUNC_RETURN(ctx, sc_pkcs15_parse_df_buffer(p15card, df, buf, bufsize));
+}
+
+
+/* Decode the content of a DF read from the card, which is freed or kept
+ * by the objects */
+static int
+sc_pkcs15_parse_df_buffer(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df,
+		u8 *buf, size_t bufsize)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	const unsigned char *p;
+	size_t buflen = bufsize;
+	int r = 0, keep_buf = 0;
+	struct sc_pkcs15_object *obj = NULL;
+	struct sc_pkcs15_df_buffer *dfb = NULL;
+	sc_pkcs15_df_decoder_t func = sc_pkcs15_df_decoder(df->type);
+
 	if (func == NULL) {
-		sc_log(ctx, "unknown DF type: %d", df->type);
+		free(buf);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
 	}
-	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize);
-	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
+
+	if (p15card->opts.zero_copy_decoding) {
+		dfb = calloc(1, sizeof(struct sc_pkcs15_df_buffer));
+		if (dfb == NULL) {
+			free(buf);
+			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+		}
+	}
 
 	p = buf;
 	while (bufsize && *p != 0x00) {
 
-		obj = calloc(1, sizeof(struct sc_pkcs15_object));
+		obj = sc_pkcs15_new_object(p15card, NULL);
 		if (obj == NULL) {
 			r = SC_ERROR_OUT_OF_MEMORY;
 			goto ret;
 		}
+		if (dfb) {
+			obj->df_data = buf;
+			obj->df_data_len = buflen;
+		}
 		r = func(p15card, obj, &p, &bufsize);
 		if (r) {
-			free(obj);
+			sc_pkcs15_discard_object(p15card, obj);
 			if (r == SC_ERROR_ASN1_END_OF_CONTENTS) {
 				r = 0;
 				break;
@@ -2109,17 +2776,28 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 		if (r) {
 			if (obj->data)
 				free(obj->data);
-			free(obj);
+			sc_pkcs15_discard_object(p15card, obj);
 			sc_log(ctx, "%s: Error adding object", sc_strerror(r));
 			goto ret;
 		}
+		if (obj->df_data)
+			keep_buf = 1;
 	};
 
 	if (r > 0)
 		r = 0;
 ret:
 	df->enumerated = 1;
-	free(buf);
+	/* objects added so far may reference the buffer, even on error */
+	if (keep_buf) {
+		dfb->data = buf;
+		dfb->len = buflen;
+		dfb->next = p15card->df_buffers;
+		p15card->df_buffers = dfb;
+	} else {
+		free(dfb);
+		free(buf);
+	}
 	LOG_FUNC_RETURN(ctx, r);
 }
 
@@ -2321,27 +2999,444 @@ sc_pkcs15_parse_unusedspace(const unsigned char *buf, size_t buflen, struct sc_p
 }
 
 
+/*
+ * Refcounted, immutable byte buffers. The header sits in front of the
+ * bytes, so a buffer is passed around as a plain data pointer and the
+ * same bytes can travel from the file cache through the parsed objects
+ * up to the final copy into the caller's memory.
+ */
+struct sc_pkcs15_buf {
+	unsigned int refs;
+	size_t len;
+	/* followed by the data */
+};
+
+u8 *
+sc_pkcs15_buf_new(size_t len)
+{
+	struct sc_pkcs15_buf *b;
+
+	b = malloc(sizeof *b + (len ? len : 1));
+	if (b == NULL)
+		return NULL;
+	b->refs = 1;
+	b->len = len;
+	return (u8 *)(b + 1);
+}
+
+const u8 *
+sc_pkcs15_buf_ref(const u8 *buf)
+{
+	if (buf)
+		((struct sc_pkcs15_buf *)buf - 1)->refs++;
+	return buf;
+}
+
+void
+sc_pkcs15_buf_unref(const u8 *buf)
+{
+	struct sc_pkcs15_buf *b;
+
+	if (buf == NULL)
+		return;
+	b = (struct sc_pkcs15_buf *)buf - 1;
+	if (--b->refs == 0)
+		free(b);
+}
+
+void
+sc_pkcs15_der_clear(struct sc_pkcs15_der *der)
+{
+	if (der == NULL)
+		return;
+	if (der->shared)
+		sc_pkcs15_buf_unref(der->value);
+	else
+		free(der->value);
+	der->value = NULL;
+	der->len = 0;
+	der->shared = 0;
+}
+
+/*
+ * Contents of the files read through sc_pkcs15_read_file_ref() are kept in
+ * memory, bounded by opts.file_cache_memory. The contents are handed out
+ * as shared buffers; a file evicted from the list lives on until its last
+ * user released it. Files which can be read without authentication stay
+ * valid for the lifetime of the binding, all others only until the next
+ * PIN command, logout or reset (card->pin_events).
+ */
+struct sc_pkcs15_mem_file {
+	struct sc_pkcs15_mem_file *next;
+	struct sc_path path;
+	int public;
+	unsigned int pin_events;
+	const u8 *data;		/* sc_pkcs15_buf_new() */
+	size_t len;
+};
+
+static void
+mem_file_free(struct sc_pkcs15_mem_file *f)
+{
+	if (f) {
+		sc_pkcs15_buf_unref(f->data);
+		free(f);
+	}
+}
+
+void
+sc_pkcs15_file_unref(const u8 *buf)
+{
+	sc_pkcs15_buf_unref(buf);
+}
+
+void
+sc_pkcs15_invalidate_files(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_mem_file *f, *next;
+
+	if (p15card == NULL)
+		return;
+	for (f = p15card->mem_files; f != NULL; f = next) {
+		next = f->next;
+		mem_file_free(f);
+	}
+	p15card->mem_files = NULL;
+	p15card->mem_files_size = 0;
+}
+
+static int
+mem_file_path_equal(const struct sc_path *a, const struct sc_path *b)
+{
+	return a->type == b->type && a->len == b->len
+		&& a->index == b->index && a->count == b->count
+		&& a->aid.len == b->aid.len
+		&& memcmp(a->value, b->value, a->len) == 0
+		&& memcmp(a->aid.value, b->aid.value, a->aid.len) == 0;
+}
+
+/* Look up a file and move it to the front of the list */
+static struct sc_pkcs15_mem_file *
+mem_file_find(struct sc_pkcs15_card *p15card, const struct sc_path *path)
+{
+	struct sc_pkcs15_mem_file **pp, *f;
+
+	if (p15card->card->cache.foreign_access) {
+		/* an other application may have changed the card */
+		sc_pkcs15_invalidate_files(p15card);
+		return NULL;
+	}
+
+	for (pp = &p15card->mem_files; (f = *pp) != NULL; pp = &f->next) {
+		if (!mem_file_path_equal(&f->path, path))
+			continue;
+		*pp = f->next;
+		if (!f->public && f->pin_events != p15card->card->pin_events) {
+			p15card->mem_files_size -= f->len;
+			mem_file_free(f);
+			return NULL;
+		}
+		f->next = p15card->mem_files;
+		p15card->mem_files = f;
+		return f;
+	}
+	return NULL;
+}
+
+/* Keep a file, evicting the least recently used ones beyond the budget */
+static void
+mem_file_add(struct sc_pkcs15_card *p15card, struct sc_pkcs15_mem_file *f)
+{
+	struct sc_pkcs15_mem_file **pp, *old;
+	size_t size;
+
+	if (!p15card->opts.file_cache_memory || f->len > p15card->opts.file_cache_memory) {
+		mem_file_free(f);
+		return;
+	}
+
+	f->next = p15card->mem_files;
+	p15card->mem_files = f;
+	p15card->mem_files_size += f->len;
+
+	for (size = 0, pp = &p15card->mem_files; (old = *pp) != NULL; ) {
+		if (size + old->len <= p15card->opts.file_cache_memory) {
+			size += old->len;
+			pp = &old->next;
+			continue;
+		}
+		*pp = old->next;
+		p15card->mem_files_size -= old->len;
+		mem_file_free(old);
+	}
+}
+
+/* Read a transparent EF holding a single DER object: the first chunk
+ * carries the tag and length, the rest of the object is read in maximal
+ * chunks and nothing beyond it. Returns 0 if the file does not start with
+ * a DER header, so that the caller reads it as a whole. The card must be
+ * locked. */
+static int
+sc_pkcs15_read_der_file(struct sc_card *card, const struct sc_file *file,
+		unsigned char **out, size_t *outlen)
+{
+	size_t chunk = sc_get_max_recv_size(card), got, len, total;
+	const u8 *p;
+	unsigned int cla, tag;
+	unsigned char *data, *tmp;
+	int r;
+
+	if (file->size && file->size < chunk)
+		chunk = file->size;
+	data = malloc(chunk);
+	if (data == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	r = sc_read_binary(card, 0, data, chunk, 0);
+	if (r < 0)
+		goto err;
+	got = r;
+
+	p = data;
+	r = sc_asn1_read_tag(&p, got, &cla, &tag, &len);
+	if ((r != SC_SUCCESS && r != SC_ERROR_ASN1_END_OF_CONTENTS) || p == NULL)
+		goto not_der;
+	total = (p - data) + len;
+	if (file->size && total > file->size)
+		goto not_der;
+
+	if (total > got) {
+		tmp = realloc(data, total);
+		if (tmp == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto err;
+		}
+		data = tmp;
+		r = sc_read_binary(card, got, data + got, total - got, 0);
+		if (r < 0)
+			goto err;
+		/* sc_read_binary may return less than requested */
+		total = got + r;
+	}
+
+	*out = data;
+	*outlen = total;
+	return 1;
+
+not_der:
+	sc_log(card->ctx, "no DER object at the start of the file");
+	r = 0;
+err:
+	free(data);
+	return r;
+}
+
+/* Reads the SIMPLE-TLV records of the selected EF into 'data' and strips
+ * their headers. Cards flagged with SC_CARD_FLAG_READ_RECORDS return as
+ * many records per READ RECORD(S) as fit in the response; a record count
+ * from the FCI saves the final failing READ RECORD. */
+static int
+sc_pkcs15_read_records(struct sc_card *card, const struct sc_file *file,
+		unsigned char *data, size_t len)
+{
+	unsigned long flags = SC_RECORD_BY_REC_NR;
+	size_t max_le = sc_get_max_recv_size(card), l, rest, hdr, record_len;
+	unsigned char *head = data, *p;
+	unsigned int i = 1, first;
+	int r;
+
+	if (card->flags & SC_CARD_FLAG_READ_RECORDS)
+		flags |= SC_RECORD_ALL_FROM_NR;
+
+	while (file->record_count == 0 || i <= file->record_count) {
+		l = len - (head - data);
+		if (l > max_le)
+			l = max_le;
+		if (l == 0)
+			break;
+		r = sc_read_record(card, i, head, l, flags);
+		if (r == SC_ERROR_RECORD_NOT_FOUND)
+			break;
+		if (r < 0)
+			return r;
+
+		if (!(flags & SC_RECORD_ALL_FROM_NR)) {
+			/* one record: strip the header, keep the rest */
+			if (r < 2)
+				break;
+			hdr = head[1] == 0xff ? 4 : 2;
+			if ((size_t)r < hdr)
+				break;
+			memmove(head, head + hdr, r - hdr);
+			head += r - hdr;
+			i++;
+			continue;
+		}
+
+		/* consecutive records: a record cut by Le is read again */
+		p = head;
+		rest = r;
+		first = i;
+		while (rest >= 2) {
+			hdr = p[1] == 0xff ? 4 : 2;
+			if (rest < hdr)
+				break;
+			record_len = hdr == 4 ? bebytes2ushort(p + 2) : p[1];
+			if (record_len > rest - hdr)
+				break;
+			memmove(head, p + hdr, record_len);
+			head += record_len;
+			p += hdr + record_len;
+			rest -= hdr + record_len;
+			i++;
+		}
+		if (i == first)
+			break;
+		if (rest == 0 && (size_t)r < l)
+			/* the response had room for more: that was the last one */
+			break;
+	}
+	return (int)(head - data);
+}
+
+/* The EF must be addressed by an absolute path below its DF */
+static int
+sfid_path_usable(const struct sc_path *path)
+{
+	if (path->type != SC_PATH_TYPE_PATH || path->len < 2)
+		return 0;
+	return path->len >= 4 || path->aid.len > 0;
+}
+
+static int
+sfid_path_match(const struct sc_path *file, const struct sc_path *path)
+{
+	return file->len == path->len && !memcmp(file->value, path->value, path->len)
+		&& file->aid.len == path->aid.len
+		&& !memcmp(file->aid.value, path->aid.value, path->aid.len);
+}
+
+int
+sc_pkcs15_set_file_sfid(struct sc_pkcs15_card *p15card, const struct sc_path *path, u8 sfid)
+{
+	struct sc_pkcs15_file_sfid *sfids;
+	size_t i;
+
+	if (p15card == NULL || path == NULL || sfid == 0 || sfid > 30)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (!sfid_path_usable(path))
+		return SC_ERROR_NOT_SUPPORTED;
+
+	for (i = 0; i < p15card->num_file_sfids; i++) {
+		if (sfid_path_match(&p15card->file_sfids[i].path, path)) {
+			p15card->file_sfids[i].sfid = sfid;
+			return SC_SUCCESS;
+		}
+	}
+
+	sfids = realloc(p15card->file_sfids, (p15card->num_file_sfids + 1) * sizeof(*sfids));
+	if (sfids == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	p15card->file_sfids = sfids;
+	sfids[p15card->num_file_sfids].path = *path;
+	sfids[p15card->num_file_sfids].path.index = 0;
+	sfids[p15card->num_file_sfids].path.count = -1;
+	sfids[p15card->num_file_sfids].sfid = sfid;
+	p15card->num_file_sfids++;
+	return SC_SUCCESS;
+}
+
 int
-sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_path,
+sc_pkcs15_get_file_sfid(const struct sc_pkcs15_card *p15card, const struct sc_path *path)
+{
+	size_t i;
+
+	if (p15card == NULL || path == NULL || !sfid_path_usable(path))
+		return 0;
+
+	for (i = 0; i < p15card->num_file_sfids; i++)
+		if (sfid_path_match(&p15card->file_sfids[i].path, path))
+			return p15card->file_sfids[i].sfid;
+	return 0;
+}
+
+/* Selects the parent DF and reads the whole EF by its short identifier.
+ * Drivers with a read_binary of their own, e.g. for secure messaging, keep
+ * reading after a SELECT. */
+static int
+sc_pkcs15_read_file_sfid(struct sc_pkcs15_card *p15card, const struct sc_path *in_path,
 		unsigned char **buf, size_t *buflen)
+{
+	struct sc_card *card = p15card->card;
+	struct sc_path parent;
+	struct sc_file *df = NULL;
+	int sfid, r;
+
+	if (!p15card->opts.read_by_sfid || in_path->count >= 0)
+		return SC_ERROR_NOT_SUPPORTED;
+	sfid = sc_pkcs15_get_file_sfid(p15card, in_path);
+	if (sfid == 0 || card->ops->read_binary != sc_get_iso7816_driver()->ops->read_binary)
+		return SC_ERROR_NOT_SUPPORTED;
+#ifdef ENABLE_SM
+	if (card->sm_ctx.ops.read_binary)
+		return SC_ERROR_NOT_SUPPORTED;
+#endif
+
+	parent = *in_path;
+	parent.len -= 2;
+	parent.index = 0;
+	parent.count = -1;
+
+	r = sc_lock(card);
+	if (r < 0)
+		return r;
+	/* with the FCI the select cache knows the DF stays current */
+	r = sc_select_file(card, &parent, &df);
+	sc_file_free(df);
+	if (r == SC_SUCCESS)
+		r = iso7816_read_binary_sfid(card, (unsigned char)sfid, buf, buflen);
+	sc_unlock(card);
+
+	if (r < 0) {
+		sc_log(card->ctx, "reading by short EF identifier 0x%02X failed: %s", sfid, sc_strerror(r));
+		free(*buf);
+		*buf = NULL;
+		*buflen = 0;
+		return r;
+	}
+	sc_stats_count(card->ctx, &card->ctx->stats.read_binary_bytes, *buflen);
+	return SC_SUCCESS;
+}
+
+static int
+sc_pkcs15_read_file_uncached(struct sc_pkcs15_card *p15card, const struct sc_path *in_path,
+		unsigned char **buf, size_t *buflen, int *public, unsigned int flags)
 {
 	struct sc_context *ctx;
 	struct sc_file *file = NULL;
 	unsigned char *data = NULL;
 	size_t	len = 0, offset = 0;
-	int	r;
+	int	r, use_file_cache;
 
 	if (p15card == NULL || p15card->card == NULL || in_path == NULL || buf == NULL) {
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 	ctx = p15card->card->ctx;
+	use_file_cache = p15card->opts.use_file_cache
+		|| (p15card->opts.cache_immutable_files
+			&& sc_pkcs15_file_is_immutable(p15card, in_path));
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "path=%s, index=%u, count=%d", sc_print_path(in_path), in_path->index, in_path->count);
 
+	if (public)
+		*public = 0;
+
 	r = -1; /* file state: not in cache */
-	if (p15card->opts.use_file_cache) {
+	if (use_file_cache) {
 		r = sc_pkcs15_read_cached_file(p15card, in_path, &data, &len);
+		sc_stats_count(ctx, r ? &ctx->stats.file_cache_misses
+				: &ctx->stats.file_cache_hits, 1);
 
 		if (!r && in_path->aid.len > 0 && in_path->len >= 2)   {
 			struct sc_path parent = *in_path;
@@ -2352,6 +3447,12 @@ sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_pat
 		}
 	}
 
+	if (r && sc_pkcs15_read_file_sfid(p15card, in_path, &data, &len) == SC_SUCCESS) {
+		r = 0;
+		if (len && use_file_cache)
+			sc_pkcs15_cache_file(p15card, in_path, data, len);
+	}
+
 	if (r) {
 		r = sc_lock(p15card->card);
 		if (r)
@@ -2360,6 +3461,19 @@ sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_pat
 		if (r)
 			goto fail_unlock;
 
+		if (p15card->opts.read_by_sfid && file->sid > 0
+				&& file->ef_structure == SC_FILE_EF_TRANSPARENT)
+			sc_pkcs15_set_file_sfid(p15card, in_path, (u8)file->sid);
+
+		if ((flags & SC_PKCS15_READ_DER) && in_path->count < 0
+				&& file->ef_structure == SC_FILE_EF_TRANSPARENT) {
+			r = sc_pkcs15_read_der_file(p15card->card, file, &data, &len);
+			if (r < 0)
+				goto fail_unlock;
+			if (r > 0)
+				goto read_done;
+		}
+
 		/* Handle the case where the ASN.1 Path object specified
 		 * index and length values */
 		if (in_path->count < 0) {
@@ -2385,34 +3499,10 @@ sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_pat
 		}
 
 		if (file->ef_structure == SC_FILE_EF_LINEAR_VARIABLE_TLV) {
-			int i;
-			size_t l, record_len;
-			unsigned char *head = data;
-
-			for (i=1;  ; i++) {
-				l = len - (head - data);
-				if (l > 256) { l = 256; }
-				r = sc_read_record(p15card->card, i, head, l, SC_RECORD_BY_REC_NR);
-				if (r == SC_ERROR_RECORD_NOT_FOUND)
-					break;
-				if (r < 0) {
-					goto fail_unlock;
-				}
-				if (r < 2)
-					break;
-				record_len = head[1];
-				if (record_len != 0xff) {
-					memmove(head,head+2,r-2);
-					head += (r-2);
-				}
-				else {
-					if (r < 4)
-						break;
-					memmove(head,head+4,r-4);
-					head += (r-4);
-				}
-			}
-			len = head-data;
+			r = sc_pkcs15_read_records(p15card->card, file, data, len);
+			if (r < 0)
+				goto fail_unlock;
+			len = r;
 		}
 		else {
 			r = sc_read_binary(p15card->card, offset, data, len, 0);
@@ -2422,11 +3512,16 @@ sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_pat
 			/* sc_read_binary may return less than requested */
 			len = r;
 		}
+read_done:
 		sc_unlock(p15card->card);
 
+		if (public) {
+			const struct sc_acl_entry *acl = sc_file_get_acl_entry(file, SC_AC_OP_READ);
+			*public = acl != NULL && acl->method == SC_AC_NONE;
+		}
 		sc_file_free(file);
 
-		if (len && p15card->opts.use_file_cache) {
+		if (len && use_file_cache) {
 			sc_pkcs15_cache_file(p15card, in_path, data, len);
 		}
 	}
@@ -2443,6 +3538,100 @@ fail:
 }
 
 
+int
+sc_pkcs15_read_file_ref(struct sc_pkcs15_card *p15card, const struct sc_path *in_path,
+		const u8 **buf, size_t *buflen, unsigned int flags)
+{
+	struct sc_pkcs15_mem_file *f;
+	unsigned char *data = NULL;
+	u8 *shared;
+	size_t len = 0;
+	int r, public = 0;
+
+	if (p15card == NULL || p15card->card == NULL || in_path == NULL
+			|| buf == NULL || buflen == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	f = mem_file_find(p15card, in_path);
+	if (f != NULL) {
+		sc_log(p15card->card->ctx, "path=%s read from memory", sc_print_path(in_path));
+		if (in_path->aid.len > 0 && in_path->len >= 2) {
+			/* leave the application selected, as a read from the card would */
+			struct sc_path parent = *in_path;
+
+			parent.len -= 2;
+			parent.type = SC_PATH_TYPE_PATH;
+			r = sc_select_file(p15card->card, &parent, NULL);
+			if (r < 0)
+				return r;
+		}
+		*buf = sc_pkcs15_buf_ref(f->data);
+		*buflen = f->len;
+		return SC_SUCCESS;
+	}
+
+	r = sc_pkcs15_read_file_uncached(p15card, in_path, &data, &len, &public, flags);
+	if (r < 0)
+		return r;
+
+	shared = sc_pkcs15_buf_new(len);
+	f = calloc(1, sizeof *f);
+	if (shared == NULL || f == NULL) {
+		sc_pkcs15_buf_unref(shared);
+		free(f);
+		free(data);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	if (len)
+		memcpy(shared, data, len);
+	free(data);
+
+	f->path = *in_path;
+	f->public = public;
+	f->pin_events = p15card->card->pin_events;
+	f->data = sc_pkcs15_buf_ref(shared);
+	f->len = len;
+	mem_file_add(p15card, f);
+
+	*buf = shared;
+	*buflen = len;
+	return SC_SUCCESS;
+}
+
+
+int
+sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_path,
+		unsigned char **buf, size_t *buflen)
+{
+	const u8 *ref;
+	size_t len;
+	int r;
+
+	if (p15card == NULL || p15card->card == NULL || in_path == NULL || buf == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	if (!p15card->opts.file_cache_memory)
+		return sc_pkcs15_read_file_uncached(p15card, in_path, buf, buflen, NULL, 0);
+
+	r = sc_pkcs15_read_file_ref(p15card, in_path, &ref, &len, 0);
+	if (r < 0)
+		return r;
+
+	/* the caller owns the buffer, so it needs a copy */
+	*buf = malloc(len ? len : 1);
+	if (*buf == NULL) {
+		sc_pkcs15_file_unref(ref);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	if (len)
+		memcpy(*buf, ref, len);
+	*buflen = len;
+	sc_pkcs15_file_unref(ref);
+
+	return SC_SUCCESS;
+}
+
+
 int
 sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1, const struct sc_pkcs15_id *id2)
 {
@@ -2534,7 +3723,10 @@ sc_pkcs15_make_absolute_path(const struct sc_path *parent, struct sc_path *child
 
 void sc_pkcs15_free_object_content(struct sc_pkcs15_object *obj)
 {
-	if (obj->content.value && obj->content.len)   {
+	if (sc_pkcs15_object_refs_df(obj, obj->content.value))   {
+		/* owned by the DF buffer */
+	}
+	else if (obj->content.value && obj->content.len)   {
 		if (SC_PKCS15_TYPE_AUTH & obj->type
 			|| SC_PKCS15_TYPE_SKEY & obj->type
 			|| SC_PKCS15_TYPE_PRKEY & obj->type) {
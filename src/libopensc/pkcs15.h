@@ -131,6 +131,11 @@ struct sc_pkcs15_auth_info {
 
 	int tries_left, max_tries, logged_in;
 	int max_unlocks;
+
+	/* when sc_pkcs15_get_pin_info() last read the status from the card,
+	 * and the value of card->pin_events at that time */
+	unsigned long long status_time;
+	unsigned int status_events;
  };
 typedef struct sc_pkcs15_auth_info sc_pkcs15_auth_info_t;
 
@@ -153,6 +158,9 @@ typedef struct sc_pkcs15_bignum sc_pkcs15_bignum_t;
 struct sc_pkcs15_der {
 	u8 *		value;
 	size_t		len;
+	/* value is a shared sc_pkcs15_buf_new() buffer; only set by the
+	 * library itself, release with sc_pkcs15_der_clear() */
+	int		shared;
 };
 typedef struct sc_pkcs15_der sc_pkcs15_der_t;
 
@@ -293,6 +301,9 @@ struct sc_pkcs15_cert {
 
 	/* DER encoded raw cert */
 	struct sc_pkcs15_der data;
+
+	/* used internally, references of a certificate kept by the card */
+	unsigned int refs;
 };
 typedef struct sc_pkcs15_cert sc_pkcs15_cert_t;
 
@@ -495,6 +506,13 @@ struct sc_pkcs15_object {
 	struct sc_pkcs15_der content;
 
 	int session_object;	/* used internally. if nonzero, object is a session object. */
+
+	/* DF buffer that decoded attributes may point into (zero-copy decoding);
+	 * owned by the card, see sc_pkcs15_object_refs_df() */
+	const u8 *df_data;
+	size_t df_data_len;
+
+	int in_arena;	/* used internally. if nonzero, the struct belongs to the card's object arena */
 };
 typedef struct sc_pkcs15_object sc_pkcs15_object_t;
 
@@ -566,6 +584,10 @@ typedef struct sc_pkcs15_tokeninfo {
 	struct sc_supported_algo_info supported_algos[SC_MAX_SUPPORTED_ALGORITHMS];
 } sc_pkcs15_tokeninfo_t;
 
+struct sc_pkcs15_file_cache;
+struct sc_pkcs15_cert_cache;
+struct sc_pkcs15_mem_file;
+
 struct sc_pkcs15_operations   {
 	int (*parse_df)(struct sc_pkcs15_card *, struct sc_pkcs15_df *);
 	void (*clear)(struct sc_pkcs15_card *);
@@ -573,6 +595,43 @@ struct sc_pkcs15_operations   {
 			unsigned char *, size_t *);
 };
 
+struct sc_pkcs15_card_opts {
+	int use_file_cache;
+	int use_pin_cache;
+	int pin_cache_counter;
+	int pin_cache_ignore_user_consent;
+	int private_certificate;
+	int zero_copy_decoding;
+	int use_cache_service;
+	int pin_status_cache_time;	/* milliseconds, 0 to disable */
+	size_t file_cache_memory;	/* bytes of files kept in memory, 0 to disable */
+	int pipeline_df_reads;		/* read the next DFs while parsing one */
+	int cache_immutable_files;	/* cache the files marked immutable, see sc_pkcs15_set_file_immutable() */
+	int read_by_sfid;		/* read EFs with a known short identifier without SELECT */
+};
+
+/* An "application" block of the framework pkcs15 configuration */
+struct sc_pkcs15_conf_app {
+	const char *name;		/* AID or path in hex */
+	const char *type;		/* "type", or NULL */
+	const char *model;		/* "model", or NULL */
+	int disable;			/* "disable" is set */
+};
+
+/* The framework pkcs15 configuration of a context, see sc_pkcs15_get_conf() */
+struct sc_pkcs15_conf {
+	scconf_block *block;		/* framework pkcs15, or NULL */
+	struct sc_pkcs15_card_opts opts;	/* initial options of bound cards */
+	int enable_emulation;		/* enable_pkcs15_emulation */
+	int try_emulation_first;	/* try_emulation_first */
+	int enable_builtin_emulation;	/* enable_builtin_emulation */
+	const scconf_list *builtin_emulators;	/* builtin_emulators, or NULL */
+	int enable_init_token;		/* pkcs11_enable_InitToken */
+	const char *file_cache_dir;	/* file_cache_dir, or NULL */
+	struct sc_pkcs15_conf_app *apps;
+	size_t app_count;
+};
+
 typedef struct sc_pkcs15_card {
 	sc_card_t *card;
 	unsigned int flags;
@@ -588,18 +647,23 @@ typedef struct sc_pkcs15_card {
 	sc_pkcs15_unusedspace_t *unusedspace_list;
 	int unusedspace_read;
 
-	struct sc_pkcs15_card_opts {
-		int use_file_cache;
-		int use_pin_cache;
-		int pin_cache_counter;
-		int pin_cache_ignore_user_consent;
-		int private_certificate;
-	} opts;
+	struct sc_pkcs15_card_opts opts;
 
 	unsigned int magic;
 
 	void *dll_handle;	/* shared lib for emulated cards */
 	struct sc_md_data *md_data;	/* minidriver specific data */
+	struct sc_pkcs15_file_cache *file_cache;	/* on-disk cache container */
+	struct sc_pkcs15_object_index *obj_index;	/* lookup of obj_list by ID */
+	struct sc_pkcs15_df_buffer *df_buffers;	/* DF contents kept for zero-copy decoding */
+	struct sc_pkcs15_object_arena *obj_arena;	/* storage of the objects bound to the card */
+	struct sc_pkcs15_cert_cache *cert_cache;	/* parsed certificates of the cert objects */
+	struct sc_pkcs15_mem_file *mem_files;	/* file contents, most recently used first */
+	size_t mem_files_size;		/* bytes of file contents in mem_files */
+	struct sc_path *immutable_files;	/* files that never change for this serial number */
+	size_t num_immutable_files;
+	struct sc_pkcs15_file_sfid *file_sfids;	/* short EF identifiers, see sc_pkcs15_set_file_sfid() */
+	size_t num_file_sfids;
 
 	struct sc_pkcs15_operations ops;
 
@@ -631,6 +695,13 @@ typedef struct sc_pkcs15_card {
 #define SC_X509_DECIPHER_ONLY         0x0100UL
 
 
+/* Returns the framework pkcs15 configuration of 'ctx', which is parsed on
+ * the first call and valid as long as the context. NULL without memory. */
+const struct sc_pkcs15_conf *sc_pkcs15_get_conf(struct sc_context *ctx);
+/* Returns the "application" block called 'name' (case insensitive), or NULL */
+const struct sc_pkcs15_conf_app *sc_pkcs15_conf_find_app(const struct sc_pkcs15_conf *conf,
+		const char *name);
+
 /* sc_pkcs15_bind:  Binds a card object to a PKCS #15 card object
  * and initializes a new PKCS #15 card object.  Will return
  * SC_ERROR_PKCS15_APP_NOT_FOUND, if the card hasn't got a
@@ -687,6 +758,17 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 				unsigned long alg_flags, const u8 *in,
 				size_t inlen, u8 *out, size_t outlen);
 
+/* Signing many inputs with one key, see pkcs15-sec.c */
+struct sc_pkcs15_sign_ctx;
+int sc_pkcs15_sign_ctx_init(struct sc_pkcs15_card *p15card,
+				const struct sc_pkcs15_object *prkey_obj,
+				unsigned long alg_flags,
+				struct sc_pkcs15_sign_ctx **sign_ctx);
+int sc_pkcs15_sign_ctx_compute(struct sc_pkcs15_sign_ctx *sign_ctx,
+				const u8 *in, size_t inlen,
+				u8 *out, size_t outlen);
+void sc_pkcs15_sign_ctx_free(struct sc_pkcs15_sign_ctx *sign_ctx);
+
 int sc_pkcs15_read_pubkey(struct sc_pkcs15_card *,
 		const struct sc_pkcs15_object *, struct sc_pkcs15_pubkey **);
 int sc_pkcs15_decode_pubkey_rsa(struct sc_context *,
@@ -723,6 +805,8 @@ int sc_pkcs15_pubkey_from_spki_file(struct sc_context *,
 		char *, struct sc_pkcs15_pubkey ** );
 int sc_pkcs15_pubkey_from_spki_fields(struct sc_context *,
 		struct sc_pkcs15_pubkey **, u8 *, size_t, int);
+int sc_pkcs15_pubkey_from_spki_sequence(struct sc_context *,
+		const unsigned char *, size_t, struct sc_pkcs15_pubkey **);
 int sc_pkcs15_encode_prkey(struct sc_context *,
 		struct sc_pkcs15_prkey *, u8 **, size_t *);
 void sc_pkcs15_free_prkey(struct sc_pkcs15_prkey *prkey);
@@ -743,10 +827,24 @@ int sc_pkcs15_find_data_object_by_name(struct sc_pkcs15_card *p15card,
 				struct sc_pkcs15_object **out);
 void sc_pkcs15_free_data_object(struct sc_pkcs15_data *data_object);
 
+/* The certificates of the card's cert objects are parsed once and shared
+ * by all callers, which must not modify them. Every certificate returned
+ * has to be released with sc_pkcs15_free_certificate(). */
 int sc_pkcs15_read_certificate(struct sc_pkcs15_card *card,
 			       const struct sc_pkcs15_cert_info *info,
 			       struct sc_pkcs15_cert **cert);
+/* Like sc_pkcs15_read_certificate(), for callers that need no more than
+ * the public key, the subject and the extensions of the certificate. With
+ * the file cache enabled these are cached under the hash of the
+ * certificate, and a certificate found there has no other fields set. */
+int sc_pkcs15_read_certificate_key(struct sc_pkcs15_card *card,
+			       const struct sc_pkcs15_cert_info *info,
+			       struct sc_pkcs15_cert **cert);
 void sc_pkcs15_free_certificate(struct sc_pkcs15_cert *cert);
+/* Forget the parsed certificate of a cert object after its content was
+ * changed, or all of them if 'info' is NULL. */
+void sc_pkcs15_invalidate_certificate(struct sc_pkcs15_card *card,
+			       const struct sc_pkcs15_cert_info *info);
 int sc_pkcs15_find_cert_by_id(struct sc_pkcs15_card *card,
 			      const struct sc_pkcs15_id *id,
 			      struct sc_pkcs15_object **out);
@@ -888,10 +986,25 @@ int sc_pkcs15_decode_skdf_entry(struct sc_pkcs15_card *p15card,
 				 struct sc_pkcs15_object *obj,
 				 const u8 **buf, size_t *bufsize);
 
+/* Allocate an object from the card's arena, optionally initialized from
+ * 'tmpl'. The storage is released with the card; sc_pkcs15_free_object()
+ * only frees what the object refers to. */
+struct sc_pkcs15_object *sc_pkcs15_new_object(struct sc_pkcs15_card *p15card,
+			 const struct sc_pkcs15_object *tmpl);
+/* Release an object that never made it into the object list, without
+ * touching its data. */
+void sc_pkcs15_discard_object(struct sc_pkcs15_card *p15card,
+			 struct sc_pkcs15_object *obj);
 int sc_pkcs15_add_object(struct sc_pkcs15_card *p15card,
 			 struct sc_pkcs15_object *obj);
 void sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card,
 			     struct sc_pkcs15_object *obj);
+/* Drop the ID index of the objects, needed after changing the ID of an
+ * object in place. The index is rebuilt by the next lookup. */
+void sc_pkcs15_invalidate_object_index(struct sc_pkcs15_card *p15card);
+/* Nonzero if 'ptr' points into the DF buffer the object was decoded from,
+ * i.e. it is not separately allocated and must not be freed. */
+int sc_pkcs15_object_refs_df(const struct sc_pkcs15_object *obj, const void *ptr);
 int sc_pkcs15_add_df(struct sc_pkcs15_card *, unsigned int, const sc_path_t *);
 
 int sc_pkcs15_add_unusedspace(struct sc_pkcs15_card *p15card,
@@ -917,6 +1030,29 @@ void sc_pkcs15_free_object(struct sc_pkcs15_object *obj);
 int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
 			const struct sc_path *path,
 			u8 **buf, size_t *buflen);
+/* Like sc_pkcs15_read_file(), but hands out a shared, read-only buffer of
+ * the in-memory file cache instead of a copy. The buffer stays valid until
+ * it is released with sc_pkcs15_file_unref(), even if the file is evicted
+ * from the cache meanwhile. */
+int sc_pkcs15_read_file_ref(struct sc_pkcs15_card *p15card,
+			const struct sc_path *path,
+			const u8 **buf, size_t *buflen, unsigned int flags);
+/* The file holds a single DER object: read no more than its encoded
+ * length, whatever size the FCI reports */
+#define SC_PKCS15_READ_DER	0x01
+void sc_pkcs15_file_unref(const u8 *buf);
+
+/* Refcounted, read-only byte buffers, e.g. the ones handed out by
+ * sc_pkcs15_read_file_ref(). sc_pkcs15_buf_new() returns the buffer with
+ * one reference; its contents must not change once it is shared. */
+u8 *sc_pkcs15_buf_new(size_t len);
+const u8 *sc_pkcs15_buf_ref(const u8 *buf);
+void sc_pkcs15_buf_unref(const u8 *buf);
+/* Release the value of a DER blob, shared or not */
+void sc_pkcs15_der_clear(struct sc_pkcs15_der *der);
+/* Drop the in-memory copies of the card's files, e.g. after writing to
+ * the card */
+void sc_pkcs15_invalidate_files(struct sc_pkcs15_card *p15card);
 
 /* Caching functions */
 int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
@@ -925,6 +1061,55 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const struct sc_path *path,
 			 const u8 *buf, size_t bufsize);
+void sc_pkcs15_cache_release(struct sc_pkcs15_card *p15card);
+/* Entries of the cache that are not files of the card, e.g. data derived
+ * from them. Names start with a lower case letter and hold letters, digits
+ * and '-' only. */
+int sc_pkcs15_read_cached_entry(struct sc_pkcs15_card *p15card,
+				const char *name, u8 **buf, size_t *bufsize);
+int sc_pkcs15_cache_entry(struct sc_pkcs15_card *p15card,
+			  const char *name, const u8 *buf, size_t bufsize);
+/* Emulators mark the files whose contents are fixed for the lifetime of
+ * the card, e.g. the certificates and the citizen data of an eID. With
+ * cache_immutable_files, sc_pkcs15_read_file() serves them from the file
+ * cache of the card's serial number after the first read, even without
+ * use_file_caching. The serial number must be set before they are read. */
+int sc_pkcs15_set_file_immutable(struct sc_pkcs15_card *p15card,
+				 const struct sc_path *path);
+int sc_pkcs15_file_is_immutable(const struct sc_pkcs15_card *p15card,
+				const struct sc_path *path);
+
+/* Short EF identifiers of transparent EFs, set by emulators or learned
+ * from the FCI of a first SELECT. With read_by_sfid, sc_pkcs15_read_file()
+ * selects only the parent DF of such an EF, which the select cache usually
+ * skips, and reads the EF with the identifier in P1 of READ BINARY. */
+struct sc_pkcs15_file_sfid {
+	struct sc_path path;
+	u8 sfid;
+};
+int sc_pkcs15_set_file_sfid(struct sc_pkcs15_card *p15card,
+			    const struct sc_path *path, u8 sfid);
+int sc_pkcs15_get_file_sfid(const struct sc_pkcs15_card *p15card,
+			    const struct sc_path *path);
+
+/*
+ * Shared file cache service (opensc-cached). The service keeps the cached
+ * files of all tokens in memory and is reached through a Unix socket in
+ * the cache directory. Every connection carries one request:
+ *
+ *   op (1) | container (2 + n) | key (2 + n) | name (2 + n) [| data (4 + n)]
+ *
+ * where container, key and name identify an entry like in the on-disk
+ * cache and only PUT carries data. The reply is a status byte, followed
+ * by the data (4 + n) for a successful GET. Numbers are big endian.
+ */
+#define SC_PKCS15_CACHE_SERVICE_SOCKET	"cache.sock"
+#define SC_PKCS15_CACHE_SERVICE_GET	'G'
+#define SC_PKCS15_CACHE_SERVICE_PUT	'P'
+#define SC_PKCS15_CACHE_SERVICE_OK	0
+#define SC_PKCS15_CACHE_SERVICE_MISS	1
+#define SC_PKCS15_CACHE_SERVICE_MAX_STRING	256
+#define SC_PKCS15_CACHE_SERVICE_MAX_DATA	0x10000
 
 /* PKCS #15 ID handling functions */
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
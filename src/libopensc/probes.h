@@ -0,0 +1,71 @@
+/*
+ * probes.h: Static tracepoints (USDT) for libopensc and the PKCS#11 module
+ *
+ * Copyright (C) 2026 The OpenSC project
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _SC_PROBES_H
+#define _SC_PROBES_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/*
+ * All probes belong to the "opensc" provider. With --enable-usdt they
+ * compile to a single nop plus a note in .note.stapsdt, which bpftrace,
+ * perf and SystemTap can attach to by name, e.g.
+ *
+ *   bpftrace -e 'usdt:/usr/lib/libopensc.so:opensc:apdu_done { ... }'
+ *
+ * Without --enable-usdt they compile to nothing.
+ *
+ * Probe                 Arguments
+ * apdu_start            card, cla, ins, p1, p2
+ * apdu_done             card, rv, sw1, sw2
+ * lock_start            card
+ * lock_done             card, rv, lock_count
+ * unlock                card, lock_count
+ * card_match            card, driver short name
+ * card_init_done        card, rv, driver short name
+ * pkcs15_bind_start     card
+ * pkcs15_bind_done      card, rv
+ * pkcs11_call           function name
+ * pkcs11_keygen_start   slot id, mechanism
+ * pkcs11_keygen_done    slot id, rv
+ *
+ * The C_* functions are exported under stable names, so their return
+ * values and durations can be taken from a uretprobe on the function
+ * that fired pkcs11_call.
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define SC_PROBE1(name, a)		DTRACE_PROBE1(opensc, name, a)
+#define SC_PROBE2(name, a, b)		DTRACE_PROBE2(opensc, name, a, b)
+#define SC_PROBE3(name, a, b, c)	DTRACE_PROBE3(opensc, name, a, b, c)
+#define SC_PROBE4(name, a, b, c, d)	DTRACE_PROBE4(opensc, name, a, b, c, d)
+#define SC_PROBE5(name, a, b, c, d, e)	DTRACE_PROBE5(opensc, name, a, b, c, d, e)
+#else
+#define SC_PROBE1(name, a)		do { } while (0)
+#define SC_PROBE2(name, a, b)		do { } while (0)
+#define SC_PROBE3(name, a, b, c)	do { } while (0)
+#define SC_PROBE4(name, a, b, c, d)	do { } while (0)
+#define SC_PROBE5(name, a, b, c, d, e)	do { } while (0)
+#endif
+
+#endif
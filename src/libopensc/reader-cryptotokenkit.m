@@ -32,6 +32,13 @@
 struct cryptotokenkit_private_data {
 	TKSmartCardSlot* tksmartcardslot;
 	TKSmartCard* tksmartcard;
+
+	/* The session is kept open for idle_time milliseconds after unlock.
+	 * session_held and the timer ending it belong to idle_queue. */
+	unsigned int idle_time;
+	dispatch_queue_t idle_queue;
+	dispatch_source_t idle_timer;
+	int session_held;
 };
 
 static struct sc_reader_operations cryptotokenkit_ops;
@@ -72,10 +79,86 @@ static int cryptotokenkit_init(sc_context_t *ctx)
 	return SC_SUCCESS;
 }
 
+/* End a session that is kept open, e.g. because the card goes away */
+static void ctk_end_held_session(struct cryptotokenkit_private_data *priv)
+{
+	if (priv->idle_queue == NULL)
+		return;
+	dispatch_sync(priv->idle_queue, ^{
+		if (priv->session_held) {
+			[priv->tksmartcard endSession];
+			priv->session_held = 0;
+		}
+	});
+}
+
+/* Take over a session that is kept open; returns 0 if there is none */
+static int ctk_take_held_session(struct cryptotokenkit_private_data *priv)
+{
+	__block int held = 0;
+
+	if (priv->idle_queue == NULL)
+		return 0;
+	dispatch_sync(priv->idle_queue, ^{
+		held = priv->session_held;
+		priv->session_held = 0;
+		if (priv->idle_timer != NULL)
+			dispatch_source_set_timer(priv->idle_timer, DISPATCH_TIME_FOREVER,
+					DISPATCH_TIME_FOREVER, 0);
+	});
+	return held;
+}
+
+/* Keep the session open for the idle time; returns 0 if it has to be
+ * ended now */
+static int ctk_hold_session(struct cryptotokenkit_private_data *priv)
+{
+	if (priv->idle_queue == NULL) {
+		priv->idle_queue = dispatch_queue_create("org.opensc.cryptotokenkit.idle",
+				DISPATCH_QUEUE_SERIAL);
+		if (priv->idle_queue == NULL)
+			return 0;
+	}
+	if (priv->idle_timer == NULL) {
+		priv->idle_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER,
+				0, 0, priv->idle_queue);
+		if (priv->idle_timer == NULL)
+			return 0;
+		dispatch_source_set_timer(priv->idle_timer, DISPATCH_TIME_FOREVER,
+				DISPATCH_TIME_FOREVER, 0);
+		dispatch_source_set_event_handler(priv->idle_timer, ^{
+			if (priv->session_held) {
+				[priv->tksmartcard endSession];
+				priv->session_held = 0;
+			}
+			dispatch_source_set_timer(priv->idle_timer, DISPATCH_TIME_FOREVER,
+					DISPATCH_TIME_FOREVER, 0);
+		});
+		dispatch_resume(priv->idle_timer);
+	}
+
+	dispatch_sync(priv->idle_queue, ^{
+		priv->session_held = 1;
+		dispatch_source_set_timer(priv->idle_timer,
+				dispatch_time(DISPATCH_TIME_NOW, (int64_t)priv->idle_time * NSEC_PER_MSEC),
+				DISPATCH_TIME_FOREVER, NSEC_PER_MSEC);
+	});
+	return 1;
+}
+
 static int cryptotokenkit_release(sc_reader_t *reader)
 {
 	struct cryptotokenkit_private_data *priv = reader->drv_data;
 
+	ctk_end_held_session(priv);
+	if (priv->idle_timer != NULL) {
+		dispatch_source_cancel(priv->idle_timer);
+		/* wait for a handler that may be running */
+		dispatch_sync(priv->idle_queue, ^{});
+		dispatch_release(priv->idle_timer);
+	}
+	if (priv->idle_queue != NULL)
+		dispatch_release(priv->idle_queue);
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -196,6 +279,7 @@ static int cryptotokenkit_disconnect(sc_reader_t * reader)
 {
 	struct cryptotokenkit_private_data *priv = reader->drv_data;
 
+	ctk_end_held_session(priv);
 	priv->tksmartcard = NULL;
 
 	reader->flags = 0;
@@ -214,11 +298,20 @@ static int cryptotokenkit_lock(sc_reader_t *reader)
 		goto err;
 
 	if (priv->tksmartcard.context == nil) {
+		ctk_end_held_session(priv);
 		r = SC_ERROR_CARD_RESET;
 		priv->tksmartcard.context = @(YES);
 		goto err;
 	}
 
+	if (ctk_take_held_session(priv)) {
+		sc_log(reader->ctx, "%s: session is still open", reader->name);
+		reader->flags |= SC_READER_LOCK_KEPT;
+		r = SC_SUCCESS;
+		goto err;
+	}
+	reader->flags &= ~SC_READER_LOCK_KEPT;
+
 	[priv->tksmartcard beginSessionWithReply:^(BOOL success, NSError *error) {
 		if (success != TRUE) {
 			r = convertError(error);
@@ -242,6 +335,9 @@ static int cryptotokenkit_unlock(sc_reader_t *reader)
 	if (reader->ctx->flags & SC_CTX_FLAG_TERMINATE)
 		return SC_ERROR_NOT_ALLOWED;
 
+	if (priv->idle_time && ctk_hold_session(priv))
+		LOG_FUNC_RETURN(reader->ctx, SC_SUCCESS);
+
 	[priv->tksmartcard endSession];
 
 	LOG_FUNC_RETURN(reader->ctx, SC_SUCCESS);
@@ -516,6 +612,7 @@ int cryptotokenkit_use_reader(sc_context_t *ctx, void *pcsc_context_handle, void
 	if (conf_block) {
 		reader->max_send_size = scconf_get_int(conf_block, "max_send_size", reader->max_send_size);
 		reader->max_recv_size = scconf_get_int(conf_block, "max_recv_size", reader->max_recv_size);
+		priv->idle_time = scconf_get_int(conf_block, "transaction_idle_time", 0);
 	}
 
 	/* attempt to detect protocol in use T0/T1/RAW */
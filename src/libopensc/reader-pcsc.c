@@ -19,6 +19,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_READER
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -26,6 +28,7 @@
 #ifdef ENABLE_PCSC	/* empty file without pcsc */
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -35,6 +38,9 @@
 #else
 #include <arpa/inet.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "common/libscdl.h"
 #include "internal.h"
@@ -97,6 +103,8 @@ void APDU_LOG(u8 *rbuf, uint16_t rsize)
 #define APDU_LOG(rbuf, rsize)
 #endif
 
+struct pcsc_reader_features;
+
 struct pcsc_global_private_data {
 	int cardmod;
 	SCARDCONTEXT pcsc_ctx;
@@ -110,6 +118,10 @@ struct pcsc_global_private_data {
 	DWORD disconnect_action;
 	DWORD transaction_end_action;
 	DWORD reconnect_action;
+	/* keep the transaction open for this long after the last unlock */
+	unsigned int transaction_idle_time;
+	/* connect cards on a context of their own, see pcsc_reader_context() */
+	int per_reader_context;
 	const char *provider_library;
 	void *dlhandle;
 	SCardEstablishContext_t SCardEstablishContext;
@@ -130,10 +142,27 @@ struct pcsc_global_private_data {
 
 	sc_reader_t *attached_reader;
 	sc_reader_t *removed_reader;
+
+	/* results of the feature discovery, see detect_reader_features() */
+	struct pcsc_reader_features *features;
+	const char *feature_cache;
+	int feature_cache_loaded;
+
+	/* reader states of pcsc_wait_for_event(), kept between the calls and
+	 * brought up to date after pcsc_detect_readers() changed the readers,
+	 * see pcsc_sync_wait_states(). Only one caller at a time uses them. */
+	SCARD_READERSTATE *wait_states;
+	sc_reader_t **wait_readers;
+	size_t wait_count, wait_size;
+	DWORD wait_pnp_state;
+	unsigned int readers_changed, wait_synced;
+	int wait_busy;
 };
 
 struct pcsc_private_data {
 	struct pcsc_global_private_data *gpriv;
+	/* -1 unless per_reader_context is enabled and the reader was used */
+	SCARDCONTEXT pcsc_ctx;
 	SCARDHANDLE pcsc_card;
 	SCARD_READERSTATE reader_state;
 	DWORD verify_ioctl;
@@ -150,12 +179,32 @@ struct pcsc_private_data {
 
 	DWORD get_tlv_properties;
 
+	/* reader_state was refreshed for several readers at once */
+	unsigned long long refreshed_at;
+	int refresh_result;
+
 	int locked;
+
+#ifdef HAVE_PTHREAD
+	/* The transaction was not ended by pcsc_unlock(), but is kept open
+	 * until release_at (sc_stats_now()) for the next pcsc_lock(). The
+	 * idle thread ends it when nobody locked the reader in between. */
+	int held;
+	unsigned long long release_at;
+	int idle_thread_running;
+	int idle_thread_stop;
+	pthread_t idle_thread;
+	pthread_mutex_t idle_mutex;
+	pthread_cond_t idle_cond;
+#endif
 };
 
 static int pcsc_detect_card_presence(sc_reader_t *reader);
 static int pcsc_reconnect(sc_reader_t * reader, DWORD action);
 static int pcsc_connect(sc_reader_t *reader);
+#ifdef HAVE_PTHREAD
+static void pcsc_drop_held_transaction(struct pcsc_private_data *priv);
+#endif
 
 static DWORD pcsc_reset_action(const char *str)
 {
@@ -301,18 +350,24 @@ static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 {
 	size_t ssize, rsize, rbuflen = 0;
 	u8 *sbuf = NULL, *rbuf = NULL;
+	u8 short_rbuf[SC_MAX_APDU_RESP_SIZE + 2];
 	int r;
 
 	/* we always use a at least 258 byte size big return buffer
 	 * to mimic the behaviour of the old implementation (some readers
 	 * seems to require a larger than necessary return buffer).
 	 * The buffer for the returned data needs to be at least 2 bytes
-	 * larger than the expected data length to store SW1 and SW2. */
+	 * larger than the expected data length to store SW1 and SW2.
+	 * Short responses are received on the stack. */
 	rsize = rbuflen = apdu->resplen <= 256 ? 258 : apdu->resplen + 2;
-	rbuf     = malloc(rbuflen);
-	if (rbuf == NULL) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto out;
+	if (rbuflen <= sizeof(short_rbuf)) {
+		rbuf = short_rbuf;
+	} else {
+		rbuf = malloc(rbuflen);
+		if (rbuf == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto out;
+		}
 	}
 
 	/* encode and log the APDU */
@@ -341,8 +396,10 @@ out:
 		free(sbuf);
 	}
 	if (rbuf != NULL) {
-		sc_mem_clear(rbuf, rbuflen);
-		free(rbuf);
+		/* only the part the reader has written may hold data */
+		sc_mem_clear(rbuf, rsize < rbuflen ? rsize : rbuflen);
+		if (rbuf != short_rbuf)
+			free(rbuf);
 	}
 
 	return r;
@@ -350,17 +407,9 @@ out:
 
 /* Calls SCardGetStatusChange on the reader to set ATR and associated flags
  * (card present/changed) */
-static int refresh_attributes(sc_reader_t *reader)
+static void prepare_reader_state(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = reader->drv_data;
-	int old_flags = reader->flags;
-	DWORD state, prev_state;
-	LONG rv;
-
-	sc_log(reader->ctx, "%s check", reader->name);
-
-	if (reader->ctx->flags & SC_CTX_FLAG_TERMINATE)
-		return SC_ERROR_NOT_ALLOWED;
 
 	if (priv->reader_state.szReader == NULL || reader->ctx->flags & SC_READER_REMOVED) {
 		priv->reader_state.szReader = reader->name;
@@ -369,8 +418,14 @@ static int refresh_attributes(sc_reader_t *reader)
 	} else {
 		priv->reader_state.dwCurrentState = priv->reader_state.dwEventState;
 	}
+}
 
-	rv = priv->gpriv->SCardGetStatusChange(priv->gpriv->pcsc_ctx, 0, &priv->reader_state, 1);
+/* Updates the reader flags from the result of SCardGetStatusChange() */
+static int apply_reader_state(sc_reader_t *reader, LONG rv)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	int old_flags = reader->flags;
+	DWORD state, prev_state;
 
 	if (rv != SCARD_S_SUCCESS) {
 		if (rv == (LONG)SCARD_E_TIMEOUT) {
@@ -466,17 +521,129 @@ static int refresh_attributes(sc_reader_t *reader)
 	return SC_SUCCESS;
 }
 
+/*
+ * pcsc-lite serializes all calls on one context, so that a long
+ * SCardTransmit() on one reader would block the transmits on all other
+ * readers. With per_reader_context, every reader gets its own context on
+ * first use, and its card handle is connected on it. Status changes of all
+ * readers and the waiting for events remain on the global context.
+ */
+static SCARDCONTEXT pcsc_reader_context(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	struct pcsc_global_private_data *gpriv = priv->gpriv;
+	LONG rv;
+
+	if (!gpriv->per_reader_context || gpriv->cardmod)
+		return gpriv->pcsc_ctx;
+
+	if (priv->pcsc_ctx == (SCARDCONTEXT)-1) {
+		rv = gpriv->SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &priv->pcsc_ctx);
+		if (rv != SCARD_S_SUCCESS) {
+			PCSC_TRACE(reader, "SCardEstablishContext failed, using the global context", rv);
+			priv->pcsc_ctx = -1;
+			return gpriv->pcsc_ctx;
+		}
+	}
+
+	return priv->pcsc_ctx;
+}
+
+static void pcsc_release_reader_context(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+
+	if (priv->pcsc_ctx != (SCARDCONTEXT)-1) {
+		priv->gpriv->SCardReleaseContext(priv->pcsc_ctx);
+		priv->pcsc_ctx = -1;
+	}
+}
+
+static int refresh_attributes(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	LONG rv;
+
+	sc_log(reader->ctx, "%s check", reader->name);
+
+	if (reader->ctx->flags & SC_CTX_FLAG_TERMINATE)
+		return SC_ERROR_NOT_ALLOWED;
+
+	priv->refreshed_at = 0;
+	prepare_reader_state(reader);
+	rv = priv->gpriv->SCardGetStatusChange(priv->gpriv->pcsc_ctx, 0, &priv->reader_state, 1);
+
+	return apply_reader_state(reader, rv);
+}
+
+/* A state refreshed by pcsc_detect_cards_presence() is used once within
+ * this many microseconds instead of asking PC/SC again */
+#define PCSC_REFRESHED_STATE_TIME	500000
+
 static int pcsc_detect_card_presence(sc_reader_t *reader)
 {
+	struct pcsc_private_data *priv = reader->drv_data;
 	int rv;
 	LOG_FUNC_CALLED(reader->ctx);
 
-	rv = refresh_attributes(reader);
+	if (priv->refreshed_at != 0
+			&& sc_stats_now() - priv->refreshed_at < PCSC_REFRESHED_STATE_TIME) {
+		priv->refreshed_at = 0;
+		rv = priv->refresh_result;
+	} else {
+		rv = refresh_attributes(reader);
+	}
 	if (rv != SC_SUCCESS)
 		LOG_FUNC_RETURN(reader->ctx, rv);
 	LOG_FUNC_RETURN(reader->ctx, reader->flags);
 }
 
+static int pcsc_detect_cards_presence(sc_context_t *ctx, sc_reader_t **readers, size_t count)
+{
+	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
+	SCARD_READERSTATE *states;
+	unsigned long long now;
+	size_t i;
+	LONG rv;
+
+	LOG_FUNC_CALLED(ctx);
+
+	if (gpriv == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_NO_READERS_FOUND);
+	if (ctx->flags & SC_CTX_FLAG_TERMINATE)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_ALLOWED);
+
+	states = calloc(count, sizeof *states);
+	if (states == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	for (i = 0; i < count; i++) {
+		struct pcsc_private_data *priv = readers[i]->drv_data;
+
+		prepare_reader_state(readers[i]);
+		states[i] = priv->reader_state;
+	}
+
+	rv = gpriv->SCardGetStatusChange(gpriv->pcsc_ctx, 0, states, (DWORD) count);
+	if (rv != SCARD_S_SUCCESS && rv != (LONG)SCARD_E_TIMEOUT) {
+		/* e.g. one of the readers is gone, they are checked one by one */
+		PCSC_LOG(ctx, "SCardGetStatusChange failed", rv);
+		free(states);
+		LOG_FUNC_RETURN(ctx, pcsc_to_opensc_error(rv));
+	}
+
+	now = sc_stats_now();
+	for (i = 0; i < count; i++) {
+		struct pcsc_private_data *priv = readers[i]->drv_data;
+
+		priv->reader_state = states[i];
+		priv->refresh_result = apply_reader_state(readers[i], rv);
+		priv->refreshed_at = now ? now : 1;
+	}
+	free(states);
+
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
 static int check_forced_protocol(sc_reader_t *reader, DWORD *protocol)
 {
 	scconf_block *atrblock = NULL;
@@ -547,6 +714,9 @@ static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 #ifndef HAVE_PCSCLITE
 	/* reconnect unlocks transaction everywhere but in PCSC-lite */
 	priv->locked = 0;
+#ifdef HAVE_PTHREAD
+	pcsc_drop_held_transaction(priv);
+#endif
 #endif
 
 	rv = priv->gpriv->SCardReconnect(priv->pcsc_card,
@@ -613,13 +783,23 @@ static int pcsc_connect(sc_reader_t *reader)
 
 
 	if (!priv->gpriv->cardmod) {
-		rv = priv->gpriv->SCardConnect(priv->gpriv->pcsc_ctx, reader->name,
+		rv = priv->gpriv->SCardConnect(pcsc_reader_context(reader), reader->name,
 				priv->gpriv->connect_exclusive ? SCARD_SHARE_EXCLUSIVE : SCARD_SHARE_SHARED,
 				protocol, &card_handle, &active_proto);
+		if (priv->pcsc_ctx != (SCARDCONTEXT)-1
+				&& (rv == (LONG)SCARD_E_INVALID_HANDLE
+					|| rv == (LONG)SCARD_E_NO_SERVICE
+					|| rv == (LONG)SCARD_E_SERVICE_STOPPED)) {
+			/* the service was restarted since the context was established */
+			pcsc_release_reader_context(reader);
+			rv = priv->gpriv->SCardConnect(pcsc_reader_context(reader), reader->name,
+					priv->gpriv->connect_exclusive ? SCARD_SHARE_EXCLUSIVE : SCARD_SHARE_SHARED,
+					protocol, &card_handle, &active_proto);
+		}
 #ifdef __APPLE__
 		if (rv == (LONG)SCARD_E_SHARING_VIOLATION) {
 			sleep(1); /* Try again to compete with Tokend probes */
-			rv = priv->gpriv->SCardConnect(priv->gpriv->pcsc_ctx, reader->name,
+			rv = priv->gpriv->SCardConnect(pcsc_reader_context(reader), reader->name,
 					priv->gpriv->connect_exclusive ? SCARD_SHARE_EXCLUSIVE : SCARD_SHARE_SHARED,
 					protocol, &card_handle, &active_proto);
 		}
@@ -664,9 +844,14 @@ static int pcsc_disconnect(sc_reader_t * reader)
 {
 	struct pcsc_private_data *priv = reader->drv_data;
 
+#ifdef HAVE_PTHREAD
+	/* disconnecting ends the transaction */
+	pcsc_drop_held_transaction(priv);
+#endif
 	if (!priv->gpriv->cardmod && !(reader->ctx->flags & SC_CTX_FLAG_TERMINATE)) {
 		LONG rv = priv->gpriv->SCardDisconnect(priv->pcsc_card, priv->gpriv->disconnect_action);
 		PCSC_TRACE(reader, "SCardDisconnect returned", rv);
+		priv->pcsc_card = 0;
 	}
 	reader->flags = 0;
 	return SC_SUCCESS;
@@ -686,6 +871,23 @@ static int pcsc_lock(sc_reader_t *reader)
 	if (reader->ctx->flags & SC_CTX_FLAG_TERMINATE)
 		return SC_ERROR_NOT_ALLOWED;
 
+#ifdef HAVE_PTHREAD
+	if (priv->gpriv->transaction_idle_time) {
+		int held;
+
+		pthread_mutex_lock(&priv->idle_mutex);
+		held = priv->held;
+		priv->held = 0;
+		pthread_mutex_unlock(&priv->idle_mutex);
+		if (held) {
+			sc_log(reader->ctx, "%s: transaction is still open", reader->name);
+			reader->flags |= SC_READER_LOCK_KEPT;
+			return SC_SUCCESS;
+		}
+	}
+#endif
+	reader->flags &= ~SC_READER_LOCK_KEPT;
+
 	rv = priv->gpriv->SCardBeginTransaction(priv->pcsc_card);
 
 
@@ -714,10 +916,20 @@ static int pcsc_lock(sc_reader_t *reader)
 						"pcsc_reconnect failed (%d)", r);
 				return r;
 			}
+			/* The event counter of pcsc-lite only moves on insertion and
+			 * removal. If it moved, this is not the card that was reset but
+			 * a different one, and nothing known about the old card holds. */
+			if (reader->flags & SC_READER_CARD_CHANGED) {
+				sc_log(reader->ctx, "%s: card was replaced", reader->name);
+				return SC_ERROR_CARD_REMOVED;
+			}
 			/* return failure so that upper layers will be notified and try to lock again */
 			return SC_ERROR_CARD_RESET;
 		case SCARD_S_SUCCESS:
 			priv->locked = 1;
+			/* no other application can use a card held exclusively */
+			if (priv->gpriv->connect_exclusive)
+				reader->flags |= SC_READER_LOCK_KEPT;
 			return SC_SUCCESS;
 		default:
 			PCSC_TRACE(reader, "SCardBeginTransaction failed", rv);
@@ -725,6 +937,83 @@ static int pcsc_lock(sc_reader_t *reader)
 	}
 }
 
+#ifdef HAVE_PTHREAD
+static void *pcsc_idle_thread(void *arg)
+{
+	sc_reader_t *reader = arg;
+	struct pcsc_private_data *priv = reader->drv_data;
+	unsigned long long now;
+	struct timespec ts;
+	LONG rv;
+
+	pthread_mutex_lock(&priv->idle_mutex);
+	while (!priv->idle_thread_stop) {
+		if (!priv->held) {
+			pthread_cond_wait(&priv->idle_cond, &priv->idle_mutex);
+			continue;
+		}
+		now = sc_stats_now();
+		if (now < priv->release_at) {
+			unsigned long long wait = priv->release_at - now;
+
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += (time_t)(wait / 1000000);
+			ts.tv_nsec += (long)(wait % 1000000) * 1000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&priv->idle_cond, &priv->idle_mutex, &ts);
+			continue;
+		}
+		rv = priv->gpriv->SCardEndTransaction(priv->pcsc_card,
+				priv->gpriv->transaction_end_action);
+		if (rv != SCARD_S_SUCCESS)
+			PCSC_TRACE(reader, "SCardEndTransaction failed", rv);
+		priv->held = 0;
+		priv->locked = 0;
+	}
+	pthread_mutex_unlock(&priv->idle_mutex);
+	return NULL;
+}
+
+/* Keep the transaction open for the idle time; returns 0 if it has to be
+ * ended now */
+static int pcsc_hold_transaction(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	int held = 1;
+
+	pthread_mutex_lock(&priv->idle_mutex);
+	if (!priv->idle_thread_running) {
+		priv->idle_thread_stop = 0;
+		if (pthread_create(&priv->idle_thread, NULL, pcsc_idle_thread, reader) == 0)
+			priv->idle_thread_running = 1;
+		else
+			held = 0;
+	}
+	if (held) {
+		priv->held = 1;
+		priv->release_at = sc_stats_now()
+			+ (unsigned long long)priv->gpriv->transaction_idle_time * 1000;
+		pthread_cond_signal(&priv->idle_cond);
+	}
+	pthread_mutex_unlock(&priv->idle_mutex);
+	return held;
+}
+
+/* Forget a transaction that is kept open, because the card handle is
+ * going away */
+static void pcsc_drop_held_transaction(struct pcsc_private_data *priv)
+{
+	if (!priv->gpriv->transaction_idle_time)
+		return;
+	pthread_mutex_lock(&priv->idle_mutex);
+	priv->held = 0;
+	pthread_mutex_unlock(&priv->idle_mutex);
+}
+#endif
+
 static int pcsc_unlock(sc_reader_t *reader)
 {
 	LONG rv;
@@ -738,6 +1027,11 @@ static int pcsc_unlock(sc_reader_t *reader)
 	if (reader->ctx->flags & SC_CTX_FLAG_TERMINATE)
 		return SC_ERROR_NOT_ALLOWED;
 
+#ifdef HAVE_PTHREAD
+	if (priv->gpriv->transaction_idle_time && pcsc_hold_transaction(reader))
+		return SC_SUCCESS;
+#endif
+
 	rv = priv->gpriv->SCardEndTransaction(priv->pcsc_card, priv->gpriv->transaction_end_action);
 
 	priv->locked = 0;
@@ -752,6 +1046,25 @@ static int pcsc_release(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = reader->drv_data;
 
+#ifdef HAVE_PTHREAD
+	/* there is no idle thread in a forked child */
+	if (priv->idle_thread_running && !(reader->ctx->flags & SC_CTX_FLAG_TERMINATE)) {
+		pthread_mutex_lock(&priv->idle_mutex);
+		if (priv->held) {
+			priv->gpriv->SCardEndTransaction(priv->pcsc_card,
+					priv->gpriv->transaction_end_action);
+			priv->held = 0;
+		}
+		priv->idle_thread_stop = 1;
+		pthread_cond_signal(&priv->idle_cond);
+		pthread_mutex_unlock(&priv->idle_mutex);
+		pthread_join(priv->idle_thread, NULL);
+	}
+	pthread_cond_destroy(&priv->idle_cond);
+	pthread_mutex_destroy(&priv->idle_mutex);
+#endif
+	if (!(reader->ctx->flags & SC_CTX_FLAG_TERMINATE))
+		pcsc_release_reader_context(reader);
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -871,6 +1184,13 @@ static int pcsc_init(sc_context_t *ctx)
 				"max_send_size", gpriv->force_max_send_size);
 		gpriv->force_max_recv_size = scconf_get_int(conf_block,
 				"max_recv_size", gpriv->force_max_recv_size);
+#ifdef HAVE_PTHREAD
+		gpriv->transaction_idle_time = scconf_get_int(conf_block,
+				"transaction_idle_time", 0);
+#endif
+		gpriv->per_reader_context = scconf_get_bool(conf_block,
+				"per_reader_context", 0);
+		gpriv->feature_cache = scconf_get_str(conf_block, "feature_cache", NULL);
 	}
 
 	if (gpriv->cardmod) {
@@ -881,15 +1201,19 @@ static int pcsc_init(sc_context_t *ctx)
 		gpriv->disconnect_action = SCARD_LEAVE_CARD;
 		gpriv->transaction_end_action = SCARD_LEAVE_CARD;
 		gpriv->reconnect_action = SCARD_LEAVE_CARD;
+		gpriv->transaction_idle_time = 0;
+		gpriv->per_reader_context = 0;
 	}
 	sc_log(ctx,
 			"PC/SC options: connect_exclusive=%d disconnect_action=%u transaction_end_action=%u"
-			" reconnect_action=%u enable_pinpad=%d enable_pace=%d",
+			" reconnect_action=%u enable_pinpad=%d enable_pace=%d transaction_idle_time=%u"
+			" per_reader_context=%d",
 			gpriv->connect_exclusive,
 			(unsigned int)gpriv->disconnect_action,
 			(unsigned int)gpriv->transaction_end_action,
 			(unsigned int)gpriv->reconnect_action, gpriv->enable_pinpad,
-			gpriv->enable_pace);
+			gpriv->enable_pace, gpriv->transaction_idle_time,
+			gpriv->per_reader_context);
 
 	gpriv->dlhandle = sc_dlopen(gpriv->provider_library);
 	if (gpriv->dlhandle == NULL) {
@@ -966,6 +1290,8 @@ out:
 }
 
 
+static void pcsc_free_features(struct pcsc_reader_features *features);
+
 static int pcsc_finish(sc_context_t *ctx)
 {
 	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
@@ -978,6 +1304,9 @@ static int pcsc_finish(sc_context_t *ctx)
 			gpriv->SCardReleaseContext(gpriv->pcsc_ctx);
 		if (gpriv->dlhandle != NULL)
 			sc_dlclose(gpriv->dlhandle);
+		pcsc_free_features(gpriv->features);
+		free(gpriv->wait_states);
+		free(gpriv->wait_readers);
 		free(gpriv);
 	}
 
@@ -1127,7 +1456,179 @@ static int part10_get_vendor_product(struct sc_reader *reader,
 	return SC_SUCCESS;
 }
 
-static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle) {
+/*
+ * Result of the feature discovery of a reader. Pinpad readers take tens
+ * of milliseconds for each of the SCardControl() calls, so the results
+ * are kept per reader for the lifetime of the context and, if
+ * feature_cache is configured, in a file shared by all processes. A
+ * reader is identified by its name, vendor name and IFD version, which
+ * are known without talking to the device.
+ */
+struct pcsc_reader_features {
+	struct pcsc_reader_features *next;
+	char *name;
+	char *vendor;
+	unsigned long ifd_version;
+
+	DWORD verify_ioctl;
+	DWORD verify_ioctl_start;
+	DWORD verify_ioctl_finish;
+	DWORD modify_ioctl;
+	DWORD modify_ioctl_start;
+	DWORD modify_ioctl_finish;
+	DWORD pace_ioctl;
+	DWORD pin_properties_ioctl;
+	DWORD get_tlv_properties;
+
+	int id_vendor, id_product;
+	int display;
+	int pace_detected;	/* pace_capabilities is only probed with enable_pace */
+	unsigned long pace_capabilities;
+	size_t max_data;
+};
+
+#define PCSC_FEATURE_CACHE_FIELDS	17
+
+static void pcsc_free_features(struct pcsc_reader_features *features)
+{
+	while (features) {
+		struct pcsc_reader_features *next = features->next;
+
+		free(features->name);
+		free(features->vendor);
+		free(features);
+		features = next;
+	}
+}
+
+static struct pcsc_reader_features *pcsc_find_features(
+		struct pcsc_global_private_data *gpriv, const char *name,
+		const char *vendor, unsigned long ifd_version)
+{
+	struct pcsc_reader_features *f;
+
+	for (f = gpriv->features; f; f = f->next)
+		if (!strcmp(f->name, name) && !strcmp(f->vendor, vendor)
+				&& f->ifd_version == ifd_version)
+			return f;
+	return NULL;
+}
+
+static void pcsc_load_feature_cache(sc_context_t *ctx,
+		struct pcsc_global_private_data *gpriv)
+{
+	char line[1024];
+	FILE *fp;
+
+	fp = fopen(gpriv->feature_cache, "r");
+	if (!fp)
+		return;
+	while (fgets(line, sizeof line, fp)) {
+		/* name TAB vendor TAB numbers */
+		char *vendor, *numbers, *end;
+		unsigned long v[PCSC_FEATURE_CACHE_FIELDS];
+		struct pcsc_reader_features *f;
+		int i;
+
+		vendor = strchr(line, '\t');
+		numbers = vendor ? strchr(vendor + 1, '\t') : NULL;
+		if (!numbers)
+			continue;
+		*vendor++ = '\0';
+		*numbers++ = '\0';
+		for (i = 0; i < PCSC_FEATURE_CACHE_FIELDS; i++) {
+			v[i] = strtoul(numbers, &end, 16);
+			if (end == numbers)
+				break;
+			numbers = end;
+		}
+		if (i != PCSC_FEATURE_CACHE_FIELDS
+				|| pcsc_find_features(gpriv, line, vendor, v[0]))
+			continue;
+
+		f = calloc(1, sizeof *f);
+		if (!f)
+			break;
+		f->name = strdup(line);
+		f->vendor = strdup(vendor);
+		if (!f->name || !f->vendor) {
+			pcsc_free_features(f);
+			break;
+		}
+		f->ifd_version = v[0];
+		f->verify_ioctl = v[1];
+		f->verify_ioctl_start = v[2];
+		f->verify_ioctl_finish = v[3];
+		f->modify_ioctl = v[4];
+		f->modify_ioctl_start = v[5];
+		f->modify_ioctl_finish = v[6];
+		f->pace_ioctl = v[7];
+		f->pin_properties_ioctl = v[8];
+		f->get_tlv_properties = v[9];
+		f->id_vendor = (int) v[10] - 1;
+		f->id_product = (int) v[11] - 1;
+		f->display = v[12] != 0;
+		f->pace_detected = v[13] != 0;
+		f->pace_capabilities = v[14];
+		f->max_data = v[15];
+		/* v[16] is reserved */
+		f->next = gpriv->features;
+		gpriv->features = f;
+	}
+	fclose(fp);
+	sc_log(ctx, "Loaded reader features from '%s'", gpriv->feature_cache);
+}
+
+static void pcsc_save_feature_cache(sc_context_t *ctx,
+		struct pcsc_global_private_data *gpriv)
+{
+	struct pcsc_reader_features *f;
+	char *tmpname;
+	size_t len;
+	FILE *fp;
+	int r = 0;
+
+	/* write a new file and rename it, so that readers see a complete one */
+	len = strlen(gpriv->feature_cache) + sizeof ".tmp";
+	tmpname = malloc(len);
+	if (!tmpname)
+		return;
+	snprintf(tmpname, len, "%s.tmp", gpriv->feature_cache);
+	fp = fopen(tmpname, "w");
+	if (!fp) {
+		sc_log(ctx, "Cannot write reader feature cache '%s'", tmpname);
+		free(tmpname);
+		return;
+	}
+	for (f = gpriv->features; f && r >= 0; f = f->next) {
+		if (strpbrk(f->name, "\t\n") || strpbrk(f->vendor, "\t\n"))
+			continue;
+		r = fprintf(fp, "%s\t%s\t%lx %lx %lx %lx %lx %lx %lx %lx %lx %lx %x %x %x %x %lx %lx 0\n",
+				f->name, f->vendor, f->ifd_version,
+				(unsigned long) f->verify_ioctl,
+				(unsigned long) f->verify_ioctl_start,
+				(unsigned long) f->verify_ioctl_finish,
+				(unsigned long) f->modify_ioctl,
+				(unsigned long) f->modify_ioctl_start,
+				(unsigned long) f->modify_ioctl_finish,
+				(unsigned long) f->pace_ioctl,
+				(unsigned long) f->pin_properties_ioctl,
+				(unsigned long) f->get_tlv_properties,
+				(unsigned) (f->id_vendor + 1), (unsigned) (f->id_product + 1),
+				(unsigned) f->display, (unsigned) f->pace_detected,
+				f->pace_capabilities, (unsigned long) f->max_data);
+	}
+	if (fclose(fp) != 0 || r < 0 || rename(tmpname, gpriv->feature_cache) != 0) {
+		sc_log(ctx, "Cannot write reader feature cache '%s'", gpriv->feature_cache);
+		remove(tmpname);
+	}
+	free(tmpname);
+}
+
+/* Asks the reader for its features, returns 0 if it does not tell */
+static int probe_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle,
+		struct pcsc_reader_features *f)
+{
 	sc_context_t *ctx = reader->ctx;
 	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
 	struct pcsc_private_data *priv = reader->drv_data;
@@ -1135,25 +1636,18 @@ static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle)
 	DWORD rcount, feature_len, i;
 	PCSC_TLV_STRUCTURE *pcsc_tlv;
 	LONG rv;
-	const char *log_disabled = "but it's disabled in configuration file";
-	int id_vendor = 0, id_product = 0;
-
-	LOG_FUNC_CALLED(ctx);
 
 	sc_log(ctx, "Requesting reader features ... ");
 
-	if (gpriv->SCardControl == NULL)
-		return;
-
 	rv = gpriv->SCardControl(card_handle, CM_IOCTL_GET_FEATURE_REQUEST, NULL, 0, feature_buf, sizeof(feature_buf), &feature_len);
 	if (rv != SCARD_S_SUCCESS) {
 		PCSC_TRACE(reader, "SCardControl failed", rv);
-		return;
+		return 0;
 	}
 
 	if ((feature_len % sizeof(PCSC_TLV_STRUCTURE)) != 0) {
 		sc_log(ctx, "Inconsistent TLV from reader!");
-		return;
+		return 0;
 	}
 
 	/* get the number of elements instead of the complete size */
@@ -1163,71 +1657,50 @@ static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle)
 	for (i = 0; i < feature_len; i++) {
 		sc_log(ctx, "Reader feature %02x found", pcsc_tlv[i].tag);
 		if (pcsc_tlv[i].tag == FEATURE_VERIFY_PIN_DIRECT) {
-			priv->verify_ioctl = ntohl(pcsc_tlv[i].value);
+			f->verify_ioctl = ntohl(pcsc_tlv[i].value);
 		} else if (pcsc_tlv[i].tag == FEATURE_VERIFY_PIN_START) {
-			priv->verify_ioctl_start = ntohl(pcsc_tlv[i].value);
+			f->verify_ioctl_start = ntohl(pcsc_tlv[i].value);
 		} else if (pcsc_tlv[i].tag == FEATURE_VERIFY_PIN_FINISH) {
-			priv->verify_ioctl_finish = ntohl(pcsc_tlv[i].value);
+			f->verify_ioctl_finish = ntohl(pcsc_tlv[i].value);
 		} else if (pcsc_tlv[i].tag == FEATURE_MODIFY_PIN_DIRECT) {
-			priv->modify_ioctl = ntohl(pcsc_tlv[i].value);
+			f->modify_ioctl = ntohl(pcsc_tlv[i].value);
 		} else if (pcsc_tlv[i].tag == FEATURE_MODIFY_PIN_START) {
-			priv->modify_ioctl_start = ntohl(pcsc_tlv[i].value);
+			f->modify_ioctl_start = ntohl(pcsc_tlv[i].value);
 		} else if (pcsc_tlv[i].tag == FEATURE_MODIFY_PIN_FINISH) {
-			priv->modify_ioctl_finish = ntohl(pcsc_tlv[i].value);
+			f->modify_ioctl_finish = ntohl(pcsc_tlv[i].value);
 		} else if (pcsc_tlv[i].tag == FEATURE_IFD_PIN_PROPERTIES) {
-			priv->pin_properties_ioctl = ntohl(pcsc_tlv[i].value);
+			f->pin_properties_ioctl = ntohl(pcsc_tlv[i].value);
 		} else if (pcsc_tlv[i].tag == FEATURE_GET_TLV_PROPERTIES)  {
-			priv->get_tlv_properties = ntohl(pcsc_tlv[i].value);
+			f->get_tlv_properties = ntohl(pcsc_tlv[i].value);
 		} else if (pcsc_tlv[i].tag == FEATURE_EXECUTE_PACE) {
-			priv->pace_ioctl = ntohl(pcsc_tlv[i].value);
+			f->pace_ioctl = ntohl(pcsc_tlv[i].value);
 		} else {
 			sc_log(ctx, "Reader feature %02x is not supported", pcsc_tlv[i].tag);
 		}
 	}
 
-	/* Set reader capabilities based on detected IOCTLs */
-	if (priv->verify_ioctl || (priv->verify_ioctl_start && priv->verify_ioctl_finish)) {
-		const char *log_text = "Reader supports pinpad PIN verification";
-		if (priv->gpriv->enable_pinpad) {
-			sc_log(ctx, "%s", log_text);
-			reader->capabilities |= SC_READER_CAP_PIN_PAD;
-		} else {
-			sc_log(ctx, "%s %s", log_text, log_disabled);
-		}
-	}
-
-	if (priv->modify_ioctl || (priv->modify_ioctl_start && priv->modify_ioctl_finish)) {
-		const char *log_text = "Reader supports pinpad PIN modification";
-		if (priv->gpriv->enable_pinpad) {
-			sc_log(ctx, "%s", log_text);
-			reader->capabilities |= SC_READER_CAP_PIN_PAD;
-		} else {
-			sc_log(ctx, "%s %s", log_text, log_disabled);
-		}
-	}
+	/* the part10 helpers take the IOCTLs from the private data */
+	priv->pace_ioctl = f->pace_ioctl;
+	priv->get_tlv_properties = f->get_tlv_properties;
 
-	/* Some readers claim to have PinPAD support even if they have not */
-	if ((reader->capabilities & SC_READER_CAP_PIN_PAD) &&
-		part10_get_vendor_product(reader, card_handle, &id_vendor, &id_product) == SC_SUCCESS) {
-		/* HID Global OMNIKEY 3x21/6121 Smart Card Reader, fixed in libccid 1.4.29 (remove when last supported OS is using 1.4.29) */
-		if ((id_vendor == 0x076B && id_product == 0x3031) ||
-			(id_vendor == 0x076B && id_product == 0x6632)) {
-			sc_log(ctx, "%s is not pinpad reader, ignoring", reader->name);
-			reader->capabilities &= ~SC_READER_CAP_PIN_PAD;
-		}
+	f->id_vendor = f->id_product = -1;
+	if (f->get_tlv_properties) {
+		/* debug the product and vendor ID of the reader */
+		part10_get_vendor_product(reader, card_handle, &f->id_vendor, &f->id_product);
+		f->max_data = part10_detect_max_data(reader, card_handle);
 	}
 
 	/* Detect display */
-	if (priv->pin_properties_ioctl) {
+	if (f->pin_properties_ioctl) {
 		rcount = sizeof(rbuf);
-		rv = gpriv->SCardControl(card_handle, priv->pin_properties_ioctl, NULL, 0, rbuf, sizeof(rbuf), &rcount);
+		rv = gpriv->SCardControl(card_handle, f->pin_properties_ioctl, NULL, 0, rbuf, sizeof(rbuf), &rcount);
 		if (rv == SCARD_S_SUCCESS) {
 #ifdef PIN_PROPERTIES_v5
 			if (rcount == sizeof(PIN_PROPERTIES_STRUCTURE_v5)) {
 				PIN_PROPERTIES_STRUCTURE_v5 *caps = (PIN_PROPERTIES_STRUCTURE_v5 *)rbuf;
 				if (caps->wLcdLayout > 0) {
 					sc_log(ctx, "Reader has a display: %04X", caps->wLcdLayout);
-					reader->capabilities |= SC_READER_CAP_DISPLAY;
+					f->display = 1;
 				} else
 					sc_log(ctx, "Reader does not have a display.");
 			}
@@ -1236,7 +1709,7 @@ static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle)
 				PIN_PROPERTIES_STRUCTURE *caps = (PIN_PROPERTIES_STRUCTURE *)rbuf;
 				if (caps->wLcdLayout > 0) {
 					sc_log(ctx, "Reader has a display: %04X", caps->wLcdLayout);
-					reader->capabilities |= SC_READER_CAP_DISPLAY;
+					f->display = 1;
 				}
 				else   {
 					sc_log(ctx, "Reader does not have a display.");
@@ -1251,10 +1724,124 @@ static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle)
 		}
 	}
 
+	return 1;
+}
+
+static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle) {
+	sc_context_t *ctx = reader->ctx;
+	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
+	struct pcsc_private_data *priv = reader->drv_data;
+	struct pcsc_reader_features *f;
+	u8 rbuf[SC_MAX_APDU_BUFFER_SIZE];
+	DWORD rcount, i = 0;
+	const char *log_disabled = "but it's disabled in configuration file";
+	int save = 0;
+
+	LOG_FUNC_CALLED(ctx);
+
+	if (gpriv->SCardControl == NULL)
+		return;
+
+	if(gpriv->SCardGetAttrib != NULL) {
+		rcount = sizeof(rbuf);
+		if (gpriv->SCardGetAttrib(card_handle, SCARD_ATTR_VENDOR_NAME,
+					rbuf, &rcount) == SCARD_S_SUCCESS
+				&& rcount > 0) {
+			/* add NUL termination, just in case... */
+			rbuf[(sizeof rbuf)-1] = '\0';
+			free(reader->vendor);
+			reader->vendor = strdup((char *) rbuf);
+		}
+
+		rcount = sizeof i;
+		if(gpriv->SCardGetAttrib(card_handle, SCARD_ATTR_VENDOR_IFD_VERSION,
+					(u8 *) &i, &rcount) == SCARD_S_SUCCESS
+				&& rcount == sizeof i) {
+			reader->version_major = (i >> 24) & 0xFF;
+			reader->version_minor = (i >> 16) & 0xFF;
+		} else {
+			i = 0;
+		}
+	}
+
+	if (gpriv->feature_cache && !gpriv->feature_cache_loaded) {
+		gpriv->feature_cache_loaded = 1;
+		pcsc_load_feature_cache(ctx, gpriv);
+	}
+
+	f = pcsc_find_features(gpriv, reader->name,
+			reader->vendor ? reader->vendor : "", (unsigned long) i);
+	if (f) {
+		sc_log(ctx, "Using known features of reader %s", reader->name);
+	} else {
+		f = calloc(1, sizeof *f);
+		if (!f)
+			return;
+		f->name = strdup(reader->name);
+		f->vendor = strdup(reader->vendor ? reader->vendor : "");
+		f->ifd_version = (unsigned long) i;
+		if (!f->name || !f->vendor || !probe_reader_features(reader, card_handle, f)) {
+			pcsc_free_features(f);
+			return;
+		}
+		f->next = gpriv->features;
+		gpriv->features = f;
+		save = 1;
+	}
+
+	priv->verify_ioctl = f->verify_ioctl;
+	priv->verify_ioctl_start = f->verify_ioctl_start;
+	priv->verify_ioctl_finish = f->verify_ioctl_finish;
+	priv->modify_ioctl = f->modify_ioctl;
+	priv->modify_ioctl_start = f->modify_ioctl_start;
+	priv->modify_ioctl_finish = f->modify_ioctl_finish;
+	priv->pace_ioctl = f->pace_ioctl;
+	priv->pin_properties_ioctl = f->pin_properties_ioctl;
+	priv->get_tlv_properties = f->get_tlv_properties;
+
+	/* Set reader capabilities based on detected IOCTLs */
+	if (priv->verify_ioctl || (priv->verify_ioctl_start && priv->verify_ioctl_finish)) {
+		const char *log_text = "Reader supports pinpad PIN verification";
+		if (priv->gpriv->enable_pinpad) {
+			sc_log(ctx, "%s", log_text);
+			reader->capabilities |= SC_READER_CAP_PIN_PAD;
+		} else {
+			sc_log(ctx, "%s %s", log_text, log_disabled);
+		}
+	}
+
+	if (priv->modify_ioctl || (priv->modify_ioctl_start && priv->modify_ioctl_finish)) {
+		const char *log_text = "Reader supports pinpad PIN modification";
+		if (priv->gpriv->enable_pinpad) {
+			sc_log(ctx, "%s", log_text);
+			reader->capabilities |= SC_READER_CAP_PIN_PAD;
+		} else {
+			sc_log(ctx, "%s %s", log_text, log_disabled);
+		}
+	}
+
+	/* Some readers claim to have PinPAD support even if they have not */
+	if (reader->capabilities & SC_READER_CAP_PIN_PAD) {
+		/* HID Global OMNIKEY 3x21/6121 Smart Card Reader, fixed in libccid 1.4.29 (remove when last supported OS is using 1.4.29) */
+		if ((f->id_vendor == 0x076B && f->id_product == 0x3031) ||
+			(f->id_vendor == 0x076B && f->id_product == 0x6632)) {
+			sc_log(ctx, "%s is not pinpad reader, ignoring", reader->name);
+			reader->capabilities &= ~SC_READER_CAP_PIN_PAD;
+		}
+	}
+
+	if (f->display)
+		reader->capabilities |= SC_READER_CAP_DISPLAY;
+
 	if (priv->pace_ioctl) {
 		const char *log_text = "Reader supports PACE";
 		if (priv->gpriv->enable_pace) {
-			reader->capabilities |= part10_detect_pace_capabilities(reader, card_handle);
+			if (!f->pace_detected) {
+				f->pace_capabilities = part10_detect_pace_capabilities(reader, card_handle);
+				f->pace_detected = 1;
+				save = 1;
+			}
+			reader->capabilities |= f->pace_capabilities;
 
 			if (reader->capabilities & SC_READER_CAP_PACE_GENERIC)
 				sc_log(ctx, "%s", log_text);
@@ -1267,10 +1854,10 @@ static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle)
 	if (priv->get_tlv_properties) {
 		/* Try to set reader max_send_size and max_recv_size based on
 		 * detected max_data */
-		int max_data = part10_detect_max_data(reader, card_handle);
+		size_t max_data = f->max_data;
 
 		if (max_data > 0) {
-			sc_log(ctx, "Reader supports transceiving %d bytes of data",
+			sc_log(ctx, "Reader supports transceiving %"SC_FORMAT_LEN_SIZE_T"u bytes of data",
 					max_data);
 			if (!priv->gpriv->force_max_send_size)
 				reader->max_send_size = max_data;
@@ -1286,29 +1873,10 @@ static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle)
 			sc_log(ctx, "Assuming that the reader supports transceiving "
 					"short length APDUs only");
 		}
-
-		/* debug the product and vendor ID of the reader */
-		part10_get_vendor_product(reader, card_handle, NULL, NULL);
 	}
 
-	if(gpriv->SCardGetAttrib != NULL) {
-		rcount = sizeof(rbuf);
-		if (gpriv->SCardGetAttrib(card_handle, SCARD_ATTR_VENDOR_NAME,
-					rbuf, &rcount) == SCARD_S_SUCCESS
-				&& rcount > 0) {
-			/* add NUL termination, just in case... */
-			rbuf[(sizeof rbuf)-1] = '\0';
-			reader->vendor = strdup((char *) rbuf);
-		}
-
-		rcount = sizeof i;
-		if(gpriv->SCardGetAttrib(card_handle, SCARD_ATTR_VENDOR_IFD_VERSION,
-					(u8 *) &i, &rcount) == SCARD_S_SUCCESS
-				&& rcount == sizeof i) {
-			reader->version_major = (i >> 24) & 0xFF;
-			reader->version_minor = (i >> 16) & 0xFF;
-		}
-	}
+	if (save && gpriv->feature_cache)
+		pcsc_save_feature_cache(ctx, gpriv);
 }
 
 int pcsc_add_reader(sc_context_t *ctx,
@@ -1333,6 +1901,11 @@ int pcsc_add_reader(sc_context_t *ctx,
 	}
 
 	priv->gpriv = gpriv;
+	priv->pcsc_ctx = -1;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&priv->idle_mutex, NULL);
+	pthread_cond_init(&priv->idle_cond, NULL);
+#endif
 
 	reader->drv_data = priv;
 	reader->ops = &pcsc_ops;
@@ -1549,12 +2122,82 @@ static int pcsc_detect_readers(sc_context_t *ctx)
 	ret = SC_SUCCESS;
 
 out:
+	if (gpriv->attached_reader || gpriv->removed_reader)
+		gpriv->readers_changed++;
 	free(reader_buf);
 
 	LOG_FUNC_RETURN(ctx, ret);
 }
 
 
+/* Drop the readers that are gone from the kept reader states and append the
+ * new ones, keeping the states of all others. */
+static int pcsc_sync_wait_states(sc_context_t *ctx, struct pcsc_global_private_data *gpriv)
+{
+	size_t i, j, count = sc_ctx_get_reader_count(ctx);
+
+	if (gpriv->wait_states != NULL && gpriv->wait_synced == gpriv->readers_changed)
+		return SC_SUCCESS;
+
+	for (i = 0; i < gpriv->wait_count; ) {
+		for (j = 0; j < count; j++)
+			if (sc_ctx_get_reader(ctx, (unsigned int)j) == gpriv->wait_readers[i])
+				break;
+		if (j < count && !(gpriv->wait_readers[i]->flags & SC_READER_REMOVED)) {
+			i++;
+			continue;
+		}
+		gpriv->wait_count--;
+		memmove(&gpriv->wait_states[i], &gpriv->wait_states[i + 1],
+				(gpriv->wait_count - i) * sizeof *gpriv->wait_states);
+		memmove(&gpriv->wait_readers[i], &gpriv->wait_readers[i + 1],
+				(gpriv->wait_count - i) * sizeof *gpriv->wait_readers);
+	}
+
+	/* room for all readers and the PnP notification */
+	if (gpriv->wait_states == NULL || gpriv->wait_size < count + 1) {
+		SCARD_READERSTATE *states;
+		sc_reader_t **readers;
+
+		states = realloc(gpriv->wait_states, (count + 1) * sizeof *states);
+		if (states == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		gpriv->wait_states = states;
+		readers = realloc(gpriv->wait_readers, (count + 1) * sizeof *readers);
+		if (readers == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		gpriv->wait_readers = readers;
+		gpriv->wait_size = count + 1;
+	}
+
+	for (j = 0; j < count; j++) {
+		sc_reader_t *reader = sc_ctx_get_reader(ctx, (unsigned int)j);
+		struct pcsc_private_data *priv = reader->drv_data;
+		SCARD_READERSTATE *state;
+
+		if (reader->flags & SC_READER_REMOVED)
+			continue;
+		for (i = 0; i < gpriv->wait_count; i++)
+			if (gpriv->wait_readers[i] == reader)
+				break;
+		if (i < gpriv->wait_count)
+			continue;
+
+		state = &gpriv->wait_states[gpriv->wait_count];
+		memset(state, 0, sizeof *state);
+		state->szReader = reader->name;
+		if (priv->reader_state.szReader == NULL)
+			state->dwCurrentState = SCARD_STATE_UNAWARE;
+		else
+			state->dwCurrentState = priv->reader_state.dwEventState;
+		state->dwEventState = SCARD_STATE_UNAWARE;
+		gpriv->wait_readers[gpriv->wait_count++] = reader;
+	}
+
+	gpriv->wait_synced = gpriv->readers_changed;
+	return SC_SUCCESS;
+}
+
 /* Wait for an event to occur.
  */
 static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_reader_t **event_reader, unsigned int *event,
@@ -1565,19 +2208,52 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 	SCARD_READERSTATE *rgReaderStates;
 	size_t i;
 	unsigned int num_watch, count;
-	int r = SC_ERROR_INTERNAL, detect_readers = 0, detected_hotplug = 0;
+	int r = SC_ERROR_INTERNAL, detect_readers = 0, detected_hotplug = 0, shared = 0;
 	DWORD dwtimeout;
 
 	LOG_FUNC_CALLED(ctx);
 
 	if (!event_reader && !event && reader_states)   {
 		sc_log(ctx, "free allocated reader states");
-		free(*reader_states);
+		if (*reader_states == gpriv) {
+			sc_mutex_lock(ctx, ctx->mutex);
+			gpriv->wait_busy = 0;
+			sc_mutex_unlock(ctx, ctx->mutex);
+		} else {
+			free(*reader_states);
+		}
 		*reader_states = NULL;
 		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 	}
 
-	if (reader_states == NULL || *reader_states == NULL) {
+	/* Use the kept reader states unless another caller is waiting on them */
+	if (reader_states && *reader_states == gpriv) {
+		shared = 1;
+	} else if (reader_states == NULL || *reader_states == NULL) {
+		sc_mutex_lock(ctx, ctx->mutex);
+		if (!gpriv->wait_busy)
+			gpriv->wait_busy = shared = 1;
+		sc_mutex_unlock(ctx, ctx->mutex);
+	}
+
+	if (shared) {
+		r = pcsc_sync_wait_states(ctx, gpriv);
+		if (r != SC_SUCCESS) {
+			if (!reader_states || *reader_states != gpriv) {
+				sc_mutex_lock(ctx, ctx->mutex);
+				gpriv->wait_busy = 0;
+				sc_mutex_unlock(ctx, ctx->mutex);
+			}
+			LOG_FUNC_RETURN(ctx, r);
+		}
+		r = SC_ERROR_INTERNAL;
+		if (reader_states)
+			*reader_states = gpriv;
+		rgReaderStates = gpriv->wait_states;
+		num_watch = (unsigned int)gpriv->wait_count;
+		sc_log(ctx, "Trying to watch %d reader%s", num_watch, num_watch == 1 ? "" : "s");
+	}
+	else if (reader_states == NULL || *reader_states == NULL) {
 		rgReaderStates = calloc(sc_ctx_get_reader_count(ctx) + 2, sizeof(SCARD_READERSTATE));
 		if (!rgReaderStates)
 			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
@@ -1600,30 +2276,33 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 			num_watch++;
 		}
 		sc_log(ctx, "Trying to watch %d reader%s", num_watch, num_watch == 1 ? "" : "s");
-		if (event_mask & SC_EVENT_READER_ATTACHED) {
-#ifdef __APPLE__
-			/* OS X 10.6.2 - 10.12.6 do not support PnP notification */
-			sc_log(ctx, "PnP notification not supported");
-			/* Always check on new readers as if a hotplug
-			 * event was detected. This overwrites a
-			 * SC_ERROR_EVENT_TIMEOUT if a new reader is
-			 * detected with SC_SUCCESS. */
-			detect_readers = 1;
-			detected_hotplug = 1;
-#else
-			rgReaderStates[num_watch].szReader = "\\\\?PnP?\\Notification";
-			rgReaderStates[num_watch].dwCurrentState = SCARD_STATE_UNAWARE;
-			rgReaderStates[num_watch].dwEventState = SCARD_STATE_UNAWARE;
-			num_watch++;
-			sc_log(ctx, "Trying to detect new readers");
-#endif
-		}
 	}
 	else {
 		rgReaderStates = (SCARD_READERSTATE *)(*reader_states);
 		for (num_watch = 0; rgReaderStates[num_watch].szReader; num_watch++)
 			sc_log(ctx, "re-use reader '%s'", rgReaderStates[num_watch].szReader);
 	}
+
+	/* watch for new readers, unless a reused array has the entry already */
+	if ((shared || reader_states == NULL || *reader_states == NULL)
+			&& (event_mask & SC_EVENT_READER_ATTACHED)) {
+#ifdef __APPLE__
+		/* OS X 10.6.2 - 10.12.6 do not support PnP notification */
+		sc_log(ctx, "PnP notification not supported");
+		/* Always check on new readers as if a hotplug
+		 * event was detected. This overwrites a
+		 * SC_ERROR_EVENT_TIMEOUT if a new reader is
+		 * detected with SC_SUCCESS. */
+		detect_readers = 1;
+		detected_hotplug = 1;
+#else
+		rgReaderStates[num_watch].szReader = "\\\\?PnP?\\Notification";
+		rgReaderStates[num_watch].dwCurrentState = shared ? gpriv->wait_pnp_state : SCARD_STATE_UNAWARE;
+		rgReaderStates[num_watch].dwEventState = SCARD_STATE_UNAWARE;
+		num_watch++;
+		sc_log(ctx, "Trying to detect new readers");
+#endif
+	}
 #ifndef _WIN32
 	/* Establish a new context, assuming that it is called from a different thread with pcsc-lite */
 	if (gpriv->pcsc_wait_ctx == (SCARDCONTEXT)-1) {
@@ -1808,7 +2487,19 @@ out:
 		}
 	}
 
-	if (detect_readers) {
+	if (shared) {
+		/* the states stay, pcsc_sync_wait_states() catches up with
+		 * the readers detected meanwhile */
+#ifndef __APPLE__
+		if (event_mask & SC_EVENT_READER_ATTACHED)
+			gpriv->wait_pnp_state = rgReaderStates[gpriv->wait_count].dwCurrentState;
+#endif
+		if (!reader_states) {
+			sc_mutex_lock(ctx, ctx->mutex);
+			gpriv->wait_busy = 0;
+			sc_mutex_unlock(ctx, ctx->mutex);
+		}
+	} else if (detect_readers) {
 		free(rgReaderStates);
 		if (reader_states && *reader_states)
 			*reader_states = NULL;
@@ -2453,8 +3144,9 @@ pcsc_perform_pace(struct sc_reader *reader, void *input_pace, void *output_pace)
 	struct establish_pace_channel_input *pace_input = (struct establish_pace_channel_input *) input_pace;
 	struct establish_pace_channel_output *pace_output = (struct establish_pace_channel_output *) output_pace;
 	struct pcsc_private_data *priv;
-	u8 rbuf[SC_MAX_EXT_APDU_BUFFER_SIZE], sbuf[SC_MAX_EXT_APDU_BUFFER_SIZE];
-	size_t rcount = sizeof rbuf, scount = sizeof sbuf;
+	u8 *rbuf = NULL, *sbuf = NULL;
+	size_t rcount = SC_MAX_EXT_APDU_BUFFER_SIZE, scount = SC_MAX_EXT_APDU_BUFFER_SIZE;
+	int r;
 
 	if (!reader || !(reader->capabilities & SC_READER_CAP_PACE_GENERIC))
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -2463,20 +3155,32 @@ pcsc_perform_pace(struct sc_reader *reader, void *input_pace, void *output_pace)
 	if (!priv)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
-	LOG_TEST_RET(reader->ctx,
-			transform_pace_input(pace_input, sbuf, &scount),
-			"Creating EstabishPACEChannel input data");
+	/* two extended APDU buffers are too much for the stack of small
+	 * systems; the PIN is passed in sbuf, so clear it afterwards */
+	sbuf = malloc(scount);
+	rbuf = malloc(rcount);
+	if (!sbuf || !rbuf) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
 
-	LOG_TEST_RET(reader->ctx,
-			pcsc_internal_transmit(reader, sbuf, scount, rbuf, &rcount,
-				priv->pace_ioctl),
-			"Executing EstabishPACEChannel");
+	r = transform_pace_input(pace_input, sbuf, &scount);
+	LOG_TEST_GOTO_ERR(reader->ctx, r, "Creating EstabishPACEChannel input data");
 
-	LOG_TEST_RET(reader->ctx,
-			transform_pace_output(rbuf, rcount, pace_output),
-			"Parsing EstabishPACEChannel output data");
+	r = pcsc_internal_transmit(reader, sbuf, scount, rbuf, &rcount,
+			priv->pace_ioctl);
+	LOG_TEST_GOTO_ERR(reader->ctx, r, "Executing EstabishPACEChannel");
 
-	return SC_SUCCESS;
+	r = transform_pace_output(rbuf, rcount, pace_output);
+	LOG_TEST_GOTO_ERR(reader->ctx, r, "Parsing EstabishPACEChannel output data");
+
+err:
+	if (sbuf) {
+		sc_mem_clear(sbuf, scount);
+		free(sbuf);
+	}
+	free(rbuf);
+	return r;
 }
 
 static void detect_protocol(sc_reader_t *reader, SCARDHANDLE card_handle)
@@ -2558,6 +3262,66 @@ out:
 	LOG_FUNC_RETURN(ctx, ret);
 }
 
+#ifndef _WIN32
+static int pcsc_fork_child(sc_context_t *ctx)
+{
+	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
+	unsigned int i;
+	LONG rv;
+
+	LOG_FUNC_CALLED(ctx);
+
+	if (!gpriv || gpriv->cardmod)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
+
+	/* The handles of the parent are left alone: pcsc-lite would end them
+	 * for the parent as well, if they were released here */
+	rv = gpriv->SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &gpriv->pcsc_ctx);
+	if (rv != SCARD_S_SUCCESS) {
+		PCSC_LOG(ctx, "SCardEstablishContext failed", rv);
+		LOG_FUNC_RETURN(ctx, pcsc_to_opensc_error(rv));
+	}
+	gpriv->pcsc_wait_ctx = -1;
+
+	for (i = 0; i < sc_ctx_get_reader_count(ctx); i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+		struct pcsc_private_data *priv = reader->drv_data;
+		DWORD protocol, active_proto;
+		SCARDHANDLE card_handle;
+
+		/* a transaction of the parent does not belong to the child, and
+		 * neither does its context */
+		priv->locked = 0;
+		priv->pcsc_ctx = -1;
+#ifdef HAVE_PTHREAD
+		/* and neither does its idle thread */
+		priv->held = 0;
+		priv->idle_thread_running = 0;
+		priv->idle_thread_stop = 0;
+		pthread_mutex_init(&priv->idle_mutex, NULL);
+		pthread_cond_init(&priv->idle_cond, NULL);
+#endif
+		if (!priv->pcsc_card)
+			continue;
+
+		protocol = opensc_proto_to_pcsc(reader->active_protocol);
+		if (!protocol)
+			protocol = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
+		rv = gpriv->SCardConnect(pcsc_reader_context(reader), reader->name,
+				gpriv->connect_exclusive ? SCARD_SHARE_EXCLUSIVE : SCARD_SHARE_SHARED,
+				protocol, &card_handle, &active_proto);
+		if (rv != SCARD_S_SUCCESS) {
+			PCSC_TRACE(reader, "SCardConnect failed", rv);
+			priv->pcsc_card = 0;
+			LOG_FUNC_RETURN(ctx, pcsc_to_opensc_error(rv));
+		}
+		priv->pcsc_card = card_handle;
+	}
+
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+#endif
+
 struct sc_reader_driver * sc_get_pcsc_driver(void)
 {
 	pcsc_ops.init = pcsc_init;
@@ -2576,6 +3340,10 @@ struct sc_reader_driver * sc_get_pcsc_driver(void)
 	pcsc_ops.reset = pcsc_reset;
 	pcsc_ops.use_reader = pcsc_use_reader;
 	pcsc_ops.perform_pace = pcsc_perform_pace;
+	pcsc_ops.detect_cards_presence = pcsc_detect_cards_presence;
+#ifndef _WIN32
+	pcsc_ops.fork_child = pcsc_fork_child;
+#endif
 
 	return &pcsc_drv;
 }
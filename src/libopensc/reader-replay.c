@@ -0,0 +1,383 @@
+/*
+ * reader-replay.c: Reader driver replaying recorded APDUs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_READER
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "internal.h"
+
+/*
+ * The replay reader answers every APDU with the response recorded for the
+ * same command, so that the library can be benchmarked without a card.
+ * Two kinds of traces are understood:
+ *
+ *  - a trace written by hand or by a script, one exchange per two lines:
+ *        # comment
+ *        atr 3B 8F 80 01 80 4F 0C A0 00 00 03 06 ...
+ *        > 00 A4 04 00 07 A0 00 00 03 08 00 00
+ *        < 61 11
+ *
+ *  - an OpenSC debug log (debug = 3 or higher), from which the
+ *    "Outgoing APDU" and "Incoming APDU" dumps and the first ATR are taken.
+ *
+ * The responses are looked up starting after the last exchange replayed,
+ * so a command sent several times gets its responses in recorded order.
+ */
+
+#define REPLAY_DEFAULT_NAME	"OpenSC replay reader"
+#define REPLAY_MAX_APDU		(SC_MAX_EXT_APDU_BUFFER_SIZE + 2)
+
+struct replay_exchange {
+	u8 *cmd;
+	size_t cmd_len;
+	u8 *resp;
+	size_t resp_len;
+};
+
+struct replay_global_private_data {
+	const char *filename;
+	unsigned int latency;	/* microseconds added to every APDU */
+	u8 atr[SC_MAX_ATR_SIZE];
+	size_t atr_len;
+	struct replay_exchange *exchanges;
+	size_t count, next;
+	int reported;	/* the card was reported as inserted */
+};
+
+static struct sc_reader_operations replay_ops;
+
+static struct sc_reader_driver replay_drv = {
+	"APDU replay",
+	"replay",
+	&replay_ops,
+	NULL
+};
+
+const char *sc_replay_trace_file(sc_context_t *ctx)
+{
+	const char *filename = getenv("OPENSC_REPLAY");
+
+	if (filename == NULL || *filename == '\0')
+		filename = scconf_get_str(sc_get_conf_block(ctx, "reader_driver", "replay", 1),
+				"file", NULL);
+	return filename;
+}
+
+/* Reads up to 'max' bytes of a hex dump line of sc_hex_dump(), which is
+ * followed by the printable characters of the data */
+static size_t replay_parse_dump(const char *line, u8 *out, size_t max)
+{
+	size_t n = 0;
+
+	while (*line == ' ' || *line == '\t')
+		line++;
+	while (n < max && isxdigit((unsigned char) line[0]) && isxdigit((unsigned char) line[1])
+			&& (line[2] == ' ' || line[2] == '\n' || line[2] == '\r' || line[2] == '\0')) {
+		unsigned int v;
+
+		sscanf(line, "%2x", &v);
+		out[n++] = (u8) v;
+		line += line[2] ? 3 : 2;
+	}
+	return n;
+}
+
+static int replay_add(struct replay_global_private_data *gpriv,
+		const u8 *cmd, size_t cmd_len, const u8 *resp, size_t resp_len)
+{
+	struct replay_exchange *ex;
+
+	if (cmd_len == 0 || resp_len < 2)
+		return SC_SUCCESS;
+	ex = realloc(gpriv->exchanges, (gpriv->count + 1) * sizeof *ex);
+	if (ex == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	gpriv->exchanges = ex;
+	ex = &gpriv->exchanges[gpriv->count];
+	ex->cmd = malloc(cmd_len);
+	ex->resp = malloc(resp_len);
+	if (ex->cmd == NULL || ex->resp == NULL) {
+		free(ex->cmd);
+		free(ex->resp);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	memcpy(ex->cmd, cmd, cmd_len);
+	ex->cmd_len = cmd_len;
+	memcpy(ex->resp, resp, resp_len);
+	ex->resp_len = resp_len;
+	gpriv->count++;
+	return SC_SUCCESS;
+}
+
+static int replay_load(sc_context_t *ctx, struct replay_global_private_data *gpriv)
+{
+	char line[256];
+	u8 *cmd = NULL, *resp = NULL, *dump = NULL;
+	size_t cmd_len = 0, dump_len = 0, dump_want = 0;
+	FILE *fp;
+	int r = SC_SUCCESS;
+
+	fp = fopen(gpriv->filename, "r");
+	if (fp == NULL) {
+		sc_log(ctx, "Cannot open APDU replay trace '%s'", gpriv->filename);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	cmd = malloc(REPLAY_MAX_APDU);
+	resp = malloc(REPLAY_MAX_APDU);
+	if (cmd == NULL || resp == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+
+	while (r == SC_SUCCESS && fgets(line, sizeof line, fp) != NULL) {
+		char *p;
+		size_t len, n;
+
+		/* continuation of a hex dump from a debug log */
+		if (dump_want > dump_len) {
+			dump_len += replay_parse_dump(line, dump + dump_len, dump_want - dump_len);
+			if (dump_len < dump_want)
+				continue;
+			if (dump == cmd) {
+				cmd_len = dump_len;
+			} else if (cmd_len > 0) {
+				r = replay_add(gpriv, cmd, cmd_len, resp, dump_len);
+				cmd_len = 0;
+			}
+			dump_want = dump_len = 0;
+			continue;
+		}
+
+		if ((p = strstr(line, "Outgoing APDU (")) != NULL
+				|| (p = strstr(line, "Incoming APDU (")) != NULL) {
+			unsigned long want;
+
+			if (sscanf(p + 15, "%lu", &want) != 1 || want == 0 || want > REPLAY_MAX_APDU)
+				continue;
+			dump = *p == 'O' ? cmd : resp;
+			dump_want = want;
+			dump_len = 0;
+			continue;
+		}
+		if (gpriv->atr_len == 0 && (p = strstr(line, "ATR     : ")) != NULL) {
+			p += 10;
+			p[strcspn(p, "\r\n")] = '\0';
+			len = sizeof gpriv->atr;
+			if (sc_hex_to_bin(p, gpriv->atr, &len) == SC_SUCCESS)
+				gpriv->atr_len = len;
+			continue;
+		}
+
+		/* hand written trace */
+		p = line;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		p[strcspn(p, "#\r\n")] = '\0';
+		if (*p == '\0')
+			continue;
+		if (strncmp(p, "atr ", 4) == 0) {
+			len = sizeof gpriv->atr;
+			if (sc_hex_to_bin(p + 4, gpriv->atr, &len) == SC_SUCCESS)
+				gpriv->atr_len = len;
+		} else if (*p == '>') {
+			n = REPLAY_MAX_APDU;
+			cmd_len = sc_hex_to_bin(p + 1, cmd, &n) == SC_SUCCESS ? n : 0;
+		} else if (*p == '<') {
+			n = REPLAY_MAX_APDU;
+			if (sc_hex_to_bin(p + 1, resp, &n) == SC_SUCCESS && cmd_len > 0)
+				r = replay_add(gpriv, cmd, cmd_len, resp, n);
+			cmd_len = 0;
+		}
+	}
+
+out:
+	free(cmd);
+	free(resp);
+	fclose(fp);
+	if (r == SC_SUCCESS && gpriv->count == 0) {
+		sc_log(ctx, "No APDUs found in '%s'", gpriv->filename);
+		r = SC_ERROR_INVALID_DATA;
+	}
+	return r;
+}
+
+static void replay_delay(unsigned int usec)
+{
+#ifdef _WIN32
+	Sleep((usec + 999) / 1000);
+#else
+	struct timespec ts;
+
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (long) (usec % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) != 0)
+		;
+#endif
+}
+
+static int replay_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct replay_global_private_data *gpriv = reader->drv_data;
+	u8 *sbuf = NULL;
+	size_t ssize, i;
+	int r;
+
+	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, reader->active_protocol);
+	if (r != SC_SUCCESS)
+		return r;
+	sc_apdu_log(reader->ctx, sbuf, ssize, 1);
+
+	r = SC_ERROR_TRANSMIT_FAILED;
+	for (i = 0; i < gpriv->count; i++) {
+		size_t idx = (gpriv->next + i) % gpriv->count;
+		struct replay_exchange *ex = &gpriv->exchanges[idx];
+
+		if (ex->cmd_len != ssize || memcmp(ex->cmd, sbuf, ssize) != 0)
+			continue;
+		if (gpriv->latency)
+			replay_delay(gpriv->latency);
+		sc_apdu_log(reader->ctx, ex->resp, ex->resp_len, 0);
+		r = sc_apdu_set_resp(reader->ctx, apdu, ex->resp, ex->resp_len);
+		gpriv->next = idx + 1;
+		break;
+	}
+	if (r == SC_ERROR_TRANSMIT_FAILED)
+		sc_log(reader->ctx, "No recorded response for this APDU");
+
+	free(sbuf);
+	return r;
+}
+
+static int replay_detect_card_presence(sc_reader_t *reader)
+{
+	struct replay_global_private_data *gpriv = reader->drv_data;
+
+	reader->flags |= SC_READER_CARD_PRESENT;
+	if (!gpriv->reported) {
+		reader->flags |= SC_READER_CARD_CHANGED;
+		gpriv->reported = 1;
+	} else {
+		reader->flags &= ~SC_READER_CARD_CHANGED;
+	}
+	return reader->flags;
+}
+
+static int replay_connect(sc_reader_t *reader)
+{
+	struct replay_global_private_data *gpriv = reader->drv_data;
+
+	memcpy(reader->atr.value, gpriv->atr, gpriv->atr_len);
+	reader->atr.len = gpriv->atr_len;
+	reader->active_protocol = SC_PROTO_T1;
+	_sc_parse_atr(reader);
+	return SC_SUCCESS;
+}
+
+static int replay_noop(sc_reader_t *reader)
+{
+	(void) reader;
+	return SC_SUCCESS;
+}
+
+static int replay_finish(sc_context_t *ctx)
+{
+	struct replay_global_private_data *gpriv = ctx->reader_drv_data;
+	size_t i;
+
+	if (gpriv) {
+		for (i = 0; i < gpriv->count; i++) {
+			free(gpriv->exchanges[i].cmd);
+			free(gpriv->exchanges[i].resp);
+		}
+		free(gpriv->exchanges);
+		free(gpriv);
+		ctx->reader_drv_data = NULL;
+	}
+	return SC_SUCCESS;
+}
+
+static int replay_init(sc_context_t *ctx)
+{
+	struct replay_global_private_data *gpriv;
+	scconf_block *conf_block;
+	sc_reader_t *reader;
+	int r;
+
+	gpriv = calloc(1, sizeof *gpriv);
+	if (gpriv == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	ctx->reader_drv_data = gpriv;
+
+	gpriv->filename = sc_replay_trace_file(ctx);
+	if (gpriv->filename == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "replay", 1);
+	gpriv->latency = (unsigned int) scconf_get_int(conf_block, "latency", 0);
+	if (getenv("OPENSC_REPLAY_LATENCY"))
+		gpriv->latency = (unsigned int) strtoul(getenv("OPENSC_REPLAY_LATENCY"), NULL, 10);
+
+	r = replay_load(ctx, gpriv);
+	if (r != SC_SUCCESS)
+		return r;
+	sc_log(ctx, "Replaying %"SC_FORMAT_LEN_SIZE_T"u APDUs from '%s'",
+			gpriv->count, gpriv->filename);
+
+	reader = calloc(1, sizeof *reader);
+	if (reader == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	reader->drv_data = gpriv;
+	reader->ops = &replay_ops;
+	reader->driver = &replay_drv;
+	reader->name = strdup(scconf_get_str(conf_block, "reader_name", REPLAY_DEFAULT_NAME));
+	reader->max_send_size = scconf_get_int(conf_block, "max_send_size", 0);
+	reader->max_recv_size = scconf_get_int(conf_block, "max_recv_size", 0);
+	if (reader->name == NULL || _sc_add_reader(ctx, reader) != SC_SUCCESS) {
+		free(reader->name);
+		free(reader);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	return SC_SUCCESS;
+}
+
+struct sc_reader_driver *sc_get_replay_driver(void)
+{
+	replay_ops.init = replay_init;
+	replay_ops.finish = replay_finish;
+	replay_ops.detect_readers = NULL;
+	replay_ops.transmit = replay_transmit;
+	replay_ops.detect_card_presence = replay_detect_card_presence;
+	replay_ops.lock = replay_noop;
+	replay_ops.unlock = replay_noop;
+	replay_ops.release = replay_noop;
+	replay_ops.connect = replay_connect;
+	replay_ops.disconnect = replay_noop;
+
+	return &replay_drv;
+}
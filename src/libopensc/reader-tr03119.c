@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_READER
+
 #include "reader-tr03119.h"
 #include "ccid-types.h"
 #include "internal.h"
@@ -930,6 +932,16 @@ void sc_detect_escape_cmds(sc_reader_t *reader)
 	u8 rbuf[0xff+1];
 	sc_apdu_t apdu;
 	unsigned long capabilities;
+	int r;
+
+	if (reader && reader->escape_detected) {
+		/* Pinpad readers are slow to answer the escape commands. What
+		 * they told is kept with the reader, the wrappers installed
+		 * below stay in its operations and so do the vendor and version */
+		sc_log(reader->ctx, "Using known escape capabilities of '%s'", reader->name);
+		reader->capabilities |= reader->escape_capabilities;
+		return;
+	}
 
 	if (reader && reader->ops && reader->ops->transmit) {
 		memset(&apdu, 0, sizeof(apdu));
@@ -942,7 +954,13 @@ void sc_detect_escape_cmds(sc_reader_t *reader)
 		apdu.resplen = sizeof rbuf;
 		apdu.le      = sizeof rbuf;
 
-		if (reader->ops->transmit(reader, &apdu) == SC_SUCCESS
+		r = reader->ops->transmit(reader, &apdu);
+		if (r == SC_SUCCESS) {
+			/* a reader without escape commands still tells by its SW */
+			reader->escape_detected = 1;
+			reader->escape_capabilities = 0;
+		}
+		if (r == SC_SUCCESS
 				&& apdu.sw1 == 0x90 && apdu.sw2 == 0x00
 				&& escape_buf_to_pace_capabilities(reader->ctx,
 					apdu.resp, apdu.resplen, &capabilities) == SC_SUCCESS) {
@@ -963,6 +981,7 @@ void sc_detect_escape_cmds(sc_reader_t *reader)
 			}
 
 			reader->capabilities |= capabilities;
+			reader->escape_capabilities = capabilities;
 		} else {
 			error++;
 			sc_log(reader->ctx, 
@@ -26,6 +26,7 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 #ifdef HAVE_SYS_MMAN_H
 #include <sys/mman.h>
@@ -54,6 +55,9 @@ static const char *sc_version = "(undef)";
 #define PAGESIZE 0
 #endif
 #endif
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+#endif
 static size_t page_size = PAGESIZE;
 
 const char *sc_get_version(void)
@@ -61,9 +65,45 @@ const char *sc_get_version(void)
     return sc_version;
 }
 
+/* Nibble values of the hex digits; 0xFE marks the separators accepted by
+ * sc_hex_to_bin(), 0xFF anything else */
+static const u8 hex_nibble[256] = {
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFE,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,
+	0x08,0x09,0xFE,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0x0A,0x0B,0x0C,0x0D,0x0E,0x0F,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0x0A,0x0B,0x0C,0x0D,0x0E,0x0F,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+};
+
 int sc_hex_to_bin(const char *in, u8 *out, size_t *outlen)
 {
-	const char *sc_hex_to_bin_separators = " :";
 	if (in == NULL || out == NULL || outlen == NULL) {
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
@@ -73,17 +113,11 @@ int sc_hex_to_bin(const char *in, u8 *out, size_t *outlen)
 	size_t left = *outlen;
 	u8 byte = 0;
 	while (*in != '\0' && 0 != left) {
-		char c = *in++;
-		u8 nibble;
-		if      ('0' <= c && c <= '9')
-			nibble = c - '0';
-		else if ('a' <= c && c <= 'f')
-			nibble = c - 'a' + 10;
-		else if ('A' <= c && c <= 'F')
-			nibble = c - 'A' + 10;
-		else {
-			if (strchr(sc_hex_to_bin_separators, (int) c))
-				continue;
+		u8 nibble = hex_nibble[(u8)*in++];
+
+		if (nibble == 0xFE)
+			continue;
+		if (nibble == 0xFF) {
 			r = SC_ERROR_INVALID_ARGUMENTS;
 			goto err;
 		}
@@ -114,11 +148,8 @@ int sc_hex_to_bin(const char *in, u8 *out, size_t *outlen)
 	}
 
 	/* skip all trailing separators to see if we missed something */
-	while (*in != '\0') {
-		if (NULL == strchr(sc_hex_to_bin_separators, (int) *in))
-			break;
+	while (hex_nibble[(u8)*in] == 0xFE)
 		in++;
-	}
 	if (*in != '\0') {
 		r = SC_ERROR_BUFFER_TOO_SMALL;
 		goto err;
@@ -129,6 +160,22 @@ err:
 	return r;
 }
 
+static const char hex_digits[2][16] = {
+	{ '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' },
+	{ '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' }
+};
+
+char *_sc_hex_put(char *out, const u8 *in, size_t in_len, int upper)
+{
+	const char *hex = hex_digits[upper ? 1 : 0];
+
+	while (in_len--) {
+		*out++ = hex[*in >> 4];
+		*out++ = hex[*in++ & 0xF];
+	}
+	return out;
+}
+
 int sc_bin_to_hex(const u8 *in, size_t in_len, char *out, size_t out_len,
 				  int in_sep)
 {
@@ -144,14 +191,15 @@ int sc_bin_to_hex(const u8 *in, size_t in_len, char *out, size_t out_len,
 			return SC_ERROR_BUFFER_TOO_SMALL;
 	}
 
-	const char hex[] = "0123456789abcdef";
-	while (in_len) {
-		unsigned char value = *in++;
-		*out++ = hex[(value >> 4) & 0xF];
-		*out++ = hex[ value       & 0xF];
-		in_len--;
-		if (in_len && in_sep > 0)
-			*out++ = (char)in_sep;
+	if (in_sep > 0) {
+		while (in_len) {
+			out = _sc_hex_put(out, in++, 1, 0);
+			in_len--;
+			if (in_len)
+				*out++ = (char)in_sep;
+		}
+	} else {
+		out = _sc_hex_put(out, in, in_len, 0);
 	}
 	*out = '\0';
 
@@ -340,6 +388,22 @@ int sc_detect_card_presence(sc_reader_t *reader)
 	LOG_FUNC_RETURN(reader->ctx, r);
 }
 
+int sc_detect_cards_presence(sc_context_t *ctx, sc_reader_t **readers, size_t count)
+{
+	int r;
+
+	if (ctx == NULL || (count > 0 && readers == NULL))
+		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(ctx);
+	if (count == 0)
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	if (ctx->reader_driver == NULL || ctx->reader_driver->ops->detect_cards_presence == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
+
+	r = ctx->reader_driver->ops->detect_cards_presence(ctx, readers, count);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
 int sc_path_set(sc_path_t *path, int type, const u8 *id, size_t id_len,
 	int idx, int count)
 {
@@ -902,7 +966,7 @@ static void init_page_size()
 	}
 }
 
-void *sc_mem_secure_alloc(size_t len)
+static void *mem_secure_alloc_pages(size_t len)
 {
 	void *p;
 
@@ -925,7 +989,7 @@ void *sc_mem_secure_alloc(size_t len)
 	return p;
 }
 
-void sc_mem_secure_free(void *ptr, size_t len)
+static void mem_secure_free_pages(void *ptr, size_t len)
 {
 #ifdef _WIN32
 	VirtualUnlock(ptr, len);
@@ -935,6 +999,280 @@ void sc_mem_secure_free(void *ptr, size_t len)
 	free(ptr);
 }
 
+#if defined(HAVE_PTHREAD) && !defined(_WIN32) && defined(HAVE_SYS_MMAN_H)
+/*
+ * Small secrets (PINs, session keys) are carved out of a few locked pages
+ * instead of locking a page of their own each: a slab is one page, split
+ * into SECURE_CHUNK byte chunks. Chunks are cleared when they are freed,
+ * and a slab that becomes empty is unlocked and unmapped unless it is the
+ * last one. Larger requests still get pages of their own.
+ */
+#define SECURE_POOL
+#define SECURE_CHUNK	32
+#define SECURE_POOL_MAX	1024
+#define SECURE_RUN	0xFF	/* map entry of a chunk inside an allocation */
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+struct secure_slab {
+	struct secure_slab *next;
+	u8 *mem;
+	size_t size;
+	size_t nchunks, used;
+	u8 map[1];	/* chunks in the allocation starting here, 0 if free */
+};
+
+static struct secure_slab *secure_slabs = NULL;
+static pthread_mutex_t secure_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct secure_slab *secure_slab_new(void)
+{
+	struct secure_slab *slab;
+	size_t size, nchunks;
+
+	init_page_size();
+	size = page_size ? page_size : 4096;
+	nchunks = size / SECURE_CHUNK;
+
+	slab = calloc(1, sizeof(*slab) + nchunks);
+	if (slab == NULL)
+		return NULL;
+	slab->mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slab->mem == MAP_FAILED) {
+		free(slab);
+		return NULL;
+	}
+	mlock(slab->mem, size);
+	slab->size = size;
+	slab->nchunks = nchunks;
+	return slab;
+}
+
+static void *secure_slab_alloc(struct secure_slab *slab, size_t n)
+{
+	size_t i, run = 0;
+
+	if (slab->nchunks - slab->used < n)
+		return NULL;
+	for (i = 0; i < slab->nchunks; i++) {
+		if (slab->map[i]) {
+			run = 0;
+			continue;
+		}
+		if (++run == n) {
+			size_t start = i + 1 - n;
+
+			slab->map[start] = (u8)n;
+			memset(slab->map + start + 1, SECURE_RUN, n - 1);
+			slab->used += n;
+			return slab->mem + start * SECURE_CHUNK;
+		}
+	}
+	return NULL;
+}
+
+static void *secure_pool_alloc(size_t len)
+{
+	struct secure_slab *slab;
+	size_t n = (len + SECURE_CHUNK - 1) / SECURE_CHUNK;
+	void *p = NULL;
+
+	pthread_mutex_lock(&secure_lock);
+	for (slab = secure_slabs; slab != NULL && p == NULL; slab = slab->next)
+		p = secure_slab_alloc(slab, n);
+	if (p == NULL && (slab = secure_slab_new()) != NULL) {
+		slab->next = secure_slabs;
+		secure_slabs = slab;
+		p = secure_slab_alloc(slab, n);
+	}
+	pthread_mutex_unlock(&secure_lock);
+	return p;
+}
+
+/* Returns 0 if ptr does not belong to the pool */
+static int secure_pool_free(void *ptr)
+{
+	struct secure_slab **pp, *slab;
+	u8 *p = ptr;
+
+	pthread_mutex_lock(&secure_lock);
+	for (pp = &secure_slabs; (slab = *pp) != NULL; pp = &slab->next) {
+		size_t i, n;
+
+		if (p < slab->mem || p >= slab->mem + slab->size)
+			continue;
+
+		i = (p - slab->mem) / SECURE_CHUNK;
+		n = slab->map[i];
+		if (n && n != SECURE_RUN) {
+			sc_mem_clear(slab->mem + i * SECURE_CHUNK, n * SECURE_CHUNK);
+			memset(slab->map + i, 0, n);
+			slab->used -= n;
+		}
+		if (slab->used == 0 && (slab != secure_slabs || slab->next != NULL)) {
+			*pp = slab->next;
+			munlock(slab->mem, slab->size);
+			munmap(slab->mem, slab->size);
+			free(slab);
+		}
+		pthread_mutex_unlock(&secure_lock);
+		return 1;
+	}
+	pthread_mutex_unlock(&secure_lock);
+	return 0;
+}
+#endif
+
+void *sc_mem_secure_alloc(size_t len)
+{
+#ifdef SECURE_POOL
+	if (len > 0 && len <= SECURE_POOL_MAX) {
+		void *p = secure_pool_alloc(len);
+
+		if (p != NULL)
+			return p;
+	}
+#endif
+	return mem_secure_alloc_pages(len);
+}
+
+void sc_mem_secure_free(void *ptr, size_t len)
+{
+	if (ptr == NULL)
+		return;
+#ifdef SECURE_POOL
+	if (secure_pool_free(ptr))
+		return;
+#endif
+	mem_secure_free_pages(ptr, len);
+}
+
+/* Precedes the memory of sc_mem_alloc(), so that sc_mem_free() finds the
+ * allocator and the counters to update */
+union sc_mem_header {
+	struct {
+		sc_context_t *ctx;
+		size_t len;
+		unsigned int subsystem;
+	} h;
+	long double align_ld;
+	void *align_ptr;
+	unsigned long long align_ull;
+};
+
+static void sc_mem_account(sc_context_t *ctx, unsigned int subsystem,
+		size_t added, size_t removed, int failed)
+{
+	struct sc_stats_memory *mem;
+
+	if (ctx == NULL || subsystem >= SC_MEM_COUNT)
+		return;
+	sc_mutex_lock(ctx, ctx->stats_mutex);
+	mem = &ctx->stats.memory[subsystem];
+	if (failed) {
+		mem->failures++;
+	} else {
+		mem->in_use -= removed < mem->in_use ? removed : mem->in_use;
+		mem->in_use += added;
+		if (added)
+			mem->allocs++;
+		if (mem->in_use > mem->peak)
+			mem->peak = mem->in_use;
+	}
+	sc_mutex_unlock(ctx, ctx->stats_mutex);
+}
+
+void *sc_mem_alloc(sc_context_t *ctx, unsigned int subsystem, size_t len)
+{
+	const sc_allocator_t *a = ctx ? ctx->allocator : NULL;
+	union sc_mem_header *hdr;
+
+	if (len > SIZE_MAX - sizeof(*hdr))
+		return NULL;
+	if (a != NULL && a->alloc != NULL)
+		hdr = a->alloc(a->opaque, sizeof(*hdr) + len);
+	else
+		hdr = malloc(sizeof(*hdr) + len);
+	if (hdr == NULL) {
+		sc_mem_account(ctx, subsystem, 0, 0, 1);
+		return NULL;
+	}
+	hdr->h.ctx = ctx;
+	hdr->h.len = len;
+	hdr->h.subsystem = subsystem;
+	sc_mem_account(ctx, subsystem, len, 0, 0);
+	return hdr + 1;
+}
+
+void *sc_mem_calloc(sc_context_t *ctx, unsigned int subsystem, size_t n, size_t size)
+{
+	void *p;
+
+	if (size != 0 && n > SIZE_MAX / size)
+		return NULL;
+	p = sc_mem_alloc(ctx, subsystem, n * size);
+	if (p != NULL)
+		memset(p, 0, n * size);
+	return p;
+}
+
+void *sc_mem_realloc(sc_context_t *ctx, unsigned int subsystem, void *ptr, size_t len)
+{
+	union sc_mem_header *hdr, *nhdr;
+	const sc_allocator_t *a;
+	void *p;
+	size_t old_len;
+
+	if (ptr == NULL)
+		return sc_mem_alloc(ctx, subsystem, len);
+	hdr = (union sc_mem_header *)ptr - 1;
+	ctx = hdr->h.ctx;
+	subsystem = hdr->h.subsystem;
+	old_len = hdr->h.len;
+	a = ctx ? ctx->allocator : NULL;
+	if (len > SIZE_MAX - sizeof(*hdr))
+		return NULL;
+
+	if (a != NULL && a->alloc != NULL && a->resize == NULL) {
+		p = sc_mem_alloc(ctx, subsystem, len);
+		if (p != NULL) {
+			memcpy(p, ptr, old_len < len ? old_len : len);
+			sc_mem_free(ptr);
+		}
+		return p;
+	}
+	if (a != NULL && a->alloc != NULL)
+		nhdr = a->resize(a->opaque, hdr, sizeof(*hdr) + len);
+	else
+		nhdr = realloc(hdr, sizeof(*hdr) + len);
+	if (nhdr == NULL) {
+		sc_mem_account(ctx, subsystem, 0, 0, 1);
+		return NULL;
+	}
+	nhdr->h.len = len;
+	sc_mem_account(ctx, subsystem, len, old_len, 0);
+	return nhdr + 1;
+}
+
+void sc_mem_free(void *ptr)
+{
+	union sc_mem_header *hdr;
+	const sc_allocator_t *a;
+	sc_context_t *ctx;
+
+	if (ptr == NULL)
+		return;
+	hdr = (union sc_mem_header *)ptr - 1;
+	ctx = hdr->h.ctx;
+	a = ctx ? ctx->allocator : NULL;
+	sc_mem_account(ctx, hdr->h.subsystem, 0, hdr->h.len, 0);
+	if (a != NULL && a->alloc != NULL)
+		a->release(a->opaque, hdr);
+	else
+		free(hdr);
+}
+
 void sc_mem_clear(void *ptr, size_t len)
 {
 	if (len > 0)   {
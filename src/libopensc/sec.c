@@ -35,6 +35,7 @@
 int sc_decipher(sc_card_t *card,
 		const u8 * crgram, size_t crgram_len, u8 * out, size_t outlen)
 {
+	unsigned long long apdus;
 	int r;
 
 	if (card == NULL || crgram == NULL || out == NULL) {
@@ -43,7 +44,9 @@ int sc_decipher(sc_card_t *card,
 	LOG_FUNC_CALLED(card->ctx);
 	if (card->ops->decipher == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	apdus = sc_stats_reader_apdus(card->reader);
 	r = card->ops->decipher(card, crgram, crgram_len, out, outlen);
+	sc_stats_operation(card->reader, &card->ctx->stats.decipher, apdus);
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -51,6 +54,7 @@ int sc_compute_signature(sc_card_t *card,
 			 const u8 * data, size_t datalen,
 			 u8 * out, size_t outlen)
 {
+	unsigned long long apdus;
 	int r;
 
 	if (card == NULL) {
@@ -59,7 +63,9 @@ int sc_compute_signature(sc_card_t *card,
 	LOG_FUNC_CALLED(card->ctx);
 	if (card->ops->compute_signature == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	apdus = sc_stats_reader_apdus(card->reader);
 	r = card->ops->compute_signature(card, data, datalen, out, outlen);
+	sc_stats_operation(card->reader, &card->ctx->stats.compute_signature, apdus);
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -142,6 +148,7 @@ int sc_logout(sc_card_t *card)
 {
 	if (card->ops->logout == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
+	card->pin_events++;
 	return card->ops->logout(card);
 }
 
@@ -192,17 +199,22 @@ int sc_reset_retry_counter(sc_card_t *card, unsigned int type, int ref,
 int sc_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *data,
 		int *tries_left)
 {
-	int r, debug;
+	unsigned long long apdus;
+	int r, i, debug, debug_levels[SC_MAX_LOG_SUBSYSTEMS];
 
 	if (card == NULL) {
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 	LOG_FUNC_CALLED(card->ctx);
+	apdus = sc_stats_reader_apdus(card->reader);
 
 	debug = card->ctx->debug;
+	memcpy(debug_levels, card->ctx->debug_levels, sizeof debug_levels);
 	if (data->cmd != SC_PIN_CMD_GET_INFO
-			&& card->ctx->debug < SC_LOG_DEBUG_PIN) {
+			&& sc_log_max_level(card->ctx) < SC_LOG_DEBUG_PIN) {
 		card->ctx->debug = 0;
+		for (i = 0; i < SC_MAX_LOG_SUBSYSTEMS; i++)
+			card->ctx->debug_levels[i] = -1;
 	}
 
 	if (card->ops->pin_cmd) {
@@ -252,6 +264,10 @@ int sc_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *data,
 		r = SC_ERROR_NOT_SUPPORTED;
 	}
 	card->ctx->debug = debug;
+	memcpy(card->ctx->debug_levels, debug_levels, sizeof debug_levels);
+	if (data->cmd != SC_PIN_CMD_GET_INFO)
+		card->pin_events++;
+	sc_stats_operation(card->reader, &card->ctx->stats.pin_cmd, apdus);
 
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
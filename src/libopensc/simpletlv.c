@@ -110,3 +110,59 @@ sc_simpletlv_read_tag(const u8 **buf, size_t buflen, u8 *tag_out, size_t *taglen
 
 	return SC_SUCCESS;
 }
+
+void
+sc_simpletlv_iter_init(struct sc_simpletlv_iter *it, const u8 *buf, size_t buflen)
+{
+	it->tl = buf;
+	it->tl_len = buf != NULL ? buflen : 0;
+	it->val = NULL;
+	it->val_len = 0;
+}
+
+void
+sc_simpletlv_iter_init_split(struct sc_simpletlv_iter *it,
+	const u8 *tl, size_t tl_len, const u8 *val, size_t val_len)
+{
+	it->tl = tl;
+	it->tl_len = tl != NULL ? tl_len : 0;
+	it->val = val;
+	it->val_len = val != NULL ? val_len : 0;
+}
+
+int
+sc_simpletlv_iter_next(struct sc_simpletlv_iter *it, u8 *tag_out,
+	const u8 **value, size_t *len)
+{
+	const u8 *p = it->tl;
+	size_t head, left, taglen;
+	int r;
+
+	if (it->tl_len == 0)
+		return 0;
+
+	r = sc_simpletlv_read_tag(&p, it->tl_len, tag_out, &taglen);
+	if (r != SC_SUCCESS && r != SC_ERROR_TLV_END_OF_CONTENTS) {
+		it->tl_len = 0;
+		return r;
+	}
+	head = p - it->tl;
+
+	if (it->val == NULL) {
+		/* the value follows the tag and length */
+		left = it->tl_len - head;
+		*value = p;
+		*len = MIN(taglen, left);
+		it->tl = p + *len;
+		it->tl_len = left - *len;
+	} else {
+		left = it->val_len;
+		*value = it->val;
+		*len = MIN(taglen, left);
+		it->val += *len;
+		it->val_len -= *len;
+		it->tl = p;
+		it->tl_len -= head;
+	}
+	return taglen > left ? SC_ERROR_TLV_END_OF_CONTENTS : 1;
+}
@@ -50,4 +50,38 @@ int sc_simpletlv_put_tag(u8 tag, size_t datalen, u8 *out, size_t outlen, u8 **pt
  */
 int sc_simpletlv_read_tag(const u8 **buf, size_t buflen, u8 *tag_out, size_t *taglen);
 
+/*
+ * Iterator over Simple TLV records. The values are returned as pointers
+ * into the parsed buffers, nothing is copied. The records are either
+ * stored in one buffer, or split into the tag/length and the value buffer
+ * as CAC stores them.
+ */
+struct sc_simpletlv_iter {
+	const u8 *tl;		/* next tag/length record */
+	size_t tl_len;
+	const u8 *val;		/* next value; NULL when values follow the TL records */
+	size_t val_len;
+};
+
+/* Iterate over a buffer of complete TLV records */
+void sc_simpletlv_iter_init(struct sc_simpletlv_iter *it, const u8 *buf, size_t buflen);
+
+/* Iterate over a TL buffer with the values stored separately */
+void sc_simpletlv_iter_init_split(struct sc_simpletlv_iter *it,
+	const u8 *tl, size_t tl_len, const u8 *val, size_t val_len);
+
+/* get the next Simple TLV record.
+ * @param  it        The iterator
+ * @param  tag_out   The tag of the record
+ * @param  value     Pointer to the value of the record in the parsed buffer
+ * @param  len       The length of the value
+ * @return           1 for a record, 0 at the end of the buffer,
+ *                   SC_ERROR_TLV_END_OF_CONTENTS for a record whose value is
+ *                   cut short (value and len then describe the part that is
+ *                   present) and SC_ERROR_INVALID_TLV_OBJECT for a broken
+ *                   tag/length record
+ */
+int sc_simpletlv_iter_next(struct sc_simpletlv_iter *it, u8 *tag_out,
+	const u8 **value, size_t *len);
+
 #endif
@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_SM
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -135,6 +137,16 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 	if (!card->sm_ctx.ops.get_sm_apdu || !card->sm_ctx.ops.free_sm_apdu)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
 
+	if (card->sm_ctx.sm_flags & SM_FLAGS_SESSION_LOST) {
+		/* cleared first: opening the session transmits APDUs itself */
+		card->sm_ctx.sm_flags &= ~SM_FLAGS_SESSION_LOST;
+		sc_log(ctx, "re-open SM session");
+		rv = card->sm_ctx.ops.open(card);
+		if (rv < 0)
+			sc_sm_stop(card);
+		LOG_TEST_RET(ctx, rv, "cannot re-open SM session");
+	}
+
 	/* get SM encoded APDU */
 	rv = card->sm_ctx.ops.get_sm_apdu(card, apdu, &sm_apdu);
 	if (rv == SC_ERROR_SM_NOT_APPLIED)   {
@@ -183,11 +195,20 @@ sc_sm_stop(struct sc_card *card)
                 && card->sm_ctx.ops.close)
             r = card->sm_ctx.ops.close(card);
         card->sm_ctx.sm_mode = SM_MODE_NONE;
+        card->sm_ctx.sm_flags &= ~SM_FLAGS_SESSION_LOST;
     }
 
     return r;
 }
 
+void
+sc_sm_session_lost(struct sc_card *card)
+{
+	if (card && card->sm_ctx.ops.open
+			&& card->sm_ctx.sm_mode == SM_MODE_TRANSMIT)
+		card->sm_ctx.sm_flags |= SM_FLAGS_SESSION_LOST;
+}
+
 #else
 
 int
@@ -215,4 +236,9 @@ sc_sm_stop(struct sc_card *card)
 {
     return SC_ERROR_NOT_SUPPORTED;
 }
+
+void
+sc_sm_session_lost(struct sc_card *card)
+{
+}
 #endif
@@ -46,6 +46,11 @@ extern "C" {
 /** use SM for all commands */
 #define SM_MODE_TRANSMIT	0x200
 
+/** sm_flags: the card lost the SM session, re-open it before the next SM APDU */
+#define SM_FLAGS_SESSION_LOST	0x0001
+/** sm_flags: GET RESPONSE is fetching the rest of a protected response, send it as is */
+#define SM_FLAGS_GET_RESPONSE	0x0002
+
 #define SM_CMD_INITIALIZE		0x10
 #define SM_CMD_MUTUAL_AUTHENTICATION	0x20
 #define SM_CMD_RSA			0x100
@@ -362,6 +367,19 @@ int sc_sm_single_transmit(struct sc_card *, struct sc_apdu *);
  */
 int sc_sm_stop(struct sc_card *card);
 
+/**
+ * @brief Notes that the card lost its SM session, e.g. after a reset.
+ *
+ * In \c SM_MODE_TRANSMIT the session is re-established lazily with
+ * \a card->sm_ctx.ops.open() before the next APDU that needs to be
+ * wrapped, so locking a card that was reset by someone else does not
+ * cost a key agreement unless SM is actually used. Nothing is done in
+ * the other modes.
+ *
+ * @param[in] card card
+ */
+void sc_sm_session_lost(struct sc_card *card);
+
 #ifdef __cplusplus
 }
 #endif
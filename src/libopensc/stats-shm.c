@@ -0,0 +1,289 @@
+/*
+ * stats-shm.c: Counters shared with other processes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "internal.h"
+
+/*
+ * The counters of the context are copied into its entry of the shared
+ * file at most once per SC_STATS_SHM_INTERVAL_US, so the hot path only
+ * pays for a clock read. Entries are claimed with a compare and swap of
+ * their pid; a process that exited releases its entry but leaves the
+ * counters for the monitor until the entry is needed again.
+ */
+#define SC_STATS_SHM_INTERVAL_US	1000000
+
+#if defined(HAVE_SYS_MMAN_H) && defined(__GNUC__)
+#define SHM_CLAIM(p, old, new)	__sync_bool_compare_and_swap((p), (old), (new))
+#define SHM_BARRIER()		__sync_synchronize()
+
+struct sc_stats_shm {
+	struct sc_stats_shm_header *header;
+	struct sc_stats_shm_entry *entries;
+	struct sc_stats_shm_entry *entry;
+	size_t size;
+	unsigned int pid;
+	unsigned long long last_publish;
+};
+
+static unsigned long long shm_wall_clock(void)
+{
+	struct timeval tv;
+
+	if (gettimeofday(&tv, NULL) == 0)
+		return (unsigned long long)tv.tv_sec * 1000000 + (unsigned long long)tv.tv_usec;
+	return (unsigned long long)time(NULL) * 1000000;
+}
+
+static int shm_header_valid(const struct sc_stats_shm_header *header)
+{
+	return memcmp(header->magic, SC_STATS_SHM_MAGIC, sizeof header->magic) == 0
+		&& header->version == SC_STATS_SHM_VERSION
+		&& header->entry_size == sizeof(struct sc_stats_shm_entry)
+		&& header->capacity == SC_STATS_SHM_PROCESSES;
+}
+
+static void shm_process_name(char *name, size_t len)
+{
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/comm", "r");
+
+	if (f != NULL) {
+		if (fgets(name, (int)len, f) != NULL)
+			name[strcspn(name, "\n")] = '\0';
+		fclose(f);
+	}
+#else
+	name[0] = '\0';
+#endif
+}
+
+/* Takes a free entry, the one of a dead process or the one of the process
+ * that exited first */
+static struct sc_stats_shm_entry *shm_claim(struct sc_stats_shm *shm)
+{
+	struct sc_stats_shm_entry *entry, *oldest = NULL;
+	unsigned int i, pid;
+
+	for (i = 0; i < SC_STATS_SHM_PROCESSES; i++) {
+		entry = &shm->entries[i];
+		pid = entry->pid;
+		if (pid == 0 || (!entry->exited && kill((pid_t)pid, 0) != 0 && errno == ESRCH)) {
+			if (SHM_CLAIM(&entry->pid, pid, shm->pid))
+				return entry;
+		} else if (entry->exited && (oldest == NULL || entry->update_time < oldest->update_time)) {
+			oldest = entry;
+		}
+	}
+	if (oldest != NULL && SHM_CLAIM(&oldest->pid, oldest->pid, shm->pid))
+		return oldest;
+	return NULL;
+}
+
+static int shm_start_entry(sc_context_t *ctx, struct sc_stats_shm *shm)
+{
+	struct sc_stats_shm_entry *entry;
+
+	shm->pid = (unsigned int)getpid();
+	entry = shm_claim(shm);
+	if (entry == NULL)
+		return SC_ERROR_NOT_ENOUGH_MEMORY;
+
+	entry->seq++;
+	SHM_BARRIER();
+	entry->exited = 0;
+	entry->update_time = shm_wall_clock();
+	strncpy(entry->app_name, ctx->app_name ? ctx->app_name : "", sizeof entry->app_name - 1);
+	entry->app_name[sizeof entry->app_name - 1] = '\0';
+	shm_process_name(entry->process, sizeof entry->process);
+	memset(&entry->stats, 0, sizeof entry->stats);
+	entry->nreaders = 0;
+	memset(entry->readers, 0, sizeof entry->readers);
+	SHM_BARRIER();
+	entry->seq++;
+
+	shm->entry = entry;
+	return SC_SUCCESS;
+}
+
+int sc_stats_shm_open(sc_context_t *ctx, const char *filename)
+{
+	struct sc_stats_shm *shm;
+	struct stat st;
+	void *map;
+	int fd, r;
+
+	if (ctx == NULL || filename == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	sc_stats_shm_close(ctx);
+
+	shm = calloc(1, sizeof *shm);
+	if (shm == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	shm->size = sizeof(struct sc_stats_shm_header)
+		+ SC_STATS_SHM_PROCESSES * sizeof(struct sc_stats_shm_entry);
+
+	fd = open(filename, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		sc_log(ctx, "Cannot open shared statistics file '%s'", filename);
+		free(shm);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	/* the processes already using the file keep their entries */
+	if (fstat(fd, &st) != 0
+			|| ((size_t)st.st_size != shm->size && ftruncate(fd, (off_t)shm->size) != 0)) {
+		close(fd);
+		free(shm);
+		return SC_ERROR_INTERNAL;
+	}
+	map = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		free(shm);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+
+	shm->header = map;
+	shm->entries = (struct sc_stats_shm_entry *)(shm->header + 1);
+	if (!shm_header_valid(shm->header)) {
+		memset(map, 0, shm->size);
+		memcpy(shm->header->magic, SC_STATS_SHM_MAGIC, sizeof shm->header->magic);
+		shm->header->version = SC_STATS_SHM_VERSION;
+		shm->header->entry_size = sizeof(struct sc_stats_shm_entry);
+		shm->header->capacity = SC_STATS_SHM_PROCESSES;
+	}
+
+	r = shm_start_entry(ctx, shm);
+	if (r != SC_SUCCESS) {
+		sc_log(ctx, "Shared statistics disabled: %s", sc_strerror(r));
+		munmap(shm->header, shm->size);
+		free(shm);
+		return r;
+	}
+
+	ctx->stats_shm = shm;
+	sc_log(ctx, "Sharing statistics in '%s'", filename);
+	return SC_SUCCESS;
+}
+
+void sc_stats_shm_publish(sc_context_t *ctx, int force)
+{
+	struct sc_stats_shm *shm = ctx->stats_shm;
+	struct sc_stats_shm_entry *entry;
+	unsigned long long now;
+	unsigned int i, n;
+
+	if (shm == NULL)
+		return;
+	now = sc_stats_now();
+	if (!force && now - shm->last_publish < SC_STATS_SHM_INTERVAL_US)
+		return;
+
+	sc_mutex_lock(ctx, ctx->stats_mutex);
+	if (now - shm->last_publish < SC_STATS_SHM_INTERVAL_US && !force) {
+		/* another thread was faster */
+		sc_mutex_unlock(ctx, ctx->stats_mutex);
+		return;
+	}
+	shm->last_publish = now;
+	/* a forked child gets an entry of its own */
+	if ((unsigned int)getpid() != shm->pid && shm_start_entry(ctx, shm) != SC_SUCCESS) {
+		sc_mutex_unlock(ctx, ctx->stats_mutex);
+		return;
+	}
+
+	entry = shm->entry;
+	entry->seq++;
+	SHM_BARRIER();
+	entry->update_time = shm_wall_clock();
+	entry->stats = ctx->stats;
+	for (i = 0, n = 0; i < list_size(&ctx->readers) && n < SC_STATS_SHM_READERS; i++) {
+		sc_reader_t *reader = list_get_at(&ctx->readers, i);
+
+		if (reader == NULL)
+			continue;
+		strncpy(entry->readers[n].name, reader->name ? reader->name : "",
+				sizeof entry->readers[n].name - 1);
+		entry->readers[n].name[sizeof entry->readers[n].name - 1] = '\0';
+		entry->readers[n].apdu = reader->apdu_stats;
+		n++;
+	}
+	entry->nreaders = n;
+	SHM_BARRIER();
+	entry->seq++;
+	sc_mutex_unlock(ctx, ctx->stats_mutex);
+}
+
+void sc_stats_shm_close(sc_context_t *ctx)
+{
+	struct sc_stats_shm *shm = ctx->stats_shm;
+
+	if (shm == NULL)
+		return;
+
+	sc_stats_shm_publish(ctx, 1);
+	ctx->stats_shm = NULL;
+	/* the counters stay for the monitor */
+	if ((unsigned int)getpid() == shm->pid)
+		shm->entry->exited = 1;
+	munmap(shm->header, shm->size);
+	free(shm);
+}
+
+#else
+
+int sc_stats_shm_open(sc_context_t *ctx, const char *filename)
+{
+	if (ctx == NULL || filename == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	sc_log(ctx, "Shared statistics are not supported on this platform");
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+void sc_stats_shm_publish(sc_context_t *ctx, int force)
+{
+}
+
+void sc_stats_shm_close(sc_context_t *ctx)
+{
+}
+
+#endif
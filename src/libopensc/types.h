@@ -31,6 +31,8 @@ typedef unsigned char u8;
 #define SC_MAX_CARD_DRIVERS		48
 #define SC_MAX_CARD_DRIVER_SNAME_SIZE	16
 #define SC_MAX_CARD_APPS		8
+#define SC_CARD_BUFFERS			2 /* scratch buffers per card, one each for C- and R-APDU data */
+#define SC_CARD_LE_MEMO_SIZE		8 /* response sizes remembered per card, see sc_transmit() */
 #define SC_MAX_APDU_BUFFER_SIZE		261 /* takes account of: CLA INS P1 P2 Lc [255 byte of data] Le */
 #define SC_MAX_APDU_DATA_SIZE		0xFF
 #define SC_MAX_APDU_RESP_SIZE		(0xFF+1)
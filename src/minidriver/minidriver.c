@@ -109,6 +109,15 @@ HINSTANCE g_inst;
 
 #define MD_CARDCF_LENGTH	(sizeof(CARD_CACHE_FILE_FORMAT))
 
+/*
+ * The generated 'msroots' file is kept in the PKCS#15 file cache of the
+ * token, next to the certificates it is built from. The two byte AID
+ * cannot collide with the AID of a card application.
+ */
+static const struct sc_path md_msroots_cache_path = {
+	"\x6D\x72", 2, 0, -1, SC_PATH_TYPE_PATH, { "\x6D\x64", 2 }
+};
+
 #define MD_KEY_USAGE_KEYEXCHANGE		\
 	SC_PKCS15INIT_X509_KEY_ENCIPHERMENT	| \
 	SC_PKCS15INIT_X509_DATA_ENCIPHERMENT	| \
@@ -188,6 +197,28 @@ struct md_pkcs15_container {
 	// BOOL guid_overwrite;
 };
 
+/* SubjectPublicKeyInfo of a container, valid while the objects are the same */
+struct md_pubkey_cache {
+	struct sc_pkcs15_object *prkey_obj, *pubkey_obj, *cert_obj;
+	struct sc_pkcs15_der der;
+};
+
+/* CardGetProperty() answers, valid while the card is bound, see md_props_load() */
+struct md_property_cache {
+	BOOL loaded;
+	BOOL read_only;
+	BOOL x509_enrollment;
+	PIN_TYPE pin_type;
+	DWORD pin_strength;
+	DWORD key_sizes_ret;
+	CARD_KEY_SIZES key_sizes;
+	unsigned char serial[64];
+	size_t serial_len;
+	/* cleared when a key container is created or deleted */
+	BOOL free_space_valid;
+	CARD_FREE_SPACE_INFO free_space;
+};
+
 struct md_dh_agreement {
 	DWORD dwSize;
 	PBYTE pbAgreement;
@@ -213,6 +244,11 @@ typedef struct _VENDOR_SPECIFIC
 	struct sc_pkcs15_card *p15card;
 
 	struct md_pkcs15_container p15_containers[MD_MAX_KEY_CONTAINERS];
+	/* public keys for CardGetContainerInfo(), see md_container_pubkey() */
+	struct md_pubkey_cache pubkey_cache[MD_MAX_KEY_CONTAINERS];
+	/* containers and 'cmapfile' are built on first use */
+	BOOL containers_loaded;
+	struct md_property_cache props;
 
 	struct md_directory root;
 
@@ -229,14 +265,38 @@ typedef struct _VENDOR_SPECIFIC
 	BYTE allocatedAgreements;
 
 	CRITICAL_SECTION hScard_lock;
+
+	/* sharing with other CardAcquireContext() calls, see md_shared_find() */
+	LONG refcount;
+	BYTE atr[SC_MAX_ATR_SIZE];
+	DWORD atr_len;
+	struct sc_serial_number serial;
+	PFN_CSP_FREE pfnCspFree;
+	struct _VENDOR_SPECIFIC *next;
 } VENDOR_SPECIFIC;
 
+static void
+md_container_cache_invalidate(VENDOR_SPECIFIC *vs, int idx)
+{
+	struct md_pubkey_cache *cache = &vs->pubkey_cache[idx];
+
+	free(cache->der.value);
+	memset(cache, 0, sizeof(*cache));
+}
+
+/* Card states of the process that can be shared, protected by md_shared_lock */
+static VENDOR_SPECIFIC *md_shared_cards = NULL;
+static CRITICAL_SECTION md_shared_lock;
+
 static DWORD md_translate_OpenSC_to_Windows_error(int OpenSCerror,
 						  DWORD dwDefaulCode);
 static DWORD associate_card(PCARD_DATA pCardData);
 static void disassociate_card(PCARD_DATA pCardData);
 static DWORD md_pkcs15_delete_object(PCARD_DATA pCardData, struct sc_pkcs15_object *obj);
+static DWORD md_query_key_sizes(PCARD_DATA pCardData, DWORD dwKeySpec, CARD_KEY_SIZES *pKeySizes);
+static void md_msroots_cache_invalidate(PCARD_DATA pCardData);
 static DWORD md_fs_init(PCARD_DATA pCardData);
+static DWORD md_fs_load_containers(PCARD_DATA pCardData);
 static void md_fs_finalize(PCARD_DATA pCardData);
 
 #if defined(__GNUC__)
@@ -475,6 +535,105 @@ check_card_reader_status(PCARD_DATA pCardData, const char *name)
 	MD_FUNC_RETURN(pCardData, 1, SCARD_S_SUCCESS);
 }
 
+/*
+ * Windows components acquire and delete contexts for the same card many
+ * times, so the bound card is kept for the whole process while a context
+ * uses it. Set MiniDriverShareContext to 0 to bind the card for every
+ * context again.
+ */
+static BOOL
+md_share_context(void)
+{
+	DWORD share = 1;
+	size_t sz = sizeof(share);
+
+	if (sc_ctx_win32_get_config_value("CARDMOD_SHARE_CONTEXT",
+			"MiniDriverShareContext", "Software\\OpenSC Project\\OpenSC",
+			(char *)(&share), &sz) != SC_SUCCESS)
+		return TRUE;
+	/* the environment variable is copied as string, the registry value as DWORD */
+	if (sz < sizeof(share))
+		return ((char *)(&share))[0] != '0';
+	return share != 0;
+}
+
+/*
+ * Check whether the card of pCardData is the one bound in vs: the handles of
+ * vs are switched to the ones of pCardData and the serial number is read
+ * again. On mismatch the previous handles are restored.
+ */
+static BOOL
+md_shared_same_card(PCARD_DATA pCardData, VENDOR_SPECIFIC *vs)
+{
+	SCARDCONTEXT hSCardCtx = vs->hSCardCtx;
+	SCARDHANDLE hScard = vs->hScard;
+	struct sc_serial_number serial;
+	BOOL same = FALSE;
+
+	if (vs->serial.len == 0)
+		return FALSE;
+
+	vs->hSCardCtx = pCardData->hSCardCtx;
+	vs->hScard = pCardData->hScard;
+	if (sc_ctx_use_reader(vs->ctx, &vs->hSCardCtx, &vs->hScard) == SC_SUCCESS) {
+		/* drivers return a cached serial number */
+		memset(&vs->card->serialnr, 0, sizeof(vs->card->serialnr));
+		same = sc_card_ctl(vs->card, SC_CARDCTL_GET_SERIALNR, &serial) == SC_SUCCESS
+			&& serial.len == vs->serial.len
+			&& !memcmp(serial.value, vs->serial.value, serial.len);
+	}
+	vs->card->serialnr = vs->serial;
+
+	if (!same) {
+		vs->hSCardCtx = hSCardCtx;
+		vs->hScard = hScard;
+		sc_ctx_use_reader(vs->ctx, &vs->hSCardCtx, &vs->hScard);
+	}
+	return same;
+}
+
+/*
+ * Find the card state of an earlier CardAcquireContext() for the card of
+ * pCardData. The ATR and the memory functions of the caller have to match,
+ * and either the PC/SC handle is the same or the serial number read through
+ * the new handle is the one of the bound card.
+ * Called with md_shared_lock held, the state is returned locked.
+ */
+static VENDOR_SPECIFIC *
+md_shared_find(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs;
+
+	for (vs = md_shared_cards; vs; vs = vs->next) {
+		if (vs->atr_len != pCardData->cbAtr
+				|| memcmp(vs->atr, pCardData->pbAtr, vs->atr_len)
+				|| vs->pfnCspFree != pCardData->pfnCspFree)
+			continue;
+
+		EnterCriticalSection(&vs->hScard_lock);
+		if (vs->initialized && (vs->hScard == pCardData->hScard
+					|| md_shared_same_card(pCardData, vs)))
+			return vs;
+		LeaveCriticalSection(&vs->hScard_lock);
+	}
+	return NULL;
+}
+
+/* Called with md_shared_lock held */
+static void
+md_shared_remove(VENDOR_SPECIFIC *vs)
+{
+	VENDOR_SPECIFIC **pp;
+
+	for (pp = &md_shared_cards; *pp; pp = &(*pp)->next) {
+		if (*pp == vs) {
+			*pp = vs->next;
+			break;
+		}
+	}
+	vs->next = NULL;
+}
+
 static DWORD
 md_get_pin_by_role(PCARD_DATA pCardData, PIN_ID role, struct sc_pkcs15_object **ret_obj)
 {
@@ -960,6 +1119,12 @@ md_fs_find_directory(PCARD_DATA pCardData, struct md_directory *parent, char *na
 	if (!dir)
 		return SCARD_E_DIR_NOT_FOUND;
 
+	if (!strncmp((char *)dir->name, "mscp", sizeof dir->name))   {
+		DWORD dwret = md_fs_load_containers(pCardData);
+		if (dwret != SCARD_S_SUCCESS)
+			return dwret;
+	}
+
 	if (out)
 		*out = dir;
 
@@ -1172,6 +1337,7 @@ md_fs_delete_file(PCARD_DATA pCardData, char *parent, char *name)
 		if (idx >= 0 && idx < MD_MAX_KEY_CONTAINERS)   {
 			dwret = md_pkcs15_delete_object(pCardData, vs->p15_containers[idx].cert_obj);
 			vs->p15_containers[idx].cert_obj = NULL;
+			md_container_cache_invalidate(vs, idx);
 			if(dwret != SCARD_S_SUCCESS)
 				logprintf(pCardData, 2,
 					  "Cannot delete certificate PKCS#15 object #%i: dwret 0x%lX\n",
@@ -1321,6 +1487,8 @@ md_pkcs15_delete_object(PCARD_DATA pCardData, struct sc_pkcs15_object *obj)
 
 	dwret = SCARD_S_SUCCESS;
 	logprintf(pCardData, 3, "MdDeleteObject() returns OK\n");
+	if ((obj->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_CERT)
+		md_msroots_cache_invalidate(pCardData);
 done:
 	sc_pkcs15init_unbind(profile);
 	sc_unlock(card);
@@ -1406,6 +1574,17 @@ md_set_cardid(PCARD_DATA pCardData, struct md_file *file)
 	return SCARD_S_SUCCESS;
 }
 
+/* forget the cached 'msroots' file after the certificates have changed */
+static void
+md_msroots_cache_invalidate(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs = pCardData ? pCardData->pvVendorSpecific : NULL;
+
+	/* an empty entry is never used as 'msroots' content */
+	if (vs && vs->p15card && vs->p15card->opts.use_file_cache)
+		sc_pkcs15_cache_file(vs->p15card, &md_msroots_cache_path, (const u8 *) "", 0);
+}
+
 /* fill the msroots file from root certificates */
 static DWORD
 md_fs_read_msroots_file(PCARD_DATA pCardData, struct md_file *file)
@@ -1424,6 +1603,25 @@ md_fs_read_msroots_file(PCARD_DATA pCardData, struct md_file *file)
 	if (!vs)
 		return SCARD_E_INVALID_PARAMETER;
 
+	/* built by an earlier process for the same version of the token? */
+	if (vs->p15card->opts.use_file_cache) {
+		u8 *cached = NULL;
+		size_t cached_len = 0;
+
+		rv = sc_pkcs15_read_cached_file(vs->p15card, &md_msroots_cache_path, &cached, &cached_len);
+		if (rv == SC_SUCCESS && cached_len > 0) {
+			file->blob = pCardData->pfnCspAlloc(cached_len);
+			if (file->blob) {
+				CopyMemory(file->blob, cached, cached_len);
+				file->size = cached_len;
+			}
+			free(cached);
+			logprintf(pCardData, 3, "msroots read from the file cache\n");
+			return file->blob ? SCARD_S_SUCCESS : SCARD_E_NO_MEMORY;
+		}
+		free(cached);
+	}
+
 	hCertStore = CertOpenStore(CERT_STORE_PROV_MEMORY, X509_ASN_ENCODING, (HCRYPTPROV_LEGACY)NULL, 0, NULL);
 	if (!hCertStore)
 		goto Ret;
@@ -1488,6 +1686,9 @@ md_fs_read_msroots_file(PCARD_DATA pCardData, struct md_file *file)
 	dbStore.pbData = NULL;
 	dwret = SCARD_S_SUCCESS;
 
+	if (vs->p15card->opts.use_file_cache && file->size > 0)
+		sc_pkcs15_cache_file(vs->p15card, &md_msroots_cache_path, file->blob, file->size);
+
 Ret:
 	if (dbStore.pbData)
 		pCardData->pfnCspFree(dbStore.pbData);
@@ -1525,6 +1726,9 @@ md_fs_read_content(PCARD_DATA pCardData, char *parent, struct md_file *file)
 		return SCARD_E_DIR_NOT_FOUND;
 	}
 
+	if (dir == &vs->root && !strcmp((char *)file->name, "cardid"))
+		return md_set_cardid(pCardData, file);
+
 	if (!strcmp((char *)dir->name, "mscp"))   {
 		int idx, rv;
 
@@ -2099,7 +2303,7 @@ md_fs_init(PCARD_DATA pCardData)
 {
 	VENDOR_SPECIFIC *vs;
 	DWORD dwret;
-	struct md_file *cardid, *cardcf, *cardapps, *cmapfile;
+	struct md_file *cardcf, *cardapps;
 	struct md_directory *mscp;
 
 	if (!pCardData || !pCardData->pvVendorSpecific)
@@ -2107,12 +2311,13 @@ md_fs_init(PCARD_DATA pCardData)
 
 	vs = pCardData->pvVendorSpecific;
 
-	dwret = md_fs_add_file(pCardData, &(vs->root.files), "cardid", EveryoneReadAdminWriteAc, NULL, 0, &cardid);
+	/* Only the metadata is set up here, 'cardid' and the contents of the
+	 * 'mscp' directory are filled on first access */
+	vs->containers_loaded = FALSE;
+
+	dwret = md_fs_add_file(pCardData, &(vs->root.files), "cardid", EveryoneReadAdminWriteAc, NULL, 0, NULL);
 	if (dwret != SCARD_S_SUCCESS)
 		return dwret;
-	dwret = md_set_cardid(pCardData, cardid);
-	if (dwret != SCARD_S_SUCCESS)
-		goto ret_cleanup;
 
 	dwret = md_fs_add_file(pCardData, &(vs->root.files), "cardcf", EveryoneReadUserWriteAc, NULL, 0, &cardcf);
 	if (dwret != SCARD_S_SUCCESS)
@@ -2132,10 +2337,7 @@ md_fs_init(PCARD_DATA pCardData)
 	if (dwret != SCARD_S_SUCCESS)
 		goto ret_cleanup;
 
-	dwret = md_fs_add_file(pCardData, &(mscp->files), "cmapfile", EveryoneReadUserWriteAc, NULL, 0, &cmapfile);
-	if (dwret != SCARD_S_SUCCESS)
-		goto ret_cleanup;
-	dwret = md_set_cmapfile(pCardData, cmapfile);
+	dwret = md_fs_add_file(pCardData, &(mscp->files), "cmapfile", EveryoneReadUserWriteAc, NULL, 0, NULL);
 	if (dwret != SCARD_S_SUCCESS)
 		goto ret_cleanup;
 
@@ -2154,6 +2356,41 @@ ret_cleanup:
 	return dwret;
 }
 
+/*
+ * Build the key containers and the 'cmapfile' with its certificate files
+ */
+static DWORD
+md_fs_load_containers(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs;
+	struct md_directory *mscp;
+	struct md_file *cmapfile;
+	DWORD dwret;
+
+	if (!pCardData || !pCardData->pvVendorSpecific)
+		return SCARD_E_INVALID_PARAMETER;
+
+	vs = pCardData->pvVendorSpecific;
+	if (vs->containers_loaded)
+		return SCARD_S_SUCCESS;
+
+	for (mscp = vs->root.subdirs; mscp; mscp = mscp->next)
+		if (!strncmp((char *)mscp->name, "mscp", sizeof mscp->name))
+			break;
+	for (cmapfile = mscp ? mscp->files : NULL; cmapfile; cmapfile = cmapfile->next)
+		if (!strncmp((char *)cmapfile->name, "cmapfile", sizeof cmapfile->name))
+			break;
+	if (!cmapfile)
+		return SCARD_E_FILE_NOT_FOUND;
+
+	logprintf(pCardData, 3, "MD virtual file system: loading the key containers\n");
+	vs->containers_loaded = TRUE;
+	dwret = md_set_cmapfile(pCardData, cmapfile);
+	if (dwret != SCARD_S_SUCCESS)
+		vs->containers_loaded = FALSE;
+	return dwret;
+}
+
 /* Create SC context */
 static DWORD
 md_create_context(PCARD_DATA pCardData, VENDOR_SPECIFIC *vs)
@@ -2181,9 +2418,65 @@ md_create_context(PCARD_DATA pCardData, VENDOR_SPECIFIC *vs)
 	return SCARD_S_SUCCESS;
 }
 
+/*
+ * Compute the card properties that do not change while the card is bound.
+ * Base CSP and KSP query them many times per logon; after the first call
+ * CardGetProperty() answers without looking at the PKCS#15 data or the
+ * configuration again.
+ */
+static DWORD
+md_props_load(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs;
+	struct md_property_cache *props;
+	const char *serial;
+
+	if (!pCardData || !pCardData->pvVendorSpecific)
+		return SCARD_E_INVALID_PARAMETER;
+
+	vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
+	props = &vs->props;
+	if (props->loaded)
+		return SCARD_S_SUCCESS;
+	if (!vs->p15card || !vs->p15card->tokeninfo || !vs->reader)
+		return SCARD_E_INVALID_PARAMETER;
+
+	logprintf(pCardData, 3, "computing the card properties\n");
+	props->read_only = md_is_read_only(pCardData);
+	props->x509_enrollment = md_is_supports_X509_enrollment(pCardData);
+
+	props->pin_type = vs->reader->capabilities & SC_READER_CAP_PIN_PAD
+		|| vs->p15card->card->caps & SC_CARD_CAP_PROTECTED_AUTHENTICATION_PATH
+		? ExternalPinType : AlphaNumericPinType;
+	props->pin_strength = CARD_PIN_STRENGTH_PLAINTEXT;
+	if (vs->p15card->card->caps & SC_CARD_CAP_SESSION_PIN)
+		props->pin_strength |= CARD_PIN_STRENGTH_SESSION_PIN;
+
+	props->key_sizes.dwVersion = CARD_KEY_SIZES_CURRENT_VERSION;
+	props->key_sizes_ret = md_query_key_sizes(pCardData, 0, &props->key_sizes);
+
+	serial = vs->p15card->tokeninfo->serial_number;
+	props->serial_len = sizeof(props->serial);
+	if (!serial)   {
+		props->serial_len = 0;
+	}
+	else if (sc_hex_to_bin(serial, props->serial, &props->serial_len))   {
+		props->serial_len = strlen(serial);
+		if (props->serial_len > SC_MAX_SERIALNR) {
+			props->serial_len = SC_MAX_SERIALNR;
+		}
+		memcpy(props->serial, serial, props->serial_len);
+	}
+
+	props->loaded = TRUE;
+	return SCARD_S_SUCCESS;
+}
+
 static DWORD
 md_card_capabilities(PCARD_DATA pCardData, PCARD_CAPABILITIES  pCardCapabilities)
 {
+	VENDOR_SPECIFIC *vs;
+
 	if (!pCardCapabilities)
 		return SCARD_E_INVALID_PARAMETER;
 
@@ -2193,7 +2486,11 @@ md_card_capabilities(PCARD_DATA pCardData, PCARD_CAPABILITIES  pCardCapabilities
 	pCardCapabilities->dwVersion = CARD_CAPABILITIES_CURRENT_VERSION;
 	pCardCapabilities->fCertificateCompression = TRUE;
 	/* a read only card cannot generate new keys */
-	pCardCapabilities->fKeyGen = ! md_is_read_only(pCardData);
+	vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
+	if (vs && md_props_load(pCardData) == SCARD_S_SUCCESS)
+		pCardCapabilities->fKeyGen = ! vs->props.read_only;
+	else
+		pCardCapabilities->fKeyGen = ! md_is_read_only(pCardData);
 
 	return SCARD_S_SUCCESS;
 }
@@ -2214,6 +2511,14 @@ md_free_space(PCARD_DATA pCardData, PCARD_FREE_SPACE_INFO pCardFreeSpaceInfo)
 	if (!vs)
 		return SCARD_E_INVALID_PARAMETER;
 
+	if (vs->props.free_space_valid)   {
+		*pCardFreeSpaceInfo = vs->props.free_space;
+		return SCARD_S_SUCCESS;
+	}
+
+	if (md_fs_load_containers(pCardData) != SCARD_S_SUCCESS)
+		return SCARD_F_INTERNAL_ERROR;
+
 	/* Count free containers */
 	for (idx=0, count=0; idx<MD_MAX_KEY_CONTAINERS; idx++)
 		if (!vs->p15_containers[idx].prkey_obj)
@@ -2224,6 +2529,8 @@ md_free_space(PCARD_DATA pCardData, PCARD_FREE_SPACE_INFO pCardFreeSpaceInfo)
 	pCardFreeSpaceInfo->dwKeyContainersAvailable = count;
 	pCardFreeSpaceInfo->dwMaxKeyContainers = MD_MAX_KEY_CONTAINERS;
 
+	vs->props.free_space = *pCardFreeSpaceInfo;
+	vs->props.free_space_valid = TRUE;
 	return SCARD_S_SUCCESS;
 }
 
@@ -2712,6 +3019,7 @@ md_pkcs15_store_certificate(PCARD_DATA pCardData, char *file_name, unsigned char
 		goto done;
 	}
 
+	md_msroots_cache_invalidate(pCardData);
 	dwret = SCARD_S_SUCCESS;
 done:
 	sc_pkcs15init_unbind(profile);
@@ -3215,6 +3523,23 @@ DWORD WINAPI CardDeleteContext(__inout PCARD_DATA  pCardData)
 	if(!vs)
 		MD_FUNC_RETURN(pCardData, 1, SCARD_E_INVALID_PARAMETER);
 
+	EnterCriticalSection(&md_shared_lock);
+	if (vs->refcount > 1) {
+		EnterCriticalSection(&vs->hScard_lock);
+		vs->refcount--;
+		logprintf(pCardData, 1, "card state still used by %ld contexts\n",
+			  (long)vs->refcount);
+		/* the window and PIN context given by this caller are no longer valid */
+		vs->hwndParent = NULL;
+		vs->wszPinContext = NULL;
+		pCardData->pvVendorSpecific = NULL;
+		LeaveCriticalSection(&vs->hScard_lock);
+		LeaveCriticalSection(&md_shared_lock);
+		MD_FUNC_RETURN(pCardData, 1, SCARD_S_SUCCESS);
+	}
+	md_shared_remove(vs);
+	LeaveCriticalSection(&md_shared_lock);
+
 	hScard_lock = vs->hScard_lock;
 	EnterCriticalSection(&hScard_lock);
 
@@ -3292,6 +3617,10 @@ DWORD WINAPI CardDeleteContainer(__in PCARD_DATA pCardData,
 	if (dwret != SCARD_S_SUCCESS) {
 		goto err;
 	}
+	dwret = md_fs_load_containers(pCardData);
+	if (dwret != SCARD_S_SUCCESS) {
+		goto err;
+	}
 
 	if (bContainerIndex >= MD_MAX_KEY_CONTAINERS) {
 		dwret = SCARD_E_INVALID_PARAMETER;
@@ -3325,6 +3654,8 @@ DWORD WINAPI CardDeleteContainer(__in PCARD_DATA pCardData,
 	}
 
 	ZeroMemory(cont, sizeof(struct md_pkcs15_container));
+	md_container_cache_invalidate(vs, bContainerIndex);
+	vs->props.free_space_valid = FALSE;
 
 	logprintf(pCardData, 1, "key deleted\n");
 
@@ -3365,6 +3696,9 @@ DWORD WINAPI CardCreateContainerEx(__in PCARD_DATA  pCardData,
 	}
 
 	dwret = check_card_reader_status(pCardData, "CardCreateContainerEx");
+	if (dwret != SCARD_S_SUCCESS)
+		goto err;
+	dwret = md_fs_load_containers(pCardData);
 	if (dwret != SCARD_S_SUCCESS)
 		goto err;
 
@@ -3426,6 +3760,7 @@ DWORD WINAPI CardCreateContainerEx(__in PCARD_DATA  pCardData,
 		dwret = SCARD_E_INVALID_PARAMETER;
 		goto err;
 	}
+	((VENDOR_SPECIFIC*)pCardData->pvVendorSpecific)->props.free_space_valid = FALSE;
 
 err:
 	unlock(pCardData);
@@ -3456,6 +3791,99 @@ typedef struct {
 	RSAPUBKEY rsapubkey;
 } PUBRSAKEYSTRUCT_BASE;
 
+/*
+ * Get the SubjectPublicKeyInfo of the container idx. It is read from the card
+ * or the certificate once and kept in vs->pubkey_cache until the objects of
+ * the container change or the card is disassociated.
+ */
+static DWORD
+md_container_pubkey(PCARD_DATA pCardData, BYTE idx, struct sc_pkcs15_der *out)
+{
+	VENDOR_SPECIFIC *vs = (VENDOR_SPECIFIC *)pCardData->pvVendorSpecific;
+	struct md_pkcs15_container *cont = &vs->p15_containers[idx];
+	struct md_pubkey_cache *cache = &vs->pubkey_cache[idx];
+	struct sc_pkcs15_der der;
+	DWORD ret = SCARD_F_UNKNOWN_ERROR;
+	int rv;
+
+	if (cache->der.value && cache->prkey_obj == cont->prkey_obj
+			&& cache->pubkey_obj == cont->pubkey_obj
+			&& cache->cert_obj == cont->cert_obj) {
+		logprintf(pCardData, 3, "public key of container %u from cache\n",
+			  (unsigned int)idx);
+		*out = cache->der;
+		return SCARD_S_SUCCESS;
+	}
+	md_container_cache_invalidate(vs, idx);
+
+	der.value = NULL;
+	der.len = 0;
+
+	if ((cont->prkey_obj->content.value != NULL) && (cont->prkey_obj->content.len > 0))   {
+		sc_der_copy(&der, &cont->prkey_obj->content);
+		ret = SCARD_S_SUCCESS;
+	}
+
+	if (!der.value && cont->pubkey_obj)   {
+		struct sc_pkcs15_pubkey *pubkey = NULL;
+
+		logprintf(pCardData, 1, "now read public key '%.*s'\n", (int) sizeof cont->pubkey_obj->label, cont->pubkey_obj->label);
+		rv = sc_pkcs15_read_pubkey(vs->p15card, cont->pubkey_obj, &pubkey);
+		if (!rv)   {
+			rv = sc_pkcs15_encode_pubkey(vs->ctx, pubkey, &der.value, &der.len);
+			if (rv)   {
+				logprintf(pCardData, 1, "encode public key error %d\n", rv);
+				ret = SCARD_F_INTERNAL_ERROR;
+			}
+			else   {
+				logprintf(pCardData, 1, "public key encoded\n");
+				ret = SCARD_S_SUCCESS;
+			}
+
+			sc_pkcs15_free_pubkey(pubkey);
+		}
+		else {
+			logprintf(pCardData, 1, "public key read error %d\n", rv);
+			ret = SCARD_E_FILE_NOT_FOUND;
+		}
+	}
+
+	if (!der.value && cont->cert_obj)   {
+		struct sc_pkcs15_cert *cert = NULL;
+
+		logprintf(pCardData, 1, "now read certificate '%.*s'\n", (int) sizeof cont->cert_obj->label, cont->cert_obj->label);
+		rv = sc_pkcs15_read_certificate(vs->p15card, (struct sc_pkcs15_cert_info *)(cont->cert_obj->data), &cert);
+		if(!rv)   {
+			rv = sc_pkcs15_encode_pubkey(vs->ctx, cert->key, &der.value, &der.len);
+			if (rv)   {
+				logprintf(pCardData, 1, "encode certificate public key error %d\n", rv);
+				ret = SCARD_F_INTERNAL_ERROR;
+			}
+			else   {
+				logprintf(pCardData, 1, "certificate public key encoded\n");
+				ret = SCARD_S_SUCCESS;
+			}
+
+			sc_pkcs15_free_certificate(cert);
+		}
+		else   {
+			logprintf(pCardData, 1,
+				  "certificate '%u' read error %d\n",
+				  (unsigned int)idx, rv);
+			ret = SCARD_E_FILE_NOT_FOUND;
+		}
+	}
+
+	if (der.value) {
+		cache->prkey_obj = cont->prkey_obj;
+		cache->pubkey_obj = cont->pubkey_obj;
+		cache->cert_obj = cont->cert_obj;
+		cache->der = der;
+	}
+	*out = der;
+	return ret;
+}
+
 DWORD WINAPI CardGetContainerInfo(__in PCARD_DATA pCardData, __in BYTE bContainerIndex, __in DWORD dwFlags,
 	__inout PCONTAINER_INFO pContainerInfo)
 {
@@ -3465,7 +3893,6 @@ DWORD WINAPI CardGetContainerInfo(__in PCARD_DATA pCardData, __in BYTE bContaine
 	struct md_pkcs15_container *cont = NULL;
 	struct sc_pkcs15_der pubkey_der;
 	struct sc_pkcs15_prkey_info *prkey_info = NULL;
-	int rv;
 	pubkey_der.value = NULL;
 	pubkey_der.len = 0;
 
@@ -3477,6 +3904,9 @@ DWORD WINAPI CardGetContainerInfo(__in PCARD_DATA pCardData, __in BYTE bContaine
 		MD_FUNC_RETURN(pCardData, 1, SCARD_E_INVALID_PARAMETER);
 
 	ret = check_card_reader_status(pCardData, "CardGetContainerInfo");
+	if (ret != SCARD_S_SUCCESS)
+		goto err;
+	ret = md_fs_load_containers(pCardData);
 	if (ret != SCARD_S_SUCCESS)
 		goto err;
 
@@ -3520,63 +3950,9 @@ DWORD WINAPI CardGetContainerInfo(__in PCARD_DATA pCardData, __in BYTE bContaine
 		goto err;
 	}
 
-	ret = SCARD_F_UNKNOWN_ERROR;
 	prkey_info = (struct sc_pkcs15_prkey_info *)cont->prkey_obj->data;
 
-	if ((cont->prkey_obj->content.value != NULL) && (cont->prkey_obj->content.len > 0))   {
-		sc_der_copy(&pubkey_der, &cont->prkey_obj->content);
-		ret = SCARD_S_SUCCESS;
-	}
-
-	if (!pubkey_der.value && cont->pubkey_obj)   {
-		struct sc_pkcs15_pubkey *pubkey = NULL;
-
-		logprintf(pCardData, 1, "now read public key '%.*s'\n", (int) sizeof cont->pubkey_obj->label, cont->pubkey_obj->label);
-		rv = sc_pkcs15_read_pubkey(vs->p15card, cont->pubkey_obj, &pubkey);
-		if (!rv)   {
-			rv = sc_pkcs15_encode_pubkey(vs->ctx, pubkey, &pubkey_der.value, &pubkey_der.len);
-			if (rv)   {
-				logprintf(pCardData, 1, "encode public key error %d\n", rv);
-				ret = SCARD_F_INTERNAL_ERROR;
-			}
-			else   {
-				logprintf(pCardData, 1, "public key encoded\n");
-				ret = SCARD_S_SUCCESS;
-			}
-
-			sc_pkcs15_free_pubkey(pubkey);
-		}
-		else {
-			logprintf(pCardData, 1, "public key read error %d\n", rv);
-			ret = SCARD_E_FILE_NOT_FOUND;
-		}
-	}
-
-	if (!pubkey_der.value && cont->cert_obj)   {
-		struct sc_pkcs15_cert *cert = NULL;
-
-		logprintf(pCardData, 1, "now read certificate '%.*s'\n", (int) sizeof cont->cert_obj->label, cont->cert_obj->label);
-		rv = sc_pkcs15_read_certificate(vs->p15card, (struct sc_pkcs15_cert_info *)(cont->cert_obj->data), &cert);
-		if(!rv)   {
-			rv = sc_pkcs15_encode_pubkey(vs->ctx, cert->key, &pubkey_der.value, &pubkey_der.len);
-			if (rv)   {
-				logprintf(pCardData, 1, "encode certificate public key error %d\n", rv);
-				ret = SCARD_F_INTERNAL_ERROR;
-			}
-			else   {
-				logprintf(pCardData, 1, "certificate public key encoded\n");
-				ret = SCARD_S_SUCCESS;
-			}
-
-			sc_pkcs15_free_certificate(cert);
-		}
-		else   {
-			logprintf(pCardData, 1,
-				  "certificate '%u' read error %d\n",
-				  (unsigned int)bContainerIndex, rv);
-			ret = SCARD_E_FILE_NOT_FOUND;
-		}
-	}
+	ret = md_container_pubkey(pCardData, bContainerIndex, &pubkey_der);
 
 	if (!pubkey_der.value && (cont->size_sign || cont->size_key_exchange)) {
 		logprintf(pCardData, 2, "cannot find public key\n");
@@ -3729,7 +4105,6 @@ DWORD WINAPI CardGetContainerInfo(__in PCARD_DATA pCardData, __in BYTE bContaine
 		  (unsigned int)bContainerIndex);
 
 err:
-	free(pubkey_der.value);
 	unlock(pCardData);
 
 	MD_FUNC_RETURN(pCardData, 1,  ret);
@@ -4374,6 +4749,12 @@ DWORD WINAPI CardGetFileInfo(__in PCARD_DATA pCardData,
 		goto err;
 	}
 
+	if (!file->blob) {
+		dwret = md_fs_read_content(pCardData, pszDirectoryName, file);
+		if (dwret != SCARD_S_SUCCESS)
+			goto err;
+	}
+
 	pCardFileInfo->dwVersion = CARD_FILE_INFO_CURRENT_VERSION;
 	pCardFileInfo->cbFileSize = (DWORD) file->size;
 	pCardFileInfo->AccessCondition = file->acl;
@@ -4492,6 +4873,9 @@ DWORD WINAPI CardRSADecrypt(__in PCARD_DATA pCardData,
 		MD_FUNC_RETURN(pCardData, 1, SCARD_E_INVALID_PARAMETER);
 
 	dwret = check_card_reader_status(pCardData, "CardRSADecrypt");
+	if (dwret != SCARD_S_SUCCESS)
+		goto err;
+	dwret = md_fs_load_containers(pCardData);
 	if (dwret != SCARD_S_SUCCESS)
 		goto err;
 
@@ -4711,6 +5095,9 @@ DWORD WINAPI CardSignData(__in PCARD_DATA pCardData, __inout PCARD_SIGNING_INFO
 		return SCARD_E_INVALID_PARAMETER;
 
 	dwret = check_card_reader_status(pCardData, "CardSignData");
+	if (dwret != SCARD_S_SUCCESS)
+		goto err;
+	dwret = md_fs_load_containers(pCardData);
 	if (dwret != SCARD_S_SUCCESS)
 		goto err;
 
@@ -4997,6 +5384,9 @@ DWORD WINAPI CardConstructDHAgreement(__in PCARD_DATA pCardData,
 		MD_FUNC_RETURN(pCardData, 1, SCARD_E_INVALID_PARAMETER);
 
 	dwret = check_card_reader_status(pCardData, "CardConstructDHAgreement");
+	if (dwret != SCARD_S_SUCCESS)
+		goto err;
+	dwret = md_fs_load_containers(pCardData);
 	if (dwret != SCARD_S_SUCCESS)
 		goto err;
 
@@ -5799,6 +6189,9 @@ DWORD WINAPI CardAuthenticateEx(__in PCARD_DATA pCardData,
 		MD_FUNC_RETURN(pCardData, 1, SCARD_E_INVALID_PARAMETER);
 
 	dwret = check_card_reader_status(pCardData, "CardAuthenticateEx");
+	if (dwret != SCARD_S_SUCCESS)
+		MD_FUNC_RETURN(pCardData, 1, dwret);
+	dwret = md_fs_load_containers(pCardData);
 	if (dwret != SCARD_S_SUCCESS)
 		MD_FUNC_RETURN(pCardData, 1, dwret);
 
@@ -5987,6 +6380,9 @@ DWORD WINAPI CardChangeAuthenticatorEx(__in PCARD_DATA pCardData,
 		MD_FUNC_RETURN(pCardData, 1, SCARD_E_INVALID_PARAMETER);
 
 	dwret = check_card_reader_status(pCardData, "CardChangeAuthenticatorEx");
+	if (dwret != SCARD_S_SUCCESS)
+		MD_FUNC_RETURN(pCardData, 1, dwret);
+	dwret = md_fs_load_containers(pCardData);
 	if (dwret != SCARD_S_SUCCESS)
 		MD_FUNC_RETURN(pCardData, 1, dwret);
 
@@ -6113,6 +6509,9 @@ DWORD WINAPI CardGetContainerProperty(__in PCARD_DATA pCardData,
 		MD_FUNC_RETURN(pCardData, 1, SCARD_E_INVALID_PARAMETER);
 
 	dwret = check_card_status(pCardData, "CardGetContainerProperty");
+	if (dwret != SCARD_S_SUCCESS)
+		MD_FUNC_RETURN(pCardData, 1, dwret);
+	dwret = md_fs_load_containers(pCardData);
 	if (dwret != SCARD_S_SUCCESS)
 		MD_FUNC_RETURN(pCardData, 1, dwret);
 
@@ -6239,12 +6638,18 @@ DWORD WINAPI CardGetProperty(__in PCARD_DATA pCardData,
 		MD_FUNC_RETURN(pCardData, 1, SCARD_E_INVALID_PARAMETER);
 
 	dwret = check_card_reader_status(pCardData, "CardGetProperty");
+	if (dwret != SCARD_S_SUCCESS)
+		MD_FUNC_RETURN(pCardData, 1, dwret);
+	dwret = md_fs_load_containers(pCardData);
 	if (dwret != SCARD_S_SUCCESS)
 		MD_FUNC_RETURN(pCardData, 1, dwret);
 
 	vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
 	if (!vs)
 		MD_FUNC_RETURN(pCardData, 1, SCARD_E_INVALID_PARAMETER);
+	dwret = md_props_load(pCardData);
+	if (dwret != SCARD_S_SUCCESS)
+		MD_FUNC_RETURN(pCardData, 1, dwret);
 
 	if (wcscmp(CP_CARD_FREE_SPACE,wszProperty) == 0)   {
 		PCARD_FREE_SPACE_INFO pCardFreeSpaceInfo = (PCARD_FREE_SPACE_INFO )pbData;
@@ -6276,10 +6681,12 @@ DWORD WINAPI CardGetProperty(__in PCARD_DATA pCardData,
 			*pdwDataLen = sizeof(*pKeySizes);
 		if (cbData < sizeof(*pKeySizes))
 			MD_FUNC_RETURN(pCardData, 1, ERROR_INSUFFICIENT_BUFFER);
+		if (pKeySizes->dwVersion != CARD_KEY_SIZES_CURRENT_VERSION && pKeySizes->dwVersion != 0)
+			MD_FUNC_RETURN(pCardData, 1, ERROR_REVISION_MISMATCH);
 
-		dwret = md_query_key_sizes(pCardData, 0, pKeySizes);
-		if (dwret != SCARD_S_SUCCESS)
-			MD_FUNC_RETURN(pCardData, 1, dwret);
+		if (vs->props.key_sizes_ret != SCARD_S_SUCCESS)
+			MD_FUNC_RETURN(pCardData, 1, vs->props.key_sizes_ret);
+		*pKeySizes = vs->props.key_sizes;
 	}
 	else if (wcscmp(CP_CARD_READ_ONLY, wszProperty) == 0)   {
 		BOOL *p = (BOOL *)pbData;
@@ -6288,7 +6695,7 @@ DWORD WINAPI CardGetProperty(__in PCARD_DATA pCardData,
 		if (cbData < sizeof(*p))
 			MD_FUNC_RETURN(pCardData, 1, ERROR_INSUFFICIENT_BUFFER);
 
-		*p = md_is_read_only(pCardData);
+		*p = vs->props.read_only;
 	}
 	else if (wcscmp(CP_CARD_CACHE_MODE, wszProperty) == 0)   {
 		DWORD *p = (DWORD *)pbData;
@@ -6304,7 +6711,7 @@ DWORD WINAPI CardGetProperty(__in PCARD_DATA pCardData,
 			*pdwDataLen = sizeof(*p);
 		if (cbData < sizeof(*p))
 			MD_FUNC_RETURN(pCardData, 1, ERROR_INSUFFICIENT_BUFFER);
-		*p = md_is_supports_X509_enrollment(pCardData);
+		*p = vs->props.x509_enrollment;
 	}
 	else if (wcscmp(CP_CARD_GUID, wszProperty) == 0)   {
 		struct md_file *cardid = NULL;
@@ -6323,23 +6730,12 @@ DWORD WINAPI CardGetProperty(__in PCARD_DATA pCardData,
 		CopyMemory(pbData, cardid->blob, cardid->size);
 	}
 	else if (wcscmp(CP_CARD_SERIAL_NO, wszProperty) == 0)   {
-		unsigned char buf[64];
-		size_t buf_len = sizeof(buf);
-
-		if (sc_hex_to_bin(vs->p15card->tokeninfo->serial_number, buf, &buf_len))   {
-			buf_len = strlen(vs->p15card->tokeninfo->serial_number);
-			if (buf_len > SC_MAX_SERIALNR) {
-				buf_len = SC_MAX_SERIALNR;
-			}
-			memcpy(buf, vs->p15card->tokeninfo->serial_number, buf_len);
-		}
-
 		if (pdwDataLen)
-			*pdwDataLen = (DWORD) buf_len;
-		if (cbData < buf_len)
+			*pdwDataLen = (DWORD) vs->props.serial_len;
+		if (cbData < vs->props.serial_len)
 			MD_FUNC_RETURN(pCardData, 1, ERROR_INSUFFICIENT_BUFFER);
 
-		CopyMemory(pbData, buf, buf_len);
+		CopyMemory(pbData, vs->props.serial, vs->props.serial_len);
 	}
 	else if (wcscmp(CP_CARD_PIN_INFO, wszProperty) == 0)   {
 		PPIN_INFO p = (PPIN_INFO) pbData;
@@ -6359,9 +6755,7 @@ DWORD WINAPI CardGetProperty(__in PCARD_DATA pCardData,
 		if (!vs->pin_objs[dwFlags])
 			MD_FUNC_RETURN(pCardData, 1, SCARD_E_INVALID_PARAMETER);
 
-		p->PinType = vs->reader->capabilities & SC_READER_CAP_PIN_PAD
-			|| vs->p15card->card->caps & SC_CARD_CAP_PROTECTED_AUTHENTICATION_PATH
-			? ExternalPinType : AlphaNumericPinType;
+		p->PinType = vs->props.pin_type;
 		p->dwFlags = 0;
 		switch (dwFlags)   {
 			case ROLE_ADMIN:
@@ -6434,10 +6828,7 @@ DWORD WINAPI CardGetProperty(__in PCARD_DATA pCardData,
 			*pdwDataLen = sizeof(*p);
 		if (cbData < sizeof(*p))
 			MD_FUNC_RETURN(pCardData, 1, ERROR_INSUFFICIENT_BUFFER);
-		*p = CARD_PIN_STRENGTH_PLAINTEXT;
-		if (vs->p15card->card->caps & SC_CARD_CAP_SESSION_PIN) {
-			*p |= CARD_PIN_STRENGTH_SESSION_PIN;
-		}
+		*p = vs->props.pin_strength;
 	}
 	else if (wcscmp(CP_KEY_IMPORT_SUPPORT, wszProperty) == 0)   {
 		DWORD *p = (DWORD *)pbData;
@@ -6836,6 +7227,66 @@ DWORD WINAPI CardProcessEncryptedData(
 	MD_FUNC_RETURN(pCardData, 1, SCARD_E_UNSUPPORTED_FEATURE);
 }
 
+static void md_set_functions(PCARD_DATA pCardData)
+{
+	pCardData->pfnCardDeleteContext = CardDeleteContext;
+	pCardData->pfnCardQueryCapabilities = CardQueryCapabilities;
+	pCardData->pfnCardDeleteContainer = CardDeleteContainer;
+	pCardData->pfnCardCreateContainer = CardCreateContainer;
+	pCardData->pfnCardGetContainerInfo = CardGetContainerInfo;
+	pCardData->pfnCardAuthenticatePin = CardAuthenticatePin;
+	pCardData->pfnCardGetChallenge = CardGetChallenge;
+	pCardData->pfnCardAuthenticateChallenge = CardAuthenticateChallenge;
+	pCardData->pfnCardUnblockPin = CardUnblockPin;
+	pCardData->pfnCardChangeAuthenticator = CardChangeAuthenticator;
+	pCardData->pfnCardDeauthenticate = CardDeauthenticate;
+	pCardData->pfnCardCreateDirectory = CardCreateDirectory;
+	pCardData->pfnCardDeleteDirectory = CardDeleteDirectory;
+	pCardData->pvUnused3 = NULL;
+	pCardData->pvUnused4 = NULL;
+	pCardData->pfnCardCreateFile = CardCreateFile;
+	pCardData->pfnCardReadFile = CardReadFile;
+	pCardData->pfnCardWriteFile = CardWriteFile;
+	pCardData->pfnCardDeleteFile = CardDeleteFile;
+	pCardData->pfnCardEnumFiles = CardEnumFiles;
+	pCardData->pfnCardGetFileInfo = CardGetFileInfo;
+	pCardData->pfnCardQueryFreeSpace = CardQueryFreeSpace;
+	pCardData->pfnCardQueryKeySizes = CardQueryKeySizes;
+	pCardData->pfnCardSignData = CardSignData;
+	pCardData->pfnCardRSADecrypt = CardRSADecrypt;
+	pCardData->pfnCardConstructDHAgreement = CardConstructDHAgreement;
+
+	if (pCardData->dwVersion >= CARD_DATA_VERSION_FIVE) {
+		pCardData->pfnCardDeriveKey = CardDeriveKey;
+		pCardData->pfnCardDestroyDHAgreement = CardDestroyDHAgreement;
+
+		if (pCardData->dwVersion >= CARD_DATA_VERSION_SIX) {
+
+			pCardData->pfnCardGetChallengeEx = CardGetChallengeEx;
+			pCardData->pfnCardAuthenticateEx = CardAuthenticateEx;
+			pCardData->pfnCardChangeAuthenticatorEx = CardChangeAuthenticatorEx;
+			pCardData->pfnCardDeauthenticateEx = CardDeauthenticateEx;
+			pCardData->pfnCardGetContainerProperty = CardGetContainerProperty;
+			pCardData->pfnCardSetContainerProperty = CardSetContainerProperty;
+			pCardData->pfnCardGetProperty = CardGetProperty;
+			pCardData->pfnCardSetProperty = CardSetProperty;
+			if (pCardData->dwVersion >= CARD_DATA_VERSION_SEVEN) {
+
+				pCardData->pfnMDImportSessionKey         = MDImportSessionKey;
+				pCardData->pfnMDEncryptData              = MDEncryptData;
+				pCardData->pfnCardImportSessionKey       = CardImportSessionKey;
+				pCardData->pfnCardGetSharedKeyHandle     = CardGetSharedKeyHandle;
+				pCardData->pfnCardGetAlgorithmProperty   = CardGetAlgorithmProperty;
+				pCardData->pfnCardGetKeyProperty         = CardGetKeyProperty;
+				pCardData->pfnCardSetKeyProperty         = CardSetKeyProperty;
+				pCardData->pfnCardProcessEncryptedData   = CardProcessEncryptedData;
+				pCardData->pfnCardDestroyKey             = CardDestroyKey;
+				pCardData->pfnCardCreateContainerEx      = CardCreateContainerEx;
+			}
+		}
+	}
+}
+
 DWORD WINAPI CardAcquireContext(__inout PCARD_DATA pCardData, __in DWORD dwFlags)
 {
 	VENDOR_SPECIFIC *vs;
@@ -6888,6 +7339,27 @@ DWORD WINAPI CardAcquireContext(__inout PCARD_DATA pCardData, __in DWORD dwFlags
 
 	suppliedVersion = pCardData->dwVersion;
 
+	if (md_share_context()) {
+		EnterCriticalSection(&md_shared_lock);
+		vs = md_shared_find(pCardData);
+		if (vs) {
+			vs->refcount++;
+			pCardData->pvVendorSpecific = vs;
+			LeaveCriticalSection(&md_shared_lock);
+
+			logprintf(pCardData, 1,
+				  "\nP:%lu T:%lu pCardData:%p CardAcquireContext, hScard=0x%08"SC_FORMAT_LEN_SIZE_T"X: reusing the bound card, %ld contexts\n",
+				  (unsigned long)GetCurrentProcessId(),
+				  (unsigned long)GetCurrentThreadId(), pCardData,
+				  (size_t)pCardData->hScard, (long)vs->refcount);
+			pCardData->dwVersion = min(pCardData->dwVersion, MD_CURRENT_VERSION_SUPPORTED);
+			md_set_functions(pCardData);
+			unlock(pCardData);
+			MD_FUNC_RETURN(pCardData, 1, SCARD_S_SUCCESS);
+		}
+		LeaveCriticalSection(&md_shared_lock);
+	}
+
 	/* VENDOR SPECIFIC */
 	vs = pCardData->pvVendorSpecific = pCardData->pfnCspAlloc(sizeof(VENDOR_SPECIFIC));
 	if (!vs)
@@ -6921,32 +7393,7 @@ DWORD WINAPI CardAcquireContext(__inout PCARD_DATA pCardData, __in DWORD dwFlags
 	if (dwret != SCARD_S_SUCCESS)
 		goto ret_free;
 
-	pCardData->pfnCardDeleteContext = CardDeleteContext;
-	pCardData->pfnCardQueryCapabilities = CardQueryCapabilities;
-	pCardData->pfnCardDeleteContainer = CardDeleteContainer;
-	pCardData->pfnCardCreateContainer = CardCreateContainer;
-	pCardData->pfnCardGetContainerInfo = CardGetContainerInfo;
-	pCardData->pfnCardAuthenticatePin = CardAuthenticatePin;
-	pCardData->pfnCardGetChallenge = CardGetChallenge;
-	pCardData->pfnCardAuthenticateChallenge = CardAuthenticateChallenge;
-	pCardData->pfnCardUnblockPin = CardUnblockPin;
-	pCardData->pfnCardChangeAuthenticator = CardChangeAuthenticator;
-	pCardData->pfnCardDeauthenticate = CardDeauthenticate;
-	pCardData->pfnCardCreateDirectory = CardCreateDirectory;
-	pCardData->pfnCardDeleteDirectory = CardDeleteDirectory;
-	pCardData->pvUnused3 = NULL;
-	pCardData->pvUnused4 = NULL;
-	pCardData->pfnCardCreateFile = CardCreateFile;
-	pCardData->pfnCardReadFile = CardReadFile;
-	pCardData->pfnCardWriteFile = CardWriteFile;
-	pCardData->pfnCardDeleteFile = CardDeleteFile;
-	pCardData->pfnCardEnumFiles = CardEnumFiles;
-	pCardData->pfnCardGetFileInfo = CardGetFileInfo;
-	pCardData->pfnCardQueryFreeSpace = CardQueryFreeSpace;
-	pCardData->pfnCardQueryKeySizes = CardQueryKeySizes;
-	pCardData->pfnCardSignData = CardSignData;
-	pCardData->pfnCardRSADecrypt = CardRSADecrypt;
-	pCardData->pfnCardConstructDHAgreement = CardConstructDHAgreement;
+	md_set_functions(pCardData);
 
 	dwret = associate_card(pCardData);
 	if (dwret != SCARD_S_SUCCESS)
@@ -6961,34 +7408,15 @@ DWORD WINAPI CardAcquireContext(__inout PCARD_DATA pCardData, __in DWORD dwFlags
 		  (unsigned long)suppliedVersion,
 		  (unsigned long)pCardData->dwVersion);
 
-	if (pCardData->dwVersion >= CARD_DATA_VERSION_FIVE) {
-		pCardData->pfnCardDeriveKey = CardDeriveKey;
-		pCardData->pfnCardDestroyDHAgreement = CardDestroyDHAgreement;
-
-		if (pCardData->dwVersion >= CARD_DATA_VERSION_SIX) {
-
-			pCardData->pfnCardGetChallengeEx = CardGetChallengeEx;
-			pCardData->pfnCardAuthenticateEx = CardAuthenticateEx;
-			pCardData->pfnCardChangeAuthenticatorEx = CardChangeAuthenticatorEx;
-			pCardData->pfnCardDeauthenticateEx = CardDeauthenticateEx;
-			pCardData->pfnCardGetContainerProperty = CardGetContainerProperty;
-			pCardData->pfnCardSetContainerProperty = CardSetContainerProperty;
-			pCardData->pfnCardGetProperty = CardGetProperty;
-			pCardData->pfnCardSetProperty = CardSetProperty;
-			if (pCardData->dwVersion >= CARD_DATA_VERSION_SEVEN) {
-
-				pCardData->pfnMDImportSessionKey         = MDImportSessionKey;
-				pCardData->pfnMDEncryptData              = MDEncryptData;
-				pCardData->pfnCardImportSessionKey       = CardImportSessionKey;
-				pCardData->pfnCardGetSharedKeyHandle     = CardGetSharedKeyHandle;
-				pCardData->pfnCardGetAlgorithmProperty   = CardGetAlgorithmProperty;
-				pCardData->pfnCardGetKeyProperty         = CardGetKeyProperty;
-				pCardData->pfnCardSetKeyProperty         = CardSetKeyProperty;
-				pCardData->pfnCardProcessEncryptedData   = CardProcessEncryptedData;
-				pCardData->pfnCardDestroyKey             = CardDestroyKey;
-				pCardData->pfnCardCreateContainerEx      = CardCreateContainerEx;
-			}
-		}
+	vs->refcount = 1;
+	memcpy(vs->atr, pCardData->pbAtr, pCardData->cbAtr);
+	vs->atr_len = pCardData->cbAtr;
+	vs->pfnCspFree = pCardData->pfnCspFree;
+	if (md_share_context()) {
+		EnterCriticalSection(&md_shared_lock);
+		vs->next = md_shared_cards;
+		md_shared_cards = vs;
+		LeaveCriticalSection(&md_shared_lock);
 	}
 
 	unlock(pCardData);
@@ -7067,6 +7495,10 @@ static DWORD associate_card(PCARD_DATA pCardData)
 		MD_FUNC_RETURN(pCardData, 1, SCARD_E_UNKNOWN_CARD);
 	}
 
+	/* identifies the card for md_shared_find() */
+	if (sc_card_ctl(vs->card, SC_CARDCTL_GET_SERIALNR, &vs->serial) != SC_SUCCESS)
+		vs->serial.len = 0;
+
 	vs->initialized = TRUE;
 
 	MD_FUNC_RETURN(pCardData, 1, SCARD_S_SUCCESS);
@@ -7075,6 +7507,7 @@ static DWORD associate_card(PCARD_DATA pCardData)
 static void disassociate_card(PCARD_DATA pCardData)
 {
 	VENDOR_SPECIFIC *vs;
+	int i;
 
 	if (!pCardData) {
 		logprintf(pCardData, 1,
@@ -7093,6 +7526,9 @@ static void disassociate_card(PCARD_DATA pCardData)
 
 	memset(vs->pin_objs, 0, sizeof(vs->pin_objs));
 	memset(vs->p15_containers, 0, sizeof(vs->p15_containers));
+	for (i = 0; i < MD_MAX_KEY_CONTAINERS; i++)
+		md_container_cache_invalidate(vs, i);
+	memset(&vs->props, 0, sizeof(vs->props));
 
 	if(vs->p15card)   {
 		logprintf(pCardData, 6, "sc_pkcs15_unbind\n");
@@ -7150,9 +7586,11 @@ BOOL APIENTRY DllMain( HINSTANCE hinstDLL,
 		g_inst = hinstDLL;
 		sc_notify_instance = hinstDLL;
 		sc_notify_init();
+		InitializeCriticalSection(&md_shared_lock);
 		break;
 	case DLL_PROCESS_DETACH:
 		sc_notify_close();
+		DeleteCriticalSection(&md_shared_lock);
 		if (lpReserved == NULL) {
 #if defined(ENABLE_OPENSSL) && defined(OPENSSL_SECURE_MALLOC_SIZE)
 			CRYPTO_secure_malloc_done();
@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS11
+
 #include "config.h"
 #include <stdlib.h>
 #include <string.h>
@@ -30,6 +32,7 @@
 #include "common/compat_strnlen.h"
 #ifdef ENABLE_OPENSSL
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 #else
 #define SHA_DIGEST_LENGTH	20
 #endif
@@ -58,7 +61,26 @@ struct pkcs15_slot_data {
 	}                                       \
 	attr->ulValueLen = size;
 
+/* Copies a value into the attribute like check_attribute_buffer() */
+static CK_RV
+copy_attribute_value(CK_ATTRIBUTE_PTR attr, const unsigned char *value, size_t len)
+{
+	check_attribute_buffer(attr, len);
+	memcpy(attr->pValue, value, len);
+	return CKR_OK;
+}
+
 #define MAX_OBJECTS	128
+
+/* Groups of PKCS#15 object types, created in the framework on demand.
+ * Keys and certificates refer to each other and are created together,
+ * unless fast_first_signature lets a private key come first. */
+#define PKCS15_OBJECTS_PRKEYS	0x01	/* PrKDF */
+#define PKCS15_OBJECTS_DATA	0x02	/* DODF */
+#define PKCS15_OBJECTS_SKEYS	0x04	/* SKDF */
+#define PKCS15_OBJECTS_PUBKEYS	0x08	/* PuKDF and CDF */
+#define PKCS15_OBJECTS_KEYS	(PKCS15_OBJECTS_PRKEYS | PKCS15_OBJECTS_PUBKEYS)
+#define PKCS15_OBJECTS_ALL	0x0F
 struct pkcs15_fw_data {
 	struct sc_pkcs15_card *		p15_card;
 	struct pkcs15_any_object *	objects[MAX_OBJECTS];
@@ -66,6 +88,20 @@ struct pkcs15_fw_data {
 	unsigned int			locked;
 	unsigned char user_puk[64];
 	unsigned int user_puk_len;
+	/* PKCS15_OBJECTS_* groups already created in objects[] */
+	unsigned int			loaded;
+	/* slot receiving the public objects, see pkcs15_create_tokens() */
+	struct sc_pkcs11_slot *		public_slot;
+	/* host DRBG seeded from the card, see random_drbg in opensc.conf */
+	void *				drbg;
+};
+
+/* Attribute value that has to be encoded, kept for the next query */
+struct pkcs15_attr_cache {
+	struct pkcs15_attr_cache *	next;
+	CK_ATTRIBUTE_TYPE		type;
+	size_t				len;
+	unsigned char			value[1];
 };
 
 struct pkcs15_any_object {
@@ -76,6 +112,7 @@ struct pkcs15_any_object {
 	struct pkcs15_pubkey_object *	related_pubkey;
 	struct pkcs15_cert_object *	related_cert;
 	struct pkcs15_prkey_object *	related_privkey;
+	struct pkcs15_attr_cache *	attr_cache;
 };
 
 struct pkcs15_cert_object {
@@ -95,6 +132,13 @@ struct pkcs15_prkey_object {
 
 	struct sc_pkcs15_prkey_info *	prv_info;
 	struct sc_pkcs15_pubkey *	pub_data;
+
+	/* the algo_refs of the key resolved against the token algorithms
+	 * when the object is created, see pkcs15_prkey_resolve_algos() */
+	CK_MECHANISM_TYPE		algo_mechs[SC_MAX_SUPPORTED_ALGORITHMS];
+	CK_FLAGS			algo_ops[SC_MAX_SUPPORTED_ALGORITHMS];
+	unsigned int			num_algos;
+	CK_RV				algo_miss;	/* when none matches */
 };
 #define prv_flags		base.base.flags
 #define prv_p15obj		base.p15_object
@@ -131,6 +175,8 @@ struct pkcs15_skey_object {
 
 	struct sc_pkcs15_skey_info *info;
 	struct sc_pkcs15_skey *valueXXXX;
+	/* session key held in host memory, not known to the PKCS#15 card */
+	struct sc_pkcs15_object *host_obj;
 };
 
 #define is_skey(obj) ((__p15_type(obj) & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_SKEY)
@@ -193,6 +239,7 @@ static const struct {
 #endif
 
 static int	__pkcs15_release_object(struct pkcs15_any_object *);
+static void	pkcs15_free_host_skey(struct sc_pkcs15_object *);
 static CK_RV	register_mechanisms(struct sc_pkcs11_card *p11card);
 static CK_RV	get_public_exponent(struct sc_pkcs15_pubkey *,
 					CK_ATTRIBUTE_PTR);
@@ -202,11 +249,13 @@ static CK_RV	get_modulus_bits(struct sc_pkcs15_pubkey *,
 					CK_ATTRIBUTE_PTR);
 static CK_RV	get_usage_bit(unsigned int usage, CK_ATTRIBUTE_PTR attr);
 static CK_RV	get_gostr3410_params(const u8 *, size_t, CK_ATTRIBUTE_PTR);
-static CK_RV	get_ec_pubkey_point(struct sc_pkcs15_pubkey *, CK_ATTRIBUTE_PTR);
+static CK_RV	get_ec_pubkey_point(struct pkcs15_any_object *,
+					struct sc_pkcs15_pubkey *, CK_ATTRIBUTE_PTR);
 static CK_RV	get_ec_pubkey_params(struct sc_pkcs15_pubkey *, CK_ATTRIBUTE_PTR);
 static int	lock_card(struct pkcs15_fw_data *);
 static int	unlock_card(struct pkcs15_fw_data *);
 static int	reselect_app_df(sc_pkcs15_card_t *p15card);
+static void	pkcs15_dobj_forget_private_values(struct sc_pkcs15_card *);
 
 #ifdef USE_PKCS15_INIT
 static CK_RV	set_gost3410_params(struct sc_pkcs15init_prkeyargs *,
@@ -337,6 +386,7 @@ pkcs15_bind(struct sc_pkcs11_card *p11card, struct sc_app_info *app_info)
 			       ck_rv);
 			return ck_rv;
 		}
+		sc_pkcs11_index_mechanisms(p11card);
 	}
 
 	if (idx == 0) {
@@ -390,6 +440,9 @@ pkcs15_unbind(struct sc_pkcs11_card *p11card)
 		}
 		fw_data->p15_card = NULL;
 
+#ifdef ENABLE_OPENSSL
+		sc_pkcs11_drbg_free(fw_data->drbg);
+#endif
 		free(fw_data);
 		p11card->fws_data[idx] = NULL;
 	}
@@ -401,22 +454,19 @@ pkcs15_unbind(struct sc_pkcs11_card *p11card)
 static void
 pkcs15_init_token_info(struct sc_pkcs15_card *p15card, CK_TOKEN_INFO_PTR pToken)
 {
-	scconf_block *conf_block = NULL;
-	char *model = NULL;
+	const struct sc_pkcs15_conf *conf;
+	const char *model = NULL;
 
-	conf_block = sc_get_conf_block(p15card->card->ctx, "framework", "pkcs15", 1);
-	if (conf_block && p15card->file_app)   {
-		scconf_block **blocks = NULL;
+	conf = sc_pkcs15_get_conf(p15card->card->ctx);
+	if (conf && conf->app_count && p15card->file_app)   {
+		const struct sc_pkcs15_conf_app *app;
 		char str_path[SC_MAX_AID_STRING_SIZE];
 
 		memset(str_path, 0, sizeof(str_path));
 		sc_bin_to_hex(p15card->file_app->path.value, p15card->file_app->path.len, str_path, sizeof(str_path), 0);
-		blocks = scconf_find_blocks(p15card->card->ctx->conf, conf_block, "application", str_path);
-		if (blocks)   {
-			if (blocks[0])
-				model = (char *)scconf_get_str(blocks[0], "model", NULL);
-			free(blocks);
-		}
+		app = sc_pkcs15_conf_find_app(conf, str_path);
+		if (app)
+			model = app->model;
 	}
 
 	if (model)
@@ -506,12 +556,64 @@ __pkcs15_release_object(struct pkcs15_any_object *obj)
 	if (--(obj->refcount) != 0)
 		return obj->refcount;
 
+	if (obj->base.ops == &pkcs15_skey_ops)
+		pkcs15_free_host_skey(((struct pkcs15_skey_object *) obj)->host_obj);
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_free_verify_key(obj->base.verify_key);
+#endif
+	while (obj->attr_cache) {
+		struct pkcs15_attr_cache *entry = obj->attr_cache;
+
+		obj->attr_cache = entry->next;
+		free(entry);
+	}
 	sc_mem_clear(obj, obj->size);
 	free(obj);
 
 	return 0;
 }
 
+/*
+ * Applications usually ask for the length of an attribute before its
+ * value, so attributes which have to be encoded for every query are kept
+ * with the object. Only values derived from data that does not change
+ * while the object exists may be cached.
+ */
+static int
+attr_cache_get(struct pkcs15_any_object *obj, CK_ATTRIBUTE_PTR attr, CK_RV *rv)
+{
+	struct pkcs15_attr_cache *entry;
+
+	for (entry = obj->attr_cache; entry; entry = entry->next) {
+		if (entry->type == attr->type) {
+			*rv = copy_attribute_value(attr, entry->value, entry->len);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Returns the encoded value in the attribute and keeps it, frees value */
+static CK_RV
+attr_cache_put(struct pkcs15_any_object *obj, CK_ATTRIBUTE_PTR attr,
+		unsigned char *value, size_t len)
+{
+	struct pkcs15_attr_cache *entry;
+	CK_RV rv;
+
+	rv = copy_attribute_value(attr, value, len);
+	entry = malloc(sizeof(*entry) + len);
+	if (entry) {
+		entry->type = attr->type;
+		entry->len = len;
+		memcpy(entry->value, value, len);
+		entry->next = obj->attr_cache;
+		obj->attr_cache = entry;
+	}
+	free(value);
+	return rv;
+}
+
 #ifdef USE_PKCS15_INIT
 static int
 __pkcs15_delete_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object *obj)
@@ -540,8 +642,12 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	struct sc_pkcs15_card *p15card = NULL;
 	struct sc_pkcs15_object *auth;
 	struct sc_pkcs15_auth_info *pin_info;
+	struct sc_pkcs11_card *p11card = NULL, *locked;
+	CK_FLAGS pin_flags = 0;
+	sc_timestamp_t now;
 	CK_RV rv;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	sc_log(context, "C_GetTokenInfo(%lx)", slotID);
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
@@ -565,6 +671,19 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 		goto out;
 	}
 
+	/* token_info is only changed with the global lock held, so a recent
+	 * PIN status is returned without waiting for operations on the card.
+	 * A slot whose application is not bound yet has no PIN status. */
+	now = get_current_time();
+	if ((now != 0 && now < slot->token_info_expires)
+			|| (slot->flags & SC_PKCS11_SLOT_FLAG_UNBOUND)) {
+		memcpy(pInfo, &slot->token_info, sizeof(CK_TOKEN_INFO));
+		goto out;
+	}
+
+	locked = slot->p11card;
+	p11card = sc_pkcs11_lock_slot(slot);
+
 	fw_data = (struct pkcs15_fw_data *) slot->p11card->fws_data[slot->fw_data_idx];
 	if (!fw_data) {
 		rv = sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_GetTokenInfo");
@@ -576,12 +695,9 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 		goto out;
 	}
 
-	/* User PIN flags are cleared before re-calculation */
-	slot->token_info.flags &= ~(CKF_USER_PIN_COUNT_LOW|CKF_USER_PIN_FINAL_TRY|CKF_USER_PIN_LOCKED);
+	/* User PIN flags are re-calculated from the card */
 	auth = slot_data_auth(slot->fw_data);
-	sc_log(context,
-		"C_GetTokenInfo() auth. object %p, token-info flags 0x%lX", auth,
-		slot->token_info.flags);
+	sc_log(context, "C_GetTokenInfo() auth. object %p", auth);
 	if (auth) {
 		pin_info = (struct sc_pkcs15_auth_info*) auth->data;
 
@@ -589,16 +705,34 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 
 		if (pin_info->tries_left >= 0) {
 			if (pin_info->tries_left == 1 || pin_info->max_tries == 1)
-				slot->token_info.flags |= CKF_USER_PIN_FINAL_TRY;
+				pin_flags = CKF_USER_PIN_FINAL_TRY;
 			else if (pin_info->tries_left == 0)
-				slot->token_info.flags |= CKF_USER_PIN_LOCKED;
+				pin_flags = CKF_USER_PIN_LOCKED;
 			else if (pin_info->max_tries > 1 && pin_info->tries_left < pin_info->max_tries)
-				slot->token_info.flags |= CKF_USER_PIN_COUNT_LOW;
+				pin_flags = CKF_USER_PIN_COUNT_LOW;
 		}
 	}
+
+	/* Publish the new PIN status with the global lock held again. The
+	 * token may have been removed in the meantime. */
+	if (p11card) {
+		sc_pkcs11_unlock_slot(p11card);
+		p11card = NULL;
+		rv = sc_pkcs11_lock();
+		if (rv != CKR_OK)
+			return rv;
+		if (slot->p11card != locked) {
+			rv = CKR_DEVICE_REMOVED;
+			goto out;
+		}
+	}
+	slot->token_info.flags &= ~(CKF_USER_PIN_COUNT_LOW|CKF_USER_PIN_FINAL_TRY|CKF_USER_PIN_LOCKED);
+	slot->token_info.flags |= pin_flags;
+	slot->token_info_expires = now ? now + 1000 : 0;
+	sc_log(context, "C_GetTokenInfo() token-info flags 0x%lX", slot->token_info.flags);
 	memcpy(pInfo, &slot->token_info, sizeof(CK_TOKEN_INFO));
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	sc_log(context, "C_GetTokenInfo(%lx) returns %s", slotID, lookup_enum(RV_T, rv));
 	return rv;
 }
@@ -662,33 +796,23 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 		struct pkcs15_any_object **cert_object)
 {
 	struct sc_pkcs15_cert_info *p15_info = NULL;
-	struct sc_pkcs15_cert *p15_cert = NULL;
 	struct pkcs15_cert_object *object = NULL;
 	struct pkcs15_pubkey_object *obj2 = NULL;
 	int rv;
 
 	p15_info = (struct sc_pkcs15_cert_info *) cert->data;
 
-	if (cert->flags & SC_PKCS15_CO_FLAG_PRIVATE)  {	/* is the cert private? */
-		p15_cert = NULL;			/* will read cert when needed */
-	}
-	else    {
-		rv = sc_pkcs15_read_certificate(fw_data->p15_card, p15_info, &p15_cert);
-		if (rv < 0)
-			return rv;
-	}
+	/* The certificate is read and parsed on the first access to an
+	 * attribute that needs its content, see check_cert_data_read() */
 
 	/* Certificate object */
 	rv = __pkcs15_create_object(fw_data, (struct pkcs15_any_object **) &object,
 			cert, &pkcs15_cert_ops, sizeof(struct pkcs15_cert_object));
-	if (rv < 0) {
-		if (p15_cert != NULL)
-			sc_pkcs15_free_certificate(p15_cert);
+	if (rv < 0)
 		return rv;
-	}
 
 	object->cert_info = p15_info;
-	object->cert_data = p15_cert;
+	object->cert_data = NULL;
 
 	/* Corresponding public key */
 	rv = public_key_created(fw_data, &p15_info->id, (struct pkcs15_any_object **) &obj2);
@@ -698,20 +822,9 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 	if (rv < 0)
 		return rv;
 
-	if (p15_cert) {
-		 /* make a copy of public key from the cert */
-		if (!obj2->pub_data)
-			rv = sc_pkcs15_pubkey_from_cert(context, &p15_cert->data, &obj2->pub_data);
-		if (rv < 0)
-			return rv;
-	}
-
 	obj2->pub_genfrom = object;
 	object->cert_pubkey = obj2;
 
-	/* Find missing labels for certificate */
-	pkcs15_cert_extract_label(object);
-
 	if (cert_object != NULL)
 		*cert_object = (struct pkcs15_any_object *) object;
 
@@ -772,6 +885,46 @@ __pkcs15_create_pubkey_object(struct pkcs15_fw_data *fw_data,
 }
 
 
+/* Looks up the algorithm references of the key in the token info once,
+ * so pkcs15_prkey_can_do() only compares mechanisms */
+static void
+pkcs15_prkey_resolve_algos(struct pkcs15_fw_data *fw_data, struct pkcs15_prkey_object *prkey)
+{
+	struct sc_pkcs15_prkey_info *pkinfo = prkey->prv_info;
+	struct sc_supported_algo_info *token_algos;
+	int ii, jj;
+
+	prkey->num_algos = 0;
+	prkey->algo_miss = CKR_MECHANISM_INVALID;
+	/* Return in there are no usage algorithms specified for this key. */
+	if (!pkinfo || !pkinfo->algo_refs[0] || !fw_data->p15_card || !fw_data->p15_card->tokeninfo) {
+		prkey->algo_miss = CKR_FUNCTION_NOT_SUPPORTED;
+		return;
+	}
+	token_algos = &fw_data->p15_card->tokeninfo->supported_algos[0];
+
+	for (ii=0;ii<SC_MAX_SUPPORTED_ALGORITHMS && pkinfo->algo_refs[ii];ii++)   {
+		/* Look for algorithm supported by token referenced in the list of key's algorithms */
+		for (jj=0;jj<SC_MAX_SUPPORTED_ALGORITHMS && (token_algos + jj)->reference; jj++)
+			if (pkinfo->algo_refs[ii] == (token_algos + jj)->reference)
+				break;
+		if ((jj == SC_MAX_SUPPORTED_ALGORITHMS) || !(token_algos + jj)->reference)   {
+			/* the mechanisms of the following references are unknown */
+			prkey->algo_miss = CKR_GENERAL_ERROR;
+			return;
+		}
+
+		prkey->algo_mechs[prkey->num_algos] = (token_algos + jj)->mechanism;
+		prkey->algo_ops[prkey->num_algos] = 0;
+		if ((token_algos + jj)->operations & SC_PKCS15_ALGO_OP_COMPUTE_SIGNATURE)
+			prkey->algo_ops[prkey->num_algos] |= CKF_SIGN;
+		if ((token_algos + jj)->operations & SC_PKCS15_ALGO_OP_DECIPHER)
+			prkey->algo_ops[prkey->num_algos] |= CKF_DECRYPT;
+		prkey->num_algos++;
+	}
+}
+
+
 static int
 __pkcs15_create_prkey_object(struct pkcs15_fw_data *fw_data,
 	struct sc_pkcs15_object *prkey, struct pkcs15_any_object **prkey_object)
@@ -781,8 +934,10 @@ __pkcs15_create_prkey_object(struct pkcs15_fw_data *fw_data,
 
 	rv = __pkcs15_create_object(fw_data, (struct pkcs15_any_object **) &object,
 			prkey, &pkcs15_prkey_ops, sizeof(struct pkcs15_prkey_object));
-	if (rv >= 0)
+	if (rv >= 0)   {
 		object->prv_info = (struct sc_pkcs15_prkey_info *) prkey->data;
+		pkcs15_prkey_resolve_algos(fw_data, object);
+	}
 
 	if (prkey_object != NULL)
 		*prkey_object = (struct pkcs15_any_object *) object;
@@ -838,13 +993,22 @@ pkcs15_create_pkcs11_objects(struct pkcs15_fw_data *fw_data, int p15_type, const
 {
 	struct sc_pkcs15_object *p15_object[MAX_OBJECTS];
 	int i, count, rv;
+	unsigned int j;
 
 	rv = count = sc_pkcs15_get_objects(fw_data->p15_card, p15_type, p15_object, MAX_OBJECTS);
 	if (rv >= 0)
 		sc_log(context, "Found %d %s%s", count, name, (count == 1)? "" : "s");
 
-	for (i = 0; rv >= 0 && i < count; i++)
+	for (i = 0; rv >= 0 && i < count; i++) {
+		/* created meanwhile by C_Login() or one of the object
+		 * creating functions */
+		for (j = 0; j < fw_data->num_objects; j++)
+			if (fw_data->objects[j]->p15_object == p15_object[i])
+				break;
+		if (j < fw_data->num_objects)
+			continue;
 		rv = create(fw_data, p15_object[i], NULL);
+	}
 
 	return count;
 }
@@ -961,7 +1125,8 @@ pkcs15_bind_related_objects(struct pkcs15_fw_data *fw_data)
 
 
 /* We deferred reading of the cert until needed, as it may be
- * a private object, so we must wait till login to read  */
+ * a private object, so we must wait till login to read, and most
+ * applications only need a few of the certificates on the token */
 static int
 check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *cert)
 {
@@ -978,9 +1143,11 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *
 		return rv;
 
 	obj2 = cert->cert_pubkey;
-	/* make a copy of public key from the cert data */
+	/* make a copy of public key from the cert data, which is already parsed */
 	if (!obj2->pub_data)
-		rv = sc_pkcs15_pubkey_from_cert(context, &cert->cert_data->data, &obj2->pub_data);
+		rv = cert->cert_data->key
+			? sc_pkcs15_dup_pubkey(context, cert->cert_data->key, &obj2->pub_data)
+			: SC_ERROR_INVALID_ASN1_OBJECT;
 
 	/* Find missing labels for certificate */
 	pkcs15_cert_extract_label(cert);
@@ -1006,13 +1173,15 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 	if (obj->base.flags & (SC_PKCS11_OBJECT_HIDDEN | SC_PKCS11_OBJECT_RECURS))
 		return;
 
-	if (list_contains(&slot->objects, obj))
+	if (slot_has_object(slot, &obj->base))
+		return;
+
+	if (slot_add_object(slot, &obj->base) != CKR_OK)
 		return;
 
 	if (pHandle != NULL)
 		*pHandle = handle;
 
-	list_append(&slot->objects, obj);
 	sc_log(context, "Slot:%lX Setting object handle of 0x%lx to 0x%lx",
 		   slot->id, obj->base.handle, handle);
 	obj->base.handle = handle;
@@ -1195,54 +1364,77 @@ pkcs15_create_slot(struct sc_pkcs11_card *p11card, struct pkcs15_fw_data *fw_dat
 
 
 static int
-_pkcs15_create_typed_objects(struct pkcs15_fw_data *fw_data)
+_pkcs15_create_typed_objects(struct pkcs15_fw_data *fw_data, unsigned int groups)
 {
-	int rv;
+	int rv = 0;
 
-	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_PRKEY_RSA, "RSA private key",
-			__pkcs15_create_prkey_object);
-	if (rv < 0)
-		return rv;
+	groups &= ~fw_data->loaded;
+	if (!groups)
+		return 0;
 
-	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_PUBKEY_RSA, "RSA public key",
-			__pkcs15_create_pubkey_object);
-	if (rv < 0)
-		return rv;
+	/* in the order of the types, the same with and without a private key
+	 * created ahead */
+	if (groups & PKCS15_OBJECTS_PRKEYS) {
+		rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_PRKEY_RSA, "RSA private key",
+				__pkcs15_create_prkey_object);
+		if (rv < 0)
+			return rv;
+	}
 
-	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_PRKEY_EC, "EC private key",
-			__pkcs15_create_prkey_object);
-	if (rv < 0)
-		return rv;
+	if (groups & PKCS15_OBJECTS_PUBKEYS) {
+		rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_PUBKEY_RSA, "RSA public key",
+				__pkcs15_create_pubkey_object);
+		if (rv < 0)
+			return rv;
+	}
 
-	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_PUBKEY_EC, "EC public key",
-			__pkcs15_create_pubkey_object);
-	if (rv < 0)
-		return rv;
+	if (groups & PKCS15_OBJECTS_PRKEYS) {
+		rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_PRKEY_EC, "EC private key",
+				__pkcs15_create_prkey_object);
+		if (rv < 0)
+			return rv;
+	}
 
-	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_PRKEY_GOSTR3410, "GOSTR3410 private key",
-			__pkcs15_create_prkey_object);
-	if (rv < 0)
-		return rv;
+	if (groups & PKCS15_OBJECTS_PUBKEYS) {
+		rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_PUBKEY_EC, "EC public key",
+				__pkcs15_create_pubkey_object);
+		if (rv < 0)
+			return rv;
+	}
 
-	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_PUBKEY_GOSTR3410, "GOSTR3410 public key",
-			__pkcs15_create_pubkey_object);
-	if (rv < 0)
-		return rv;
+	if (groups & PKCS15_OBJECTS_PRKEYS) {
+		rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_PRKEY_GOSTR3410, "GOSTR3410 private key",
+				__pkcs15_create_prkey_object);
+		if (rv < 0)
+			return rv;
+	}
 
-	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_CERT_X509, "certificate",
-			__pkcs15_create_cert_object);
-	if (rv < 0)
-		return rv;
+	if (groups & PKCS15_OBJECTS_PUBKEYS) {
+		rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_PUBKEY_GOSTR3410, "GOSTR3410 public key",
+				__pkcs15_create_pubkey_object);
+		if (rv < 0)
+			return rv;
 
-	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_DATA_OBJECT, "data object",
-			__pkcs15_create_data_object);
-	if (rv < 0)
-		return rv;
+		rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_CERT_X509, "certificate",
+				__pkcs15_create_cert_object);
+		if (rv < 0)
+			return rv;
+	}
 
-	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_SKEY_GENERIC, "Generic secret key",
-			__pkcs15_create_secret_key_object);
-	if (rv < 0)
-		return rv;
+	if (groups & PKCS15_OBJECTS_DATA) {
+		rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_DATA_OBJECT, "data object",
+				__pkcs15_create_data_object);
+		if (rv < 0)
+			return rv;
+	}
+
+	if (groups & PKCS15_OBJECTS_SKEYS) {
+		rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_SKEY_GENERIC, "Generic secret key",
+				__pkcs15_create_secret_key_object);
+		if (rv < 0)
+			return rv;
+	}
+	fw_data->loaded |= groups;
 
 	/* Match up related keys and certificates */
 	pkcs15_bind_related_objects(fw_data);
@@ -1494,10 +1686,9 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 		auth_sign_pin = _get_auth_object_by_name(fw_data->p15_card, "SignPIN");
 	sc_log(context, "Flags:0x%X; Auth User/Sign PINs %p/%p", cs_flags, auth_user_pin, auth_sign_pin);
 
-	/* Add PKCS#15 objects of the known types to the framework data */
-	rc = _pkcs15_create_typed_objects(fw_data);
-	if (rc < 0)
-		return sc_to_cryptoki_error(rc, NULL);
+	/* The PKCS#15 objects of the known types are added to the framework
+	 * data only when an application looks for them, see
+	 * pkcs15_load_objects(). Slots and token info need the AODF only. */
 	sc_log(context, "Found %d FW objects objects", fw_data->num_objects);
 
 	/* Create slots for all non-unblock, non-so PINs if:
@@ -1570,6 +1761,7 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 		sc_log(context, "Created slot without AUTH object: %p", slot);
 	}
 
+	fw_data->public_slot = slot;
 	if (slot)   {
 		sc_log(context, "Add public objects to slot %p", slot);
 		_add_public_objects(slot, fw_data);
@@ -1580,6 +1772,120 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 }
 
 
+/* Groups with DFs that were not enumerated yet, e.g. because reading them
+ * needs a login */
+static unsigned int
+pkcs15_unread_groups(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_df *df;
+	unsigned int groups = 0;
+
+	for (df = p15card->df_list; df != NULL; df = df->next) {
+		if (df->enumerated)
+			continue;
+		switch (df->type) {
+		case SC_PKCS15_PRKDF:
+			groups |= PKCS15_OBJECTS_PRKEYS;
+			break;
+		case SC_PKCS15_PUKDF:
+		case SC_PKCS15_PUKDF_TRUSTED:
+		case SC_PKCS15_CDF:
+		case SC_PKCS15_CDF_TRUSTED:
+		case SC_PKCS15_CDF_USEFUL:
+			groups |= PKCS15_OBJECTS_PUBKEYS;
+			break;
+		case SC_PKCS15_DODF:
+			groups |= PKCS15_OBJECTS_DATA;
+			break;
+		case SC_PKCS15_SKDF:
+			groups |= PKCS15_OBJECTS_SKEYS;
+			break;
+		}
+	}
+	return groups;
+}
+
+
+/* Create the framework objects of the given groups and hand them out to the
+ * slots of the application, the same way pkcs15_create_tokens() does. */
+static CK_RV
+pkcs15_create_objects(struct sc_pkcs11_card *p11card, int idx, unsigned int groups)
+{
+	struct pkcs15_fw_data *fw_data = (struct pkcs15_fw_data *) p11card->fws_data[idx];
+	struct sc_pkcs11_slot *slot;
+	unsigned int i, num_objects;
+	int rc;
+
+	if (!fw_data || !(groups & ~fw_data->loaded))
+		return CKR_OK;
+
+	num_objects = fw_data->num_objects;
+	rc = _pkcs15_create_typed_objects(fw_data, groups);
+	if (rc < 0)
+		return sc_to_cryptoki_error(rc, NULL);
+	if (fw_data->num_objects == num_objects)
+		return CKR_OK;
+
+	for (i = 0; i < list_size(&virtual_slots); i++) {
+		struct sc_pkcs15_object *auth;
+
+		slot = virtual_slot_table[i];
+		if (slot->p11card != p11card || slot->fw_data_idx != idx)
+			continue;
+		auth = slot_data_auth(slot->fw_data);
+		if (auth)
+			_add_pin_related_objects(slot, auth, fw_data, NULL);
+	}
+	if (fw_data->public_slot)
+		_add_public_objects(fw_data->public_slot, fw_data);
+
+	return CKR_OK;
+}
+
+
+static CK_RV
+pkcs15_load_objects(struct sc_pkcs11_slot *slot, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	unsigned int groups = PKCS15_OBJECTS_ALL;
+	CK_OBJECT_CLASS class;
+	CK_ULONG i;
+
+	if (slot->p11card == NULL)
+		return CKR_OK;
+
+	/* Without a class in the template every object may match */
+	for (i = 0; i < ulCount; i++) {
+		if (pTemplate[i].type != CKA_CLASS || pTemplate[i].pValue == NULL
+				|| pTemplate[i].ulValueLen != sizeof(class))
+			continue;
+		memcpy(&class, pTemplate[i].pValue, sizeof(class));
+		switch (class) {
+		case CKO_PRIVATE_KEY:
+			/* the public keys and certificates follow when the key
+			 * needs them, see pkcs15_prkey_get_attribute() */
+			if (sc_pkcs11_conf.fast_first_signature)
+				groups = PKCS15_OBJECTS_PRKEYS;
+			else
+				groups = PKCS15_OBJECTS_KEYS;
+			break;
+		case CKO_PUBLIC_KEY:
+		case CKO_CERTIFICATE:
+			groups = PKCS15_OBJECTS_KEYS;
+			break;
+		case CKO_DATA:
+			groups = PKCS15_OBJECTS_DATA;
+			break;
+		case CKO_SECRET_KEY:
+			groups = PKCS15_OBJECTS_SKEYS;
+			break;
+		}
+		break;
+	}
+
+	return pkcs15_create_objects(slot->p11card, slot->fw_data_idx, groups);
+}
+
+
 static CK_RV
 pkcs15_release_token(struct sc_pkcs11_card *p11card, void *fw_token)
 {
@@ -1712,51 +2018,10 @@ pkcs15_login(struct sc_pkcs11_slot *slot, CK_USER_TYPE userType,
 	if (rc != SC_SUCCESS)
 		return sc_to_cryptoki_error(rc, "C_Login");
 
-	if (userType == CKU_USER)   {
-		sc_pkcs15_object_t *p15_obj = p15card->obj_list;
-		sc_pkcs15_search_key_t sk;
-
-		sc_log(context, "Check if pkcs15 object list can be completed.");
-
-		/* Ensure non empty list */
-		if (p15_obj == NULL)
-			return CKR_OK;
-
-		/* Select last object in list */
-		while(p15_obj->next)
-			p15_obj = p15_obj->next;
-
-		/* Trigger enumeration of EF.XXX files */
-		memset(&sk, 0, sizeof(sk));
-		sk.class_mask = SC_PKCS15_SEARCH_CLASS_PRKEY | SC_PKCS15_SEARCH_CLASS_PUBKEY |
-				SC_PKCS15_SEARCH_CLASS_CERT  | SC_PKCS15_SEARCH_CLASS_DATA;
-		sc_pkcs15_search_objects(p15card, &sk, NULL, 0);
-
-		/* Iterate over newly discovered objects */
-		while(p15_obj->next) {
-			struct pkcs15_any_object *fw_obj;
-
-			p15_obj = p15_obj->next;
-
-			if (!sc_pkcs15_compare_id(&pin_info->auth_id, &p15_obj->auth_id))
-				continue;
-
-			switch (p15_obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
-			case SC_PKCS15_TYPE_PRKEY:
-				__pkcs15_create_prkey_object(fw_data, p15_obj, &fw_obj); break;
-			case SC_PKCS15_TYPE_PUBKEY:
-				__pkcs15_create_pubkey_object(fw_data, p15_obj, &fw_obj); break;
-			case SC_PKCS15_TYPE_CERT:
-				__pkcs15_create_cert_object(fw_data, p15_obj, &fw_obj); break;
-			case SC_PKCS15_TYPE_DATA_OBJECT:
-				__pkcs15_create_data_object(fw_data, p15_obj, &fw_obj); break;
-			default: continue;
-			}
-
-			sc_log(context, "new object found: type=0x%03X", p15_obj->type);
-			pkcs15_add_object(slot, fw_obj, NULL);
-		}
-	}
+	/* Objects in DFs that could not be read before the login are
+	 * created by the next C_FindObjectsInit() that may match them */
+	if (userType == CKU_USER)
+		fw_data->loaded &= ~pkcs15_unread_groups(p15card);
 
 	return CKR_OK;
 }
@@ -1782,6 +2047,7 @@ pkcs15_logout(struct sc_pkcs11_slot *slot)
 	fw_data->user_puk_len = 0;
 
 	sc_pkcs15_pincache_clear(fw_data->p15_card);
+	pkcs15_dobj_forget_private_values(fw_data->p15_card);
 
 	rc = sc_logout(fw_data->p15_card->card);
 
@@ -1804,6 +2070,54 @@ pkcs15_logout(struct sc_pkcs11_slot *slot)
 }
 
 
+/* The atomic mode logs out after each operation and used to verify the
+ * PIN again before the next one. Put the user PIN in the PIN cache
+ * instead: the operations on the keys verify it when the card reports
+ * that the security status is not satisfied, see use_key() */
+static CK_RV
+pkcs15_defer_login(struct sc_pkcs11_slot *slot, CK_USER_TYPE userType,
+		CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
+{
+	struct pkcs15_fw_data *fw_data = NULL;
+	struct sc_pkcs15_card *p15card = NULL;
+	struct sc_pkcs15_object *auth_object = NULL;
+	struct sc_pkcs15_auth_info *pin_info = NULL;
+	int rc;
+
+	if (userType != CKU_USER || !pPin || !ulPinLen || !slot->p11card)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	fw_data = (struct pkcs15_fw_data *) slot->p11card->fws_data[slot->fw_data_idx];
+	if (!fw_data || !fw_data->p15_card)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	p15card = fw_data->p15_card;
+
+	auth_object = slot_data_auth(slot->fw_data);
+	if (auth_object == NULL)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	pin_info = (struct sc_pkcs15_auth_info *) auth_object->data;
+	if (pin_info->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN
+			|| !p15card->opts.use_pin_cache
+			|| p15card->opts.pin_cache_counter <= 0
+			|| (p15card->card->reader->capabilities & SC_READER_CAP_PIN_PAD)
+			|| (p15card->card->caps & SC_CARD_CAP_PROTECTED_AUTHENTICATION_PATH))
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	/* The cache refuses the PINs of keys asking for the user consent */
+	sc_pkcs15_free_object_content(auth_object);
+	sc_pkcs15_pincache_add(p15card, auth_object, pPin, ulPinLen);
+	if (auth_object->content.value == NULL)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	if (sc_pkcs11_conf.lock_login && (rc = lock_card(fw_data)) < 0) {
+		sc_pkcs15_free_object_content(auth_object);
+		return sc_to_cryptoki_error(rc, "C_Login");
+	}
+
+	sc_log(context, "pkcs15-login: user PIN verified on demand");
+	return CKR_OK;
+}
+
+
 static CK_RV
 pkcs15_change_pin(struct sc_pkcs11_slot *slot,
 		CK_CHAR_PTR pOldPin, CK_ULONG ulOldLen,
@@ -1877,15 +2191,15 @@ pkcs15_initialize(struct sc_pkcs11_slot *slot, void *ptr,
 {
 	struct sc_pkcs11_card *p11card = slot->p11card;
 	struct sc_cardctl_pkcs11_init_token args;
-	scconf_block *conf_block = NULL;
+	const struct sc_pkcs15_conf *conf;
 	int rc, enable_InitToken = 0;
 	CK_RV rv;
 
 	sc_log(context, "Get 'enable-InitToken' card configuration option");
 	if (!p11card)
 		return CKR_TOKEN_NOT_RECOGNIZED;
-	conf_block = sc_get_conf_block(p11card->card->ctx, "framework", "pkcs15", 1);
-	enable_InitToken = scconf_get_bool(conf_block, "pkcs11_enable_InitToken", 0);
+	conf = sc_pkcs15_get_conf(p11card->card->ctx);
+	enable_InitToken = conf ? conf->enable_init_token : 0;
 
 	memset(&args, 0, sizeof(args));
 	args.so_pin = pPin;
@@ -2290,6 +2604,7 @@ pkcs15_create_secret_key(struct sc_pkcs11_slot *slot, struct sc_profile *profile
 	int rc;
 	char label[SC_PKCS15_MAX_LABEL_SIZE];
 	CK_BBOOL temp_object = FALSE;
+	unsigned int host_access_flags = 0;
 
 	memset(&args, 0, sizeof(args));
 	if (!p11card)
@@ -2378,6 +2693,13 @@ pkcs15_create_secret_key(struct sc_pkcs11_slot *slot, struct sc_profile *profile
 		case CKA_EXTRACTABLE:
 			if (pkcs15_check_bool_cka(attr, 1))
 				args.access_flags |= SC_PKCS15_PRKEY_ACCESS_EXTRACTABLE;
+			else
+				host_access_flags |= SC_PKCS15_PRKEY_ACCESS_NEVEREXTRACTABLE;
+			break;
+		case CKA_SENSITIVE:
+			if (pkcs15_check_bool_cka(attr, 1))
+				host_access_flags |= SC_PKCS15_PRKEY_ACCESS_SENSITIVE
+					| SC_PKCS15_PRKEY_ACCESS_ALWAYSSENSITIVE;
 			break;
 		case CKA_OPENSC_ALWAYS_AUTH_ANY_OBJECT:
 			args.user_consent = (int) (pkcs15_check_bool_cka(attr, 1));
@@ -2418,7 +2740,7 @@ pkcs15_create_secret_key(struct sc_pkcs11_slot *slot, struct sc_profile *profile
 		key_obj->data = skey_info;
 		skey_info->usage = (unsigned int) args.usage;
 		skey_info->native = 0; /* card can not use this */
-		skey_info->access_flags = 0; /* looks like not needed */
+		skey_info->access_flags = host_access_flags;
 		skey_info->key_type = key_type; /* PKCS#11 CKK_* */
 		skey_info->data.value = args.key.data;
 		skey_info->data.len = args.key.data_len;
@@ -2439,15 +2761,25 @@ pkcs15_create_secret_key(struct sc_pkcs11_slot *slot, struct sc_profile *profile
 	}
 
 	/* Create a new pkcs11 object for it */
-	__pkcs15_create_secret_key_object(fw_data, key_obj, &key_any_obj);
+	rc = __pkcs15_create_secret_key_object(fw_data, key_obj, &key_any_obj);
+	if (rc < 0) {
+		rv = sc_to_cryptoki_error(rc, "C_CreateObject");
+		goto out;
+	}
+	if (temp_object) {
+		/* owned by the PKCS#11 object from now on */
+		((struct pkcs15_skey_object *) key_any_obj)->host_obj = key_obj;
+		temp_object = FALSE;
+	}
 	pkcs15_add_object(slot, key_any_obj, phObject);
 
 	rv = CKR_OK;
 
 out:
 	free(args.key.data); /* if allocated */
+	/* do not free if the object was created by pkcs15init. It will be freed in C_Finalize */
 	if (temp_object)
-		free(key_obj); /* do not free if the object was created by pkcs15init. It will be freed in C_Finalize */
+		pkcs15_free_host_skey(key_obj);
 	return rv;
 }
 
@@ -3040,15 +3372,16 @@ pkcs15_gen_keypair(struct sc_pkcs11_slot *slot, CK_MECHANISM_PTR pMechanism,
 	if(slot->app_info)
 		aid = &slot->app_info->aid;
 
+	memset(&keygen_args, 0, sizeof(keygen_args));
+	memset(&pub_args, 0, sizeof(pub_args));
+
 	rc = sc_pkcs15init_finalize_profile(p11card->card, profile, aid);
 	if (rc != CKR_OK) {
 		sc_log(context, "Cannot finalize profile: %i", rc);
-		return sc_to_cryptoki_error(rc, "C_GenerateKeyPair");
+		rv = sc_to_cryptoki_error(rc, "C_GenerateKeyPair");
+		goto kpgen_done;
 	}
 
-	memset(&keygen_args, 0, sizeof(keygen_args));
-	memset(&pub_args, 0, sizeof(pub_args));
-
 	/* 1. Convert the pkcs11 attributes to pkcs15init args */
 
 	if ((pin = slot_data_auth_info(slot->fw_data)) != NULL)
@@ -3089,10 +3422,8 @@ pkcs15_gen_keypair(struct sc_pkcs11_slot *slot, CK_MECHANISM_PTR pMechanism,
 
 		der->len = sizeof(struct sc_object_id);
 		rv = attr_find_and_allocate_ptr(pPubTpl, ulPubCnt, CKA_EC_PARAMS, (void **)&der->value, &der->len);
-		if (rv != CKR_OK)   {
-			sc_unlock(p11card->card);
-			return sc_to_cryptoki_error(rc, "C_GenerateKeyPair");
-		}
+		if (rv != CKR_OK)
+			goto kpgen_done;
 
 		keygen_args.prkey_args.key.algorithm = SC_ALGORITHM_EC;
 		pub_args.key.algorithm               = SC_ALGORITHM_EC;
@@ -3211,7 +3542,7 @@ pkcs15_skey_destroy(struct sc_pkcs11_session *session, void *object)
 
 	/* Oppose to pkcs15_add_object */
 	--any_obj->refcount; /* correct refcount */
-	list_delete(&session->slot->objects, any_obj);
+	slot_remove_object(session->slot, &any_obj->base);
 	/* Delete object in pkcs15 */
 	rv = __pkcs15_delete_object(fw_data, any_obj);
 
@@ -3271,7 +3602,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 		struct pkcs15_pubkey_object *pubkey = any_obj->related_pubkey;
 
 		/* Check if key is not removed in between */
-		if (list_locate(&session->slot->objects, ao_pubkey) > 0) {
+		if (slot_has_object(session->slot, &ao_pubkey->base)) {
 			sc_log(context, "Found related pubkey %p", any_obj->related_pubkey);
 
 			/* Delete reference to related certificate of the public key PKCS#11 object */
@@ -3281,7 +3612,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 				/* Unlink related public key FW object if it has no corresponding PKCS#15 object
 				 * and was created from certificate. */
 				--ao_pubkey->refcount;
-				list_delete(&session->slot->objects, ao_pubkey);
+				slot_remove_object(session->slot, &ao_pubkey->base);
 				/* Delete public key object in pkcs15 */
 				if (pubkey->pub_data)   {
 					sc_log(context, "Found pub_data %p", pubkey->pub_data);
@@ -3299,7 +3630,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 	if (rv >= 0) {
 		/* Oppose to pkcs15_add_object */
 		--any_obj->refcount; /* correct refcount */
-		list_delete(&session->slot->objects, any_obj);
+		slot_remove_object(session->slot, &any_obj->base);
 		/* Delete object in pkcs15 */
 		rv = __pkcs15_delete_object(fw_data, any_obj);
 	}
@@ -3330,11 +3661,56 @@ pkcs15_get_random(struct sc_pkcs11_slot *slot, CK_BYTE_PTR p, CK_ULONG len)
 	if (!fw_data->p15_card)
 		return sc_to_cryptoki_error(SC_ERROR_INVALID_CARD, "C_GenerateRandom");
 
+#ifdef ENABLE_OPENSSL
+	if (sc_pkcs11_conf.random_drbg)
+		return sc_pkcs11_drbg_generate(&fw_data->drbg, fw_data->p15_card->card,
+				sc_pkcs11_conf.random_reseed_interval, p, len);
+#endif
 	rc = sc_get_challenge(fw_data->p15_card->card, p, (size_t)len);
 	return sc_to_cryptoki_error(rc, "C_GenerateRandom");
 }
 
 
+/*
+ * Drop the parsed certificates, cached attribute values and file contents
+ * of an idle card. The objects stay, check_cert_data_read() and the
+ * attribute functions read what they need again.
+ */
+static void
+pkcs15_reclaim(struct sc_pkcs11_card *p11card)
+{
+	struct pkcs15_fw_data *fw_data;
+	unsigned int i, j;
+
+	for (i = 0; i < SC_PKCS11_FRAMEWORK_DATA_MAX_NUM; i++) {
+		fw_data = (struct pkcs15_fw_data *) p11card->fws_data[i];
+		if (!fw_data)
+			continue;
+
+		for (j = 0; j < fw_data->num_objects; j++) {
+			struct pkcs15_any_object *obj = fw_data->objects[j];
+
+			if (is_cert(obj)) {
+				struct pkcs15_cert_object *cert = (struct pkcs15_cert_object *) obj;
+
+				sc_pkcs15_free_certificate(cert->cert_data);
+				cert->cert_data = NULL;
+			}
+			while (obj->attr_cache) {
+				struct pkcs15_attr_cache *entry = obj->attr_cache;
+
+				obj->attr_cache = entry->next;
+				free(entry);
+			}
+		}
+
+		if (fw_data->p15_card) {
+			sc_pkcs15_invalidate_certificate(fw_data->p15_card, NULL);
+			sc_pkcs15_invalidate_files(fw_data->p15_card);
+		}
+	}
+}
+
 struct sc_pkcs11_framework_ops framework_pkcs15 = {
 	pkcs15_bind,
 	pkcs15_unbind,
@@ -3354,7 +3730,10 @@ struct sc_pkcs11_framework_ops framework_pkcs15 = {
 	NULL,
 	NULL,
 #endif
-	pkcs15_get_random
+	pkcs15_get_random,
+	pkcs15_load_objects,
+	pkcs15_reclaim,
+	pkcs15_defer_login
 };
 
 
@@ -3503,7 +3882,9 @@ pkcs15_cert_get_attribute(struct sc_pkcs11_session *session, void *object, CK_AT
 		*(CK_BBOOL*)attr->pValue = FALSE;
 		break;
 	case CKA_LABEL:
-		if (check_cert_data_read(fw_data, cert) != 0) {
+		/* the label may have to be derived from the subject */
+		if (cert->cert_p15obj->label[0] == '\0'
+				&& check_cert_data_read(fw_data, cert) != 0) {
 			attr->ulValueLen = 0;
 			return CKR_OK;
 		}
@@ -3570,6 +3951,112 @@ pkcs15_cert_get_attribute(struct sc_pkcs11_session *session, void *object, CK_AT
 }
 
 
+/* Compare the attributes searched for most often with the PKCS#15 fields
+ * directly, the way the get_attribute() functions report them. Returns -1
+ * for the attributes that have to be compared through get_attribute() */
+static int
+pkcs15_cmp_native(struct pkcs15_any_object *obj, CK_ATTRIBUTE_PTR attr)
+{
+	struct sc_pkcs15_object *p15_object = obj->p15_object;
+	const struct sc_pkcs15_id *id = NULL;
+	CK_OBJECT_CLASS class;
+	CK_KEY_TYPE key_type;
+	CK_BBOOL flag;
+	size_t len;
+
+	if (p15_object == NULL || (attr->pValue == NULL && attr->ulValueLen != 0))
+		return -1;
+
+	switch (p15_object->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		class = CKO_PRIVATE_KEY;
+		id = &((struct pkcs15_prkey_object *) obj)->prv_info->id;
+		break;
+	case SC_PKCS15_TYPE_PUBKEY:
+		class = CKO_PUBLIC_KEY;
+		if (((struct pkcs15_pubkey_object *) obj)->pub_info)
+			id = &((struct pkcs15_pubkey_object *) obj)->pub_info->id;
+		break;
+	case SC_PKCS15_TYPE_CERT:
+		class = CKO_CERTIFICATE;
+#ifndef ZERO_CKAID_FOR_CA_CERTS
+		id = &((struct pkcs15_cert_object *) obj)->cert_info->id;
+#endif
+		break;
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		class = CKO_DATA;
+		break;
+	case SC_PKCS15_TYPE_SKEY:
+		class = CKO_SECRET_KEY;
+		if (((struct pkcs15_skey_object *) obj)->info)
+			id = &((struct pkcs15_skey_object *) obj)->info->id;
+		break;
+	default:
+		return -1;
+	}
+
+	switch (attr->type) {
+	case CKA_CLASS:
+		return attr->ulValueLen == sizeof(class)
+			&& !memcmp(attr->pValue, &class, sizeof(class));
+	case CKA_TOKEN:
+		/* secret keys may be session objects */
+		if (class == CKO_SECRET_KEY)
+			return -1;
+		flag = TRUE;
+		return attr->ulValueLen == sizeof(flag)
+			&& !memcmp(attr->pValue, &flag, sizeof(flag));
+	case CKA_PRIVATE:
+		/* public keys may take the flag from their certificate */
+		if (class == CKO_PUBLIC_KEY)
+			return -1;
+		flag = (p15_object->flags & SC_PKCS15_CO_FLAG_PRIVATE) != 0;
+		return attr->ulValueLen == sizeof(flag)
+			&& !memcmp(attr->pValue, &flag, sizeof(flag));
+	case CKA_ID:
+		if (id == NULL)
+			return -1;
+		return attr->ulValueLen == id->len
+			&& !memcmp(attr->pValue, id->value, id->len);
+	case CKA_LABEL:
+		/* the label of a certificate may be derived from the subject */
+		if (p15_object->label[0] == '\0' && class == CKO_CERTIFICATE)
+			return -1;
+		len = strnlen(p15_object->label, sizeof p15_object->label);
+		return attr->ulValueLen == len
+			&& !memcmp(attr->pValue, p15_object->label, len);
+	case CKA_KEY_TYPE:
+		switch (p15_object->type) {
+		case SC_PKCS15_TYPE_PRKEY_RSA:
+			key_type = CKK_RSA;
+			break;
+		case SC_PKCS15_TYPE_PRKEY_GOSTR3410:
+			key_type = CKK_GOSTR3410;
+			break;
+		case SC_PKCS15_TYPE_PRKEY_EC:
+			key_type = CKK_EC;
+			break;
+		default:
+			return -1;
+		}
+		return attr->ulValueLen == sizeof(key_type)
+			&& !memcmp(attr->pValue, &key_type, sizeof(key_type));
+	}
+	return -1;
+}
+
+static CK_RV
+pkcs15_any_cmp_attribute(struct sc_pkcs11_session *session,
+		void *object, CK_ATTRIBUTE_PTR attr)
+{
+	int r = pkcs15_cmp_native((struct pkcs15_any_object *) object, attr);
+
+	if (r >= 0)
+		return r;
+	return sc_pkcs11_any_cmp_attribute(session, object, attr);
+}
+
+
 #define ASN1_SET_TAG (SC_ASN1_SET | SC_ASN1_TAG_CONSTRUCTED)
 #define ASN1_SEQ_TAG (SC_ASN1_SEQUENCE | SC_ASN1_TAG_CONSTRUCTED)
 static CK_RV
@@ -3630,7 +4117,7 @@ pkcs15_cert_cmp_attribute(struct sc_pkcs11_session *session,
 		}
 		break;
 	default:
-		return sc_pkcs11_any_cmp_attribute(session, object, attr);
+		return pkcs15_any_cmp_attribute(session, object, attr);
 	}
 	sc_log(context, "pkcs15_cert_cmp_attribute() returns not matched");
 	return 0;
@@ -3649,7 +4136,8 @@ struct sc_pkcs11_object_ops pkcs15_cert_ops = {
 	NULL,	/* derive */
 	NULL,	/* can_do */
 	NULL,	/* init_params */
-	NULL	/* wrap_key */
+	NULL,	/* wrap_key */
+	NULL	/* encrypt */
 };
 
 /*
@@ -3695,6 +4183,13 @@ pkcs15_prkey_get_attribute(struct sc_pkcs11_session *session,
 	if (!fw_data->p15_card)
 		return sc_to_cryptoki_error(SC_ERROR_INVALID_CARD, "C_GetAttributeValue");
 
+	/* The public keys and certificates were not needed so far, see
+	 * fast_first_signature. The key size may come from them as well. */
+	if (!prkey->pub_data && !(fw_data->loaded & PKCS15_OBJECTS_PUBKEYS)
+			&& (attr->type == CKA_MODULUS || attr->type == CKA_PUBLIC_EXPONENT
+				|| attr->type == CKA_MODULUS_BITS || attr->type == CKA_ECDSA_PARAMS))
+		pkcs15_create_objects(p11card, session->slot->fw_data_idx, PKCS15_OBJECTS_PUBKEYS);
+
 	/* PKCS#11 requires us to supply CKA_MODULUS for private keys,
 	 * although that is not generally available from a smart card
 	 * (the key is supposed to be safely locked away after all).
@@ -4092,6 +4587,55 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 }
 
 
+static CK_RV	pkcs15_prkey_decrypt(struct sc_pkcs11_session *, void *,
+			CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG,
+			CK_BYTE_PTR, CK_ULONG_PTR);
+
+/*
+ * Unwrap into a session key held in host memory: the card only deciphers
+ * the key, which is then used with OpenSSL
+ */
+static CK_RV
+pkcs15_prkey_unwrap_to_host(struct sc_pkcs11_session *session,
+			struct pkcs15_prkey_object *prkey,
+			CK_MECHANISM_PTR pMechanism, CK_BYTE_PTR pWrappedKey,
+			CK_ULONG ulWrappedKeyLen,
+			struct pkcs15_skey_object *skey)
+{
+	unsigned char value[512];
+	CK_ULONG len = sizeof(value);
+	u8 *copy;
+	CK_RV rv;
+
+	rv = pkcs15_prkey_decrypt(session, prkey, pMechanism,
+			pWrappedKey, ulWrappedKeyLen, value, &len);
+	if (rv != CKR_OK)
+		goto out;
+
+	if ((skey->info->key_type == CKK_AES && len != 16 && len != 24 && len != 32)
+			|| (skey->info->value_len && skey->info->value_len != len * 8)) {
+		rv = CKR_WRAPPED_KEY_LEN_RANGE;
+		goto out;
+	}
+	if (!(copy = malloc(len))) {
+		rv = CKR_HOST_MEMORY;
+		goto out;
+	}
+	memcpy(copy, value, len);
+
+	if (skey->info->data.value) {
+		sc_mem_clear(skey->info->data.value, skey->info->data.len);
+		free(skey->info->data.value);
+	}
+	skey->info->data.value = copy;
+	skey->info->data.len = len;
+	skey->info->value_len = len * 8;
+
+out:
+	sc_mem_clear(value, sizeof(value));
+	return rv;
+}
+
 static CK_RV
 pkcs15_prkey_unwrap(struct sc_pkcs11_session *session, void *obj,
 			CK_MECHANISM_PTR pMechanism, CK_BYTE_PTR pWrappedKey,
@@ -4128,6 +4672,11 @@ pkcs15_prkey_unwrap(struct sc_pkcs11_session *session, void *obj,
 
 	sc_log(context, "Using mechanism %lx.", pMechanism->mechanism);
 
+	if (is_skey(targetKeyObj) && ((struct pkcs15_skey_object *) targetKeyObj)->host_obj)
+		return pkcs15_prkey_unwrap_to_host(session, prkey, pMechanism,
+				pWrappedKey, ulWrappedKeyLen,
+				(struct pkcs15_skey_object *) targetKeyObj);
+
 #if 0
 	/* FIXME https://github.com/OpenSC/OpenSC/issues/1595 */
 	/* Select the proper padding mechanism */
@@ -4351,52 +4900,20 @@ static CK_RV
 pkcs15_prkey_can_do(struct sc_pkcs11_session *session, void *obj,
 		CK_MECHANISM_TYPE mech_type, unsigned int flags)
 {
-	struct sc_pkcs11_card *p11card = session->slot->p11card;
-	struct pkcs15_fw_data *fw_data = NULL;
 	struct pkcs15_prkey_object *prkey = (struct pkcs15_prkey_object *) obj;
-	struct sc_pkcs15_prkey_info *pkinfo = NULL;
-	struct sc_supported_algo_info *token_algos = NULL;
-	int ii, jj;
+	unsigned int ii;
 
 	if (!prkey || !prkey->prv_info)
 		return CKR_KEY_FUNCTION_NOT_PERMITTED;
 
-	pkinfo = prkey->prv_info;
-	/* Return in there are no usage algorithms specified for this key. */
-	if (!pkinfo->algo_refs[0])
-		return CKR_FUNCTION_NOT_SUPPORTED;
-
-	if (!p11card)
+	if (!session->slot->p11card)
 		return CKR_FUNCTION_NOT_SUPPORTED;
-	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[session->slot->fw_data_idx];
-	if (!fw_data->p15_card)
-		return CKR_FUNCTION_NOT_SUPPORTED;
-	token_algos = &fw_data->p15_card->tokeninfo->supported_algos[0];
 
-	for (ii=0;ii<SC_MAX_SUPPORTED_ALGORITHMS && pkinfo->algo_refs[ii];ii++)   {
-		/* Look for algorithm supported by token referenced in the list of key's algorithms */
-		for (jj=0;jj<SC_MAX_SUPPORTED_ALGORITHMS && (token_algos + jj)->reference; jj++)
-			if (pkinfo->algo_refs[ii] == (token_algos + jj)->reference)
-				break;
-		if ((jj == SC_MAX_SUPPORTED_ALGORITHMS) || !(token_algos + jj)->reference)
-			return CKR_GENERAL_ERROR;
-
-		if ((token_algos + jj)->mechanism != mech_type)
-			continue;
-
-		if (flags == CKF_SIGN)
-			if ((token_algos + jj)->operations & SC_PKCS15_ALGO_OP_COMPUTE_SIGNATURE)
-				break;
-
-		if (flags == CKF_DECRYPT)
-			if ((token_algos + jj)->operations & SC_PKCS15_ALGO_OP_DECIPHER)
-				break;
-	}
-
-	if (ii == SC_MAX_SUPPORTED_ALGORITHMS || !pkinfo->algo_refs[ii])
-		return CKR_MECHANISM_INVALID;
+	for (ii = 0; ii < prkey->num_algos; ii++)
+		if (prkey->algo_mechs[ii] == mech_type && (prkey->algo_ops[ii] & flags))
+			return CKR_OK;
 
-	return CKR_OK;
+	return prkey->algo_miss;
 }
 
 
@@ -4495,7 +5012,7 @@ struct sc_pkcs11_object_ops pkcs15_prkey_ops = {
 	pkcs15_prkey_release,
 	pkcs15_prkey_set_attribute,
 	pkcs15_prkey_get_attribute,
-	sc_pkcs11_any_cmp_attribute,
+	pkcs15_any_cmp_attribute,
 	pkcs15_any_destroy,
 	NULL,	/* get_size */
 	pkcs15_prkey_sign,
@@ -4504,7 +5021,8 @@ struct sc_pkcs11_object_ops pkcs15_prkey_ops = {
 	pkcs15_prkey_derive,
 	pkcs15_prkey_can_do,
 	pkcs15_prkey_init_params,
-	NULL	/* wrap_key */
+	NULL,	/* wrap_key */
+	NULL	/* encrypt */
 };
 
 /*
@@ -4566,6 +5084,15 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session, void *object, CK_
 				if (SC_SUCCESS != check_cert_data_read(fw_data, cert))
 					return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "check_cert_data_read");
 			break;
+		case CKA_KEY_TYPE:
+			if (pubkey->pub_data == NULL && cert)
+				check_cert_data_read(fw_data, cert);
+			break;
+		case CKA_LABEL:
+			if (!pubkey->pub_p15obj && cert && cert->cert_p15obj
+					&& cert->cert_p15obj->label[0] == '\0')
+				check_cert_data_read(fw_data, cert);
+			break;
 	}
 
 	switch (attr->type) {
@@ -4682,7 +5209,10 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session, void *object, CK_
 		else if (pubkey->pub_data)   {
 			unsigned char *value = NULL;
 			size_t len;
+			CK_RV rv;
 
+			if (attr_cache_get(&pubkey->base, attr, &rv))
+				return rv;
 			if (attr->type != CKA_SPKI) {
 				if (sc_pkcs15_encode_pubkey(context, pubkey->pub_data, &value, &len))
 					return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_GetAttributeValue");
@@ -4691,20 +5221,7 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session, void *object, CK_
 					return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_GetAttributeValue");
 				}
 
-			if (attr->pValue == NULL_PTR) {
-				attr->ulValueLen = len;
-				free(value);
-				return CKR_OK;
-			}
-			if (attr->ulValueLen < len) {
-				attr->ulValueLen = len;
-				free(value);
-				return CKR_BUFFER_TOO_SMALL;
-			}
-			attr->ulValueLen = len;
-			memcpy(attr->pValue, value, len);
-
-			free(value);
+			return attr_cache_put(&pubkey->base, attr, value, len);
 		}
 		else if (attr->type != CKA_SPKI && pubkey->base.p15_object && pubkey->base.p15_object->content.value && pubkey->base.p15_object->content.len)   {
 			check_attribute_buffer(attr, pubkey->base.p15_object->content.len);
@@ -4726,7 +5243,7 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session, void *object, CK_
 	case CKA_EC_PARAMS:
 		return get_ec_pubkey_params(pubkey->pub_data, attr);
 	case CKA_EC_POINT:
-		return get_ec_pubkey_point(pubkey->pub_data, attr);
+		return get_ec_pubkey_point(&pubkey->base, pubkey->pub_data, attr);
 
 	default:
 		return CKR_ATTRIBUTE_TYPE_INVALID;
@@ -4739,7 +5256,7 @@ struct sc_pkcs11_object_ops pkcs15_pubkey_ops = {
 	pkcs15_pubkey_release,
 	pkcs15_pubkey_set_attribute,
 	pkcs15_pubkey_get_attribute,
-	sc_pkcs11_any_cmp_attribute,
+	pkcs15_any_cmp_attribute,
 	pkcs15_any_destroy,
 	NULL,	/* get_size */
 	NULL,	/* sign */
@@ -4748,7 +5265,8 @@ struct sc_pkcs11_object_ops pkcs15_pubkey_ops = {
 	NULL,	/* derive */
 	NULL,	/* can_do */
 	NULL,	/* init_params */
-	NULL	/* wrap_key */
+	NULL,	/* wrap_key */
+	NULL	/* encrypt */
 };
 
 
@@ -4811,6 +5329,48 @@ pkcs15_dobj_get_value(struct sc_pkcs11_session *session,
 }
 
 
+/*
+ * Once read, the content of a data object is kept in its info structure
+ * (sc_pkcs15_read_data_object() stores it there and C_SetAttributeValue
+ * replaces it), so it can be returned without locking the card. Content
+ * of private objects is only returned this way while the user is logged
+ * in, and is dropped again on logout.
+ */
+static int
+pkcs15_dobj_value_cached(struct sc_pkcs11_session *session,
+		struct pkcs15_data_object *dobj)
+{
+	if (dobj->info->data.value == NULL)
+		return 0;
+	if (dobj->base.p15_object->flags & SC_PKCS15_CO_FLAG_PRIVATE)
+		return session->slot->login_user == CKU_USER;
+	return 1;
+}
+
+
+static void
+pkcs15_dobj_forget_private_values(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_object *objs[MAX_OBJECTS];
+	int i, count;
+
+	count = sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_DATA_OBJECT, objs, MAX_OBJECTS);
+	for (i = 0; i < count; i++) {
+		struct sc_pkcs15_data_info *info = (struct sc_pkcs15_data_info *) objs[i]->data;
+
+		/* values stored in the DODF itself cannot be read again */
+		if (!(objs[i]->flags & SC_PKCS15_CO_FLAG_PRIVATE) || info->path.len == 0)
+			continue;
+		if (info->data.value) {
+			sc_mem_clear(info->data.value, info->data.len);
+			free(info->data.value);
+		}
+		info->data.value = NULL;
+		info->data.len = 0;
+	}
+}
+
+
 static CK_RV
 data_value_to_attr(CK_ATTRIBUTE_PTR attr, struct sc_pkcs15_data *data)
 {
@@ -4890,6 +5450,11 @@ pkcs15_dobj_get_attribute(struct sc_pkcs11_session *session, void *object, CK_AT
 		free(buf);
 		break;
 	case CKA_VALUE:
+		if (pkcs15_dobj_value_cached(session, dobj)) {
+			check_attribute_buffer(attr, dobj->info->data.len);
+			memcpy(attr->pValue, dobj->info->data.value, dobj->info->data.len);
+			break;
+		}
 		/* if CKA_VALUE is empty, sets data to NULL */
 		rv = pkcs15_dobj_get_value(session, dobj, &data);
 		if (rv == CKR_OK) {
@@ -4919,7 +5484,7 @@ struct sc_pkcs11_object_ops pkcs15_dobj_ops = {
 	pkcs15_dobj_release,
 	pkcs15_dobj_set_attribute,
 	pkcs15_dobj_get_attribute,
-	sc_pkcs11_any_cmp_attribute,
+	pkcs15_any_cmp_attribute,
 	pkcs15_any_destroy,
 	NULL,	/* get_size */
 	NULL,	/* sign */
@@ -4928,12 +5493,31 @@ struct sc_pkcs11_object_ops pkcs15_dobj_ops = {
 	NULL,	/* derive */
 	NULL,	/* can_do */
 	NULL,	/* init_params */
-	NULL	/* wrap_key */
+	NULL,	/* wrap_key */
+	NULL	/* encrypt */
 };
 
 
 /* PKCS#15 Secret Key Objects */
 /* TODO Currently only session objects */
+static void
+pkcs15_free_host_skey(struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_skey_info *info;
+
+	if (obj == NULL)
+		return;
+	info = (struct sc_pkcs15_skey_info *) obj->data;
+	if (info) {
+		if (info->data.value) {
+			sc_mem_clear(info->data.value, info->data.len);
+			free(info->data.value);
+		}
+		free(info);
+	}
+	free(obj);
+}
+
 static void
 pkcs15_skey_release(void *object)
 {
@@ -4955,6 +5539,11 @@ pkcs15_skey_set_attribute(struct sc_pkcs11_session *session,
 	switch (attr->type) {
 	case CKA_VALUE:
 		if (attr->pValue) {
+			if (skey->info->data.value) {
+				sc_mem_clear(skey->info->data.value, skey->info->data.len);
+				free(skey->info->data.value);
+			}
+			skey->info->data.len = 0;
 			skey->info->data.value = calloc(1,attr->ulValueLen);
 			if (!skey->info->data.value)
 				return CKR_HOST_MEMORY;
@@ -5028,6 +5617,10 @@ pkcs15_skey_get_attribute(struct sc_pkcs11_session *session,
 		break;
 	case CKA_EXTRACTABLE:
 		check_attribute_buffer(attr, sizeof(CK_BBOOL));
+		if (skey->host_obj) {
+			*(CK_BBOOL*)attr->pValue = (skey->info->access_flags & SC_PKCS15_PRKEY_ACCESS_NEVEREXTRACTABLE) == 0;
+			break;
+		}
 		*(CK_BBOOL*)attr->pValue = (((skey->base.p15_object->flags & SC_PKCS15_PRKEY_ACCESS_EXTRACTABLE) == SC_PKCS15_PRKEY_ACCESS_EXTRACTABLE)
 					&& (skey->base.p15_object->flags & SC_PKCS15_PRKEY_ACCESS_NEVEREXTRACTABLE) == 0
 					&& (skey->base.p15_object->flags & SC_PKCS15_PRKEY_ACCESS_ALWAYSSENSITIVE) == 0) ? CK_TRUE : CK_FALSE;
@@ -5057,6 +5650,10 @@ pkcs15_skey_get_attribute(struct sc_pkcs11_session *session,
 		*(CK_ULONG*)attr->pValue = skey->info->data.len;
 		break;
 	case CKA_VALUE:
+		/* An unwrapped session key never leaves the module */
+		if (skey->host_obj && (skey->info->access_flags
+				& (SC_PKCS15_PRKEY_ACCESS_SENSITIVE | SC_PKCS15_PRKEY_ACCESS_NEVEREXTRACTABLE)))
+			return CKR_ATTRIBUTE_SENSITIVE;
 		check_attribute_buffer(attr, skey->info->data.len);
 		memcpy(attr->pValue, skey->info->data.value, skey->info->data.len);
 		break;
@@ -5067,6 +5664,160 @@ pkcs15_skey_get_attribute(struct sc_pkcs11_session *session,
 	return CKR_OK;
 }
 
+#ifdef ENABLE_OPENSSL
+static const struct {
+	CK_MECHANISM_TYPE mech;
+	size_t key_len;
+	const EVP_CIPHER *(*cipher)(void);
+} host_skey_ciphers[] = {
+	{ CKM_AES_ECB,		16, EVP_aes_128_ecb },
+	{ CKM_AES_ECB,		24, EVP_aes_192_ecb },
+	{ CKM_AES_ECB,		32, EVP_aes_256_ecb },
+	{ CKM_AES_CBC,		16, EVP_aes_128_cbc },
+	{ CKM_AES_CBC,		24, EVP_aes_192_cbc },
+	{ CKM_AES_CBC,		32, EVP_aes_256_cbc },
+	{ CKM_AES_CBC_PAD,	16, EVP_aes_128_cbc },
+	{ CKM_AES_CBC_PAD,	24, EVP_aes_192_cbc },
+	{ CKM_AES_CBC_PAD,	32, EVP_aes_256_cbc },
+	{ CKM_AES_GCM,		16, EVP_aes_128_gcm },
+	{ CKM_AES_GCM,		24, EVP_aes_192_gcm },
+	{ CKM_AES_GCM,		32, EVP_aes_256_gcm },
+};
+
+/*
+ * Encrypt or decrypt with a session key held in host memory, so that bulk
+ * data does not have to go through the card
+ */
+static CK_RV
+pkcs15_skey_crypt(struct pkcs15_skey_object *skey, CK_MECHANISM_PTR pMechanism,
+		int encrypt, CK_BYTE_PTR pIn, CK_ULONG ulInLen,
+		CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	const EVP_CIPHER *cipher = NULL;
+	EVP_CIPHER_CTX *ctx;
+	CK_GCM_PARAMS *gcm = NULL;
+	const unsigned char *iv = NULL;
+	CK_ULONG need, tag_len = 0;
+	CK_RV len_range = encrypt ? CKR_DATA_LEN_RANGE : CKR_ENCRYPTED_DATA_LEN_RANGE;
+	int ok, len = 0, final_len = 0;
+	size_t i;
+	CK_RV rv = CKR_OK;
+
+	/* Symmetric operations with keys on the card are not implemented */
+	if (skey->host_obj == NULL || skey->info->data.value == NULL)
+		return CKR_KEY_FUNCTION_NOT_PERMITTED;
+	if (!(skey->info->usage & (encrypt ? SC_PKCS15_PRKEY_USAGE_ENCRYPT : SC_PKCS15_PRKEY_USAGE_DECRYPT)))
+		return CKR_KEY_FUNCTION_NOT_PERMITTED;
+
+	for (i = 0; i < sizeof(host_skey_ciphers) / sizeof(host_skey_ciphers[0]); i++) {
+		if (host_skey_ciphers[i].mech != pMechanism->mechanism)
+			continue;
+		if (host_skey_ciphers[i].key_len == skey->info->data.len) {
+			cipher = host_skey_ciphers[i].cipher();
+			break;
+		}
+		rv = CKR_KEY_SIZE_RANGE;
+	}
+	if (cipher == NULL)
+		return rv != CKR_OK ? rv : CKR_MECHANISM_INVALID;
+
+	switch (pMechanism->mechanism) {
+	case CKM_AES_CBC:
+	case CKM_AES_CBC_PAD:
+		if (pMechanism->pParameter == NULL || pMechanism->ulParameterLen != 16)
+			return CKR_MECHANISM_PARAM_INVALID;
+		iv = pMechanism->pParameter;
+		/* fall through */
+	case CKM_AES_ECB:
+		if (pMechanism->mechanism == CKM_AES_CBC_PAD && encrypt) {
+			need = (ulInLen / 16 + 1) * 16;
+			break;
+		}
+		if (ulInLen % 16)
+			return len_range;
+		/* the padding is only known after decryption */
+		need = ulInLen;
+		break;
+	case CKM_AES_GCM:
+		if (pMechanism->pParameter == NULL || pMechanism->ulParameterLen != sizeof(CK_GCM_PARAMS))
+			return CKR_MECHANISM_PARAM_INVALID;
+		gcm = pMechanism->pParameter;
+		tag_len = gcm->ulTagBits / 8;
+		if (gcm->pIv == NULL || gcm->ulIvLen == 0 || (gcm->pAAD == NULL && gcm->ulAADLen)
+				|| gcm->ulTagBits % 8 || tag_len < 4 || tag_len > 16)
+			return CKR_MECHANISM_PARAM_INVALID;
+		iv = gcm->pIv;
+		if (!encrypt && ulInLen < tag_len)
+			return len_range;
+		need = encrypt ? ulInLen + tag_len : ulInLen - tag_len;
+		break;
+	default:
+		return CKR_MECHANISM_INVALID;
+	}
+
+	if (pOut == NULL) {
+		*pulOutLen = need;
+		return CKR_OK;
+	}
+	if (*pulOutLen < need) {
+		*pulOutLen = need;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+	if (gcm && !encrypt)
+		ulInLen -= tag_len;
+
+	if (!(ctx = EVP_CIPHER_CTX_new()))
+		return CKR_HOST_MEMORY;
+	ok = EVP_CipherInit_ex(ctx, cipher, NULL, NULL, NULL, encrypt);
+	if (ok && gcm)
+		ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, (int) gcm->ulIvLen, NULL);
+	if (ok)
+		ok = EVP_CipherInit_ex(ctx, NULL, NULL, skey->info->data.value, iv, encrypt);
+	if (ok)
+		ok = EVP_CIPHER_CTX_set_padding(ctx, pMechanism->mechanism == CKM_AES_CBC_PAD);
+	if (ok && gcm && gcm->ulAADLen)
+		ok = EVP_CipherUpdate(ctx, NULL, &len, gcm->pAAD, (int) gcm->ulAADLen);
+	if (ok && gcm && !encrypt)
+		ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, (int) tag_len, pIn + ulInLen);
+	if (ok)
+		ok = EVP_CipherUpdate(ctx, pOut, &len, pIn, (int) ulInLen);
+	if (ok)
+		ok = EVP_CipherFinal_ex(ctx, pOut + len, &final_len);
+	if (ok && gcm && encrypt)
+		ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, (int) tag_len, pOut + len + final_len);
+	EVP_CIPHER_CTX_free(ctx);
+
+	if (!ok) {
+		sc_log(context, "AES %s with a host key failed", encrypt ? "encryption" : "decryption");
+		/* a wrong tag or padding */
+		return encrypt ? CKR_FUNCTION_FAILED : CKR_ENCRYPTED_DATA_INVALID;
+	}
+
+	*pulOutLen = len + final_len + (encrypt ? tag_len : 0);
+	return CKR_OK;
+}
+
+static CK_RV
+pkcs15_skey_encrypt(struct sc_pkcs11_session *session, void *obj,
+		CK_MECHANISM_PTR pMechanism,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	return pkcs15_skey_crypt((struct pkcs15_skey_object *) obj, pMechanism, 1,
+			pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+}
+
+static CK_RV
+pkcs15_skey_decrypt(struct sc_pkcs11_session *session, void *obj,
+		CK_MECHANISM_PTR pMechanism,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen,
+		CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	return pkcs15_skey_crypt((struct pkcs15_skey_object *) obj, pMechanism, 0,
+			pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+}
+#endif
+
 static CK_RV
 pkcs15_skey_unwrap(struct sc_pkcs11_session *session, void *obj,
 			CK_MECHANISM_PTR pMechanism, CK_BYTE_PTR pWrappedKey,
@@ -5226,16 +5977,25 @@ struct sc_pkcs11_object_ops pkcs15_skey_ops = {
 	pkcs15_skey_release,
 	pkcs15_skey_set_attribute,
 	pkcs15_skey_get_attribute,
-	sc_pkcs11_any_cmp_attribute,
+	pkcs15_any_cmp_attribute,
 	pkcs15_skey_destroy,
 	NULL,	/* get_size */
 	NULL,	/* sign */
 	pkcs15_skey_unwrap,
+#ifdef ENABLE_OPENSSL
+	pkcs15_skey_decrypt,
+#else
 	NULL,	/* decrypt */
+#endif
 	NULL,	/* derive */
 	NULL,	/* can_do */
 	NULL,	/* init_params */
-	pkcs15_skey_wrap /* wrap_key */
+	pkcs15_skey_wrap, /* wrap_key */
+#ifdef ENABLE_OPENSSL
+	pkcs15_skey_encrypt
+#else
+	NULL	/* encrypt */
+#endif
 };
 
 /*
@@ -5336,36 +6096,26 @@ get_ec_pubkey_params(struct sc_pkcs15_pubkey *key, CK_ATTRIBUTE_PTR attr)
 }
 
 static CK_RV
-get_ec_pubkey_point(struct sc_pkcs15_pubkey *key, CK_ATTRIBUTE_PTR attr)
+get_ec_pubkey_point(struct pkcs15_any_object *obj, struct sc_pkcs15_pubkey *key,
+		CK_ATTRIBUTE_PTR attr)
 {
 	unsigned char *value = NULL;
 	size_t value_len = 0;
 	int rc;
+	CK_RV rv;
 
 	if (key == NULL)
 		return CKR_ATTRIBUTE_TYPE_INVALID;
 
 	switch (key->algorithm) {
 	case SC_ALGORITHM_EC:
+		if (attr_cache_get(obj, attr, &rv))
+			return rv;
 		rc = sc_pkcs15_encode_pubkey_ec(context, &key->u.ec, &value, &value_len);
 		if (rc != SC_SUCCESS)
 			return sc_to_cryptoki_error(rc, NULL);
 
-		if (attr->pValue == NULL_PTR) {
-			attr->ulValueLen = value_len;
-			free(value);
-			return CKR_OK;
-		}
-		if (attr->ulValueLen < value_len) {
-			attr->ulValueLen = value_len;
-			free(value);
-			return CKR_BUFFER_TOO_SMALL;
-		}
-		attr->ulValueLen = value_len;
-
-		memcpy(attr->pValue, value, value_len);
-		free(value);
-		return CKR_OK;
+		return attr_cache_put(obj, attr, value, value_len);
 	}
 
 	return CKR_ATTRIBUTE_TYPE_INVALID;
@@ -5598,6 +6348,17 @@ static int sc_pkcs11_register_aes_mechanisms(struct sc_pkcs11_card *p11card, int
 	if (rc != CKR_OK)
 			return rc;
 
+#ifdef ENABLE_OPENSSL
+	/* only for session keys in host memory */
+	mech_info.flags = CKF_ENCRYPT | CKF_DECRYPT;
+	mt = sc_pkcs11_new_fw_mechanism(CKM_AES_GCM, &mech_info, CKK_AES, NULL, NULL);
+	if (!mt)
+		return CKR_HOST_MEMORY;
+	rc = sc_pkcs11_register_mechanism(p11card, mt);
+	if (rc != CKR_OK)
+			return rc;
+#endif
+
 	return CKR_OK;
 }
 
@@ -5627,6 +6388,8 @@ register_mechanisms(struct sc_pkcs11_card *p11card)
 #ifdef ENABLE_OPENSSL
 	/* That practise definitely conflicts with CKF_HW -- andre 2010-11-28 */
 	mech_info.flags |= CKF_VERIFY;
+	/* RSA encryption with a public key is done by OpenSSL as well */
+	mech_info.flags |= CKF_ENCRYPT;
 #endif
 	if ((card->caps & SC_CARD_CAP_UNWRAP_KEY) == SC_CARD_CAP_UNWRAP_KEY)
 		mech_info.flags |= CKF_UNWRAP;
@@ -5712,10 +6475,13 @@ register_mechanisms(struct sc_pkcs11_card *p11card)
 
 	if (rsa_flags & SC_ALGORITHM_RSA_PAD_ISO9796) {
 		/* Supported in hardware only, if the card driver declares it. */
+		CK_FLAGS old_flags = mech_info.flags;
+		mech_info.flags &= ~CKF_ENCRYPT;
 		mt = sc_pkcs11_new_fw_mechanism(CKM_RSA_9796, &mech_info, CKK_RSA, NULL, NULL);
 		rc = sc_pkcs11_register_mechanism(p11card, mt);
 		if (rc != CKR_OK)
 			return rc;
+		mech_info.flags = old_flags;
 	}
 
 #ifdef ENABLE_OPENSSL
@@ -5848,6 +6614,14 @@ register_mechanisms(struct sc_pkcs11_card *p11card)
 			return rc;
 	}
 
+#ifdef ENABLE_OPENSSL
+	/* Session keys unwrapped into host memory are used with OpenSSL,
+	 * see pkcs15_skey_crypt() */
+	if (aes_max_key_size == 0) {
+		aes_min_key_size = 128;
+		aes_max_key_size = 256;
+	}
+#endif
 	if (aes_max_key_size > 0) {
 		rc = sc_pkcs11_register_aes_mechanisms(p11card, aes_flags, aes_min_key_size, aes_max_key_size);
 		if (rc != CKR_OK)
@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS11
+
 #include "config.h"
 
 #include <stdlib.h>
@@ -191,7 +193,10 @@ struct sc_pkcs11_framework_ops framework_pkcs15init = {
 	NULL, /* init_pin */
 	NULL, /* create_object */
 	NULL, /* gen_keypair */
-	NULL  /* get_random */
+	NULL, /* get_random */
+	NULL, /* load_objects */
+	NULL, /* reclaim */
+	NULL  /* defer_login */
 };
 
 #else /* ifdef USE_PKCS15_INIT */
@@ -208,7 +213,10 @@ struct sc_pkcs11_framework_ops framework_pkcs15init = {
 	NULL,	/* init_pin */
 	NULL,	/* create_object */
 	NULL,	/* gen_keypair */
-	NULL	/* get_random */
+	NULL,	/* get_random */
+	NULL,	/* load_objects */
+	NULL,	/* reclaim */
+	NULL	/* defer_login */
 };
 
 #endif
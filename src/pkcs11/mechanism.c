@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS11
+
 #include "config.h"
 
 #include <stdlib.h>
@@ -43,6 +45,9 @@ struct signature_data {
 	unsigned int	buffer_len;
 };
 
+static CK_RV	sc_pkcs11_signature_final(sc_pkcs11_operation_t *,
+			CK_BYTE_PTR, CK_ULONG_PTR);
+
 /*
  * Register a mechanism
  */
@@ -55,16 +60,65 @@ sc_pkcs11_register_mechanism(struct sc_pkcs11_card *p11card,
 	if (mt == NULL)
 		return CKR_HOST_MEMORY;
 
-	p = (sc_pkcs11_mechanism_type_t **) realloc(p11card->mechanisms,
-			(p11card->nmechanisms + 2) * sizeof(*p));
-	if (p == NULL)
-		return CKR_HOST_MEMORY;
-	p11card->mechanisms = p;
+	/* the list stays NULL terminated */
+	if (p11card->nmechanisms + 2 > p11card->mechanisms_alloc) {
+		unsigned int alloc = p11card->mechanisms_alloc ? 2 * p11card->mechanisms_alloc : 32;
+
+		p = (sc_pkcs11_mechanism_type_t **) realloc(p11card->mechanisms,
+				alloc * sizeof(*p));
+		if (p == NULL)
+			return CKR_HOST_MEMORY;
+		p11card->mechanisms = p;
+		p11card->mechanisms_alloc = alloc;
+	}
+	p = p11card->mechanisms;
 	p[p11card->nmechanisms++] = mt;
 	p[p11card->nmechanisms] = NULL;
 	return CKR_OK;
 }
 
+static int
+mech_index_cmp(const void *a, const void *b)
+{
+	const struct sc_pkcs11_mech_index *e1 = a, *e2 = b;
+
+	if (e1->mech != e2->mech)
+		return e1->mech < e2->mech ? -1 : 1;
+	return e1->pos < e2->pos ? -1 : (e1->pos > e2->pos);
+}
+
+/*
+ * Sort the registered mechanisms by type, so that looking them up does not
+ * need to walk the whole list. Called by the framework once all mechanisms
+ * of the card are registered; mechanisms registered later are found by
+ * the plain scan until the index is built again.
+ */
+CK_RV
+sc_pkcs11_index_mechanisms(struct sc_pkcs11_card *p11card)
+{
+	struct sc_pkcs11_mech_index *index;
+	unsigned int n, count = 0;
+
+	index = realloc(p11card->mech_index,
+			(p11card->nmechanisms + 1) * sizeof(*index));
+	if (index == NULL)
+		return CKR_HOST_MEMORY;
+	p11card->mech_index = index;
+
+	for (n = 0; n < p11card->nmechanisms; n++) {
+		if (!p11card->mechanisms[n])
+			continue;
+		index[count].mech = p11card->mechanisms[n]->mech;
+		index[count].pos = n;
+		count++;
+	}
+	qsort(index, count, sizeof(*index), mech_index_cmp);
+
+	p11card->nmech_index = count;
+	p11card->mech_indexed = p11card->nmechanisms;
+	return CKR_OK;
+}
+
 /*
  * Look up a mechanism
  */
@@ -74,6 +128,26 @@ sc_pkcs11_find_mechanism(struct sc_pkcs11_card *p11card, CK_MECHANISM_TYPE mech,
 	sc_pkcs11_mechanism_type_t *mt;
 	unsigned int n;
 
+	if (p11card->mech_index && p11card->mech_indexed == p11card->nmechanisms) {
+		struct sc_pkcs11_mech_index *index = p11card->mech_index;
+		unsigned int lo = 0, hi = p11card->nmech_index, mid;
+
+		/* first entry of this type, then the same order as the list */
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (index[mid].mech < mech)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		for (; lo < p11card->nmech_index && index[lo].mech == mech; lo++) {
+			mt = p11card->mechanisms[index[lo].pos];
+			if ((mt->mech_info.flags & flags) == flags)
+				return mt;
+		}
+		return NULL;
+	}
+
 	for (n = 0; n < p11card->nmechanisms; n++) {
 		mt = p11card->mechanisms[n];
 		if (mt && mt->mech == mech && ((mt->mech_info.flags & flags) == flags))
@@ -100,6 +174,15 @@ sc_pkcs11_get_mechanism_list(struct sc_pkcs11_card *p11card,
 	if (!p11card)
 		return CKR_TOKEN_NOT_PRESENT;
 
+	/* no application is bound yet, see token_snapshots */
+	if (!p11card->nmechanisms) {
+		for (n = 0; n < p11card->nsnapshot_mechanisms; n++) {
+			if (pList && count < *pulCount)
+				pList[count] = p11card->snapshot_mechanisms[n];
+			count++;
+		}
+	}
+
 	for (n = 0; n < p11card->nmechanisms; n++) {
 		if (!(mt = p11card->mechanisms[n]))
 			continue;
@@ -121,6 +204,16 @@ sc_pkcs11_get_mechanism_info(struct sc_pkcs11_card *p11card,
 			CK_MECHANISM_INFO_PTR pInfo)
 {
 	sc_pkcs11_mechanism_type_t *mt;
+	unsigned int n;
+
+	if (p11card && !p11card->nmechanisms) {
+		for (n = 0; n < p11card->nsnapshot_mechanisms; n++) {
+			if (p11card->snapshot_mechanisms[n] == mechanism) {
+				memcpy(pInfo, &p11card->snapshot_mechanism_info[n], sizeof(*pInfo));
+				return CKR_OK;
+			}
+		}
+	}
 
 	if (!(mt = sc_pkcs11_find_mechanism(p11card, mechanism, 0)))
 		return CKR_MECHANISM_INVALID;
@@ -137,7 +230,10 @@ sc_pkcs11_new_operation(sc_pkcs11_session_t *session,
 {
 	sc_pkcs11_operation_t *res;
 
-	res = calloc(1, type->obj_size);
+	if (session)
+		res = session_pool_alloc(session, type->obj_size);
+	else
+		res = calloc(1, type->obj_size);
 	if (res) {
 		res->session = session;
 		res->type = type;
@@ -154,8 +250,13 @@ sc_pkcs11_release_operation(sc_pkcs11_operation_t **ptr)
 		return;
 	if (operation->type && operation->type->release)
 		operation->type->release(operation);
-	memset(operation, 0, sizeof(*operation));
-	free(operation);
+	/* the session of an orphaned operation may be gone already */
+	if (operation->session && !operation->orphaned && operation->type) {
+		session_pool_free(operation->session, operation, operation->type->obj_size);
+	} else {
+		memset(operation, 0, sizeof(*operation));
+		free(operation);
+	}
 	*ptr = NULL;
 }
 
@@ -336,6 +437,42 @@ done:
 	LOG_FUNC_RETURN(context, (int) rv);
 }
 
+/*
+ * Single-part signature with a mechanism that signs the data as it is
+ * (no hashing on the host): hand the caller's buffer to the key directly
+ * instead of collecting it in the signature data first. Returns
+ * CKR_FUNCTION_NOT_SUPPORTED, without touching the operation, when the
+ * operation has to go through sc_pkcs11_sign_update()/_final().
+ */
+CK_RV
+sc_pkcs11_sign(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	sc_pkcs11_operation_t *op;
+	struct signature_data *data;
+	CK_RV rv;
+
+	LOG_FUNC_CALLED(context);
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_SIGN, &op);
+	if (rv != CKR_OK)
+		LOG_FUNC_RETURN(context, (int) rv);
+
+	if (op->type->sign_final != sc_pkcs11_signature_final)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	data = (struct signature_data *) op->priv_data;
+	if (data->md != NULL || data->buffer_len != 0)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	rv = data->key->ops->sign(op->session, data->key, &op->mechanism,
+			pData, ulDataLen, pSignature, pulSignatureLen);
+
+	if (rv != CKR_BUFFER_TOO_SMALL && pSignature != NULL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_SIGN);
+
+	LOG_FUNC_RETURN(context, (int) rv);
+}
+
 CK_RV
 sc_pkcs11_sign_size(struct sc_pkcs11_session *session, CK_ULONG_PTR pLength)
 {
@@ -374,7 +511,7 @@ sc_pkcs11_signature_init(sc_pkcs11_operation_t *operation,
 	int can_do_it = 0;
 
 	LOG_FUNC_CALLED(context);
-	if (!(data = calloc(1, sizeof(*data))))
+	if (!(data = session_pool_alloc(operation->session, sizeof(*data))))
 		LOG_FUNC_RETURN(context, CKR_HOST_MEMORY);
 	data->info = NULL;
 	data->key = key;
@@ -529,12 +666,48 @@ sc_pkcs11_signature_release(sc_pkcs11_operation_t *operation)
 	data = (struct signature_data *) operation->priv_data;
 	if (!data)
 	    return;
+	if (data->md)
+		data->md->orphaned = operation->orphaned;
 	sc_pkcs11_release_operation(&data->md);
-	memset(data, 0, sizeof(*data));
-	free(data);
+	if (operation->orphaned) {
+		memset(data, 0, sizeof(*data));
+		free(data);
+	} else {
+		session_pool_free(operation->session, data, sizeof(*data));
+	}
 }
 
 #ifdef ENABLE_OPENSSL
+/*
+ * Parse the public key of an object once, so that later operations
+ * with it need neither the card nor the key attributes.
+ */
+static CK_RV
+sc_pkcs11_load_public_key(struct sc_pkcs11_session *session,
+		struct sc_pkcs11_object *key)
+{
+	CK_ATTRIBUTE attr = {CKA_SPKI, NULL, 0};
+	unsigned char *spki;
+	CK_RV rv;
+
+	if (key->verify_key)
+		return CKR_OK;
+
+	rv = key->ops->get_attribute(session, key, &attr);
+	if (rv != CKR_OK)
+		return rv;
+	spki = calloc(1, attr.ulValueLen);
+	if (!spki)
+		return CKR_HOST_MEMORY;
+	attr.pValue = spki;
+	rv = key->ops->get_attribute(session, key, &attr);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_parse_public_key(&key->verify_key,
+				spki, (unsigned int) attr.ulValueLen);
+	free(spki);
+	return rv;
+}
+
 /*
  * Initialize a verify context. When we get here, we know
  * the key object is capable of verifying _something_
@@ -638,9 +811,11 @@ sc_pkcs11_verify_init(sc_pkcs11_operation_t *operation,
 {
 	struct hash_signature_info *info;
 	struct signature_data *data;
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE attr_key_type = {CKA_KEY_TYPE, &key_type, sizeof(key_type)};
 	CK_RV rv;
 
-	if (!(data = calloc(1, sizeof(*data))))
+	if (!(data = session_pool_alloc(operation->session, sizeof(*data))))
 		return CKR_HOST_MEMORY;
 
 	data->info = NULL;
@@ -668,6 +843,11 @@ sc_pkcs11_verify_init(sc_pkcs11_operation_t *operation,
 		}
 	}
 
+	/* Parse the key now, so that the verification does not need the card */
+	if (key->ops->get_attribute(operation->session, key, &attr_key_type) == CKR_OK
+			&& key_type != CKK_GOSTR3410)
+		sc_pkcs11_load_public_key(operation->session, key);
+
 	/* If this is a verify with hash operation, set up the
 	 * hash operation */
 	info = (struct hash_signature_info *) operation->type->mech_data;
@@ -736,9 +916,15 @@ sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 	if (rv != CKR_OK)
 		return rv;
 
-	if (key_type != CKK_GOSTR3410)
+	if (key_type != CKK_GOSTR3410) {
+		/* the key parsed for an earlier verification is kept with the object */
+		if (key->verify_key)
+			return sc_pkcs11_verify_data(&key->verify_key, NULL, 0,
+				NULL, 0, &operation->mechanism, data->md,
+				data->buffer, data->buffer_len,
+				pSignature, (unsigned int) ulSignatureLen);
 		attr.type = CKA_SPKI;
-		
+	}
 
 	rv = key->ops->get_attribute(operation->session, key, &attr);
 	if (rv != CKR_OK)
@@ -759,7 +945,8 @@ sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 			goto done;
 	}
 
-	rv = sc_pkcs11_verify_data(pubkey_value, (unsigned int) attr.ulValueLen,
+	rv = sc_pkcs11_verify_data(key_type != CKK_GOSTR3410 ? &key->verify_key : NULL,
+		pubkey_value, (unsigned int) attr.ulValueLen,
 		params, sizeof(params),
 		&operation->mechanism, data->md,
 		data->buffer, data->buffer_len, pSignature, (unsigned int) ulSignatureLen);
@@ -769,8 +956,284 @@ done:
 
 	return rv;
 }
+
+/*
+ * Whether the verify operation of the session is done on the host with a
+ * key parsed before, so that it needs neither the card nor the login state.
+ */
+int
+sc_pkcs11_verif_host_only(struct sc_pkcs11_session *session)
+{
+	sc_pkcs11_operation_t *op;
+	struct signature_data *data;
+
+	if (session_get_operation(session, SC_PKCS11_OPERATION_VERIFY, &op) != CKR_OK)
+		return 0;
+	if (op->type->verif_final != sc_pkcs11_verify_final)
+		return 0;
+	data = (struct signature_data *) op->priv_data;
+	return data != NULL && data->key->verify_key != NULL;
+}
+
+/*
+ * Initialize an encryption context. Encryption is done on the host only,
+ * with the public key or with a secret key held in memory.
+ */
+CK_RV
+sc_pkcs11_encr_init(struct sc_pkcs11_session *session,
+			CK_MECHANISM_PTR pMechanism,
+			struct sc_pkcs11_object *key,
+			CK_MECHANISM_TYPE key_type)
+{
+	struct sc_pkcs11_card *p11card;
+	sc_pkcs11_operation_t *operation;
+	sc_pkcs11_mechanism_type_t *mt;
+	CK_RV rv;
+
+	if (!session || !session->slot
+	 || !(p11card = session->slot->p11card))
+		return CKR_ARGUMENTS_BAD;
+
+	/* See if we support this mechanism type */
+	mt = sc_pkcs11_find_mechanism(p11card, pMechanism->mechanism, CKF_ENCRYPT);
+	if (mt == NULL || mt->encrypt_init == NULL)
+		return CKR_MECHANISM_INVALID;
+	if (pMechanism->pParameter
+			&& pMechanism->ulParameterLen > sizeof(operation->mechanism_params))
+		return CKR_MECHANISM_PARAM_INVALID;
+
+	/* See if compatible with key type */
+	if (mt->key_type != key_type)
+		return CKR_KEY_TYPE_INCONSISTENT;
+
+	rv = session_start_operation(session, SC_PKCS11_OPERATION_ENCRYPT, mt, &operation);
+	if (rv != CKR_OK)
+		return rv;
+
+	memcpy(&operation->mechanism, pMechanism, sizeof(CK_MECHANISM));
+	if (pMechanism->pParameter) {
+		memcpy(&operation->mechanism_params, pMechanism->pParameter,
+		       pMechanism->ulParameterLen);
+		operation->mechanism.pParameter = &operation->mechanism_params;
+	}
+	rv = mt->encrypt_init(operation, key);
+
+	if (rv != CKR_OK)
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
+
+CK_RV
+sc_pkcs11_encr(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	sc_pkcs11_operation_t *op;
+	CK_RV rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_ENCRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = op->type->encrypt(op, pData, ulDataLen,
+	                       pEncryptedData, pulEncryptedDataLen);
+
+	if (rv != CKR_BUFFER_TOO_SMALL && pEncryptedData != NULL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
+
+static CK_RV
+sc_pkcs11_encrypt_init(sc_pkcs11_operation_t *operation,
+		struct sc_pkcs11_object *key)
+{
+	struct signature_data *data;
+	CK_RV rv;
+
+	/* Validate the mechanism parameters */
+	if (key->ops->init_params) {
+		rv = key->ops->init_params(operation->session, &operation->mechanism);
+		if (rv != CKR_OK)
+			LOG_FUNC_RETURN(context, (int) rv);
+	}
+
+	rv = sc_pkcs11_load_public_key(operation->session, key);
+	if (rv != CKR_OK)
+		LOG_FUNC_RETURN(context, (int) rv);
+
+	if (!(data = session_pool_alloc(operation->session, sizeof(*data))))
+		return CKR_HOST_MEMORY;
+	data->key = key;
+	operation->priv_data = data;
+	return CKR_OK;
+}
+
+static CK_RV
+sc_pkcs11_encrypt(sc_pkcs11_operation_t *operation,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	struct signature_data *data;
+
+	data = (struct signature_data *) operation->priv_data;
+	return sc_pkcs11_encrypt_data(data->key->verify_key, &operation->mechanism,
+			pData, (unsigned int) ulDataLen,
+			pEncryptedData, pulEncryptedDataLen);
+}
+
+/*
+ * Secret keys encrypt through their object, see pkcs15_skey_encrypt()
+ */
+static CK_RV
+sc_pkcs11_encrypt_skey_init(sc_pkcs11_operation_t *operation,
+		struct sc_pkcs11_object *key)
+{
+	struct signature_data *data;
+
+	if (key->ops->encrypt == NULL)
+		return CKR_KEY_TYPE_INCONSISTENT;
+
+	if (!(data = session_pool_alloc(operation->session, sizeof(*data))))
+		return CKR_HOST_MEMORY;
+	data->key = key;
+	operation->priv_data = data;
+	return CKR_OK;
+}
+
+static CK_RV
+sc_pkcs11_encrypt_skey(sc_pkcs11_operation_t *operation,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	struct signature_data *data;
+
+	data = (struct signature_data *) operation->priv_data;
+	return data->key->ops->encrypt(operation->session, data->key,
+			&operation->mechanism, pData, ulDataLen,
+			pEncryptedData, pulEncryptedDataLen);
+}
 #endif
 
+/*
+ * The update phase of digests, and of sign/verify operations hashed on
+ * the host, does not touch the card or any module state. Return the
+ * digest operation such an update feeds, so that the caller can run it
+ * without holding the module lock.
+ */
+CK_RV
+sc_pkcs11_get_update_digest(struct sc_pkcs11_session *session, int type,
+		sc_pkcs11_operation_t **operation, sc_pkcs11_operation_t **md)
+{
+	sc_pkcs11_operation_t *op;
+	struct signature_data *data;
+	CK_RV rv;
+
+	rv = session_get_operation(session, type, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	switch (type) {
+	case SC_PKCS11_OPERATION_DIGEST:
+		if (op->type->md_update == NULL)
+			return CKR_FUNCTION_NOT_SUPPORTED;
+		*md = op;
+		break;
+	case SC_PKCS11_OPERATION_SIGN:
+		if (op->type->sign_update != sc_pkcs11_signature_update)
+			return CKR_FUNCTION_NOT_SUPPORTED;
+		data = (struct signature_data *) op->priv_data;
+		if (data == NULL || data->md == NULL)
+			return CKR_FUNCTION_NOT_SUPPORTED;
+		*md = data->md;
+		break;
+#ifdef ENABLE_OPENSSL
+	case SC_PKCS11_OPERATION_VERIFY:
+		if (op->type->verif_update != sc_pkcs11_verify_update)
+			return CKR_FUNCTION_NOT_SUPPORTED;
+		data = (struct signature_data *) op->priv_data;
+		if (data == NULL || data->md == NULL)
+			return CKR_FUNCTION_NOT_SUPPORTED;
+		*md = data->md;
+		break;
+#endif
+	default:
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	}
+
+	*operation = op;
+	return CKR_OK;
+}
+
+static int
+sc_pkcs11_has_update_digest(sc_pkcs11_operation_t *op)
+{
+	if (op->type->sign_update == sc_pkcs11_signature_update)
+		return 1;
+#ifdef ENABLE_OPENSSL
+	if (op->type->verif_update == sc_pkcs11_verify_update)
+		return 1;
+#endif
+	return 0;
+}
+
+static int
+sc_pkcs11_copy_type(sc_pkcs11_operation_t *op)
+{
+	sc_pkcs11_mechanism_type_t *type;
+
+	type = malloc(sizeof *type);
+	if (type == NULL)
+		return 0;
+	*type = *op->type;
+	type->mech_data = NULL;
+	type->free_mech_data = NULL;
+	op->type = type;
+	return 1;
+}
+
+/*
+ * An operation that is being updated without the lock is stopped (its
+ * session is closed). The card, and with it the mechanism types, may be
+ * released before the updating thread is done. Give the operation
+ * private copies of its types so that the updating thread can still
+ * release it with sc_pkcs11_release_orphan().
+ */
+void
+sc_pkcs11_orphan_operation(sc_pkcs11_operation_t *op)
+{
+	struct signature_data *data = NULL;
+
+	if (sc_pkcs11_has_update_digest(op))
+		data = (struct signature_data *) op->priv_data;
+	if (data && data->md && !sc_pkcs11_copy_type(data->md))
+		data->md->type = NULL;
+	if (!sc_pkcs11_copy_type(op))
+		op->type = NULL;
+	op->orphaned = 1;
+}
+
+void
+sc_pkcs11_release_orphan(sc_pkcs11_operation_t **ptr)
+{
+	sc_pkcs11_operation_t *op = *ptr;
+	sc_pkcs11_mechanism_type_t *type, *md_type = NULL;
+	struct signature_data *data = NULL;
+
+	if (!op)
+		return;
+	type = op->type;
+	if (type && sc_pkcs11_has_update_digest(op))
+		data = (struct signature_data *) op->priv_data;
+	if (data && data->md)
+		md_type = data->md->type;
+
+	sc_pkcs11_release_operation(ptr);
+	free(md_type);
+	free(type);
+}
+
 /*
  * Initialize a decryption context. When we get here, we know
  * the key object is capable of decrypting _something_
@@ -794,6 +1257,9 @@ sc_pkcs11_decr_init(struct sc_pkcs11_session *session,
 	mt = sc_pkcs11_find_mechanism(p11card, pMechanism->mechanism, CKF_DECRYPT);
 	if (mt == NULL)
 		return CKR_MECHANISM_INVALID;
+	if (pMechanism->pParameter
+			&& pMechanism->ulParameterLen > sizeof(operation->mechanism_params))
+		return CKR_MECHANISM_PARAM_INVALID;
 
 	/* See if compatible with key type */
 	if (mt->key_type != key_type)
@@ -1053,7 +1519,7 @@ sc_pkcs11_decrypt_init(sc_pkcs11_operation_t *operation,
 	struct signature_data *data;
 	CK_RV rv;
 
-	if (!(data = calloc(1, sizeof(*data))))
+	if (!(data = session_pool_alloc(operation->session, sizeof(*data))))
 		return CKR_HOST_MEMORY;
 
 	data->key = key;
@@ -1091,6 +1557,81 @@ sc_pkcs11_decrypt(sc_pkcs11_operation_t *operation,
 				pData, pulDataLen);
 }
 
+/*
+ * The private key operations of a token pool (see token_pool in
+ * opensc.conf) run on the same key of another token. Finish the host
+ * side of the operation of 'type', i.e. the digest of a signature
+ * mechanism hashing on the host, and return its key, so that the caller
+ * can hand the operation to sc_pkcs11_run_on_key() without holding the
+ * lock of the session's card.
+ */
+CK_RV
+sc_pkcs11_prepare_on_key(struct sc_pkcs11_session *session, int type,
+		sc_pkcs11_operation_t **operation, struct sc_pkcs11_object **key)
+{
+	sc_pkcs11_operation_t *op;
+	struct signature_data *data;
+	CK_RV rv;
+
+	rv = session_get_operation(session, type, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	switch (type) {
+	case SC_PKCS11_OPERATION_SIGN:
+		if (op->type->sign_final != sc_pkcs11_signature_final)
+			return CKR_FUNCTION_NOT_SUPPORTED;
+		data = (struct signature_data *) op->priv_data;
+		if (data->md) {
+			CK_ULONG len = sizeof(data->buffer);
+
+			rv = data->md->type->md_final(data->md, data->buffer, &len);
+			if (rv == CKR_BUFFER_TOO_SMALL)
+				rv = CKR_FUNCTION_FAILED;
+			if (rv != CKR_OK)
+				return rv;
+			data->buffer_len = (unsigned int) len;
+			sc_pkcs11_release_operation(&data->md);
+		}
+		break;
+	case SC_PKCS11_OPERATION_DECRYPT:
+		if (op->type->decrypt != sc_pkcs11_decrypt)
+			return CKR_FUNCTION_NOT_SUPPORTED;
+		data = (struct signature_data *) op->priv_data;
+		break;
+	default:
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	}
+
+	*operation = op;
+	*key = data->key;
+	return CKR_OK;
+}
+
+/*
+ * Run the operation prepared by sc_pkcs11_prepare_on_key() with 'key'
+ * in 'session', which may belong to another slot than the operation.
+ */
+CK_RV
+sc_pkcs11_run_on_key(sc_pkcs11_operation_t *op, int type,
+		struct sc_pkcs11_session *session, struct sc_pkcs11_object *key,
+		CK_BYTE_PTR pIn, CK_ULONG ulInLen,
+		CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	struct signature_data *data = (struct signature_data *) op->priv_data;
+
+	switch (type) {
+	case SC_PKCS11_OPERATION_SIGN:
+		return key->ops->sign(session, key, &op->mechanism,
+				data->buffer, data->buffer_len, pOut, pulOutLen);
+	case SC_PKCS11_OPERATION_DECRYPT:
+		return key->ops->decrypt(session, key, &op->mechanism,
+				pIn, ulInLen, pOut, pulOutLen);
+	default:
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	}
+}
+
 static CK_RV
 sc_pkcs11_derive(sc_pkcs11_operation_t *operation,
 	    struct sc_pkcs11_object *basekey,
@@ -1187,6 +1728,15 @@ sc_pkcs11_new_fw_mechanism(CK_MECHANISM_TYPE mech,
 		mt->decrypt_init = sc_pkcs11_decrypt_init;
 		mt->decrypt = sc_pkcs11_decrypt;
 	}
+#ifdef ENABLE_OPENSSL
+	if ((pInfo->flags & CKF_ENCRYPT) && key_type == CKK_RSA) {
+		mt->encrypt_init = sc_pkcs11_encrypt_init;
+		mt->encrypt = sc_pkcs11_encrypt;
+	} else if (pInfo->flags & CKF_ENCRYPT) {
+		mt->encrypt_init = sc_pkcs11_encrypt_skey_init;
+		mt->encrypt = sc_pkcs11_encrypt_skey;
+	}
+#endif
 
 	return mt;
 }
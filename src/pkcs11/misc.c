@@ -18,11 +18,17 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS11
+
 #include "config.h"
 
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef ENABLE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
 #include "sc-pkcs11.h"
 
 #define DUMP_TEMPLATE_MAX	32
@@ -180,6 +186,38 @@ CK_RV restore_login_state(struct sc_pkcs11_slot *slot)
 	return r;
 }
 
+/* Same as restore_login_state() before an operation using a key: the
+ * framework may keep the logins it can verify when the card asks for
+ * them, so only the PIN protecting that key is verified, and only if
+ * the card lost its security status */
+CK_RV restore_key_login_state(struct sc_pkcs11_slot *slot)
+{
+	CK_RV r = CKR_OK;
+
+	if (sc_pkcs11_conf.atomic && slot) {
+		if (list_iterator_start(&slot->logins)) {
+			struct sc_pkcs11_login *login = list_iterator_next(&slot->logins);
+			while (login && slot->p11card && slot->p11card->framework) {
+				struct sc_pkcs11_framework_ops *fw = slot->p11card->framework;
+
+				r = CKR_FUNCTION_NOT_SUPPORTED;
+				if (fw->defer_login)
+					r = fw->defer_login(slot, login->userType,
+							login->pPin, login->ulPinLen);
+				if (r == CKR_FUNCTION_NOT_SUPPORTED)
+					r = fw->login(slot, login->userType,
+							login->pPin, login->ulPinLen);
+				if (r != CKR_OK)
+					break;
+				login = list_iterator_next(&slot->logins);
+			}
+			list_iterator_stop(&slot->logins);
+		}
+	}
+
+	return r;
+}
+
 CK_RV reset_login_state(struct sc_pkcs11_slot *slot, CK_RV rv)
 {
 	if (slot) {
@@ -311,6 +349,10 @@ CK_RV session_get_operation(struct sc_pkcs11_session * session, int type, sc_pkc
 	if (!(op = session->operation[type]))
 		return CKR_OPERATION_NOT_INITIALIZED;
 
+	/* another thread is feeding data to this operation */
+	if (op->busy)
+		return CKR_OPERATION_ACTIVE;
+
 	if (operation)
 		*operation = op;
 
@@ -325,10 +367,70 @@ CK_RV session_stop_operation(struct sc_pkcs11_session * session, int type)
 	if (session->operation[type] == NULL)
 		return CKR_OPERATION_NOT_INITIALIZED;
 
+	if (session->operation[type]->busy) {
+		/* the updating thread releases it once it is done */
+		sc_pkcs11_orphan_operation(session->operation[type]);
+		session->operation[type] = NULL;
+		return CKR_OK;
+	}
+
 	sc_pkcs11_release_operation(&session->operation[type]);
 	return CKR_OK;
 }
 
+/* Get a zeroed block of the given size, reusing one the session has
+ * kept from a finished operation when possible */
+void *session_pool_alloc(struct sc_pkcs11_session *session, size_t size)
+{
+	struct sc_pkcs11_pool *pool = &session->pool;
+	void *p;
+	int i;
+
+	for (i = 0; i < SC_PKCS11_POOL_BLOCKS; i++) {
+		if (pool->block[i] != NULL && pool->size[i] == size) {
+			p = pool->block[i];
+			pool->block[i] = NULL;
+			memset(p, 0, size);
+			return p;
+		}
+	}
+	return calloc(1, size);
+}
+
+/* Give back a block obtained with session_pool_alloc() */
+void session_pool_free(struct sc_pkcs11_session *session, void *p, size_t size)
+{
+	struct sc_pkcs11_pool *pool = &session->pool;
+	int i;
+
+	if (p == NULL)
+		return;
+	sc_mem_clear(p, size);
+	for (i = 0; i < SC_PKCS11_POOL_BLOCKS; i++) {
+		if (pool->block[i] == NULL) {
+			pool->block[i] = p;
+			pool->size[i] = size;
+			return;
+		}
+	}
+	free(p);
+}
+
+void session_pool_clear(struct sc_pkcs11_session *session)
+{
+	struct sc_pkcs11_pool *pool = &session->pool;
+	int i;
+
+	for (i = 0; i < SC_PKCS11_POOL_BLOCKS; i++) {
+		free(pool->block[i]);
+		pool->block[i] = NULL;
+	}
+#ifdef ENABLE_OPENSSL
+	EVP_MD_CTX_destroy(pool->md_ctx);
+#endif
+	pool->md_ctx = NULL;
+}
+
 CK_RV attr_extract(CK_ATTRIBUTE_PTR pAttr, void *ptr, size_t * sizep)
 {
 	size_t size;
@@ -484,6 +586,21 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	conf->pin_unblock_style = SC_PKCS11_PIN_UNBLOCK_NOT_ALLOWED;
 	conf->create_puk_slot = 0;
 	conf->create_slots_flags = SC_PKCS11_SLOT_CREATE_ALL;
+	conf->per_slot_locking = 0;
+	conf->fair_slot_locking = 0;
+	conf->token_pool = 0;
+	conf->slot_event_thread = 0;
+	conf->async_token_binding = 0;
+	conf->async_token_removal = 0;
+	conf->parallel_card_detection = 0;
+	conf->lazy_card_detection = 0;
+	conf->lazy_app_binding = 0;
+	conf->keep_tokens_after_fork = 0;
+	conf->random_drbg = 0;
+	conf->random_reseed_interval = 65536;
+	conf->idle_token_timeout = 0;
+	conf->token_snapshots = 0;
+	conf->fast_first_signature = 0;
 
 	conf_block = sc_get_conf_block(ctx, "pkcs11", NULL, 1);
 	if (!conf_block)
@@ -497,6 +614,27 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 		conf->lock_login = 1;
 	conf->lock_login = scconf_get_bool(conf_block, "lock_login", conf->lock_login);
 	conf->init_sloppy = scconf_get_bool(conf_block, "init_sloppy", conf->init_sloppy);
+	conf->per_slot_locking = scconf_get_bool(conf_block, "per_slot_locking", conf->per_slot_locking);
+#ifdef HAVE_PTHREAD
+	/* the card queue cannot block without pthreads */
+	conf->fair_slot_locking = scconf_get_bool(conf_block, "fair_slot_locking", conf->fair_slot_locking);
+#endif
+	conf->token_pool = scconf_get_bool(conf_block, "token_pool", conf->token_pool);
+	conf->slot_event_thread = scconf_get_bool(conf_block, "slot_event_thread", conf->slot_event_thread);
+	conf->async_token_binding = scconf_get_bool(conf_block, "async_token_binding", conf->async_token_binding);
+	conf->async_token_removal = scconf_get_bool(conf_block, "async_token_removal", conf->async_token_removal);
+	conf->parallel_card_detection = scconf_get_bool(conf_block, "parallel_card_detection", conf->parallel_card_detection);
+	conf->lazy_card_detection = scconf_get_bool(conf_block, "lazy_card_detection", conf->lazy_card_detection);
+	conf->fast_first_signature = scconf_get_bool(conf_block, "fast_first_signature", conf->fast_first_signature);
+	/* only the application of the slot in use is bound */
+	if (conf->fast_first_signature)
+		conf->lazy_app_binding = 1;
+	conf->lazy_app_binding = scconf_get_bool(conf_block, "lazy_app_binding", conf->lazy_app_binding);
+	conf->keep_tokens_after_fork = scconf_get_bool(conf_block, "keep_tokens_after_fork", conf->keep_tokens_after_fork);
+	conf->random_drbg = scconf_get_bool(conf_block, "random_drbg", conf->random_drbg);
+	conf->random_reseed_interval = scconf_get_int(conf_block, "random_reseed_interval", conf->random_reseed_interval);
+	conf->idle_token_timeout = scconf_get_int(conf_block, "idle_token_timeout", conf->idle_token_timeout);
+	conf->token_snapshots = scconf_get_bool(conf_block, "token_snapshots", conf->token_snapshots);
 
 	unblock_style = (char *)scconf_get_str(conf_block, "user_pin_unblock_style", NULL);
 	if (unblock_style && !strcmp(unblock_style, "set_pin_in_unlogged_session"))
@@ -525,8 +663,18 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 
 	sc_log(ctx, "PKCS#11 options: max_virtual_slots=%d slots_per_card=%d "
 		 "lock_login=%d atomic=%d pin_unblock_style=%d "
-		 "create_slots_flags=0x%X",
+		 "create_slots_flags=0x%X per_slot_locking=%d fair_slot_locking=%d "
+		 "token_pool=%d slot_event_thread=%d "
+		 "async_token_binding=%d async_token_removal=%d parallel_card_detection=%d "
+		 "lazy_card_detection=%d lazy_app_binding=%d keep_tokens_after_fork=%d "
+		 "random_drbg=%d random_reseed_interval=%u idle_token_timeout=%u token_snapshots=%d "
+		 "fast_first_signature=%d",
 		 conf->max_virtual_slots, conf->slots_per_card,
 		 conf->lock_login, conf->atomic, conf->pin_unblock_style,
-		 conf->create_slots_flags);
+		 conf->create_slots_flags, conf->per_slot_locking,
+		 conf->fair_slot_locking, conf->token_pool, conf->slot_event_thread, conf->async_token_binding,
+		 conf->async_token_removal, conf->parallel_card_detection, conf->lazy_card_detection, conf->lazy_app_binding,
+		 conf->keep_tokens_after_fork, conf->random_drbg,
+		 conf->random_reseed_interval, conf->idle_token_timeout, conf->token_snapshots,
+		 conf->fast_first_signature);
 }
@@ -19,14 +19,21 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS11
+
 #include "config.h"
 
 #ifdef ENABLE_OPENSSL		/* empty file without openssl */
 #include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 #include <openssl/bn.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <openssl/rsa.h>
+#include <openssl/sha.h>
 #include <openssl/opensslv.h>
 #include <openssl/x509.h>
 #include <openssl/conf.h>
@@ -41,6 +48,7 @@
 #include <openssl/asn1.h>
 #include <openssl/crypto.h>
 
+#include "libopensc/internal.h"
 #include "sc-pkcs11.h"
 
 static CK_RV	sc_pkcs11_openssl_md_init(sc_pkcs11_operation_t *);
@@ -61,6 +69,7 @@ static sc_pkcs11_mechanism_type_t openssl_sha1_mech = {
 	sc_pkcs11_openssl_md_final,
 	NULL, NULL, NULL, NULL,	/* sign_* */
 	NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL,		/* encrypt_* */
 	NULL, NULL,		/* decrypt_* */
 	NULL,			/* derive */
 	NULL,			/* wrap */
@@ -80,6 +89,7 @@ static sc_pkcs11_mechanism_type_t openssl_sha224_mech = {
 	sc_pkcs11_openssl_md_final,
 	NULL, NULL, NULL, NULL,	/* sign_* */
 	NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL,		/* encrypt_* */
 	NULL, NULL,		/* decrypt_* */
 	NULL,			/* derive */
 	NULL,			/* wrap */
@@ -99,6 +109,7 @@ static sc_pkcs11_mechanism_type_t openssl_sha256_mech = {
 	sc_pkcs11_openssl_md_final,
 	NULL, NULL, NULL, NULL,	/* sign_* */
 	NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL,		/* encrypt_* */
 	NULL, NULL,		/* decrypt_* */
 	NULL,			/* derive */
 	NULL,			/* wrap */
@@ -118,6 +129,7 @@ static sc_pkcs11_mechanism_type_t openssl_sha384_mech = {
 	sc_pkcs11_openssl_md_final,
 	NULL, NULL, NULL, NULL,	/* sign_* */
 	NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL,		/* encrypt_* */
 	NULL, NULL,		/* decrypt_* */
 	NULL,			/* derive */
 	NULL,			/* wrap */
@@ -137,6 +149,7 @@ static sc_pkcs11_mechanism_type_t openssl_sha512_mech = {
 	sc_pkcs11_openssl_md_final,
 	NULL, NULL, NULL, NULL,	/* sign_* */
 	NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL,		/* encrypt_* */
 	NULL, NULL,		/* decrypt_* */
 	NULL,			/* derive */
 	NULL,			/* wrap */
@@ -156,6 +169,7 @@ static sc_pkcs11_mechanism_type_t openssl_gostr3411_mech = {
 	sc_pkcs11_openssl_md_final,
 	NULL, NULL, NULL, NULL,	/* sign_* */
 	NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL,		/* encrypt_* */
 	NULL, NULL,		/* decrypt_* */
 	NULL,			/* derive */
 	NULL,			/* wrap */
@@ -175,6 +189,7 @@ static sc_pkcs11_mechanism_type_t openssl_md5_mech = {
 	sc_pkcs11_openssl_md_final,
 	NULL, NULL, NULL, NULL,	/* sign_* */
 	NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL,		/* encrypt_* */
 	NULL, NULL,		/* decrypt_* */
 	NULL,			/* derive */
 	NULL,			/* wrap */
@@ -194,6 +209,7 @@ static sc_pkcs11_mechanism_type_t openssl_ripemd160_mech = {
 	sc_pkcs11_openssl_md_final,
 	NULL, NULL, NULL, NULL,	/* sign_* */
 	NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL,		/* encrypt_* */
 	NULL, NULL,		/* decrypt_* */
 	NULL,			/* derive */
 	NULL,			/* wrap */
@@ -259,19 +275,19 @@ sc_pkcs11_register_openssl_mechanisms(struct sc_pkcs11_card *p11card)
 #endif
 #endif /* !defined(OPENSSL_NO_ENGINE) */
 
-	openssl_sha1_mech.mech_data = EVP_sha1();
+	openssl_sha1_mech.mech_data = sc_evp_md(context, "SHA1");
 	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_sha1_mech, sizeof openssl_sha1_mech));
-	openssl_sha224_mech.mech_data = EVP_sha224();
+	openssl_sha224_mech.mech_data = sc_evp_md(context, "SHA224");
 	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_sha224_mech, sizeof openssl_sha224_mech));
-	openssl_sha256_mech.mech_data = EVP_sha256();
+	openssl_sha256_mech.mech_data = sc_evp_md(context, "SHA256");
 	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_sha256_mech, sizeof openssl_sha256_mech));
-	openssl_sha384_mech.mech_data = EVP_sha384();
+	openssl_sha384_mech.mech_data = sc_evp_md(context, "SHA384");
 	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_sha384_mech, sizeof openssl_sha384_mech));
-	openssl_sha512_mech.mech_data = EVP_sha512();
+	openssl_sha512_mech.mech_data = sc_evp_md(context, "SHA512");
 	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_sha512_mech, sizeof openssl_sha512_mech));
-	openssl_md5_mech.mech_data = EVP_md5();
+	openssl_md5_mech.mech_data = sc_evp_md(context, "MD5");
 	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_md5_mech, sizeof openssl_md5_mech));
-	openssl_ripemd160_mech.mech_data = EVP_ripemd160();
+	openssl_ripemd160_mech.mech_data = sc_evp_md(context, "RIPEMD160");
 	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_ripemd160_mech, sizeof openssl_ripemd160_mech));
 	openssl_gostr3411_mech.mech_data = EVP_get_digestbynid(NID_id_GostR3411_94);
 	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_gostr3411_mech, sizeof openssl_gostr3411_mech));
@@ -293,9 +309,14 @@ static CK_RV sc_pkcs11_openssl_md_init(sc_pkcs11_operation_t *op)
 	if (!op || !(mt = op->type) || !(md = (EVP_MD *) mt->mech_data))
 		return CKR_ARGUMENTS_BAD;
 
-	if (!(md_ctx = EVP_MD_CTX_create()))
+	/* reuse the context of the last digest of the session */
+	if (op->session && op->session->pool.md_ctx) {
+		md_ctx = op->session->pool.md_ctx;
+		op->session->pool.md_ctx = NULL;
+	} else if (!(md_ctx = EVP_MD_CTX_create())) {
 		return CKR_HOST_MEMORY;
-	if (!EVP_DigestInit(md_ctx, md)) {
+	}
+	if (!EVP_DigestInit_ex(md_ctx, md, NULL)) {
 		EVP_MD_CTX_destroy(md_ctx);
 		return CKR_GENERAL_ERROR;
 	}
@@ -337,7 +358,10 @@ static void sc_pkcs11_openssl_md_release(sc_pkcs11_operation_t *op)
 {
 	if (op) {
 		EVP_MD_CTX	*md_ctx = DIGEST_CTX(op);
-		if (md_ctx)
+		if (md_ctx && op->session && !op->orphaned
+				&& op->session->pool.md_ctx == NULL)
+			op->session->pool.md_ctx = md_ctx;
+		else if (md_ctx)
 			EVP_MD_CTX_destroy(md_ctx);
 		op->priv_data = NULL;
 	}
@@ -434,7 +458,123 @@ static CK_RV gostr3410_verify_data(const unsigned char *pubkey, unsigned int pub
  * If a hash function was used, we can make a big shortcut by
  *   finishing with EVP_VerifyFinal().
  */
-CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, unsigned int pubkey_len,
+void sc_pkcs11_free_verify_key(void *key)
+{
+	EVP_PKEY_free(key);
+}
+
+/*
+ * Parse the SubjectPublicKeyInfo of a key object for host-side operations
+ * and keep it in key_cache (see sc_pkcs11_object.verify_key).
+ */
+CK_RV sc_pkcs11_parse_public_key(void **key_cache,
+			const unsigned char *pubkey, unsigned int pubkey_len)
+{
+	const unsigned char *pubkey_tmp = pubkey;
+	EVP_PKEY *pkey;
+
+	if (*key_cache != NULL)
+		return CKR_OK;
+	if (pubkey == NULL)
+		return CKR_ARGUMENTS_BAD;
+
+	pkey = d2i_PUBKEY(NULL, &pubkey_tmp, pubkey_len);
+	if (pkey == NULL)
+		return CKR_GENERAL_ERROR;
+	*key_cache = pkey;
+	return CKR_OK;
+}
+
+/*
+ * Encrypt with a public RSA key parsed by sc_pkcs11_parse_public_key().
+ * With out == NULL only the size of the cryptogram is returned.
+ */
+CK_RV sc_pkcs11_encrypt_data(void *key, CK_MECHANISM_PTR mech,
+			unsigned char *data, unsigned int data_len,
+			unsigned char *out, CK_ULONG_PTR out_len)
+{
+	CK_RSA_PKCS_OAEP_PARAMS *oaep;
+	unsigned char *raw = NULL;
+	unsigned int overhead;
+	RSA *rsa;
+	CK_ULONG size;
+	int pad, r;
+
+	switch (mech->mechanism) {
+	case CKM_RSA_PKCS:
+		pad = RSA_PKCS1_PADDING;
+		overhead = 11;
+		break;
+	case CKM_RSA_X_509:
+		pad = RSA_NO_PADDING;
+		overhead = 0;
+		break;
+	case CKM_RSA_PKCS_OAEP:
+		/* RSA_public_encrypt() only does OAEP with SHA-1 */
+		oaep = (CK_RSA_PKCS_OAEP_PARAMS *) mech->pParameter;
+		if (oaep == NULL || oaep->hashAlg != CKM_SHA_1
+				|| oaep->mgf != CKG_MGF1_SHA1
+				|| oaep->ulSourceDataLen != 0)
+			return CKR_MECHANISM_PARAM_INVALID;
+		pad = RSA_PKCS1_OAEP_PADDING;
+		overhead = 2 * SHA_DIGEST_LENGTH + 2;
+		break;
+	default:
+		return CKR_MECHANISM_INVALID;
+	}
+
+	if (key == NULL || out_len == NULL)
+		return CKR_ARGUMENTS_BAD;
+	rsa = EVP_PKEY_get1_RSA((EVP_PKEY *) key);
+	if (rsa == NULL)
+		return CKR_KEY_TYPE_INCONSISTENT;
+
+	size = RSA_size(rsa);
+	if (out == NULL) {
+		*out_len = size;
+		RSA_free(rsa);
+		return CKR_OK;
+	}
+	if (*out_len < size) {
+		*out_len = size;
+		RSA_free(rsa);
+		return CKR_BUFFER_TOO_SMALL;
+	}
+	if (data_len + overhead > size) {
+		RSA_free(rsa);
+		return CKR_DATA_LEN_RANGE;
+	}
+
+	/* raw RSA takes shorter input as a big-endian number */
+	if (pad == RSA_NO_PADDING && data_len < size) {
+		raw = calloc(1, size);
+		if (raw == NULL) {
+			RSA_free(rsa);
+			return CKR_HOST_MEMORY;
+		}
+		memcpy(raw + size - data_len, data, data_len);
+		data = raw;
+		data_len = (unsigned int) size;
+	}
+
+	r = RSA_public_encrypt(data_len, data, out, rsa, pad);
+	RSA_free(rsa);
+	free(raw);
+	if (r <= 0) {
+		sc_log(context, "RSA_public_encrypt() returned %d", r);
+		return CKR_GENERAL_ERROR;
+	}
+	*out_len = r;
+	return CKR_OK;
+}
+
+/*
+ * If key_cache is given and holds a key, pubkey is not used (and may be
+ * NULL). Otherwise the key parsed from pubkey is stored there for the next
+ * verification with the same object.
+ */
+CK_RV sc_pkcs11_verify_data(void **key_cache,
+			const unsigned char *pubkey, unsigned int pubkey_len,
 			const unsigned char *pubkey_params, unsigned int pubkey_params_len,
 			CK_MECHANISM_PTR mech, sc_pkcs11_operation_t *md,
 			unsigned char *data, unsigned int data_len,
@@ -442,7 +582,7 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, unsigned int pubkey_len
 {
 	int res;
 	CK_RV rv = CKR_GENERAL_ERROR;
-	EVP_PKEY *pkey = NULL;
+	EVP_PKEY *pkey = NULL, *own_pkey = NULL;
 	const unsigned char *pubkey_tmp = NULL;
 
 	if (mech->mechanism == CKM_GOSTR3410)
@@ -463,11 +603,21 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, unsigned int pubkey_len
 	 * And we need to support more then just RSA.
 	 * We can use d2i_PUBKEY which works for SPKI and any key type. 
 	 */
-	pubkey_tmp = pubkey; /* pass in so pubkey pointer is not modified */
+	if (key_cache != NULL && *key_cache != NULL) {
+		pkey = *key_cache;
+	} else {
+		if (pubkey == NULL)
+			return CKR_ARGUMENTS_BAD;
+		pubkey_tmp = pubkey; /* pass in so pubkey pointer is not modified */
 
-	pkey = d2i_PUBKEY(NULL, &pubkey_tmp, pubkey_len);
-	if (pkey == NULL)
-		return CKR_GENERAL_ERROR;
+		pkey = d2i_PUBKEY(NULL, &pubkey_tmp, pubkey_len);
+		if (pkey == NULL)
+			return CKR_GENERAL_ERROR;
+		if (key_cache != NULL)
+			*key_cache = pkey;
+		else
+			own_pkey = pkey;
+	}
 
 	if (md != NULL && (mech->mechanism == CKM_SHA1_RSA_PKCS
 		|| mech->mechanism == CKM_MD5_RSA_PKCS
@@ -487,7 +637,7 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, unsigned int pubkey_len
 		} else {
 			res = -1;
 		}
-		EVP_PKEY_free(pkey);
+		EVP_PKEY_free(own_pkey);
 		if (res == 1)
 			return CKR_OK;
 		else if (res == 0) {
@@ -521,12 +671,12 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, unsigned int pubkey_len
 			pad = RSA_NO_PADDING;
 			break;
 		default:
-			EVP_PKEY_free(pkey);
+			EVP_PKEY_free(own_pkey);
 			return CKR_ARGUMENTS_BAD;
 		}
 
 		rsa = EVP_PKEY_get1_RSA(pkey);
-		EVP_PKEY_free(pkey);
+		EVP_PKEY_free(own_pkey);
 		if (rsa == NULL)
 			return CKR_DEVICE_MEMORY;
 
@@ -567,19 +717,19 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, unsigned int pubkey_len
 			param = (CK_RSA_PKCS_PSS_PARAMS*)mech->pParameter;
 			switch (param->mgf) {
 			case CKG_MGF1_SHA1:
-				mgf_md = EVP_sha1();
+				mgf_md = sc_evp_md(context, "SHA1");
 				break;
 			case CKG_MGF1_SHA224:
-				mgf_md = EVP_sha224();
+				mgf_md = sc_evp_md(context, "SHA224");
 				break;
 			case CKG_MGF1_SHA256:
-				mgf_md = EVP_sha256();
+				mgf_md = sc_evp_md(context, "SHA256");
 				break;
 			case CKG_MGF1_SHA384:
-				mgf_md = EVP_sha384();
+				mgf_md = sc_evp_md(context, "SHA384");
 				break;
 			case CKG_MGF1_SHA512:
-				mgf_md = EVP_sha512();
+				mgf_md = sc_evp_md(context, "SHA512");
 				break;
 			default:
 				RSA_free(rsa);
@@ -589,19 +739,19 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, unsigned int pubkey_len
 
 			switch (param->hashAlg) {
 			case CKM_SHA_1:
-				pss_md = EVP_sha1();
+				pss_md = sc_evp_md(context, "SHA1");
 				break;
 			case CKM_SHA224:
-				pss_md = EVP_sha224();
+				pss_md = sc_evp_md(context, "SHA224");
 				break;
 			case CKM_SHA256:
-				pss_md = EVP_sha256();
+				pss_md = sc_evp_md(context, "SHA256");
 				break;
 			case CKM_SHA384:
-				pss_md = EVP_sha384();
+				pss_md = sc_evp_md(context, "SHA384");
 				break;
 			case CKM_SHA512:
-				pss_md = EVP_sha512();
+				pss_md = sc_evp_md(context, "SHA512");
 				break;
 			default:
 				RSA_free(rsa);
@@ -609,6 +759,12 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, unsigned int pubkey_len
 				return CKR_MECHANISM_PARAM_INVALID;
 			}
 
+			if (mgf_md == NULL || pss_md == NULL) {
+				RSA_free(rsa);
+				free(rsa_out);
+				return CKR_MECHANISM_INVALID;
+			}
+
 			/* for the mechanisms with hash algorithm, the data
 			 * is already added to the hash buffer, so we need
 			 * to finish the hash operation here
@@ -648,4 +804,149 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, unsigned int pubkey_len
 
 	return rv;
 }
+
+/*
+ * HMAC_DRBG with SHA-256 (NIST SP 800-90A) for C_GenerateRandom, see
+ * random_drbg in opensc.conf. It is seeded with GET CHALLENGE from the card
+ * and the host's generator, and reseeded from both after reseed_interval
+ * bytes and in a child process after fork().
+ */
+#define DRBG_LEN		SHA256_DIGEST_LENGTH
+#define DRBG_CARD_SEED_LEN	48	/* entropy and nonce */
+#define DRBG_MAX_INPUT		(DRBG_CARD_SEED_LEN + DRBG_LEN)
+#define DRBG_MAX_REQUEST	65536	/* at most 2^19 bits per request */
+
+struct sc_pkcs11_drbg {
+	unsigned char key[DRBG_LEN];
+	unsigned char v[DRBG_LEN];
+	unsigned long served;
+#ifndef _WIN32
+	pid_t pid;
+#endif
+};
+
+static int drbg_hmac(const unsigned char *key, const unsigned char *in, size_t in_len,
+		unsigned char *out)
+{
+	unsigned char md[DRBG_LEN];
+	unsigned int md_len = sizeof(md);
+
+	if (HMAC(EVP_sha256(), key, DRBG_LEN, in, in_len, md, &md_len) == NULL
+			|| md_len != DRBG_LEN)
+		return 0;
+	memcpy(out, md, DRBG_LEN);
+	OPENSSL_cleanse(md, sizeof(md));
+	return 1;
+}
+
+static int drbg_update(struct sc_pkcs11_drbg *drbg, const unsigned char *data, size_t data_len)
+{
+	unsigned char buf[DRBG_LEN + 1 + DRBG_MAX_INPUT];
+	int r = 1;
+	unsigned char round;
+
+	if (data_len > DRBG_MAX_INPUT)
+		return 0;
+	for (round = 0; r && round < 2; round++) {
+		memcpy(buf, drbg->v, DRBG_LEN);
+		buf[DRBG_LEN] = round;
+		if (data_len)
+			memcpy(buf + DRBG_LEN + 1, data, data_len);
+		r = drbg_hmac(drbg->key, buf, DRBG_LEN + 1 + data_len, drbg->key)
+			&& drbg_hmac(drbg->key, drbg->v, DRBG_LEN, drbg->v);
+		if (data_len == 0)
+			break;
+	}
+	OPENSSL_cleanse(buf, sizeof(buf));
+	return r;
+}
+
+static CK_RV drbg_seed(struct sc_pkcs11_drbg *drbg, struct sc_card *card, int reseed)
+{
+	unsigned char seed[DRBG_MAX_INPUT];
+	size_t seed_len = DRBG_CARD_SEED_LEN;
+	int rc;
+
+	rc = sc_get_challenge(card, seed, DRBG_CARD_SEED_LEN);
+	if (rc < 0)
+		return sc_to_cryptoki_error(rc, "C_GenerateRandom");
+	/* The output is never weaker than the card's generator */
+	if (RAND_bytes(seed + DRBG_CARD_SEED_LEN, DRBG_LEN) == 1)
+		seed_len += DRBG_LEN;
+
+	if (!reseed) {
+		memset(drbg->key, 0x00, DRBG_LEN);
+		memset(drbg->v, 0x01, DRBG_LEN);
+	}
+	rc = drbg_update(drbg, seed, seed_len);
+	OPENSSL_cleanse(seed, sizeof(seed));
+	if (!rc)
+		return CKR_GENERAL_ERROR;
+
+	drbg->served = 0;
+#ifndef _WIN32
+	drbg->pid = getpid();
+#endif
+	sc_log(card->ctx, "DRBG %s from the card", reseed ? "reseeded" : "seeded");
+	return CKR_OK;
+}
+
+/*
+ * Fill out with len bytes from the DRBG kept in drbg_cache, seeding it from
+ * card first if needed. The caller holds the lock of the card.
+ */
+CK_RV sc_pkcs11_drbg_generate(void **drbg_cache, struct sc_card *card,
+			unsigned long reseed_interval, CK_BYTE_PTR out, CK_ULONG len)
+{
+	struct sc_pkcs11_drbg *drbg = *drbg_cache;
+	CK_RV rv;
+
+	if (drbg == NULL) {
+		drbg = calloc(1, sizeof(*drbg));
+		if (drbg == NULL)
+			return CKR_HOST_MEMORY;
+		rv = drbg_seed(drbg, card, 0);
+		if (rv != CKR_OK) {
+			sc_pkcs11_drbg_free(drbg);
+			return rv;
+		}
+		*drbg_cache = drbg;
+	}
+
+	while (len > 0) {
+		CK_ULONG chunk = len < DRBG_MAX_REQUEST ? len : DRBG_MAX_REQUEST;
+		CK_ULONG i;
+
+		if (drbg->served >= reseed_interval
+#ifndef _WIN32
+				|| drbg->pid != getpid()
+#endif
+				) {
+			rv = drbg_seed(drbg, card, 1);
+			if (rv != CKR_OK)
+				return rv;
+		}
+
+		for (i = 0; i < chunk; i += DRBG_LEN) {
+			if (!drbg_hmac(drbg->key, drbg->v, DRBG_LEN, drbg->v))
+				return CKR_GENERAL_ERROR;
+			memcpy(out + i, drbg->v, chunk - i < DRBG_LEN ? chunk - i : DRBG_LEN);
+		}
+		if (!drbg_update(drbg, NULL, 0))
+			return CKR_GENERAL_ERROR;
+
+		drbg->served += chunk;
+		out += chunk;
+		len -= chunk;
+	}
+	return CKR_OK;
+}
+
+void sc_pkcs11_drbg_free(void *drbg)
+{
+	if (drbg == NULL)
+		return;
+	OPENSSL_cleanse(drbg, sizeof(struct sc_pkcs11_drbg));
+	free(drbg);
+}
 #endif
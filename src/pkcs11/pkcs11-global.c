@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS11
+
 #include "config.h"
 
 #include <stdlib.h>
@@ -54,7 +56,10 @@ list_t virtual_slots;
 pid_t initialized_pid = (pid_t)-1;
 #endif
 static int in_finalize = 0;
+/* set by C_Initialize() with lazy_card_detection, see card_detect_deferred() */
+static int card_detection_deferred = 0;
 extern CK_FUNCTION_LIST pkcs11_function_list;
+extern CK_FUNCTION_LIST_3_0 pkcs11_function_list_3_0;
 
 #ifdef PKCS11_THREAD_LOCKING
 
@@ -239,6 +244,137 @@ int module_close()
 	return 1;
 }
 
+#if defined(PKCS11_THREAD_LOCKING) && defined(HAVE_PTHREAD)
+#define HAVE_EVENT_THREAD
+/*
+ * Optional background thread that keeps the slot states up to date from
+ * sc_wait_for_event(). C_WaitForSlotEvent() then only sleeps on a
+ * condition variable and the slot functions can skip their own polling.
+ */
+static pthread_t event_thread;
+static pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+static int event_thread_running = 0;
+static unsigned long event_generation = 0;
+static pid_t event_thread_pid = (pid_t)-1;
+
+/* timeout of a single wait, so that C_Finalize() joins in bounded time */
+#define EVENT_THREAD_TIMEOUT 500
+
+static void *event_thread_main(void *arg)
+{
+	unsigned int mask = SC_EVENT_CARD_EVENTS | SC_EVENT_READER_EVENTS;
+	unsigned int events;
+	sc_reader_t *found;
+	void *reader_states = NULL;
+	int r;
+
+	(void)arg;
+	while (!in_finalize) {
+		r = sc_wait_for_event(context, mask, &found, &events,
+				EVENT_THREAD_TIMEOUT, &reader_states);
+		if (in_finalize)
+			break;
+		if (r == SC_ERROR_EVENT_TIMEOUT)
+			continue;
+		if (r != SC_SUCCESS) {
+			sc_log(context, "event thread: sc_wait_for_event() returned %d", r);
+			break;
+		}
+
+		if (sc_pkcs11_lock() != CKR_OK)
+			break;
+		if (!in_finalize)
+			card_detect_all();
+		sc_pkcs11_unlock();
+
+		pthread_mutex_lock(&event_mutex);
+		event_generation++;
+		pthread_cond_broadcast(&event_cond);
+		pthread_mutex_unlock(&event_mutex);
+	}
+
+	if (reader_states)
+		sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
+
+	pthread_mutex_lock(&event_mutex);
+	event_thread_running = 0;
+	pthread_cond_broadcast(&event_cond);
+	pthread_mutex_unlock(&event_mutex);
+	return NULL;
+}
+
+static int event_thread_active(void)
+{
+	int running;
+
+	pthread_mutex_lock(&event_mutex);
+	running = event_thread_running && event_thread_pid == getpid();
+	pthread_mutex_unlock(&event_mutex);
+	return running;
+}
+
+static void event_thread_start(void)
+{
+	if (!sc_pkcs11_conf.slot_event_thread || !global_lock)
+		return;
+
+	pthread_mutex_lock(&event_mutex);
+	event_thread_running = 1;
+	event_thread_pid = getpid();
+	if (pthread_create(&event_thread, NULL, event_thread_main, NULL) != 0) {
+		sc_log(context, "Failed to start the slot event thread");
+		event_thread_running = 0;
+		event_thread_pid = (pid_t)-1;
+	}
+	pthread_mutex_unlock(&event_mutex);
+}
+
+/* Called with the global lock held and in_finalize set */
+static void event_thread_stop(void)
+{
+	if (event_thread_pid != getpid())
+		return;
+	event_thread_pid = (pid_t)-1;
+
+	sc_pkcs11_unlock();
+	pthread_join(event_thread, NULL);
+	sc_pkcs11_lock();
+}
+
+/* Called with the global lock held; returns with the global lock held
+ * unless CKR_CRYPTOKI_NOT_INITIALIZED is returned */
+static CK_RV event_thread_wait(CK_FLAGS flags, CK_SLOT_ID_PTR slot_id, int mask)
+{
+	unsigned long generation;
+	CK_RV rv;
+
+	while (1) {
+		pthread_mutex_lock(&event_mutex);
+		generation = event_generation;
+		pthread_mutex_unlock(&event_mutex);
+
+		rv = slot_find_event(slot_id, mask);
+		if (rv == CKR_OK || (flags & CKF_DONT_BLOCK))
+			return rv;
+
+		sc_pkcs11_unlock();
+		pthread_mutex_lock(&event_mutex);
+		while (generation == event_generation
+				&& event_thread_running && !in_finalize)
+			pthread_cond_wait(&event_cond, &event_mutex);
+		pthread_mutex_unlock(&event_mutex);
+
+		if (in_finalize == 1)
+			return CKR_CRYPTOKI_NOT_INITIALIZED;
+		if ((rv = sc_pkcs11_lock()) != CKR_OK)
+			return CKR_CRYPTOKI_NOT_INITIALIZED;
+		if (!event_thread_active())
+			return CKR_FUNCTION_FAILED;
+	}
+}
+#endif /* PKCS11_THREAD_LOCKING && HAVE_PTHREAD */
+
 #ifdef _WIN32
 BOOL APIENTRY DllMain( HINSTANCE hinstDLL,
 	DWORD  ul_reason_for_call,
@@ -262,6 +398,59 @@ BOOL APIENTRY DllMain( HINSTANCE hinstDLL,
 }
 #endif
 
+#if !defined(_WIN32)
+/*
+ * With keep_tokens_after_fork, a child of a process which used the module
+ * does not bind its tokens again: only the sessions, which are not
+ * inherited according to PKCS#11, and the locks are dropped, and the
+ * context opens its own PC/SC handles. The module does not register a
+ * pthread_atfork() handler, it could outlive a dlclose() of the module.
+ */
+static CK_RV reinit_after_fork(CK_C_INITIALIZE_ARGS_PTR args)
+{
+	struct sc_pkcs11_session *session;
+	CK_RV rv;
+
+	/* the locks of the parent may be held by threads that do not exist
+	 * here, so they are forgotten instead of destroyed */
+	global_lock = NULL;
+	global_locking = NULL;
+	rv = sc_pkcs11_init_lock(args);
+	if (rv != CKR_OK)
+		return rv;
+
+	if (sc_ctx_reinit_after_fork(context) != SC_SUCCESS)
+		return CKR_FUNCTION_FAILED;
+
+	while ((session = list_fetch(&sessions))) {
+		session_pool_clear(session);
+		sc_mem_free(session);
+	}
+	session_index_free();
+
+	rv = card_reinit_after_fork();
+	if (rv != CKR_OK)
+		return rv;
+
+	sc_log(context, "C_Initialize(): reusing the tokens of the parent process");
+	/* the detection C_Initialize() did in the parent */
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+	if (!card_detection_deferred && !sc_pkcs11_conf.lazy_card_detection)
+		card_detect_all();
+#ifdef HAVE_EVENT_THREAD
+	pthread_mutex_init(&event_mutex, NULL);
+	pthread_cond_init(&event_cond, NULL);
+	event_thread_running = 0;
+	if (!card_detection_deferred)
+		event_thread_start();
+#endif
+	sc_pkcs11_unlock();
+	return CKR_OK;
+}
+#endif
+
 CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 {
 	CK_RV rv;
@@ -271,9 +460,15 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 	int rc;
 	sc_context_param_t ctx_opts;
 
+	SC_PROBE1(pkcs11_call, __func__);
 #if !defined(_WIN32)
 	/* Handle fork() exception */
 	if (current_pid != initialized_pid) {
+		if (context && sc_pkcs11_conf.keep_tokens_after_fork
+				&& reinit_after_fork((CK_C_INITIALIZE_ARGS_PTR) pInitArgs) == CKR_OK) {
+			initialized_pid = current_pid;
+			return CKR_OK;
+		}
 		if (context)
 			context->flags |= SC_CTX_FLAG_TERMINATE;
 		C_Finalize(NULL_PTR);
@@ -296,6 +491,8 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 	ctx_opts.ver        = 0;
 	ctx_opts.app_name   = MODULE_APP_NAME;
 	ctx_opts.thread_ctx = &sc_thread_ctx;
+	/* readers are detected below, unless that is deferred */
+	ctx_opts.flags      = SC_CTX_FLAG_DEFER_READER_DETECTION;
 
 	rc = sc_context_create(&context, &ctx_opts);
 	if (rc != SC_SUCCESS) {
@@ -305,6 +502,12 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 
 	/* Load configuration */
 	load_pkcs11_parameters(&sc_pkcs11_conf, context);
+	/* the binding and reclaiming threads need the global lock */
+	if (!global_lock) {
+		sc_pkcs11_conf.async_token_binding = 0;
+		sc_pkcs11_conf.async_token_removal = 0;
+		sc_pkcs11_conf.parallel_card_detection = 0;
+	}
 
 	/* List of sessions */
 	if (0 != list_init(&sessions)) {
@@ -320,7 +523,14 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 	}
 	list_attributes_seeker(&virtual_slots, slot_list_seeker);
 
-	card_detect_all();
+	/* card_detect_all() expects the lock like from any other caller */
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		goto out;
+	card_detection_deferred = 1;
+	if (!sc_pkcs11_conf.lazy_card_detection)
+		card_detect_deferred();
+	sc_pkcs11_unlock();
 
 out:
 	if (context != NULL)
@@ -338,6 +548,25 @@ out:
 	return rv;
 }
 
+/* Detects the readers and cards, and starts the event thread, if this has
+ * not been done yet. With lazy_card_detection, C_Initialize() leaves this
+ * to the first call that needs the slots, so that loading the module does
+ * not touch PC/SC. Called with the global lock held, returns 1 if the
+ * detection ran. */
+int card_detect_deferred(void)
+{
+	if (!card_detection_deferred)
+		return 0;
+	card_detection_deferred = 0;
+
+	sc_ctx_detect_readers(context);
+	card_detect_all();
+#ifdef HAVE_EVENT_THREAD
+	event_thread_start();
+#endif
+	return 1;
+}
+
 CK_RV C_Finalize(CK_VOID_PTR pReserved)
 {
 	int i;
@@ -345,6 +574,7 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	sc_pkcs11_slot_t *slot;
 	CK_RV rv;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pReserved != NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -364,20 +594,33 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	/* cancel pending calls */
 	in_finalize = 1;
 	sc_cancel(context);
+#ifdef HAVE_EVENT_THREAD
+	pthread_mutex_lock(&event_mutex);
+	pthread_cond_broadcast(&event_cond);
+	pthread_mutex_unlock(&event_mutex);
+	event_thread_stop();
+#endif
+	card_detect_wait_bindings();
 	/* remove all cards from readers */
 	for (i=0; i < (int)sc_ctx_get_reader_count(context); i++)
 		card_removed(sc_ctx_get_reader(context, i));
+	card_reclaim_wait();
 
-	while ((p = list_fetch(&sessions)))
-		free(p);
+	while ((p = list_fetch(&sessions))) {
+		session_pool_clear(p);
+		sc_mem_free(p);
+	}
 	list_destroy(&sessions);
+	session_index_free();
 
 	while ((slot = list_fetch(&virtual_slots))) {
-		list_destroy(&slot->objects);
+		slot_invalidate_index(slot);
+		free(slot->objects);
 		list_destroy(&slot->logins);
 		free(slot);
 	}
 	list_destroy(&virtual_slots);
+	slot_table_free();
 
 	sc_release_context(context);
 	context = NULL;
@@ -392,6 +635,7 @@ CK_RV C_GetInfo(CK_INFO_PTR pInfo)
 {
 	CK_RV rv = CKR_OK;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -419,6 +663,7 @@ CK_RV C_GetInfo(CK_INFO_PTR pInfo)
 
 CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
 {
+	SC_PROBE1(pkcs11_call, __func__);
 	if (ppFunctionList == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -426,6 +671,61 @@ CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
 	return CKR_OK;
 }
 
+/* The interfaces in the order of preference, see C_GetInterface() */
+static CK_INTERFACE pkcs11_interfaces[] = {
+	{ (CK_BYTE *) "PKCS 11", &pkcs11_function_list_3_0, 0 },
+	{ (CK_BYTE *) "PKCS 11", &pkcs11_function_list, 0 }
+};
+#define PKCS11_INTERFACES (sizeof(pkcs11_interfaces) / sizeof(pkcs11_interfaces[0]))
+
+CK_RV C_GetInterfaceList(CK_INTERFACE_PTR pInterfacesList, CK_ULONG_PTR pulCount)
+{
+	SC_PROBE1(pkcs11_call, __func__);
+	if (pulCount == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	if (pInterfacesList == NULL_PTR) {
+		*pulCount = PKCS11_INTERFACES;
+		return CKR_OK;
+	}
+	if (*pulCount < PKCS11_INTERFACES) {
+		*pulCount = PKCS11_INTERFACES;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+
+	memcpy(pInterfacesList, pkcs11_interfaces, sizeof(pkcs11_interfaces));
+	*pulCount = PKCS11_INTERFACES;
+	return CKR_OK;
+}
+
+CK_RV C_GetInterface(CK_UTF8CHAR_PTR pInterfaceName, CK_VERSION_PTR pVersion,
+		CK_INTERFACE_PTR_PTR ppInterface, CK_FLAGS flags)
+{
+	unsigned int i;
+
+	SC_PROBE1(pkcs11_call, __func__);
+	if (ppInterface == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	for (i = 0; i < PKCS11_INTERFACES; i++) {
+		/* every function list starts with its version */
+		CK_VERSION *version = (CK_VERSION *) pkcs11_interfaces[i].pFunctionList;
+
+		if (pInterfaceName != NULL_PTR
+				&& strcmp((char *) pInterfaceName, (char *) pkcs11_interfaces[i].pInterfaceName))
+			continue;
+		if (pVersion != NULL_PTR && (pVersion->major != version->major
+					|| pVersion->minor != version->minor))
+			continue;
+		if ((pkcs11_interfaces[i].flags & flags) != flags)
+			continue;
+		*ppInterface = &pkcs11_interfaces[i];
+		return CKR_OK;
+	}
+
+	return CKR_ARGUMENTS_BAD;
+}
+
 CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token present */
 		    CK_SLOT_ID_PTR pSlotList,     /* receives the array of slot IDs */
 		    CK_ULONG_PTR   pulCount)      /* receives the number of slots */
@@ -437,6 +737,7 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 	sc_reader_t *prev_reader = NULL;
 	CK_RV rv;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pulCount == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -448,13 +749,22 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 			pSlotList==NULL_PTR? "plug-n-play":"refresh");
 	DEBUG_VSS(NULL, "C_GetSlotList before ctx_detect_detect");
 
-	/* Slot list can only change in v2.20 */
-	if (pSlotList == NULL_PTR)
-		sc_ctx_detect_readers(context);
+	if (card_detect_deferred()) {
+		/* first call after a lazy C_Initialize(), everything was detected */
+	} else
+#ifdef HAVE_EVENT_THREAD
+	/* slot states are maintained by the event thread */
+	if (!event_thread_active())
+#endif
+	{
+		/* Slot list can only change in v2.20 */
+		if (pSlotList == NULL_PTR)
+			sc_ctx_detect_readers(context);
 
-	DEBUG_VSS(NULL, "C_GetSlotList after ctx_detect_readers");
+		DEBUG_VSS(NULL, "C_GetSlotList after ctx_detect_readers");
 
-	card_detect_all();
+		card_detect_all();
+	}
 
 	if (list_empty(&virtual_slots)) {
 		sc_log(context, "returned 0 slots\n");
@@ -473,7 +783,7 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 	prev_reader = NULL;
 	numMatches = 0;
 	for (i=0; i<list_size(&virtual_slots); i++) {
-		slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+		slot = virtual_slot_table[i];
 		/* the list of available slots contains:
 		 * - without token(s), at least one empty slot per reader;
 		 * - any slot with token;
@@ -517,7 +827,7 @@ out:
 	return rv;
 }
 
-static sc_timestamp_t get_current_time(void)
+sc_timestamp_t get_current_time(void)
 {
 #if HAVE_GETTIMEOFDAY
 	struct timeval tv;
@@ -550,6 +860,7 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 	sc_timestamp_t now;
 	CK_RV rv;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -559,7 +870,11 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 
 	sc_log(context, "C_GetSlotInfo(0x%lx)", slotID);
 
-	if (sc_pkcs11_conf.init_sloppy) {
+	if (!card_detect_deferred() && sc_pkcs11_conf.init_sloppy
+#ifdef HAVE_EVENT_THREAD
+			&& !event_thread_active()
+#endif
+			) {
 		/* Most likely virtual_slots is empty and has not
 		 * been initialized because the caller has *not* called C_GetSlotList
 		 * before C_GetSlotInfo, as required by PKCS#11.  Initialize
@@ -576,6 +891,11 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 			rv = CKR_TOKEN_NOT_PRESENT;
 		} else {
 			now = get_current_time();
+#ifdef HAVE_EVENT_THREAD
+			/* slot states are maintained by the event thread */
+			if (event_thread_active())
+				slot->slot_state_expires = now + 1000;
+#endif
 			if (now >= slot->slot_state_expires || now == 0) {
 				/* Update slot status */
 				rv = card_detect(slot->reader);
@@ -609,6 +929,7 @@ CK_RV C_GetMechanismList(CK_SLOT_ID slotID,
 	struct sc_pkcs11_slot *slot;
 	CK_RV rv;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pulCount == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -631,6 +952,7 @@ CK_RV C_GetMechanismInfo(CK_SLOT_ID slotID,
 	struct sc_pkcs11_slot *slot;
 	CK_RV rv;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -656,6 +978,7 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 	CK_RV rv;
 	unsigned int i;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	sc_log(context, "C_InitToken(pLabel='%s') called", pLabel);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
@@ -706,6 +1029,7 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 	CK_RV rv;
 	int r;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pReserved != NULL_PTR)
 		return  CKR_ARGUMENTS_BAD;
 
@@ -720,6 +1044,19 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 		return rv;
 
 	mask = SC_EVENT_CARD_EVENTS | SC_EVENT_READER_EVENTS;
+	card_detect_deferred();
+
+#ifdef HAVE_EVENT_THREAD
+	if (event_thread_active()) {
+		rv = event_thread_wait(flags, &slot_id, mask);
+		if (rv == CKR_CRYPTOKI_NOT_INITIALIZED)
+			return rv;
+		if (rv != CKR_FUNCTION_FAILED)
+			goto out;
+		/* the event thread stopped, poll ourselves */
+	}
+#endif
+
 	/* Detect and add new slots for added readers v2.20 */
 
 	rv = slot_find_changed(&slot_id, mask);
@@ -876,6 +1213,95 @@ void sc_pkcs11_free_lock(void)
 	global_locking = NULL;
 }
 
+/*
+ * Per-card locking functions
+ */
+
+CK_RV sc_pkcs11_card_init_lock(struct sc_pkcs11_card *p11card)
+{
+	if (!p11card || p11card->lock)
+		return CKR_OK;
+
+	/* Without locking or a global lock there is nothing to split */
+	if (!sc_pkcs11_conf.per_slot_locking || !global_locking || !global_lock)
+		return CKR_OK;
+
+	return global_locking->CreateMutex(&p11card->lock);
+}
+
+void sc_pkcs11_card_free_lock(struct sc_pkcs11_card *p11card)
+{
+	if (!p11card || !p11card->lock)
+		return;
+
+	if (global_locking)
+		global_locking->DestroyMutex(p11card->lock);
+	p11card->lock = NULL;
+}
+
+void sc_pkcs11_card_lock(struct sc_pkcs11_card *p11card)
+{
+	if (!p11card || !p11card->lock || !global_locking)
+		return;
+
+	while (global_locking->LockMutex(p11card->lock) != CKR_OK)
+		;
+}
+
+void sc_pkcs11_card_unlock(struct sc_pkcs11_card *p11card)
+{
+	if (!p11card || !p11card->lock)
+		return;
+
+	__sc_pkcs11_unlock(p11card->lock);
+}
+
+struct sc_pkcs11_card *sc_pkcs11_lock_slot(struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_card *p11card;
+
+	if (!slot || !slot->p11card)
+		return NULL;
+
+	p11card = slot->p11card;
+	if (sc_pkcs11_conf.idle_token_timeout) {
+		p11card->last_used = get_current_time();
+		p11card->reclaimed = 0;
+	}
+	if (!p11card->lock)
+		return NULL;
+
+	if (sc_pkcs11_conf.fair_slot_locking && p11card->card) {
+		unsigned long ticket;
+
+		/* Line up while holding the global lock, but wait without it.
+		 * card_removed() lines up as well, so it waits for us. */
+		if (sc_queue_take(p11card->card, &ticket) == SC_SUCCESS) {
+			sc_pkcs11_unlock();
+			sc_queue_wait(p11card->card, ticket);
+			sc_pkcs11_card_lock(p11card);
+			return p11card;
+		}
+	}
+	/* Nobody can release the card while we hold the global lock, and
+	 * once we own the card lock card_removed() will wait for us */
+	sc_pkcs11_card_lock(p11card);
+	sc_pkcs11_unlock();
+
+	return p11card;
+}
+
+void sc_pkcs11_unlock_slot(struct sc_pkcs11_card *p11card)
+{
+	if (p11card) {
+		sc_pkcs11_card_unlock(p11card);
+		if (sc_pkcs11_conf.fair_slot_locking && p11card->card)
+			sc_queue_leave(p11card->card);
+	} else {
+		sc_pkcs11_unlock();
+	}
+}
+
 CK_FUNCTION_LIST pkcs11_function_list = {
 	{ 2, 11 }, /* Note: NSS/Firefox ignores this version number and uses C_GetInfo() */
 	C_Initialize,
@@ -947,3 +1373,99 @@ CK_FUNCTION_LIST pkcs11_function_list = {
 	C_CancelFunction,
 	C_WaitForSlotEvent
 };
+
+CK_FUNCTION_LIST_3_0 pkcs11_function_list_3_0 = {
+	{ 3, 0 },
+	C_Initialize,
+	C_Finalize,
+	C_GetInfo,
+	C_GetFunctionList,
+	C_GetSlotList,
+	C_GetSlotInfo,
+	C_GetTokenInfo,
+	C_GetMechanismList,
+	C_GetMechanismInfo,
+	C_InitToken,
+	C_InitPIN,
+	C_SetPIN,
+	C_OpenSession,
+	C_CloseSession,
+	C_CloseAllSessions,
+	C_GetSessionInfo,
+	C_GetOperationState,
+	C_SetOperationState,
+	C_Login,
+	C_Logout,
+	C_CreateObject,
+	C_CopyObject,
+	C_DestroyObject,
+	C_GetObjectSize,
+	C_GetAttributeValue,
+	C_SetAttributeValue,
+	C_FindObjectsInit,
+	C_FindObjects,
+	C_FindObjectsFinal,
+	C_EncryptInit,
+	C_Encrypt,
+	C_EncryptUpdate,
+	C_EncryptFinal,
+	C_DecryptInit,
+	C_Decrypt,
+	C_DecryptUpdate,
+	C_DecryptFinal,
+	C_DigestInit,
+	C_Digest,
+	C_DigestUpdate,
+	C_DigestKey,
+	C_DigestFinal,
+	C_SignInit,
+	C_Sign,
+	C_SignUpdate,
+	C_SignFinal,
+	C_SignRecoverInit,
+	C_SignRecover,
+	C_VerifyInit,
+	C_Verify,
+	C_VerifyUpdate,
+	C_VerifyFinal,
+	C_VerifyRecoverInit,
+	C_VerifyRecover,
+	C_DigestEncryptUpdate,
+	C_DecryptDigestUpdate,
+	C_SignEncryptUpdate,
+	C_DecryptVerifyUpdate,
+	C_GenerateKey,
+	C_GenerateKeyPair,
+	C_WrapKey,
+	C_UnwrapKey,
+	C_DeriveKey,
+	C_SeedRandom,
+	C_GenerateRandom,
+	C_GetFunctionStatus,
+	C_CancelFunction,
+	C_WaitForSlotEvent,
+	C_GetInterfaceList,
+	C_GetInterface,
+	C_LoginUser,
+	C_SessionCancel,
+	C_MessageEncryptInit,
+	C_EncryptMessage,
+	C_EncryptMessageBegin,
+	C_EncryptMessageNext,
+	C_MessageEncryptFinal,
+	C_MessageDecryptInit,
+	C_DecryptMessage,
+	C_DecryptMessageBegin,
+	C_DecryptMessageNext,
+	C_MessageDecryptFinal,
+	C_MessageSignInit,
+	C_SignMessage,
+	C_SignMessageBegin,
+	C_SignMessageNext,
+	C_MessageSignFinal,
+	C_MessageVerifyInit,
+	C_VerifyMessage,
+	C_VerifyMessageBegin,
+	C_VerifyMessageNext,
+	C_MessageVerifyFinal
+};
@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS11
+
 #include "config.h"
 
 #include <stdlib.h>
@@ -44,6 +46,8 @@ static sc_pkcs11_mechanism_type_t find_mechanism = {
 	NULL,		/* verif_init */
 	NULL,		/* verif_update */
 	NULL,		/* verif_final */
+	NULL,		/* encrypt_init */
+	NULL,		/* encrypt */
 	NULL,		/* decrypt_init */
 	NULL,		/* decrypt */
 	NULL,		/* derive */
@@ -62,6 +66,10 @@ sc_find_release(sc_pkcs11_operation_t *operation)
 		free(fop->handles);
 		fop->handles = NULL;
 	}
+	free(fop->pTemplate);
+	fop->pTemplate = NULL;
+	free(fop->order);
+	fop->order = NULL;
 }
 
 
@@ -76,13 +84,163 @@ get_object_from_session(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
 	if (rv != CKR_OK)
 		return rv;
 
-	*object = list_seek(&sess->slot->objects, &hObject);
+	*object = slot_find_object(sess->slot, hObject);
 	if (!*object)
 		return CKR_OBJECT_HANDLE_INVALID;
 	*session = sess;
 	return CKR_OK;
 }
 
+/* Feed data to the host-side digest of a multi-part operation without
+ * holding the module lock, so that hashing a large document does not
+ * block other sessions. Called and returns with the global lock held.
+ * Returns CKR_FUNCTION_NOT_SUPPORTED if the update needs the lock. */
+static CK_RV
+update_digest_unlocked(struct sc_pkcs11_session *session, int type,
+		CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+{
+	sc_pkcs11_operation_t *op, *md;
+	CK_RV (*md_update)(sc_pkcs11_operation_t *, CK_BYTE_PTR, CK_ULONG);
+	CK_RV rv;
+
+	rv = sc_pkcs11_get_update_digest(session, type, &op, &md);
+	if (rv != CKR_OK)
+		return rv;
+
+	/* the mechanism type may go away with the card meanwhile */
+	md_update = md->type->md_update;
+	op->busy = 1;
+	sc_pkcs11_unlock();
+
+	rv = md_update(md, pPart, ulPartLen);
+
+	if (sc_pkcs11_lock() != CKR_OK)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	op->busy = 0;
+
+	/* The session was closed meanwhile, it may be gone */
+	if (op->orphaned) {
+		sc_pkcs11_release_orphan(&op);
+		return CKR_SESSION_CLOSED;
+	}
+	if (rv != CKR_OK)
+		session_stop_operation(session, type);
+
+	return rv;
+}
+
+/* A failed token of the pool leaves the operation to another one */
+static int
+pool_failover(CK_RV rv)
+{
+	return rv == CKR_DEVICE_REMOVED || rv == CKR_TOKEN_NOT_PRESENT
+		|| rv == CKR_DEVICE_ERROR || rv == CKR_USER_NOT_LOGGED_IN;
+}
+
+/* Run the signature or decryption of the session on the least busy token
+ * of the pool of its slot (see token_pool), so that identical tokens share
+ * the load. Called with the card lock *p11card of the session held.
+ * Returns 0, still holding it, if the operation has to run on the token
+ * of the session as usual. Otherwise the operation is done, *rv is set
+ * and the global lock is held instead of the card lock (*p11card = NULL). */
+static int
+pool_operation(struct sc_pkcs11_session *session, int type,
+		struct sc_pkcs11_card **p11card,
+		CK_BYTE_PTR pIn, CK_ULONG ulInLen,
+		CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen, CK_RV *rv)
+{
+	struct sc_pkcs11_slot *slot = session->slot, *member, *failed = NULL;
+	struct sc_pkcs11_session pool_session;
+	struct sc_pkcs11_object *key, *member_key;
+	struct sc_pkcs11_card *member_card;
+	sc_pkcs11_operation_t *op;
+	CK_FLAGS flags = session->flags;
+	CK_BBOOL always_authenticate = FALSE;
+	CK_ATTRIBUTE always_authenticate_attr = { CKA_ALWAYS_AUTHENTICATE,
+		&always_authenticate, sizeof(always_authenticate) };
+	CK_BYTE id_value[SC_PKCS15_MAX_ID_SIZE];
+	CK_ATTRIBUTE id = { CKA_ID, id_value, sizeof(id_value) };
+	int attempt;
+
+	if (!sc_pkcs11_conf.token_pool || *p11card == NULL)
+		return 0;
+	if (sc_pkcs11_prepare_on_key(session, type, &op, &key) != CKR_OK)
+		return 0;
+	/* the PIN has to be verified right before using such a key */
+	if (key->ops->get_attribute(session, key, &always_authenticate_attr) == CKR_OK
+			&& always_authenticate)
+		return 0;
+	if (key->ops->get_attribute(session, key, &id) != CKR_OK)
+		return 0;
+
+	/* The session may be closed while its card is not locked; the
+	 * operation is then released below instead */
+	op->busy = 1;
+	sc_pkcs11_unlock_slot(*p11card);
+	*p11card = NULL;
+	if (sc_pkcs11_lock() != CKR_OK) {
+		*rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+		return 1;
+	}
+
+	for (attempt = 0; ; attempt++) {
+		if (op->orphaned) {
+			sc_pkcs11_release_orphan(&op);
+			*rv = CKR_SESSION_CLOSED;
+			return 1;
+		}
+
+		member = slot_pool_pick(slot, failed);
+		member->pool_busy++;
+		sc_log(context, "Slot 0x%lx: running the operation on slot 0x%lx",
+				slot->id, member->id);
+		member_card = sc_pkcs11_lock_slot(member);
+
+		memset(&pool_session, 0, sizeof(pool_session));
+		pool_session.slot = member;
+		pool_session.flags = flags;
+		member_key = member == slot ? key : slot_pool_find_key(&pool_session, &id);
+		if (member_key == NULL) {
+			*rv = CKR_KEY_HANDLE_INVALID;
+		} else {
+			*rv = restore_key_login_state(member);
+			if (*rv == CKR_OK)
+				*rv = sc_pkcs11_run_on_key(op, type, &pool_session, member_key,
+						pIn, ulInLen, pOut, pulOutLen);
+			*rv = reset_login_state(member, *rv);
+		}
+
+		if (member_card) {
+			sc_pkcs11_unlock_slot(member_card);
+			if (sc_pkcs11_lock() != CKR_OK) {
+				*rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+				return 1;
+			}
+		}
+		member->pool_busy--;
+
+		if (attempt == 0 && member != slot && !op->orphaned
+				&& (member_key == NULL || pool_failover(*rv))) {
+			sc_log(context, "Slot 0x%lx failed (0x%lx), trying another one",
+					member->id, *rv);
+			failed = member;
+			continue;
+		}
+		break;
+	}
+
+	op->busy = 0;
+	if (op->orphaned) {
+		sc_pkcs11_release_orphan(&op);
+		*rv = CKR_SESSION_CLOSED;
+	} else if (*rv != CKR_BUFFER_TOO_SMALL) {
+		session_stop_operation(session, type);
+	}
+
+	return 1;
+}
+
+
 /* C_CreateObject can be called from C_DeriveKey
  * which is holding the sc_pkcs11_lock
  * So dont get the lock again. */
@@ -95,7 +253,7 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 {
 	CK_RV rv = CKR_OK;
 	struct sc_pkcs11_session *session;
-	struct sc_pkcs11_card *card;
+	struct sc_pkcs11_card *card = NULL;
 	CK_BBOOL is_token = FALSE;
 
 	LOG_FUNC_CALLED(context);
@@ -110,12 +268,16 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_CreateObject()", pTemplate, ulCount);
 
-	session = list_seek(&sessions, &hSession);
+	session = session_lookup(hSession);
 	if (!session) {
 		rv = CKR_SESSION_HANDLE_INVALID;
 		goto out;
 	}
 
+	card = session->slot->p11card;
+	if (use_lock)
+		sc_pkcs11_card_lock(card);
+
 	rv = attr_find(pTemplate, ulCount, CKA_TOKEN, &is_token, NULL);
 	if (rv != CKR_TEMPLATE_INCOMPLETE && rv != CKR_OK) {
 		goto out;
@@ -132,15 +294,16 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 		}
 	}
 
-	card = session->slot->p11card;
 	if (card->framework->create_object == NULL)
 		rv = CKR_FUNCTION_NOT_SUPPORTED;
 	else
 		rv = card->framework->create_object(session->slot, pTemplate, ulCount, phObject);
 
 out:
-	if (use_lock)
+	if (use_lock) {
+		sc_pkcs11_card_unlock(card);
 		sc_pkcs11_unlock();
+	}
 
 	return rv;
 }
@@ -152,6 +315,7 @@ C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulCount,		/* attributes in template */
 		CK_OBJECT_HANDLE_PTR phObject)
 {
+	SC_PROBE1(pkcs11_call, __func__);
 	return sc_create_object_int(hSession, pTemplate, ulCount, phObject, 1);
 }
 
@@ -163,6 +327,7 @@ C_CopyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulCount,		/* attributes in template */
 		CK_OBJECT_HANDLE_PTR phNewObject)	/* receives handle of copy */
 {
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
@@ -172,11 +337,13 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_OBJECT_HANDLE hObject)	/* the object's handle */
 {
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 	CK_BBOOL is_token = FALSE;
 	CK_ATTRIBUTE token_attribute = {CKA_TOKEN, &is_token, sizeof(is_token)};
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
@@ -186,6 +353,9 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		goto out;
 
+	p11card = session->slot->p11card;
+	sc_pkcs11_card_lock(p11card);
+
 	object->ops->get_attribute(session, object, &token_attribute);
 	if (is_token == TRUE) {
 		if (session->slot->token_info.flags & CKF_WRITE_PROTECTED) {
@@ -204,6 +374,7 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = object->ops->destroy_object(session, object);
 
 out:
+	sc_pkcs11_card_unlock(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -214,6 +385,7 @@ C_GetObjectSize(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		      CK_OBJECT_HANDLE hObject,	/* the object's handle */
 		      CK_ULONG_PTR pulSize)	/* receives size of object */
 {
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
@@ -234,12 +406,14 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	char object_name[64];
 	CK_RV j;
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 	CK_RV res;
 	CK_RV res_type;
 	unsigned int i;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
@@ -251,6 +425,8 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		goto out;
 
+	p11card = sc_pkcs11_lock_slot(session->slot);
+
 	/* Debug printf */
 	snprintf(object_name, sizeof(object_name), "Object %lu", (unsigned long)hObject);
 
@@ -283,7 +459,7 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:	sc_log(context, "C_GetAttributeValue(hSession=0x%lx, hObject=0x%lx) = %s",
 			hSession, hObject, lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 }
 
@@ -295,10 +471,12 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulCount)		/* attributes in template */
 {
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	unsigned int i;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
@@ -312,6 +490,9 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		goto out;
 
+	p11card = session->slot->p11card;
+	sc_pkcs11_card_lock(p11card);
+
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -325,66 +506,128 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			if (rv != CKR_OK)
 				break;
 		}
+		/* Indexed attributes may have changed */
+		slot_invalidate_index(session->slot);
 	}
 
 out:
+	sc_pkcs11_card_unlock(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
 
 
-CK_RV
-C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
-		CK_ATTRIBUTE_PTR pTemplate,	/* attribute values to match */
-		CK_ULONG ulCount)		/* attributes in search template */
+/* Search template attributes are compared cheapest and most selective
+ * first, so that most objects are ruled out by the first comparison */
+static int
+find_attribute_rank(CK_ATTRIBUTE_TYPE type)
 {
-	CK_RV rv;
-	CK_BBOOL is_private = TRUE;
-	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
-	int match, hide_private;
-	unsigned int i, j;
-	struct sc_pkcs11_session *session;
-	struct sc_pkcs11_object *object;
-	struct sc_pkcs11_find_operation *operation;
-	struct sc_pkcs11_slot *slot;
+	switch (type) {
+	case CKA_CLASS:
+		return 0;
+	case CKA_KEY_TYPE:
+	case CKA_CERTIFICATE_TYPE:
+		return 1;
+	case CKA_ID:
+		return 2;
+	case CKA_TOKEN:
+	case CKA_PRIVATE:
+	case CKA_LABEL:
+		return 3;
+	default:
+		return 4;
+	}
+}
 
-	if (pTemplate == NULL_PTR && ulCount > 0)
-		return CKR_ARGUMENTS_BAD;
+/* Compute the order in which the attributes of the template are compared
+ * with each object; attributes of the same rank keep their order */
+static void
+find_plan(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_ULONG *order)
+{
+	CK_ULONG i, j, k;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
+	for (i = 0; i < ulCount; i++) {
+		k = i;
+		for (j = i; j > 0 && find_attribute_rank(pTemplate[order[j - 1]].type)
+				> find_attribute_rank(pTemplate[k].type); j--)
+			order[j] = order[j - 1];
+		order[j] = k;
+	}
+}
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
 
-	sc_log(context, "C_FindObjectsInit(slot = %lu)\n", session->slot->id);
-	dump_template(SC_LOG_DEBUG_NORMAL, "C_FindObjectsInit()", pTemplate, ulCount);
+/* Copy the search template with its values into a single allocation, as
+ * the caller may release it before the objects are matched */
+static CK_ATTRIBUTE_PTR
+find_copy_template(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	CK_ATTRIBUTE_PTR copy;
+	unsigned char *values;
+	size_t size = ulCount * sizeof(CK_ATTRIBUTE);
+	CK_ULONG i;
 
-	rv = session_start_operation(session, SC_PKCS11_OPERATION_FIND,
-				     &find_mechanism, (struct sc_pkcs11_operation **)&operation);
-	if (rv != CKR_OK)
-		goto out;
+	for (i = 0; i < ulCount; i++)
+		if (pTemplate[i].pValue != NULL)
+			size += pTemplate[i].ulValueLen;
 
-	operation->current_handle = 0;
-	operation->num_handles = 0;
-	operation->allocated_handles = 0;
-	operation->handles = NULL;
-	slot = session->slot;
+	copy = malloc(size ? size : 1);
+	if (copy == NULL)
+		return NULL;
 
-	/* Check whether we should hide private objects */
-	hide_private = 0;
-	if (slot->login_user != CKU_USER && (slot->token_info.flags & CKF_LOGIN_REQUIRED))
-		hide_private = 1;
+	values = (unsigned char *)(copy + ulCount);
+	for (i = 0; i < ulCount; i++) {
+		copy[i] = pTemplate[i];
+		if (pTemplate[i].pValue != NULL) {
+			memcpy(values, pTemplate[i].pValue, pTemplate[i].ulValueLen);
+			copy[i].pValue = values;
+			values += pTemplate[i].ulValueLen;
+		}
+	}
+	return copy;
+}
+
+
+/* Match the objects of the slot until at least 'wanted' handles are
+ * waiting to be returned or all objects were seen. The iterator is
+ * restarted when the objects changed since the last call, skipping the
+ * objects that were already found. Called with the slot locked. */
+static CK_RV
+find_objects_match(struct sc_pkcs11_session *session,
+		struct sc_pkcs11_find_operation *operation, CK_ULONG wanted)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+	CK_BBOOL is_private = TRUE;
+	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
+	struct sc_pkcs11_object *object;
+	int match, restarted = 0, i;
+	CK_ULONG j;
+	CK_RV rv;
 
-	/* For each object in token do */
-	for (i=0; i<list_size(&slot->objects); i++) {
-		object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
+	while (!operation->done
+			&& (CK_ULONG)(operation->num_handles - operation->current_handle) < wanted) {
+		if (operation->generation != slot->objects_generation) {
+			slot_objects_init(&operation->iter, session,
+					operation->pTemplate, operation->ulCount);
+			operation->generation = slot->objects_generation;
+			restarted = 1;
+		}
+		object = slot_objects_next(&operation->iter);
+		if (object == NULL) {
+			operation->done = 1;
+			break;
+		}
 		sc_log(context, "Object with handle 0x%lx", object->handle);
 
+		if (restarted) {
+			for (i = 0; i < operation->num_handles; i++)
+				if (operation->handles[i] == object->handle)
+					break;
+			if (i < operation->num_handles)
+				continue;
+		}
+
 		/* User not logged in and private object? */
-		if (hide_private) {
+		if (operation->hide_private) {
 			if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
 			        continue;
 			if (is_private) {
@@ -397,20 +640,22 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 		/* Try to match every attribute */
 		match = 1;
-		for (j = 0; j < ulCount; j++) {
-			rv = object->ops->cmp_attribute(session, object, &pTemplate[j]);
+		for (j = 0; j < operation->ulCount; j++) {
+			CK_ATTRIBUTE_PTR attr = &operation->pTemplate[operation->order[j]];
+
+			rv = object->ops->cmp_attribute(session, object, attr);
 			if (rv == 0) {
 				sc_log(context,
 				       "Object %lu/%lu: Attribute 0x%lx does NOT match.",
-				       slot->id, object->handle, pTemplate[j].type);
+				       slot->id, object->handle, attr->type);
 				match = 0;
 				break;
 			}
 
-			if (context->debug >= 4) {
+			if (SC_LOG_ENABLED(context, 4)) {
 				sc_log(context,
 				       "Object %lu/%lu: Attribute 0x%lx matches.",
-				       slot->id, object->handle, pTemplate[j].type);
+				       slot->id, object->handle, attr->type);
 			}
 		}
 
@@ -419,24 +664,96 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			       object->handle);
 			/* Realloc handles - remove restriction on only 32 matching objects -dee */
 			if (operation->num_handles >= operation->allocated_handles) {
+				CK_OBJECT_HANDLE *handles;
+
+				sc_log(context, "realloc for %d handles",
+				       operation->allocated_handles + SC_PKCS11_FIND_INC_HANDLES);
+				handles = realloc(operation->handles, sizeof(CK_OBJECT_HANDLE)
+					* (operation->allocated_handles + SC_PKCS11_FIND_INC_HANDLES));
+				if (handles == NULL)
+					return CKR_HOST_MEMORY;
+				operation->handles = handles;
 				operation->allocated_handles += SC_PKCS11_FIND_INC_HANDLES;
-				sc_log(context, "realloc for %d handles", operation->allocated_handles);
-				operation->handles = realloc(operation->handles,
-					sizeof(CK_OBJECT_HANDLE) * operation->allocated_handles);
-				if (operation->handles == NULL) {
-					rv = CKR_HOST_MEMORY;
-					goto out;
-				}
 			}
 			operation->handles[operation->num_handles++] = object->handle;
 		}
 	}
-	rv = CKR_OK;
 
-	sc_log(context, "%d matching objects\n", operation->num_handles);
+	if (operation->done)
+		sc_log(context, "%d matching objects\n", operation->num_handles);
+	return CKR_OK;
+}
+
+
+CK_RV
+C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_ATTRIBUTE_PTR pTemplate,	/* attribute values to match */
+		CK_ULONG ulCount)		/* attributes in search template */
+{
+	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_find_operation *operation;
+	struct sc_pkcs11_slot *slot;
+
+	SC_PROBE1(pkcs11_call, __func__);
+	if (pTemplate == NULL_PTR && ulCount > 0)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
+		goto out;
+
+	p11card = sc_pkcs11_lock_slot(session->slot);
+
+	sc_log(context, "C_FindObjectsInit(slot = %lu)\n", session->slot->id);
+	dump_template(SC_LOG_DEBUG_NORMAL, "C_FindObjectsInit()", pTemplate, ulCount);
+
+	slot = session->slot;
+	if (slot->p11card && slot->p11card->framework
+			&& slot->p11card->framework->load_objects) {
+		rv = slot->p11card->framework->load_objects(slot, pTemplate, ulCount);
+		if (rv != CKR_OK)
+			goto out;
+	}
+
+	rv = session_start_operation(session, SC_PKCS11_OPERATION_FIND,
+				     &find_mechanism, (struct sc_pkcs11_operation **)&operation);
+	if (rv != CKR_OK)
+		goto out;
+
+	operation->current_handle = 0;
+	operation->num_handles = 0;
+	operation->allocated_handles = 0;
+	operation->handles = NULL;
+	operation->done = 0;
+
+	/* Check whether we should hide private objects */
+	operation->hide_private = 0;
+	if (slot->login_user != CKU_USER && (slot->token_info.flags & CKF_LOGIN_REQUIRED))
+		operation->hide_private = 1;
+
+	/* The objects are matched by C_FindObjects(), so that a caller
+	 * asking for a single handle does not wait for all objects */
+	operation->ulCount = ulCount;
+	operation->pTemplate = find_copy_template(pTemplate, ulCount);
+	operation->order = malloc((ulCount ? ulCount : 1) * sizeof(*operation->order));
+	if (operation->pTemplate == NULL || operation->order == NULL) {
+		session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
+		rv = CKR_HOST_MEMORY;
+		goto out;
+	}
+	find_plan(operation->pTemplate, ulCount, operation->order);
+
+	slot_objects_init(&operation->iter, session, operation->pTemplate, ulCount);
+	operation->generation = slot->objects_generation;
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 }
 
@@ -449,9 +766,11 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	CK_ULONG to_return;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_find_operation *operation;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (phObject == NULL_PTR || ulMaxObjectCount == 0 || pulObjectCount == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -467,6 +786,22 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		goto out;
 
+	/* Matching may need the card; handles found before are returned
+	 * with the global lock only */
+	if (!operation->done
+			&& (CK_ULONG)(operation->num_handles - operation->current_handle) < ulMaxObjectCount) {
+		p11card = sc_pkcs11_lock_slot(session->slot);
+		/* the session may be gone while waiting for the slot */
+		rv = get_session(hSession, &session);
+		if (rv == CKR_OK)
+			rv = session_get_operation(session, SC_PKCS11_OPERATION_FIND,
+					(sc_pkcs11_operation_t **) & operation);
+		if (rv == CKR_OK)
+			rv = find_objects_match(session, operation, ulMaxObjectCount);
+		if (rv != CKR_OK)
+			goto out;
+	}
+
 	to_return = (CK_ULONG) operation->num_handles - operation->current_handle;
 	if (to_return > ulMaxObjectCount)
 		to_return = ulMaxObjectCount;
@@ -477,7 +812,8 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	operation->current_handle += to_return;
 
-out:	sc_pkcs11_unlock();
+out:
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 }
 
@@ -488,6 +824,7 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
@@ -513,8 +850,10 @@ C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_MECHANISM_PTR pMechanism)	/* the digesting mechanism */
 {
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -524,11 +863,13 @@ C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	sc_log(context, "C_DigestInit(hSession=0x%lx)", hSession);
 	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
+	if (rv == CKR_OK) {
+		p11card = sc_pkcs11_lock_slot(session->slot);
 		rv = sc_pkcs11_md_init(session, pMechanism);
+	}
 
 	sc_log(context, "C_DigestInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 }
 
@@ -541,9 +882,11 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		CK_ULONG_PTR pulDigestLen)	/* receives byte length of digest */
 {
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 	CK_ULONG  ulBuflen = 0;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
@@ -553,6 +896,8 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	if (rv != CKR_OK)
 		goto out;
 
+	p11card = sc_pkcs11_lock_slot(session->slot);
+
 	/* if pDigest == NULL, buffer size request */
 	if (pDigest) {
 	    /* As per PKCS#11 2.20 we need to check if buffer too small before update */
@@ -573,7 +918,7 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 }
 
@@ -584,18 +929,26 @@ C_DigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulPartLen)		/* bytes of data to be digested */
 {
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
 	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
+	if (rv == CKR_OK) {
+		rv = update_digest_unlocked(session, SC_PKCS11_OPERATION_DIGEST,
+				pPart, ulPartLen);
+		if (rv == CKR_FUNCTION_NOT_SUPPORTED) {
+			p11card = sc_pkcs11_lock_slot(session->slot);
+			rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
+		}
+	}
 
 	sc_log(context, "C_DigestUpdate() == %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 }
 
@@ -604,6 +957,7 @@ CK_RV
 C_DigestKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_OBJECT_HANDLE hKey)	/* handle of secret key to digest */
 {
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
@@ -614,18 +968,22 @@ C_DigestFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG_PTR pulDigestLen)	/* receives byte count of digest */
 {
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
 	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
+	if (rv == CKR_OK) {
+		p11card = sc_pkcs11_lock_slot(session->slot);
 		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
+	}
 
 	sc_log(context, "C_DigestFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 }
 
@@ -642,7 +1000,9 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -657,6 +1017,8 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		goto out;
 	}
 
+	p11card = sc_pkcs11_lock_slot(session->slot);
+
 	if (object->ops->sign == NULL_PTR) {
 		rv = CKR_KEY_TYPE_INCONSISTENT;
 		goto out;
@@ -677,7 +1039,7 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_SignInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 }
 
@@ -690,9 +1052,11 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		CK_ULONG_PTR pulSignatureLen)	/* receives byte count of signature */
 {
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 	CK_ULONG length;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
@@ -701,6 +1065,8 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	if (rv != CKR_OK)
 		goto out;
 
+	p11card = sc_pkcs11_lock_slot(session->slot);
+
 	/* According to the pkcs11 specs, we must not do any calls that
 	 * change our crypto state if the caller is just asking for the
 	 * signature buffer size, or if the result would be
@@ -715,9 +1081,23 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		goto out;
 	}
 
+	/* Mechanisms signing the data as it is take the caller's buffer
+	 * directly, unless the operation may run on another token */
+	if (!sc_pkcs11_conf.token_pool) {
+		rv = restore_key_login_state(session->slot);
+		if (rv == CKR_OK)
+			rv = sc_pkcs11_sign(session, pData, ulDataLen, pSignature, pulSignatureLen);
+		if (rv != CKR_FUNCTION_NOT_SUPPORTED) {
+			rv = reset_login_state(session->slot, rv);
+			goto out;
+		}
+		reset_login_state(session->slot, CKR_OK);
+	}
+
 	rv = sc_pkcs11_sign_update(session, pData, ulDataLen);
-	if (rv == CKR_OK) {
-		rv = restore_login_state(session->slot);
+	if (rv == CKR_OK && !pool_operation(session, SC_PKCS11_OPERATION_SIGN,
+				&p11card, NULL, 0, pSignature, pulSignatureLen, &rv)) {
+		rv = restore_key_login_state(session->slot);
 		if (rv == CKR_OK)
 			rv = sc_pkcs11_sign_final(session, pSignature, pulSignatureLen);
 		rv = reset_login_state(session->slot, rv);
@@ -725,7 +1105,7 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_Sign() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 }
 
@@ -736,18 +1116,26 @@ C_SignUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulPartLen)		/* count of bytes to be signed */
 {
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
 	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
+	if (rv == CKR_OK) {
+		rv = update_digest_unlocked(session, SC_PKCS11_OPERATION_SIGN,
+				pPart, ulPartLen);
+		if (rv == CKR_FUNCTION_NOT_SUPPORTED) {
+			p11card = sc_pkcs11_lock_slot(session->slot);
+			rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
+		}
+	}
 
 	sc_log(context, "C_SignUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 }
 
@@ -760,7 +1148,9 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	struct sc_pkcs11_session *session;
 	CK_ULONG length;
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
@@ -769,6 +1159,8 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	if (rv != CKR_OK)
 		goto out;
 
+	p11card = sc_pkcs11_lock_slot(session->slot);
+
 	/* According to the pkcs11 specs, we must not do any calls that
 	 * change our crypto state if the caller is just asking for the
 	 * signature buffer size, or if the result would be
@@ -780,8 +1172,9 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	if (pSignature == NULL || length > *pulSignatureLen) {
 		*pulSignatureLen = length;
 		rv = pSignature ? CKR_BUFFER_TOO_SMALL : CKR_OK;
-	} else {
-		rv = restore_login_state(session->slot);
+	} else if (!pool_operation(session, SC_PKCS11_OPERATION_SIGN,
+				&p11card, NULL, 0, pSignature, pulSignatureLen, &rv)) {
+		rv = restore_key_login_state(session->slot);
 		if (rv == CKR_OK)
 			rv = sc_pkcs11_sign_final(session, pSignature, pulSignatureLen);
 		rv = reset_login_state(session->slot, rv);
@@ -789,7 +1182,7 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_SignFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 }
 
@@ -799,6 +1192,7 @@ C_SignRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_MECHANISM_PTR pMechanism,	/* the signature mechanism */
 		CK_OBJECT_HANDLE hKey)		/* handle of the signature key */
 {
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
@@ -810,6 +1204,7 @@ C_SignRecover(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_BYTE_PTR pSignature,		/* receives the signature */
 		CK_ULONG_PTR pulSignatureLen)	/* receives byte count of signature */
 {
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
@@ -819,48 +1214,20 @@ C_EncryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_MECHANISM_PTR pMechanism,	/* the encryption mechanism */
 		CK_OBJECT_HANDLE hKey)		/* handle of encryption key */
 {
+#ifndef ENABLE_OPENSSL
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
-}
-
-
-CK_RV C_Encrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
-		CK_BYTE_PTR pData,	/* the plaintext data */
-		CK_ULONG ulDataLen,	/* bytes of plaintext data */
-		CK_BYTE_PTR pEncryptedData,	/* receives encrypted data */
-		CK_ULONG_PTR pulEncryptedDataLen)
-{				/* receives encrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
-}
-
-CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
-		      CK_BYTE_PTR pPart,	/* the plaintext data */
-		      CK_ULONG ulPartLen,	/* bytes of plaintext data */
-		      CK_BYTE_PTR pEncryptedPart,	/* receives encrypted data */
-		      CK_ULONG_PTR pulEncryptedPartLen)
-{				/* receives encrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
-}
-
-CK_RV C_EncryptFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
-		     CK_BYTE_PTR pLastEncryptedPart,	/* receives encrypted last part */
-		     CK_ULONG_PTR pulLastEncryptedPartLen)
-{				/* receives byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
-}
-
-CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
-		    CK_MECHANISM_PTR pMechanism,	/* the decryption mechanism */
-		    CK_OBJECT_HANDLE hKey)
-{				/* handle of the decryption key */
-	CK_BBOOL can_decrypt, can_unwrap;
+#else
+	CK_BBOOL can_encrypt;
 	CK_KEY_TYPE key_type;
-	CK_ATTRIBUTE decrypt_attribute = { CKA_DECRYPT,	&can_decrypt,	sizeof(can_decrypt) };
+	CK_ATTRIBUTE encrypt_attribute = { CKA_ENCRYPT,	&can_encrypt,	sizeof(can_encrypt) };
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE,	&key_type,	sizeof(key_type) };
-	CK_ATTRIBUTE unwrap_attribute = { CKA_UNWRAP,	&can_unwrap,	sizeof(can_unwrap) };
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -875,32 +1242,140 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		goto out;
 	}
 
-	if (object->ops->decrypt == NULL_PTR) {
+	/* Encryption is done on the host; only parsing the public key
+	 * for the first time may have to read it from the card */
+	if (object->verify_key == NULL)
+		p11card = sc_pkcs11_lock_slot(session->slot);
+
+	rv = object->ops->get_attribute(session, object, &encrypt_attribute);
+	if (rv != CKR_OK || !can_encrypt) {
 		rv = CKR_KEY_TYPE_INCONSISTENT;
 		goto out;
 	}
-
-	rv = object->ops->get_attribute(session, object, &decrypt_attribute);
-	if (rv != CKR_OK || !can_decrypt) {
-		/* Also accept UNWRAP - apps call Decrypt when they mean Unwrap */
-		rv = object->ops->get_attribute(session, object, &unwrap_attribute);
-		if (rv != CKR_OK || !can_unwrap) {
-			rv = CKR_KEY_TYPE_INCONSISTENT;
-			goto out;
-		}
-	}
 	rv = object->ops->get_attribute(session, object, &key_type_attr);
 	if (rv != CKR_OK) {
 		rv = CKR_KEY_TYPE_INCONSISTENT;
 		goto out;
 	}
 
-	rv = sc_pkcs11_decr_init(session, pMechanism, object, key_type);
+	rv = sc_pkcs11_encr_init(session, pMechanism, object, key_type);
 
 out:
-	sc_log(context, "C_DecryptInit() = %s", lookup_enum ( RV_T, rv ));
+	sc_log(context, "C_EncryptInit() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(p11card);
+	return rv;
+#endif
+}
+
+
+CK_RV C_Encrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_BYTE_PTR pData,	/* the plaintext data */
+		CK_ULONG ulDataLen,	/* bytes of plaintext data */
+		CK_BYTE_PTR pEncryptedData,	/* receives encrypted data */
+		CK_ULONG_PTR pulEncryptedDataLen)
+{				/* receives encrypted byte count */
+#ifndef ENABLE_OPENSSL
+	SC_PROBE1(pkcs11_call, __func__);
+	return CKR_FUNCTION_NOT_SUPPORTED;
+#else
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	SC_PROBE1(pkcs11_call, __func__);
+	if (pData == NULL_PTR || pulEncryptedDataLen == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	/* no card lock: the card is not involved */
+	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_encr(session, pData, ulDataLen,
+				pEncryptedData, pulEncryptedDataLen);
+
+	sc_log(context, "C_Encrypt() = %s", lookup_enum ( RV_T, rv ));
 	sc_pkcs11_unlock();
 	return rv;
+#endif
+}
+
+CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		      CK_BYTE_PTR pPart,	/* the plaintext data */
+		      CK_ULONG ulPartLen,	/* bytes of plaintext data */
+		      CK_BYTE_PTR pEncryptedPart,	/* receives encrypted data */
+		      CK_ULONG_PTR pulEncryptedPartLen)
+{				/* receives encrypted byte count */
+	SC_PROBE1(pkcs11_call, __func__);
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_EncryptFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		     CK_BYTE_PTR pLastEncryptedPart,	/* receives encrypted last part */
+		     CK_ULONG_PTR pulLastEncryptedPartLen)
+{				/* receives byte count */
+	SC_PROBE1(pkcs11_call, __func__);
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		    CK_MECHANISM_PTR pMechanism,	/* the decryption mechanism */
+		    CK_OBJECT_HANDLE hKey)
+{				/* handle of the decryption key */
+	CK_BBOOL can_decrypt, can_unwrap;
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE decrypt_attribute = { CKA_DECRYPT,	&can_decrypt,	sizeof(can_decrypt) };
+	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE,	&key_type,	sizeof(key_type) };
+	CK_ATTRIBUTE unwrap_attribute = { CKA_UNWRAP,	&can_unwrap,	sizeof(can_unwrap) };
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_object *object;
+	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
+
+	SC_PROBE1(pkcs11_call, __func__);
+	if (pMechanism == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_object_from_session(hSession, hKey, &session, &object);
+	if (rv != CKR_OK) {
+		if (rv == CKR_OBJECT_HANDLE_INVALID)
+			rv = CKR_KEY_HANDLE_INVALID;
+		goto out;
+	}
+
+	p11card = sc_pkcs11_lock_slot(session->slot);
+
+	if (object->ops->decrypt == NULL_PTR) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+
+	rv = object->ops->get_attribute(session, object, &decrypt_attribute);
+	if (rv != CKR_OK || !can_decrypt) {
+		/* Also accept UNWRAP - apps call Decrypt when they mean Unwrap */
+		rv = object->ops->get_attribute(session, object, &unwrap_attribute);
+		if (rv != CKR_OK || !can_unwrap) {
+			rv = CKR_KEY_TYPE_INCONSISTENT;
+			goto out;
+		}
+	}
+	rv = object->ops->get_attribute(session, object, &key_type_attr);
+	if (rv != CKR_OK) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+
+	rv = sc_pkcs11_decr_init(session, pMechanism, object, key_type);
+
+out:
+	sc_log(context, "C_DecryptInit() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(p11card);
+	return rv;
 }
 
 CK_RV C_Decrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -910,24 +1385,32 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG_PTR pulDataLen)
 {				/* receives decrypted byte count */
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
 	rv = get_session(hSession, &session);
 	if (rv == CKR_OK) {
-		rv = restore_login_state(session->slot);
-		if (rv == CKR_OK) {
-			rv = sc_pkcs11_decr(session, pEncryptedData,
-					ulEncryptedDataLen, pData, pulDataLen);
+		p11card = sc_pkcs11_lock_slot(session->slot);
+		/* the size of the output is asked from the session's token */
+		if (pData == NULL || !pool_operation(session, SC_PKCS11_OPERATION_DECRYPT,
+					&p11card, pEncryptedData, ulEncryptedDataLen,
+					pData, pulDataLen, &rv)) {
+			rv = restore_key_login_state(session->slot);
+			if (rv == CKR_OK) {
+				rv = sc_pkcs11_decr(session, pEncryptedData,
+						ulEncryptedDataLen, pData, pulDataLen);
+			}
+			rv = reset_login_state(session->slot, rv);
 		}
-		rv = reset_login_state(session->slot, rv);
 	}
 
 	sc_log(context, "C_Decrypt() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 }
 
@@ -937,6 +1420,7 @@ CK_RV C_DecryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		      CK_BYTE_PTR pPart,	/* receives decrypted output */
 		      CK_ULONG_PTR pulPartLen)
 {				/* receives decrypted byte count */
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
@@ -944,6 +1428,7 @@ CK_RV C_DecryptFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		     CK_BYTE_PTR pLastPart,	/* receives decrypted output */
 		     CK_ULONG_PTR pulLastPartLen)
 {				/* receives decrypted byte count */
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
@@ -953,6 +1438,7 @@ CK_RV C_DigestEncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle
 			    CK_BYTE_PTR pEncryptedPart,	/* receives encrypted data */
 			    CK_ULONG_PTR pulEncryptedPartLen)
 {				/* receives encrypted byte count */
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
@@ -962,6 +1448,7 @@ CK_RV C_DecryptDigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle
 			    CK_BYTE_PTR pPart,	/* receives decrypted output */
 			    CK_ULONG_PTR pulPartLen)
 {				/* receives decrypted byte count */
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
@@ -971,6 +1458,7 @@ CK_RV C_SignEncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			  CK_BYTE_PTR pEncryptedPart,	/* receives encrypted data */
 			  CK_ULONG_PTR pulEncryptedPartLen)
 {				/* receives encrypted byte count */
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
@@ -980,6 +1468,7 @@ CK_RV C_DecryptVerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle
 			    CK_BYTE_PTR pPart,	/* receives decrypted output */
 			    CK_ULONG_PTR pulPartLen)
 {				/* receives decrypted byte count */
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
@@ -989,6 +1478,7 @@ CK_RV C_GenerateKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		    CK_ULONG ulCount,	/* number of attributes in template */
 		    CK_OBJECT_HANDLE_PTR phKey)
 {				/* receives handle of new key */
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
@@ -1002,9 +1492,11 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			CK_OBJECT_HANDLE_PTR phPrivateKey)
 {				/* gets priv. key handle */
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pMechanism == NULL_PTR
 			|| (pPublicKeyTemplate == NULL_PTR && ulPublicKeyAttributeCount > 0)
 			|| (pPrivateKeyTemplate == NULL_PTR && ulPrivateKeyAttributeCount > 0))
@@ -1021,6 +1513,10 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		goto out;
 
+	/* On-card key generation can take a minute; only hold the slot's
+	 * lock so that the other readers stay usable meanwhile */
+	p11card = sc_pkcs11_lock_slot(session->slot);
+
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -1031,6 +1527,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			|| slot->p11card->framework->gen_keypair == NULL)
 		rv = CKR_FUNCTION_NOT_SUPPORTED;
 	else {
+		SC_PROBE2(pkcs11_keygen_start, slot->id, pMechanism->mechanism);
 		rv = restore_login_state(slot);
 		if (rv == CKR_OK)
 			rv = slot->p11card->framework->gen_keypair(slot, pMechanism,
@@ -1038,10 +1535,12 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 					pPrivateKeyTemplate, ulPrivateKeyAttributeCount,
 					phPublicKey, phPrivateKey);
 		rv = reset_login_state(session->slot, rv);
+		SC_PROBE2(pkcs11_keygen_done, slot->id, rv);
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_log(context, "C_GenerateKeyPair() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 }
 
@@ -1054,6 +1553,7 @@ CK_RV C_WrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG_PTR pulWrappedKeyLen)
 {				/* receives byte size of wrapped key */
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	CK_BBOOL can_wrap,
 			 can_be_wrapped;
 	CK_KEY_TYPE key_type;
@@ -1064,6 +1564,7 @@ CK_RV C_WrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_object *wrapping_object;
 	struct sc_pkcs11_object *key_object;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -1078,6 +1579,9 @@ CK_RV C_WrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			rv = CKR_KEY_HANDLE_INVALID;
 		goto out;
 	}
+
+	p11card = session->slot->p11card;
+	sc_pkcs11_card_lock(p11card);
 	if (wrapping_object->ops->wrap_key == NULL_PTR) {
 		rv = CKR_KEY_TYPE_INCONSISTENT;
 		goto out;
@@ -1108,7 +1612,7 @@ CK_RV C_WrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		goto out;
 	}
 
-	rv = restore_login_state(session->slot);
+	rv = restore_key_login_state(session->slot);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_wrap(session, pMechanism, wrapping_object, key_type,
 				key_object, pWrappedKey, pulWrappedKeyLen);
@@ -1116,6 +1620,7 @@ CK_RV C_WrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = reset_login_state(session->slot, rv);
 
 out:
+	sc_pkcs11_card_unlock(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -1130,6 +1635,7 @@ CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		  CK_OBJECT_HANDLE_PTR phKey)
 {				/* gets handle of recovered key */
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	CK_BBOOL can_unwrap;
 	CK_KEY_TYPE key_type;
 	CK_ATTRIBUTE unwrap_attribute = { CKA_UNWRAP, &can_unwrap, sizeof(can_unwrap) };
@@ -1138,6 +1644,7 @@ CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_object *key_object;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -1151,6 +1658,9 @@ CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			rv = CKR_KEY_HANDLE_INVALID;
 		goto out;
 	}
+
+	p11card = session->slot->p11card;
+	sc_pkcs11_card_lock(p11card);
 	if (object->ops->unwrap_key == NULL_PTR) {
 		rv = CKR_KEY_TYPE_INCONSISTENT;
 		goto out;
@@ -1188,6 +1698,7 @@ CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = reset_login_state(session->slot, rv);
 
 out:
+	sc_pkcs11_card_unlock(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -1202,6 +1713,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 /* TODO: -DEE ECDH with Cofactor  on PIV is an example */
 /* TODO: need to do a lot of checking, will only support ECDH for now.*/
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	CK_BBOOL can_derive;
 	CK_KEY_TYPE key_type;
 	CK_ATTRIBUTE derive_attribute = { CKA_DERIVE, &can_derive, sizeof(can_derive) };
@@ -1210,6 +1722,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_object *key_object;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -1224,6 +1737,9 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		goto out;
 	}
 
+	p11card = session->slot->p11card;
+	sc_pkcs11_card_lock(p11card);
+
 	if (object->ops->derive == NULL_PTR) {
 		rv = CKR_KEY_TYPE_INCONSISTENT;
 		goto out;
@@ -1257,7 +1773,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			goto out;
 		}
 
-		rv = restore_login_state(session->slot);
+		rv = restore_key_login_state(session->slot);
 		if (rv == CKR_OK)
 			rv = sc_pkcs11_deri(session, pMechanism, object, key_type,
 					hSession, *phKey, key_object);
@@ -1270,6 +1786,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
+	sc_pkcs11_card_unlock(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -1278,6 +1795,7 @@ CK_RV C_SeedRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		   CK_BYTE_PTR pSeed,	/* the seed material */
 		   CK_ULONG ulSeedLen)
 {				/* count of bytes of seed material */
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
@@ -1286,15 +1804,18 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		       CK_ULONG ulRandomLen)
 {				/* number of bytes to be generated */
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
 	rv = get_session(hSession, &session);
 	if (rv == CKR_OK) {
+		p11card = sc_pkcs11_lock_slot(session->slot);
 		slot = session->slot;
 		if (slot == NULL || slot->p11card == NULL || slot->p11card->framework == NULL
 				|| slot->p11card->framework->get_random == NULL)
@@ -1303,18 +1824,20 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			rv = slot->p11card->framework->get_random(slot, RandomData, ulRandomLen);
 	}
 
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	sc_log(context, "C_GenerateRandom() = %s", lookup_enum ( RV_T, rv ));
 	return rv;
 }
 
 CK_RV C_GetFunctionStatus(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_PARALLEL;
 }
 
 CK_RV C_CancelFunction(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_PARALLEL;
 }
 
@@ -1323,14 +1846,17 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		   CK_OBJECT_HANDLE hKey)
 {				/* handle of the verification key */
 #ifndef ENABLE_OPENSSL
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 #else
 	CK_KEY_TYPE key_type;
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -1345,6 +1871,12 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			rv = CKR_KEY_HANDLE_INVALID;
 		goto out;
 	}
+
+	/* Once its public key is parsed, verifying with an object needs
+	 * nothing from the card, so do not wait for a card operation */
+	if (object->verify_key == NULL)
+		p11card = sc_pkcs11_lock_slot(session->slot);
+
 	rv = object->ops->get_attribute(session, object, &key_type_attr);
 	if (rv != CKR_OK) {
 		rv = CKR_KEY_TYPE_INCONSISTENT;
@@ -1355,7 +1887,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	sc_log(context, "C_VerifyInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 #endif
 }
@@ -1367,11 +1899,15 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	       CK_ULONG ulSignatureLen)
 {				/* count of bytes of signature */
 #ifndef ENABLE_OPENSSL
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 #else
 	CK_RV rv;
+	int host_only;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
@@ -1380,9 +1916,15 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		goto out;
 
+	host_only = sc_pkcs11_verif_host_only(session);
+	if (!host_only)
+		p11card = sc_pkcs11_lock_slot(session->slot);
+
 	rv = sc_pkcs11_verif_update(session, pData, ulDataLen);
-	if (rv == CKR_OK) {
-		rv = restore_login_state(session->slot);
+	if (rv == CKR_OK && host_only) {
+		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
+	} else if (rv == CKR_OK) {
+		rv = restore_key_login_state(session->slot);
 		if (rv == CKR_OK)
 			rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 		rv = reset_login_state(session->slot, rv);
@@ -1390,7 +1932,7 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	sc_log(context, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 #endif
 }
@@ -1400,21 +1942,31 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		     CK_ULONG ulPartLen)
 {				/* length of data (digest) in bytes */
 #ifndef ENABLE_OPENSSL
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 #else
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
 	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
+	if (rv == CKR_OK) {
+		rv = update_digest_unlocked(session, SC_PKCS11_OPERATION_VERIFY,
+				pPart, ulPartLen);
+		if (rv == CKR_FUNCTION_NOT_SUPPORTED) {
+			if (!sc_pkcs11_verif_host_only(session))
+				p11card = sc_pkcs11_lock_slot(session->slot);
+			rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
+		}
+	}
 
 	sc_log(context, "C_VerifyUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 #endif
 }
@@ -1424,25 +1976,31 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		    CK_ULONG ulSignatureLen)
 {				/* count of bytes of signature */
 #ifndef ENABLE_OPENSSL
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 #else
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
 	rv = get_session(hSession, &session);
-	if (rv == CKR_OK) {
-		rv = restore_login_state(session->slot);
+	if (rv == CKR_OK && sc_pkcs11_verif_host_only(session)) {
+		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
+	} else if (rv == CKR_OK) {
+		p11card = sc_pkcs11_lock_slot(session->slot);
+		rv = restore_key_login_state(session->slot);
 		if (rv == CKR_OK)
 			rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 		rv = reset_login_state(session->slot, rv);
 	}
 
 	sc_log(context, "C_VerifyFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(p11card);
 	return rv;
 #endif
 }
@@ -1451,6 +2009,7 @@ CK_RV C_VerifyRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			  CK_MECHANISM_PTR pMechanism,	/* the verification mechanism */
 			  CK_OBJECT_HANDLE hKey)
 {				/* handle of the verification key */
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
@@ -1460,6 +2019,578 @@ CK_RV C_VerifyRecover(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		      CK_BYTE_PTR pData,	/* receives decrypted data (digest) */
 		      CK_ULONG_PTR pulDataLen)
 {				/* receives byte count of data */
+	SC_PROBE1(pkcs11_call, __func__);
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+/*
+ * Message-based signatures and verifications (PKCS#11 3.0).
+ * C_MessageSignInit() checks the key and the mechanism once and keeps
+ * them in the session. Every message then runs a sign operation like
+ * C_SignInit() and C_Sign() in a single call, without further lookups
+ * by the application. The operation of each message uses the same slot
+ * of the session as C_SignInit(), so a single-part operation must not be
+ * active at the same time. The per-message parameter is not used by any
+ * of the supported mechanisms.
+ */
+static struct sc_pkcs11_message *
+message_of(struct sc_pkcs11_session *session, int type)
+{
+	return type == SC_PKCS11_OPERATION_SIGN ? &session->message_sign
+		: &session->message_verify;
+}
+
+static CK_RV
+message_init(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey, int type)
+{
+	CK_BBOOL can_sign;
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE sign_attribute = { CKA_SIGN, &can_sign, sizeof(can_sign) };
+	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_object *object;
+	struct sc_pkcs11_message *msg;
+	sc_pkcs11_mechanism_type_t *mt;
+	struct sc_pkcs11_card *p11card = NULL;
+	CK_RV rv;
+
+	if (pMechanism == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+	if (pMechanism->pParameter
+			&& pMechanism->ulParameterLen > sizeof(msg->mechanism_params))
+		return CKR_MECHANISM_PARAM_INVALID;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_object_from_session(hSession, hKey, &session, &object);
+	if (rv != CKR_OK) {
+		if (rv == CKR_OBJECT_HANDLE_INVALID)
+			rv = CKR_KEY_HANDLE_INVALID;
+		goto out;
+	}
+	msg = message_of(session, type);
+	if (msg->active) {
+		rv = CKR_OPERATION_ACTIVE;
+		goto out;
+	}
+
+	p11card = sc_pkcs11_lock_slot(session->slot);
+
+	if (type == SC_PKCS11_OPERATION_SIGN) {
+		if (object->ops->sign == NULL_PTR) {
+			rv = CKR_KEY_TYPE_INCONSISTENT;
+			goto out;
+		}
+		rv = object->ops->get_attribute(session, object, &sign_attribute);
+		if (rv != CKR_OK || !can_sign) {
+			rv = CKR_KEY_TYPE_INCONSISTENT;
+			goto out;
+		}
+	}
+	rv = object->ops->get_attribute(session, object, &key_type_attr);
+	if (rv != CKR_OK) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+
+	mt = sc_pkcs11_find_mechanism(session->slot->p11card, pMechanism->mechanism,
+			type == SC_PKCS11_OPERATION_SIGN ? CKF_SIGN : CKF_VERIFY);
+	if (mt == NULL) {
+		rv = CKR_MECHANISM_INVALID;
+		goto out;
+	}
+	if (mt->key_type != key_type) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+
+	memset(msg, 0, sizeof(*msg));
+	msg->mechanism = *pMechanism;
+	if (pMechanism->pParameter) {
+		memcpy(&msg->mechanism_params, pMechanism->pParameter,
+				pMechanism->ulParameterLen);
+		msg->mechanism.pParameter = &msg->mechanism_params;
+	}
+	msg->key = hKey;
+	msg->key_type = key_type;
+	msg->active = 1;
+
+out:
+	sc_pkcs11_unlock_slot(p11card);
+	return rv;
+}
+
+/* Starts the operation of a message. Called with the card lock held. */
+static CK_RV
+message_begin(struct sc_pkcs11_session *session, int type)
+{
+	struct sc_pkcs11_message *msg = message_of(session, type);
+	struct sc_pkcs11_object *object;
+	CK_RV rv;
+
+	if (!msg->active)
+		return CKR_OPERATION_NOT_INITIALIZED;
+	if (msg->in_progress && session->operation[type] != NULL)
+		return CKR_OPERATION_ACTIVE;
+
+	object = slot_find_object(session->slot, msg->key);
+	if (object == NULL)
+		return CKR_KEY_HANDLE_INVALID;
+
+	if (type == SC_PKCS11_OPERATION_SIGN)
+		rv = sc_pkcs11_sign_init(session, &msg->mechanism, object, msg->key_type);
+	else
+#ifdef ENABLE_OPENSSL
+		rv = sc_pkcs11_verif_init(session, &msg->mechanism, object, msg->key_type);
+#else
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+#endif
+	if (rv == CKR_OK)
+		msg->in_progress = 1;
+	return rv;
+}
+
+/* The operations stop themselves when they are done or fail */
+static void
+message_update_state(struct sc_pkcs11_session *session, int type)
+{
+	message_of(session, type)->in_progress = session->operation[type] != NULL;
+}
+
+static void
+message_abort(struct sc_pkcs11_session *session, int type)
+{
+	struct sc_pkcs11_message *msg = message_of(session, type);
+
+	if (msg->in_progress && session->operation[type] != NULL)
+		session_stop_operation(session, type);
+	msg->in_progress = 0;
+}
+
+/* Signs the last part of a message. Called with the card lock held. */
+static CK_RV
+message_sign_last(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	CK_ULONG length;
+	CK_RV rv;
+
+	/* as in C_Sign(), asking for the size does not end the message */
+	rv = sc_pkcs11_sign_size(session, &length);
+	if (rv != CKR_OK)
+		goto out;
+	if (pSignature == NULL || length > *pulSignatureLen) {
+		*pulSignatureLen = length;
+		return pSignature ? CKR_BUFFER_TOO_SMALL : CKR_OK;
+	}
+
+	rv = sc_pkcs11_sign_update(session, pData, ulDataLen);
+	if (rv == CKR_OK) {
+		rv = restore_key_login_state(session->slot);
+		if (rv == CKR_OK)
+			rv = sc_pkcs11_sign_final(session, pSignature, pulSignatureLen);
+		rv = reset_login_state(session->slot, rv);
+	}
+
+out:
+	message_update_state(session, SC_PKCS11_OPERATION_SIGN);
+	return rv;
+}
+
+/* Verifies the last part of a message. Called with the card lock held. */
+static CK_RV
+message_verify_last(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+#ifdef ENABLE_OPENSSL
+	CK_RV rv;
+
+	rv = sc_pkcs11_verif_update(session, pData, ulDataLen);
+	if (rv == CKR_OK) {
+		rv = restore_key_login_state(session->slot);
+		if (rv == CKR_OK)
+			rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
+		rv = reset_login_state(session->slot, rv);
+	}
+	message_update_state(session, SC_PKCS11_OPERATION_VERIFY);
+	return rv;
+#else
+	return CKR_FUNCTION_NOT_SUPPORTED;
+#endif
+}
+
+static CK_RV
+message_final(CK_SESSION_HANDLE hSession, int type)
+{
+	struct sc_pkcs11_card *p11card = NULL;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_message *msg;
+	CK_RV rv;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
+		goto out;
+
+	p11card = sc_pkcs11_lock_slot(session->slot);
+
+	msg = message_of(session, type);
+	if (!msg->active) {
+		rv = CKR_OPERATION_NOT_INITIALIZED;
+		goto out;
+	}
+	message_abort(session, type);
+	memset(msg, 0, sizeof(*msg));
+
+out:
+	sc_pkcs11_unlock_slot(p11card);
+	return rv;
+}
+
+CK_RV C_MessageSignInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_MECHANISM_PTR pMechanism,	/* the signature mechanism */
+		CK_OBJECT_HANDLE hKey)		/* handle of the signature key */
+{
+	CK_RV rv;
+
+	SC_PROBE1(pkcs11_call, __func__);
+	rv = message_init(hSession, pMechanism, hKey, SC_PKCS11_OPERATION_SIGN);
+	sc_log(context, "C_MessageSignInit() = %s", lookup_enum(RV_T, rv));
+	return rv;
+}
+
+CK_RV C_SignMessage(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_VOID_PTR pParameter,		/* message specific parameter */
+		CK_ULONG ulParameterLen,	/* length of the parameter */
+		CK_BYTE_PTR pData,		/* the data to be signed */
+		CK_ULONG ulDataLen,		/* count of bytes to be signed */
+		CK_BYTE_PTR pSignature,		/* receives the signature */
+		CK_ULONG_PTR pulSignatureLen)	/* receives byte count of signature */
+{
+	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
+	struct sc_pkcs11_session *session;
+
+	SC_PROBE1(pkcs11_call, __func__);
+	if (pulSignatureLen == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
+		goto out;
+
+	p11card = sc_pkcs11_lock_slot(session->slot);
+
+	rv = message_begin(session, SC_PKCS11_OPERATION_SIGN);
+	if (rv == CKR_OK) {
+		rv = message_sign_last(session, pData, ulDataLen, pSignature, pulSignatureLen);
+		/* each call is a complete message, also when only the size was asked */
+		message_abort(session, SC_PKCS11_OPERATION_SIGN);
+	}
+
+out:
+	sc_log(context, "C_SignMessage() = %s", lookup_enum(RV_T, rv));
+	sc_pkcs11_unlock_slot(p11card);
+	return rv;
+}
+
+CK_RV C_SignMessageBegin(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_VOID_PTR pParameter,		/* message specific parameter */
+		CK_ULONG ulParameterLen)	/* length of the parameter */
+{
+	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
+	struct sc_pkcs11_session *session;
+
+	SC_PROBE1(pkcs11_call, __func__);
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
+		goto out;
+
+	p11card = sc_pkcs11_lock_slot(session->slot);
+	rv = message_begin(session, SC_PKCS11_OPERATION_SIGN);
+
+out:
+	sc_log(context, "C_SignMessageBegin() = %s", lookup_enum(RV_T, rv));
+	sc_pkcs11_unlock_slot(p11card);
+	return rv;
+}
+
+CK_RV C_SignMessageNext(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_VOID_PTR pParameter,		/* message specific parameter */
+		CK_ULONG ulParameterLen,	/* length of the parameter */
+		CK_BYTE_PTR pData,		/* the data to be signed */
+		CK_ULONG ulDataLen,		/* count of bytes to be signed */
+		CK_BYTE_PTR pSignature,		/* receives the signature */
+		CK_ULONG_PTR pulSignatureLen)	/* NULL if not the last part */
+{
+	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
+	struct sc_pkcs11_session *session;
+
+	SC_PROBE1(pkcs11_call, __func__);
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
+		goto out;
+
+	p11card = sc_pkcs11_lock_slot(session->slot);
+
+	if (!session->message_sign.in_progress) {
+		rv = CKR_OPERATION_NOT_INITIALIZED;
+	} else if (pulSignatureLen == NULL_PTR) {
+		rv = sc_pkcs11_sign_update(session, pData, ulDataLen);
+		message_update_state(session, SC_PKCS11_OPERATION_SIGN);
+	} else {
+		rv = message_sign_last(session, pData, ulDataLen, pSignature, pulSignatureLen);
+	}
+
+out:
+	sc_log(context, "C_SignMessageNext() = %s", lookup_enum(RV_T, rv));
+	sc_pkcs11_unlock_slot(p11card);
+	return rv;
+}
+
+CK_RV C_MessageSignFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
+{
+	CK_RV rv;
+
+	SC_PROBE1(pkcs11_call, __func__);
+	rv = message_final(hSession, SC_PKCS11_OPERATION_SIGN);
+	sc_log(context, "C_MessageSignFinal() = %s", lookup_enum(RV_T, rv));
+	return rv;
+}
+
+CK_RV C_MessageVerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_MECHANISM_PTR pMechanism,	/* the verification mechanism */
+		CK_OBJECT_HANDLE hKey)		/* handle of the verification key */
+{
+#ifndef ENABLE_OPENSSL
+	SC_PROBE1(pkcs11_call, __func__);
+	return CKR_FUNCTION_NOT_SUPPORTED;
+#else
+	CK_RV rv;
+
+	SC_PROBE1(pkcs11_call, __func__);
+	rv = message_init(hSession, pMechanism, hKey, SC_PKCS11_OPERATION_VERIFY);
+	sc_log(context, "C_MessageVerifyInit() = %s", lookup_enum(RV_T, rv));
+	return rv;
+#endif
+}
+
+CK_RV C_VerifyMessage(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_VOID_PTR pParameter,		/* message specific parameter */
+		CK_ULONG ulParameterLen,	/* length of the parameter */
+		CK_BYTE_PTR pData,		/* the signed data */
+		CK_ULONG ulDataLen,		/* count of bytes of data */
+		CK_BYTE_PTR pSignature,		/* the signature to be verified */
+		CK_ULONG ulSignatureLen)	/* count of bytes of signature */
+{
+	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
+	struct sc_pkcs11_session *session;
+
+	SC_PROBE1(pkcs11_call, __func__);
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
+		goto out;
+
+	p11card = sc_pkcs11_lock_slot(session->slot);
+
+	rv = message_begin(session, SC_PKCS11_OPERATION_VERIFY);
+	if (rv == CKR_OK) {
+		rv = message_verify_last(session, pData, ulDataLen, pSignature, ulSignatureLen);
+		message_abort(session, SC_PKCS11_OPERATION_VERIFY);
+	}
+
+out:
+	sc_log(context, "C_VerifyMessage() = %s", lookup_enum(RV_T, rv));
+	sc_pkcs11_unlock_slot(p11card);
+	return rv;
+}
+
+CK_RV C_VerifyMessageBegin(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_VOID_PTR pParameter,		/* message specific parameter */
+		CK_ULONG ulParameterLen)	/* length of the parameter */
+{
+	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
+	struct sc_pkcs11_session *session;
+
+	SC_PROBE1(pkcs11_call, __func__);
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
+		goto out;
+
+	p11card = sc_pkcs11_lock_slot(session->slot);
+	rv = message_begin(session, SC_PKCS11_OPERATION_VERIFY);
+
+out:
+	sc_log(context, "C_VerifyMessageBegin() = %s", lookup_enum(RV_T, rv));
+	sc_pkcs11_unlock_slot(p11card);
+	return rv;
+}
+
+CK_RV C_VerifyMessageNext(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_VOID_PTR pParameter,		/* message specific parameter */
+		CK_ULONG ulParameterLen,	/* length of the parameter */
+		CK_BYTE_PTR pData,		/* the signed data */
+		CK_ULONG ulDataLen,		/* count of bytes of data */
+		CK_BYTE_PTR pSignature,		/* NULL if not the last part */
+		CK_ULONG ulSignatureLen)	/* count of bytes of signature */
+{
+	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
+	struct sc_pkcs11_session *session;
+
+	SC_PROBE1(pkcs11_call, __func__);
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
+		goto out;
+
+	p11card = sc_pkcs11_lock_slot(session->slot);
+
+	if (!session->message_verify.in_progress) {
+		rv = CKR_OPERATION_NOT_INITIALIZED;
+	} else if (pSignature == NULL_PTR) {
+#ifdef ENABLE_OPENSSL
+		rv = sc_pkcs11_verif_update(session, pData, ulDataLen);
+#else
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+#endif
+		message_update_state(session, SC_PKCS11_OPERATION_VERIFY);
+	} else {
+		rv = message_verify_last(session, pData, ulDataLen, pSignature, ulSignatureLen);
+	}
+
+out:
+	sc_log(context, "C_VerifyMessageNext() = %s", lookup_enum(RV_T, rv));
+	sc_pkcs11_unlock_slot(p11card);
+	return rv;
+}
+
+CK_RV C_MessageVerifyFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
+{
+	CK_RV rv;
+
+	SC_PROBE1(pkcs11_call, __func__);
+	rv = message_final(hSession, SC_PKCS11_OPERATION_VERIFY);
+	sc_log(context, "C_MessageVerifyFinal() = %s", lookup_enum(RV_T, rv));
+	return rv;
+}
+
+/* Message-based encryption is only defined for AEAD mechanisms, which
+ * the tokens do not offer */
+CK_RV C_MessageEncryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey)
+{
+	SC_PROBE1(pkcs11_call, __func__);
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_EncryptMessage(CK_SESSION_HANDLE hSession,
+		CK_VOID_PTR pParameter, CK_ULONG ulParameterLen,
+		CK_BYTE_PTR pAssociatedData, CK_ULONG ulAssociatedDataLen,
+		CK_BYTE_PTR pPlaintext, CK_ULONG ulPlaintextLen,
+		CK_BYTE_PTR pCiphertext, CK_ULONG_PTR pulCiphertextLen)
+{
+	SC_PROBE1(pkcs11_call, __func__);
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_EncryptMessageBegin(CK_SESSION_HANDLE hSession,
+		CK_VOID_PTR pParameter, CK_ULONG ulParameterLen,
+		CK_BYTE_PTR pAssociatedData, CK_ULONG ulAssociatedDataLen)
+{
+	SC_PROBE1(pkcs11_call, __func__);
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_EncryptMessageNext(CK_SESSION_HANDLE hSession,
+		CK_VOID_PTR pParameter, CK_ULONG ulParameterLen,
+		CK_BYTE_PTR pPlaintextPart, CK_ULONG ulPlaintextPartLen,
+		CK_BYTE_PTR pCiphertextPart, CK_ULONG_PTR pulCiphertextPartLen,
+		CK_FLAGS flags)
+{
+	SC_PROBE1(pkcs11_call, __func__);
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_MessageEncryptFinal(CK_SESSION_HANDLE hSession)
+{
+	SC_PROBE1(pkcs11_call, __func__);
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_MessageDecryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey)
+{
+	SC_PROBE1(pkcs11_call, __func__);
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptMessage(CK_SESSION_HANDLE hSession,
+		CK_VOID_PTR pParameter, CK_ULONG ulParameterLen,
+		CK_BYTE_PTR pAssociatedData, CK_ULONG ulAssociatedDataLen,
+		CK_BYTE_PTR pCiphertext, CK_ULONG ulCiphertextLen,
+		CK_BYTE_PTR pPlaintext, CK_ULONG_PTR pulPlaintextLen)
+{
+	SC_PROBE1(pkcs11_call, __func__);
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptMessageBegin(CK_SESSION_HANDLE hSession,
+		CK_VOID_PTR pParameter, CK_ULONG ulParameterLen,
+		CK_BYTE_PTR pAssociatedData, CK_ULONG ulAssociatedDataLen)
+{
+	SC_PROBE1(pkcs11_call, __func__);
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptMessageNext(CK_SESSION_HANDLE hSession,
+		CK_VOID_PTR pParameter, CK_ULONG ulParameterLen,
+		CK_BYTE_PTR pCiphertextPart, CK_ULONG ulCiphertextPartLen,
+		CK_BYTE_PTR pPlaintextPart, CK_ULONG_PTR pulPlaintextPartLen,
+		CK_FLAGS flags)
+{
+	SC_PROBE1(pkcs11_call, __func__);
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_MessageDecryptFinal(CK_SESSION_HANDLE hSession)
+{
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
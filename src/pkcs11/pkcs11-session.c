@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS11
+
 #include "config.h"
 
 #include <stdint.h>
@@ -27,9 +29,112 @@
 
 #include "sc-pkcs11.h"
 
+/*
+ * Index of the open sessions by handle. The sessions list is still used to
+ * iterate over all sessions, this table only speeds up the handle lookup
+ * done at the start of nearly every PKCS#11 call.
+ */
+#define SESSION_INDEX_MIN_SIZE	64
+
+static struct sc_pkcs11_session **session_buckets = NULL;
+static size_t session_bucket_count = 0;
+static size_t session_index_count = 0;
+
+static size_t session_hash(CK_SESSION_HANDLE handle, size_t bucket_count)
+{
+	/* handles are heap pointers: drop the alignment bits */
+	uint64_t h = (uint64_t)handle >> 4;
+
+	h *= UINT64_C(0x9E3779B97F4A7C15);
+	return (size_t)(h >> 32) & (bucket_count - 1);
+}
+
+static CK_RV session_index_resize(size_t bucket_count)
+{
+	struct sc_pkcs11_session **buckets, *session, *next;
+	size_t i, n;
+
+	buckets = calloc(bucket_count, sizeof *buckets);
+	if (buckets == NULL)
+		return CKR_HOST_MEMORY;
+
+	for (i = 0; i < session_bucket_count; i++) {
+		for (session = session_buckets[i]; session; session = next) {
+			next = session->index_next;
+			n = session_hash(session->handle, bucket_count);
+			session->index_next = buckets[n];
+			buckets[n] = session;
+		}
+	}
+	free(session_buckets);
+	session_buckets = buckets;
+	session_bucket_count = bucket_count;
+	return CKR_OK;
+}
+
+static CK_RV session_index_add(struct sc_pkcs11_session *session)
+{
+	size_t n;
+	CK_RV rv;
+
+	if (session_index_count >= session_bucket_count) {
+		rv = session_index_resize(session_bucket_count ?
+				2 * session_bucket_count : SESSION_INDEX_MIN_SIZE);
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	n = session_hash(session->handle, session_bucket_count);
+	session->index_next = session_buckets[n];
+	session_buckets[n] = session;
+	session_index_count++;
+	return CKR_OK;
+}
+
+static void session_index_remove(struct sc_pkcs11_session *session)
+{
+	struct sc_pkcs11_session **p;
+
+	if (session_buckets == NULL)
+		return;
+
+	for (p = &session_buckets[session_hash(session->handle, session_bucket_count)];
+			*p; p = &(*p)->index_next) {
+		if (*p == session) {
+			*p = session->index_next;
+			session->index_next = NULL;
+			session_index_count--;
+			return;
+		}
+	}
+}
+
+void session_index_free(void)
+{
+	free(session_buckets);
+	session_buckets = NULL;
+	session_bucket_count = 0;
+	session_index_count = 0;
+}
+
+struct sc_pkcs11_session *session_lookup(CK_SESSION_HANDLE hSession)
+{
+	struct sc_pkcs11_session *session;
+
+	if (session_buckets == NULL)
+		return NULL;
+
+	for (session = session_buckets[session_hash(hSession, session_bucket_count)];
+			session; session = session->index_next) {
+		if (session->handle == hSession)
+			return session;
+	}
+	return NULL;
+}
+
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
 {
-	*session = list_seek(&sessions, &hSession);
+	*session = session_lookup(hSession);
 	if (!*session)
 		return CKR_SESSION_HANDLE_INVALID;
 	return CKR_OK;
@@ -45,6 +150,7 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	struct sc_pkcs11_slot *slot;
 	struct sc_pkcs11_session *session;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (!(flags & CKF_SERIAL_SESSION))
 		return CKR_SESSION_PARALLEL_NOT_SUPPORTED;
 
@@ -61,13 +167,18 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	if (rv != CKR_OK)
 		goto out;
 
+	/* the application of the slot may not be bound yet */
+	rv = slot_bind_app(slot);
+	if (rv != CKR_OK)
+		goto out;
+
 	/* Check that no conflicting sessions exist */
 	if (!(flags & CKF_RW_SESSION) && (slot->login_user == CKU_SO)) {
 		rv = CKR_SESSION_READ_WRITE_SO_EXISTS;
 		goto out;
 	}
 
-	session = (struct sc_pkcs11_session *)calloc(1, sizeof(struct sc_pkcs11_session));
+	session = sc_mem_calloc(context, SC_MEM_PKCS11, 1, sizeof(struct sc_pkcs11_session));
 	if (session == NULL) {
 		rv = CKR_HOST_MEMORY;
 		goto out;
@@ -75,10 +186,10 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 
 	/* make session handle from pointer and check its uniqueness */
 	session->handle = (CK_SESSION_HANDLE)(uintptr_t)session;
-	if (list_seek(&sessions, &session->handle) != NULL) {
+	if (session_lookup(session->handle) != NULL) {
 		sc_log(context, "C_OpenSession handle 0x%lx already exists", session->handle);
 
-		free(session);
+		sc_mem_free(session);
 
 		rv = CKR_HOST_MEMORY;
 		goto out;
@@ -88,6 +199,11 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	session->notify_callback = Notify;
 	session->notify_data = pApplication;
 	session->flags = flags;
+	if (session_index_add(session) != CKR_OK) {
+		sc_mem_free(session);
+		rv = CKR_HOST_MEMORY;
+		goto out;
+	}
 	slot->nsessions++;
 	list_append(&sessions, session);
 	*phSession = session->handle;
@@ -105,10 +221,11 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 {
 	struct sc_pkcs11_slot *slot;
 	struct sc_pkcs11_session *session;
+	int i;
 
 	sc_log(context, "real C_CloseSession(0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
+	session = session_lookup(hSession);
 	if (!session)
 		return CKR_SESSION_HANDLE_INVALID;
 
@@ -127,9 +244,14 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 		}
 	}
 
+	for (i = 0; i < SC_PKCS11_OPERATION_MAX; i++)
+		session_stop_operation(session, i);
+	session_pool_clear(session);
+
+	session_index_remove(session);
 	if (list_delete(&sessions, session) != 0)
 		sc_log(context, "Could not delete session from list!");
-	free(session);
+	sc_mem_free(session);
 	return CKR_OK;
 }
 
@@ -153,14 +275,24 @@ CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
 	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_CloseSession(0x%lx)", hSession);
 
+	session = session_lookup(hSession);
+	if (session)
+		p11card = session->slot->p11card;
+
+	/* Wait for operations running in this session */
+	sc_pkcs11_card_lock(p11card);
 	rv = sc_pkcs11_close_session(hSession);
+	sc_pkcs11_card_unlock(p11card);
 
 	sc_pkcs11_unlock();
 	return rv;
@@ -171,6 +303,7 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 	CK_RV rv;
 	struct sc_pkcs11_slot *slot;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
@@ -181,7 +314,9 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 	if (rv != CKR_OK)
 		goto out;
 
+	sc_pkcs11_card_lock(slot->p11card);
 	rv = sc_pkcs11_close_all_sessions(slotID);
+	sc_pkcs11_card_unlock(slot->p11card);
 
 out:
 	sc_pkcs11_unlock();
@@ -192,10 +327,12 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		       CK_SESSION_INFO_PTR pInfo)
 {				/* receives session information */
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 	int logged_out;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
@@ -205,7 +342,7 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	sc_log(context, "C_GetSessionInfo(hSession:0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
+	session = session_lookup(hSession);
 	if (!session) {
 		rv = CKR_SESSION_HANDLE_INVALID;
 		goto out;
@@ -217,6 +354,8 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	pInfo->ulDeviceError = 0;
 
 	slot = session->slot;
+	p11card = slot->p11card;
+	sc_pkcs11_card_lock(p11card);
 	logged_out = (slot_get_logged_in_state(slot) == SC_PIN_STATE_LOGGED_OUT);
 	if (logged_out && slot->login_user >= 0) {
 		slot->login_user = -1;
@@ -235,6 +374,7 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
+	sc_pkcs11_card_unlock(p11card);
 	sc_log(context, "C_GetSessionInfo(0x%lx) = %s", hSession, lookup_enum(RV_T, rv));
 	sc_pkcs11_unlock();
 	return rv;
@@ -244,6 +384,7 @@ CK_RV C_GetOperationState(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			  CK_BYTE_PTR pOperationState,	/* location receiving state */
 			  CK_ULONG_PTR pulOperationStateLen)
 {				/* location receiving state length */
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
@@ -253,18 +394,80 @@ CK_RV C_SetOperationState(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			  CK_OBJECT_HANDLE hEncryptionKey,	/* handle of en/decryption key */
 			  CK_OBJECT_HANDLE hAuthenticationKey)
 {				/* handle of sign/verify key */
+	SC_PROBE1(pkcs11_call, __func__);
 	return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
+/* Logs the other tokens of the pool of 'slot' (see token_pool) in like
+ * 'slot', so that they can take over its operations. Tokens refusing the
+ * PIN just stay out of the pool. Called with the global lock held. */
+static void
+pool_login(struct sc_pkcs11_slot *slot, CK_USER_TYPE userType,
+		CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
+{
+	unsigned int i;
+
+	for (i = 0; i < list_size(&virtual_slots); i++) {
+		struct sc_pkcs11_slot *member = virtual_slot_table[i];
+		struct sc_pkcs11_card *p11card = member->p11card;
+		CK_RV rv;
+
+		if (!slot_pool_member(slot, member) || member->login_user >= 0)
+			continue;
+
+		sc_pkcs11_card_lock(p11card);
+		rv = restore_login_state(member);
+		if (rv == CKR_OK)
+			rv = p11card->framework->login(member, userType, pPin, ulPinLen);
+		if (rv == CKR_OK)
+			rv = push_login_state(member, userType, pPin, ulPinLen);
+		if (rv == CKR_OK) {
+			member->login_user = (int) userType;
+			member->flags |= SC_PKCS11_SLOT_FLAG_POOL_LOGIN;
+		}
+		rv = reset_login_state(member, rv);
+		sc_pkcs11_card_unlock(p11card);
+		sc_log(context, "Slot 0x%lx joined the pool of slot 0x%lx: 0x%lx",
+				member->id, slot->id, rv);
+	}
+}
+
+/* Logs out the tokens logged in by pool_login() */
+static void
+pool_logout(struct sc_pkcs11_slot *slot)
+{
+	unsigned int i;
+
+	for (i = 0; i < list_size(&virtual_slots); i++) {
+		struct sc_pkcs11_slot *member = virtual_slot_table[i];
+		struct sc_pkcs11_card *p11card = member->p11card;
+
+		if (!(member->flags & SC_PKCS11_SLOT_FLAG_POOL_LOGIN)
+				|| !slot_pool_member(slot, member))
+			continue;
+
+		sc_pkcs11_card_lock(p11card);
+		member->flags &= ~SC_PKCS11_SLOT_FLAG_POOL_LOGIN;
+		member->login_user = -1;
+		if (sc_pkcs11_conf.atomic)
+			pop_all_login_states(member);
+		else
+			p11card->framework->logout(member);
+		sc_pkcs11_card_unlock(p11card);
+	}
+}
+
 CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	      CK_USER_TYPE userType,	/* the user type */
 	      CK_CHAR_PTR pPin,	/* the user's PIN */
 	      CK_ULONG ulPinLen)
 {				/* the length of the PIN */
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
@@ -276,7 +479,7 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = CKR_USER_TYPE_INVALID;
 		goto out;
 	}
-	session = list_seek(&sessions, &hSession);
+	session = session_lookup(hSession);
 	if (!session) {
 		rv = CKR_SESSION_HANDLE_INVALID;
 		goto out;
@@ -285,7 +488,11 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	sc_log(context, "C_Login(0x%lx, %lu)", hSession, userType);
 
 	slot = session->slot;
+	/* the PIN status in token_info changes */
+	slot->token_info_expires = 0;
 
+	p11card = slot->p11card;
+	sc_pkcs11_card_lock(p11card);
 	if (!(slot->token_info.flags & CKF_USER_PIN_INITIALIZED) && userType == CKU_USER) {
 		rv = CKR_USER_PIN_NOT_INITIALIZED;
 		goto out;
@@ -317,8 +524,9 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		if (rv == CKR_OK) {
 			sc_log(context, "C_Login() userType %li", userType);
 			if (slot->p11card == NULL)
-				return CKR_TOKEN_NOT_RECOGNIZED;
-			rv = slot->p11card->framework->login(slot, userType, pPin, ulPinLen);
+				rv = CKR_TOKEN_NOT_RECOGNIZED;
+			else
+				rv = slot->p11card->framework->login(slot, userType, pPin, ulPinLen);
 			sc_log(context, "fLogin() rv %li", rv);
 		}
 		if (rv == CKR_OK)
@@ -327,9 +535,12 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			slot->login_user = (int) userType;
 		}
 		rv = reset_login_state(slot, rv);
+		if (rv == CKR_OK && sc_pkcs11_conf.token_pool)
+			pool_login(slot, userType, pPin, ulPinLen);
 	}
 
 out:
+	sc_pkcs11_card_unlock(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -337,14 +548,16 @@ out:
 CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
+	session = session_lookup(hSession);
 	if (!session) {
 		rv = CKR_SESSION_HANDLE_INVALID;
 		goto out;
@@ -353,30 +566,105 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	sc_log(context, "C_Logout(hSession:0x%lx)", hSession);
 
 	slot = session->slot;
+	slot->token_info_expires = 0;
 
+	p11card = slot->p11card;
+	sc_pkcs11_card_lock(p11card);
 	if (slot->login_user >= 0) {
 		slot->login_user = -1;
 		if (sc_pkcs11_conf.atomic)
 			pop_all_login_states(slot);
 		else {
 			if (!slot->p11card)
-				return CKR_TOKEN_NOT_RECOGNIZED;
-			rv = slot->p11card->framework->logout(slot);
+				rv = CKR_TOKEN_NOT_RECOGNIZED;
+			else
+				rv = slot->p11card->framework->logout(slot);
 		}
+		if (sc_pkcs11_conf.token_pool)
+			pool_logout(slot);
 	} else
 		rv = CKR_USER_NOT_LOGGED_IN;
 
 out:
+	sc_pkcs11_card_unlock(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
 
+/* The PINs of the cards have no user names, so the name is ignored */
+CK_RV C_LoginUser(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		  CK_USER_TYPE userType,	/* the user type */
+		  CK_UTF8CHAR_PTR pPin,	/* the user's PIN */
+		  CK_ULONG ulPinLen,	/* the length of the PIN */
+		  CK_UTF8CHAR_PTR pUsername,	/* the user's name */
+		  CK_ULONG ulUsernameLen)	/* the length of the user's name */
+{
+	SC_PROBE1(pkcs11_call, __func__);
+	return C_Login(hSession, userType, pPin, ulPinLen);
+}
+
+CK_RV C_SessionCancel(CK_SESSION_HANDLE hSession, CK_FLAGS flags)
+{
+	static const struct {
+		CK_FLAGS flag;
+		int type;
+	} operations[] = {
+		{ CKF_ENCRYPT, SC_PKCS11_OPERATION_ENCRYPT },
+		{ CKF_DECRYPT, SC_PKCS11_OPERATION_DECRYPT },
+		{ CKF_DIGEST, SC_PKCS11_OPERATION_DIGEST },
+		{ CKF_SIGN, SC_PKCS11_OPERATION_SIGN },
+		{ CKF_VERIFY, SC_PKCS11_OPERATION_VERIFY },
+		{ CKF_DERIVE, SC_PKCS11_OPERATION_DERIVE },
+		{ CKF_WRAP, SC_PKCS11_OPERATION_WRAP },
+		{ CKF_UNWRAP, SC_PKCS11_OPERATION_UNWRAP },
+		{ CKF_FIND_OBJECTS, SC_PKCS11_OPERATION_FIND },
+	};
+	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
+	struct sc_pkcs11_session *session;
+	unsigned int i;
+
+	SC_PROBE1(pkcs11_call, __func__);
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	session = session_lookup(hSession);
+	if (!session) {
+		rv = CKR_SESSION_HANDLE_INVALID;
+		goto out;
+	}
+
+	sc_log(context, "C_SessionCancel(hSession:0x%lx, flags:0x%lx)", hSession, flags);
+
+	p11card = sc_pkcs11_lock_slot(session->slot);
+	for (i = 0; i < sizeof(operations) / sizeof(operations[0]); i++)
+		if ((flags & operations[i].flag) && session->operation[operations[i].type])
+			session_stop_operation(session, operations[i].type);
+	/* message-based operations stay initialized, only the current
+	 * message is canceled */
+	if ((flags & CKF_MESSAGE_SIGN) && session->message_sign.in_progress)
+		session_stop_operation(session, SC_PKCS11_OPERATION_SIGN);
+	if ((flags & CKF_MESSAGE_VERIFY) && session->message_verify.in_progress)
+		session_stop_operation(session, SC_PKCS11_OPERATION_VERIFY);
+	if (session->operation[SC_PKCS11_OPERATION_SIGN] == NULL)
+		session->message_sign.in_progress = 0;
+	if (session->operation[SC_PKCS11_OPERATION_VERIFY] == NULL)
+		session->message_verify.in_progress = 0;
+
+out:
+	sc_pkcs11_unlock_slot(p11card);
+	return rv;
+}
+
 CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 {
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	sc_log(context, "C_InitPIN() called, pin '%s'", pPin ? (char *) pPin : "<null>");
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
@@ -385,7 +673,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
+	session = session_lookup(hSession);
 	if (!session) {
 		rv = CKR_SESSION_HANDLE_INVALID;
 		goto out;
@@ -397,6 +685,9 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	}
 
 	slot = session->slot;
+	slot->token_info_expires = 0;
+	p11card = slot->p11card;
+	sc_pkcs11_card_lock(p11card);
 	if (slot->login_user != CKU_SO) {
 		rv = CKR_USER_NOT_LOGGED_IN;
 	} else if (slot->p11card == NULL || slot->p11card->framework->init_pin == NULL) {
@@ -411,6 +702,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	}
 
 out:
+	sc_pkcs11_card_unlock(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -419,9 +711,11 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	       CK_CHAR_PTR pOldPin, CK_ULONG ulOldLen, CK_CHAR_PTR pNewPin, CK_ULONG ulNewLen)
 {
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
+	SC_PROBE1(pkcs11_call, __func__);
 	if ((pOldPin == NULL_PTR && ulOldLen > 0) || (pNewPin == NULL_PTR && ulNewLen > 0))
 		return CKR_ARGUMENTS_BAD;
 
@@ -429,13 +723,16 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
+	session = session_lookup(hSession);
 	if (!session) {
 		rv = CKR_SESSION_HANDLE_INVALID;
 		goto out;
 	}
 
 	slot = session->slot;
+	slot->token_info_expires = 0;
+	p11card = slot->p11card;
+	sc_pkcs11_card_lock(p11card);
 	sc_log(context, "Changing PIN (session 0x%lx; login user %d)", hSession, slot->login_user);
 
 	if (!(session->flags & CKF_RW_SESSION)) {
@@ -446,12 +743,14 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	rv = restore_login_state(slot);
 	if (rv == CKR_OK) {
 		if (slot->p11card == NULL)
-			return CKR_TOKEN_NOT_RECOGNIZED;
-		rv = slot->p11card->framework->change_pin(slot, pOldPin, ulOldLen, pNewPin, ulNewLen);
+			rv = CKR_TOKEN_NOT_RECOGNIZED;
+		else
+			rv = slot->p11card->framework->change_pin(slot, pOldPin, ulOldLen, pNewPin, ulNewLen);
 	}
 	rv = reset_login_state(slot, rv);
 
 out:
+	sc_pkcs11_card_unlock(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
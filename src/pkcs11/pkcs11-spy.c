@@ -21,6 +21,9 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -29,6 +32,9 @@
 #else
 #include <sys/time.h>
 #include <time.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #endif
 
 #define CRYPTOKI_EXPORTS
@@ -48,11 +54,1145 @@ static void *modhandle = NULL;
 /* Spy module output */
 static FILE *spy_output = NULL;
 
+/*
+ * Statistics mode, enabled with the PKCS11SPY_STATS environment variable.
+ * Instead of logging every call, the function list returned to the
+ * application points to thin wrappers which only count the calls, the
+ * errors and the time spent in the real module, per function and per
+ * slot. The totals are written to the spy output at C_Finalize and, if
+ * PKCS11SPY_STATS_INTERVAL is set, every that many seconds.
+ */
+#define STATS_FUNCTIONS	(sizeof(CK_FUNCTION_LIST) / sizeof(CK_VOID_PTR) + 1)
+#define STATS_INDEX(name)	(offsetof(CK_FUNCTION_LIST, name) / sizeof(CK_VOID_PTR))
+#define STATS_MAX_SLOTS	16
+#define STATS_MAX_SESSIONS	512
+
+enum { STATS_NONE, STATS_SLOT, STATS_SESSION };
+
+struct stats_counter {
+	unsigned long count;
+	unsigned long errors;
+	unsigned long long total_us;
+	unsigned long long max_us;
+};
+
+static int spy_stats = 0;
+static unsigned long long stats_interval_us = 0;
+static unsigned long long stats_last_dump = 0;
+static struct {
+	const char *name;
+	struct stats_counter c;
+} stats_functions[STATS_FUNCTIONS];
+static struct {
+	int used;
+	CK_SLOT_ID slot;
+	struct stats_counter c;
+} stats_slots[STATS_MAX_SLOTS];
+/* open addressing, used is 0 for a free entry and 2 for a removed one */
+static struct {
+	int used;
+	CK_SESSION_HANDLE session;
+	CK_SLOT_ID slot;
+} stats_sessions[STATS_MAX_SESSIONS];
+
+#if defined(_WIN32)
+static CRITICAL_SECTION stats_lock;
+#define STATS_LOCK()	EnterCriticalSection(&stats_lock)
+#define STATS_UNLOCK()	LeaveCriticalSection(&stats_lock)
+#elif defined(HAVE_PTHREAD)
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#define STATS_LOCK()	pthread_mutex_lock(&stats_lock)
+#define STATS_UNLOCK()	pthread_mutex_unlock(&stats_lock)
+#else
+#define STATS_LOCK()
+#define STATS_UNLOCK()
+#endif
+
+static unsigned long long
+stats_now(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000
+		+ (unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timeval tv;
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (unsigned long long)ts.tv_sec * 1000000 + (unsigned long long)ts.tv_nsec / 1000;
+#endif
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000000 + (unsigned long long)tv.tv_usec;
+#endif
+}
+
+static size_t
+stats_session_find(CK_SESSION_HANDLE session, int insert)
+{
+	size_t i, n, free_entry = STATS_MAX_SESSIONS;
+
+	for (n = 0, i = session % STATS_MAX_SESSIONS; n < STATS_MAX_SESSIONS;
+			n++, i = (i + 1) % STATS_MAX_SESSIONS) {
+		if (stats_sessions[i].used == 1 && stats_sessions[i].session == session)
+			return i;
+		if (stats_sessions[i].used != 1 && free_entry == STATS_MAX_SESSIONS)
+			free_entry = i;
+		if (stats_sessions[i].used == 0)
+			break;
+	}
+	return insert ? free_entry : STATS_MAX_SESSIONS;
+}
+
+static void
+stats_add(struct stats_counter *c, unsigned long long us, CK_RV rv)
+{
+	c->count++;
+	if (rv != CKR_OK)
+		c->errors++;
+	c->total_us += us;
+	if (us > c->max_us)
+		c->max_us = us;
+}
+
+static void
+stats_print(const char *name, const struct stats_counter *c)
+{
+	fprintf(spy_output, "%-24s %10lu %8lu %12.3f %10llu %10llu\n", name,
+			c->count, c->errors, (double)c->total_us / 1000,
+			c->total_us / c->count, c->max_us);
+}
+
+/* Called with the lock held */
+static void
+stats_dump(void)
+{
+	char name[32];
+	size_t i;
+
+	fprintf(spy_output, "\n*************** PKCS#11 spy statistics *****************\n");
+	fprintf(spy_output, "%-24s %10s %8s %12s %10s %10s\n",
+			"Function", "Calls", "Errors", "Total ms", "Avg us", "Max us");
+	for (i = 0; i < STATS_FUNCTIONS; i++)
+		if (stats_functions[i].c.count)
+			stats_print(stats_functions[i].name, &stats_functions[i].c);
+	for (i = 0; i < STATS_MAX_SLOTS; i++) {
+		if (!stats_slots[i].used || !stats_slots[i].c.count)
+			continue;
+		snprintf(name, sizeof name, "Slot 0x%lx", stats_slots[i].slot);
+		stats_print(name, &stats_slots[i].c);
+	}
+	fflush(spy_output);
+}
+
+static void
+stats_record(size_t index, const char *name, int kind, CK_ULONG id,
+		unsigned long long start, CK_RV rv)
+{
+	unsigned long long now = stats_now(), us = now - start;
+	size_t i;
+
+	STATS_LOCK();
+	stats_functions[index].name = name;
+	stats_add(&stats_functions[index].c, us, rv);
+
+	if (kind == STATS_SESSION) {
+		i = stats_session_find(id, 0);
+		if (i < STATS_MAX_SESSIONS) {
+			id = stats_sessions[i].slot;
+			kind = STATS_SLOT;
+		}
+	}
+	if (kind == STATS_SLOT) {
+		for (i = 0; i < STATS_MAX_SLOTS; i++) {
+			if (!stats_slots[i].used) {
+				stats_slots[i].used = 1;
+				stats_slots[i].slot = id;
+			}
+			if (stats_slots[i].slot == id) {
+				stats_add(&stats_slots[i].c, us, rv);
+				break;
+			}
+		}
+	}
+
+	if (stats_interval_us && now - stats_last_dump >= stats_interval_us) {
+		stats_dump();
+		stats_last_dump = now;
+	}
+	STATS_UNLOCK();
+}
+
+#define SPY_STATS(name, kind, id, params, args) \
+static CK_RV \
+stats_##name params \
+{ \
+	unsigned long long start = stats_now(); \
+	CK_RV rv = po->name args; \
+	stats_record(STATS_INDEX(name), #name, kind, (CK_ULONG)(id), start, rv); \
+	return rv; \
+}
+
+SPY_STATS(C_Initialize, STATS_NONE, 0,
+	(CK_VOID_PTR pInitArgs),
+	(pInitArgs))
+SPY_STATS(C_GetInfo, STATS_NONE, 0,
+	(CK_INFO_PTR pInfo),
+	(pInfo))
+SPY_STATS(C_GetSlotList, STATS_NONE, 0,
+	(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList, CK_ULONG_PTR pulCount),
+	(tokenPresent, pSlotList, pulCount))
+SPY_STATS(C_GetSlotInfo, STATS_SLOT, slotID,
+	(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo),
+	(slotID, pInfo))
+SPY_STATS(C_GetTokenInfo, STATS_SLOT, slotID,
+	(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo),
+	(slotID, pInfo))
+SPY_STATS(C_GetMechanismList, STATS_SLOT, slotID,
+	(CK_SLOT_ID slotID, CK_MECHANISM_TYPE_PTR pMechanismList, CK_ULONG_PTR pulCount),
+	(slotID, pMechanismList, pulCount))
+SPY_STATS(C_GetMechanismInfo, STATS_SLOT, slotID,
+	(CK_SLOT_ID slotID, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_PTR pInfo),
+	(slotID, type, pInfo))
+SPY_STATS(C_InitToken, STATS_SLOT, slotID,
+	(CK_SLOT_ID slotID, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen, CK_UTF8CHAR_PTR pLabel),
+	(slotID, pPin, ulPinLen, pLabel))
+SPY_STATS(C_InitPIN, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen),
+	(hSession, pPin, ulPinLen))
+SPY_STATS(C_SetPIN, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pOldPin, CK_ULONG ulOldLen, CK_UTF8CHAR_PTR pNewPin, CK_ULONG ulNewLen),
+	(hSession, pOldPin, ulOldLen, pNewPin, ulNewLen))
+SPY_STATS(C_GetSessionInfo, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo),
+	(hSession, pInfo))
+SPY_STATS(C_GetOperationState, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState, CK_ULONG_PTR pulOperationStateLen),
+	(hSession, pOperationState, pulOperationStateLen))
+SPY_STATS(C_SetOperationState, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState, CK_ULONG ulOperationStateLen, CK_OBJECT_HANDLE hEncryptionKey, CK_OBJECT_HANDLE hAuthenticationKey),
+	(hSession, pOperationState, ulOperationStateLen, hEncryptionKey, hAuthenticationKey))
+SPY_STATS(C_Login, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen),
+	(hSession, userType, pPin, ulPinLen))
+SPY_STATS(C_Logout, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession),
+	(hSession))
+SPY_STATS(C_CreateObject, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phObject),
+	(hSession, pTemplate, ulCount, phObject))
+SPY_STATS(C_CopyObject, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phNewObject),
+	(hSession, hObject, pTemplate, ulCount, phNewObject))
+SPY_STATS(C_DestroyObject, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject),
+	(hSession, hObject))
+SPY_STATS(C_GetObjectSize, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ULONG_PTR pulSize),
+	(hSession, hObject, pulSize))
+SPY_STATS(C_GetAttributeValue, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount),
+	(hSession, hObject, pTemplate, ulCount))
+SPY_STATS(C_SetAttributeValue, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount),
+	(hSession, hObject, pTemplate, ulCount))
+SPY_STATS(C_FindObjectsInit, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount),
+	(hSession, pTemplate, ulCount))
+SPY_STATS(C_FindObjects, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject, CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount),
+	(hSession, phObject, ulMaxObjectCount, pulObjectCount))
+SPY_STATS(C_FindObjectsFinal, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession),
+	(hSession))
+SPY_STATS(C_EncryptInit, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+	(hSession, pMechanism, hKey))
+SPY_STATS(C_Encrypt, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen),
+	(hSession, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen))
+SPY_STATS(C_EncryptUpdate, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen),
+	(hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen))
+SPY_STATS(C_EncryptFinal, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastEncryptedPart, CK_ULONG_PTR pulLastEncryptedPartLen),
+	(hSession, pLastEncryptedPart, pulLastEncryptedPartLen))
+SPY_STATS(C_DecryptInit, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+	(hSession, pMechanism, hKey))
+SPY_STATS(C_Decrypt, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen),
+	(hSession, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen))
+SPY_STATS(C_DecryptUpdate, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen),
+	(hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen))
+SPY_STATS(C_DecryptFinal, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastPart, CK_ULONG_PTR pulLastPartLen),
+	(hSession, pLastPart, pulLastPartLen))
+SPY_STATS(C_DigestInit, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism),
+	(hSession, pMechanism))
+SPY_STATS(C_Digest, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen),
+	(hSession, pData, ulDataLen, pDigest, pulDigestLen))
+SPY_STATS(C_DigestUpdate, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen),
+	(hSession, pPart, ulPartLen))
+SPY_STATS(C_DigestKey, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey),
+	(hSession, hKey))
+SPY_STATS(C_DigestFinal, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen),
+	(hSession, pDigest, pulDigestLen))
+SPY_STATS(C_SignInit, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+	(hSession, pMechanism, hKey))
+SPY_STATS(C_Sign, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen),
+	(hSession, pData, ulDataLen, pSignature, pulSignatureLen))
+SPY_STATS(C_SignUpdate, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen),
+	(hSession, pPart, ulPartLen))
+SPY_STATS(C_SignFinal, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen),
+	(hSession, pSignature, pulSignatureLen))
+SPY_STATS(C_SignRecoverInit, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+	(hSession, pMechanism, hKey))
+SPY_STATS(C_SignRecover, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen),
+	(hSession, pData, ulDataLen, pSignature, pulSignatureLen))
+SPY_STATS(C_VerifyInit, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+	(hSession, pMechanism, hKey))
+SPY_STATS(C_Verify, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen),
+	(hSession, pData, ulDataLen, pSignature, ulSignatureLen))
+SPY_STATS(C_VerifyUpdate, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen),
+	(hSession, pPart, ulPartLen))
+SPY_STATS(C_VerifyFinal, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen),
+	(hSession, pSignature, ulSignatureLen))
+SPY_STATS(C_VerifyRecoverInit, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+	(hSession, pMechanism, hKey))
+SPY_STATS(C_VerifyRecover, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen),
+	(hSession, pSignature, ulSignatureLen, pData, pulDataLen))
+SPY_STATS(C_DigestEncryptUpdate, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen),
+	(hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen))
+SPY_STATS(C_DecryptDigestUpdate, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen),
+	(hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen))
+SPY_STATS(C_SignEncryptUpdate, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen),
+	(hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen))
+SPY_STATS(C_DecryptVerifyUpdate, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen),
+	(hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen))
+SPY_STATS(C_GenerateKey, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phKey),
+	(hSession, pMechanism, pTemplate, ulCount, phKey))
+SPY_STATS(C_GenerateKeyPair, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount, CK_ATTRIBUTE_PTR pPrivateKeyTemplate, CK_ULONG ulPrivateKeyAttributeCount, CK_OBJECT_HANDLE_PTR phPublicKey, CK_OBJECT_HANDLE_PTR phPrivateKey),
+	(hSession, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, phPublicKey, phPrivateKey))
+SPY_STATS(C_WrapKey, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hWrappingKey, CK_OBJECT_HANDLE hKey, CK_BYTE_PTR pWrappedKey, CK_ULONG_PTR pulWrappedKeyLen),
+	(hSession, pMechanism, hWrappingKey, hKey, pWrappedKey, pulWrappedKeyLen))
+SPY_STATS(C_UnwrapKey, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hUnwrappingKey, CK_BYTE_PTR pWrappedKey, CK_ULONG ulWrappedKeyLen, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey),
+	(hSession, pMechanism, hUnwrappingKey, pWrappedKey, ulWrappedKeyLen, pTemplate, ulAttributeCount, phKey))
+SPY_STATS(C_DeriveKey, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hBaseKey, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey),
+	(hSession, pMechanism, hBaseKey, pTemplate, ulAttributeCount, phKey))
+SPY_STATS(C_SeedRandom, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSeed, CK_ULONG ulSeedLen),
+	(hSession, pSeed, ulSeedLen))
+SPY_STATS(C_GenerateRandom, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR RandomData, CK_ULONG ulRandomLen),
+	(hSession, RandomData, ulRandomLen))
+SPY_STATS(C_GetFunctionStatus, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession),
+	(hSession))
+SPY_STATS(C_CancelFunction, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession),
+	(hSession))
+SPY_STATS(C_WaitForSlotEvent, STATS_NONE, 0,
+	(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_PTR pRserved),
+	(flags, pSlot, pRserved))
+
+static CK_RV
+stats_C_Finalize(CK_VOID_PTR pReserved)
+{
+	unsigned long long start = stats_now();
+	CK_RV rv = po->C_Finalize(pReserved);
+
+	stats_record(STATS_INDEX(C_Finalize), "C_Finalize", STATS_NONE, 0, start, rv);
+	STATS_LOCK();
+	stats_dump();
+	memset(stats_sessions, 0, sizeof stats_sessions);
+	STATS_UNLOCK();
+	return rv;
+}
+
+static CK_RV
+stats_C_OpenSession(CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApplication,
+		CK_NOTIFY Notify, CK_SESSION_HANDLE_PTR phSession)
+{
+	unsigned long long start = stats_now();
+	CK_RV rv = po->C_OpenSession(slotID, flags, pApplication, Notify, phSession);
+	size_t i;
+
+	if (rv == CKR_OK) {
+		STATS_LOCK();
+		i = stats_session_find(*phSession, 1);
+		if (i < STATS_MAX_SESSIONS) {
+			stats_sessions[i].used = 1;
+			stats_sessions[i].session = *phSession;
+			stats_sessions[i].slot = slotID;
+		}
+		STATS_UNLOCK();
+	}
+	stats_record(STATS_INDEX(C_OpenSession), "C_OpenSession", STATS_SLOT, slotID, start, rv);
+	return rv;
+}
+
+static CK_RV
+stats_C_CloseSession(CK_SESSION_HANDLE hSession)
+{
+	unsigned long long start = stats_now();
+	CK_RV rv = po->C_CloseSession(hSession);
+	size_t i;
+
+	stats_record(STATS_INDEX(C_CloseSession), "C_CloseSession", STATS_SESSION, hSession, start, rv);
+	STATS_LOCK();
+	i = stats_session_find(hSession, 0);
+	if (i < STATS_MAX_SESSIONS)
+		stats_sessions[i].used = 2;
+	STATS_UNLOCK();
+	return rv;
+}
+
+static CK_RV
+stats_C_CloseAllSessions(CK_SLOT_ID slotID)
+{
+	unsigned long long start = stats_now();
+	CK_RV rv = po->C_CloseAllSessions(slotID);
+	size_t i;
+
+	stats_record(STATS_INDEX(C_CloseAllSessions), "C_CloseAllSessions", STATS_SLOT, slotID, start, rv);
+	STATS_LOCK();
+	for (i = 0; i < STATS_MAX_SESSIONS; i++)
+		if (stats_sessions[i].used == 1 && stats_sessions[i].slot == slotID)
+			stats_sessions[i].used = 2;
+	STATS_UNLOCK();
+	return rv;
+}
+
+static void
+stats_function_list(CK_FUNCTION_LIST_PTR list)
+{
+	list->C_GetFunctionList = C_GetFunctionList;
+	list->C_Initialize = stats_C_Initialize;
+	list->C_Finalize = stats_C_Finalize;
+	list->C_GetInfo = stats_C_GetInfo;
+	list->C_GetSlotList = stats_C_GetSlotList;
+	list->C_GetSlotInfo = stats_C_GetSlotInfo;
+	list->C_GetTokenInfo = stats_C_GetTokenInfo;
+	list->C_GetMechanismList = stats_C_GetMechanismList;
+	list->C_GetMechanismInfo = stats_C_GetMechanismInfo;
+	list->C_InitToken = stats_C_InitToken;
+	list->C_InitPIN = stats_C_InitPIN;
+	list->C_SetPIN = stats_C_SetPIN;
+	list->C_OpenSession = stats_C_OpenSession;
+	list->C_CloseSession = stats_C_CloseSession;
+	list->C_CloseAllSessions = stats_C_CloseAllSessions;
+	list->C_GetSessionInfo = stats_C_GetSessionInfo;
+	list->C_GetOperationState = stats_C_GetOperationState;
+	list->C_SetOperationState = stats_C_SetOperationState;
+	list->C_Login = stats_C_Login;
+	list->C_Logout = stats_C_Logout;
+	list->C_CreateObject = stats_C_CreateObject;
+	list->C_CopyObject = stats_C_CopyObject;
+	list->C_DestroyObject = stats_C_DestroyObject;
+	list->C_GetObjectSize = stats_C_GetObjectSize;
+	list->C_GetAttributeValue = stats_C_GetAttributeValue;
+	list->C_SetAttributeValue = stats_C_SetAttributeValue;
+	list->C_FindObjectsInit = stats_C_FindObjectsInit;
+	list->C_FindObjects = stats_C_FindObjects;
+	list->C_FindObjectsFinal = stats_C_FindObjectsFinal;
+	list->C_EncryptInit = stats_C_EncryptInit;
+	list->C_Encrypt = stats_C_Encrypt;
+	list->C_EncryptUpdate = stats_C_EncryptUpdate;
+	list->C_EncryptFinal = stats_C_EncryptFinal;
+	list->C_DecryptInit = stats_C_DecryptInit;
+	list->C_Decrypt = stats_C_Decrypt;
+	list->C_DecryptUpdate = stats_C_DecryptUpdate;
+	list->C_DecryptFinal = stats_C_DecryptFinal;
+	list->C_DigestInit = stats_C_DigestInit;
+	list->C_Digest = stats_C_Digest;
+	list->C_DigestUpdate = stats_C_DigestUpdate;
+	list->C_DigestKey = stats_C_DigestKey;
+	list->C_DigestFinal = stats_C_DigestFinal;
+	list->C_SignInit = stats_C_SignInit;
+	list->C_Sign = stats_C_Sign;
+	list->C_SignUpdate = stats_C_SignUpdate;
+	list->C_SignFinal = stats_C_SignFinal;
+	list->C_SignRecoverInit = stats_C_SignRecoverInit;
+	list->C_SignRecover = stats_C_SignRecover;
+	list->C_VerifyInit = stats_C_VerifyInit;
+	list->C_Verify = stats_C_Verify;
+	list->C_VerifyUpdate = stats_C_VerifyUpdate;
+	list->C_VerifyFinal = stats_C_VerifyFinal;
+	list->C_VerifyRecoverInit = stats_C_VerifyRecoverInit;
+	list->C_VerifyRecover = stats_C_VerifyRecover;
+	list->C_DigestEncryptUpdate = stats_C_DigestEncryptUpdate;
+	list->C_DecryptDigestUpdate = stats_C_DecryptDigestUpdate;
+	list->C_SignEncryptUpdate = stats_C_SignEncryptUpdate;
+	list->C_DecryptVerifyUpdate = stats_C_DecryptVerifyUpdate;
+	list->C_GenerateKey = stats_C_GenerateKey;
+	list->C_GenerateKeyPair = stats_C_GenerateKeyPair;
+	list->C_WrapKey = stats_C_WrapKey;
+	list->C_UnwrapKey = stats_C_UnwrapKey;
+	list->C_DeriveKey = stats_C_DeriveKey;
+	list->C_SeedRandom = stats_C_SeedRandom;
+	list->C_GenerateRandom = stats_C_GenerateRandom;
+	list->C_GetFunctionStatus = stats_C_GetFunctionStatus;
+	list->C_CancelFunction = stats_C_CancelFunction;
+	list->C_WaitForSlotEvent = stats_C_WaitForSlotEvent;
+}
+
+/*
+ * Trace mode, enabled with PKCS11SPY_TRACE=<file>. Like the statistics
+ * mode it hands thin wrappers to the application, which append every call
+ * to the file as one JSON object per line, to be re-issued with
+ * pkcs11-replay. A record holds the start of the call in microseconds
+ * since the spy was loaded ("t"), its duration ("us"), the function
+ * ("fn"), its result ("rv") and the arguments needed to repeat it:
+ * slots, sessions, object handles, mechanisms, the types and lengths of
+ * templates and the lengths of data and output buffers. PINs, keys and
+ * data are never written; of the search templates only the values of the
+ * attributes that identify objects are kept. The trace takes precedence
+ * over the statistics mode.
+ */
+#define TRACE_RECORD_SIZE	8192
+
+struct trace_record {
+	char buf[TRACE_RECORD_SIZE];
+	size_t len;
+	unsigned long long start;
+};
+
+static FILE *trace_output = NULL;
+static unsigned long long trace_epoch = 0;
+
+static void
+trace_printf(struct trace_record *r, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (r->len >= sizeof r->buf)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(r->buf + r->len, sizeof r->buf - r->len, fmt, ap);
+	va_end(ap);
+	/* a record that does not fit is dropped in trace_end() */
+	r->len = n < 0 ? sizeof r->buf : r->len + (size_t)n;
+}
+
+static void
+trace_begin(struct trace_record *r)
+{
+	r->len = 0;
+	r->start = stats_now();
+}
+
+static void
+trace_end(struct trace_record *r, const char *name, CK_RV rv)
+{
+	unsigned long long now = stats_now();
+
+	if (r->len >= sizeof r->buf)
+		r->len = 0;
+	STATS_LOCK();
+	fprintf(trace_output, "{\"t\":%llu,\"us\":%llu,\"fn\":\"%s\",\"rv\":%lu%.*s}\n",
+			r->start - trace_epoch, now - r->start, name, (unsigned long)rv,
+			(int)r->len, r->buf);
+	if (!strcmp(name, "C_Finalize"))
+		fflush(trace_output);
+	STATS_UNLOCK();
+}
+
+static void
+trace_ulong(struct trace_record *r, const char *key, CK_ULONG value)
+{
+	trace_printf(r, ",\"%s\":%lu", key, (unsigned long)value);
+}
+
+/* length of an output buffer, -1 for a length query */
+static void
+trace_outbuf(struct trace_record *r, const char *key, CK_VOID_PTR buf, CK_ULONG_PTR len)
+{
+	if (len == NULL)
+		return;
+	if (buf == NULL)
+		trace_printf(r, ",\"%s\":-1", key);
+	else
+		trace_ulong(r, key, *len);
+}
+
+static void
+trace_handles(struct trace_record *r, const char *key, const CK_ULONG *handles, CK_ULONG count)
+{
+	CK_ULONG i;
+
+	trace_printf(r, ",\"%s\":[", key);
+	for (i = 0; handles != NULL && i < count; i++)
+		trace_printf(r, "%s%lu", i ? "," : "", (unsigned long)handles[i]);
+	trace_printf(r, "]");
+}
+
+static void
+trace_mechanism(struct trace_record *r, CK_MECHANISM_PTR mech)
+{
+	if (mech == NULL)
+		return;
+	trace_ulong(r, "mech", mech->mechanism);
+	trace_ulong(r, "mparam", mech->ulParameterLen);
+}
+
+/* the attributes whose values are kept in search templates */
+static int
+trace_keep_value(CK_ATTRIBUTE_TYPE type)
+{
+	switch (type) {
+	case CKA_CLASS:
+	case CKA_TOKEN:
+	case CKA_PRIVATE:
+	case CKA_LABEL:
+	case CKA_ID:
+	case CKA_KEY_TYPE:
+	case CKA_CERTIFICATE_TYPE:
+	case CKA_SIGN:
+	case CKA_VERIFY:
+	case CKA_ENCRYPT:
+	case CKA_DECRYPT:
+	case CKA_WRAP:
+	case CKA_UNWRAP:
+	case CKA_DERIVE:
+		return 1;
+	}
+	return 0;
+}
+
+/* [[type,length],...], or [[type,length,"hex value"],...] with values */
+static void
+trace_template(struct trace_record *r, const char *key, CK_ATTRIBUTE_PTR tmpl,
+		CK_ULONG count, int values)
+{
+	CK_ULONG i, j;
+
+	trace_printf(r, ",\"%s\":[", key);
+	for (i = 0; tmpl != NULL && i < count; i++) {
+		trace_printf(r, "%s[%lu,%ld", i ? "," : "", (unsigned long)tmpl[i].type,
+				(long)tmpl[i].ulValueLen);
+		if (values && tmpl[i].pValue != NULL && trace_keep_value(tmpl[i].type)
+				&& tmpl[i].ulValueLen <= 256) {
+			trace_printf(r, ",\"");
+			for (j = 0; j < tmpl[i].ulValueLen; j++)
+				trace_printf(r, "%02x", ((CK_BYTE_PTR)tmpl[i].pValue)[j]);
+			trace_printf(r, "\"");
+		}
+		trace_printf(r, "]");
+	}
+	trace_printf(r, "]");
+}
+
+/* calls of which only the slot or session is traced */
+#define SPY_TRACE(name, kind, id, params, args) \
+static CK_RV \
+trace_##name params \
+{ \
+	struct trace_record r; \
+	CK_RV rv; \
+	trace_begin(&r); \
+	rv = po->name args; \
+	if (kind != STATS_NONE) \
+		trace_ulong(&r, kind == STATS_SLOT ? "slot" : "session", (CK_ULONG)(id)); \
+	trace_end(&r, #name, rv); \
+	return rv; \
+}
+
+/* C_SignInit() and friends */
+#define SPY_TRACE_INIT(name) \
+static CK_RV \
+trace_##name(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey) \
+{ \
+	struct trace_record r; \
+	CK_RV rv; \
+	trace_begin(&r); \
+	rv = po->name(hSession, pMechanism, hKey); \
+	trace_ulong(&r, "session", hSession); \
+	trace_mechanism(&r, pMechanism); \
+	trace_ulong(&r, "key", hKey); \
+	trace_end(&r, #name, rv); \
+	return rv; \
+}
+
+/* C_Sign(), C_EncryptUpdate() and the other calls with input and output */
+#define SPY_TRACE_DATA(name) \
+static CK_RV \
+trace_##name(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pIn, CK_ULONG ulInLen, \
+		CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen) \
+{ \
+	struct trace_record r; \
+	CK_RV rv; \
+	trace_begin(&r); \
+	trace_ulong(&r, "session", hSession); \
+	trace_ulong(&r, "in", ulInLen); \
+	trace_outbuf(&r, "obuf", pOut, pulOutLen); \
+	rv = po->name(hSession, pIn, ulInLen, pOut, pulOutLen); \
+	if (pulOutLen != NULL) \
+		trace_ulong(&r, "out", *pulOutLen); \
+	trace_end(&r, #name, rv); \
+	return rv; \
+}
+
+/* C_SignUpdate(), C_VerifyFinal() and the other calls with input only */
+#define SPY_TRACE_IN(name) \
+static CK_RV \
+trace_##name(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pIn, CK_ULONG ulInLen) \
+{ \
+	struct trace_record r; \
+	CK_RV rv; \
+	trace_begin(&r); \
+	rv = po->name(hSession, pIn, ulInLen); \
+	trace_ulong(&r, "session", hSession); \
+	trace_ulong(&r, "in", ulInLen); \
+	trace_end(&r, #name, rv); \
+	return rv; \
+}
+
+/* C_SignFinal() and the other calls with output only */
+#define SPY_TRACE_OUT(name) \
+static CK_RV \
+trace_##name(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen) \
+{ \
+	struct trace_record r; \
+	CK_RV rv; \
+	trace_begin(&r); \
+	trace_ulong(&r, "session", hSession); \
+	trace_outbuf(&r, "obuf", pOut, pulOutLen); \
+	rv = po->name(hSession, pOut, pulOutLen); \
+	if (pulOutLen != NULL) \
+		trace_ulong(&r, "out", *pulOutLen); \
+	trace_end(&r, #name, rv); \
+	return rv; \
+}
+
+SPY_TRACE(C_GetInfo, STATS_NONE, 0,
+	(CK_INFO_PTR pInfo),
+	(pInfo))
+SPY_TRACE(C_GetSlotInfo, STATS_SLOT, slotID,
+	(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo),
+	(slotID, pInfo))
+SPY_TRACE(C_GetTokenInfo, STATS_SLOT, slotID,
+	(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo),
+	(slotID, pInfo))
+SPY_TRACE(C_InitToken, STATS_SLOT, slotID,
+	(CK_SLOT_ID slotID, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen, CK_UTF8CHAR_PTR pLabel),
+	(slotID, pPin, ulPinLen, pLabel))
+SPY_TRACE(C_InitPIN, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen),
+	(hSession, pPin, ulPinLen))
+SPY_TRACE(C_SetPIN, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pOldPin, CK_ULONG ulOldLen, CK_UTF8CHAR_PTR pNewPin, CK_ULONG ulNewLen),
+	(hSession, pOldPin, ulOldLen, pNewPin, ulNewLen))
+SPY_TRACE(C_CloseSession, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession),
+	(hSession))
+SPY_TRACE(C_CloseAllSessions, STATS_SLOT, slotID,
+	(CK_SLOT_ID slotID),
+	(slotID))
+SPY_TRACE(C_GetSessionInfo, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo),
+	(hSession, pInfo))
+SPY_TRACE(C_GetOperationState, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState, CK_ULONG_PTR pulOperationStateLen),
+	(hSession, pOperationState, pulOperationStateLen))
+SPY_TRACE(C_SetOperationState, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState, CK_ULONG ulOperationStateLen, CK_OBJECT_HANDLE hEncryptionKey, CK_OBJECT_HANDLE hAuthenticationKey),
+	(hSession, pOperationState, ulOperationStateLen, hEncryptionKey, hAuthenticationKey))
+SPY_TRACE(C_Logout, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession),
+	(hSession))
+SPY_TRACE(C_CreateObject, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phObject),
+	(hSession, pTemplate, ulCount, phObject))
+SPY_TRACE(C_CopyObject, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phNewObject),
+	(hSession, hObject, pTemplate, ulCount, phNewObject))
+SPY_TRACE(C_DestroyObject, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject),
+	(hSession, hObject))
+SPY_TRACE(C_GetObjectSize, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ULONG_PTR pulSize),
+	(hSession, hObject, pulSize))
+SPY_TRACE(C_SetAttributeValue, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount),
+	(hSession, hObject, pTemplate, ulCount))
+SPY_TRACE(C_FindObjectsFinal, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession),
+	(hSession))
+SPY_TRACE(C_DigestKey, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey),
+	(hSession, hKey))
+SPY_TRACE(C_GenerateKey, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phKey),
+	(hSession, pMechanism, pTemplate, ulCount, phKey))
+SPY_TRACE(C_GenerateKeyPair, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount, CK_ATTRIBUTE_PTR pPrivateKeyTemplate, CK_ULONG ulPrivateKeyAttributeCount, CK_OBJECT_HANDLE_PTR phPublicKey, CK_OBJECT_HANDLE_PTR phPrivateKey),
+	(hSession, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, phPublicKey, phPrivateKey))
+SPY_TRACE(C_WrapKey, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hWrappingKey, CK_OBJECT_HANDLE hKey, CK_BYTE_PTR pWrappedKey, CK_ULONG_PTR pulWrappedKeyLen),
+	(hSession, pMechanism, hWrappingKey, hKey, pWrappedKey, pulWrappedKeyLen))
+SPY_TRACE(C_UnwrapKey, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hUnwrappingKey, CK_BYTE_PTR pWrappedKey, CK_ULONG ulWrappedKeyLen, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey),
+	(hSession, pMechanism, hUnwrappingKey, pWrappedKey, ulWrappedKeyLen, pTemplate, ulAttributeCount, phKey))
+SPY_TRACE(C_DeriveKey, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hBaseKey, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey),
+	(hSession, pMechanism, hBaseKey, pTemplate, ulAttributeCount, phKey))
+SPY_TRACE(C_GetFunctionStatus, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession),
+	(hSession))
+SPY_TRACE(C_CancelFunction, STATS_SESSION, hSession,
+	(CK_SESSION_HANDLE hSession),
+	(hSession))
+SPY_TRACE(C_WaitForSlotEvent, STATS_NONE, 0,
+	(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_PTR pRserved),
+	(flags, pSlot, pRserved))
+
+SPY_TRACE_INIT(C_EncryptInit)
+SPY_TRACE_INIT(C_DecryptInit)
+SPY_TRACE_INIT(C_SignInit)
+SPY_TRACE_INIT(C_SignRecoverInit)
+SPY_TRACE_INIT(C_VerifyInit)
+SPY_TRACE_INIT(C_VerifyRecoverInit)
+
+SPY_TRACE_DATA(C_Encrypt)
+SPY_TRACE_DATA(C_EncryptUpdate)
+SPY_TRACE_DATA(C_Decrypt)
+SPY_TRACE_DATA(C_DecryptUpdate)
+SPY_TRACE_DATA(C_Digest)
+SPY_TRACE_DATA(C_Sign)
+SPY_TRACE_DATA(C_SignRecover)
+SPY_TRACE_DATA(C_VerifyRecover)
+SPY_TRACE_DATA(C_DigestEncryptUpdate)
+SPY_TRACE_DATA(C_DecryptDigestUpdate)
+SPY_TRACE_DATA(C_SignEncryptUpdate)
+SPY_TRACE_DATA(C_DecryptVerifyUpdate)
+
+SPY_TRACE_IN(C_DigestUpdate)
+SPY_TRACE_IN(C_SignUpdate)
+SPY_TRACE_IN(C_VerifyUpdate)
+SPY_TRACE_IN(C_VerifyFinal)
+SPY_TRACE_IN(C_SeedRandom)
+
+SPY_TRACE_OUT(C_EncryptFinal)
+SPY_TRACE_OUT(C_DecryptFinal)
+SPY_TRACE_OUT(C_DigestFinal)
+SPY_TRACE_OUT(C_SignFinal)
+
+static CK_RV
+trace_C_Initialize(CK_VOID_PTR pInitArgs)
+{
+	struct trace_record r;
+	CK_RV rv;
+
+	trace_begin(&r);
+	rv = po->C_Initialize(pInitArgs);
+	if (pInitArgs != NULL)
+		trace_ulong(&r, "flags", ((CK_C_INITIALIZE_ARGS *)pInitArgs)->flags);
+	trace_end(&r, "C_Initialize", rv);
+	return rv;
+}
+
+static CK_RV
+trace_C_Finalize(CK_VOID_PTR pReserved)
+{
+	struct trace_record r;
+	CK_RV rv;
+
+	trace_begin(&r);
+	rv = po->C_Finalize(pReserved);
+	trace_end(&r, "C_Finalize", rv);
+	return rv;
+}
+
+static CK_RV
+trace_C_GetSlotList(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList, CK_ULONG_PTR pulCount)
+{
+	struct trace_record r;
+	CK_RV rv;
+
+	trace_begin(&r);
+	trace_ulong(&r, "present", tokenPresent);
+	trace_outbuf(&r, "obuf", pSlotList, pulCount);
+	rv = po->C_GetSlotList(tokenPresent, pSlotList, pulCount);
+	if (rv == CKR_OK && pulCount != NULL)
+		trace_handles(&r, "slots", pSlotList, pSlotList ? *pulCount : 0);
+	trace_end(&r, "C_GetSlotList", rv);
+	return rv;
+}
+
+static CK_RV
+trace_C_GetMechanismList(CK_SLOT_ID slotID, CK_MECHANISM_TYPE_PTR pMechanismList,
+		CK_ULONG_PTR pulCount)
+{
+	struct trace_record r;
+	CK_RV rv;
+
+	trace_begin(&r);
+	trace_ulong(&r, "slot", slotID);
+	trace_outbuf(&r, "obuf", pMechanismList, pulCount);
+	rv = po->C_GetMechanismList(slotID, pMechanismList, pulCount);
+	if (pulCount != NULL)
+		trace_ulong(&r, "out", *pulCount);
+	trace_end(&r, "C_GetMechanismList", rv);
+	return rv;
+}
+
+static CK_RV
+trace_C_GetMechanismInfo(CK_SLOT_ID slotID, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_PTR pInfo)
+{
+	struct trace_record r;
+	CK_RV rv;
+
+	trace_begin(&r);
+	rv = po->C_GetMechanismInfo(slotID, type, pInfo);
+	trace_ulong(&r, "slot", slotID);
+	trace_ulong(&r, "mech", type);
+	trace_end(&r, "C_GetMechanismInfo", rv);
+	return rv;
+}
+
+static CK_RV
+trace_C_OpenSession(CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApplication,
+		CK_NOTIFY Notify, CK_SESSION_HANDLE_PTR phSession)
+{
+	struct trace_record r;
+	CK_RV rv;
+
+	trace_begin(&r);
+	rv = po->C_OpenSession(slotID, flags, pApplication, Notify, phSession);
+	trace_ulong(&r, "slot", slotID);
+	trace_ulong(&r, "flags", flags);
+	if (rv == CKR_OK && phSession != NULL)
+		trace_ulong(&r, "session", *phSession);
+	trace_end(&r, "C_OpenSession", rv);
+	return rv;
+}
+
+static CK_RV
+trace_C_Login(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin,
+		CK_ULONG ulPinLen)
+{
+	struct trace_record r;
+	CK_RV rv;
+
+	trace_begin(&r);
+	rv = po->C_Login(hSession, userType, pPin, ulPinLen);
+	trace_ulong(&r, "session", hSession);
+	trace_ulong(&r, "user", userType);
+	trace_ulong(&r, "pin", pPin != NULL);
+	trace_end(&r, "C_Login", rv);
+	return rv;
+}
+
+static CK_RV
+trace_C_GetAttributeValue(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	struct trace_record r;
+	CK_ULONG i;
+	CK_RV rv;
+
+	trace_begin(&r);
+	trace_ulong(&r, "session", hSession);
+	trace_ulong(&r, "object", hObject);
+	/* the buffer sizes, -1 for length queries */
+	trace_printf(&r, ",\"tmpl\":[");
+	for (i = 0; pTemplate != NULL && i < ulCount; i++)
+		trace_printf(&r, "%s[%lu,%ld]", i ? "," : "", (unsigned long)pTemplate[i].type,
+				pTemplate[i].pValue ? (long)pTemplate[i].ulValueLen : -1L);
+	trace_printf(&r, "]");
+	rv = po->C_GetAttributeValue(hSession, hObject, pTemplate, ulCount);
+	trace_end(&r, "C_GetAttributeValue", rv);
+	return rv;
+}
+
+static CK_RV
+trace_C_FindObjectsInit(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	struct trace_record r;
+	CK_RV rv;
+
+	trace_begin(&r);
+	rv = po->C_FindObjectsInit(hSession, pTemplate, ulCount);
+	trace_ulong(&r, "session", hSession);
+	trace_template(&r, "tmpl", pTemplate, ulCount, 1);
+	trace_end(&r, "C_FindObjectsInit", rv);
+	return rv;
+}
+
+static CK_RV
+trace_C_FindObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject,
+		CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount)
+{
+	struct trace_record r;
+	CK_RV rv;
+
+	trace_begin(&r);
+	rv = po->C_FindObjects(hSession, phObject, ulMaxObjectCount, pulObjectCount);
+	trace_ulong(&r, "session", hSession);
+	trace_ulong(&r, "max", ulMaxObjectCount);
+	if (rv == CKR_OK && pulObjectCount != NULL)
+		trace_handles(&r, "objects", phObject, *pulObjectCount);
+	trace_end(&r, "C_FindObjects", rv);
+	return rv;
+}
+
+static CK_RV
+trace_C_DigestInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism)
+{
+	struct trace_record r;
+	CK_RV rv;
+
+	trace_begin(&r);
+	rv = po->C_DigestInit(hSession, pMechanism);
+	trace_ulong(&r, "session", hSession);
+	trace_mechanism(&r, pMechanism);
+	trace_end(&r, "C_DigestInit", rv);
+	return rv;
+}
+
+static CK_RV
+trace_C_Verify(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+	struct trace_record r;
+	CK_RV rv;
+
+	trace_begin(&r);
+	rv = po->C_Verify(hSession, pData, ulDataLen, pSignature, ulSignatureLen);
+	trace_ulong(&r, "session", hSession);
+	trace_ulong(&r, "in", ulDataLen);
+	trace_ulong(&r, "sig", ulSignatureLen);
+	trace_end(&r, "C_Verify", rv);
+	return rv;
+}
+
+static CK_RV
+trace_C_GenerateRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR RandomData, CK_ULONG ulRandomLen)
+{
+	struct trace_record r;
+	CK_RV rv;
+
+	trace_begin(&r);
+	rv = po->C_GenerateRandom(hSession, RandomData, ulRandomLen);
+	trace_ulong(&r, "session", hSession);
+	trace_ulong(&r, "out", ulRandomLen);
+	trace_end(&r, "C_GenerateRandom", rv);
+	return rv;
+}
+
+static void
+trace_function_list(CK_FUNCTION_LIST_PTR list)
+{
+	list->C_GetFunctionList = C_GetFunctionList;
+	list->C_Initialize = trace_C_Initialize;
+	list->C_Finalize = trace_C_Finalize;
+	list->C_GetInfo = trace_C_GetInfo;
+	list->C_GetSlotList = trace_C_GetSlotList;
+	list->C_GetSlotInfo = trace_C_GetSlotInfo;
+	list->C_GetTokenInfo = trace_C_GetTokenInfo;
+	list->C_GetMechanismList = trace_C_GetMechanismList;
+	list->C_GetMechanismInfo = trace_C_GetMechanismInfo;
+	list->C_InitToken = trace_C_InitToken;
+	list->C_InitPIN = trace_C_InitPIN;
+	list->C_SetPIN = trace_C_SetPIN;
+	list->C_OpenSession = trace_C_OpenSession;
+	list->C_CloseSession = trace_C_CloseSession;
+	list->C_CloseAllSessions = trace_C_CloseAllSessions;
+	list->C_GetSessionInfo = trace_C_GetSessionInfo;
+	list->C_GetOperationState = trace_C_GetOperationState;
+	list->C_SetOperationState = trace_C_SetOperationState;
+	list->C_Login = trace_C_Login;
+	list->C_Logout = trace_C_Logout;
+	list->C_CreateObject = trace_C_CreateObject;
+	list->C_CopyObject = trace_C_CopyObject;
+	list->C_DestroyObject = trace_C_DestroyObject;
+	list->C_GetObjectSize = trace_C_GetObjectSize;
+	list->C_GetAttributeValue = trace_C_GetAttributeValue;
+	list->C_SetAttributeValue = trace_C_SetAttributeValue;
+	list->C_FindObjectsInit = trace_C_FindObjectsInit;
+	list->C_FindObjects = trace_C_FindObjects;
+	list->C_FindObjectsFinal = trace_C_FindObjectsFinal;
+	list->C_EncryptInit = trace_C_EncryptInit;
+	list->C_Encrypt = trace_C_Encrypt;
+	list->C_EncryptUpdate = trace_C_EncryptUpdate;
+	list->C_EncryptFinal = trace_C_EncryptFinal;
+	list->C_DecryptInit = trace_C_DecryptInit;
+	list->C_Decrypt = trace_C_Decrypt;
+	list->C_DecryptUpdate = trace_C_DecryptUpdate;
+	list->C_DecryptFinal = trace_C_DecryptFinal;
+	list->C_DigestInit = trace_C_DigestInit;
+	list->C_Digest = trace_C_Digest;
+	list->C_DigestUpdate = trace_C_DigestUpdate;
+	list->C_DigestKey = trace_C_DigestKey;
+	list->C_DigestFinal = trace_C_DigestFinal;
+	list->C_SignInit = trace_C_SignInit;
+	list->C_Sign = trace_C_Sign;
+	list->C_SignUpdate = trace_C_SignUpdate;
+	list->C_SignFinal = trace_C_SignFinal;
+	list->C_SignRecoverInit = trace_C_SignRecoverInit;
+	list->C_SignRecover = trace_C_SignRecover;
+	list->C_VerifyInit = trace_C_VerifyInit;
+	list->C_Verify = trace_C_Verify;
+	list->C_VerifyUpdate = trace_C_VerifyUpdate;
+	list->C_VerifyFinal = trace_C_VerifyFinal;
+	list->C_VerifyRecoverInit = trace_C_VerifyRecoverInit;
+	list->C_VerifyRecover = trace_C_VerifyRecover;
+	list->C_DigestEncryptUpdate = trace_C_DigestEncryptUpdate;
+	list->C_DecryptDigestUpdate = trace_C_DecryptDigestUpdate;
+	list->C_SignEncryptUpdate = trace_C_SignEncryptUpdate;
+	list->C_DecryptVerifyUpdate = trace_C_DecryptVerifyUpdate;
+	list->C_GenerateKey = trace_C_GenerateKey;
+	list->C_GenerateKeyPair = trace_C_GenerateKeyPair;
+	list->C_WrapKey = trace_C_WrapKey;
+	list->C_UnwrapKey = trace_C_UnwrapKey;
+	list->C_DeriveKey = trace_C_DeriveKey;
+	list->C_SeedRandom = trace_C_SeedRandom;
+	list->C_GenerateRandom = trace_C_GenerateRandom;
+	list->C_GetFunctionStatus = trace_C_GetFunctionStatus;
+	list->C_CancelFunction = trace_C_CancelFunction;
+	list->C_WaitForSlotEvent = trace_C_WaitForSlotEvent;
+}
+
 /* Inits the spy. If successful, po != NULL */
 static CK_RV
 init_spy(void)
 {
-	const char *output, *module;
+	const char *output, *module, *trace;
 	CK_RV rv = CKR_OK;
 #ifdef _WIN32
         char temp_path[PATH_MAX], expanded_path[PATH_MAX];
@@ -61,6 +1201,17 @@ init_spy(void)
         HKEY hKey;
 #endif
 
+	trace = getenv("PKCS11SPY_TRACE");
+	if (trace != NULL) {
+		trace_output = fopen(trace, "a");
+		if (trace_output == NULL)
+			return CKR_GENERAL_ERROR;
+		trace_epoch = stats_now();
+	}
+	spy_stats = trace_output == NULL && getenv("PKCS11SPY_STATS") != NULL;
+	if (spy_stats && getenv("PKCS11SPY_STATS_INTERVAL"))
+		stats_interval_us = strtoul(getenv("PKCS11SPY_STATS_INTERVAL"), NULL, 10) * 1000000ULL;
+
 	/* Allocates and initializes the pkcs11_spy structure */
 	pkcs11_spy = malloc(sizeof(CK_FUNCTION_LIST));
 	if (pkcs11_spy) {
@@ -135,6 +1286,10 @@ init_spy(void)
 		pkcs11_spy->C_GetFunctionStatus = C_GetFunctionStatus;
 		pkcs11_spy->C_CancelFunction = C_CancelFunction;
 		pkcs11_spy->C_WaitForSlotEvent = C_WaitForSlotEvent;
+		if (trace_output)
+			trace_function_list(pkcs11_spy);
+		else if (spy_stats)
+			stats_function_list(pkcs11_spy);
 	}
 	else {
 		return CKR_HOST_MEMORY;
@@ -182,6 +1337,16 @@ init_spy(void)
 		spy_output = stderr;
 
 	fprintf(spy_output, "\n\n*************** OpenSC PKCS#11 spy *****************\n");
+#ifdef _WIN32
+	if (spy_stats || trace_output)
+		InitializeCriticalSection(&stats_lock);
+#endif
+	if (spy_stats) {
+		stats_last_dump = stats_now();
+		fprintf(spy_output, "Collecting statistics only\n");
+	}
+	if (trace_output)
+		fprintf(spy_output, "Tracing calls to \"%s\" only\n", trace);
 
 	module = getenv("PKCS11SPY");
 #ifdef _WIN32
@@ -345,11 +1510,74 @@ CK_RV C_GetFunctionList
 			return rv;
 	}
 
+	if (spy_stats) {
+		*ppFunctionList = pkcs11_spy;
+		return CKR_OK;
+	}
+
 	enter("C_GetFunctionList");
 	*ppFunctionList = pkcs11_spy;
 	return retne(CKR_OK);
 }
 
+/* The spy only wraps the PKCS #11 2.x functions */
+static CK_INTERFACE spy_interface = { (CK_BYTE *) "PKCS 11", NULL, 0 };
+
+CK_RV C_GetInterfaceList
+(CK_INTERFACE_PTR pInterfacesList, CK_ULONG_PTR pulCount)
+{
+	CK_RV rv = CKR_OK;
+
+	if (po == NULL) {
+		rv = init_spy();
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	if (!spy_stats)
+		enter("C_GetInterfaceList");
+	if (pulCount == NULL_PTR) {
+		rv = CKR_ARGUMENTS_BAD;
+	} else if (pInterfacesList != NULL_PTR && *pulCount < 1) {
+		*pulCount = 1;
+		rv = CKR_BUFFER_TOO_SMALL;
+	} else {
+		if (pInterfacesList != NULL_PTR) {
+			spy_interface.pFunctionList = pkcs11_spy;
+			pInterfacesList[0] = spy_interface;
+		}
+		*pulCount = 1;
+	}
+	return spy_stats ? rv : retne(rv);
+}
+
+CK_RV C_GetInterface
+(CK_UTF8CHAR_PTR pInterfaceName, CK_VERSION_PTR pVersion,
+ CK_INTERFACE_PTR_PTR ppInterface, CK_FLAGS flags)
+{
+	CK_RV rv = CKR_OK;
+
+	if (po == NULL) {
+		rv = init_spy();
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	if (!spy_stats)
+		enter("C_GetInterface");
+	if (ppInterface == NULL_PTR
+			|| (pInterfaceName != NULL_PTR && strcmp((char *) pInterfaceName, "PKCS 11"))
+			|| (pVersion != NULL_PTR && (pVersion->major != pkcs11_spy->version.major
+					|| pVersion->minor != pkcs11_spy->version.minor))
+			|| flags != 0) {
+		rv = CKR_ARGUMENTS_BAD;
+	} else {
+		spy_interface.pFunctionList = pkcs11_spy;
+		*ppInterface = &spy_interface;
+	}
+	return spy_stats ? rv : retne(rv);
+}
+
 CK_RV
 C_Initialize(CK_VOID_PTR pInitArgs)
 {
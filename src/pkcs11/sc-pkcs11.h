@@ -26,6 +26,7 @@
 #include "libopensc/opensc.h"
 #include "libopensc/pkcs15.h"
 #include "libopensc/log.h"
+#include "libopensc/probes.h"
 
 #define CRYPTOKI_EXPORTS
 #include "pkcs11.h"
@@ -74,6 +75,21 @@ struct sc_pkcs11_config {
 	unsigned int create_puk_slot;
 	unsigned int create_slots_flags;
 	unsigned char ignore_pin_length;
+	unsigned char per_slot_locking;
+	unsigned char fair_slot_locking;
+	unsigned char token_pool;
+	unsigned char slot_event_thread;
+	unsigned char async_token_binding;
+	unsigned char async_token_removal;
+	unsigned char parallel_card_detection;
+	unsigned char lazy_card_detection;
+	unsigned char lazy_app_binding;
+	unsigned char keep_tokens_after_fork;
+	unsigned char random_drbg;
+	unsigned int random_reseed_interval;
+	unsigned int idle_token_timeout;
+	unsigned char token_snapshots;
+	unsigned char fast_first_signature;
 };
 
 /*
@@ -122,6 +138,12 @@ struct sc_pkcs11_object_ops {
 			void*,
 			CK_BYTE_PTR pData, CK_ULONG_PTR ulDataLen);
 
+	/* Secret keys only; public key encryption uses verify_key */
+	CK_RV (*encrypt)(struct sc_pkcs11_session *, void *,
+			CK_MECHANISM_PTR,
+			CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+			CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen);
+
 	/* Others to be added when implemented */
 };
 
@@ -129,6 +151,7 @@ struct sc_pkcs11_object {
 	CK_OBJECT_HANDLE handle;
 	int flags;
 	struct sc_pkcs11_object_ops *ops;
+	void *verify_key;	/* public key parsed for C_Verify and C_Encrypt */
 };
 
 #define SC_PKCS11_OBJECT_SEEN	0x0001
@@ -176,6 +199,19 @@ struct sc_pkcs11_framework_ops {
 				CK_OBJECT_HANDLE_PTR, CK_OBJECT_HANDLE_PTR);
 	CK_RV (*get_random)(struct sc_pkcs11_slot *,
 				CK_BYTE_PTR, CK_ULONG);
+	/* Make sure the objects that may match a search template
+	 * have been added to the slot; may be NULL */
+	CK_RV (*load_objects)(struct sc_pkcs11_slot *,
+				CK_ATTRIBUTE_PTR, CK_ULONG);
+	/* Drop the state of an idle card that can be read again on
+	 * demand, keeping its objects and handles; may be NULL */
+	void (*reclaim)(struct sc_pkcs11_card *);
+	/* Keep a login of the atomic mode to be verified only when the
+	 * card refuses an operation on a key protected by it; returns
+	 * CKR_FUNCTION_NOT_SUPPORTED if the login has to be replayed
+	 * at once. May be NULL */
+	CK_RV (*defer_login)(struct sc_pkcs11_slot *,
+				CK_USER_TYPE, CK_CHAR_PTR, CK_ULONG);
 };
 
 /*
@@ -189,6 +225,11 @@ typedef unsigned __int64   sc_timestamp_t;
 #endif
 
 #define SC_PKCS11_FRAMEWORK_DATA_MAX_NUM	4
+struct sc_pkcs11_mech_index {
+	CK_MECHANISM_TYPE mech;
+	unsigned int pos;
+};
+
 struct sc_pkcs11_card {
 	sc_reader_t *reader;
 	sc_card_t *card;
@@ -198,6 +239,29 @@ struct sc_pkcs11_card {
 	/* List of supported mechanisms */
 	struct sc_pkcs11_mechanism_type **mechanisms;
 	unsigned int nmechanisms;
+	unsigned int mechanisms_alloc;
+
+	/* The mechanisms sorted by type and registration order, see
+	 * sc_pkcs11_index_mechanisms(). Only used while
+	 * mech_indexed == nmechanisms */
+	struct sc_pkcs11_mech_index *mech_index;
+	unsigned int nmech_index;
+	unsigned int mech_indexed;
+
+	/* Lock serializing operations on this card if per_slot_locking is
+	 * enabled; NULL otherwise */
+	void *lock;
+
+	/* Last time one of the slots of the card was used, and whether its
+	 * state was reclaimed since, see idle_token_timeout */
+	sc_timestamp_t last_used;
+	int reclaimed;
+
+	/* Mechanisms of the card's last binding, reported until the first
+	 * application is bound, see token_snapshots */
+	CK_MECHANISM_TYPE *snapshot_mechanisms;
+	CK_MECHANISM_INFO *snapshot_mechanism_info;
+	unsigned int nsnapshot_mechanisms;
 };
 
 /* If the slot did already show with `C_GetSlotList`, then we need to keep this
@@ -205,6 +269,34 @@ struct sc_pkcs11_card {
  * the application calls `C_GetSlotList` with `NULL`. This flag tracks the
  * visibility to the application */
 #define SC_PKCS11_SLOT_FLAG_SEEN 1
+/* The card in the reader of this slot is being bound by a background thread,
+ * see async_token_binding. The slot reports a token, but p11card is not set
+ * before the binding finished */
+#define SC_PKCS11_SLOT_FLAG_BINDING 2
+/* The user was logged in because another token of the pool was, see
+ * token_pool in opensc.conf */
+#define SC_PKCS11_SLOT_FLAG_POOL_LOGIN 4
+/* The slot stands for an application of the card that is not bound yet,
+ * see lazy_app_binding and token_snapshots. Its token info comes from EF.DIR
+ * or the snapshot only and the application is bound by the first
+ * C_OpenSession, see slot_bind_app() */
+#define SC_PKCS11_SLOT_FLAG_UNBOUND 8
+
+/* Index of the objects of a slot by the values of CKA_ID, CKA_LABEL and
+ * CKA_CLASS. Built on demand by C_FindObjectsInit and dropped whenever the
+ * objects of the slot change. */
+struct sc_pkcs11_index_node {
+	CK_ATTRIBUTE_TYPE type;
+	unsigned long hash;
+	struct sc_pkcs11_object *object;
+	struct sc_pkcs11_index_node *next;
+};
+
+struct sc_pkcs11_object_index {
+	unsigned int nbuckets;
+	struct sc_pkcs11_index_node **buckets;
+	struct sc_pkcs11_index_node *nodes;
+};
 
 struct sc_pkcs11_slot {
 	CK_SLOT_ID id;			/* ID of the slot */
@@ -215,7 +307,9 @@ struct sc_pkcs11_slot {
 	struct sc_pkcs11_card *p11card;	/* The card associated with this slot */
 	unsigned int events;		/* Card events SC_EVENT_CARD_{INSERTED,REMOVED} */
 	void *fw_data;			/* Framework specific data */  /* TODO: get know how it used */
-	list_t objects;			/* Objects in this slot */
+	struct sc_pkcs11_object **objects;	/* Objects in this slot, in the order they were added */
+	unsigned int nobjects;		/* Number of objects in this slot */
+	unsigned int objects_size;	/* Allocated size of objects */
 	unsigned int nsessions;		/* Number of sessions using this slot */
 	sc_timestamp_t slot_state_expires;
 
@@ -223,9 +317,26 @@ struct sc_pkcs11_slot {
 	struct sc_app_info *app_info;	/* Application associated to slot */
 	list_t logins;			/* tracks all calls to C_Login if atomic operations are requested */
 	int flags;
+	struct sc_pkcs11_object_index *index;	/* Lookup index of objects, may be NULL */
+	unsigned int objects_generation;	/* Changes with the objects and the index */
+	unsigned int pool_busy;		/* Operations of the token pool running on this slot */
+	sc_timestamp_t token_info_expires;	/* PIN status in token_info valid until then */
+	struct sc_pkcs11_slot *reader_next;	/* next slot of the same reader, see slot_first_of_reader() */
 };
 typedef struct sc_pkcs11_slot sc_pkcs11_slot_t;
 
+/* Iterates the objects of a slot that may match a search template */
+struct sc_pkcs11_object_iter {
+	struct sc_pkcs11_slot *slot;
+	int indexed;
+	/* indexed lookup */
+	struct sc_pkcs11_index_node *node;
+	CK_ATTRIBUTE_TYPE type;
+	unsigned long hash;
+	/* linear scan */
+	unsigned int pos;
+};
+
 /* Debug virtual slots. S is slot to be highlighted or NULL
  * C is a comment format string and args It will be preceeded by "VSS " */
 #define DEBUG_VSS(S, ...) do { sc_log(context,"VSS " __VA_ARGS__); _debug_virtual_slots(S); } while (0)
@@ -245,6 +356,7 @@ enum {
 	SC_PKCS11_OPERATION_DERIVE,
 	SC_PKCS11_OPERATION_WRAP,
 	SC_PKCS11_OPERATION_UNWRAP,
+	SC_PKCS11_OPERATION_ENCRYPT,
 	SC_PKCS11_OPERATION_MAX
 };
 
@@ -279,6 +391,11 @@ struct sc_pkcs11_mechanism_type {
 					CK_BYTE_PTR, CK_ULONG);
 	CK_RV		  (*verif_final)(sc_pkcs11_operation_t *,
 					CK_BYTE_PTR, CK_ULONG);
+	CK_RV		  (*encrypt_init)(sc_pkcs11_operation_t *,
+					struct sc_pkcs11_object *);
+	CK_RV		  (*encrypt)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG,
+					CK_BYTE_PTR, CK_ULONG_PTR);
 	CK_RV		  (*decrypt_init)(sc_pkcs11_operation_t *,
 					struct sc_pkcs11_object *);
 	CK_RV		  (*decrypt)(sc_pkcs11_operation_t *,
@@ -313,9 +430,15 @@ struct sc_pkcs11_operation {
 	union {
 		CK_RSA_PKCS_PSS_PARAMS pss;
 		CK_RSA_PKCS_OAEP_PARAMS oaep;
+		CK_GCM_PARAMS gcm;
+		CK_BYTE iv[16];
 	} mechanism_params;
 	struct sc_pkcs11_session *session;
 	void *		  priv_data;
+	/* host-side update in progress without the module lock */
+	unsigned char	  busy;
+	/* stopped while busy; released by the updating thread */
+	unsigned char	  orphaned;
 };
 
 /* Find Operation */
@@ -324,12 +447,44 @@ struct sc_pkcs11_find_operation {
 	struct sc_pkcs11_operation operation;
 	int num_handles, current_handle, allocated_handles;
 	CK_OBJECT_HANDLE *handles;
+	/* The objects are matched by C_FindObjects() as far as needed */
+	CK_ATTRIBUTE_PTR pTemplate;
+	CK_ULONG ulCount;
+	CK_ULONG *order;
+	int hide_private;
+	int done;
+	struct sc_pkcs11_object_iter iter;
+	unsigned int generation;
 };
 
 /*
  * PKCS#11 Session
  */
 
+/* Key and mechanism of a message-based signature or verification
+ * (PKCS#11 3.0), used for every message until C_MessageSignFinal() */
+struct sc_pkcs11_message {
+	int active;
+	int in_progress;	/* between C_SignMessageBegin() and the last part */
+	CK_MECHANISM mechanism;
+	union {
+		CK_RSA_PKCS_PSS_PARAMS pss;
+		CK_BYTE raw[32];
+	} mechanism_params;
+	CK_OBJECT_HANDLE key;
+	CK_KEY_TYPE key_type;
+};
+
+/* Blocks of finished operations, kept by the session for reuse by its
+ * next operations instead of going back to the allocator */
+#define SC_PKCS11_POOL_BLOCKS	4
+struct sc_pkcs11_pool {
+	void *block[SC_PKCS11_POOL_BLOCKS];
+	size_t size[SC_PKCS11_POOL_BLOCKS];
+	/* reset digest context (EVP_MD_CTX) */
+	void *md_ctx;
+};
+
 struct sc_pkcs11_session {
 	CK_SESSION_HANDLE handle;
 	/* Session to this slot */
@@ -340,6 +495,13 @@ struct sc_pkcs11_session {
 	CK_VOID_PTR notify_data;
 	/* Active operations - one per type */
 	struct sc_pkcs11_operation *operation[SC_PKCS11_OPERATION_MAX];
+	/* Message-based operations */
+	struct sc_pkcs11_message message_sign;
+	struct sc_pkcs11_message message_verify;
+	/* Next session in the same bucket of the session index */
+	struct sc_pkcs11_session *index_next;
+	/* Reusable operation memory */
+	struct sc_pkcs11_pool pool;
 };
 typedef struct sc_pkcs11_session sc_pkcs11_session_t;
 
@@ -348,6 +510,8 @@ extern struct sc_context *context;
 extern struct sc_pkcs11_config sc_pkcs11_conf;
 extern list_t sessions;
 extern list_t virtual_slots;
+/* virtual_slots indexed by the slot IDs, see create_slot() */
+extern struct sc_pkcs11_slot **virtual_slot_table;
 extern list_t cards;
 
 /* Framework definitions */
@@ -365,18 +529,40 @@ void sc_pkcs11_print_attrs(int level, const char *file, unsigned int line, const
 /* Slot and card handling functions */
 CK_RV card_removed(sc_reader_t *reader);
 CK_RV card_detect_all(void);
+void card_reclaim_idle(void);
+int card_detect_deferred(void);
 CK_RV create_slot(sc_reader_t *reader);
+void slot_table_free(void);
+struct sc_pkcs11_slot *slot_first_of_reader(sc_reader_t *reader);
 void init_slot_info(CK_SLOT_INFO_PTR pInfo, sc_reader_t *reader);
 CK_RV card_detect(sc_reader_t *reader);
+void card_detect_wait_bindings(void);
+void card_reclaim_wait(void);
+CK_RV card_reinit_after_fork(void);
 CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot **);
 CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot **);
 CK_RV slot_token_removed(CK_SLOT_ID id);
 CK_RV slot_allocate(struct sc_pkcs11_slot **, struct sc_pkcs11_card *);
+CK_RV slot_bind_app(struct sc_pkcs11_slot *);
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask);
+CK_RV slot_find_event(CK_SLOT_ID_PTR idp, int mask);
 int slot_get_logged_in_state(struct sc_pkcs11_slot *slot);
+void slot_invalidate_index(struct sc_pkcs11_slot *slot);
+void slot_objects_init(struct sc_pkcs11_object_iter *iter, struct sc_pkcs11_session *session,
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
+struct sc_pkcs11_object *slot_objects_next(struct sc_pkcs11_object_iter *iter);
+CK_RV slot_add_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object);
+int slot_has_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object);
+void slot_remove_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object);
+struct sc_pkcs11_object *slot_find_object(struct sc_pkcs11_slot *slot, CK_OBJECT_HANDLE handle);
+int slot_pool_member(struct sc_pkcs11_slot *slot, struct sc_pkcs11_slot *other);
+struct sc_pkcs11_slot *slot_pool_pick(struct sc_pkcs11_slot *slot, struct sc_pkcs11_slot *exclude);
+struct sc_pkcs11_object *slot_pool_find_key(struct sc_pkcs11_session *session, CK_ATTRIBUTE_PTR id);
 
 /* Login tracking functions */
+sc_timestamp_t get_current_time(void);
 CK_RV restore_login_state(struct sc_pkcs11_slot *slot);
+CK_RV restore_key_login_state(struct sc_pkcs11_slot *slot);
 CK_RV reset_login_state(struct sc_pkcs11_slot *slot, CK_RV rv);
 CK_RV push_login_state(struct sc_pkcs11_slot *slot,
 		CK_USER_TYPE userType, CK_CHAR_PTR pPin, CK_ULONG ulPinLen);
@@ -385,12 +571,17 @@ void pop_all_login_states(struct sc_pkcs11_slot *slot);
 
 /* Session manipulation */
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session);
+struct sc_pkcs11_session *session_lookup(CK_SESSION_HANDLE hSession);
+void session_index_free(void);
 CK_RV session_start_operation(struct sc_pkcs11_session *,
 			int, sc_pkcs11_mechanism_type_t *,
 			struct sc_pkcs11_operation **);
 CK_RV session_get_operation(struct sc_pkcs11_session *, int,
 			struct sc_pkcs11_operation **);
 CK_RV session_stop_operation(struct sc_pkcs11_session *, int);
+void *session_pool_alloc(struct sc_pkcs11_session *, size_t);
+void session_pool_free(struct sc_pkcs11_session *, void *, size_t);
+void session_pool_clear(struct sc_pkcs11_session *);
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID);
 
 /* Generic secret key stuff */
@@ -416,6 +607,7 @@ CK_RV attr_extract(CK_ATTRIBUTE_PTR, void *, size_t *);
 /* Generic Mechanism functions */
 CK_RV sc_pkcs11_register_mechanism(struct sc_pkcs11_card *,
 				sc_pkcs11_mechanism_type_t *);
+CK_RV sc_pkcs11_index_mechanisms(struct sc_pkcs11_card *);
 CK_RV sc_pkcs11_get_mechanism_list(struct sc_pkcs11_card *,
 				CK_MECHANISM_TYPE_PTR, CK_ULONG_PTR);
 CK_RV sc_pkcs11_get_mechanism_info(struct sc_pkcs11_card *, CK_MECHANISM_TYPE,
@@ -423,16 +615,31 @@ CK_RV sc_pkcs11_get_mechanism_info(struct sc_pkcs11_card *, CK_MECHANISM_TYPE,
 CK_RV sc_pkcs11_md_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR);
 CK_RV sc_pkcs11_md_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_md_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_get_update_digest(struct sc_pkcs11_session *, int,
+				sc_pkcs11_operation_t **, sc_pkcs11_operation_t **);
+void sc_pkcs11_orphan_operation(sc_pkcs11_operation_t *);
+void sc_pkcs11_release_orphan(sc_pkcs11_operation_t **);
+CK_RV sc_pkcs11_prepare_on_key(struct sc_pkcs11_session *, int,
+				sc_pkcs11_operation_t **, struct sc_pkcs11_object **);
+CK_RV sc_pkcs11_run_on_key(sc_pkcs11_operation_t *, int,
+				struct sc_pkcs11_session *, struct sc_pkcs11_object *,
+				CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
 CK_RV sc_pkcs11_sign_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
 CK_RV sc_pkcs11_sign_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_sign_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_sign(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG,
+			CK_BYTE_PTR, CK_ULONG_PTR);
 CK_RV sc_pkcs11_sign_size(struct sc_pkcs11_session *, CK_ULONG_PTR);
 #ifdef ENABLE_OPENSSL
 CK_RV sc_pkcs11_verif_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
 CK_RV sc_pkcs11_verif_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_verif_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
+int sc_pkcs11_verif_host_only(struct sc_pkcs11_session *);
+CK_RV sc_pkcs11_encr_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
+				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
+CK_RV sc_pkcs11_encr(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
 #endif
 CK_RV sc_pkcs11_decr_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR, struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
 CK_RV sc_pkcs11_decr(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
@@ -458,11 +665,21 @@ CK_RV sc_pkcs11_register_sign_and_hash_mechanism(struct sc_pkcs11_card *,
 				sc_pkcs11_mechanism_type_t *);
 
 #ifdef ENABLE_OPENSSL
-CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, unsigned int pubkey_len,
+CK_RV sc_pkcs11_verify_data(void **key_cache,
+	const unsigned char *pubkey, unsigned int pubkey_len,
 	const unsigned char *pubkey_params, unsigned int pubkey_params_len,
 	CK_MECHANISM_PTR mech, sc_pkcs11_operation_t *md,
 	unsigned char *inp, unsigned int inp_len,
 	unsigned char *signat, unsigned int signat_len);
+void sc_pkcs11_free_verify_key(void *key);
+CK_RV sc_pkcs11_parse_public_key(void **key_cache,
+	const unsigned char *pubkey, unsigned int pubkey_len);
+CK_RV sc_pkcs11_encrypt_data(void *key, CK_MECHANISM_PTR mech,
+	unsigned char *data, unsigned int data_len,
+	unsigned char *out, CK_ULONG_PTR out_len);
+CK_RV sc_pkcs11_drbg_generate(void **drbg_cache, struct sc_card *card,
+	unsigned long reseed_interval, CK_BYTE_PTR out, CK_ULONG len);
+void sc_pkcs11_drbg_free(void *drbg);
 #endif
 
 /* Load configuration defaults */
@@ -474,6 +691,20 @@ CK_RV sc_pkcs11_lock(void);
 void sc_pkcs11_unlock(void);
 void sc_pkcs11_free_lock(void);
 
+/* Per-card locking primitives (see per_slot_locking in opensc.conf).
+ * The global lock must be held when a card lock is acquired; the global lock
+ * must never be acquired while a card lock is held. */
+CK_RV sc_pkcs11_card_init_lock(struct sc_pkcs11_card *);
+void sc_pkcs11_card_free_lock(struct sc_pkcs11_card *);
+void sc_pkcs11_card_lock(struct sc_pkcs11_card *);
+void sc_pkcs11_card_unlock(struct sc_pkcs11_card *);
+/* Acquire the lock of the card in the slot and release the global lock.
+ * Returns the locked card, or NULL if the global lock is still held. The
+ * result has to be passed to sc_pkcs11_unlock_slot(). With
+ * fair_slot_locking, the callers get the card in the order they called. */
+struct sc_pkcs11_card *sc_pkcs11_lock_slot(struct sc_pkcs11_slot *);
+void sc_pkcs11_unlock_slot(struct sc_pkcs11_card *);
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,14 +19,32 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_PKCS11
+
 #include "config.h"
 #include "libopensc/opensc.h"
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#endif
 
 #include "sc-pkcs11.h"
 
+#if defined(PKCS11_THREAD_LOCKING) && defined(HAVE_PTHREAD)
+#include <pthread.h>
+#define HAVE_BIND_THREAD
+#endif
+
 /* Print virtual_slots list. Called by DEBUG_VSS(S, C) */
 void _debug_virtual_slots(sc_pkcs11_slot_t *p)
 {
@@ -39,7 +57,7 @@ void _debug_virtual_slots(sc_pkcs11_slot_t *p)
 	_sc_debug(context, 10,
 			"VSS  [i] id   flags LU events nsessions slot_info.flags reader p11card description");
 	for (i = 0; i < vs_size; i++) {
-		slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+		slot = virtual_slot_table[i];
 		if (slot) {
 			_sc_debug(context, 10,
 				"VSS %s[%d] 0x%2.2lx 0x%4.4x %d  %d  %d %4.4lx  %p %p %.64s",
@@ -63,20 +81,156 @@ static struct sc_pkcs11_framework_ops *frameworks[] = {
 	NULL
 };
 
+struct sc_pkcs11_slot **virtual_slot_table = NULL;
+static size_t virtual_slot_table_size = 0;
+
+/* The objects and the framework data of a token whose card was removed,
+ * released later together with the card, see async_token_removal */
+struct sc_pkcs11_removed_token {
+	void *fw_data;
+	struct sc_pkcs11_object **objects;
+	unsigned int nobjects;
+};
+
+/* A removed card waiting for the reclaiming thread */
+struct sc_pkcs11_removed_card {
+	sc_reader_t *reader;
+	struct sc_pkcs11_card *p11card;
+	struct sc_pkcs11_removed_token *tokens;
+	unsigned int ntokens;
+	struct sc_pkcs11_removed_card *next;
+};
+
+static CK_RV slot_token_remove(struct sc_pkcs11_slot *slot, struct sc_pkcs11_removed_token *removed);
+
+/*
+ * The slots of a reader are chained by reader_next in the order of their
+ * IDs, the slots without a reader under NULL. The chain of a reader is
+ * found by the hash of the reader pointer, so that with hundreds of
+ * readers the detection does not scan all the slots for each of them.
+ */
+struct reader_slots {
+	int used;
+	sc_reader_t *reader;
+	struct sc_pkcs11_slot *first;
+};
+static struct reader_slots *reader_slots = NULL;
+static size_t reader_slots_size = 0, reader_slots_used = 0;
+
+static size_t reader_slots_hash(const sc_reader_t *reader)
+{
+	return (size_t) (((uintptr_t) reader >> 4) * 2654435761u);
+}
+
+static struct reader_slots *reader_slots_insert(struct reader_slots *table,
+		size_t size, sc_reader_t *reader)
+{
+	size_t i, mask = size - 1;
+
+	for (i = reader_slots_hash(reader) & mask; table[i].used; i = (i + 1) & mask)
+		if (table[i].reader == reader)
+			return &table[i];
+	table[i].used = 1;
+	table[i].reader = reader;
+	table[i].first = NULL;
+	return &table[i];
+}
+
+static struct reader_slots *reader_slots_find(sc_reader_t *reader, int create)
+{
+	size_t i, mask;
+
+	if (create && 2 * (reader_slots_used + 1) > reader_slots_size) {
+		/* the readers without slots left are dropped on the way */
+		size_t size = reader_slots_size ? 2 * reader_slots_size : 16;
+		struct reader_slots *table = calloc(size, sizeof *table);
+
+		if (table == NULL)
+			return NULL;
+		reader_slots_used = 0;
+		for (i = 0; i < reader_slots_size; i++) {
+			if (!reader_slots[i].used || reader_slots[i].first == NULL)
+				continue;
+			reader_slots_insert(table, size, reader_slots[i].reader)->first =
+				reader_slots[i].first;
+			reader_slots_used++;
+		}
+		free(reader_slots);
+		reader_slots = table;
+		reader_slots_size = size;
+	}
+	if (reader_slots_size == 0)
+		return NULL;
+
+	mask = reader_slots_size - 1;
+	for (i = reader_slots_hash(reader) & mask; reader_slots[i].used; i = (i + 1) & mask)
+		if (reader_slots[i].reader == reader)
+			return &reader_slots[i];
+	if (!create)
+		return NULL;
+	reader_slots_used++;
+	return reader_slots_insert(reader_slots, reader_slots_size, reader);
+}
+
+struct sc_pkcs11_slot *slot_first_of_reader(sc_reader_t *reader)
+{
+	struct reader_slots *group = reader_slots_find(reader, 0);
+
+	return group ? group->first : NULL;
+}
+
+static void slot_unlink_reader(struct sc_pkcs11_slot *slot)
+{
+	struct reader_slots *group = reader_slots_find(slot->reader, 0);
+	struct sc_pkcs11_slot **p;
+
+	for (p = group ? &group->first : NULL; p && *p; p = &(*p)->reader_next)
+		if (*p == slot) {
+			*p = slot->reader_next;
+			break;
+		}
+	slot->reader_next = NULL;
+}
+
+static CK_RV slot_link_reader(struct sc_pkcs11_slot *slot, sc_reader_t *reader)
+{
+	struct reader_slots *group = reader_slots_find(reader, 1);
+	struct sc_pkcs11_slot **p;
+
+	if (group == NULL)
+		return CKR_HOST_MEMORY;
+	for (p = &group->first; *p && (*p)->id < slot->id; p = &(*p)->reader_next)
+		;
+	slot->reader_next = *p;
+	*p = slot;
+	slot->reader = reader;
+	return CKR_OK;
+}
+
+void slot_table_free(void)
+{
+	free(virtual_slot_table);
+	virtual_slot_table = NULL;
+	virtual_slot_table_size = 0;
+	free(reader_slots);
+	reader_slots = NULL;
+	reader_slots_size = reader_slots_used = 0;
+}
+
 static struct sc_pkcs11_slot * reader_reclaim_slot(sc_reader_t *reader)
 {
-	unsigned int i;
+	sc_pkcs11_slot_t *slot;
 	CK_UTF8CHAR slotDescription[64];
 	CK_UTF8CHAR manufacturerID[32];
 
+	if (reader == NULL)
+		return NULL;
 	strcpy_bp(slotDescription, reader->name, 64);
 	strcpy_bp(manufacturerID, reader->vendor, 32);
 
-	/* Locate a slot related to the reader */
-	for (i = 0; i<list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-		if (slot->reader == NULL && reader != NULL
-				&& 0 == memcmp(slot->slot_info.slotDescription, slotDescription, 64)
+	/* Locate a slot left by the same reader before */
+	for (slot = slot_first_of_reader(NULL); slot; slot = slot->reader_next) {
+		if (0 == memcmp(slot->slot_info.slotDescription, slotDescription, 64)
 				&& 0 == memcmp(slot->slot_info.manufacturerID, manufacturerID, 32)
 				&& slot->slot_info.hardwareVersion.major == reader->version_major
 				&& slot->slot_info.hardwareVersion.minor == reader->version_minor) {
@@ -105,17 +259,6 @@ void init_slot_info(CK_SLOT_INFO_PTR pInfo, sc_reader_t *reader)
 }
 
 /* simclist helpers to locate interesting objects by ID */
-static int object_list_seeker(const void *el, const void *key)
-{
-	const struct sc_pkcs11_object *object = (struct sc_pkcs11_object *)el;
-
-	if ((el == NULL) || (key == NULL))
-		return 0;
-	if (object->handle == *(CK_OBJECT_HANDLE*)key)
-		return 1;
-	return 0;
-}
-
 CK_RV create_slot(sc_reader_t *reader)
 {
 	/* find unused slots previously allocated for the same reader */
@@ -123,154 +266,759 @@ CK_RV create_slot(sc_reader_t *reader)
 
 	/* create a new slot if no empty slot is available */
 	if (!slot) {
+		size_t count = list_size(&virtual_slots);
+
 		sc_log(context, "Creating new slot");
-		if (list_size(&virtual_slots) >= sc_pkcs11_conf.max_virtual_slots)
+		/* max_virtual_slots = 0 lets the table grow with the readers */
+		if (sc_pkcs11_conf.max_virtual_slots
+				&& count >= sc_pkcs11_conf.max_virtual_slots)
 			return CKR_FUNCTION_FAILED;
 
+		if (count >= virtual_slot_table_size) {
+			size_t size = virtual_slot_table_size ? 2 * virtual_slot_table_size : 16;
+			struct sc_pkcs11_slot **table = realloc(virtual_slot_table, size * sizeof *table);
+
+			if (!table)
+				return CKR_HOST_MEMORY;
+			virtual_slot_table = table;
+			virtual_slot_table_size = size;
+		}
+
 		slot = (struct sc_pkcs11_slot *)calloc(1, sizeof(struct sc_pkcs11_slot));
 		if (!slot)
 			return CKR_HOST_MEMORY;
 
-		list_append(&virtual_slots, slot);
-		if (0 != list_init(&slot->objects)) {
+		if (0 != list_init(&slot->logins)) {
+			free(slot);
 			return CKR_HOST_MEMORY;
 		}
-		list_attributes_seeker(&slot->objects, object_list_seeker);
-
-		if (0 != list_init(&slot->logins)) {
+		if (0 > list_append(&virtual_slots, slot)) {
+			list_destroy(&slot->logins);
+			free(slot);
 			return CKR_HOST_MEMORY;
 		}
+		virtual_slot_table[count] = slot;
+		slot->id = (CK_SLOT_ID) count;
 	} else {
 		DEBUG_VSS(slot, "Reusing this old slot");
 
 		/* reuse the old list of logins/objects since they should be empty */
 		list_t logins = slot->logins;
-		list_t objects = slot->objects;
+		struct sc_pkcs11_object **objects = slot->objects;
+		unsigned int objects_size = slot->objects_size;
+		CK_SLOT_ID id = slot->id;
+
+		slot_invalidate_index(slot);
+		slot_unlink_reader(slot);
 
 		memset(slot, 0, sizeof *slot);
 
 		slot->logins = logins;
 		slot->objects = objects;
+		slot->objects_size = objects_size;
+		slot->id = id;
 	}
 
 	slot->login_user = -1;
-	slot->id = (CK_SLOT_ID) list_locate(&virtual_slots, slot);
 	init_slot_info(&slot->slot_info, reader);
-	slot->reader = reader;
+	if (slot_link_reader(slot, reader) != CKR_OK)
+		return CKR_HOST_MEMORY;
 
 	DEBUG_VSS(slot, "Finished initializing this slot");
 
 	return CKR_OK;
 }
 
-CK_RV card_removed(sc_reader_t * reader)
+/* Release the card state left behind by slot_token_remove() */
+static void card_free(struct sc_pkcs11_card *p11card)
+{
+	unsigned int i;
+
+	p11card->framework->unbind(p11card);
+	sc_disconnect_card(p11card->card);
+	for (i=0; i < p11card->nmechanisms; ++i) {
+		if (p11card->mechanisms[i]->free_mech_data) {
+			p11card->mechanisms[i]->free_mech_data(p11card->mechanisms[i]->mech_data);
+		}
+		free(p11card->mechanisms[i]);
+	}
+	free(p11card->mechanisms);
+	free(p11card->mech_index);
+	free(p11card->snapshot_mechanisms);
+	free(p11card->snapshot_mechanism_info);
+	sc_pkcs11_card_free_lock(p11card);
+	free(p11card);
+}
+
+/* Does not need the global lock, the tokens are not reachable anymore */
+static void card_free_tokens(struct sc_pkcs11_removed_card *removed)
+{
+	struct sc_pkcs11_removed_token *token;
+	struct sc_pkcs11_object *object;
+	unsigned int i;
+
+	for (i = 0; i < removed->ntokens; i++) {
+		token = &removed->tokens[i];
+		while (token->nobjects > 0) {
+			object = token->objects[--token->nobjects];
+			if (object->ops->release)
+				object->ops->release(object);
+		}
+		free(token->objects);
+		if (token->fw_data != NULL)
+			removed->p11card->framework->release_token(removed->p11card, token->fw_data);
+	}
+	free(removed->tokens);
+}
+
+#ifdef HAVE_BIND_THREAD
+static pthread_mutex_t reclaim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+/* the cards stay queued until they are freed */
+static struct sc_pkcs11_removed_card *reclaim_head = NULL;
+static struct sc_pkcs11_removed_card *reclaim_tail = NULL;
+static int reclaim_running = 0;
+
+static void *card_reclaim_thread(void *arg)
+{
+	struct sc_pkcs11_removed_card *removed;
+
+	pthread_mutex_lock(&reclaim_mutex);
+	while ((removed = reclaim_head) != NULL) {
+		pthread_mutex_unlock(&reclaim_mutex);
+
+		card_free_tokens(removed);
+		/* unbinding and disconnecting use the reader */
+		if (sc_pkcs11_lock() == CKR_OK) {
+			card_free(removed->p11card);
+			sc_pkcs11_unlock();
+		}
+
+		pthread_mutex_lock(&reclaim_mutex);
+		reclaim_head = removed->next;
+		if (reclaim_head == NULL)
+			reclaim_tail = NULL;
+		free(removed);
+		pthread_cond_broadcast(&reclaim_cond);
+	}
+	reclaim_running = 0;
+	pthread_cond_broadcast(&reclaim_cond);
+	pthread_mutex_unlock(&reclaim_mutex);
+
+	return NULL;
+}
+
+/* Called with the global lock held */
+static CK_RV card_reclaim_start(struct sc_pkcs11_removed_card *removed)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int r = 0;
+
+	pthread_mutex_lock(&reclaim_mutex);
+	if (!reclaim_running) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		r = pthread_create(&thread, &attr, card_reclaim_thread, NULL);
+		pthread_attr_destroy(&attr);
+		if (r != 0) {
+			pthread_mutex_unlock(&reclaim_mutex);
+			sc_log(context, "%s: Cannot start reclaiming thread", removed->reader->name);
+			return CKR_FUNCTION_FAILED;
+		}
+		reclaim_running = 1;
+	}
+	if (reclaim_tail != NULL)
+		reclaim_tail->next = removed;
+	else
+		reclaim_head = removed;
+	reclaim_tail = removed;
+	pthread_mutex_unlock(&reclaim_mutex);
+
+	sc_log(context, "%s: Releasing the card in the background", removed->reader->name);
+	return CKR_OK;
+}
+
+/* The old card of the reader is still being disconnected */
+static int card_reclaiming(sc_reader_t *reader)
 {
+	struct sc_pkcs11_removed_card *removed;
+	int found = 0;
+
+	pthread_mutex_lock(&reclaim_mutex);
+	for (removed = reclaim_head; removed; removed = removed->next)
+		if (removed->reader == reader)
+			found = 1;
+	pthread_mutex_unlock(&reclaim_mutex);
+	return found;
+}
+#endif
+
+/* With defer, the slots are emptied right away and the card is released by
+ * a background thread, see async_token_removal */
+static CK_RV card_remove(sc_reader_t *reader, int defer)
+{
+	sc_pkcs11_slot_t *slot;
 	unsigned int i;
 	struct sc_pkcs11_card *p11card = NULL;
+	struct sc_pkcs11_removed_card *removed = NULL;
 	/* Mark all slots as "token not present" */
 	sc_log(context, "%s: card removed", reader->name);
 
 
-	for (i=0; i < list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-		if (slot->reader == reader) {
+	for (slot = slot_first_of_reader(reader); slot; slot = slot->reader_next) {
+		if (slot->p11card) {
 			/* Save the "card" object */
-			if (slot->p11card)
-				p11card = slot->p11card;
-			slot_token_removed(slot->id);
+			p11card = slot->p11card;
+			break;
+		}
+	}
+
+#ifdef HAVE_BIND_THREAD
+	if (p11card && defer && (removed = calloc(1, sizeof *removed)) != NULL) {
+		for (slot = slot_first_of_reader(reader); slot; slot = slot->reader_next)
+			removed->ntokens++;
+		removed->tokens = calloc(removed->ntokens, sizeof *removed->tokens);
+		if (removed->tokens == NULL) {
+			free(removed);
+			removed = NULL;
+		}
+	}
+#endif
+
+	/* Wait for operations still running on this card */
+	if (p11card && p11card->lock && p11card->card
+			&& sc_pkcs11_conf.fair_slot_locking) {
+		unsigned long ticket;
+
+		/* and for the ones lined up in sc_pkcs11_lock_slot(); nobody can
+		 * line up behind us while we hold the global lock */
+		if (sc_queue_take(p11card->card, &ticket) == SC_SUCCESS) {
+			sc_queue_wait(p11card->card, ticket);
+			sc_pkcs11_card_lock(p11card);
+			sc_queue_leave(p11card->card);
+		} else {
+			sc_pkcs11_card_lock(p11card);
 		}
+	} else {
+		sc_pkcs11_card_lock(p11card);
 	}
 
+	i = 0;
+	for (slot = slot_first_of_reader(reader); slot; slot = slot->reader_next)
+		slot_token_remove(slot, removed ? &removed->tokens[i++] : NULL);
+
 	if (p11card) {
-		p11card->framework->unbind(p11card);
-		sc_disconnect_card(p11card->card);
-		for (i=0; i < p11card->nmechanisms; ++i) {
-			if (p11card->mechanisms[i]->free_mech_data) {
-				p11card->mechanisms[i]->free_mech_data(p11card->mechanisms[i]->mech_data);
-			}
-			free(p11card->mechanisms[i]);
+		/* none of the slots refers to the card anymore, so nobody can
+		 * wait for its lock */
+		sc_pkcs11_card_unlock(p11card);
+		if (removed) {
+			removed->reader = reader;
+			removed->p11card = p11card;
+#ifdef HAVE_BIND_THREAD
+			if (card_reclaim_start(removed) == CKR_OK)
+				return CKR_OK;
+#endif
+			card_free_tokens(removed);
+			free(removed);
 		}
-		free(p11card->mechanisms);
-		free(p11card);
+		card_free(p11card);
 	}
 
 	return CKR_OK;
 }
 
+CK_RV card_removed(sc_reader_t * reader)
+{
+	return card_remove(reader, 0);
+}
 
-CK_RV card_detect(sc_reader_t *reader)
+/* Called from C_Finalize with the global lock held; drops it while waiting
+ * until the removed cards are released */
+void card_reclaim_wait(void)
 {
-	struct sc_pkcs11_card *p11card = NULL;
-	int free_p11card = 0;
-	int rc;
+#ifdef HAVE_BIND_THREAD
+	pthread_mutex_lock(&reclaim_mutex);
+	if (reclaim_running) {
+		sc_pkcs11_unlock();
+		while (reclaim_running)
+			pthread_cond_wait(&reclaim_cond, &reclaim_mutex);
+		pthread_mutex_unlock(&reclaim_mutex);
+		sc_pkcs11_lock();
+		return;
+	}
+	pthread_mutex_unlock(&reclaim_mutex);
+#endif
+}
+
+
+static void card_release(struct sc_pkcs11_card *p11card)
+{
+	if (p11card->framework)
+		p11card->framework->unbind(p11card);
+	if (p11card->card != NULL)
+		sc_disconnect_card(p11card->card);
+	free(p11card->snapshot_mechanisms);
+	free(p11card->snapshot_mechanism_info);
+	sc_pkcs11_card_free_lock(p11card);
+	free(p11card);
+}
+
+#ifdef HAVE_BIND_THREAD
+static pthread_mutex_t bind_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bind_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int bind_threads = 0;
+static unsigned int bind_generation = 0;
+static int bind_stopping = 0;
+
+static int card_binding(sc_reader_t *reader)
+{
+	sc_pkcs11_slot_t *slot;
+
+	for (slot = slot_first_of_reader(reader); slot; slot = slot->reader_next)
+		if (slot->flags & SC_PKCS11_SLOT_FLAG_BINDING)
+			return 1;
+	return 0;
+}
+#endif
+
+/* Create the slot of an application that is bound on first use, see
+ * SC_PKCS11_SLOT_FLAG_UNBOUND. EF.DIR only gives its label. */
+static CK_RV slot_create_unbound(struct sc_pkcs11_card *p11card, struct sc_app_info *app_info,
+		struct sc_pkcs11_slot **out)
+{
+	struct sc_pkcs11_slot *slot = NULL;
+	CK_TOKEN_INFO *token = NULL;
 	CK_RV rv;
-	unsigned int i;
-	int j;
 
-	sc_log(context, "%s: Detecting smart card", reader->name);
-	/* Check if someone inserted a card */
-again:
-	rc = sc_detect_card_presence(reader);
-	if (rc < 0) {
-		sc_log(context, "%s: failed, %s", reader->name, sc_strerror(rc));
-		return sc_to_cryptoki_error(rc, NULL);
+	rv = slot_allocate(&slot, p11card);
+	if (rv != CKR_OK)
+		return rv;
+
+	slot->slot_info.flags |= CKF_TOKEN_PRESENT;
+	slot->app_info = app_info;
+	slot->flags |= SC_PKCS11_SLOT_FLAG_UNBOUND;
+
+	token = &slot->token_info;
+	strcpy_bp(token->label, app_info && app_info->label ? app_info->label : "", 32);
+	strcpy_bp(token->manufacturerID, "", 32);
+	strcpy_bp(token->model, "PKCS#15", 16);
+	strcpy_bp(token->serialNumber, "", 16);
+	token->flags = CKF_TOKEN_INITIALIZED;
+	token->ulMaxSessionCount = CK_EFFECTIVELY_INFINITE;
+	token->ulMaxRwSessionCount = CK_EFFECTIVELY_INFINITE;
+	token->ulTotalPublicMemory = CK_UNAVAILABLE_INFORMATION;
+	token->ulFreePublicMemory = CK_UNAVAILABLE_INFORMATION;
+	token->ulTotalPrivateMemory = CK_UNAVAILABLE_INFORMATION;
+	token->ulFreePrivateMemory = CK_UNAVAILABLE_INFORMATION;
+	sc_log(context, "%s: slot 0x%lx waits for application %s", p11card->reader->name,
+			slot->id, app_info && app_info->label ? app_info->label : "<anonymous>");
+	if (out)
+		*out = slot;
+	return CKR_OK;
+}
+
+static CK_RV create_tokens(struct sc_pkcs11_card *p11card,
+		struct sc_app_info *app_info, int lazy)
+{
+	if (lazy)
+		return slot_create_unbound(p11card, app_info, NULL);
+	return p11card->framework->create_tokens(p11card, app_info);
+}
+
+static CK_RV card_create_tokens(struct sc_pkcs11_card *p11card,
+		struct sc_app_info *app_info, int unlocked, int lazy)
+{
+	CK_RV rv;
+
+	if (!unlocked)
+		return create_tokens(p11card, app_info, lazy);
+
+	/* creating the tokens allocates slots and needs the global lock */
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+#ifdef HAVE_BIND_THREAD
+	if (bind_stopping) {
+		sc_pkcs11_unlock();
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
 	}
-	if (rc == 0) {
-		sc_log(context, "%s: card absent", reader->name);
-		card_removed(reader);	/* Release all resources */
-		return CKR_TOKEN_NOT_PRESENT;
+#endif
+	rv = create_tokens(p11card, app_info, lazy);
+	sc_pkcs11_unlock();
+	return rv;
+}
+
+/*
+ * Token snapshots, see token_snapshots in opensc.conf. Once a card is
+ * bound, the token info of its slots and its mechanisms are written to the
+ * cache directory, in a file named after the card's serial number:
+ *
+ *   magic "P11T" | version (1) | ATR length (1) | ATR |
+ *   mechanism count (2) | mechanisms | token count (1) | tokens
+ *
+ * A mechanism is its type, minimum and maximum key size and flags, 4 bytes
+ * each. A token is the index of its application in EF.DIR (0xFF for none),
+ * the AID length (1) and AID (16) of the application, followed by the
+ * fields of its CK_TOKEN_INFO: label (32), manufacturerID (32), model (16),
+ * serialNumber (16), flags (4), ulMaxPinLen (4), ulMinPinLen (4),
+ * hardwareVersion (2), firmwareVersion (2) and utcTime (16). All numbers
+ * are big endian.
+ *
+ * When a card with the same ATR, serial number and applications comes
+ * back, its slots are created from the snapshot as unbound slots (see
+ * SC_PKCS11_SLOT_FLAG_UNBOUND) and every application is bound when its
+ * first session is opened, which writes the snapshot again. The PIN status
+ * is not kept.
+ */
+#define SNAPSHOT_MAGIC		"P11T"
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_MECH_SIZE	16
+#define SNAPSHOT_TOKEN_SIZE	(2 + SC_MAX_AID_SIZE + 32 + 32 + 16 + 16 + 4 + 4 + 4 + 2 + 2 + 16)
+#define SNAPSHOT_MAX_SIZE	(4 + 2 + SC_MAX_ATR_SIZE + 2 + 0xFFFF * SNAPSHOT_MECH_SIZE \
+				 + 1 + 0xFF * SNAPSHOT_TOKEN_SIZE)
+#define SNAPSHOT_NO_APP		0xFF
+#define SNAPSHOT_PIN_STATUS	(CKF_USER_PIN_COUNT_LOW | CKF_USER_PIN_FINAL_TRY \
+				 | CKF_USER_PIN_LOCKED | CKF_USER_PIN_TO_BE_CHANGED \
+				 | CKF_SO_PIN_COUNT_LOW | CKF_SO_PIN_FINAL_TRY \
+				 | CKF_SO_PIN_LOCKED | CKF_SO_PIN_TO_BE_CHANGED)
+
+static void snapshot_put(u8 *p, unsigned long value, size_t len)
+{
+	while (len-- > 0) {
+		p[len] = (u8)(value & 0xFF);
+		value >>= 8;
 	}
+}
 
-	/* If the card was changed, disconnect the current one */
-	if (rc & SC_READER_CARD_CHANGED) {
-		sc_log(context, "%s: Card changed", reader->name);
-		/* The following should never happen - but if it
-		 * does we'll be stuck in an endless loop.
-		 * So better be fussy.
-		if (!retry--)
-			return CKR_TOKEN_NOT_PRESENT; */
-		card_removed(reader);
-		goto again;
+static unsigned long snapshot_get(const u8 *p, size_t len)
+{
+	unsigned long value = 0;
+
+	while (len-- > 0)
+		value = (value << 8) | *p++;
+	return value;
+}
+
+static int snapshot_filename(struct sc_pkcs11_card *p11card, char *buf, size_t bufsize)
+{
+	struct sc_serial_number serial;
+	char dir[PATH_MAX], hex[SC_MAX_SERIALNR * 2 + 1];
+
+	if (p11card->card == NULL
+			|| sc_card_ctl(p11card->card, SC_CARDCTL_GET_SERIALNR, &serial) != SC_SUCCESS
+			|| serial.len == 0 || serial.len > SC_MAX_SERIALNR)
+		return SC_ERROR_NOT_SUPPORTED;
+	if (sc_get_cache_dir(context, dir, sizeof dir) != SC_SUCCESS)
+		return SC_ERROR_INTERNAL;
+	sc_bin_to_hex(serial.value, serial.len, hex, sizeof hex, 0);
+	if ((size_t)snprintf(buf, bufsize, "%s/p11-%s.tok", dir, hex) >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static int snapshot_app_index(struct sc_card *card, struct sc_app_info *app_info)
+{
+	int i;
+
+	if (app_info == NULL)
+		return SNAPSHOT_NO_APP;
+	for (i = 0; i < card->app_count && i < SNAPSHOT_NO_APP; i++)
+		if (card->app[i] == app_info)
+			return i;
+	return -1;
+}
+
+/* Called with the global lock held, after the card or one of its
+ * applications was bound */
+static void card_save_snapshot(struct sc_pkcs11_card *p11card)
+{
+	struct sc_pkcs11_slot *slot, *other;
+	char fname[PATH_MAX], tmpname[PATH_MAX + 16];
+	u8 *buf, *p, *count;
+	unsigned int i, ntokens = 0, nmechs = 0;
+	size_t len;
+	FILE *f;
+	int r;
+
+	if (snapshot_filename(p11card, fname, sizeof fname) != SC_SUCCESS)
+		return;
+
+	for (i = 0; i < p11card->nmechanisms && nmechs < 0xFFFF; i++)
+		if (p11card->mechanisms[i] != NULL)
+			nmechs++;
+	len = 4 + 2 + p11card->card->atr.len + 2 + nmechs * SNAPSHOT_MECH_SIZE
+		+ 1 + 0xFF * SNAPSHOT_TOKEN_SIZE;
+	buf = malloc(len);
+	if (buf == NULL)
+		return;
+
+	p = buf;
+	memcpy(p, SNAPSHOT_MAGIC, 4);
+	p[4] = SNAPSHOT_VERSION;
+	p[5] = (u8)p11card->card->atr.len;
+	memcpy(p + 6, p11card->card->atr.value, p11card->card->atr.len);
+	p += 6 + p11card->card->atr.len;
+	snapshot_put(p, nmechs, 2);
+	p += 2;
+	for (i = 0; i < p11card->nmechanisms && nmechs > 0; i++) {
+		struct sc_pkcs11_mechanism_type *mt = p11card->mechanisms[i];
+
+		if (mt == NULL)
+			continue;
+		snapshot_put(p, mt->mech, 4);
+		snapshot_put(p + 4, mt->mech_info.ulMinKeySize, 4);
+		snapshot_put(p + 8, mt->mech_info.ulMaxKeySize, 4);
+		snapshot_put(p + 12, mt->mech_info.flags, 4);
+		p += SNAPSHOT_MECH_SIZE;
+		nmechs--;
 	}
 
-	/* Locate a slot related to the reader */
-	for (i=0; i<list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-		if (slot->reader == reader) {
-			p11card = slot->p11card;
-			break;
+	/* one token per application, the one in its first slot */
+	count = p++;
+	for (slot = slot_first_of_reader(p11card->reader); slot; slot = slot->reader_next) {
+		CK_TOKEN_INFO *token = &slot->token_info;
+		int idx;
+
+		if (slot->p11card != p11card || ntokens == 0xFF)
+			continue;
+		for (other = slot_first_of_reader(p11card->reader); other != slot; other = other->reader_next)
+			if (other->p11card == p11card && other->app_info == slot->app_info)
+				break;
+		if (other != slot)
+			continue;
+		idx = snapshot_app_index(p11card->card, slot->app_info);
+		if (idx < 0)
+			continue;
+
+		memset(p, 0, SNAPSHOT_TOKEN_SIZE);
+		p[0] = (u8)idx;
+		if (slot->app_info) {
+			p[1] = (u8)slot->app_info->aid.len;
+			memcpy(p + 2, slot->app_info->aid.value, slot->app_info->aid.len);
 		}
+		p += 2 + SC_MAX_AID_SIZE;
+		memcpy(p, token->label, 32);
+		memcpy(p + 32, token->manufacturerID, 32);
+		memcpy(p + 64, token->model, 16);
+		memcpy(p + 80, token->serialNumber, 16);
+		p += 96;
+		snapshot_put(p, token->flags & ~SNAPSHOT_PIN_STATUS, 4);
+		snapshot_put(p + 4, token->ulMaxPinLen, 4);
+		snapshot_put(p + 8, token->ulMinPinLen, 4);
+		p[12] = token->hardwareVersion.major;
+		p[13] = token->hardwareVersion.minor;
+		p[14] = token->firmwareVersion.major;
+		p[15] = token->firmwareVersion.minor;
+		memcpy(p + 16, token->utcTime, 16);
+		p += 32;
+		ntokens++;
+	}
+	*count = (u8)ntokens;
+	len = p - buf;
+	if (ntokens == 0) {
+		free(buf);
+		return;
 	}
 
-	/* Detect the card if it's not known already */
-	if (p11card == NULL) {
-		sc_log(context, "%s: First seen the card ", reader->name);
-		p11card = (struct sc_pkcs11_card *)calloc(1, sizeof(struct sc_pkcs11_card));
-		if (!p11card)
-			return CKR_HOST_MEMORY;
-		free_p11card = 1;
-		p11card->reader = reader;
+	/* readers never see a half written snapshot */
+	snprintf(tmpname, sizeof tmpname, "%s.%lu", fname, (unsigned long)getpid());
+	f = fopen(tmpname, "wb");
+	if (f == NULL && errno == ENOENT && sc_make_cache_dir(context) == SC_SUCCESS)
+		f = fopen(tmpname, "wb");
+	if (f == NULL) {
+		free(buf);
+		return;
+	}
+	r = fwrite(buf, 1, len, f) == len;
+	if (fclose(f) != 0)
+		r = 0;
+#ifdef _WIN32
+	if (r)
+		remove(fname);
+#endif
+	if (!r || rename(tmpname, fname) != 0) {
+		sc_log(context, "%s: cannot write token snapshot %s", p11card->reader->name, fname);
+		remove(tmpname);
+	} else {
+		sc_log(context, "%s: wrote token snapshot %s with %u tokens",
+				p11card->reader->name, fname, ntokens);
+	}
+	free(buf);
+}
+
+/* Called with the global lock held. Creates the unbound slots of a card
+ * that was bound before, see card_save_snapshot() */
+static CK_RV card_restore_snapshot(struct sc_pkcs11_card *p11card)
+{
+	struct sc_card *card = p11card->card;
+	struct sc_pkcs11_slot *slot;
+	char fname[PATH_MAX];
+	u8 *buf = NULL;
+	const u8 *p, *end, *tokens;
+	size_t len;
+	unsigned int i, nmechs, ntokens, nfree = 0, napps = 0;
+	u8 seen[SC_MAX_CARD_APPS];
+	FILE *f;
+	CK_RV rv = CKR_FUNCTION_FAILED;
+
+	if (snapshot_filename(p11card, fname, sizeof fname) != SC_SUCCESS)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return CKR_FUNCTION_FAILED;
+	buf = malloc(SNAPSHOT_MAX_SIZE);
+	len = buf ? fread(buf, 1, SNAPSHOT_MAX_SIZE, f) : 0;
+	fclose(f);
+	if (buf == NULL)
+		return CKR_HOST_MEMORY;
+
+	/* the cheap checks come first: ATR, applications, free slots */
+	p = buf;
+	end = buf + len;
+	if (len < 6 || memcmp(p, SNAPSHOT_MAGIC, 4) || p[4] != SNAPSHOT_VERSION
+			|| p[5] != card->atr.len || len < 6 + (size_t)p[5] + 2
+			|| memcmp(p + 6, card->atr.value, card->atr.len))
+		goto out;
+	p += 6 + card->atr.len;
+	nmechs = snapshot_get(p, 2);
+	p += 2;
+	if ((size_t)(end - p) < nmechs * SNAPSHOT_MECH_SIZE + 1)
+		goto out;
+	p += nmechs * SNAPSHOT_MECH_SIZE;
+	ntokens = *p++;
+	if (ntokens == 0 || (size_t)(end - p) != ntokens * SNAPSHOT_TOKEN_SIZE)
+		goto out;
+	tokens = p;
+	/* every application of EF.DIR has exactly one token */
+	memset(seen, 0, sizeof seen);
+	for (i = 0; i < ntokens; i++, p += SNAPSHOT_TOKEN_SIZE) {
+		if (p[0] == SNAPSHOT_NO_APP) {
+			if (card->app_count > 0 || ntokens > 1)
+				goto out;
+			continue;
+		}
+		if (p[0] >= card->app_count || seen[p[0]]
+				|| p[1] != card->app[p[0]]->aid.len
+				|| memcmp(p + 2, card->app[p[0]]->aid.value, p[1]))
+			goto out;
+		seen[p[0]] = 1;
+		napps++;
+	}
+	if (napps != (unsigned int)card->app_count)
+		goto out;
+	for (slot = slot_first_of_reader(p11card->reader); slot; slot = slot->reader_next)
+		if (slot->p11card == NULL)
+			nfree++;
+	if (nfree < ntokens)
+		goto out;
+
+	free(p11card->snapshot_mechanisms);
+	free(p11card->snapshot_mechanism_info);
+	p11card->snapshot_mechanisms = calloc(nmechs ? nmechs : 1, sizeof(CK_MECHANISM_TYPE));
+	p11card->snapshot_mechanism_info = calloc(nmechs ? nmechs : 1, sizeof(CK_MECHANISM_INFO));
+	p11card->nsnapshot_mechanisms = 0;
+	if (p11card->snapshot_mechanisms == NULL || p11card->snapshot_mechanism_info == NULL) {
+		rv = CKR_HOST_MEMORY;
+		goto out;
+	}
+	p = tokens - 1 - nmechs * SNAPSHOT_MECH_SIZE;
+	for (i = 0; i < nmechs; i++, p += SNAPSHOT_MECH_SIZE) {
+		p11card->snapshot_mechanisms[i] = snapshot_get(p, 4);
+		p11card->snapshot_mechanism_info[i].ulMinKeySize = snapshot_get(p + 4, 4);
+		p11card->snapshot_mechanism_info[i].ulMaxKeySize = snapshot_get(p + 8, 4);
+		p11card->snapshot_mechanism_info[i].flags = snapshot_get(p + 12, 4);
+	}
+	p11card->nsnapshot_mechanisms = nmechs;
+
+	for (i = 0, p = tokens; i < ntokens; i++, p += SNAPSHOT_TOKEN_SIZE) {
+		struct sc_app_info *app_info = p[0] == SNAPSHOT_NO_APP ? NULL : card->app[p[0]];
+		const u8 *q = p + 2 + SC_MAX_AID_SIZE;
+		CK_TOKEN_INFO *token;
+
+		rv = slot_create_unbound(p11card, app_info, &slot);
+		if (rv != CKR_OK)
+			goto out;
+		token = &slot->token_info;
+		memcpy(token->label, q, 32);
+		memcpy(token->manufacturerID, q + 32, 32);
+		memcpy(token->model, q + 64, 16);
+		memcpy(token->serialNumber, q + 80, 16);
+		q += 96;
+		token->flags = snapshot_get(q, 4);
+		token->ulMaxPinLen = snapshot_get(q + 4, 4);
+		token->ulMinPinLen = snapshot_get(q + 8, 4);
+		token->hardwareVersion.major = q[12];
+		token->hardwareVersion.minor = q[13];
+		token->firmwareVersion.major = q[14];
+		token->firmwareVersion.minor = q[15];
+		memcpy(token->utcTime, q + 16, 16);
+	}
+	sc_log(context, "%s: restored %u tokens from snapshot %s", p11card->reader->name, ntokens, fname);
+	rv = CKR_OK;
+
+out:
+	if (rv != CKR_OK)
+		sc_log(context, "%s: token snapshot %s not used", p11card->reader->name, fname);
+	free(buf);
+	return rv;
+}
+
+static CK_RV card_snapshot(struct sc_pkcs11_card *p11card, int unlocked, int restore)
+{
+	CK_RV rv = CKR_OK;
+
+	if (!sc_pkcs11_conf.token_snapshots)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	if (unlocked) {
+		rv = sc_pkcs11_lock();
+		if (rv != CKR_OK)
+			return rv;
+	}
+#ifdef HAVE_BIND_THREAD
+	if (unlocked && bind_stopping)
+		rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+#endif
+	if (rv == CKR_OK) {
+		if (restore)
+			rv = card_restore_snapshot(p11card);
+		else
+			card_save_snapshot(p11card);
 	}
+	if (unlocked)
+		sc_pkcs11_unlock();
+	return rv;
+}
+
+/* Connect the card and create the tokens of its applications. Called with
+ * the global lock held, or without it from a binding thread (unlocked), in
+ * which case the lock is only taken to create the tokens. */
+static CK_RV card_bind(struct sc_pkcs11_card *p11card, int unlocked)
+{
+	sc_reader_t *reader = p11card->reader;
+	int rc;
+	CK_RV rv;
+	unsigned int i;
+	int j, bound = 0;
 
 	if (p11card->card == NULL) {
 		sc_log(context, "%s: Connecting ... ", reader->name);
 		rc = sc_connect_card(reader, &p11card->card);
 		if (rc != SC_SUCCESS) {
 			sc_log(context, "%s: SC connect card error %i", reader->name, rc);
-			rv = sc_to_cryptoki_error(rc, NULL);
-			goto fail;
+			return sc_to_cryptoki_error(rc, NULL);
 		}
 
 		/* escape commands are only guaranteed to be working with a card
 		 * inserted. That's why by now, after sc_connect_card() the reader's
 		 * metadata may have changed. We re-initialize the metadata for every
-		 * slot of this reader here. */
-		if (reader->flags & SC_READER_ENABLE_ESCAPE) {
-			for (i = 0; i<list_size(&virtual_slots); i++) {
-				sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-				if (slot->reader == reader)
-					init_slot_info(&slot->slot_info, reader);
-			}
+		 * slot of this reader here. A binding thread does this once it
+		 * holds the global lock again. */
+		if ((reader->flags & SC_READER_ENABLE_ESCAPE) && !unlocked) {
+			sc_pkcs11_slot_t *slot;
+
+			for (slot = slot_first_of_reader(reader); slot; slot = slot->reader_next)
+				init_slot_info(&slot->slot_info, reader);
 		}
 
 		sc_log(context, "%s: Connected SC card %p", reader->name, p11card->card);
@@ -287,13 +1035,16 @@ again:
 			if (frameworks[i]->bind != NULL)
 				break;
 		/*TODO: only first framework is used: pkcs15init framework is not reachable here */
-		if (frameworks[i] == NULL) {
-			rv = CKR_GENERAL_ERROR;
-			goto fail;
-		}
+		if (frameworks[i] == NULL)
+			return CKR_GENERAL_ERROR;
 
 		p11card->framework = frameworks[i];
 
+		/* A card seen before gets the tokens of its snapshot, which
+		 * are bound on first use */
+		if (card_snapshot(p11card, unlocked, 1) == CKR_OK)
+			return CKR_OK;
+
 		/* Initialize framework */
 		sc_log(context, "%s: Detected framework %d. Creating tokens.", reader->name, i);
 		/* Bind 'generic' application or (emulated?) card without applications */
@@ -303,12 +1054,14 @@ again:
 
 			conf_block = sc_match_atr_block(p11card->card->ctx, NULL,
 				&p11card->reader->atr);
-			if (!conf_block) /* check default block */
-				conf_block = sc_get_conf_block(context,
-					"framework", "pkcs15", 1);
+			if (conf_block) {
+				enable_InitToken = scconf_get_bool(conf_block,
+					"pkcs11_enable_InitToken", 0);
+			} else { /* check default block */
+				const struct sc_pkcs15_conf *conf = sc_pkcs15_get_conf(context);
 
-			enable_InitToken = scconf_get_bool(conf_block,
-				"pkcs11_enable_InitToken", 0);
+				enable_InitToken = conf ? conf->enable_init_token : 0;
+			}
 
 			sc_log(context, "%s: Try to bind 'generic' token.", reader->name);
 			rv = frameworks[i]->bind(p11card, app_generic);
@@ -320,17 +1073,18 @@ again:
 				sc_log(context,
 				       "%s: cannot bind 'generic' token: rv 0x%lX",
 				       reader->name, rv);
-				goto fail;
+				return rv;
 			}
 
 			sc_log(context, "%s: Creating 'generic' token.", reader->name);
-			rv = frameworks[i]->create_tokens(p11card, app_generic);
+			rv = card_create_tokens(p11card, app_generic, unlocked, 0);
 			if (rv != CKR_OK)   {
 				sc_log(context,
 				       "%s: create 'generic' token error 0x%lX",
 				       reader->name, rv);
-				goto fail;
+				return rv;
 			}
+			bound = 1;
 		}
 
 		/* Now bind the rest of applications that are not 'generic' */
@@ -341,6 +1095,19 @@ again:
 			if (app_generic && app_generic == p11card->card->app[j])
 				continue;
 
+			/* once one application is bound, the others may wait
+			 * for their first session */
+			if (bound && app_info && sc_pkcs11_conf.lazy_app_binding) {
+				rv = card_create_tokens(p11card, app_info, unlocked, 1);
+				if (rv != CKR_OK)   {
+					sc_log(context,
+					       "%s: create unbound %s token error 0x%lX",
+					       reader->name, app_name, rv);
+					return rv;
+				}
+				continue;
+			}
+
 			sc_log(context, "%s: Binding %s token.", reader->name, app_name);
 			rv = frameworks[i]->bind(p11card, app_info);
 			if (rv != CKR_OK)   {
@@ -350,94 +1117,435 @@ again:
 			}
 
 			sc_log(context, "%s: Creating %s token.", reader->name, app_name);
-			rv = frameworks[i]->create_tokens(p11card, app_info);
+			rv = card_create_tokens(p11card, app_info, unlocked, 0);
 			if (rv != CKR_OK)   {
 				sc_log(context,
 				       "%s: create %s token error 0x%lX",
 				       reader->name, app_name, rv);
-				goto fail;
+				return rv;
+			}
+			bound = 1;
+		}
+		card_snapshot(p11card, unlocked, 0);
+	}
+
+	return CKR_OK;
+}
+
+#ifdef HAVE_BIND_THREAD
+static void *card_bind_thread(void *arg)
+{
+	sc_reader_t *reader = arg;
+	struct sc_pkcs11_card *p11card;
+	CK_RV rv;
+
+	p11card = (struct sc_pkcs11_card *)calloc(1, sizeof(struct sc_pkcs11_card));
+	if (!p11card) {
+		rv = CKR_HOST_MEMORY;
+	} else {
+		p11card->reader = reader;
+		rv = sc_pkcs11_card_init_lock(p11card);
+		if (rv == CKR_OK)
+			rv = card_bind(p11card, 1);
+		if (rv != CKR_OK)
+			card_release(p11card);
+	}
+
+	if (sc_pkcs11_lock() == CKR_OK) {
+		sc_log(context, "%s: Binding ended: 0x%lX", reader->name, rv);
+		sc_pkcs11_slot_t *slot;
+
+		for (slot = slot_first_of_reader(reader); slot; slot = slot->reader_next) {
+			if (reader->flags & SC_READER_ENABLE_ESCAPE)
+				init_slot_info(&slot->slot_info, reader);
+			if (slot->flags & SC_PKCS11_SLOT_FLAG_BINDING) {
+				slot->flags &= ~SC_PKCS11_SLOT_FLAG_BINDING;
+				/* an unrecognized card is still reported as token, as
+				 * C_GetSlotInfo does for a synchronous detection */
+				if (slot->p11card == NULL && rv != CKR_TOKEN_NOT_RECOGNIZED)
+					slot->slot_info.flags &= ~CKF_TOKEN_PRESENT;
 			}
 		}
+		sc_pkcs11_unlock();
+	}
+
+	pthread_mutex_lock(&bind_mutex);
+	bind_threads--;
+	bind_generation++;
+	pthread_cond_broadcast(&bind_cond);
+	pthread_mutex_unlock(&bind_mutex);
+	return NULL;
+}
+
+/* Called with the global lock held for a card which is not bound yet. The
+ * first slot of the reader reports the token until the thread finished. */
+static CK_RV card_bind_start(sc_reader_t *reader)
+{
+	sc_pkcs11_slot_t *slot = NULL;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int r;
+
+	for (slot = slot_first_of_reader(reader); slot; slot = slot->reader_next)
+		if (slot->p11card == NULL)
+			break;
+	if (slot == NULL)
+		return CKR_FUNCTION_FAILED;
+
+	slot->flags |= SC_PKCS11_SLOT_FLAG_BINDING;
+	slot->slot_info.flags |= CKF_TOKEN_PRESENT;
+
+	pthread_mutex_lock(&bind_mutex);
+	bind_stopping = 0;
+	bind_threads++;
+	pthread_mutex_unlock(&bind_mutex);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	r = pthread_create(&thread, &attr, card_bind_thread, reader);
+	pthread_attr_destroy(&attr);
+	if (r != 0) {
+		sc_log(context, "%s: Cannot start binding thread", reader->name);
+		pthread_mutex_lock(&bind_mutex);
+		bind_threads--;
+		pthread_mutex_unlock(&bind_mutex);
+		slot->flags &= ~SC_PKCS11_SLOT_FLAG_BINDING;
+		slot->slot_info.flags &= ~CKF_TOKEN_PRESENT;
+		return CKR_FUNCTION_FAILED;
+	}
+	sc_log(context, "%s: Binding the card in the background", reader->name);
+	return CKR_OK;
+}
+
+/* Called with the global lock held; drops it while waiting until the
+ * binding of the card in the slot's reader finished */
+static void card_bind_wait(sc_pkcs11_slot_t *slot)
+{
+	unsigned int generation;
+
+	while (slot->flags & SC_PKCS11_SLOT_FLAG_BINDING) {
+		pthread_mutex_lock(&bind_mutex);
+		generation = bind_generation;
+		sc_pkcs11_unlock();
+		while (generation == bind_generation)
+			pthread_cond_wait(&bind_cond, &bind_mutex);
+		pthread_mutex_unlock(&bind_mutex);
+		if (sc_pkcs11_lock() != CKR_OK)
+			return;
+	}
+}
+
+/* Called with the global lock held; drops it while waiting until no
+ * binding thread is running. With stop, the threads discard their cards. */
+static void card_bind_wait_all(int stop)
+{
+	pthread_mutex_lock(&bind_mutex);
+	if (bind_threads) {
+		if (stop)
+			bind_stopping = 1;
+		sc_pkcs11_unlock();
+		while (bind_threads)
+			pthread_cond_wait(&bind_cond, &bind_mutex);
+		pthread_mutex_unlock(&bind_mutex);
+		sc_pkcs11_lock();
+		return;
+	}
+	pthread_mutex_unlock(&bind_mutex);
+}
+#endif
+
+/* Called from C_Finalize with the global lock held */
+void card_detect_wait_bindings(void)
+{
+#ifdef HAVE_BIND_THREAD
+	card_bind_wait_all(1);
+#endif
+}
+
+/* Called by C_Initialize() in the child after fork(), once the context has
+ * its own reader handles, see keep_tokens_after_fork. The bound tokens are
+ * kept, the logins and locks of the parent are dropped. The sessions have
+ * been freed by the caller. */
+CK_RV card_reinit_after_fork(void)
+{
+	struct sc_pkcs11_card *prev = NULL;
+	unsigned int i;
+	CK_RV rv;
+
+#ifdef HAVE_BIND_THREAD
+	/* a binding thread of the parent has not been forked */
+	for (i = 0; i < list_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = virtual_slot_table[i];
+		if (slot->flags & SC_PKCS11_SLOT_FLAG_BINDING)
+			return CKR_FUNCTION_FAILED;
+	}
+	/* neither has the reclaiming thread */
+	if (reclaim_head != NULL)
+		return CKR_FUNCTION_FAILED;
+	pthread_mutex_init(&bind_mutex, NULL);
+	pthread_cond_init(&bind_cond, NULL);
+	bind_threads = 0;
+	bind_stopping = 0;
+	pthread_mutex_init(&reclaim_mutex, NULL);
+	pthread_cond_init(&reclaim_cond, NULL);
+	reclaim_running = 0;
+#endif
+
+	for (i = 0; i < list_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = virtual_slot_table[i];
+
+		/* the card stays authenticated for the parent, without logging out */
+		slot->nsessions = 0;
+		slot->login_user = -1;
+		pop_all_login_states(slot);
+
+		/* the slots of a card follow each other */
+		if (slot->p11card == NULL || slot->p11card == prev)
+			continue;
+		prev = slot->p11card;
+
+		prev->lock = NULL;
+		rv = sc_pkcs11_card_init_lock(prev);
+		if (rv != CKR_OK)
+			return rv;
+		if (prev->card != NULL && sc_card_reinit_after_fork(prev->card) != SC_SUCCESS)
+			return CKR_FUNCTION_FAILED;
+	}
+	return CKR_OK;
+}
+
+/* With async, a card seen first is bound by a background thread */
+static CK_RV card_detect_reader(sc_reader_t *reader, int async)
+{
+	struct sc_pkcs11_card *p11card = NULL;
+	int free_p11card = 0;
+	int rc;
+	CK_RV rv;
+
+#ifdef HAVE_BIND_THREAD
+	/* the binding thread reports the outcome */
+	if (card_binding(reader))
+		return CKR_OK;
+	/* the reclaiming thread still disconnects the old card */
+	if (card_reclaiming(reader))
+		return CKR_TOKEN_NOT_PRESENT;
+#endif
+
+	sc_log(context, "%s: Detecting smart card", reader->name);
+	/* Check if someone inserted a card */
+again:
+	rc = sc_detect_card_presence(reader);
+	if (rc < 0) {
+		sc_log(context, "%s: failed, %s", reader->name, sc_strerror(rc));
+		return sc_to_cryptoki_error(rc, NULL);
+	}
+	if (rc == 0) {
+		sc_log(context, "%s: card absent", reader->name);
+		/* Release all resources */
+		card_remove(reader, sc_pkcs11_conf.async_token_removal);
+		return CKR_TOKEN_NOT_PRESENT;
 	}
 
+	/* If the card was changed, disconnect the current one */
+	if (rc & SC_READER_CARD_CHANGED) {
+		sc_log(context, "%s: Card changed", reader->name);
+		/* The following should never happen - but if it
+		 * does we'll be stuck in an endless loop.
+		 * So better be fussy.
+		if (!retry--)
+			return CKR_TOKEN_NOT_PRESENT; */
+		card_removed(reader);
+		goto again;
+	}
+
+	/* Locate a slot related to the reader */
+	if (slot_first_of_reader(reader))
+		p11card = slot_first_of_reader(reader)->p11card;
+
+#ifdef HAVE_BIND_THREAD
+	if (p11card == NULL && async && card_bind_start(reader) == CKR_OK)
+		return CKR_OK;
+#endif
+
+	/* Detect the card if it's not known already */
+	if (p11card == NULL) {
+		sc_log(context, "%s: First seen the card ", reader->name);
+		p11card = (struct sc_pkcs11_card *)calloc(1, sizeof(struct sc_pkcs11_card));
+		if (!p11card)
+			return CKR_HOST_MEMORY;
+		free_p11card = 1;
+		p11card->reader = reader;
+		rv = sc_pkcs11_card_init_lock(p11card);
+		if (rv != CKR_OK)
+			goto fail;
+	}
+
+	rv = card_bind(p11card, 0);
+	if (rv != CKR_OK)
+		goto fail;
+
 	sc_log(context, "%s: Detection ended", reader->name);
 	return CKR_OK;
 
 fail:
-	if (free_p11card) {
-		if (p11card->framework)
-			p11card->framework->unbind(p11card);
-		if (p11card->card != NULL)
-			sc_disconnect_card(p11card->card);
-		free(p11card);
-	}
+	if (free_p11card)
+		card_release(p11card);
 
 	return rv;
 }
 
+CK_RV card_detect(sc_reader_t *reader)
+{
+	return card_detect_reader(reader, sc_pkcs11_conf.async_token_binding);
+}
+
+
+/* Ask for the state of all readers at once, card_detect_reader() then uses
+ * it instead of asking for every reader separately */
+static void refresh_all_readers(void)
+{
+	unsigned int i, count = sc_ctx_get_reader_count(context);
+	sc_reader_t **readers;
+	size_t n = 0;
+
+	if (count < 2)
+		return;
+	readers = calloc(count, sizeof *readers);
+	if (readers == NULL)
+		return;
+	for (i = 0; i < count; i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(context, i);
+
+		if (reader == NULL || reader->flags & SC_READER_REMOVED)
+			continue;
+#ifdef HAVE_BIND_THREAD
+		/* the binding or reclaiming thread is using the reader */
+		if (card_binding(reader) || card_reclaiming(reader))
+			continue;
+#endif
+		readers[n++] = reader;
+	}
+	if (n > 1)
+		sc_detect_cards_presence(context, readers, n);
+	free(readers);
+}
+
 
 CK_RV
 card_detect_all(void)
 {
+	sc_pkcs11_slot_t *slot;
 	unsigned int i, j;
+	/* bind the cards of all readers concurrently, but still return only
+	 * once all of them are done unless binding is asynchronous anyway */
+	int parallel = sc_pkcs11_conf.parallel_card_detection
+		&& !sc_pkcs11_conf.async_token_binding;
 
 	sc_log(context, "Detect all cards");
+	refresh_all_readers();
 	/* Detect cards in all initialized readers */
 	for (i=0; i< sc_ctx_get_reader_count(context); i++) {
 		sc_reader_t *reader = sc_ctx_get_reader(context, i);
 
 		if (reader->flags & SC_READER_REMOVED) {
-			card_removed(reader);
+#ifdef HAVE_BIND_THREAD
+			/* handled once the binding thread gave up */
+			if (card_binding(reader))
+				continue;
+#endif
+			card_remove(reader, sc_pkcs11_conf.async_token_removal);
 			/* do not remove slots related to this reader which would be
 			 * possible according to PKCS#11 2.20 and later, because NSS can't
 			 * handle a shrinking slot list
 			 * https://bugzilla.mozilla.org/show_bug.cgi?id=1613632 */
 
 			/* Instead, remove the releation between reader and slot */
-			for (j = 0; j<list_size(&virtual_slots); j++) {
-				sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, j);
-				if (slot->reader == reader) {
-					slot->reader = NULL;
-				}
+			while ((slot = slot_first_of_reader(reader)) != NULL) {
+				slot_unlink_reader(slot);
+				if (slot_link_reader(slot, NULL) != CKR_OK)
+					return CKR_HOST_MEMORY;
 			}
 		} else {
 			/* Locate a slot related to the reader */
-			int found = 0;
-			for (j = 0; j<list_size(&virtual_slots); j++) {
-				sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, j);
-				if (slot->reader == reader) {
-					found = 1;
-					break;
-				}
-			}
-			if (!found) {
+			if (!slot_first_of_reader(reader)) {
 				for (j = 0; j < sc_pkcs11_conf.slots_per_card; j++) {
 					CK_RV rv = create_slot(reader);
 					if (rv != CKR_OK)
 						return rv;
 				}
 			}
-			card_detect(reader);
+			card_detect_reader(reader,
+				parallel || sc_pkcs11_conf.async_token_binding);
 		}
 	}
+#ifdef HAVE_BIND_THREAD
+	if (parallel)
+		card_bind_wait_all(0);
+#endif
 	sc_log(context, "All cards detected");
+	card_reclaim_idle();
 	return CKR_OK;
 }
 
+/*
+ * Let the frameworks drop the state of the cards that were not used for
+ * idle_token_timeout seconds. The slots, objects and their handles stay;
+ * what was dropped is read again (from the file cache, if enabled) when
+ * the token is used next. Called with the global lock held.
+ */
+void
+card_reclaim_idle(void)
+{
+	sc_timestamp_t now;
+	unsigned int i;
+
+	if (!sc_pkcs11_conf.idle_token_timeout)
+		return;
+
+	now = get_current_time();
+	for (i = 0; i < list_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = virtual_slot_table[i];
+		struct sc_pkcs11_card *p11card = slot->p11card;
+
+		if (!p11card || p11card->reclaimed || !p11card->framework
+				|| !p11card->framework->reclaim)
+			continue;
+		if (p11card->last_used == 0) {
+			/* bound since the last check */
+			p11card->last_used = now;
+			continue;
+		}
+		if (now - p11card->last_used < sc_pkcs11_conf.idle_token_timeout * 1000ULL)
+			continue;
+
+		sc_log(context, "Slot 0x%lx: reclaiming the state of the idle token", slot->id);
+		sc_pkcs11_card_lock(p11card);
+		p11card->framework->reclaim(p11card);
+		p11card->reclaimed = 1;
+		sc_pkcs11_card_unlock(p11card);
+	}
+}
+
 /* Allocates an existing slot to a card */
 CK_RV slot_allocate(struct sc_pkcs11_slot ** slot, struct sc_pkcs11_card * p11card)
 {
-	unsigned int i;
 	struct sc_pkcs11_slot *tmp_slot = NULL;
 
-	/* Locate a free slot for this reader */
-	for (i=0; i< list_size(&virtual_slots); i++) {
-		tmp_slot = (struct sc_pkcs11_slot *)list_get_at(&virtual_slots, i);
-		if (tmp_slot->reader == p11card->reader && tmp_slot->p11card == NULL)
-			break;
+	/* Locate a free slot for this reader. The slot of an application that
+	 * is being bound on first use is taken first, see slot_bind_app() */
+	for (tmp_slot = slot_first_of_reader(p11card->reader); tmp_slot; tmp_slot = tmp_slot->reader_next) {
+		if (tmp_slot->p11card == NULL
+				&& (tmp_slot->flags & SC_PKCS11_SLOT_FLAG_UNBOUND)) {
+			tmp_slot->flags &= ~SC_PKCS11_SLOT_FLAG_UNBOUND;
+			goto found;
+		}
 	}
-	if (!tmp_slot || (i == list_size(&virtual_slots)))
+	for (tmp_slot = slot_first_of_reader(p11card->reader); tmp_slot; tmp_slot = tmp_slot->reader_next)
+		if (tmp_slot->p11card == NULL)
+			break;
+	if (!tmp_slot)
 		return CKR_FUNCTION_FAILED;
+found:
 	sc_log(context, "Allocated slot 0x%lx for card in reader %s", tmp_slot->id, p11card->reader->name);
 	tmp_slot->p11card = p11card;
 	tmp_slot->events = SC_EVENT_CARD_INSERTED;
@@ -449,9 +1557,13 @@ CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 {
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	card_detect_deferred();
 
-	*slot = list_seek(&virtual_slots, &id);	/* FIXME: check for null? */
-	if (!*slot)
+	/* slot IDs are the positions in virtual_slots, see slot_allocate() */
+	if (id >= list_size(&virtual_slots))
+		return CKR_SLOT_ID_INVALID;
+	*slot = virtual_slot_table[id];
+	if (!*slot || (*slot)->id != id)
 		return CKR_SLOT_ID_INVALID;
 	return CKR_OK;
 }
@@ -474,6 +1586,10 @@ CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 			return rv;
 	}
 
+#ifdef HAVE_BIND_THREAD
+	card_bind_wait(*slot);
+#endif
+
 	if (!((*slot)->slot_info.flags & CKF_TOKEN_PRESENT)) {
 		sc_log(context, "card detected, but slot not presenting token");
 		return CKR_TOKEN_NOT_PRESENT;
@@ -482,33 +1598,83 @@ CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 	return CKR_OK;
 }
 
-CK_RV slot_token_removed(CK_SLOT_ID id)
+/* Bind the application of a slot created by slot_create_unbound(). The
+ * framework then creates the tokens of the application as usual, the first
+ * one in this slot. Called with the global lock held. */
+CK_RV slot_bind_app(struct sc_pkcs11_slot *slot)
 {
+	struct sc_pkcs11_card *p11card = slot->p11card;
+	struct sc_app_info *app_info = slot->app_info;
+	const char *app_name = app_info && app_info->label ? app_info->label : "<anonymous>";
 	CK_RV rv;
-	int token_was_present;
-	struct sc_pkcs11_slot *slot;
-	struct sc_pkcs11_object *object;
 
-	sc_log(context, "slot_token_removed(0x%lx)", id);
-	rv = slot_get_slot(id, &slot);
-	if (rv != CKR_OK)
+	if (!(slot->flags & SC_PKCS11_SLOT_FLAG_UNBOUND))
+		return CKR_OK;
+	if (p11card == NULL || p11card->framework == NULL)
+		return CKR_TOKEN_NOT_PRESENT;
+
+	sc_log(context, "%s: Binding %s token on first use.", p11card->reader->name, app_name);
+	rv = p11card->framework->bind(p11card, app_info);
+	if (rv != CKR_OK) {
+		sc_log(context, "%s: bind %s token error 0x%lX", p11card->reader->name, app_name, rv);
 		return rv;
+	}
+
+	/* hand the slot over to slot_allocate() */
+	slot->p11card = NULL;
+	slot->slot_info.flags &= ~CKF_TOKEN_PRESENT;
+	slot->token_info_expires = 0;
+	memset(&slot->token_info, 0, sizeof slot->token_info);
 
+	rv = p11card->framework->create_tokens(p11card, app_info);
+	if (rv != CKR_OK)
+		sc_log(context, "%s: create %s token error 0x%lX", p11card->reader->name, app_name, rv);
+	if (slot->p11card == NULL) {
+		/* no token of the application ended up in this slot */
+		slot->flags &= ~SC_PKCS11_SLOT_FLAG_UNBOUND;
+		return rv != CKR_OK ? rv : CKR_TOKEN_NOT_PRESENT;
+	}
+	if (rv == CKR_OK)
+		card_snapshot(p11card, 0, 0);
+	return rv;
+}
+
+/* With removed, the objects and the framework data of the token are handed
+ * over instead of being released, see async_token_removal */
+static CK_RV slot_token_remove(struct sc_pkcs11_slot *slot, struct sc_pkcs11_removed_token *removed)
+{
+	int token_was_present;
+	struct sc_pkcs11_object *object;
+
+	sc_log(context, "slot_token_removed(0x%lx)", slot->id);
 	token_was_present = (slot->slot_info.flags & CKF_TOKEN_PRESENT);
 
 	/* Terminate active sessions */
-	sc_pkcs11_close_all_sessions(id);
-
-	while ((object = list_fetch(&slot->objects))) {
-		if (object->ops->release)
-			object->ops->release(object);
+	sc_pkcs11_close_all_sessions(slot->id);
+
+	if (removed != NULL) {
+		removed->objects = slot->objects;
+		removed->nobjects = slot->nobjects;
+		slot->objects = NULL;
+		slot->nobjects = 0;
+		slot->objects_size = 0;
+	} else {
+		while (slot->nobjects > 0) {
+			object = slot->objects[--slot->nobjects];
+			if (object->ops->release)
+				object->ops->release(object);
+		}
 	}
+	slot_invalidate_index(slot);
 
 	/* Release framework stuff */
 	if (slot->p11card != NULL) {
 		if (slot->fw_data != NULL && slot->p11card->framework != NULL
 				&& slot->p11card->framework->release_token != NULL) {
-			slot->p11card->framework->release_token(slot->p11card, slot->fw_data);
+			if (removed != NULL)
+				removed->fw_data = slot->fw_data;
+			else
+				slot->p11card->framework->release_token(slot->p11card, slot->fw_data);
 			slot->fw_data = NULL;
 		}
 		slot->p11card = NULL;
@@ -517,6 +1683,8 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	/* Reset relevant slot properties */
 	slot->slot_info.flags &= ~CKF_TOKEN_PRESENT;
 	slot->login_user = -1;
+	slot->flags &= ~(SC_PKCS11_SLOT_FLAG_POOL_LOGIN | SC_PKCS11_SLOT_FLAG_UNBOUND);
+	slot->token_info_expires = 0;
 	pop_all_login_states(slot);
 
 	if (token_was_present)
@@ -527,15 +1695,35 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	return CKR_OK;
 }
 
+CK_RV slot_token_removed(CK_SLOT_ID id)
+{
+	CK_RV rv;
+	struct sc_pkcs11_slot *slot;
+
+	rv = slot_get_slot(id, &slot);
+	if (rv != CKR_OK)
+		return rv;
+
+	return slot_token_remove(slot, NULL);
+}
+
 /* Called from C_WaitForSlotEvent */
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 {
-	unsigned int i;
 	LOG_FUNC_CALLED(context);
 
 	card_detect_all();
+	LOG_FUNC_RETURN(context, slot_find_event(idp, mask));
+}
+
+/* Consume a pending event of the already detected slot states */
+CK_RV slot_find_event(CK_SLOT_ID_PTR idp, int mask)
+{
+	unsigned int i;
+	LOG_FUNC_CALLED(context);
+
 	for (i=0; i<list_size(&virtual_slots); i++) {
-		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+		sc_pkcs11_slot_t *slot = virtual_slot_table[i];
 		sc_log(context, "slot 0x%lx token: %lu events: 0x%02X",
 		       slot->id, (slot->slot_info.flags & CKF_TOKEN_PRESENT),
 		       slot->events);
@@ -554,3 +1742,316 @@ CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 	}
 	LOG_FUNC_RETURN(context, CKR_NO_EVENT);
 }
+
+/*
+ * Object index
+ */
+
+/* Indexed attributes, ordered by their expected selectivity */
+static const CK_ATTRIBUTE_TYPE indexed_attributes[] = {
+	CKA_ID, CKA_LABEL, CKA_CLASS
+};
+#define NUM_INDEXED_ATTRIBUTES	(sizeof(indexed_attributes)/sizeof(indexed_attributes[0]))
+
+/* FNV-1a over the attribute type and value */
+static unsigned long index_hash(CK_ATTRIBUTE_TYPE type, const void *value, CK_ULONG len)
+{
+	const unsigned char *p = value;
+	unsigned long hash = 2166136261UL;
+	CK_ULONG i;
+
+	for (i = 0; i < sizeof(type); i++) {
+		hash ^= (type >> (8 * i)) & 0xFF;
+		hash *= 16777619UL;
+	}
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 16777619UL;
+	}
+	return hash & 0xFFFFFFFFUL;
+}
+
+static CK_RV index_attribute_hash(struct sc_pkcs11_session *session,
+		struct sc_pkcs11_object *object, CK_ATTRIBUTE_TYPE type,
+		unsigned long *hash)
+{
+	unsigned char buf[256];
+	CK_ATTRIBUTE attr = { type, NULL, 0 };
+	CK_RV rv;
+
+	rv = object->ops->get_attribute(session, object, &attr);
+	if (rv != CKR_OK || attr.ulValueLen == (CK_ULONG) -1)
+		return CKR_ATTRIBUTE_TYPE_INVALID;
+
+	if (attr.ulValueLen <= sizeof(buf)) {
+		attr.pValue = buf;
+	} else {
+		attr.pValue = malloc(attr.ulValueLen);
+		if (attr.pValue == NULL)
+			return CKR_HOST_MEMORY;
+	}
+
+	rv = object->ops->get_attribute(session, object, &attr);
+	if (rv == CKR_OK)
+		*hash = index_hash(type, attr.pValue, attr.ulValueLen);
+
+	if (attr.pValue != buf)
+		free(attr.pValue);
+	return rv;
+}
+
+void slot_invalidate_index(struct sc_pkcs11_slot *slot)
+{
+	if (!slot)
+		return;
+	/* running searches restart their iterator */
+	slot->objects_generation++;
+	if (!slot->index)
+		return;
+
+	free(slot->index->buckets);
+	free(slot->index->nodes);
+	free(slot->index);
+	slot->index = NULL;
+}
+
+static CK_RV slot_build_index(struct sc_pkcs11_session *session)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+	struct sc_pkcs11_object_index *index;
+	struct sc_pkcs11_object **objects = slot->objects;
+	unsigned int i, j, n, used = 0;
+	CK_RV rv = CKR_HOST_MEMORY;
+
+	n = slot->nobjects;
+	index = calloc(1, sizeof(struct sc_pkcs11_object_index));
+	if (!index)
+		return CKR_HOST_MEMORY;
+
+	index->nbuckets = 16;
+	while (index->nbuckets < n * NUM_INDEXED_ATTRIBUTES)
+		index->nbuckets <<= 1;
+	index->buckets = calloc(index->nbuckets, sizeof(struct sc_pkcs11_index_node *));
+	index->nodes = calloc(n * NUM_INDEXED_ATTRIBUTES + 1, sizeof(struct sc_pkcs11_index_node));
+	if (!index->buckets || !index->nodes)
+		goto err;
+
+	/* Insert in reverse order so that every chain keeps the order of
+	 * slot->objects */
+	for (i = n; i-- > 0; ) {
+		for (j = 0; j < NUM_INDEXED_ATTRIBUTES; j++) {
+			struct sc_pkcs11_index_node *node = &index->nodes[used];
+			unsigned long hash;
+
+			if (index_attribute_hash(session, objects[i], indexed_attributes[j], &hash) != CKR_OK)
+				continue;
+
+			node->type = indexed_attributes[j];
+			node->hash = hash;
+			node->object = objects[i];
+			node->next = index->buckets[hash & (index->nbuckets - 1)];
+			index->buckets[hash & (index->nbuckets - 1)] = node;
+			used++;
+		}
+	}
+
+	slot_invalidate_index(slot);
+	slot->index = index;
+	sc_log(context, "Slot 0x%lx: indexed %u objects (%u entries)", slot->id, n, used);
+	return CKR_OK;
+
+err:
+	free(index->buckets);
+	free(index->nodes);
+	free(index);
+	return rv;
+}
+
+void slot_objects_init(struct sc_pkcs11_object_iter *iter, struct sc_pkcs11_session *session,
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+	CK_ATTRIBUTE_PTR attr = NULL;
+	unsigned int i;
+	CK_ULONG j;
+
+	memset(iter, 0, sizeof(*iter));
+	iter->slot = slot;
+
+	/* Use the most selective indexed attribute of the template */
+	for (i = 0; i < NUM_INDEXED_ATTRIBUTES && attr == NULL; i++) {
+		for (j = 0; j < ulCount; j++) {
+			if (pTemplate[j].type == indexed_attributes[i]
+					&& (pTemplate[j].pValue != NULL || pTemplate[j].ulValueLen == 0)) {
+				attr = &pTemplate[j];
+				break;
+			}
+		}
+	}
+	if (attr == NULL)
+		return;
+
+	if (slot->index == NULL && slot_build_index(session) != CKR_OK)
+		return;
+
+	iter->indexed = 1;
+	iter->type = attr->type;
+	iter->hash = index_hash(attr->type, attr->pValue, attr->ulValueLen);
+	iter->node = slot->index->buckets[iter->hash & (slot->index->nbuckets - 1)];
+}
+
+struct sc_pkcs11_object *slot_objects_next(struct sc_pkcs11_object_iter *iter)
+{
+	struct sc_pkcs11_index_node *node;
+
+	if (!iter->indexed) {
+		if (iter->pos >= iter->slot->nobjects)
+			return NULL;
+		return iter->slot->objects[iter->pos++];
+	}
+
+	for (node = iter->node; node != NULL; node = node->next) {
+		if (node->type == iter->type && node->hash == iter->hash) {
+			iter->node = node->next;
+			return node->object;
+		}
+	}
+	iter->node = NULL;
+	return NULL;
+}
+
+/*
+ * The objects of a slot are kept in an array in the order they were
+ * added, which is the order C_FindObjects reports them in. The handles
+ * are assigned by the framework and stay valid while the object is in
+ * the slot.
+ */
+CK_RV slot_add_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	if (slot->nobjects == slot->objects_size) {
+		unsigned int size = slot->objects_size ? 2 * slot->objects_size : 16;
+		struct sc_pkcs11_object **objects;
+
+		objects = realloc(slot->objects, size * sizeof(*objects));
+		if (!objects)
+			return CKR_HOST_MEMORY;
+		slot->objects = objects;
+		slot->objects_size = size;
+	}
+	slot->objects[slot->nobjects++] = object;
+	slot_invalidate_index(slot);
+	return CKR_OK;
+}
+
+int slot_has_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	unsigned int i;
+
+	for (i = 0; i < slot->nobjects; i++)
+		if (slot->objects[i] == object)
+			return 1;
+	return 0;
+}
+
+void slot_remove_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	unsigned int i;
+
+	for (i = 0; i < slot->nobjects; i++) {
+		if (slot->objects[i] == object) {
+			/* keep the order of the remaining objects */
+			memmove(&slot->objects[i], &slot->objects[i + 1],
+					(slot->nobjects - i - 1) * sizeof(*slot->objects));
+			slot->nobjects--;
+			slot_invalidate_index(slot);
+			return;
+		}
+	}
+}
+
+struct sc_pkcs11_object *slot_find_object(struct sc_pkcs11_slot *slot, CK_OBJECT_HANDLE handle)
+{
+	unsigned int i;
+
+	for (i = 0; i < slot->nobjects; i++)
+		if (slot->objects[i]->handle == handle)
+			return slot->objects[i];
+	return NULL;
+}
+
+/*
+ * With token_pool, the tokens with the same label, manufacturer and model
+ * in other cards form the pool of a slot, e.g. several HSMs restored from
+ * the same backup. The private key operations of a slot may run on the
+ * key with the same CKA_ID of any token of its pool. The slots of the
+ * pool have to be locked individually, so this needs per_slot_locking.
+ */
+int slot_pool_member(struct sc_pkcs11_slot *slot, struct sc_pkcs11_slot *other)
+{
+	if (!sc_pkcs11_conf.token_pool || other == slot)
+		return 0;
+	if (!slot->p11card || !other->p11card || other->p11card == slot->p11card
+			|| !slot->p11card->lock || !other->p11card->lock
+			|| other->p11card->framework != slot->p11card->framework)
+		return 0;
+	if (!(other->slot_info.flags & CKF_TOKEN_PRESENT)
+			|| (other->flags & SC_PKCS11_SLOT_FLAG_BINDING))
+		return 0;
+
+	return !memcmp(other->token_info.label, slot->token_info.label,
+				sizeof(slot->token_info.label))
+		&& !memcmp(other->token_info.manufacturerID, slot->token_info.manufacturerID,
+				sizeof(slot->token_info.manufacturerID))
+		&& !memcmp(other->token_info.model, slot->token_info.model,
+				sizeof(slot->token_info.model));
+}
+
+/* Called with the global lock held. Returns the slot of the pool of 'slot'
+ * running the fewest operations, 'slot' itself on a tie. The members have
+ * to be logged in like 'slot'; 'exclude' is skipped (may be NULL). */
+struct sc_pkcs11_slot *slot_pool_pick(struct sc_pkcs11_slot *slot, struct sc_pkcs11_slot *exclude)
+{
+	struct sc_pkcs11_slot *best = slot != exclude ? slot : NULL;
+	unsigned int i;
+
+	for (i = 0; i < list_size(&virtual_slots); i++) {
+		struct sc_pkcs11_slot *other = virtual_slot_table[i];
+
+		if (other == exclude || !slot_pool_member(slot, other)
+				|| other->login_user != slot->login_user)
+			continue;
+		if (best == NULL || other->pool_busy < best->pool_busy)
+			best = other;
+	}
+
+	return best ? best : slot;
+}
+
+/* Called with the card lock of the slot of 'session' held. Returns its
+ * private key with the CKA_ID 'id', or NULL */
+struct sc_pkcs11_object *slot_pool_find_key(struct sc_pkcs11_session *session, CK_ATTRIBUTE_PTR id)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_ATTRIBUTE template[2];
+	struct sc_pkcs11_object_iter iter;
+	struct sc_pkcs11_object *object;
+
+	template[0].type = CKA_CLASS;
+	template[0].pValue = &class;
+	template[0].ulValueLen = sizeof(class);
+	template[1] = *id;
+
+	if (slot->p11card->framework->load_objects
+			&& slot->p11card->framework->load_objects(slot, template, 2) != CKR_OK)
+		return NULL;
+
+	slot_objects_init(&iter, session, template, 2);
+	while ((object = slot_objects_next(&iter)) != NULL) {
+		if (object->ops->cmp_attribute(session, object, &template[0])
+				&& object->ops->cmp_attribute(session, object, &template[1]))
+			return object;
+	}
+
+	return NULL;
+}
@@ -920,6 +920,7 @@ sc_pkcs15init_authentic_operations = {
 	authentic_emu_store_data,
 
 	NULL,					/* sanity_check */
+	NULL,					/* emu_flush */
 };
 
 
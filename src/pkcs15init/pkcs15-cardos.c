@@ -910,7 +910,8 @@ static struct sc_pkcs15init_operations sc_pkcs15init_cardos_operations = {
 	NULL,				/* finalize_card */
 	cardos_delete_object,
 	NULL, NULL, NULL, NULL, NULL, 	/* pkcs15init emulation */
-	NULL				/* sanity_check */
+	NULL,				/* sanity_check */
+	NULL				/* emu_flush */
 };
 
 struct sc_pkcs15init_operations *
@@ -116,7 +116,7 @@ static int cflex_erase_card(struct sc_profile *profile, sc_pkcs15_card_t *p15car
 out:	/* Forget all cached keys, the pin files on card are all gone. */
 	sc_file_free(userpinfile);
 
-        sc_free_apps(p15card->card);
+        sc_invalidate_apps(p15card->card);
         if (r == SC_ERROR_FILE_NOT_FOUND)
                 r=0;
 
@@ -914,7 +914,8 @@ static struct sc_pkcs15init_operations sc_pkcs15init_cryptoflex_operations = {
 	NULL,				/* finalize_card */
 	NULL, 				/* delete_object */
 	NULL, NULL, NULL, NULL, NULL,  	/* pkcs15init emulation */
-	NULL				/* sanity_check */
+	NULL,				/* sanity_check */
+	NULL				/* emu_flush */
 };
 
 static struct sc_pkcs15init_operations sc_pkcs15init_cyberflex_operations = {
@@ -933,7 +934,8 @@ static struct sc_pkcs15init_operations sc_pkcs15init_cyberflex_operations = {
 	NULL,				/* finalize_card */
 	NULL, 				/* delete_object */
 	NULL, NULL, NULL, NULL, NULL,  	/* pkcs15init emulation */
-	NULL				/* sanity_check */
+	NULL,				/* sanity_check */
+	NULL				/* emu_flush */
 };
 
 struct sc_pkcs15init_operations *
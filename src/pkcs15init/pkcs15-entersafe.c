@@ -530,6 +530,7 @@ static struct sc_pkcs15init_operations sc_pkcs15init_entersafe_operations = {
 	NULL, 				/* delete_object */
 	NULL, NULL, NULL, NULL, NULL, 	/* pkcs15init emulation */
 	entersafe_sanity_check,
+	NULL,				/* emu_flush */
 };
 
 struct sc_pkcs15init_operations *sc_pkcs15init_get_entersafe_ops(void)
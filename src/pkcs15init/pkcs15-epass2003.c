@@ -86,7 +86,7 @@ static int epass2003_pkcs15_init_card(struct sc_profile *profile,
 		LOG_TEST_RET(card->ctx, ret,
 			    "Create EF(DIR) failed");
 
-		sc_free_apps(card);
+		sc_invalidate_apps(card);
 	}
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_SUCCESS);
 }
@@ -793,6 +793,7 @@ static struct sc_pkcs15init_operations sc_pkcs15init_epass2003_operations = {
 	epass2003_pkcs15_delete_object,
 	NULL, NULL, NULL, NULL, NULL,	/* pkcs15init emulation */
 	epass2003_pkcs15_sanity_check,
+	NULL,				/* emu_flush */
 };
 
 struct sc_pkcs15init_operations *sc_pkcs15init_get_epass2003_ops(void)
@@ -183,6 +183,7 @@ static struct sc_pkcs15init_operations sc_pkcs15init_gids_operations =
 	NULL, /* pkcs15init emulation emu_write_info */
 	gids_emu_store_data, /* pkcs15init emulation emu_store_data */
 	NULL,                           /* sanity_check*/
+	NULL,                           /* emu_flush */
 };
 
 struct
@@ -1139,7 +1139,8 @@ static struct sc_pkcs15init_operations sc_pkcs15init_gpk_operations = {
 	NULL,				/* finalize_card */
 	NULL, 				/* delete_object */
 	NULL, NULL, NULL, NULL, NULL, 	/* pkcs15init emulation */
-	NULL                            /* sanity_check */
+	NULL,                            /* sanity_check */
+	NULL                            /* emu_flush */
 };
 
 struct sc_pkcs15init_operations *sc_pkcs15init_get_gpk_ops(void)
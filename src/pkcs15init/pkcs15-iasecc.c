@@ -1868,6 +1868,7 @@ sc_pkcs15init_iasecc_operations = {
 	NULL,					/* pkcs15init emulation write_info */
 	iasecc_emu_store_data,
 	NULL,					/* sanity_check */
+	NULL,					/* emu_flush */
 };
 
 
@@ -159,6 +159,12 @@ struct sc_pkcs15init_operations {
 			struct sc_pkcs15_der *, struct sc_path *);
 
 	int (*sanity_check)(struct sc_profile *, struct sc_pkcs15_card *);
+
+	/*
+	 * Write the card specific files whose update the emulation deferred
+	 * (see sc_pkcs15init_df_update_deferred())
+	 */
+	int (*emu_flush)(struct sc_profile *, struct sc_pkcs15_card *);
 };
 
 /* Do not change these or reorder these */
@@ -305,6 +311,12 @@ extern int	sc_pkcs15init_bind(struct sc_card *, const char *, const char *,
 extern void	sc_pkcs15init_unbind(struct sc_profile *);
 extern void	sc_pkcs15init_set_p15card(struct sc_profile *,
 				struct sc_pkcs15_card *);
+/* Keep the card locked and the PINs verified until the commit, and write
+ * the DFs, the ODF and TokenInfo only once, when committing */
+extern int	sc_pkcs15init_begin_transaction(struct sc_pkcs15_card *,
+				struct sc_profile *);
+extern int	sc_pkcs15init_commit_transaction(struct sc_pkcs15_card *,
+				struct sc_profile *);
 extern int	sc_pkcs15init_set_lifecycle(struct sc_card *, int);
 extern int	sc_pkcs15init_erase_card(struct sc_pkcs15_card *,
 				struct sc_profile *, struct sc_aid *);
@@ -382,6 +394,11 @@ extern int	sc_pkcs15init_update_certificate(struct sc_pkcs15_card *,
 
 extern int	sc_pkcs15init_create_file(struct sc_profile *,
 				struct sc_pkcs15_card *, struct sc_file *);
+/* Whether DF updates are held back until the commit or unbind */
+extern int	sc_pkcs15init_df_update_deferred(struct sc_profile *,
+				struct sc_pkcs15_card *);
+extern struct df_image *sc_pkcs15init_get_df_image(struct sc_profile *,
+				const struct sc_path *);
 extern int	sc_pkcs15init_update_file(struct sc_profile *,
 				struct sc_pkcs15_card *, struct sc_file *, void *, unsigned int);
 extern int	sc_pkcs15init_authenticate(struct sc_profile *, struct sc_pkcs15_card *,
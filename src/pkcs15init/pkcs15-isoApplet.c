@@ -790,6 +790,7 @@ static struct sc_pkcs15init_operations sc_pkcs15init_isoApplet_operations =
 	NULL,                           /* delete_object */
 	NULL, NULL, NULL, NULL, NULL,   /* pkcs15init emulation */
 	NULL,                           /* sanity_check*/
+	NULL,                           /* emu_flush */
 };
 
 struct
@@ -106,6 +106,8 @@ static int	sc_pkcs15init_update_lastupdate(struct sc_pkcs15_card *,
 			struct sc_profile *profile);
 static int	sc_pkcs15init_update_odf(struct sc_pkcs15_card *,
 			struct sc_profile *profile);
+static int	sc_pkcs15init_flush_dfs(struct sc_pkcs15_card *,
+			struct sc_profile *profile);
 static int	sc_pkcs15init_map_usage(unsigned long, int);
 static int	do_select_parent(struct sc_profile *, struct sc_pkcs15_card *,
 			struct sc_file *, struct sc_file **);
@@ -431,6 +433,15 @@ sc_pkcs15init_unbind(struct sc_profile *profile)
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "Pksc15init Unbind: %i:%p:%i", profile->dirty, profile->p15_data, profile->pkcs15.do_last_update);
+	if (profile->p15_data != NULL) {
+		r = sc_pkcs15init_flush_dfs(profile->p15_data, profile);
+		if (r < 0)
+			sc_log(ctx, "Failed to write deferred DF updates: %s", sc_strerror(r));
+	}
+	if (profile->transaction.active) {
+		profile->transaction.active = 0;
+		sc_unlock(profile->card);
+	}
 	if (profile->dirty != 0 && profile->p15_data != NULL && profile->pkcs15.do_last_update) {
 		r = sc_pkcs15init_update_lastupdate(profile->p15_data, profile);
 		if (r < 0)
@@ -442,6 +453,99 @@ sc_pkcs15init_unbind(struct sc_profile *profile)
 }
 
 
+/*
+ * Start provisioning several objects in one go: the card stays locked,
+ * every PIN is verified only once, and the DFs, the ODF and TokenInfo
+ * are written once by sc_pkcs15init_commit_transaction().
+ */
+int
+sc_pkcs15init_begin_transaction(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+	if (profile->transaction.active)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "Transaction already started");
+
+	r = sc_lock(p15card->card);
+	LOG_TEST_RET(ctx, r, "Cannot lock card");
+
+	if (profile->p15_data != p15card)
+		sc_pkcs15init_set_p15card(profile, p15card);
+	profile->transaction.active = 1;
+	profile->transaction.nverified = 0;
+	profile->transaction.pin_events = p15card->card->pin_events;
+
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+int
+sc_pkcs15init_commit_transaction(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!profile->transaction.active)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "No transaction started");
+
+	r = sc_pkcs15init_flush_dfs(p15card, profile);
+	if (r >= 0 && profile->dirty && profile->pkcs15.do_last_update) {
+		r = sc_pkcs15init_update_lastupdate(p15card, profile);
+		if (r >= 0)
+			profile->dirty = 0;
+	}
+
+	profile->transaction.active = 0;
+	profile->transaction.nverified = 0;
+	sc_unlock(p15card->card);
+
+	LOG_TEST_RET(ctx, r, "Failed to commit transaction");
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+/*
+ * Whether a PIN was verified before in the transaction, with the security
+ * status of the card untouched by anybody else since.
+ */
+static int
+sc_pkcs15init_transaction_verified(struct sc_profile *profile, struct sc_card *card,
+		unsigned int type, int reference)
+{
+	unsigned int i;
+
+	if (!profile->transaction.active || type != SC_AC_CHV)
+		return 0;
+	if (card->pin_events != profile->transaction.pin_events) {
+		profile->transaction.nverified = 0;
+		return 0;
+	}
+	for (i = 0; i < profile->transaction.nverified; i++)
+		if (profile->transaction.verified[i].type == type
+				&& profile->transaction.verified[i].reference == reference)
+			return 1;
+	return 0;
+}
+
+static void
+sc_pkcs15init_transaction_add_verified(struct sc_profile *profile, struct sc_card *card,
+		unsigned int type, int reference)
+{
+	unsigned int n = profile->transaction.nverified;
+
+	if (!profile->transaction.active || type != SC_AC_CHV)
+		return;
+	/* our own VERIFY counts as a PIN event, others do not happen while locked */
+	profile->transaction.pin_events = card->pin_events;
+	if (n < sizeof profile->transaction.verified / sizeof profile->transaction.verified[0]) {
+		profile->transaction.verified[n].type = type;
+		profile->transaction.verified[n].reference = reference;
+		profile->transaction.nverified = n + 1;
+	}
+}
+
+
 void
 sc_pkcs15init_set_p15card(struct sc_profile *profile, struct sc_pkcs15_card *p15card)
 {
@@ -543,7 +647,7 @@ sc_pkcs15init_erase_card_recursively(struct sc_pkcs15_card *p15card,
 		r = sc_pkcs15init_rmdir(p15card, profile, dir);
 		sc_file_free(dir);
 		if (r < 0 && r != SC_ERROR_FILE_NOT_FOUND)   {
-			sc_free_apps(p15card->card);
+			sc_invalidate_apps(p15card->card);
 			return r;
 		}
 	}
@@ -556,7 +660,7 @@ sc_pkcs15init_erase_card_recursively(struct sc_pkcs15_card *p15card,
 	if (r == SC_ERROR_FILE_NOT_FOUND)
 		r = 0;
 
-	sc_free_apps(p15card->card);
+	sc_invalidate_apps(p15card->card);
 	return r;
 }
 
@@ -573,6 +677,7 @@ sc_pkcs15init_delete_by_path(struct sc_profile *profile, struct sc_pkcs15_card *
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "trying to delete '%s'", sc_print_path(file_path));
+	sc_pkcs15_invalidate_files(p15card);
 
 	/* For some cards, to delete file should be satisfied the 'DELETE' ACL of the file itself,
 	 * for the others the 'DELETE' ACL of parent.
@@ -654,6 +759,7 @@ sc_pkcs15init_rmdir(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
 
 	if (df == NULL)
 		return SC_ERROR_INTERNAL;
+	sc_pkcs15_invalidate_files(p15card);
 	sc_log(ctx, "sc_pkcs15init_rmdir(%s)", sc_print_path(&df->path));
 
 	if (df->type == SC_FILE_TYPE_DF) {
@@ -3098,25 +3204,119 @@ sc_pkcs15init_update_odf(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 	LOG_FUNC_RETURN(ctx, r);
 }
 
+int
+sc_pkcs15init_df_update_deferred(struct sc_profile *profile, struct sc_pkcs15_card *p15card)
+{
+	return (profile->pkcs15.defer_df_update || profile->transaction.active)
+		&& profile->p15_data == p15card;
+}
+
+struct df_image *
+sc_pkcs15init_get_df_image(struct sc_profile *profile, const struct sc_path *path)
+{
+	struct df_image *img;
+
+	for (img = profile->df_images; img; img = img->next)
+		if (sc_compare_path(&img->path, path))
+			return img;
+
+	img = calloc(1, sizeof(*img));
+	if (img == NULL)
+		return NULL;
+	img->path = *path;
+	img->next = profile->df_images;
+	profile->df_images = img;
+	return img;
+}
+
 /*
- * Update any PKCS15 DF file (except ODF and DIR)
+ * Write only the bytes of a transparent EF that differ from its known
+ * contents 'img'; the new contents are 'data', padded with zeros to the
+ * size of the file. The contents are read from the card the first time.
+ * Returns SC_ERROR_NOT_SUPPORTED if the whole file has to be written.
  */
-int
-sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
-		struct sc_profile *profile,
-		struct sc_pkcs15_df *df,
-		int is_new)
+static int
+sc_pkcs15init_patch_file(struct sc_profile *profile, struct sc_pkcs15_card *p15card,
+		struct sc_file *file, struct df_image *img,
+		const unsigned char *data, size_t datalen)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_file *selected_file = NULL;
+	unsigned char *patch;
+	size_t size, first, last, i;
+	int r;
+
+	sc_pkcs15_invalidate_files(p15card);
+	r = sc_select_file(p15card->card, &file->path, &selected_file);
+	if (r < 0)
+		return SC_ERROR_NOT_SUPPORTED;
+	size = selected_file->size;
+	r = selected_file->ef_structure == SC_FILE_EF_TRANSPARENT;
+	sc_file_free(selected_file);
+	if (!r || size == 0 || size < datalen)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	if (img->data == NULL || img->len != size) {
+		free(img->data);
+		img->len = 0;
+		img->data = malloc(size);
+		if (img->data == NULL)
+			return SC_ERROR_NOT_SUPPORTED;
+		r = sc_read_binary(p15card->card, 0, img->data, size, 0);
+		if (r != (int)size) {
+			free(img->data);
+			img->data = NULL;
+			return SC_ERROR_NOT_SUPPORTED;
+		}
+		img->len = size;
+	}
+
+#define NEW_BYTE(i) ((i) < datalen ? data[i] : 0)
+	for (first = 0; first < size; first++)
+		if (img->data[first] != NEW_BYTE(first))
+			break;
+	if (first == size) {
+		sc_log(ctx, "%s unchanged", sc_print_path(&file->path));
+		return SC_SUCCESS;
+	}
+	for (last = size; last > first + 1; last--)
+		if (img->data[last - 1] != NEW_BYTE(last - 1))
+			break;
+
+	patch = calloc(1, last - first);
+	if (patch == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	for (i = first; i < last; i++)
+		patch[i - first] = NEW_BYTE(i);
+#undef NEW_BYTE
+
+	sc_log(ctx, "Updating %"SC_FORMAT_LEN_SIZE_T"u of %"SC_FORMAT_LEN_SIZE_T"u bytes of %s at offset %"SC_FORMAT_LEN_SIZE_T"u",
+			last - first, size, sc_print_path(&file->path), first);
+	r = sc_pkcs15init_authenticate(profile, p15card, file, SC_AC_OP_UPDATE);
+	if (r >= 0)
+		r = sc_update_binary(p15card->card, (unsigned int)first, patch, last - first, 0);
+	if (r >= 0) {
+		memcpy(img->data + first, patch, last - first);
+	} else {
+		/* the contents on the card are unknown now */
+		free(img->data);
+		img->data = NULL;
+	}
+	free(patch);
+	return r < 0 ? r : SC_SUCCESS;
+}
+
+static int
+sc_pkcs15init_write_df(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		struct sc_pkcs15_df *df, int *update_odf)
 {
 	struct sc_context	*ctx = p15card->card->ctx;
 	struct sc_card	*card = p15card->card;
 	struct sc_file	*file = NULL;
+	struct df_image	*img;
 	unsigned char	*buf = NULL;
 	size_t		bufsize;
-	int		update_odf = is_new, r = 0;
-
-	LOG_FUNC_CALLED(ctx);
-	if (!df)
-		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "DF missing");
+	int		r;
 
 	r = sc_profile_get_file_by_path(profile, &df->path, &file);
 	if (r < 0 || file == NULL)
@@ -3124,7 +3324,17 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 
 	r = sc_pkcs15_encode_df(card->ctx, p15card, df, &buf, &bufsize);
 	if (r >= 0) {
-		r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+		img = file ? sc_pkcs15init_get_df_image(profile, &df->path) : NULL;
+		r = SC_ERROR_NOT_SUPPORTED;
+		if (img != NULL)
+			r = sc_pkcs15init_patch_file(profile, p15card, file, img, buf, bufsize);
+		if (r == SC_ERROR_NOT_SUPPORTED) {
+			r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+			if (img != NULL) {
+				free(img->data);
+				img->data = NULL;
+			}
+		}
 
 		/* For better performance and robustness, we want
 		 * to note which portion of the file actually
@@ -3138,12 +3348,85 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 		if (profile->pkcs15.encode_df_length) {
 			df->path.count = bufsize;
 			df->path.index = 0;
-			update_odf = 1;
+			*update_odf = 1;
 		}
 		free(buf);
 	}
 	sc_file_free(file);
 
+	LOG_TEST_RET(ctx, r, "Failed to encode or update xDF");
+	return r;
+}
+
+/*
+ * Write the DFs whose update was deferred (see defer-df-update)
+ */
+static int
+sc_pkcs15init_flush_dfs(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_df *df;
+	struct df_image *img;
+	int update_odf = 0, r = SC_SUCCESS;
+
+	LOG_FUNC_CALLED(ctx);
+	if (profile->ops->emu_flush) {
+		r = profile->ops->emu_flush(profile, p15card);
+		LOG_TEST_RET(ctx, r, "Failed to write deferred card specific files");
+	}
+
+	for (img = profile->df_images; img; img = img->next) {
+		if (!img->pending)
+			continue;
+		img->pending = 0;
+		update_odf |= img->update_odf;
+		img->update_odf = 0;
+
+		for (df = p15card->df_list; df; df = df->next)
+			if (sc_compare_path(&df->path, &img->path))
+				break;
+		if (df == NULL)
+			continue;
+		r = sc_pkcs15init_write_df(p15card, profile, df, &update_odf);
+		LOG_TEST_RET(ctx, r, "Failed to write deferred xDF");
+	}
+
+	if (update_odf)
+		r = sc_pkcs15init_update_odf(p15card, profile);
+	LOG_TEST_RET(ctx, r, "Failed to encode or update ODF");
+
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+/*
+ * Update any PKCS15 DF file (except ODF and DIR)
+ */
+int
+sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
+		struct sc_profile *profile,
+		struct sc_pkcs15_df *df,
+		int is_new)
+{
+	struct sc_context	*ctx = p15card->card->ctx;
+	struct df_image	*img;
+	int		update_odf = is_new, r = 0;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!df)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "DF missing");
+
+	/* Only written by sc_pkcs15init_unbind() or at commit */
+	if (sc_pkcs15init_df_update_deferred(profile, p15card)) {
+		img = sc_pkcs15init_get_df_image(profile, &df->path);
+		if (img != NULL) {
+			sc_log(ctx, "Update of %s deferred", sc_print_path(&df->path));
+			img->pending = 1;
+			img->update_odf |= is_new;
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+	}
+
+	r = sc_pkcs15init_write_df(p15card, profile, df, &update_odf);
 	LOG_TEST_RET(ctx, r, "Failed to encode or update xDF");
 
 	/* Now update the ODF if we have to */
@@ -3327,6 +3610,7 @@ sc_pkcs15init_change_attrib(struct sc_pkcs15_card *p15card, struct sc_profile *p
 		default:
 			LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Cannot change ID attribute");
 		}
+		sc_pkcs15_invalidate_object_index(p15card);
 		break;
 	case P15_ATTR_TYPE_VALUE:
 		switch(df_type) {
@@ -3469,6 +3753,8 @@ sc_pkcs15init_update_certificate(struct sc_pkcs15_card *p15card,
 	int r;
 
 	LOG_FUNC_CALLED(ctx);
+	sc_pkcs15_invalidate_certificate(p15card, obj->data);
+	sc_pkcs15_invalidate_files(p15card);
 	r = sc_select_file(p15card->card, path, &file);
 	LOG_TEST_RET(ctx, r, "Failed to select cert file");
 
@@ -3874,8 +4160,14 @@ sc_pkcs15init_authenticate(struct sc_profile *profile, struct sc_pkcs15_card *p1
 			sc_log(ctx, "unknown acl method");
 			break;
 		}
+		if (sc_pkcs15init_transaction_verified(profile, p15card->card, acl->method, acl->key_ref)) {
+			sc_log(ctx, "acl(method:%i,reference:%i) verified before", acl->method, acl->key_ref);
+			continue;
+		}
 		sc_log(ctx, "verify acl(method:%i,reference:%i)", acl->method, acl->key_ref);
 		r = sc_pkcs15init_verify_secret(profile, p15card, file_tmp ? file_tmp : file, acl->method, acl->key_ref);
+		if (r == 0)
+			sc_pkcs15init_transaction_add_verified(profile, p15card->card, acl->method, acl->key_ref);
 	}
 
 	sc_file_free(file_tmp);
@@ -3986,6 +4278,7 @@ sc_pkcs15init_update_file(struct sc_profile *profile,
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
 
 	sc_log(ctx, "path:%s; datalen:%i", sc_print_path(&file->path), datalen);
+	sc_pkcs15_invalidate_files(p15card);
 
 	r = sc_select_file(p15card->card, &file->path, &selected_file);
 	if (!r)   {
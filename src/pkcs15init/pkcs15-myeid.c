@@ -944,7 +944,8 @@ static struct sc_pkcs15init_operations sc_pkcs15init_myeid_operations = {
 	myeid_finalize_card,
 	myeid_delete_object, /* delete_object */
 	NULL, NULL, NULL, NULL, NULL, /* pkcs15init emulation */
-	NULL /* sanity_check */
+	NULL, /* sanity_check */
+	NULL /* emu_flush */
 };
 
 struct sc_pkcs15init_operations *sc_pkcs15init_get_myeid_ops(void) {
@@ -632,6 +632,52 @@ done:
 }
 
 
+/*
+ * While the DF updates are deferred, the public and private object lists
+ * are changed in memory only; awp_update_df_flush() writes each changed
+ * list once.
+ */
+static int
+awp_get_list_image(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		struct sc_file *lst_file, struct df_image **out)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct df_image *img;
+	int rv;
+
+	LOG_FUNC_CALLED(ctx);
+	img = sc_pkcs15init_get_df_image(profile, &lst_file->path);
+	if (!img)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+
+	if (!img->data)   {
+		rv = sc_pkcs15init_authenticate(profile, p15card, lst_file, SC_AC_OP_READ);
+		LOG_TEST_RET(ctx, rv, "AWP list image: 'read' authentication failed");
+
+		rv = sc_select_file(p15card->card, &lst_file->path, NULL);
+		if (rv == SC_ERROR_FILE_NOT_FOUND)
+			rv = sc_pkcs15init_create_file(profile, p15card, lst_file);
+		LOG_TEST_RET(ctx, rv, "AWP list image: cannot select list file");
+
+		img->data = calloc(1, lst_file->size);
+		if (!img->data)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+
+		rv = sc_read_binary(p15card->card, 0, img->data, lst_file->size, 0);
+		if (rv != (int)lst_file->size)   {
+			free(img->data);
+			img->data = NULL;
+			LOG_TEST_RET(ctx, rv < 0 ? rv : SC_ERROR_INVALID_CARD,
+					"AWP list image: cannot read list file");
+		}
+		img->len = lst_file->size;
+	}
+
+	*out = img;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
 static int
 awp_update_object_list(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
 		unsigned int type, int num)
@@ -639,8 +685,9 @@ awp_update_object_list(struct sc_pkcs15_card *p15card, struct sc_profile *profil
 	struct sc_context *ctx = p15card->card->ctx;
 	struct sc_file *obj_file = NULL, *lst_file = NULL;
 	struct sc_file *file = NULL;
+	struct df_image *img = NULL;
 	char obj_name[NAME_MAX_LEN], lst_name[NAME_MAX_LEN];
-	unsigned char *buff = NULL;
+	unsigned char *buff = NULL, *list;
 	int rv;
 	unsigned ii;
 
@@ -703,33 +750,42 @@ awp_update_object_list(struct sc_pkcs15_card *p15card, struct sc_profile *profil
 			file->size = 2048;
 	}
 
-	buff = malloc(lst_file->size);
-	if (!buff)   {
-		rv = SC_ERROR_OUT_OF_MEMORY;
-		goto done;
+	if (sc_pkcs15init_df_update_deferred(profile, p15card))   {
+		rv = awp_get_list_image(p15card, profile, lst_file, &img);
+		if (rv)
+			goto done;
+		list = img->data;
 	}
+	else   {
+		buff = malloc(lst_file->size);
+		if (!buff)   {
+			rv = SC_ERROR_OUT_OF_MEMORY;
+			goto done;
+		}
 
-	rv = sc_pkcs15init_authenticate(profile, p15card, lst_file, SC_AC_OP_READ);
-	if (rv)
-		goto done;
-	rv = sc_pkcs15init_authenticate(profile, p15card, lst_file, SC_AC_OP_UPDATE);
-	if (rv)
-		goto done;
+		rv = sc_pkcs15init_authenticate(profile, p15card, lst_file, SC_AC_OP_READ);
+		if (rv)
+			goto done;
+		rv = sc_pkcs15init_authenticate(profile, p15card, lst_file, SC_AC_OP_UPDATE);
+		if (rv)
+			goto done;
 
-	rv = sc_select_file(p15card->card, &lst_file->path, NULL);
-	if (rv == SC_ERROR_FILE_NOT_FOUND)
-		rv = sc_pkcs15init_create_file(profile, p15card, lst_file);
-	if (rv < 0)
-		goto done;
+		rv = sc_select_file(p15card->card, &lst_file->path, NULL);
+		if (rv == SC_ERROR_FILE_NOT_FOUND)
+			rv = sc_pkcs15init_create_file(profile, p15card, lst_file);
+		if (rv < 0)
+			goto done;
 
-	rv = sc_read_binary(p15card->card, 0, buff, lst_file->size, lst_file->ef_structure);
-	if (rv < 0)
-		goto done;
+		rv = sc_read_binary(p15card->card, 0, buff, lst_file->size, lst_file->ef_structure);
+		if (rv < 0)
+			goto done;
+		list = buff;
+	}
 
-	for (ii=0; ii < lst_file->size; ii+=5)
-		if (*(buff + ii) != COSM_LIST_TAG)
+	for (ii=0; ii + 5 <= lst_file->size; ii+=5)
+		if (*(list + ii) != COSM_LIST_TAG)
 			break;
-	if (ii>=lst_file->size)   {
+	if (ii + 5 > lst_file->size)   {
 		rv = SC_ERROR_UNKNOWN_DATA_RECEIVED;
 		goto done;
 	}
@@ -737,13 +793,19 @@ awp_update_object_list(struct sc_pkcs15_card *p15card, struct sc_profile *profil
 	sc_log(ctx, 
 		 "ii %i, rv %i; %X; %"SC_FORMAT_LEN_SIZE_T"u",
 		 ii, rv, file->id, file->size);
-	*(buff + ii) = COSM_LIST_TAG;
-	*(buff + ii + 1) = (file->id >> 8) & 0xFF;
-	*(buff + ii + 2) = file->id & 0xFF;
-	*(buff + ii + 3) = (file->size >> 8) & 0xFF;
-	*(buff + ii + 4) = file->size & 0xFF;
+	*(list + ii) = COSM_LIST_TAG;
+	*(list + ii + 1) = (file->id >> 8) & 0xFF;
+	*(list + ii + 2) = file->id & 0xFF;
+	*(list + ii + 3) = (file->size >> 8) & 0xFF;
+	*(list + ii + 4) = file->size & 0xFF;
+
+	if (img)   {
+		img->pending = 1;
+		rv = 0;
+		goto done;
+	}
 
-	rv = sc_update_binary(p15card->card, ii, buff + ii, 5, 0);
+	rv = sc_update_binary(p15card->card, ii, list + ii, 5, 0);
 	sc_log(ctx,  "rv %i",rv);
 	if (rv < 0)
 		goto done;
@@ -1729,6 +1791,7 @@ awp_remove_from_object_list( struct sc_pkcs15_card *p15card, struct sc_profile *
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	struct sc_file *lst_file=NULL, *lst=NULL;
+	struct df_image *img = NULL;
 	int rv = 0;
 	unsigned ii;
 	char lst_name[NAME_MAX_LEN];
@@ -1757,6 +1820,24 @@ awp_remove_from_object_list( struct sc_pkcs15_card *p15card, struct sc_profile *
 	rv = sc_profile_get_file(profile, lst_name, &lst_file);
 	LOG_TEST_RET(ctx, rv, "AWP update object list: cannot instantiate list file");
 
+	id[0] = (obj_id >> 8) & 0xFF;
+	id[1] = obj_id & 0xFF;
+
+	if (sc_pkcs15init_df_update_deferred(profile, p15card))   {
+		rv = awp_get_list_image(p15card, profile, lst_file, &img);
+		if (!rv)   {
+			for (ii=0; ii + 3 <= img->len; ii+=5)   {
+				if (img->data[ii]==0xFF && img->data[ii+1]==id[0] && img->data[ii+2]==id[1])   {
+					img->data[ii] = 0;
+					img->pending = 1;
+					break;
+				}
+			}
+		}
+		sc_file_free(lst_file);
+		LOG_FUNC_RETURN(ctx, rv);
+	}
+
 	rv = sc_select_file(p15card->card, &lst_file->path, &lst);
 	LOG_TEST_RET(ctx, rv, "AWP update object list: cannot select list file");
 
@@ -1771,8 +1852,6 @@ awp_remove_from_object_list( struct sc_pkcs15_card *p15card, struct sc_profile *
 	if (rv != (int)lst->size)
 		goto done;
 
-	id[0] = (obj_id >> 8) & 0xFF;
-	id[1] = obj_id & 0xFF;
 	for (ii=0; ii<lst->size; ii+=5)   {
 		if (*(buff+ii)==0xFF && *(buff+ii+1)==id[0] && *(buff+ii+2)==id[1])   {
 			rv = sc_pkcs15init_authenticate(profile, p15card, lst, SC_AC_OP_UPDATE);
@@ -1931,6 +2010,55 @@ awp_update_df_delete_data(struct sc_pkcs15_card *p15card, struct sc_profile *pro
 }
 
 
+/*
+ * Write the object lists changed while the DF updates were deferred
+ */
+int
+awp_update_df_flush(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	const char *lists[] = { "private-list", "public-list" };
+	char lst_name[NAME_MAX_LEN];
+	struct sc_file *lst_file = NULL;
+	struct df_image *img;
+	unsigned ii;
+	int rv = 0;
+
+	LOG_FUNC_CALLED(ctx);
+	for (ii = 0; rv >= 0 && ii < sizeof(lists)/sizeof(lists[0]); ii++)   {
+		snprintf(lst_name, NAME_MAX_LEN, "%s-%s", COSM_TITLE, lists[ii]);
+		if (sc_profile_get_file(profile, lst_name, &lst_file) < 0)
+			continue;
+
+		for (img = profile->df_images; img; img = img->next)
+			if (sc_compare_path(&img->path, &lst_file->path))
+				break;
+
+		if (img && img->pending && img->data)   {
+			sc_log(ctx, "write deferred %s (%"SC_FORMAT_LEN_SIZE_T"u bytes)", lst_name, img->len);
+			rv = sc_pkcs15init_authenticate(profile, p15card, lst_file, SC_AC_OP_UPDATE);
+			if (!rv)
+				rv = sc_select_file(p15card->card, &lst_file->path, NULL);
+			if (!rv)
+				rv = sc_update_binary(p15card->card, 0, img->data, img->len, 0);
+		}
+		if (img)   {
+			/* read again in the next session, the card may be changed meanwhile */
+			free(img->data);
+			img->data = NULL;
+			img->len = 0;
+			img->pending = 0;
+		}
+		sc_file_free(lst_file);
+		lst_file = NULL;
+	}
+
+	if (rv > 0)
+		rv = 0;
+	LOG_FUNC_RETURN(ctx, rv);
+}
+
+
 int
 awp_update_df_delete(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
 		struct sc_pkcs15_object *object)
@@ -208,7 +208,7 @@ cosm_erase_card(struct sc_profile *profile, struct sc_pkcs15_card *p15card)
 		sc_file_free(dir);
 	}
 
-	sc_free_apps(p15card->card);
+	sc_invalidate_apps(p15card->card);
 done:
 	if (rv == SC_ERROR_FILE_NOT_FOUND)
 		rv = 0;
@@ -857,6 +857,18 @@ cosm_emu_write_info(struct sc_profile *profile, struct sc_pkcs15_card *p15card,
 	/* No OpenSC Info file in the native Oberthur card */
 	SC_FUNC_RETURN(p15card->card->ctx, 1, SC_SUCCESS);
 }
+
+
+static int
+cosm_emu_flush(struct sc_profile *profile, struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	int rv;
+
+	SC_FUNC_CALLED(ctx, 1);
+	rv = awp_update_df_flush(p15card, profile);
+	SC_FUNC_RETURN(ctx, 1, rv);
+}
 #endif
 
 
@@ -882,10 +894,11 @@ sc_pkcs15init_oberthur_operations = {
 	cosm_emu_update_tokeninfo,
 	cosm_emu_write_info,
 	NULL,
-	NULL
+	NULL,				/* sanity_check */
+	cosm_emu_flush
 #else
 	NULL, NULL, NULL, NULL, NULL,
-	NULL
+	NULL, NULL
 #endif
 };
 
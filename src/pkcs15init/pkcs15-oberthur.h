@@ -99,6 +99,7 @@ struct awp_data_info {
 extern int cosm_delete_file(struct sc_pkcs15_card *, struct sc_profile *, struct sc_file *);
 extern int awp_update_df_create(struct sc_pkcs15_card *, struct sc_profile *, struct sc_pkcs15_object *);
 extern int awp_update_df_delete(struct sc_pkcs15_card *, struct sc_profile *, struct sc_pkcs15_object *);
+extern int awp_update_df_flush(struct sc_pkcs15_card *, struct sc_profile *);
 
 #endif /* #ifdef ENABLE_OPENSSL */
 #endif /* #ifndef pkcs15_oberthur_h*/
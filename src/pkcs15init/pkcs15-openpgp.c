@@ -503,7 +503,8 @@ static struct sc_pkcs15init_operations sc_pkcs15init_openpgp_operations = {
 	openpgp_emu_update_tokeninfo,
 	NULL,   /* emu_write_info */
 	openpgp_store_data, /* emu_store_data */
-	NULL				/* sanity_check */
+	NULL,				/* sanity_check */
+	NULL				/* emu_flush */
 };
 
 struct sc_pkcs15init_operations *sc_pkcs15init_get_openpgp_ops(void)
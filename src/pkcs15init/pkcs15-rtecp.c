@@ -45,7 +45,7 @@ static int rtecp_erase(sc_profile_t *profile, sc_pkcs15_card_t *p15card)
 		return SC_ERROR_INVALID_ARGUMENTS;
 	r = sc_card_ctl(p15card->card, SC_CARDCTL_RTECP_INIT, NULL);
 	if (r == SC_SUCCESS)
-		sc_free_apps(p15card->card);
+		sc_invalidate_apps(p15card->card);
 	return r;
 }
 
@@ -693,7 +693,8 @@ static struct sc_pkcs15init_operations sc_pkcs15init_rtecp_operations = {
 	rtecp_finalize,                 /* finalize_card */
 	rtecp_delete_object,            /* delete_object */
 	NULL, NULL, NULL, NULL, NULL,   /* pkcs15init emulation */
-	NULL                            /* sanity_check */
+	NULL,                            /* sanity_check */
+	NULL                            /* emu_flush */
 };
 
 struct sc_pkcs15init_operations * sc_pkcs15init_get_rtecp_ops(void)
@@ -303,7 +303,7 @@ rutoken_erase(struct sc_profile *profile, sc_pkcs15_card_t *p15card)
 		sc_log(card->ctx, 
 				"Failed to erase: %s\n", sc_strerror(ret));
 	else
-		sc_free_apps(card);
+		sc_invalidate_apps(card);
 	return ret;
 }
 
@@ -323,7 +323,8 @@ static struct sc_pkcs15init_operations sc_pkcs15init_rutoken_operations = {
 	NULL,                           /* finalize_card */
 	NULL,                           /* delete_object */
 	NULL, NULL, NULL, NULL, NULL,   /* pkcs15init emulation */
-	NULL                            /* sanity_check */
+	NULL,                            /* sanity_check */
+	NULL                            /* emu_flush */
 };
 
 struct sc_pkcs15init_operations* sc_pkcs15init_get_rutoken_ops(void)
@@ -630,6 +630,7 @@ sc_pkcs15init_sc_hsm_operations = {
 	NULL,						/* pkcs15init emulation write_info */
 	sc_hsm_emu_store_data,
 	NULL,						/* sanity_check */
+	NULL,						/* emu_flush */
 };
 
 
@@ -80,7 +80,7 @@ static int setcos_erase_card(sc_profile_t *profile, sc_pkcs15_card_t *p15card)
 	if (r)
 		return r;
 
-	sc_free_apps(p15card->card);
+	sc_invalidate_apps(p15card->card);
 	return 0;
 }
 
@@ -594,7 +594,8 @@ static struct sc_pkcs15init_operations sc_pkcs15init_setcos_operations = {
 	NULL, 				/* emu_update_tokeninfo */
 	NULL, 				/* emu_write_info */
 	NULL, 				/* emu_store_data */
-	NULL				/* sanity_check */
+	NULL,				/* sanity_check */
+	NULL				/* emu_flush */
 };
 
 struct sc_pkcs15init_operations *
@@ -333,7 +333,8 @@ static struct sc_pkcs15init_operations sc_pkcs15init_westcos_operations = {
 	westcos_pkcs15init_finalize_card,	/* finalize_card */
 	NULL,					/* delete_object */
 	NULL, NULL, NULL, NULL, NULL,		/* pkcs15init emulation */
-	NULL					/* sanity_check */
+	NULL,					/* sanity_check */
+	NULL					/* emu_flush */
 };
 
 struct sc_pkcs15init_operations* sc_pkcs15init_get_westcos_ops(void)
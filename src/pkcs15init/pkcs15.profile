@@ -22,6 +22,9 @@ pkcs15 {
     encode-df-length	= no;
     # Have a lastUpdate field in the EF(TokenInfo)?
     do-last-update	= yes;
+    # Write the changed DFs once when the card is released,
+    # instead of after every object that is added?
+    defer-df-update	= no;
     # Method to calculate ID of the crypto objects
     #     native: 'E' + number_of_present_objects_of_the_same_type
     #     mozilla: SHA1(modulus) for RSA, SHA1(pub) for DSA
@@ -36,6 +36,8 @@
 #endif
 #include <assert.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -44,6 +46,7 @@
 
 #include "common/compat_strlcpy.h"
 #include "scconf/scconf.h"
+#include "libopensc/internal.h"
 #include "libopensc/log.h"
 #include "libopensc/pkcs15.h"
 #include "pkcs15-init.h"
@@ -226,6 +229,9 @@ static struct {
 };
 
 static int		process_conf(struct sc_profile *, scconf_context *);
+static struct sc_profile_cache *profile_cache_get(struct sc_context *, const char *);
+static struct sc_profile_cache *profile_cache_add(struct sc_context *, const char *, scconf_context *);
+static void		profile_cache_put(struct sc_context *, struct sc_profile_cache *);
 static int		process_block(struct state *, struct block *,
 				const char *, scconf_block *);
 static void		init_state(struct state *, struct state *);
@@ -320,11 +326,30 @@ sc_profile_new(void)
 	return pro;
 }
 
+/*
+ * The profiles are text files which are parsed again by every
+ * sc_pkcs15init_bind(), i.e. for each object the PKCS#11 module creates.
+ * The parsed configuration is therefore kept in the context and reused
+ * as long as the file keeps its modification time and size. The entries
+ * are only read by process_conf(), a reference count keeps a replaced
+ * entry alive until the last user of another thread is done with it.
+ */
+struct sc_profile_cache {
+	struct sc_profile_cache *next;
+	char		*path;
+	time_t		mtime;
+	off_t		size;
+	scconf_context	*conf;
+	unsigned int	refs;
+	int		stale;
+};
+
 int
 sc_profile_load(struct sc_profile *profile, const char *filename)
 {
 	struct sc_context *ctx = profile->card->ctx;
 	scconf_context	*conf;
+	struct sc_profile_cache *entry;
 	const char *profile_dir = NULL;
 	char path[PATH_MAX];
 	int res = 0, i;
@@ -363,24 +388,124 @@ sc_profile_load(struct sc_profile *profile, const char *filename)
 
 	sc_log(ctx, "Trying profile file %s", path);
 
-	conf = scconf_new(path);
-	res = scconf_parse(conf);
+	entry = profile_cache_get(ctx, path);
+	if (entry != NULL) {
+		conf = entry->conf;
+	} else {
+		conf = scconf_new(path);
+		res = scconf_parse(conf);
+
+		if (res < 0) {
+			scconf_free(conf);
+			LOG_FUNC_RETURN(ctx, SC_ERROR_FILE_NOT_FOUND);
+		}
+
+		if (res == 0) {
+			scconf_free(conf);
+			LOG_FUNC_RETURN(ctx, SC_ERROR_SYNTAX_ERROR);
+		}
+		entry = profile_cache_add(ctx, path, conf);
+	}
 
 	sc_log(ctx, "profile %s loaded ok", path);
 
-	if (res < 0) {
+	res = process_conf(profile, conf);
+	if (entry != NULL)
+		profile_cache_put(ctx, entry);
+	else
 		scconf_free(conf);
-		LOG_FUNC_RETURN(ctx, SC_ERROR_FILE_NOT_FOUND);
+	LOG_FUNC_RETURN(ctx, res);
+}
+
+static void
+profile_cache_release(struct sc_profile_cache *entry)
+{
+	scconf_free(entry->conf);
+	free(entry->path);
+	free(entry);
+}
+
+static struct sc_profile_cache *
+profile_cache_get(struct sc_context *ctx, const char *path)
+{
+	struct sc_profile_cache *entry, **pp;
+	struct stat st;
+
+	if (stat(path, &st) != 0)
+		return NULL;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (pp = &ctx->profile_cache; (entry = *pp) != NULL; pp = &entry->next) {
+		if (strcmp(entry->path, path) != 0)
+			continue;
+		if (entry->mtime == st.st_mtime && entry->size == st.st_size) {
+			entry->refs++;
+			break;
+		}
+		/* the file was changed, parse it again */
+		*pp = entry->next;
+		entry->stale = 1;
+		if (entry->refs == 0)
+			profile_cache_release(entry);
+		entry = NULL;
+		break;
 	}
+	sc_mutex_unlock(ctx, ctx->mutex);
 
-	if (res == 0) {
-		scconf_free(conf);
-		LOG_FUNC_RETURN(ctx, SC_ERROR_SYNTAX_ERROR);
+	if (entry != NULL)
+		sc_log(ctx, "Using cached profile %s", path);
+	return entry;
+}
+
+static struct sc_profile_cache *
+profile_cache_add(struct sc_context *ctx, const char *path, scconf_context *conf)
+{
+	struct sc_profile_cache *entry;
+	struct stat st;
+
+	if (stat(path, &st) != 0)
+		return NULL;
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL)
+		return NULL;
+	entry->path = strdup(path);
+	if (entry->path == NULL) {
+		free(entry);
+		return NULL;
 	}
+	entry->mtime = st.st_mtime;
+	entry->size = st.st_size;
+	entry->conf = conf;
+	entry->refs = 1;
 
-	res = process_conf(profile, conf);
-	scconf_free(conf);
-	LOG_FUNC_RETURN(ctx, res);
+	sc_mutex_lock(ctx, ctx->mutex);
+	entry->next = ctx->profile_cache;
+	ctx->profile_cache = entry;
+	sc_mutex_unlock(ctx, ctx->mutex);
+	return entry;
+}
+
+static void
+profile_cache_put(struct sc_context *ctx, struct sc_profile_cache *entry)
+{
+	int release;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	release = --entry->refs == 0 && entry->stale;
+	sc_mutex_unlock(ctx, ctx->mutex);
+	if (release)
+		profile_cache_release(entry);
+}
+
+void
+sc_profile_cache_free(struct sc_context *ctx)
+{
+	struct sc_profile_cache *entry;
+
+	while ((entry = ctx->profile_cache) != NULL) {
+		ctx->profile_cache = entry->next;
+		profile_cache_release(entry);
+	}
 }
 
 
@@ -449,6 +574,7 @@ sc_profile_free(struct sc_profile *profile)
 	struct pin_info *pi;
 	sc_macro_t	*mi;
 	sc_template_t	*ti;
+	struct df_image	*di;
 
 	if (profile->name)
 		free(profile->name);
@@ -483,6 +609,12 @@ sc_profile_free(struct sc_profile *profile)
 		free(pi);
 	}
 
+	while ((di = profile->df_images) != NULL) {
+		profile->df_images = di->next;
+		free(di->data);
+		free(di);
+	}
+
 	if (profile->p15_spec)
 		sc_pkcs15_card_free(profile->p15_spec);
 	free(profile);
@@ -903,6 +1035,12 @@ do_encode_update_field(struct state *cur, int argc, char **argv)
 	return get_bool(cur, argv[0], &cur->profile->pkcs15.do_last_update);
 }
 
+static int
+do_defer_df_update(struct state *cur, int argc, char **argv)
+{
+	return get_bool(cur, argv[0], &cur->profile->pkcs15.defer_df_update);
+}
+
 static int
 do_pkcs15_id_style(struct state *cur, int argc, char **argv)
 {
@@ -1843,6 +1981,7 @@ static struct command	p15_commands[] = {
  { "direct-certificates",	1,	1,	do_direct_certificates },
  { "encode-df-length",		1,	1,	do_encode_df_length },
  { "do-last-update",		1,	1,	do_encode_update_field },
+ { "defer-df-update",		1,	1,	do_defer_df_update },
  { "pkcs15-id-style",		1,	1,	do_pkcs15_id_style },
  { "minidriver-support-style",	1,	1,	do_minidriver_support_style },
  { NULL, 0, 0, NULL }
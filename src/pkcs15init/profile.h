@@ -85,6 +85,20 @@ typedef struct sc_macro {
  * EFs and DFs are combined from the value given in the
  * profile, and the last octet of the pkcs15 ID.
  */
+/*
+ * Contents of a PKCS#15 DF file as last read or written by
+ * sc_pkcs15init_update_any_df(), used to update only the part of
+ * the file that changed.
+ */
+struct df_image {
+	struct df_image *	next;
+	sc_path_t		path;
+	unsigned char *		data;	/* the whole file, NULL if unknown */
+	size_t			len;
+	int			pending;	/* update deferred to unbind */
+	int			update_odf;
+};
+
 typedef struct sc_template {
 	char *			name;
 	struct sc_template *	next;
@@ -126,6 +140,7 @@ struct sc_profile {
 		unsigned int	direct_certificates;
 		unsigned int	encode_df_length;
 		unsigned int	do_last_update;
+		unsigned int	defer_df_update;
 	} pkcs15;
 
 	/* PKCS15 information */
@@ -135,6 +150,18 @@ struct sc_profile {
 	 * needs to be updated (in other words: if the card content
 	 * has been changed) */
 	int			dirty;
+	struct df_image *	df_images;
+
+	/* see sc_pkcs15init_begin_transaction() */
+	struct {
+		int		active;
+		unsigned int	pin_events;	/* card->pin_events after our last login */
+		unsigned int	nverified;
+		struct {
+			unsigned int	type;
+			int		reference;
+		} verified[8];
+	} transaction;
 
 	/* PKCS15 object ID style */
 	unsigned int id_style;
@@ -0,0 +1,328 @@
+/*
+ * compiled.c: Binary snapshot of a parsed configuration
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "scconf.h"
+
+/*
+ * The snapshot is the tree of the configuration written depth first:
+ *
+ *   header:  magic, source file name, its mtime and size
+ *   block:   name list, item count, items
+ *   item:    type, key, then a comment string, a block or a value list
+ *   list:    count, strings
+ *   string:  32 bit length (0xffffffff for NULL), bytes
+ *
+ * All numbers are big endian, so that a snapshot does not depend on the
+ * machine which wrote it.
+ */
+#define COMPILED_MAGIC		"SCCONF\x01\n"
+#define COMPILED_MAGIC_LEN	8
+#define COMPILED_NULL		0xffffffffU
+#define COMPILED_MAX_DEPTH	32
+
+typedef struct {
+	FILE *f;
+	int error;
+} compiled_writer;
+
+typedef struct {
+	const unsigned char *p, *end;
+	int error;
+} compiled_reader;
+
+static void put_u32(compiled_writer * w, unsigned long v)
+{
+	unsigned char buf[4];
+
+	buf[0] = (unsigned char) (v >> 24);
+	buf[1] = (unsigned char) (v >> 16);
+	buf[2] = (unsigned char) (v >> 8);
+	buf[3] = (unsigned char) v;
+	if (!w->error && fwrite(buf, 1, sizeof(buf), w->f) != sizeof(buf))
+		w->error = errno ? errno : EIO;
+}
+
+static void put_u64(compiled_writer * w, unsigned long long v)
+{
+	put_u32(w, (unsigned long) (v >> 32) & 0xffffffffUL);
+	put_u32(w, (unsigned long) v & 0xffffffffUL);
+}
+
+static void put_string(compiled_writer * w, const char *str)
+{
+	size_t len;
+
+	if (str == NULL) {
+		put_u32(w, COMPILED_NULL);
+		return;
+	}
+	len = strlen(str);
+	put_u32(w, (unsigned long) len);
+	if (!w->error && fwrite(str, 1, len, w->f) != len)
+		w->error = errno ? errno : EIO;
+}
+
+static void put_list(compiled_writer * w, const scconf_list * list)
+{
+	const scconf_list *l;
+	unsigned long count = 0;
+
+	for (l = list; l; l = l->next)
+		count++;
+	put_u32(w, count);
+	for (l = list; l; l = l->next)
+		put_string(w, l->data);
+}
+
+static void put_block(compiled_writer * w, const scconf_block * block)
+{
+	const scconf_item *item;
+	unsigned long count = 0;
+
+	put_list(w, block->name);
+	for (item = block->items; item; item = item->next)
+		count++;
+	put_u32(w, count);
+	for (item = block->items; item; item = item->next) {
+		put_u32(w, (unsigned long) item->type);
+		put_string(w, item->key);
+		switch (item->type) {
+		case SCCONF_ITEM_TYPE_COMMENT:
+			put_string(w, item->value.comment);
+			break;
+		case SCCONF_ITEM_TYPE_BLOCK:
+			put_block(w, item->value.block);
+			break;
+		case SCCONF_ITEM_TYPE_VALUE:
+			put_list(w, item->value.list);
+			break;
+		}
+	}
+}
+
+static unsigned long get_u32(compiled_reader * r)
+{
+	unsigned long v;
+
+	if (r->error || r->end - r->p < 4) {
+		r->error = 1;
+		return 0;
+	}
+	v = ((unsigned long) r->p[0] << 24) | ((unsigned long) r->p[1] << 16)
+		| ((unsigned long) r->p[2] << 8) | (unsigned long) r->p[3];
+	r->p += 4;
+	return v;
+}
+
+static unsigned long long get_u64(compiled_reader * r)
+{
+	unsigned long long v = get_u32(r);
+
+	return (v << 32) | get_u32(r);
+}
+
+static char *get_string(compiled_reader * r)
+{
+	unsigned long len = get_u32(r);
+	char *str;
+
+	if (r->error || len == COMPILED_NULL)
+		return NULL;
+	if ((unsigned long) (r->end - r->p) < len) {
+		r->error = 1;
+		return NULL;
+	}
+	str = malloc(len + 1);
+	if (str == NULL) {
+		r->error = 1;
+		return NULL;
+	}
+	memcpy(str, r->p, len);
+	str[len] = '\0';
+	r->p += len;
+	return str;
+}
+
+static scconf_list *get_list(compiled_reader * r)
+{
+	scconf_list *list = NULL, **tail = &list;
+	unsigned long count = get_u32(r);
+
+	while (!r->error && count-- > 0) {
+		scconf_list *l = calloc(1, sizeof(scconf_list));
+
+		if (l == NULL) {
+			r->error = 1;
+			break;
+		}
+		*tail = l;
+		tail = &l->next;
+		l->data = get_string(r);
+		if (l->data == NULL)
+			r->error = 1;
+	}
+	return list;
+}
+
+static int get_block(compiled_reader * r, scconf_block * block, int depth)
+{
+	scconf_item **tail = &block->items;
+	unsigned long count;
+
+	if (depth > COMPILED_MAX_DEPTH)
+		return 0;
+	block->name = get_list(r);
+	count = get_u32(r);
+	while (!r->error && count-- > 0) {
+		scconf_item *item = calloc(1, sizeof(scconf_item));
+
+		if (item == NULL)
+			return 0;
+		*tail = item;
+		tail = &item->next;
+		item->type = (int) get_u32(r);
+		item->key = get_string(r);
+		switch (item->type) {
+		case SCCONF_ITEM_TYPE_COMMENT:
+			item->value.comment = get_string(r);
+			break;
+		case SCCONF_ITEM_TYPE_BLOCK:
+			item->value.block = calloc(1, sizeof(scconf_block));
+			if (item->value.block == NULL || item->key == NULL)
+				return 0;
+			item->value.block->parent = block;
+			if (!get_block(r, item->value.block, depth + 1))
+				return 0;
+			break;
+		case SCCONF_ITEM_TYPE_VALUE:
+			if (item->key == NULL)
+				return 0;
+			item->value.list = get_list(r);
+			break;
+		default:
+			return 0;
+		}
+	}
+	return !r->error;
+}
+
+int scconf_save_compiled(const scconf_context * config, const char *cachefile)
+{
+	compiled_writer w;
+	struct stat st;
+	char *tmpfile;
+	size_t len;
+
+	if (!config || !config->filename || !cachefile)
+		return EINVAL;
+	if (stat(config->filename, &st) != 0)
+		return errno;
+
+	/* write a new file and rename it, so that readers see a complete one */
+	len = strlen(cachefile) + sizeof(".tmp");
+	tmpfile = malloc(len);
+	if (!tmpfile)
+		return ENOMEM;
+	snprintf(tmpfile, len, "%s.tmp", cachefile);
+
+	memset(&w, 0, sizeof(w));
+	w.f = fopen(tmpfile, "wb");
+	if (!w.f) {
+		w.error = errno;
+		free(tmpfile);
+		return w.error;
+	}
+	if (fwrite(COMPILED_MAGIC, 1, COMPILED_MAGIC_LEN, w.f) != COMPILED_MAGIC_LEN)
+		w.error = errno ? errno : EIO;
+	put_string(&w, config->filename);
+	put_u64(&w, (unsigned long long) st.st_mtime);
+	put_u64(&w, (unsigned long long) st.st_size);
+	put_block(&w, config->root);
+	if (fclose(w.f) != 0 && !w.error)
+		w.error = errno ? errno : EIO;
+
+	if (!w.error && rename(tmpfile, cachefile) != 0)
+		w.error = errno;
+	if (w.error)
+		remove(tmpfile);
+	free(tmpfile);
+	return w.error;
+}
+
+int scconf_load_compiled(scconf_context * config, const char *cachefile)
+{
+	compiled_reader r;
+	scconf_block *root;
+	struct stat st;
+	unsigned char *buf;
+	char *source;
+	long size;
+	FILE *f;
+	int ok;
+
+	if (!config || !config->filename || !cachefile)
+		return -1;
+	f = fopen(cachefile, "rb");
+	if (!f)
+		return -1;
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < COMPILED_MAGIC_LEN
+	    || fseek(f, 0, SEEK_SET) != 0) {
+		fclose(f);
+		return 0;
+	}
+	buf = malloc((size_t) size);
+	if (!buf || fread(buf, 1, (size_t) size, f) != (size_t) size) {
+		free(buf);
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	memset(&r, 0, sizeof(r));
+	r.p = buf + COMPILED_MAGIC_LEN;
+	r.end = buf + size;
+	ok = memcmp(buf, COMPILED_MAGIC, COMPILED_MAGIC_LEN) == 0;
+
+	/* the snapshot must be made from the current version of the file */
+	source = ok ? get_string(&r) : NULL;
+	ok = source && strcmp(source, config->filename) == 0
+		&& stat(config->filename, &st) == 0
+		&& get_u64(&r) == (unsigned long long) st.st_mtime
+		&& get_u64(&r) == (unsigned long long) st.st_size;
+	free(source);
+
+	root = ok ? calloc(1, sizeof(scconf_block)) : NULL;
+	if (root && get_block(&r, root, 0) && r.p == r.end) {
+		scconf_block_destroy(config->root);
+		config->root = root;
+	} else {
+		scconf_block_destroy(root);
+		ok = 0;
+	}
+	free(buf);
+	return ok ? 1 : 0;
+}
@@ -86,6 +86,18 @@ extern int scconf_parse(scconf_context * config);
  */
 extern int scconf_parse_string(scconf_context * config, const char *string);
 
+/* Load config from a snapshot written by scconf_save_compiled()
+ * The snapshot is only used if it was made from config->filename
+ * and the file has not been modified since
+ * Returns 1 = ok, 0 = snapshot outdated or invalid, -1 = error opening snapshot
+ */
+extern int scconf_load_compiled(scconf_context * config, const char *cachefile);
+
+/* Write a snapshot of the parsed config->filename to cachefile
+ * Returns 0 = ok, else = errno
+ */
+extern int scconf_save_compiled(const scconf_context * config, const char *cachefile);
+
 /* Write config to a file
  * If the filename is NULL, use the config->filename
  * Returns 0 = ok, else = errno
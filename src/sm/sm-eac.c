@@ -17,6 +17,9 @@
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_SM
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -66,6 +69,13 @@ IMPLEMENT_ASN1_FUNCTIONS(ASN1_AUXILIARY_DATA)
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/objects.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+#define EAC_JOB_THREAD
+#endif
 
 
 /*
@@ -261,7 +271,25 @@ struct eac_sm_ctx {
 	BUF_MEM *eph_pub_key;
 	/** @brief Auxiliary Data */
 	BUF_MEM *auxiliary_data;
+	/** @brief Input of the SM operations, reused for every APDU */
+	BUF_MEM *input;
+	/** @brief Salted digest of the PACE secret, type and CHAT which
+	 * established the channel, see eac_pace_is_established() */
+	unsigned char pace_id[SHA256_DIGEST_LENGTH];
+	/** @brief Salt of \a pace_id */
+	unsigned char pace_salt[16];
+	/** @brief Whether \a pace_id is valid */
+	char pace_id_set;
 	char flags;
+	/** @brief CARs of the CVCA keys the card reported in PACE, the
+	 * certificate chain of TA starts with one they verify */
+	BUF_MEM *recent_car;
+	BUF_MEM *previous_car;
+};
+
+/** @brief Established EAC channel detached from its card */
+struct eac_sm_session {
+	struct iso_sm_ctx *sctx;
 };
 
 
@@ -319,6 +347,10 @@ eac_sm_ctx_create(EAC_CTX *ctx, const unsigned char *certificate_description,
 
 	out->eph_pub_key = NULL;
 	out->auxiliary_data = NULL;
+	out->input = NULL;
+	out->pace_id_set = 0;
+	out->recent_car = NULL;
+	out->previous_car = NULL;
 
 	out->flags = eac_default_flags;
 	if (out->flags & EAC_FLAG_DISABLE_CHECK_TA)
@@ -333,6 +365,93 @@ err:
 	return NULL;
 }
 
+/*
+ * Host side computations of TA and CA which don't depend on the card's next
+ * response. They run in a thread while the card is busy with the APDUs of
+ * the protocol step. The job only touches the TA and CA contexts while the
+ * SM of the concurrent APDUs uses the PACE keys. Without threads the job
+ * runs when it is started.
+ */
+struct eac_job {
+	int (*run)(struct eac_job *job);
+	EAC_CTX *ctx;
+	/* TA: inputs for EAC_CTX_init_ta(), output is the ephemeral key for CA */
+	const unsigned char *privkey;
+	size_t privkey_len;
+	const unsigned char *cert;
+	size_t cert_len;
+	BUF_MEM *eph_pub_key;
+	/* CA: the chip's static key */
+	const BUF_MEM *picc_pubkey;
+	const char *error;
+	int r;
+#ifdef EAC_JOB_THREAD
+	pthread_t thread;
+	int started;
+#endif
+};
+
+#ifdef EAC_JOB_THREAD
+static void *eac_job_main(void *arg)
+{
+	struct eac_job *job = arg;
+	job->r = job->run(job);
+	return NULL;
+}
+#endif
+
+static void eac_job_start(struct eac_job *job)
+{
+#ifdef EAC_JOB_THREAD
+	job->started = pthread_create(&job->thread, NULL, eac_job_main, job) == 0;
+	if (job->started)
+		return;
+#endif
+	job->r = job->run(job);
+}
+
+/* Wait for the job; must be called for every started job */
+static int eac_job_finish(sc_card_t *card, struct eac_job *job)
+{
+#ifdef EAC_JOB_THREAD
+	if (job->started) {
+		pthread_join(job->thread, NULL);
+		job->started = 0;
+	}
+#endif
+	if (job->r < 0 && job->error)
+		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "%s", job->error);
+
+	return job->r;
+}
+
+static int eac_job_ta(struct eac_job *job)
+{
+	if (!EAC_CTX_init_ta(job->ctx, job->privkey, job->privkey_len,
+				job->cert, job->cert_len)) {
+		job->error = "Could not initialize TA.";
+		return SC_ERROR_INTERNAL;
+	}
+
+	job->eph_pub_key = TA_STEP3_generate_ephemeral_key(job->ctx);
+	if (!job->eph_pub_key) {
+		job->error = "Could not generate CA ephemeral key.";
+		return SC_ERROR_INTERNAL;
+	}
+
+	return SC_SUCCESS;
+}
+
+static int eac_job_ca(struct eac_job *job)
+{
+	if (!CA_STEP4_compute_shared_secret(job->ctx, job->picc_pubkey)) {
+		job->error = "Could not compute shared secret.";
+		return SC_ERROR_INTERNAL;
+	}
+
+	return SC_SUCCESS;
+}
+
 static int
 eac_sm_start(sc_card_t *card, EAC_CTX *eac_ctx,
 		const unsigned char *certificate_description,
@@ -1011,6 +1130,155 @@ get_psec(sc_card_t *card, const char *pin, size_t length_pin, enum s_type pin_id
 }
 
 
+static int
+eac_pace_id(const unsigned char *salt, size_t salt_len,
+		const struct establish_pace_channel_input *pace_input,
+		unsigned char id[SHA256_DIGEST_LENGTH])
+{
+	EVP_MD_CTX *md_ctx = EVP_MD_CTX_create();
+	unsigned char pin_id = pace_input->pin_id;
+	int ok;
+
+	ok = md_ctx
+		&& EVP_DigestInit_ex(md_ctx, EVP_sha256(), NULL)
+		&& EVP_DigestUpdate(md_ctx, salt, salt_len)
+		&& EVP_DigestUpdate(md_ctx, &pin_id, sizeof pin_id)
+		&& EVP_DigestUpdate(md_ctx, pace_input->chat, pace_input->chat_length)
+		&& EVP_DigestUpdate(md_ctx, pace_input->pin, pace_input->pin_length)
+		&& EVP_DigestFinal_ex(md_ctx, id, NULL);
+	EVP_MD_CTX_destroy(md_ctx);
+
+	return ok ? SC_SUCCESS : SC_ERROR_INTERNAL;
+}
+
+/* Remember which secret established the channel. Without a secret (PIN pad
+ * or prompt) the channel can not be matched later and is never reused. */
+static void
+eac_pace_set_id(sc_card_t *card,
+		const struct establish_pace_channel_input *pace_input)
+{
+	struct iso_sm_ctx *sctx = card->sm_ctx.info.cmd_data;
+	struct eac_sm_ctx *eacsmctx = sctx ? sctx->priv_data : NULL;
+
+	if (!eacsmctx || !pace_input->pin || !pace_input->pin_length)
+		return;
+
+	if (RAND_bytes(eacsmctx->pace_salt, sizeof eacsmctx->pace_salt) == 1
+			&& SC_SUCCESS == eac_pace_id(eacsmctx->pace_salt,
+				sizeof eacsmctx->pace_salt, pace_input, eacsmctx->pace_id))
+		eacsmctx->pace_id_set = 1;
+}
+
+/* Remember the CVCAs known to the card for TA; without them the whole
+ * chain is sent */
+static void
+eac_sm_set_cars(sc_card_t *card,
+		const struct establish_pace_channel_output *pace_output)
+{
+	struct iso_sm_ctx *isosmctx = card->sm_ctx.info.cmd_data;
+	struct eac_sm_ctx *eacsmctx = isosmctx ? isosmctx->priv_data : NULL;
+
+	if (!eacsmctx)
+		return;
+	if (pace_output->recent_car && pace_output->recent_car_length)
+		eacsmctx->recent_car = BUF_MEM_create_init(pace_output->recent_car,
+				pace_output->recent_car_length);
+	if (pace_output->previous_car && pace_output->previous_car_length)
+		eacsmctx->previous_car = BUF_MEM_create_init(pace_output->previous_car,
+				pace_output->previous_car_length);
+}
+
+int eac_pace_is_established(sc_card_t *card,
+		const struct establish_pace_channel_input *pace_input)
+{
+	struct iso_sm_ctx *sctx;
+	struct eac_sm_ctx *eacsmctx;
+	unsigned char id[SHA256_DIGEST_LENGTH];
+	int r;
+
+	if (!card || !pace_input || !pace_input->pin || !pace_input->pin_length
+			|| card->sm_ctx.sm_mode != SM_MODE_TRANSMIT)
+		return 0;
+
+	sctx = card->sm_ctx.info.cmd_data;
+	if (!sctx || sctx->clear_free != eac_sm_clear_free)
+		return 0;
+	eacsmctx = sctx->priv_data;
+	if (!eacsmctx || !eacsmctx->pace_id_set)
+		return 0;
+
+	if (SC_SUCCESS != eac_pace_id(eacsmctx->pace_salt,
+				sizeof eacsmctx->pace_salt, pace_input, id))
+		return 0;
+	r = CRYPTO_memcmp(id, eacsmctx->pace_id, sizeof id) == 0;
+	sc_mem_clear(id, sizeof id);
+
+	return r;
+}
+
+void eac_pace_clear_id(sc_card_t *card)
+{
+	struct iso_sm_ctx *sctx;
+	struct eac_sm_ctx *eacsmctx;
+
+	if (!card || card->sm_ctx.sm_mode != SM_MODE_TRANSMIT)
+		return;
+	sctx = card->sm_ctx.info.cmd_data;
+	if (!sctx || sctx->clear_free != eac_sm_clear_free)
+		return;
+	eacsmctx = sctx->priv_data;
+	if (eacsmctx)
+		eacsmctx->pace_id_set = 0;
+}
+
+int eac_sm_export(sc_card_t *card, struct eac_sm_session **session)
+{
+	struct iso_sm_ctx *sctx;
+	struct eac_sm_session *out;
+
+	if (!card || !session)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	sctx = card->sm_ctx.info.cmd_data;
+	if (card->sm_ctx.sm_mode != SM_MODE_TRANSMIT
+			|| card->sm_ctx.ops.close != iso_sm_close
+			|| !sctx || sctx->clear_free != eac_sm_clear_free)
+		return SC_ERROR_SM_NOT_INITIALIZED;
+
+	out = malloc(sizeof *out);
+	if (!out)
+		return SC_ERROR_OUT_OF_MEMORY;
+	out->sctx = sctx;
+
+	card->sm_ctx.info.cmd_data = NULL;
+	card->sm_ctx.sm_mode = SM_MODE_NONE;
+	*session = out;
+
+	return SC_SUCCESS;
+}
+
+int eac_sm_import(sc_card_t *card, struct eac_sm_session *session)
+{
+	int r;
+
+	if (!card || !session || !session->sctx)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	r = iso_sm_start(card, session->sctx);
+	if (r == SC_SUCCESS)
+		free(session);
+
+	return r;
+}
+
+void eac_sm_session_free(struct eac_sm_session *session)
+{
+	if (session) {
+		iso_sm_ctx_clear_free(session->sctx);
+		free(session);
+	}
+}
+
 int perform_pace(sc_card_t *card,
 		struct establish_pace_channel_input pace_input,
 		struct establish_pace_channel_output *pace_output,
@@ -1323,6 +1591,10 @@ int perform_pace(sc_card_t *card,
 		r = eac_sm_start(card, eac_ctx, pace_input.certificate_description,
 				pace_input.certificate_description_length, pace_output->id_icc,
 				pace_output->id_icc_length);
+		if (r == SC_SUCCESS) {
+			eac_pace_set_id(card, &pace_input);
+			eac_sm_set_cars(card, pace_output);
+		}
 	}
 
 err:
@@ -1465,6 +1737,102 @@ static void eac_sm_clear_free_without_ctx(const struct iso_sm_ctx *ctx)
 	}
 }
 
+/*
+ * The references of the CV certificates used for TA, so that the same
+ * chain is not decoded again for every session. Keyed by the SHA-256 of
+ * the encoded certificate; shared by all cards of the process.
+ */
+#define EAC_CVC_CACHE_SIZE 16
+#define EAC_CVC_REF_MAX 16
+
+struct eac_cvc_refs {
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	unsigned char car[EAC_CVC_REF_MAX];
+	size_t car_len;
+	unsigned char chr[EAC_CVC_REF_MAX];
+	size_t chr_len;
+};
+
+static struct eac_cvc_refs eac_cvc_cache[EAC_CVC_CACHE_SIZE];
+static unsigned int eac_cvc_cache_count = 0;
+static unsigned int eac_cvc_cache_next = 0;
+#ifdef EAC_JOB_THREAD
+static pthread_mutex_t eac_cvc_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define eac_cvc_cache_lock()	pthread_mutex_lock(&eac_cvc_cache_mutex)
+#define eac_cvc_cache_unlock()	pthread_mutex_unlock(&eac_cvc_cache_mutex)
+#else
+#define eac_cvc_cache_lock()
+#define eac_cvc_cache_unlock()
+#endif
+
+static int eac_cvc_get_refs(sc_card_t *card, const unsigned char *cert,
+		size_t cert_len, struct eac_cvc_refs *refs)
+{
+	const unsigned char *p = cert;
+	CVC_CERT *cvc_cert = NULL;
+	ASN1_OCTET_STRING *car, *chr;
+	unsigned int i;
+	int r = SC_SUCCESS;
+
+	SHA256(cert, cert_len, refs->digest);
+	eac_cvc_cache_lock();
+	for (i = 0; i < eac_cvc_cache_count; i++) {
+		if (memcmp(eac_cvc_cache[i].digest, refs->digest, sizeof refs->digest) == 0) {
+			*refs = eac_cvc_cache[i];
+			eac_cvc_cache_unlock();
+			return SC_SUCCESS;
+		}
+	}
+	eac_cvc_cache_unlock();
+
+	if (!CVC_d2i_CVC_CERT(&cvc_cert, &p, cert_len) || !cvc_cert
+			|| !cvc_cert->body || !cvc_cert->body->certificate_authority_reference
+			|| !cvc_cert->body->certificate_holder_reference) {
+		ssl_error(card->ctx);
+		r = SC_ERROR_INVALID_DATA;
+		goto err;
+	}
+	car = cvc_cert->body->certificate_authority_reference;
+	chr = cvc_cert->body->certificate_holder_reference;
+	if (car->length < 0 || (size_t)car->length > sizeof refs->car
+			|| chr->length < 0 || (size_t)chr->length > sizeof refs->chr) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Certificate reference too long.");
+		r = SC_ERROR_INVALID_DATA;
+		goto err;
+	}
+	memcpy(refs->car, car->data, car->length);
+	refs->car_len = car->length;
+	memcpy(refs->chr, chr->data, chr->length);
+	refs->chr_len = chr->length;
+
+	eac_cvc_cache_lock();
+	eac_cvc_cache[eac_cvc_cache_next] = *refs;
+	eac_cvc_cache_next = (eac_cvc_cache_next + 1) % EAC_CVC_CACHE_SIZE;
+	if (eac_cvc_cache_count < EAC_CVC_CACHE_SIZE)
+		eac_cvc_cache_count++;
+	eac_cvc_cache_unlock();
+
+err:
+	if (cvc_cert)
+		CVC_CERT_free(cvc_cert);
+	return r;
+}
+
+static int eac_car_known(const struct eac_sm_ctx *eacsmctx,
+		const struct eac_cvc_refs *refs)
+{
+	const BUF_MEM *cars[2];
+	unsigned int i;
+
+	cars[0] = eacsmctx->recent_car;
+	cars[1] = eacsmctx->previous_car;
+	for (i = 0; i < 2; i++)
+		if (cars[i] && cars[i]->length == refs->car_len
+				&& memcmp(cars[i]->data, refs->car, refs->car_len) == 0)
+			return 1;
+	return 0;
+}
+
 #define TA_NONCE_LENGTH 8
 int perform_terminal_authentication(sc_card_t *card,
 		const unsigned char **certs, const size_t *certs_lens,
@@ -1474,15 +1842,18 @@ int perform_terminal_authentication(sc_card_t *card,
 	int r;
 	const unsigned char *cert = NULL;
 	size_t cert_len = 0, ef_cardaccess_length = 0;
-	CVC_CERT *cvc_cert = NULL;
+	struct eac_cvc_refs *refs = NULL;
 	BUF_MEM *nonce = NULL, *signature = NULL;
 	struct iso_sm_ctx *isosmctx = NULL;
 	struct eac_sm_ctx *eacsmctx = NULL;
 	unsigned char *ef_cardaccess = NULL;
 	EAC_CTX *eac_ctx = NULL;
 	const unsigned char *chr = NULL;
-	size_t chr_len = 0;
+	size_t chr_len = 0, i, n, first;
+	struct eac_job job;
+	int job_started = 0;
 
+	memset(&job, 0, sizeof job);
 	if (!card || !certs_lens || !certs) {
 		r = SC_ERROR_INVALID_ARGUMENTS;
 		goto err;
@@ -1536,57 +1907,74 @@ int perform_terminal_authentication(sc_card_t *card,
 	}
 	eacsmctx = isosmctx->priv_data;
 
+	/* The terminal's certificate is the last one of the chain. TA is
+	 * initialized and the ephemeral key generated while the card verifies
+	 * the chain. */
+	for (n = 0; certs[n] && certs_lens[n]; n++) {
+		cert = certs[n];
+		cert_len = certs_lens[n];
+	}
+	if (n == 0) {
+		r = SC_ERROR_INVALID_ARGUMENTS;
+		goto err;
+	}
+	refs = calloc(n, sizeof *refs);
+	if (!refs) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	job.run = eac_job_ta;
+	job.ctx = eacsmctx->ctx;
+	job.privkey = privkey;
+	job.privkey_len = privkey_len;
+	job.cert = cert;
+	job.cert_len = cert_len;
+	eac_job_start(&job);
+	job_started = 1;
 
-	while (*certs && *certs_lens) {
-		cert = *certs;
-		cert_len = *certs_lens;
-		if (!CVC_d2i_CVC_CERT(&cvc_cert, &cert, cert_len) || !cvc_cert
-				|| !cvc_cert->body || !cvc_cert->body->certificate_authority_reference
-				|| !cvc_cert->body->certificate_holder_reference) {
-			ssl_error(card->ctx);
-			r = SC_ERROR_INVALID_DATA;
+	for (i = 0; i < n; i++) {
+		r = eac_cvc_get_refs(card, certs[i], certs_lens[i], &refs[i]);
+		if (r < 0)
 			goto err;
+	}
+
+	/* The card already knows the links up to the newest certificate
+	 * issued by one of its CVCAs */
+	first = 0;
+	for (i = n; i-- > 0; ) {
+		if (eac_car_known(eacsmctx, &refs[i])) {
+			first = i;
+			break;
 		}
-		cert = *certs;
+	}
+	if (first)
+		sc_debug(card->ctx, SC_LOG_DEBUG_SM, "Skipping %"SC_FORMAT_LEN_SIZE_T"u "
+				"certificates known to the card", first);
 
-		r = eac_mse_set_dst(card,
-				cvc_cert->body->certificate_authority_reference->data,
-				cvc_cert->body->certificate_authority_reference->length);
+	for (i = first; i < n; i++) {
+		r = eac_mse_set_dst(card, refs[i].car, refs[i].car_len);
 		if (r < 0) {
 			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not select protocol properties "
 					"(MSE: Set AT failed).");
 			goto err;
 		}
 
-		r = eac_verify(card, cert, cert_len);
+		r = eac_verify(card, certs[i], certs_lens[i]);
 		if (r < 0)
 			goto err;
-
-		chr = cvc_cert->body->certificate_holder_reference->data;
-		chr_len = cvc_cert->body->certificate_holder_reference->length;
-
-		certs++;
-		certs_lens++;
 	}
+	chr = refs[n - 1].chr;
+	chr_len = refs[n - 1].chr_len;
 
 
-	if (!EAC_CTX_init_ta(eacsmctx->ctx, privkey, privkey_len, cert, cert_len)) {
-		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not initialize TA.");
-		ssl_error(card->ctx);
-		r = SC_ERROR_INTERNAL;
+	job_started = 0;
+	r = eac_job_finish(card, &job);
+	if (r < 0)
 		goto err;
-	}
-
-
 	if (eacsmctx->eph_pub_key)
 		BUF_MEM_free(eacsmctx->eph_pub_key);
-	eacsmctx->eph_pub_key = TA_STEP3_generate_ephemeral_key(eacsmctx->ctx);
-	if (!eacsmctx->eph_pub_key) {
-		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not generate CA ephemeral key.");
-		ssl_error(card->ctx);
-		r = SC_ERROR_INTERNAL;
-		goto err;
-	}
+	eacsmctx->eph_pub_key = job.eph_pub_key;
+	job.eph_pub_key = NULL;
 
 
 	r = eac_mse_set_at_ta(card, eacsmctx->ctx->ta_ctx->protocol, chr, chr_len,
@@ -1634,8 +2022,10 @@ int perform_terminal_authentication(sc_card_t *card,
 			signature->length);
 
 err:
-	if (cvc_cert)
-		CVC_CERT_free(cvc_cert);
+	if (job_started)
+		eac_job_finish(card, &job);
+	BUF_MEM_free(job.eph_pub_key);
+	free(refs);
 	free(ef_cardaccess);
 	EAC_CTX_clear_free(eac_ctx);
 	BUF_MEM_clear_free(nonce);
@@ -1795,7 +2185,10 @@ int perform_chip_authentication_ex(sc_card_t *card, void *eac_ctx,
 	BUF_MEM *picc_pubkey_buf = NULL, *nonce = NULL, *token = NULL,
 			*eph_pub_key = NULL;
 	EAC_CTX *ctx = eac_ctx;
+	struct eac_job job;
+	int job_started = 0, protocol;
 
+	memset(&job, 0, sizeof job);
 	if (!card || !ctx) {
 		r = SC_ERROR_INVALID_ARGUMENTS;
 		goto err;
@@ -1811,14 +2204,7 @@ int perform_chip_authentication_ex(sc_card_t *card, void *eac_ctx,
 	}
 
 
-	r = eac_mse_set_at_ca(card, ctx->ca_ctx->protocol);
-	if (r < 0) {
-		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not select protocol properties "
-				"(MSE: Set AT failed).");
-		goto err;
-	}
-
-
+	protocol = ctx->ca_ctx->protocol;
 	eph_pub_key = CA_STEP2_get_eph_pubkey(ctx);
 	if (!eph_pub_key) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not derive keys.");
@@ -1826,6 +2212,22 @@ int perform_chip_authentication_ex(sc_card_t *card, void *eac_ctx,
 		r = SC_ERROR_INTERNAL;
 		goto err;
 	}
+
+	/* The shared secret only depends on our ephemeral key and the chip's
+	 * static key, compute it while the card performs the key agreement */
+	job.run = eac_job_ca;
+	job.ctx = ctx;
+	job.picc_pubkey = picc_pubkey_buf;
+	eac_job_start(&job);
+	job_started = 1;
+
+	r = eac_mse_set_at_ca(card, protocol);
+	if (r < 0) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not select protocol properties "
+				"(MSE: Set AT failed).");
+		goto err;
+	}
+
 	r = eac_gen_auth_ca(card, eph_pub_key, &nonce, &token);
 	if (r < 0) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "(General Authenticate failed).");
@@ -1833,12 +2235,10 @@ int perform_chip_authentication_ex(sc_card_t *card, void *eac_ctx,
 	}
 
 
-	if (!CA_STEP4_compute_shared_secret(ctx, picc_pubkey_buf)) {
-		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not compute shared secret.");
-		ssl_error(card->ctx);
-		r = SC_ERROR_INTERNAL;
+	job_started = 0;
+	r = eac_job_finish(card, &job);
+	if (r < 0)
 		goto err;
-	}
 
 
 	if (!CA_STEP6_derive_keys(ctx, nonce, token)) {
@@ -1862,6 +2262,8 @@ int perform_chip_authentication_ex(sc_card_t *card, void *eac_ctx,
 	}
 
 err:
+	if (job_started)
+		eac_job_finish(card, &job);
 	BUF_MEM_clear_free(picc_pubkey_buf);
 	BUF_MEM_clear_free(nonce);
 	BUF_MEM_clear_free(token);
@@ -1885,6 +2287,27 @@ increment_ssc(struct eac_sm_ctx *eacsmctx)
 	return SC_SUCCESS;
 }
 
+/* Copy data into the input buffer of the SM context, growing it only when
+ * the data does not fit */
+static BUF_MEM *
+eac_sm_input(struct eac_sm_ctx *eacsmctx, const u8 *data, size_t datalen)
+{
+	if (!eacsmctx->input) {
+		eacsmctx->input = BUF_MEM_new();
+		if (!eacsmctx->input)
+			return NULL;
+	}
+	if (datalen > eacsmctx->input->max
+			&& !BUF_MEM_grow_clean(eacsmctx->input, datalen))
+		return NULL;
+	eacsmctx->input->length = datalen;
+	if (datalen)
+		/* Flawfinder: ignore */
+		memcpy(eacsmctx->input->data, data, datalen);
+
+	return eacsmctx->input;
+}
+
 static int
 eac_sm_encrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 		const u8 *data, size_t datalen, u8 **enc)
@@ -1900,8 +2323,9 @@ eac_sm_encrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	}
 	eacsmctx = ctx->priv_data;
 
-	databuf = BUF_MEM_create_init(data, datalen);
-	encbuf = EAC_encrypt(eacsmctx->ctx, databuf);
+	databuf = eac_sm_input(eacsmctx, data, datalen);
+	if (databuf)
+		encbuf = EAC_encrypt(eacsmctx->ctx, databuf);
 	if (!databuf || !encbuf || !encbuf->length) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not encrypt data.");
 		ssl_error(card->ctx);
@@ -1920,7 +2344,8 @@ eac_sm_encrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	r = encbuf->length;
 
 err:
-	BUF_MEM_clear_free(databuf);
+	if (databuf)
+		OPENSSL_cleanse(databuf->data, databuf->length);
 	if (encbuf)
 		BUF_MEM_free(encbuf);
 
@@ -1942,8 +2367,9 @@ eac_sm_decrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	}
 	eacsmctx = ctx->priv_data;
 
-	encbuf = BUF_MEM_create_init(enc, enclen);
-	databuf = EAC_decrypt(eacsmctx->ctx, encbuf);
+	encbuf = eac_sm_input(eacsmctx, enc, enclen);
+	if (encbuf)
+		databuf = EAC_decrypt(eacsmctx->ctx, encbuf);
 	if (!encbuf || !databuf || !databuf->length) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not decrypt data.");
 		ssl_error(card->ctx);
@@ -1963,8 +2389,6 @@ eac_sm_decrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 
 err:
 	BUF_MEM_clear_free(databuf);
-	if (encbuf)
-		BUF_MEM_free(encbuf);
 
 	return r;
 }
@@ -1984,7 +2408,7 @@ eac_sm_authenticate(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	}
 	eacsmctx = ctx->priv_data;
 
-	inbuf = BUF_MEM_create_init(data, datalen);
+	inbuf = eac_sm_input(eacsmctx, data, datalen);
 	if (!inbuf) {
 		r = SC_ERROR_OUT_OF_MEMORY;
 		goto err;
@@ -2010,8 +2434,6 @@ eac_sm_authenticate(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	r = macbuf->length;
 
 err:
-	if (inbuf)
-		BUF_MEM_free(inbuf);
 	if (macbuf)
 		BUF_MEM_free(macbuf);
 
@@ -2033,7 +2455,7 @@ eac_sm_verify_authentication(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	}
 	eacsmctx = ctx->priv_data;
 
-	inbuf = BUF_MEM_create_init(macdata, macdatalen);
+	inbuf = eac_sm_input(eacsmctx, macdata, macdatalen);
 	if (!inbuf) {
 		r = SC_ERROR_OUT_OF_MEMORY;
 		goto err;
@@ -2061,8 +2483,6 @@ eac_sm_verify_authentication(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	r = SC_SUCCESS;
 
 err:
-	if (inbuf)
-		BUF_MEM_free(inbuf);
 	if (my_mac)
 		BUF_MEM_free(my_mac);
 
@@ -2352,6 +2772,12 @@ eac_sm_clear_free(const struct iso_sm_ctx *ctx)
 				BUF_MEM_free(eacsmctx->eph_pub_key);
 			if (eacsmctx->auxiliary_data)
 				BUF_MEM_free(eacsmctx->auxiliary_data);
+			if (eacsmctx->input)
+				BUF_MEM_clear_free(eacsmctx->input);
+			if (eacsmctx->recent_car)
+				BUF_MEM_free(eacsmctx->recent_car);
+			if (eacsmctx->previous_car)
+				BUF_MEM_free(eacsmctx->previous_car);
 			free(eacsmctx);
 		}
 	}
@@ -2397,6 +2823,30 @@ int perform_chip_authentication_ex(sc_card_t *card, void *eac_ctx,
 	return SC_ERROR_NOT_SUPPORTED;
 }
 
+int eac_pace_is_established(sc_card_t *card,
+		const struct establish_pace_channel_input *pace_input)
+{
+	return 0;
+}
+
+void eac_pace_clear_id(sc_card_t *card)
+{
+}
+
+int eac_sm_export(sc_card_t *card, struct eac_sm_session **session)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+int eac_sm_import(sc_card_t *card, struct eac_sm_session *session)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+void eac_sm_session_free(struct eac_sm_session *session)
+{
+}
+
 #endif
 
 static const char *MRZ_name = "MRZ";
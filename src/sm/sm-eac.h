@@ -178,6 +178,68 @@ int perform_chip_authentication(sc_card_t *card,
 int perform_chip_authentication_ex(sc_card_t *card, void *eacsmctx,
 		unsigned char *picc_pubkey, size_t picc_pubkey_len);
 
+/** @brief Established EAC secure messaging channel detached from its card */
+struct eac_sm_session;
+
+/**
+ * @brief Check whether the card's SM channel was established by PACE with
+ * the given secret
+ *
+ * Compares \a pace_input.pin_id, \a pace_input.chat and \a pace_input.pin
+ * with the input of the PACE run that established the current channel. A
+ * channel established without an explicit secret never matches.
+ *
+ * @param[in] card
+ * @param[in] pace_input
+ *
+ * @return \c 1 if the channel can be reused instead of running PACE again,
+ * \c 0 otherwise
+ */
+int eac_pace_is_established(sc_card_t *card,
+		const struct establish_pace_channel_input *pace_input);
+
+/**
+ * @brief Prevent the current channel from being reused by
+ * eac_pace_is_established(), e.g. after the secret has been changed
+ *
+ * @param[in] card
+ */
+void eac_pace_clear_id(sc_card_t *card);
+
+/**
+ * @brief Detach the established EAC channel from \a card
+ *
+ * The card is left without SM. The session keys and send sequence counter
+ * are kept in \a session until they are given back with eac_sm_import() or
+ * discarded with eac_sm_session_free().
+ *
+ * @param[in]  card
+ * @param[out] session
+ *
+ * @return \c SC_SUCCESS or error code if an error occurred
+ */
+int eac_sm_export(sc_card_t *card, struct eac_sm_session **session);
+
+/**
+ * @brief Continue a channel detached with eac_sm_export()
+ *
+ * On success \a card takes over \a session. If the card meanwhile
+ * dropped the channel, the next APDU fails and PACE needs to be run again.
+ *
+ * @param[in] card
+ * @param[in] session
+ *
+ * @return \c SC_SUCCESS or error code if an error occurred
+ */
+int eac_sm_import(sc_card_t *card, struct eac_sm_session *session);
+
+/**
+ * @brief Discard a channel detached with eac_sm_export()
+ *
+ * @param[in] session
+ */
+void eac_sm_session_free(struct eac_sm_session *session);
+
 /** @brief Disable all sanity checks done by OpenSC */
 #define EAC_FLAG_DISABLE_CHECK_ALL 1
 
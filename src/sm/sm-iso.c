@@ -17,6 +17,9 @@
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+
+#define SC_LOG_SUBSYSTEM SC_LOG_SUBSYS_SM
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -54,6 +57,19 @@ static const struct sc_asn1_entry c_sm_rapdu[] = {
 	{ NULL, 0, 0, 0, NULL, NULL }
 };
 
+/* Temporary buffers of sm_encrypt() and sm_decrypt(). They are only grown
+ * with realloc() and kept in the context, so that protecting an APDU does
+ * not allocate them again. Buffers holding plain data are cleared after
+ * every use. */
+struct iso_sm_buffers {
+	u8 *le;
+	u8 *pad_data;
+	u8 *fdata;
+	u8 *mac_data;
+	u8 *mac;
+	u8 *data;
+};
+
 static int
 add_iso_pad(const u8 *data, size_t datalen, int block_size, u8 **padded)
 {
@@ -99,6 +115,7 @@ add_padding(const struct iso_sm_ctx *ctx, const u8 *data, size_t datalen,
 					*padded = p;
 					memcpy(*padded, data, datalen);
 				} else {
+					free(*padded);
 					*padded = NULL;
 				}
 			}
@@ -213,6 +230,8 @@ static int format_data(sc_card_t *card, const struct iso_sm_ctx *ctx,
 		r = SC_ERROR_INVALID_ARGUMENTS;
 		goto err;
 	}
+	if (ctx->buffers)
+		pad_data = ctx->buffers->pad_data;
 
 	r = add_padding(ctx, data, datalen, &pad_data);
 	if (r < 0) {
@@ -248,7 +267,10 @@ static int format_data(sc_card_t *card, const struct iso_sm_ctx *ctx,
 err:
 	if (pad_data) {
 		sc_mem_clear(pad_data, pad_data_len);
-		free(pad_data);
+		if (ctx && ctx->buffers)
+			ctx->buffers->pad_data = pad_data;
+		else
+			free(pad_data);
 	}
 
 	return r;
@@ -284,11 +306,19 @@ static int sm_encrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 	size_t sm_data_len, fdata_len, mac_data_len, asn1_len, mac_len, le_len;
 	int r;
 	sc_apdu_t *sm_apdu = NULL;
+	struct iso_sm_buffers *b = NULL;
 
 	if (!apdu || !ctx || !card || !card->reader || !psm_apdu) {
 		r = SC_ERROR_INVALID_ARGUMENTS;
 		goto err;
 	}
+	b = ctx->buffers;
+	if (b) {
+		le = b->le;
+		fdata = b->fdata;
+		mac_data = b->mac_data;
+		mac = b->mac;
+	}
 
 	if ((apdu->cla & 0x0C) == 0x0C) {
 		r = SC_ERROR_INVALID_ARGUMENTS;
@@ -491,11 +521,18 @@ static int sm_encrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 	*psm_apdu = sm_apdu;
 
 err:
-	free(fdata);
 	free(asn1);
-	free(mac_data);
-	free(mac);
-	free(le);
+	if (b) {
+		b->le = le;
+		b->fdata = fdata;
+		b->mac_data = mac_data;
+		b->mac = mac;
+	} else {
+		free(fdata);
+		free(mac_data);
+		free(mac);
+		free(le);
+	}
 	if (r < 0) {
 		free(resp_data);
 		free(sm_apdu);
@@ -513,10 +550,15 @@ static int sm_decrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 	struct sc_asn1_entry my_sm_rapdu[5];
 	u8 sw[2], mac[8], fdata[SC_MAX_EXT_APDU_BUFFER_SIZE];
 	size_t sw_len = sizeof sw, mac_len = sizeof mac, fdata_len = sizeof fdata,
-		   buf_len, asn1_len, fdata_offset = 0;
+		   buf_len, asn1_len, fdata_offset = 0, data_len = 0;
 	const u8 *buf;
 	u8 *data = NULL, *mac_data = NULL, *asn1 = NULL;
 
+	if (ctx->buffers) {
+		data = ctx->buffers->data;
+		mac_data = ctx->buffers->mac_data;
+	}
+
 	sc_copy_asn1_entry(c_sm_rapdu, sm_rapdu);
 	sc_format_asn1_entry(sm_rapdu + 0, fdata, &fdata_len, 0);
 	sc_format_asn1_entry(sm_rapdu + 1, fdata, &fdata_len, 0);
@@ -571,6 +613,7 @@ static int sm_decrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 		if (r < 0)
 			goto err;
 		buf_len = r;
+		data_len = r;
 
 		r = rm_padding(ctx->padding_indicator, data, buf_len);
 		if (r < 0) {
@@ -616,9 +659,13 @@ static int sm_decrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 
 err:
 	free(asn1);
-	free(mac_data);
-	if (data) {
-		sc_mem_clear(data, buf_len);
+	if (data)
+		sc_mem_clear(data, data_len);
+	if (ctx->buffers) {
+		ctx->buffers->data = data;
+		ctx->buffers->mac_data = mac_data;
+	} else {
+		free(mac_data);
 		free(data);
 	}
 
@@ -709,6 +756,11 @@ struct iso_sm_ctx *iso_sm_ctx_create(void)
 	if (!sctx)
 		return NULL;
 
+	sctx->buffers = calloc(1, sizeof *sctx->buffers);
+	if (!sctx->buffers) {
+		free(sctx);
+		return NULL;
+	}
 	sctx->priv_data = NULL;
 	sctx->padding_indicator = SM_ISO_PADDING;
 	sctx->block_length = 0;
@@ -728,6 +780,15 @@ void iso_sm_ctx_clear_free(struct iso_sm_ctx *sctx)
 {
 	if (sctx && sctx->clear_free)
 		sctx->clear_free(sctx);
+	if (sctx && sctx->buffers) {
+		free(sctx->buffers->le);
+		free(sctx->buffers->pad_data);
+		free(sctx->buffers->fdata);
+		free(sctx->buffers->mac_data);
+		free(sctx->buffers->mac);
+		free(sctx->buffers->data);
+		free(sctx->buffers);
+	}
 	free(sctx);
 }
 
@@ -50,11 +50,17 @@ extern "C" {
 /** @brief Padding indicator: use no padding */
 #define SM_NO_PADDING  0x02
 
+struct iso_sm_buffers;
+
 /** @brief Secure messaging context */
 struct iso_sm_ctx {
 	/** @brief data of the specific crypto implementation */
 	void *priv_data;
 
+	/** @brief scratch buffers kept from one APDU to the next, allocated by
+	 * \c iso_sm_ctx_create() */
+	struct iso_sm_buffers *buffers;
+
 	/** @brief Padding-content indicator byte (ISO 7816-4 Table 30) */
 	u8 padding_indicator;
 	/** @brief Pad to this block length */
@@ -182,17 +182,15 @@ void fuzz_add_reader(struct sc_context *ctx, const uint8_t *Data, size_t Size)
     list_append(&ctx->readers, reader);
 }
 
-int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size)
-{
-    struct sc_context *ctx = NULL;
-    struct sc_card *card = NULL;
-    struct sc_pkcs15_card *p15card = NULL;
-    struct sc_reader *reader;
-    struct sc_pkcs15_object *obj;
+/* The context is set up once with the fuzzing reader driver. Per input only
+ * the reader and the state that depends on the card are recreated. */
+static struct sc_context *ctx = NULL;
 
+static int fuzz_setup_context(void)
+{
     sc_establish_context(&ctx, "fuzz");
     if (!ctx)
-        return 0;
+        return SC_ERROR_INTERNAL;
     /* copied from sc_release_context() */
     while (list_size(&ctx->readers)) {
         sc_reader_t *rdr = (sc_reader_t *) list_get_at(&ctx->readers, 0);
@@ -202,8 +200,32 @@ int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size)
         ctx->reader_driver->ops->finish(ctx);
 
     ctx->reader_driver = sc_get_fuzz_driver();
+    return SC_SUCCESS;
+}
+
+static void fuzz_reset_reader(const uint8_t *Data, size_t Size)
+{
+    while (list_size(&ctx->readers)) {
+        sc_reader_t *rdr = (sc_reader_t *) list_get_at(&ctx->readers, 0);
+        _sc_delete_reader(ctx, rdr);
+    }
+    /* the content of EF.DIR must not leak into the next input */
+    _sc_dir_cache_free(ctx);
 
     fuzz_add_reader(ctx, Data, Size);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size)
+{
+    struct sc_card *card = NULL;
+    struct sc_pkcs15_card *p15card = NULL;
+    struct sc_reader *reader;
+    struct sc_pkcs15_object *obj;
+
+    if (!ctx && fuzz_setup_context() != SC_SUCCESS)
+        return 0;
+
+    fuzz_reset_reader(Data, Size);
 
     reader = sc_ctx_get_reader(ctx, 0);
     sc_connect_card(reader, &card);
@@ -291,7 +313,6 @@ int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size)
     }
 
     sc_disconnect_card(card);
-    sc_release_context(ctx);
 
     return 0;
 }
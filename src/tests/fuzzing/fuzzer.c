@@ -0,0 +1,178 @@
+/*
+ * fuzzer.c: Stand-alone driver for the fuzzing harnesses
+ *
+ * Copyright (C) 2026 The OpenSC project
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Without libFuzzer, the harnesses are linked with this file. It runs the
+ * files and directories given on the command line through
+ * LLVMFuzzerTestOneInput(), e.g. to check the corpus for regressions or to
+ * measure the executions per second of a harness:
+ *
+ *   fuzz_pkcs15_reader [-n repeat] corpus/fuzz_pkcs15_reader
+ *
+ * Without arguments the corpus in $FUZZ_CORPUS_DIR/<harness> is used, or
+ * the test is skipped if there is none.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size);
+
+/* exit code for skipped tests in automake */
+#define SKIP	77
+
+struct run_stats {
+    unsigned long inputs;
+    unsigned long executions;
+    size_t bytes;
+};
+
+static int run_file(const char *path, unsigned long repeat, struct run_stats *stats)
+{
+    FILE *f;
+    uint8_t *data = NULL;
+    long size;
+    unsigned long i;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return -1;
+    }
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0
+            || fseek(f, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        fclose(f);
+        return -1;
+    }
+    /* a copy of exactly the input size, so that ASan catches overreads */
+    data = malloc(size ? size : 1);
+    if (!data || fread(data, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        free(data);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    for (i = 0; i < repeat; i++)
+        LLVMFuzzerTestOneInput(data, size);
+    free(data);
+
+    stats->inputs++;
+    stats->executions += repeat;
+    stats->bytes += (size_t)size * repeat;
+    return 0;
+}
+
+static int run_path(const char *path, unsigned long repeat, struct run_stats *stats)
+{
+    struct stat st;
+    DIR *dir;
+    struct dirent *entry;
+    int r = 0;
+
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "Cannot access %s\n", path);
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode))
+        return run_file(path, repeat, stats);
+
+    dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        char file[4096];
+
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(file, sizeof file, "%s/%s", path, entry->d_name);
+        if (run_path(file, repeat, stats) != 0)
+            r = -1;
+    }
+    closedir(dir);
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    struct run_stats stats = {0, 0, 0};
+    struct timespec start, end;
+    unsigned long repeat = 1;
+    char corpus[4096];
+    double seconds;
+    int i = 1, r = 0;
+
+    if (argc > 2 && !strcmp(argv[1], "-n")) {
+        repeat = strtoul(argv[2], NULL, 10);
+        if (repeat == 0)
+            repeat = 1;
+        i = 3;
+    }
+
+    if (i >= argc) {
+        const char *dir = getenv("FUZZ_CORPUS_DIR");
+        const char *name = strrchr(argv[0], '/');
+        struct stat st;
+
+        name = name ? name + 1 : argv[0];
+        /* libtool wrappers run the binary as lt-<name> */
+        if (!strncmp(name, "lt-", 3))
+            name += 3;
+        if (!dir)
+            return SKIP;
+        snprintf(corpus, sizeof corpus, "%s/%s", dir, name);
+        if (stat(corpus, &st) != 0)
+            return SKIP;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (i >= argc) {
+        r = run_path(corpus, repeat, &stats);
+    } else {
+        for (; i < argc; i++)
+            if (run_path(argv[i], repeat, &stats) != 0)
+                r = -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    seconds = (double)(end.tv_sec - start.tv_sec)
+        + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    /* some harnesses close stdout */
+    fprintf(stderr, "%lu inputs, %lu executions, %zu bytes in %.3f s",
+            stats.inputs, stats.executions, stats.bytes, seconds);
+    if (seconds > 0)
+        fprintf(stderr, " (%.0f exec/s)", (double)stats.executions / seconds);
+    fprintf(stderr, "\n");
+
+    return r == 0 ? 0 : 1;
+}
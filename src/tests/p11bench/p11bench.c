@@ -0,0 +1,591 @@
+/*
+ * p11bench.c: Benchmark of a PKCS#11 module under multi-threaded load
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <dlfcn.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/bn.h>
+#include <openssl/rsa.h>
+
+#include "pkcs11/pkcs11.h"
+#include "libopensc/sc-ossl-compat.h"
+
+#define DEFAULT_P11LIB	"../../pkcs11/.libs/opensc-pkcs11.so"
+#define MAX_SLOTS	32
+#define BENCH_DATA_LEN	32
+
+enum {
+	OP_SIGN = 0,
+	OP_DECRYPT,
+	OP_FIND,
+	OP_ATTR,
+	OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = { "sign", "decrypt", "find", "attr" };
+
+typedef struct {
+	CK_SLOT_ID id;
+	CK_SESSION_HANDLE session;	/* keeps the login state */
+	CK_OBJECT_HANDLE sign_key;
+	CK_MECHANISM_TYPE sign_mech;
+	CK_BBOOL sign_always_auth;
+	CK_OBJECT_HANDLE decrypt_key;
+	CK_BBOOL decrypt_always_auth;
+	unsigned char *ciphertext;
+	CK_ULONG ciphertext_len;
+	CK_OBJECT_HANDLE attr_object;
+} bench_slot_t;
+
+typedef struct {
+	pthread_t thread;
+	bench_slot_t *slot;
+	unsigned long ops[OP_COUNT];
+	unsigned long errors[OP_COUNT];
+	double *latency[OP_COUNT];	/* milliseconds */
+	size_t latency_count[OP_COUNT];
+} bench_thread_t;
+
+static CK_FUNCTION_LIST_PTR p11 = NULL;
+static CK_UTF8CHAR *pin = NULL;
+static size_t pin_length = 0;
+static unsigned long iterations = 100;
+static unsigned int weights[OP_COUNT] = { 1, 1, 1, 1 };
+
+static void display_usage(void)
+{
+	fprintf(stdout,
+		" Usage:\n"
+		"	./p11bench [-m module_path] [-s slot_id]... [-p pin] [-t threads]\n"
+		"	           [-n iterations] [-x mix]\n"
+		"		-m module_path	Path to tested module (e.g. /usr/lib64/opensc-pkcs11.so)\n"
+		"						Default is "DEFAULT_P11LIB"\n"
+		"		-p pin			User PIN, required for sign and decrypt\n"
+		"		-s slot_id		Slot to use, may be repeated (default all slots with a token)\n"
+		"		-t threads		Number of threads, spread over the slots (default 1)\n"
+		"		-n iterations	Operations per thread (default 100)\n"
+		"		-x mix			Operation weights, e.g. sign=4,decrypt=1,find=1,attr=4\n"
+		"		-h				This help\n"
+		"\n");
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int parse_mix(const char *mix)
+{
+	char *copy, *item, *saveptr = NULL;
+	int i;
+
+	copy = strdup(mix);
+	if (copy == NULL)
+		return 1;
+	for (i = 0; i < OP_COUNT; i++)
+		weights[i] = 0;
+
+	for (item = strtok_r(copy, ",", &saveptr); item != NULL;
+			item = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(item, '=');
+
+		if (value != NULL)
+			*value++ = '\0';
+		for (i = 0; i < OP_COUNT; i++) {
+			if (strcmp(item, op_names[i]) == 0)
+				break;
+		}
+		if (i == OP_COUNT) {
+			fprintf(stderr, "Unknown operation '%s' in the mix\n", item);
+			free(copy);
+			return 1;
+		}
+		weights[i] = value ? (unsigned int)atoi(value) : 1;
+	}
+	free(copy);
+	return 0;
+}
+
+static void *load_module(const char *path)
+{
+	CK_RV (*get_function_list)(CK_FUNCTION_LIST_PTR_PTR);
+	void *so;
+	CK_RV rv;
+
+	so = dlopen(path, RTLD_NOW);
+	if (!so) {
+		fprintf(stderr, "Error loading pkcs#11 so: %s\n", dlerror());
+		return NULL;
+	}
+	get_function_list = (CK_RV (*)(CK_FUNCTION_LIST_PTR_PTR)) dlsym(so, "C_GetFunctionList");
+	if (!get_function_list) {
+		fprintf(stderr, "Could not get function list: %s\n", dlerror());
+		dlclose(so);
+		return NULL;
+	}
+	rv = get_function_list(&p11);
+	if (rv != CKR_OK) {
+		fprintf(stderr, "C_GetFunctionList call failed: 0x%.8lX\n", rv);
+		dlclose(so);
+		return NULL;
+	}
+	return so;
+}
+
+static CK_OBJECT_HANDLE find_private_key(CK_SESSION_HANDLE session,
+		CK_ATTRIBUTE_TYPE usage)
+{
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_BBOOL true_value = CK_TRUE;
+	CK_ATTRIBUTE template[] = {
+		{ CKA_CLASS, &class, sizeof(class) },
+		{ usage, &true_value, sizeof(true_value) },
+	};
+	CK_OBJECT_HANDLE object = CK_INVALID_HANDLE;
+	CK_ULONG count = 0;
+
+	if (p11->C_FindObjectsInit(session, template, 2) != CKR_OK)
+		return CK_INVALID_HANDLE;
+	if (p11->C_FindObjects(session, &object, 1, &count) != CKR_OK || count == 0)
+		object = CK_INVALID_HANDLE;
+	p11->C_FindObjectsFinal(session);
+	return object;
+}
+
+static CK_BBOOL get_always_authenticate(CK_SESSION_HANDLE session,
+		CK_OBJECT_HANDLE key)
+{
+	CK_BBOOL value = CK_FALSE;
+	CK_ATTRIBUTE attr = { CKA_ALWAYS_AUTHENTICATE, &value, sizeof(value) };
+
+	if (p11->C_GetAttributeValue(session, key, &attr, 1) != CKR_OK)
+		return CK_FALSE;
+	return value;
+}
+
+/* Encrypt the test data on the host with the public part of the key */
+static int prepare_ciphertext(bench_slot_t *slot)
+{
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_MODULUS, NULL, 0 },
+		{ CKA_PUBLIC_EXPONENT, NULL, 0 },
+	};
+	unsigned char data[BENCH_DATA_LEN];
+	BIGNUM *n = NULL, *e = NULL;
+	RSA *rsa = NULL;
+	int r = 1, len;
+
+	if (p11->C_GetAttributeValue(slot->session, slot->decrypt_key, attrs, 2) != CKR_OK)
+		return 1;
+	attrs[0].pValue = malloc(attrs[0].ulValueLen);
+	attrs[1].pValue = malloc(attrs[1].ulValueLen);
+	if (attrs[0].pValue == NULL || attrs[1].pValue == NULL)
+		goto end;
+	if (p11->C_GetAttributeValue(slot->session, slot->decrypt_key, attrs, 2) != CKR_OK)
+		goto end;
+
+	n = BN_bin2bn(attrs[0].pValue, attrs[0].ulValueLen, NULL);
+	e = BN_bin2bn(attrs[1].pValue, attrs[1].ulValueLen, NULL);
+	rsa = RSA_new();
+	if (n == NULL || e == NULL || rsa == NULL || RSA_set0_key(rsa, n, e, NULL) != 1)
+		goto end;
+	n = e = NULL;
+
+	slot->ciphertext = malloc(RSA_size(rsa));
+	if (slot->ciphertext == NULL)
+		goto end;
+	memset(data, 0xA5, sizeof(data));
+	len = RSA_public_encrypt(sizeof(data), data, slot->ciphertext, rsa, RSA_PKCS1_PADDING);
+	if (len <= 0)
+		goto end;
+	slot->ciphertext_len = len;
+	r = 0;
+
+end:
+	if (r) {
+		free(slot->ciphertext);
+		slot->ciphertext = NULL;
+	}
+	BN_free(n);
+	BN_free(e);
+	RSA_free(rsa);
+	free(attrs[0].pValue);
+	free(attrs[1].pValue);
+	return r;
+}
+
+static int setup_slot(bench_slot_t *slot)
+{
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
+	CK_ULONG count = 0;
+	CK_RV rv;
+
+	rv = p11->C_OpenSession(slot->id, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+		NULL_PTR, NULL_PTR, &slot->session);
+	if (rv != CKR_OK) {
+		fprintf(stderr, "Slot %lu: C_OpenSession: 0x%.8lX\n", slot->id, rv);
+		return 1;
+	}
+
+	if (pin != NULL) {
+		rv = p11->C_Login(slot->session, CKU_USER, pin, pin_length);
+		if (rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN) {
+			fprintf(stderr, "Slot %lu: C_Login: 0x%.8lX\n", slot->id, rv);
+			return 1;
+		}
+	}
+
+	slot->sign_key = find_private_key(slot->session, CKA_SIGN);
+	if (slot->sign_key != CK_INVALID_HANDLE
+			&& p11->C_GetAttributeValue(slot->session, slot->sign_key, &attr, 1) == CKR_OK) {
+		slot->sign_mech = (key_type == CKK_EC) ? CKM_ECDSA : CKM_RSA_PKCS;
+		slot->sign_always_auth = get_always_authenticate(slot->session, slot->sign_key);
+	} else {
+		slot->sign_key = CK_INVALID_HANDLE;
+	}
+
+	slot->decrypt_key = find_private_key(slot->session, CKA_DECRYPT);
+	if (slot->decrypt_key != CK_INVALID_HANDLE
+			&& (p11->C_GetAttributeValue(slot->session, slot->decrypt_key, &attr, 1) != CKR_OK
+			|| key_type != CKK_RSA || prepare_ciphertext(slot) != 0))
+		slot->decrypt_key = CK_INVALID_HANDLE;
+	if (slot->decrypt_key != CK_INVALID_HANDLE)
+		slot->decrypt_always_auth = get_always_authenticate(slot->session, slot->decrypt_key);
+
+	slot->attr_object = slot->sign_key;
+	if (slot->attr_object == CK_INVALID_HANDLE
+			&& p11->C_FindObjectsInit(slot->session, NULL_PTR, 0) == CKR_OK) {
+		if (p11->C_FindObjects(slot->session, &slot->attr_object, 1, &count) != CKR_OK
+				|| count == 0)
+			slot->attr_object = CK_INVALID_HANDLE;
+		p11->C_FindObjectsFinal(slot->session);
+	}
+
+	printf("Slot %lu: sign %s, decrypt %s, attr %s\n", slot->id,
+		slot->sign_key != CK_INVALID_HANDLE ? "yes" : "no",
+		slot->decrypt_key != CK_INVALID_HANDLE ? "yes" : "no",
+		slot->attr_object != CK_INVALID_HANDLE ? "yes" : "no");
+	return 0;
+}
+
+static CK_RV context_login(CK_SESSION_HANDLE session, CK_BBOOL always_auth)
+{
+	if (!always_auth || pin == NULL)
+		return CKR_OK;
+	return p11->C_Login(session, CKU_CONTEXT_SPECIFIC, pin, pin_length);
+}
+
+static CK_RV run_op(bench_slot_t *slot, CK_SESSION_HANDLE session, int op)
+{
+	unsigned char data[BENCH_DATA_LEN];
+	unsigned char out[1024];
+	CK_ULONG out_len = sizeof(out);
+	CK_MECHANISM mech = { 0, NULL_PTR, 0 };
+	CK_OBJECT_HANDLE objects[16];
+	CK_ULONG count;
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_LABEL, out, 256 },
+		{ CKA_ID, out + 256, 256 },
+	};
+	CK_RV rv;
+
+	switch (op) {
+	case OP_SIGN:
+		memset(data, 0x5A, sizeof(data));
+		mech.mechanism = slot->sign_mech;
+		rv = p11->C_SignInit(session, &mech, slot->sign_key);
+		if (rv == CKR_OK)
+			rv = context_login(session, slot->sign_always_auth);
+		if (rv == CKR_OK)
+			rv = p11->C_Sign(session, data, sizeof(data), out, &out_len);
+		return rv;
+	case OP_DECRYPT:
+		mech.mechanism = CKM_RSA_PKCS;
+		rv = p11->C_DecryptInit(session, &mech, slot->decrypt_key);
+		if (rv == CKR_OK)
+			rv = context_login(session, slot->decrypt_always_auth);
+		if (rv == CKR_OK)
+			rv = p11->C_Decrypt(session, slot->ciphertext, slot->ciphertext_len,
+				out, &out_len);
+		return rv;
+	case OP_FIND:
+		rv = p11->C_FindObjectsInit(session, NULL_PTR, 0);
+		if (rv != CKR_OK)
+			return rv;
+		do {
+			rv = p11->C_FindObjects(session, objects, 16, &count);
+		} while (rv == CKR_OK && count == 16);
+		p11->C_FindObjectsFinal(session);
+		return rv;
+	case OP_ATTR:
+		rv = p11->C_GetAttributeValue(session, slot->attr_object, attrs, 2);
+		if (rv == CKR_ATTRIBUTE_TYPE_INVALID)
+			rv = CKR_OK;
+		return rv;
+	}
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+static int op_available(bench_slot_t *slot, int op)
+{
+	switch (op) {
+	case OP_SIGN:
+		return slot->sign_key != CK_INVALID_HANDLE;
+	case OP_DECRYPT:
+		return slot->decrypt_key != CK_INVALID_HANDLE;
+	case OP_ATTR:
+		return slot->attr_object != CK_INVALID_HANDLE;
+	}
+	return 1;
+}
+
+static void *bench_thread(void *arg)
+{
+	bench_thread_t *t = arg;
+	CK_SESSION_HANDLE session;
+	int schedule[OP_COUNT * 100];
+	size_t schedule_len = 0, i;
+	unsigned int w;
+	int op;
+	double start;
+	CK_RV rv;
+
+	for (op = 0; op < OP_COUNT; op++) {
+		if (!op_available(t->slot, op))
+			continue;
+		for (w = 0; w < weights[op] && schedule_len < sizeof(schedule)/sizeof(*schedule); w++)
+			schedule[schedule_len++] = op;
+	}
+	if (schedule_len == 0)
+		return NULL;
+
+	for (op = 0; op < OP_COUNT; op++) {
+		t->latency[op] = calloc(iterations, sizeof(double));
+		if (t->latency[op] == NULL)
+			return NULL;
+	}
+
+	rv = p11->C_OpenSession(t->slot->id, CKF_SERIAL_SESSION, NULL_PTR, NULL_PTR, &session);
+	if (rv != CKR_OK) {
+		fprintf(stderr, "Slot %lu: C_OpenSession: 0x%.8lX\n", t->slot->id, rv);
+		return NULL;
+	}
+
+	for (i = 0; i < iterations; i++) {
+		op = schedule[i % schedule_len];
+		start = now_ms();
+		rv = run_op(t->slot, session, op);
+		t->latency[op][t->latency_count[op]++] = now_ms() - start;
+		t->ops[op]++;
+		if (rv != CKR_OK)
+			t->errors[op]++;
+	}
+
+	p11->C_CloseSession(session);
+	return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, size_t count, unsigned int pct)
+{
+	size_t index;
+
+	if (count == 0)
+		return 0;
+	index = (count * pct + 99) / 100;
+	return sorted[index > 0 ? index - 1 : 0];
+}
+
+static void report(bench_thread_t *threads, unsigned int nthreads, double elapsed)
+{
+	unsigned long total = 0;
+	unsigned int i;
+	int op;
+
+	printf("\n%-8s %10s %8s %12s %10s %10s\n",
+		"op", "count", "errors", "ops/s", "p50 ms", "p99 ms");
+	for (op = 0; op < OP_COUNT; op++) {
+		unsigned long ops = 0, errors = 0;
+		size_t count = 0;
+		double *all;
+
+		for (i = 0; i < nthreads; i++) {
+			ops += threads[i].ops[op];
+			errors += threads[i].errors[op];
+		}
+		if (ops == 0)
+			continue;
+		total += ops;
+
+		all = calloc(ops, sizeof(double));
+		if (all == NULL)
+			continue;
+		for (i = 0; i < nthreads; i++) {
+			memcpy(all + count, threads[i].latency[op],
+				threads[i].latency_count[op] * sizeof(double));
+			count += threads[i].latency_count[op];
+		}
+		qsort(all, count, sizeof(double), compare_double);
+		printf("%-8s %10lu %8lu %12.1f %10.2f %10.2f\n", op_names[op],
+			ops, errors, ops * 1000.0 / elapsed,
+			percentile(all, count, 50), percentile(all, count, 99));
+		free(all);
+	}
+	printf("%-8s %10lu %8s %12.1f\n", "total", total, "",
+		total * 1000.0 / elapsed);
+	printf("%u threads, %.1f ms wall time\n", nthreads, elapsed);
+}
+
+int main(int argc, char **argv)
+{
+	CK_C_INITIALIZE_ARGS init_args;
+	bench_slot_t slots[MAX_SLOTS];
+	bench_thread_t *threads = NULL;
+	CK_SLOT_ID slot_list[MAX_SLOTS];
+	CK_ULONG slot_count = 0;
+	unsigned int nthreads = 1, nslots = 0, i;
+	char *library_path = NULL;
+	void *so;
+	double start, elapsed;
+	int command, op, r = 1;
+	CK_RV rv;
+
+	memset(slots, 0, sizeof(slots));
+	while ((command = getopt(argc, argv, "?hm:s:p:t:n:x:")) != -1) {
+		switch (command) {
+			case 'm':
+				library_path = optarg;
+				break;
+			case 's':
+				if (nslots < MAX_SLOTS)
+					slots[nslots++].id = strtoul(optarg, NULL, 0);
+				break;
+			case 'p':
+				pin = (CK_UTF8CHAR *) optarg;
+				pin_length = strlen(optarg);
+				break;
+			case 't':
+				nthreads = atoi(optarg);
+				break;
+			case 'n':
+				iterations = strtoul(optarg, NULL, 0);
+				break;
+			case 'x':
+				if (parse_mix(optarg))
+					return 1;
+				break;
+			case 'h':
+			case '?':
+				display_usage();
+				return 0;
+			default:
+				break;
+		}
+	}
+	if (nthreads == 0 || iterations == 0) {
+		display_usage();
+		return 1;
+	}
+	if (library_path == NULL)
+		library_path = DEFAULT_P11LIB;
+
+	so = load_module(library_path);
+	if (so == NULL)
+		return 1;
+
+	memset(&init_args, 0, sizeof(init_args));
+	init_args.flags = CKF_OS_LOCKING_OK;
+	rv = p11->C_Initialize(&init_args);
+	if (rv != CKR_OK) {
+		fprintf(stderr, "C_Initialize: Error = 0x%.8lX\n", rv);
+		dlclose(so);
+		return 1;
+	}
+
+	if (nslots == 0) {
+		slot_count = MAX_SLOTS;
+		rv = p11->C_GetSlotList(CK_TRUE, slot_list, &slot_count);
+		if (rv != CKR_OK) {
+			fprintf(stderr, "C_GetSlotList: Error = 0x%.8lX\n", rv);
+			goto end;
+		}
+		for (i = 0; i < slot_count; i++)
+			slots[nslots++].id = slot_list[i];
+	}
+	if (nslots == 0) {
+		fprintf(stderr, "No slot with a token found\n");
+		goto end;
+	}
+	for (i = 0; i < nslots; i++) {
+		if (setup_slot(&slots[i]))
+			goto end;
+	}
+
+	threads = calloc(nthreads, sizeof(bench_thread_t));
+	if (threads == NULL)
+		goto end;
+
+	start = now_ms();
+	for (i = 0; i < nthreads; i++) {
+		threads[i].slot = &slots[i % nslots];
+		if (pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]) != 0) {
+			fprintf(stderr, "Failed to start thread %u\n", i);
+			nthreads = i;
+			break;
+		}
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed = now_ms() - start;
+
+	report(threads, nthreads, elapsed);
+	r = 0;
+
+end:
+	if (threads) {
+		for (i = 0; i < nthreads; i++) {
+			for (op = 0; op < OP_COUNT; op++)
+				free(threads[i].latency[op]);
+		}
+		free(threads);
+	}
+	for (i = 0; i < nslots; i++) {
+		if (slots[i].session)
+			p11->C_CloseSession(slots[i].session);
+		free(slots[i].ciphertext);
+	}
+	p11->C_Finalize(NULL_PTR);
+	dlclose(so);
+	return r;
+}
@@ -31,6 +31,7 @@
 #include "p11test_case_mechs.h"
 #include "p11test_case_wait.h"
 #include "p11test_case_pss_oaep.h"
+#include "p11test_case_perf.h"
 
 #define DEFAULT_P11LIB	"../../pkcs11/.libs/opensc-pkcs11.so"
 
@@ -85,6 +86,10 @@ int main(int argc, char** argv) {
 		/* Verify that ECDH key derivation works */
 		cmocka_unit_test_setup_teardown(derive_tests,
 			user_login_setup, after_test_cleanup),
+
+		/* Measure the latency of initialization, login and signatures */
+		cmocka_unit_test_setup_teardown(perf_test,
+			NULL, after_test_cleanup),
 	};
 
 	token.library_path = NULL;
@@ -0,0 +1,163 @@
+/*
+ * p11test_case_perf.c: Measure the latency of common operations
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "p11test_case_perf.h"
+#include "p11test_case_readonly.h"
+#include "p11test_loader.h"
+#include "p11test_helpers.h"
+
+#include <time.h>
+#include <sys/time.h>
+
+#define PERF_MESSAGE	"Simple message for measuring the signature latency.\n"
+#define PERF_DIGEST_INFO	"\x30\x21\x30\x09\x06\x05\x2b\x0e" \
+				"\x03\x02\x1a\x05\x00\x04\x14\xd9" \
+				"\xdd\xa3\x76\x44\x2f\x50\xe1\xec" \
+				"\xd3\x8b\xcd\x6f\xc6\xce\x4e\xfd" \
+				"\xd3\x1a\x3f"
+
+static unsigned long long
+perf_now_us(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static void
+perf_record(token_info_t *info, const char *operation, const char *key,
+	const char *mechanism, unsigned long long start)
+{
+	int us = (int) (perf_now_us() - start);
+
+	debug_print(" [ PERF ] %-14s %-24s %-20s %8d us", operation,
+		key, mechanism, us);
+	P11TEST_DATA_ROW(info, 4,
+		's', operation,
+		's', key,
+		's', mechanism,
+		'd', us);
+}
+
+/*
+ * Sign once with every key and mechanism the token advertises for signing.
+ * Only the C_SignInit .. C_Sign sequence is measured; raw RSA and RSA-PSS
+ * need mechanism specific input and are left to the functional tests.
+ */
+static int
+perf_sign(token_info_t *info, test_certs_t *objects)
+{
+	unsigned int i;
+	int j, rv, errors = 0;
+	unsigned long long start;
+
+	for (i = 0; i < objects->count; i++) {
+		test_cert_t *o = &objects->data[i];
+
+		if (o->private_handle == CK_INVALID_HANDLE || !o->sign)
+			continue;
+
+		for (j = 0; j < o->num_mechs; j++) {
+			test_mech_t *mech = &o->mechs[j];
+			CK_BYTE *message = (CK_BYTE *) PERF_MESSAGE;
+			CK_ULONG message_length = strlen(PERF_MESSAGE);
+			unsigned char *sign = NULL;
+
+			if ((mech->usage_flags & CKF_SIGN) == 0
+					|| mech->mech == CKM_RSA_X_509
+					|| is_pss_mechanism(mech->mech))
+				continue;
+
+			if (mech->mech == CKM_RSA_PKCS) {
+				/* DigestInfo + SHA1(message) */
+				message = (CK_BYTE *) PERF_DIGEST_INFO;
+				message_length = 35;
+			}
+
+			start = perf_now_us();
+			rv = sign_message(o, info, message, message_length,
+				mech, &sign, 0);
+			if (rv < 0) {
+				errors++;
+				continue;
+			} else if (rv == 0) {
+				continue;
+			}
+			free(sign);
+			perf_record(info, "C_Sign", o->id_str,
+				get_mechanism_name(mech->mech), start);
+		}
+	}
+	return errors;
+}
+
+void perf_test(void **state) {
+	token_info_t *info = (token_info_t *) *state;
+	CK_FUNCTION_LIST_PTR fp = info->function_pointer;
+	unsigned long long start;
+	CK_ULONG slot_count = 0;
+	test_certs_t objects;
+	int errors;
+	CK_RV rv;
+
+	P11TEST_START(info);
+	debug_print("\nMeasure the latency of initialization, login and signatures");
+
+	start = perf_now_us();
+	rv = fp->C_Initialize(NULL_PTR);
+	if (rv != CKR_OK) {
+		fail_msg("Could not initialize CRYPTOKI!\n");
+		exit(1);
+	}
+	perf_record(info, "C_Initialize", "", "", start);
+
+	start = perf_now_us();
+	rv = fp->C_GetSlotList(CK_TRUE, NULL_PTR, &slot_count);
+	if (rv != CKR_OK) {
+		P11TEST_FAIL(info, "C_GetSlotList: rv = 0x%.8lX", rv);
+	}
+	perf_record(info, "C_GetSlotList", "", "", start);
+
+	if (get_slot_with_card(info) || open_session(info)) {
+		P11TEST_FAIL(info, "Could not open session to token");
+	}
+
+	start = perf_now_us();
+	rv = fp->C_Login(info->session_handle, CKU_USER,
+		info->pin, info->pin_length);
+	if (rv != CKR_OK) {
+		P11TEST_FAIL(info, "C_Login: rv = 0x%.8lX", rv);
+	}
+	perf_record(info, "C_Login", "", "", start);
+
+	objects.count = 0;
+	objects.data = NULL;
+	search_for_all_objects(&objects, info);
+	errors = perf_sign(info, &objects);
+	clean_all_objects(&objects);
+
+	if (errors > 0)
+		P11TEST_FAIL(info, "Some signatures failed. Please review the log");
+	P11TEST_PASS(info);
+}
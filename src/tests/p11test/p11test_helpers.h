@@ -34,4 +34,6 @@ int token_setup(void **state);
 int token_cleanup(void **state);
 
 int token_initialize(void **state);
+
+int open_session(token_info_t *info);
 #endif //P11TEST_HELPERS_H
@@ -21,6 +21,8 @@
 
 #include "torture.h"
 #include "libopensc/log.c"
+/* asn1.c logs as its own subsystem */
+#undef SC_LOG_SUBSYSTEM
 #include "libopensc/asn1.c"
 
 /* The last argument is an OID value */
@@ -558,6 +560,121 @@ static void torture_asn1_put_tag_without_data(void **state)
 	assert_ptr_equal(p, out + sizeof(expected));
 }
 
+static void torture_asn1_encode_nested(void **state)
+{
+	sc_context_t *ctx = *state;
+	u8 octets[200];
+	size_t octets_len = sizeof(octets);
+	int version = 1;
+	struct sc_asn1_entry asn1_inner[4] = {
+		{ "octets",	SC_ASN1_OCTET_STRING, SC_ASN1_TAG_OCTET_STRING, 0, NULL, NULL },
+		{ "null",	SC_ASN1_NULL, SC_ASN1_TAG_NULL, 0, NULL, NULL },
+		{ "missing",	SC_ASN1_INTEGER, SC_ASN1_CTX | 0, SC_ASN1_OPTIONAL, NULL, NULL },
+		{ NULL, 0, 0, 0, NULL, NULL }
+	};
+	struct sc_asn1_entry asn1_outer[3] = {
+		{ "version",	SC_ASN1_INTEGER, SC_ASN1_TAG_INTEGER, 0, NULL, NULL },
+		{ "inner",	SC_ASN1_STRUCT, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, NULL, NULL },
+		{ NULL, 0, 0, 0, NULL, NULL }
+	};
+	struct sc_asn1_entry asn1_top[2] = {
+		{ "outer",	SC_ASN1_STRUCT, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, NULL, NULL },
+		{ NULL, 0, 0, 0, NULL, NULL }
+	};
+	const u8 header[] = {
+		0x30, 0x81, 0xD3,		/* SEQUENCE */
+		0x02, 0x01, 0x01,		/* INTEGER 1 */
+		0x30, 0x81, 0xCD,		/* SEQUENCE */
+		0x04, 0x81, 0xC8		/* OCTET STRING */
+	};
+	u8 *buf = NULL;
+	size_t buflen = 0;
+	int rv;
+
+	memset(octets, 0xA5, sizeof(octets));
+	sc_format_asn1_entry(asn1_inner + 0, octets, &octets_len, 1);
+	sc_format_asn1_entry(asn1_inner + 1, NULL, NULL, 1);
+	sc_format_asn1_entry(asn1_outer + 0, &version, NULL, 1);
+	sc_format_asn1_entry(asn1_outer + 1, asn1_inner, NULL, 1);
+	sc_format_asn1_entry(asn1_top + 0, asn1_outer, NULL, 1);
+
+	rv = sc_asn1_encode(ctx, asn1_top, &buf, &buflen);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(buflen, sizeof(header) + sizeof(octets) + 2);
+	assert_memory_equal(buf, header, sizeof(header));
+	assert_memory_equal(buf + sizeof(header), octets, sizeof(octets));
+	assert_int_equal(buf[buflen - 2], 0x05);
+	assert_int_equal(buf[buflen - 1], 0x00);
+	free(buf);
+}
+
+static void torture_asn1_encode_missing(void **state)
+{
+	sc_context_t *ctx = *state;
+	int version = 1;
+	struct sc_asn1_entry asn1_struct[3] = {
+		{ "version",	SC_ASN1_INTEGER, SC_ASN1_TAG_INTEGER, 0, NULL, NULL },
+		{ "required",	SC_ASN1_INTEGER, SC_ASN1_CTX | 0, 0, NULL, NULL },
+		{ NULL, 0, 0, 0, NULL, NULL }
+	};
+	u8 *buf = NULL;
+	size_t buflen = 0;
+	int rv;
+
+	sc_format_asn1_entry(asn1_struct + 0, &version, NULL, 1);
+	rv = sc_asn1_encode(ctx, asn1_struct, &buf, &buflen);
+	assert_int_equal(rv, SC_ERROR_INVALID_ASN1_OBJECT);
+	assert_null(buf);
+}
+
+/* Encodes a deeply nested structure, which used to be copied once for
+ * every level of nesting */
+#define NESTING 64
+static void torture_asn1_encode_deep(void **state)
+{
+	sc_context_t *ctx = *state;
+	struct sc_asn1_entry asn1_levels[NESTING][2];
+	u8 octets[16] = {0};
+	size_t octets_len = sizeof(octets);
+	u8 *buf = NULL, *p;
+	size_t buflen = 0, ii;
+	int rv;
+
+	for (ii = 0; ii < NESTING; ii++) {
+		memset(asn1_levels[ii], 0, sizeof(asn1_levels[ii]));
+		asn1_levels[ii][0].name = "level";
+		asn1_levels[ii][0].type = SC_ASN1_STRUCT;
+		asn1_levels[ii][0].tag = SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS;
+		if (ii + 1 < NESTING)
+			sc_format_asn1_entry(asn1_levels[ii], asn1_levels[ii + 1], NULL, 1);
+	}
+	asn1_levels[NESTING - 1][0].type = SC_ASN1_OCTET_STRING;
+	asn1_levels[NESTING - 1][0].tag = SC_ASN1_TAG_OCTET_STRING;
+	sc_format_asn1_entry(asn1_levels[NESTING - 1], octets, &octets_len, 1);
+
+	rv = sc_asn1_encode(ctx, asn1_levels[0], &buf, &buflen);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_non_null(buf);
+
+	for (p = buf, ii = 0; ii < NESTING - 1; ii++) {
+		size_t left = buflen - (p - buf);
+
+		assert_int_equal(p[0], 0x30);
+		if (left - 2 > 127) {
+			assert_int_equal(p[1], 0x81);
+			assert_int_equal(p[2], left - 3);
+			p += 3;
+		} else {
+			assert_int_equal(p[1], left - 2);
+			p += 2;
+		}
+	}
+	assert_int_equal(p[0], 0x04);
+	assert_int_equal(p[1], sizeof(octets));
+	assert_int_equal(buflen - (p - buf), sizeof(octets) + 2);
+	free(buf);
+}
+
 int main(void)
 {
 	int rc;
@@ -625,6 +742,13 @@ int main(void)
 		cmocka_unit_test(torture_asn1_put_tag_without_data),
 		cmocka_unit_test(torture_asn1_put_tag_long_tag),
 		cmocka_unit_test(torture_asn1_put_tag_long_data),
+		/* encode() */
+		cmocka_unit_test_setup_teardown(torture_asn1_encode_nested,
+			setup_sc_context, teardown_sc_context),
+		cmocka_unit_test_setup_teardown(torture_asn1_encode_missing,
+			setup_sc_context, teardown_sc_context),
+		cmocka_unit_test_setup_teardown(torture_asn1_encode_deep,
+			setup_sc_context, teardown_sc_context),
 	};
 
 	rc = cmocka_run_group_tests(tests, NULL, NULL);
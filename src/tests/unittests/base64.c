@@ -0,0 +1,178 @@
+/*
+ * base64.c: Unit tests for the base64 and hex codecs
+ *
+ * Copyright (C) 2026 The OpenSC project
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "libopensc/sc.c"
+#include "libopensc/base64.c"
+
+#define TORTURE_BASE64(name, bin, b64, linelength) \
+	static void torture_base64_## name (void **state) \
+	{ \
+		u8 data[] = bin; \
+		size_t datalen = sizeof(data) - 1; \
+		u8 out[256]; \
+		int rv; \
+	\
+		rv = sc_base64_encode(data, datalen, out, sizeof(out), linelength); \
+		assert_int_equal(rv, SC_SUCCESS); \
+		assert_string_equal((char *)out, b64); \
+		rv = sc_base64_decode(b64, out, sizeof(out)); \
+		assert_int_equal(rv, datalen); \
+		assert_memory_equal(out, data, datalen); \
+	}
+
+TORTURE_BASE64(empty, "", "", 0)
+TORTURE_BASE64(one, "f", "Zg==", 0)
+TORTURE_BASE64(two, "fo", "Zm8=", 0)
+TORTURE_BASE64(three, "foo", "Zm9v", 0)
+TORTURE_BASE64(long, "foobar-foobar", "Zm9vYmFyLWZvb2Jhcg==", 0)
+TORTURE_BASE64(binary, "\x00\xff\xfe\x80\x7f\x01", "AP/+gH8B", 0)
+TORTURE_BASE64(lines, "foobar-foobar", "Zm9vYmFy\nLWZvb2Jh\ncg==\n", 8)
+
+static void torture_base64_decode_whitespace(void **state)
+{
+	u8 out[32];
+	int rv;
+
+	rv = sc_base64_decode("Zm9v\r\nYmFy\nLWZv\nb2Jh\ncg==\n", out, sizeof(out));
+	assert_int_equal(rv, 13);
+	assert_memory_equal(out, "foobar-foobar", 13);
+}
+
+static void torture_base64_decode_invalid(void **state)
+{
+	u8 out[32];
+	int rv;
+
+	rv = sc_base64_decode("Zm9v*mFy", out, sizeof(out));
+	assert_int_equal(rv, SC_ERROR_INVALID_ARGUMENTS);
+	rv = sc_base64_decode("Zm9v\xc3\xa4mFy", out, sizeof(out));
+	assert_int_equal(rv, SC_ERROR_INVALID_ARGUMENTS);
+}
+
+static void torture_base64_decode_too_small(void **state)
+{
+	u8 out[4];
+	int rv;
+
+	rv = sc_base64_decode("Zm9vYmFy", out, sizeof(out));
+	assert_int_equal(rv, SC_ERROR_BUFFER_TOO_SMALL);
+	rv = sc_base64_decode("Zm9vYg==", out, sizeof(out));
+	assert_int_equal(rv, 4);
+}
+
+static void torture_base64_encode_too_small(void **state)
+{
+	u8 out[4];
+	int rv;
+
+	rv = sc_base64_encode((const u8 *)"foo", 3, out, sizeof(out), 0);
+	assert_int_equal(rv, SC_ERROR_BUFFER_TOO_SMALL);
+}
+
+static void torture_base64_roundtrip(void **state)
+{
+	u8 data[1000], out[1000], b64[1500];
+	size_t i;
+	int rv;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = (u8)(i * 7 + 3);
+	rv = sc_base64_encode(data, sizeof(data), b64, sizeof(b64), 64);
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_base64_decode((const char *)b64, out, sizeof(out));
+	assert_int_equal(rv, sizeof(data));
+	assert_memory_equal(out, data, sizeof(data));
+}
+
+#define TORTURE_HEX(name, hex, bin, error) \
+	static void torture_hex_to_bin_## name (void **state) \
+	{ \
+		u8 ref[] = bin; \
+		size_t reflen = sizeof(ref) - 1; \
+		u8 out[16]; \
+		size_t outlen = sizeof(out); \
+		int rv; \
+	\
+		rv = sc_hex_to_bin(hex, out, &outlen); \
+		assert_int_equal(rv, error); \
+		if (rv == SC_SUCCESS) { \
+			assert_int_equal(outlen, reflen); \
+			assert_memory_equal(out, ref, reflen); \
+		} \
+	}
+
+TORTURE_HEX(empty, "", "", SC_SUCCESS)
+TORTURE_HEX(lower, "3f00a1b2", "\x3f\x00\xa1\xb2", SC_SUCCESS)
+TORTURE_HEX(upper, "3F00A1B2", "\x3f\x00\xa1\xb2", SC_SUCCESS)
+TORTURE_HEX(separators, " 3F:00 A1:b2 ", "\x3f\x00\xa1\xb2", SC_SUCCESS)
+TORTURE_HEX(single_nibble, "f", "\x0f", SC_SUCCESS)
+TORTURE_HEX(odd, "3f0", "", SC_ERROR_INVALID_ARGUMENTS)
+TORTURE_HEX(invalid, "3g", "", SC_ERROR_INVALID_ARGUMENTS)
+TORTURE_HEX(too_long, "00112233445566778899aabbccddeeff00", "", SC_ERROR_BUFFER_TOO_SMALL)
+
+static void torture_bin_to_hex(void **state)
+{
+	u8 data[] = { 0x3f, 0x00, 0xa1, 0xb2 };
+	char out[16];
+	int rv;
+
+	rv = sc_bin_to_hex(data, sizeof(data), out, sizeof(out), 0);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_string_equal(out, "3f00a1b2");
+	rv = sc_bin_to_hex(data, sizeof(data), out, sizeof(out), ':');
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_string_equal(out, "3f:00:a1:b2");
+	rv = sc_bin_to_hex(data, sizeof(data), out, 8, 0);
+	assert_int_equal(rv, SC_ERROR_BUFFER_TOO_SMALL);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		/* sc_base64_encode() and sc_base64_decode() */
+		cmocka_unit_test(torture_base64_empty),
+		cmocka_unit_test(torture_base64_one),
+		cmocka_unit_test(torture_base64_two),
+		cmocka_unit_test(torture_base64_three),
+		cmocka_unit_test(torture_base64_long),
+		cmocka_unit_test(torture_base64_binary),
+		cmocka_unit_test(torture_base64_lines),
+		cmocka_unit_test(torture_base64_decode_whitespace),
+		cmocka_unit_test(torture_base64_decode_invalid),
+		cmocka_unit_test(torture_base64_decode_too_small),
+		cmocka_unit_test(torture_base64_encode_too_small),
+		cmocka_unit_test(torture_base64_roundtrip),
+		/* sc_hex_to_bin() */
+		cmocka_unit_test(torture_hex_to_bin_empty),
+		cmocka_unit_test(torture_hex_to_bin_lower),
+		cmocka_unit_test(torture_hex_to_bin_upper),
+		cmocka_unit_test(torture_hex_to_bin_separators),
+		cmocka_unit_test(torture_hex_to_bin_single_nibble),
+		cmocka_unit_test(torture_hex_to_bin_odd),
+		cmocka_unit_test(torture_hex_to_bin_invalid),
+		cmocka_unit_test(torture_hex_to_bin_too_long),
+		/* sc_bin_to_hex() */
+		cmocka_unit_test(torture_bin_to_hex),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
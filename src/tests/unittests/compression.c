@@ -321,7 +321,30 @@ static void torture_compression_decompress_zlib_good(void **state)
 	assert_int_equal(rv, SC_SUCCESS);
 }
 
+static void torture_compression_size_hint(void **state)
+{
+	/* gzip trailer is honoured */
+	assert_int_equal(sc_decompress_size_hint(valid_data, sizeof(valid_data), COMPRESSION_AUTO), 5);
+	assert_int_equal(sc_decompress_size_hint(valid_data, sizeof(valid_data), COMPRESSION_GZIP), 5);
+	/* implausible trailer is ignored */
+	assert_int_equal(sc_decompress_size_hint(invalid_suffix_data, sizeof(invalid_suffix_data), COMPRESSION_AUTO), 0);
+	/* zlib has no length */
+	assert_int_equal(sc_decompress_size_hint(valid_zlib_data, sizeof(valid_zlib_data), COMPRESSION_AUTO), 0);
+	assert_int_equal(sc_decompress_size_hint(NULL, 0, COMPRESSION_AUTO), 0);
+}
 
+static void torture_compression_decompress_alloc_truncated(void **state)
+{
+	u8 *buf = NULL;
+	size_t buflen = 0;
+	int rv;
+
+	/* drop the trailer so the stream never ends */
+	rv = sc_decompress_alloc(&buf, &buflen, valid_data, sizeof(valid_data) - 8, COMPRESSION_AUTO);
+	assert_int_equal(rv, SC_ERROR_UNKNOWN_DATA_RECEIVED);
+	assert_int_equal(buflen, 0);
+	assert_null(buf);
+}
 
 int main(void)
 {
@@ -336,6 +359,7 @@ int main(void)
 		cmocka_unit_test(torture_compression_decompress_alloc_invalid),
 		cmocka_unit_test(torture_compression_decompress_alloc_invalid_suffix),
 		cmocka_unit_test(torture_compression_decompress_alloc_valid),
+		cmocka_unit_test(torture_compression_decompress_alloc_truncated),
 		/* Decompress */
 		cmocka_unit_test(torture_compression_decompress_empty),
 		cmocka_unit_test(torture_compression_decompress_gzip_empty),
@@ -346,6 +370,8 @@ int main(void)
 		cmocka_unit_test(torture_compression_decompress_invalid_suffix),
 		cmocka_unit_test(torture_compression_decompress_valid),
 		cmocka_unit_test(torture_compression_decompress_zlib_good),
+		/* Size hint */
+		cmocka_unit_test(torture_compression_size_hint),
 	};
 
 	rc = cmocka_run_group_tests(tests, NULL, NULL);
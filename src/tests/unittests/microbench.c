@@ -0,0 +1,593 @@
+/*
+ * microbench.c: Microbenchmarks of hot-path library code
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libopensc/opensc.h"
+#include "libopensc/internal.h"
+#include "libopensc/pkcs15.h"
+#include "libopensc/compression.h"
+
+#define DEFAULT_ENTRIES		8
+#define DEFAULT_TIME_MS		500
+
+/*
+ * Allocation counting. Defining malloc() and friends in the executable
+ * interposes them for libopensc as well; the real allocator is reached
+ * through the glibc internal entry points. Elsewhere, allocations are
+ * reported as unknown.
+ */
+#ifdef __GLIBC__
+#define COUNT_ALLOCATIONS
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long long allocations = 0;
+
+void *malloc(size_t size)
+{
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+struct bench_data {
+	u8 *prkdf;
+	size_t prkdf_len;
+	u8 *cdf;
+	size_t cdf_len;
+	u8 *cert;		/* plain certificate (or any DER blob) */
+	size_t cert_len;
+	u8 *cert_z;		/* the same, gzip compressed */
+	size_t cert_z_len;
+	char *b64;		/* base64 of cert */
+	char *hex;		/* hex of cert */
+	u8 *buf;		/* scratch output */
+	size_t buf_len;
+	u8 rsa_block[256];	/* PKCS#1 BT02 block of a 2048 bit key */
+};
+
+struct bench {
+	const char *name;
+	const char *input;
+	int (*run)(struct bench_data *d);
+};
+
+static sc_context_t *ctx = NULL;
+static sc_pkcs15_card_t *p15card = NULL;
+static sc_card_t card;
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+decode_df(int (*decode)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
+		const u8 **, size_t *), const u8 *buf, size_t len)
+{
+	struct sc_pkcs15_object *obj;
+	int r, count = 0;
+
+	while (len > 0 && *buf != 0 && *buf != 0xFF) {
+		obj = calloc(1, sizeof *obj);
+		if (obj == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		r = decode(p15card, obj, &buf, &len);
+		sc_pkcs15_free_object(obj);
+		if (r == SC_ERROR_ASN1_END_OF_CONTENTS)
+			break;
+		if (r < 0)
+			return r;
+		count++;
+	}
+	return count;
+}
+
+static int
+bench_asn1_prkdf(struct bench_data *d)
+{
+	return decode_df(sc_pkcs15_decode_prkdf_entry, d->prkdf, d->prkdf_len);
+}
+
+static int
+bench_asn1_cdf(struct bench_data *d)
+{
+	return decode_df(sc_pkcs15_decode_cdf_entry, d->cdf, d->cdf_len);
+}
+
+static int
+bench_base64_encode(struct bench_data *d)
+{
+	return sc_base64_encode(d->cert, d->cert_len, d->buf, d->buf_len, 64);
+}
+
+static int
+bench_base64_decode(struct bench_data *d)
+{
+	return sc_base64_decode(d->b64, d->buf, d->buf_len);
+}
+
+static int
+bench_hex_encode(struct bench_data *d)
+{
+	return sc_bin_to_hex(d->cert, d->cert_len, (char *)d->buf, d->buf_len, 0);
+}
+
+static int
+bench_hex_decode(struct bench_data *d)
+{
+	size_t len = d->buf_len;
+
+	return sc_hex_to_bin(d->hex, d->buf, &len);
+}
+
+#ifdef ENABLE_ZLIB
+static int
+bench_decompress(struct bench_data *d)
+{
+	u8 *out = NULL;
+	size_t out_len = 0;
+	int r;
+
+	r = sc_decompress_alloc(&out, &out_len, d->cert_z, d->cert_z_len,
+		COMPRESSION_AUTO);
+	free(out);
+	return r;
+}
+#endif
+
+static int
+bench_pkcs1_v15(struct bench_data *d)
+{
+	size_t len = d->buf_len;
+
+	/* the first 32 bytes of the certificate stand in for a SHA-256 digest */
+	return sc_pkcs1_encode(ctx, SC_ALGORITHM_RSA_PAD_PKCS1
+		| SC_ALGORITHM_RSA_HASH_SHA256, d->cert, 32, d->buf, &len, 2048);
+}
+
+static int
+bench_pkcs1_strip_02(struct bench_data *d)
+{
+	size_t len = d->buf_len;
+
+	return sc_pkcs1_strip_02_padding(ctx, d->rsa_block, sizeof d->rsa_block, d->buf, &len);
+}
+
+#ifdef ENABLE_OPENSSL
+static int
+bench_pkcs1_pss(struct bench_data *d)
+{
+	size_t len = d->buf_len;
+
+	return sc_pkcs1_encode(ctx, SC_ALGORITHM_RSA_PAD_PSS
+		| SC_ALGORITHM_RSA_HASH_NONE | SC_ALGORITHM_MGF1_SHA256,
+		d->cert, 32, d->buf, &len, 2048);
+}
+#endif
+
+static const struct bench benches[] = {
+	{ "asn1-prkdf",		"prkdf",	bench_asn1_prkdf },
+	{ "asn1-cdf",		"cdf",		bench_asn1_cdf },
+	{ "base64-encode",	"cert",		bench_base64_encode },
+	{ "base64-decode",	"cert",		bench_base64_decode },
+	{ "hex-encode",		"cert",		bench_hex_encode },
+	{ "hex-decode",		"cert",		bench_hex_decode },
+#ifdef ENABLE_ZLIB
+	{ "decompress",		"cert",		bench_decompress },
+#endif
+	{ "pkcs1-v15",		"digest",	bench_pkcs1_v15 },
+	{ "pkcs1-strip-02",	"rsa-block",	bench_pkcs1_strip_02 },
+#ifdef ENABLE_OPENSSL
+	{ "pkcs1-pss",		"digest",	bench_pkcs1_pss },
+#endif
+	{ NULL, NULL, NULL }
+};
+
+static int
+read_file(const char *name, u8 **data, size_t *len)
+{
+	FILE *f;
+	long size;
+
+	f = fopen(name, "rb");
+	if (f == NULL) {
+		perror(name);
+		return -1;
+	}
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) <= 0
+			|| fseek(f, 0, SEEK_SET) != 0) {
+		fprintf(stderr, "%s: can not determine the size\n", name);
+		fclose(f);
+		return -1;
+	}
+	free(*data);
+	*data = malloc(size);
+	if (*data == NULL || fread(*data, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "%s: read failed\n", name);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	*len = size;
+	return 0;
+}
+
+/*
+ * Without recorded data, synthesize directory files with a few RSA keys and
+ * the certificates matching them; the certificate input is then the CDF.
+ */
+static int
+synthesize_dfs(struct bench_data *d, int entries)
+{
+	struct sc_pkcs15_object obj;
+	struct sc_pkcs15_prkey_info prkey;
+	struct sc_pkcs15_cert_info cert;
+	u8 *buf, *p;
+	size_t len;
+	char tmp[32];
+	int i, r;
+
+	for (i = 0; i < entries; i++) {
+		memset(&obj, 0, sizeof obj);
+		memset(&prkey, 0, sizeof prkey);
+		obj.type = SC_PKCS15_TYPE_PRKEY_RSA;
+		obj.flags = SC_PKCS15_CO_FLAG_PRIVATE;
+		obj.data = &prkey;
+		snprintf(obj.label, sizeof obj.label, "Private key %d", i);
+		sc_pkcs15_format_id("01", &obj.auth_id);
+		snprintf(tmp, sizeof tmp, "%02X", i + 1);
+		sc_pkcs15_format_id(tmp, &prkey.id);
+		prkey.usage = SC_PKCS15_PRKEY_USAGE_SIGN
+			| SC_PKCS15_PRKEY_USAGE_DECRYPT;
+		prkey.access_flags = SC_PKCS15_PRKEY_ACCESS_SENSITIVE
+			| SC_PKCS15_PRKEY_ACCESS_NEVEREXTRACTABLE;
+		prkey.native = 1;
+		prkey.key_reference = i + 1;
+		prkey.modulus_length = 2048;
+		snprintf(tmp, sizeof tmp, "3F0050154B%02X", i + 1);
+		sc_format_path(tmp, &prkey.path);
+
+		r = sc_pkcs15_encode_prkdf_entry(ctx, &obj, &buf, &len);
+		if (r < 0)
+			return r;
+		p = realloc(d->prkdf, d->prkdf_len + len);
+		if (p == NULL) {
+			free(buf);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		memcpy(p + d->prkdf_len, buf, len);
+		d->prkdf = p;
+		d->prkdf_len += len;
+		free(buf);
+
+		memset(&obj, 0, sizeof obj);
+		memset(&cert, 0, sizeof cert);
+		obj.type = SC_PKCS15_TYPE_CERT_X509;
+		obj.data = &cert;
+		snprintf(obj.label, sizeof obj.label, "Certificate %d", i);
+		cert.id = prkey.id;
+		snprintf(tmp, sizeof tmp, "3F0050154C%02X", i + 1);
+		sc_format_path(tmp, &cert.path);
+
+		r = sc_pkcs15_encode_cdf_entry(ctx, &obj, &buf, &len);
+		if (r < 0)
+			return r;
+		p = realloc(d->cdf, d->cdf_len + len);
+		if (p == NULL) {
+			free(buf);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		memcpy(p + d->cdf_len, buf, len);
+		d->cdf = p;
+		d->cdf_len += len;
+		free(buf);
+	}
+	return 0;
+}
+
+static int
+prepare_derived(struct bench_data *d)
+{
+	size_t len;
+
+	if (d->cert == NULL) {
+		d->cert = malloc(d->cdf_len);
+		if (d->cert == NULL)
+			return -1;
+		memcpy(d->cert, d->cdf, d->cdf_len);
+		d->cert_len = d->cdf_len;
+	}
+	if (d->cert_len < 32) {
+		fprintf(stderr, "The certificate input needs at least 32 bytes\n");
+		return -1;
+	}
+
+	/* a TLS pre-master secret in the BT02 block, as a card returns it */
+	d->rsa_block[0] = 0x00;
+	d->rsa_block[1] = 0x02;
+	for (len = 2; len < sizeof d->rsa_block - 49; len++)
+		d->rsa_block[len] = (u8)(len % 255 + 1);
+	d->rsa_block[len++] = 0x00;
+	memcpy(d->rsa_block + len, d->cert, 32);
+	memset(d->rsa_block + len + 32, 0x5A, sizeof d->rsa_block - len - 32);
+
+	/* large enough for any of the encodings below */
+	d->buf_len = d->cert_len * 3 + 1024;
+	d->buf = malloc(d->buf_len);
+	d->b64 = malloc(d->buf_len);
+	d->hex = malloc(d->buf_len);
+	if (d->buf == NULL || d->b64 == NULL || d->hex == NULL)
+		return -1;
+	if (sc_base64_encode(d->cert, d->cert_len, (u8 *)d->b64, d->buf_len, 64) < 0)
+		return -1;
+	if (sc_bin_to_hex(d->cert, d->cert_len, d->hex, d->buf_len, 0) < 0)
+		return -1;
+
+#ifdef ENABLE_ZLIB
+	if (d->cert_z == NULL) {
+		len = d->cert_len + 1024;
+		d->cert_z = malloc(len);
+		if (d->cert_z == NULL || sc_compress(d->cert_z, &len,
+				d->cert, d->cert_len, COMPRESSION_GZIP) != SC_SUCCESS)
+			return -1;
+		d->cert_z_len = len;
+	}
+#endif
+	return 0;
+}
+
+static size_t
+input_size(struct bench_data *d, const char *input)
+{
+	if (strcmp(input, "prkdf") == 0)
+		return d->prkdf_len;
+	if (strcmp(input, "cdf") == 0)
+		return d->cdf_len;
+	if (strcmp(input, "digest") == 0)
+		return 32;
+	if (strcmp(input, "rsa-block") == 0)
+		return sizeof d->rsa_block;
+	return d->cert_len;
+}
+
+static int
+run_bench(const struct bench *b, struct bench_data *d,
+	unsigned long iterations, unsigned long time_ms)
+{
+	unsigned long long start, elapsed, allocs = 0;
+	unsigned long i, n;
+	int r;
+
+	/* warm up caches and check that the operation works at all */
+	r = b->run(d);
+	if (r < 0) {
+		printf("%-16s failed: %s\n", b->name, sc_strerror(r));
+		return -1;
+	}
+
+	/* calibrate the number of iterations to the requested run time */
+	n = iterations;
+	if (n == 0) {
+		n = 1;
+		do {
+			n *= 2;
+			start = now_ns();
+			for (i = 0; i < n; i++)
+				b->run(d);
+			elapsed = now_ns() - start;
+		} while (elapsed < time_ms * 1000000ULL / 10 && n < (1UL << 30));
+		n = (unsigned long)(n * (time_ms * 1000000.0 / (elapsed ? elapsed : 1)));
+		if (n == 0)
+			n = 1;
+	}
+
+#ifdef COUNT_ALLOCATIONS
+	allocs = allocations;
+#endif
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		b->run(d);
+	elapsed = now_ns() - start;
+#ifdef COUNT_ALLOCATIONS
+	allocs = allocations - allocs;
+	printf("%-16s %8lu %10lu %12.1f %10.2f\n", b->name,
+		(unsigned long)input_size(d, b->input), n,
+		(double)elapsed / n, (double)allocs / n);
+#else
+	(void) allocs;
+	printf("%-16s %8lu %10lu %12.1f %10s\n", b->name,
+		(unsigned long)input_size(d, b->input), n,
+		(double)elapsed / n, "-");
+#endif
+	return 0;
+}
+
+static int
+selected(const char *name, int argc, char **argv)
+{
+	int i;
+
+	if (argc == 0)
+		return 1;
+	for (i = 0; i < argc; i++)
+		if (strstr(name, argv[i]) != NULL)
+			return 1;
+	return 0;
+}
+
+static void
+display_usage(void)
+{
+	const struct bench *b;
+
+	fprintf(stdout,
+		" Usage:\n"
+		"	./microbench [-p prkdf] [-c cdf] [-x cert] [-z cert.gz] [-e entries]\n"
+		"		[-n iterations] [-t ms] [benchmark]...\n"
+		"		-p prkdf	Recorded PrKDF to decode (default: synthesized)\n"
+		"		-c cdf		Recorded CDF to decode (default: synthesized)\n"
+		"		-x cert		DER certificate for the encoding benchmarks\n"
+		"		-z cert.gz	Compressed certificate, e.g. read from a PIV card\n"
+		"		-e entries	Number of synthesized DF entries (default %d)\n"
+		"		-n iterations	Fixed number of iterations\n"
+		"		-t ms		Run time of every benchmark (default %d)\n"
+		"		-h		This help\n"
+		"\n"
+		" Benchmarks (selected by substring):\n",
+		DEFAULT_ENTRIES, DEFAULT_TIME_MS);
+	for (b = benches; b->name != NULL; b++)
+		fprintf(stdout, "	%s\n", b->name);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_data d;
+	const struct bench *b;
+	unsigned long iterations = 0, time_ms = DEFAULT_TIME_MS;
+	int entries = DEFAULT_ENTRIES;
+	int c, r, errors = 0;
+
+	memset(&d, 0, sizeof d);
+	while ((c = getopt(argc, argv, "hp:c:x:z:e:n:t:")) != -1) {
+		switch (c) {
+		case 'p':
+			if (read_file(optarg, &d.prkdf, &d.prkdf_len))
+				return 1;
+			break;
+		case 'c':
+			if (read_file(optarg, &d.cdf, &d.cdf_len))
+				return 1;
+			break;
+		case 'x':
+			if (read_file(optarg, &d.cert, &d.cert_len))
+				return 1;
+			break;
+		case 'z':
+			if (read_file(optarg, &d.cert_z, &d.cert_z_len))
+				return 1;
+			break;
+		case 'e':
+			entries = atoi(optarg);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			time_ms = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+		default:
+			display_usage();
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	r = sc_establish_context(&ctx, "microbench");
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Failed to establish context: %s\n", sc_strerror(r));
+		return 1;
+	}
+	memset(&card, 0, sizeof card);
+	card.ctx = ctx;
+	p15card = sc_pkcs15_card_new();
+	if (p15card == NULL) {
+		sc_release_context(ctx);
+		return 1;
+	}
+	p15card->card = &card;
+	/* decoded paths are made absolute against the application DF */
+	p15card->file_app = sc_file_new();
+	if (p15card->file_app == NULL) {
+		errors++;
+		goto out;
+	}
+	sc_format_path("3F005015", &p15card->file_app->path);
+
+	if (d.prkdf == NULL || d.cdf == NULL) {
+		struct bench_data s;
+
+		memset(&s, 0, sizeof s);
+		if (synthesize_dfs(&s, entries) != 0) {
+			fprintf(stderr, "Failed to synthesize the directory files\n");
+			errors++;
+			goto out;
+		}
+		if (d.prkdf == NULL) {
+			d.prkdf = s.prkdf;
+			d.prkdf_len = s.prkdf_len;
+		} else {
+			free(s.prkdf);
+		}
+		if (d.cdf == NULL) {
+			d.cdf = s.cdf;
+			d.cdf_len = s.cdf_len;
+		} else {
+			free(s.cdf);
+		}
+	}
+	if (prepare_derived(&d) != 0) {
+		fprintf(stderr, "Failed to prepare the benchmark input\n");
+		errors++;
+		goto out;
+	}
+
+	printf("%-16s %8s %10s %12s %10s\n", "benchmark", "bytes",
+		"iterations", "ns/op", "allocs/op");
+	for (b = benches; b->name != NULL; b++) {
+		if (!selected(b->name, argc - optind, argv + optind))
+			continue;
+		if (run_bench(b, &d, iterations, time_ms) != 0)
+			errors++;
+	}
+
+out:
+	free(d.prkdf);
+	free(d.cdf);
+	free(d.cert);
+	free(d.cert_z);
+	free(d.b64);
+	free(d.hex);
+	free(d.buf);
+	sc_pkcs15_card_free(p15card);
+	sc_release_context(ctx);
+	return errors ? 1 : 0;
+}
@@ -118,6 +118,102 @@ TORTURE_PUT_TAG_SUCCESS(first_long, 0x42, 0xff, 4, "\x42\xff\xff\x00")
 TORTURE_PUT_TAG_SUCCESS(last_long, 0x42, 0xffff, 4, "\x42\xff\xff\xff")
 TORTURE_PUT_TAG_ERROR(too_large_length, 0x42, 0x10000, 4, SC_ERROR_WRONG_LENGTH)
 
+static void torture_simpletlv_iter_combined(void **state)
+{
+	u8 buf[] = "\x42\x02\x01\x02\x43\x00\x44\xff\x01\x00\x03";
+	struct sc_simpletlv_iter it;
+	const u8 *value = NULL;
+	size_t len = 0;
+	u8 tag = 0;
+	int rv;
+
+	sc_simpletlv_iter_init(&it, buf, sizeof(buf) - 1);
+	rv = sc_simpletlv_iter_next(&it, &tag, &value, &len);
+	assert_int_equal(rv, 1);
+	assert_int_equal(tag, 0x42);
+	assert_int_equal(len, 2);
+	assert_ptr_equal(value, buf + 2);
+	rv = sc_simpletlv_iter_next(&it, &tag, &value, &len);
+	assert_int_equal(rv, 1);
+	assert_int_equal(tag, 0x43);
+	assert_int_equal(len, 0);
+	rv = sc_simpletlv_iter_next(&it, &tag, &value, &len);
+	assert_int_equal(rv, 1);
+	assert_int_equal(tag, 0x44);
+	assert_int_equal(len, 1);
+	assert_ptr_equal(value, buf + 10);
+	rv = sc_simpletlv_iter_next(&it, &tag, &value, &len);
+	assert_int_equal(rv, 0);
+}
+
+static void torture_simpletlv_iter_truncated(void **state)
+{
+	u8 buf[] = "\x42\x04\x01\x02";
+	struct sc_simpletlv_iter it;
+	const u8 *value = NULL;
+	size_t len = 0;
+	u8 tag = 0;
+	int rv;
+
+	sc_simpletlv_iter_init(&it, buf, sizeof(buf) - 1);
+	rv = sc_simpletlv_iter_next(&it, &tag, &value, &len);
+	assert_int_equal(rv, SC_ERROR_TLV_END_OF_CONTENTS);
+	assert_int_equal(tag, 0x42);
+	assert_int_equal(len, 2);
+	assert_ptr_equal(value, buf + 2);
+	rv = sc_simpletlv_iter_next(&it, &tag, &value, &len);
+	assert_int_equal(rv, 0);
+}
+
+static void torture_simpletlv_iter_invalid(void **state)
+{
+	u8 buf[] = "\x42\x00\x43";
+	struct sc_simpletlv_iter it;
+	const u8 *value = NULL;
+	size_t len = 0;
+	u8 tag = 0;
+	int rv;
+
+	sc_simpletlv_iter_init(&it, buf, sizeof(buf) - 1);
+	rv = sc_simpletlv_iter_next(&it, &tag, &value, &len);
+	assert_int_equal(rv, 1);
+	rv = sc_simpletlv_iter_next(&it, &tag, &value, &len);
+	assert_int_equal(rv, SC_ERROR_INVALID_TLV_OBJECT);
+	rv = sc_simpletlv_iter_next(&it, &tag, &value, &len);
+	assert_int_equal(rv, 0);
+}
+
+static void torture_simpletlv_iter_split(void **state)
+{
+	u8 tl[] = "\x42\x02\x43\xff\x01\x00\x44\x02";
+	u8 val[] = "\x01\x02\x03\x04";
+	struct sc_simpletlv_iter it;
+	const u8 *value = NULL;
+	size_t len = 0;
+	u8 tag = 0;
+	int rv;
+
+	sc_simpletlv_iter_init_split(&it, tl, sizeof(tl) - 1, val, sizeof(val) - 1);
+	rv = sc_simpletlv_iter_next(&it, &tag, &value, &len);
+	assert_int_equal(rv, 1);
+	assert_int_equal(tag, 0x42);
+	assert_int_equal(len, 2);
+	assert_ptr_equal(value, val);
+	rv = sc_simpletlv_iter_next(&it, &tag, &value, &len);
+	assert_int_equal(rv, 1);
+	assert_int_equal(tag, 0x43);
+	assert_int_equal(len, 1);
+	assert_ptr_equal(value, val + 2);
+	/* only one byte of the value is left */
+	rv = sc_simpletlv_iter_next(&it, &tag, &value, &len);
+	assert_int_equal(rv, SC_ERROR_TLV_END_OF_CONTENTS);
+	assert_int_equal(tag, 0x44);
+	assert_int_equal(len, 1);
+	assert_ptr_equal(value, val + 3);
+	rv = sc_simpletlv_iter_next(&it, &tag, &value, &len);
+	assert_int_equal(rv, 0);
+}
+
 int main(void)
 {
 	int rc;
@@ -144,6 +240,11 @@ int main(void)
 		cmocka_unit_test(torture_simpletlv_put_tag_first_long),
 		cmocka_unit_test(torture_simpletlv_put_tag_last_long),
 		cmocka_unit_test(torture_simpletlv_put_tag_too_large_length),
+		/* simpletlv_iter_next() */
+		cmocka_unit_test(torture_simpletlv_iter_combined),
+		cmocka_unit_test(torture_simpletlv_iter_truncated),
+		cmocka_unit_test(torture_simpletlv_iter_invalid),
+		cmocka_unit_test(torture_simpletlv_iter_split),
 	};
 
 	rc = cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,257 @@
+/*
+ * startbench.c: Benchmark of the library and PKCS#11 module start up
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Short-lived clients (ssh, pam_pkcs11, commit signing) pay for the start
+ * up on every call. This times its phases one by one, every run with a
+ * fresh context: the phases of sc_context_create() as recorded in the
+ * context statistics, connecting the card and binding PKCS#15, and, with
+ * a module, C_Initialize() and the first C_GetSlotList(), which binds the
+ * tokens. Run it against a replay trace (OPENSC_REPLAY or -r) so the card
+ * does not dominate and the numbers compare across releases.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libopensc/opensc.h"
+#include "libopensc/pkcs15.h"
+#include "pkcs11/pkcs11.h"
+#include "common/libpkcs11.h"
+
+#define DEFAULT_RUNS	10
+
+enum {
+	PHASE_CONFIG,
+	PHASE_READER_INIT,
+	PHASE_DRIVERS,
+	PHASE_DETECT,
+	PHASE_CONTEXT,
+	PHASE_CONNECT,
+	PHASE_BIND,
+	PHASE_RELEASE,
+	PHASE_LOAD_MODULE,
+	PHASE_INITIALIZE,
+	PHASE_SLOT_LIST,
+	PHASE_FINALIZE,
+	PHASE_COUNT
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+	"config",
+	"reader driver",
+	"card drivers",
+	"reader detection",
+	"context (total)",
+	"connect card",
+	"pkcs15 bind",
+	"release",
+	"load module",
+	"C_Initialize",
+	"C_GetSlotList",
+	"C_Finalize",
+};
+
+struct phase {
+	unsigned long long total, min, max;
+	unsigned long runs;
+};
+
+static struct phase phases[PHASE_COUNT];
+
+static unsigned long long
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+record(int phase, unsigned long long us)
+{
+	struct phase *p = &phases[phase];
+
+	if (p->runs == 0 || us < p->min)
+		p->min = us;
+	if (us > p->max)
+		p->max = us;
+	p->total += us;
+	p->runs++;
+}
+
+/* One start up of the library, the way the tools do it */
+static int
+run_library(void)
+{
+	sc_context_param_t param;
+	sc_context_t *ctx = NULL;
+	sc_card_t *card = NULL;
+	struct sc_pkcs15_card *p15card = NULL;
+	struct sc_stats stats;
+	unsigned long long start;
+	unsigned int i;
+	int r;
+
+	memset(&param, 0, sizeof param);
+	param.ver = 0;
+	param.app_name = "startbench";
+
+	start = now_us();
+	r = sc_context_create(&ctx, &param);
+	record(PHASE_CONTEXT, now_us() - start);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Failed to establish context: %s\n", sc_strerror(r));
+		return r;
+	}
+	if (sc_ctx_get_stats(ctx, &stats) == SC_SUCCESS) {
+		record(PHASE_CONFIG, stats.startup.config_us);
+		record(PHASE_READER_INIT, stats.startup.reader_init_us);
+		record(PHASE_DRIVERS, stats.startup.drivers_us);
+		record(PHASE_DETECT, stats.startup.detect_us);
+	}
+
+	for (i = 0; i < sc_ctx_get_reader_count(ctx); i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+
+		if (reader == NULL || !(sc_detect_card_presence(reader) & SC_READER_CARD_PRESENT))
+			continue;
+		start = now_us();
+		r = sc_connect_card(reader, &card);
+		record(PHASE_CONNECT, now_us() - start);
+		break;
+	}
+	if (card != NULL) {
+		start = now_us();
+		if (sc_pkcs15_bind(card, NULL, &p15card) == SC_SUCCESS)
+			record(PHASE_BIND, now_us() - start);
+	}
+
+	start = now_us();
+	if (p15card != NULL)
+		sc_pkcs15_unbind(p15card);
+	if (card != NULL)
+		sc_disconnect_card(card);
+	sc_release_context(ctx);
+	record(PHASE_RELEASE, now_us() - start);
+	return SC_SUCCESS;
+}
+
+/* One start up of the PKCS#11 module, as a client loading it would see */
+static int
+run_module(const char *module)
+{
+	CK_FUNCTION_LIST_PTR p11 = NULL;
+	CK_SLOT_ID slots[16];
+	CK_ULONG count = sizeof slots / sizeof slots[0];
+	unsigned long long start;
+	void *handle;
+	CK_RV rv;
+
+	start = now_us();
+	handle = C_LoadModule(module, &p11);
+	record(PHASE_LOAD_MODULE, now_us() - start);
+	if (handle == NULL) {
+		fprintf(stderr, "Failed to load '%s'\n", module);
+		return SC_ERROR_INTERNAL;
+	}
+
+	start = now_us();
+	rv = p11->C_Initialize(NULL);
+	record(PHASE_INITIALIZE, now_us() - start);
+	if (rv != CKR_OK) {
+		fprintf(stderr, "C_Initialize() failed: 0x%lx\n", (unsigned long)rv);
+		C_UnloadModule(handle);
+		return SC_ERROR_INTERNAL;
+	}
+
+	start = now_us();
+	rv = p11->C_GetSlotList(CK_TRUE, slots, &count);
+	record(PHASE_SLOT_LIST, now_us() - start);
+	if (rv != CKR_OK)
+		fprintf(stderr, "C_GetSlotList() failed: 0x%lx\n", (unsigned long)rv);
+
+	start = now_us();
+	p11->C_Finalize(NULL);
+	C_UnloadModule(handle);
+	record(PHASE_FINALIZE, now_us() - start);
+	return SC_SUCCESS;
+}
+
+static void
+display_usage(void)
+{
+	fprintf(stdout,
+		" Usage:\n"
+		"	./startbench [-r trace] [-m module] [-n runs]\n"
+		"		-r trace	APDU trace for the replay reader (default: OPENSC_REPLAY)\n"
+		"		-m module	Also time the start up of this PKCS#11 module\n"
+		"		-n runs		Number of start ups (default %d)\n"
+		"		-h		This help\n",
+		DEFAULT_RUNS);
+}
+
+int main(int argc, char **argv)
+{
+	const char *module = NULL;
+	unsigned long runs = DEFAULT_RUNS, i;
+	int c, p;
+
+	while ((c = getopt(argc, argv, "hr:m:n:")) != -1) {
+		switch (c) {
+		case 'r':
+			setenv("OPENSC_REPLAY", optarg, 1);
+			break;
+		case 'm':
+			module = optarg;
+			break;
+		case 'n':
+			runs = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+		default:
+			display_usage();
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if (runs == 0)
+		runs = 1;
+	if (getenv("OPENSC_REPLAY") == NULL)
+		fprintf(stderr, "No replay trace given, using the configured readers\n");
+
+	for (i = 0; i < runs; i++) {
+		if (run_library() != SC_SUCCESS)
+			return 1;
+		if (module != NULL && run_module(module) != SC_SUCCESS)
+			return 1;
+	}
+
+	printf("%-18s %6s %10s %10s %10s\n", "phase", "runs", "min us", "avg us", "max us");
+	for (p = 0; p < PHASE_COUNT; p++) {
+		if (phases[p].runs == 0)
+			continue;
+		printf("%-18s %6lu %10llu %10llu %10llu\n", phase_names[p], phases[p].runs,
+			phases[p].min, phases[p].total / phases[p].runs, phases[p].max);
+	}
+	return 0;
+}
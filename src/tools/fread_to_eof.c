@@ -21,37 +21,68 @@
 #include "config.h"
 #endif
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "fread_to_eof.h"
+
+/* initial buffer size for input of unknown length, e.g. from a pipe */
+#define READ_CHUNK_LEN 0x1000
 
 int fread_to_eof(const char *file, unsigned char **buf, size_t *buflen)
 {
 	FILE *input = NULL;
+	struct stat st;
+	size_t size, len = 0;
 	int r = 0;
 	unsigned char *p;
 
 	if (!buflen || !buf || !file)
 		goto err;
 
-#define MAX_READ_LEN 0xfff
-	p = realloc(*buf, MAX_READ_LEN);
-	if (!p)
-		goto err;
-	*buf = p;
-
 	input = fopen(file, "rb");
 	if (!input) {
 		goto err;
 	}
 
-	*buflen = 0;
-	while (feof(input) == 0 && *buflen < MAX_READ_LEN) {
-		*buflen += fread(*buf+*buflen, 1, MAX_READ_LEN-*buflen, input);
+	/* regular files are read with a single allocation of their size */
+	size = READ_CHUNK_LEN;
+	if (fstat(fileno(input), &st) == 0 && S_ISREG(st.st_mode)
+			&& st.st_size > 0 && (unsigned long long) st.st_size < SIZE_MAX)
+		size = (size_t) st.st_size + 1;
+
+	p = realloc(*buf, size);
+	if (!p)
+		goto err;
+	*buf = p;
+
+	for (;;) {
+		len += fread(*buf + len, 1, size - len, input);
 		if (ferror(input)) {
 			goto err;
 		}
+		if (feof(input))
+			break;
+		if (len == size) {
+			if (size > SIZE_MAX / 2)
+				goto err;
+			size *= 2;
+			p = realloc(*buf, size);
+			if (!p)
+				goto err;
+			*buf = p;
+		}
 	}
+	*buflen = len;
 
 	r = 1;
 err:
@@ -60,3 +91,50 @@ err:
 
 	return r;
 }
+
+int fmap_file(const char *file, struct fmapped_file *mapped)
+{
+#ifdef HAVE_SYS_MMAN_H
+	struct stat st;
+	void *p;
+	int fd;
+#endif
+
+	if (!file || !mapped)
+		return 0;
+	memset(mapped, 0, sizeof *mapped);
+
+#ifdef HAVE_SYS_MMAN_H
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+			&& st.st_size > 0 && (unsigned long long) st.st_size <= SIZE_MAX) {
+		p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			close(fd);
+			mapped->data = p;
+			mapped->len = (size_t) st.st_size;
+			mapped->mapped = 1;
+			return 1;
+		}
+	}
+	close(fd);
+#endif
+
+	/* pipes, empty files and systems without mmap() */
+	return fread_to_eof(file, &mapped->data, &mapped->len);
+}
+
+void funmap_file(struct fmapped_file *mapped)
+{
+	if (!mapped)
+		return;
+#ifdef HAVE_SYS_MMAN_H
+	if (mapped->mapped)
+		munmap(mapped->data, mapped->len);
+	else
+#endif
+		free(mapped->data);
+	memset(mapped, 0, sizeof *mapped);
+}
@@ -22,6 +22,18 @@
 
 #include <stddef.h>
 
+/* Reads the whole file into a buffer the caller frees */
 int fread_to_eof(const char *file, unsigned char **buf, size_t *buflen);
 
+struct fmapped_file {
+	unsigned char *data;
+	size_t len;
+	int mapped;
+};
+
+/* Maps the whole file read-only, or reads it if it cannot be mapped.
+ * Release it with funmap_file(). */
+int fmap_file(const char *file, struct fmapped_file *mapped);
+void funmap_file(struct fmapped_file *mapped);
+
 #endif
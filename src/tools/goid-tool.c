@@ -777,15 +777,13 @@ int paccess_main(struct sc_context *ctx, sc_card_t *card, struct gengetopt_args_
     }
 
     for (i = 0; i < cmdline->write_dg_given; i++) {
-        u8 *ef = NULL;
-        size_t ef_len = 0;
-        if (!fread_to_eof(cmdline->in_file_arg[i],
-                    &ef, &ef_len)) {
+        struct fmapped_file ef;
+        if (!fmap_file(cmdline->in_file_arg[i], &ef)) {
             SC_TEST_GOTO_ERR(ctx, SC_LOG_DEBUG_VERBOSE_TOOL,
                     SC_ERROR_INVALID_ARGUMENTS, "Could not read input file.\n");
         }
-        r = iso7816_update_binary_sfid(card, cmdline->write_dg_arg[i], ef, ef_len);
-        free(ef);
+        r = iso7816_update_binary_sfid(card, cmdline->write_dg_arg[i], ef.data, ef.len);
+        funmap_file(&ef);
         SC_TEST_GOTO_ERR(ctx, SC_LOG_DEBUG_VERBOSE_TOOL, r,
                 "Error writing data group.");
     }
@@ -80,6 +80,7 @@ const char *gengetopt_args_info_help[] = {
   "      --read-dg19               Read DG 19  (Residence Permit I)  (default=off)",
   "      --read-dg20               Read DG 20  (Residence Permit II)\n                                  (default=off)",
   "      --read-dg21               Read DG 21  (Optional Data)  (default=off)",
+  "      --read-dgs=LIST           Read the listed data groups (e.g. 1-13,17)",
   "      --write-dg17=HEX_STRING   Write DG 17 (Normal Place of Residence)",
   "      --write-dg18=HEX_STRING   Write DG 18 (Community ID)",
   "      --write-dg19=HEX_STRING   Write DG 19 (Residence Permit I)",
@@ -163,6 +164,7 @@ void clear_given (struct gengetopt_args_info *args_info)
   args_info->read_dg19_given = 0 ;
   args_info->read_dg20_given = 0 ;
   args_info->read_dg21_given = 0 ;
+  args_info->read_dgs_given = 0 ;
   args_info->write_dg17_given = 0 ;
   args_info->write_dg18_given = 0 ;
   args_info->write_dg19_given = 0 ;
@@ -233,6 +235,8 @@ void clear_args (struct gengetopt_args_info *args_info)
   args_info->read_dg19_flag = 0;
   args_info->read_dg20_flag = 0;
   args_info->read_dg21_flag = 0;
+  args_info->read_dgs_arg = NULL;
+  args_info->read_dgs_orig = NULL;
   args_info->write_dg17_arg = NULL;
   args_info->write_dg17_orig = NULL;
   args_info->write_dg18_arg = NULL;
@@ -308,18 +312,19 @@ void init_args_info(struct gengetopt_args_info *args_info)
   args_info->read_dg19_help = gengetopt_args_info_help[43] ;
   args_info->read_dg20_help = gengetopt_args_info_help[44] ;
   args_info->read_dg21_help = gengetopt_args_info_help[45] ;
-  args_info->write_dg17_help = gengetopt_args_info_help[46] ;
-  args_info->write_dg18_help = gengetopt_args_info_help[47] ;
-  args_info->write_dg19_help = gengetopt_args_info_help[48] ;
-  args_info->write_dg20_help = gengetopt_args_info_help[49] ;
-  args_info->write_dg21_help = gengetopt_args_info_help[50] ;
-  args_info->verify_validity_help = gengetopt_args_info_help[52] ;
-  args_info->older_than_help = gengetopt_args_info_help[53] ;
-  args_info->verify_community_help = gengetopt_args_info_help[54] ;
-  args_info->break_help = gengetopt_args_info_help[56] ;
-  args_info->translate_help = gengetopt_args_info_help[57] ;
-  args_info->tr_03110v201_help = gengetopt_args_info_help[58] ;
-  args_info->disable_all_checks_help = gengetopt_args_info_help[59] ;
+  args_info->read_dgs_help = gengetopt_args_info_help[46] ;
+  args_info->write_dg17_help = gengetopt_args_info_help[47] ;
+  args_info->write_dg18_help = gengetopt_args_info_help[48] ;
+  args_info->write_dg19_help = gengetopt_args_info_help[49] ;
+  args_info->write_dg20_help = gengetopt_args_info_help[50] ;
+  args_info->write_dg21_help = gengetopt_args_info_help[51] ;
+  args_info->verify_validity_help = gengetopt_args_info_help[53] ;
+  args_info->older_than_help = gengetopt_args_info_help[54] ;
+  args_info->verify_community_help = gengetopt_args_info_help[55] ;
+  args_info->break_help = gengetopt_args_info_help[57] ;
+  args_info->translate_help = gengetopt_args_info_help[58] ;
+  args_info->tr_03110v201_help = gengetopt_args_info_help[59] ;
+  args_info->disable_all_checks_help = gengetopt_args_info_help[60] ;
   
 }
 
@@ -478,6 +483,8 @@ cmdline_parser_release (struct gengetopt_args_info *args_info)
   free_string_field (&(args_info->cvc_dir_orig));
   free_string_field (&(args_info->x509_dir_arg));
   free_string_field (&(args_info->x509_dir_orig));
+  free_string_field (&(args_info->read_dgs_arg));
+  free_string_field (&(args_info->read_dgs_orig));
   free_string_field (&(args_info->write_dg17_arg));
   free_string_field (&(args_info->write_dg17_orig));
   free_string_field (&(args_info->write_dg18_arg));
@@ -616,6 +623,8 @@ cmdline_parser_dump(FILE *outfile, struct gengetopt_args_info *args_info)
     write_into_file(outfile, "read-dg20", 0, 0 );
   if (args_info->read_dg21_given)
     write_into_file(outfile, "read-dg21", 0, 0 );
+  if (args_info->read_dgs_given)
+    write_into_file(outfile, "read-dgs", args_info->read_dgs_orig, 0);
   if (args_info->write_dg17_given)
     write_into_file(outfile, "write-dg17", args_info->write_dg17_orig, 0);
   if (args_info->write_dg18_given)
@@ -1214,6 +1223,7 @@ cmdline_parser_internal (
         { "read-dg19",	0, NULL, 0 },
         { "read-dg20",	0, NULL, 0 },
         { "read-dg21",	0, NULL, 0 },
+        { "read-dgs",	1, NULL, 0 },
         { "write-dg17",	1, NULL, 0 },
         { "write-dg18",	1, NULL, 0 },
         { "write-dg19",	1, NULL, 0 },
@@ -1742,6 +1752,20 @@ cmdline_parser_internal (
                 additional_error))
               goto failure;
           
+          }
+          /* Read the listed data groups (e.g. 1-13,17).  */
+          else if (strcmp (long_options[option_index].name, "read-dgs") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->read_dgs_arg), 
+                 &(args_info->read_dgs_orig), &(args_info->read_dgs_given),
+                &(local_args_info.read_dgs_given), optarg, 0, 0, ARG_STRING,
+                check_ambiguity, override, 0, 0,
+                "read-dgs", '-',
+                additional_error))
+              goto failure;
+          
           }
           /* Write DG 17 (Normal Place of Residence).  */
           else if (strcmp (long_options[option_index].name, "write-dg17") == 0)
@@ -135,6 +135,9 @@ struct gengetopt_args_info
   const char *read_dg20_help; /**< @brief Read DG 20  (Residence Permit II) help description.  */
   int read_dg21_flag;	/**< @brief Read DG 21  (Optional Data) (default=off).  */
   const char *read_dg21_help; /**< @brief Read DG 21  (Optional Data) help description.  */
+  char * read_dgs_arg;	/**< @brief Read the listed data groups (e.g. 1-13,17).  */
+  char * read_dgs_orig;	/**< @brief Read the listed data groups (e.g. 1-13,17) original value given at command line.  */
+  const char *read_dgs_help; /**< @brief Read the listed data groups (e.g. 1-13,17) help description.  */
   char * write_dg17_arg;	/**< @brief Write DG 17 (Normal Place of Residence).  */
   char * write_dg17_orig;	/**< @brief Write DG 17 (Normal Place of Residence) original value given at command line.  */
   const char *write_dg17_help; /**< @brief Write DG 17 (Normal Place of Residence) help description.  */
@@ -211,6 +214,7 @@ struct gengetopt_args_info
   unsigned int read_dg19_given ;	/**< @brief Whether read-dg19 was given.  */
   unsigned int read_dg20_given ;	/**< @brief Whether read-dg20 was given.  */
   unsigned int read_dg21_given ;	/**< @brief Whether read-dg21 was given.  */
+  unsigned int read_dgs_given ;	/**< @brief Whether read-dgs was given.  */
   unsigned int write_dg17_given ;	/**< @brief Whether write-dg17 was given.  */
   unsigned int write_dg18_given ;	/**< @brief Whether write-dg18 was given.  */
   unsigned int write_dg19_given ;	/**< @brief Whether write-dg19 was given.  */
@@ -128,6 +128,66 @@ static void read_dg(sc_card_t *card, unsigned char sfid, const char *dg_str,
 	}
 }
 
+static const char *dg_names[] = {
+	NULL,
+	"Document Type", "Issuing State", "Date of Expiry", "Given Names",
+	"Family Names", "Religious/Artistic Name", "Academic Title",
+	"Date of Birth", "Place of Birth", "Nationality", "Sex", "Optional Data",
+	"Birth Name", "DG 14", "DG 15", "DG 16", "Normal Place of Residence",
+	"Community ID", "Residence Permit I", "Residence Permit II",
+	"Optional Data",
+};
+
+/* Reads a list of data groups such as "1-13,17" while holding the card lock,
+ * so that all of them are read within the same secure channel and each one
+ * with the largest response the channel allows. */
+static void read_dg_list(sc_card_t *card, const char *list,
+		unsigned char **dg, size_t *dg_len)
+{
+	const char *p = list;
+	char *end;
+	unsigned long first, last, sfid;
+	int r;
+
+	r = sc_lock(card);
+	if (r < 0) {
+		fprintf(stderr, "Could not lock card (%s)\n", sc_strerror(r));
+		return;
+	}
+
+	while (*p) {
+		first = strtoul(p, &end, 10);
+		if (end == p)
+			goto parse_err;
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (end == p)
+				goto parse_err;
+		}
+		if (first < 1 || first > last
+				|| last >= sizeof dg_names/sizeof *dg_names)
+			goto parse_err;
+
+		for (sfid = first; sfid <= last; sfid++)
+			read_dg(card, (unsigned char) sfid, dg_names[sfid], dg, dg_len);
+
+		if (*end == ',')
+			end++;
+		else if (*end)
+			goto parse_err;
+		p = end;
+	}
+
+	sc_unlock(card);
+	return;
+
+parse_err:
+	sc_unlock(card);
+	fprintf(stderr, "Could not parse list of data groups '%s'\n", list);
+}
+
 static void write_dg(sc_card_t *card, unsigned char sfid, const char *dg_str,
 		const char *dg_hex)
 {
@@ -772,6 +832,8 @@ nopace:
 			read_dg(card, 20, "Residence Permit II", &dg, &dg_len);
 		if (cmdline.read_dg21_flag)
 			read_dg(card, 21, "Optional Data", &dg, &dg_len);
+		if (cmdline.read_dgs_given)
+			read_dg_list(card, cmdline.read_dgs_arg, &dg, &dg_len);
 
 		if (cmdline.write_dg17_given)
 			write_dg(card, 17, "Normal Place of Residence", cmdline.write_dg17_arg);
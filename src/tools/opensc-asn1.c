@@ -30,22 +30,22 @@ int
 main (int argc, char **argv)
 {
 	struct gengetopt_args_info cmdline;
-	unsigned char *buf = NULL;
-	size_t buflen = 0, i;
+	struct fmapped_file input;
+	size_t i;
 
 	if (cmdline_parser(argc, argv, &cmdline) != 0)
 		return 1;
 
 	for (i = 0; i < cmdline.inputs_num; i++) {
-		if (!fread_to_eof(cmdline.inputs[i], &buf, &buflen))
+		if (!fmap_file(cmdline.inputs[i], &input))
 			continue;
 
 		printf("Parsing '%s' (%"SC_FORMAT_LEN_SIZE_T"u byte%s)\n",
-				cmdline.inputs[i], buflen, buflen == 1 ? "" : "s");
-		sc_asn1_print_tags(buf, buflen);
+				cmdline.inputs[i], input.len, input.len == 1 ? "" : "s");
+		sc_asn1_print_tags(input.data, input.len);
+		funmap_file(&input);
 	}
 
-	free(buf);
 	cmdline_parser_free (&cmdline);
 
 	return 0;
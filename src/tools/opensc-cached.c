@@ -0,0 +1,443 @@
+/*
+ * opensc-cached.c: shared cache of PKCS #15 files
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The service keeps the files that libopensc would otherwise put into the
+ * on-disk cache (use_file_caching) in memory and shares them between all
+ * processes of the user, so that only the first process binding a token
+ * reads its directory files from the card. See pkcs15.h for the protocol.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE	/* struct ucred */
+#endif
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <limits.h>
+
+#include "libopensc/opensc.h"
+#include "libopensc/pkcs15.h"
+#include "util.h"
+
+static const char *app_name = "opensc-cached";
+
+static const char *opt_socket = NULL;
+static size_t opt_max_size = 4 * 1024 * 1024;
+static int verbose = 0;
+
+static const struct option options[] = {
+	{ "socket",	1, NULL,	's' },
+	{ "max-size",	1, NULL,	'm' },
+	{ "verbose",	0, NULL,	'v' },
+	{ "help",	0, NULL,	'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static const char *option_help[] = {
+	"Listen on socket <arg> [<cache dir>/" SC_PKCS15_CACHE_SERVICE_SOCKET "]",
+	"Keep at most <arg> KiB of cached files [4096]",
+	"Verbose operation. Use several times to enable debug output.",
+	"Print this help message",
+};
+
+struct cache_entry {
+	char *container;
+	char *key;
+	char *name;
+	u8 *data;
+	size_t len;
+	struct cache_entry *next;
+};
+
+/* newest entries first, the oldest ones are evicted */
+static struct cache_entry *entries = NULL;
+static size_t entries_size = 0;
+
+static volatile sig_atomic_t terminate = 0;
+
+static size_t get_be16(const u8 *p)
+{
+	return ((size_t)p[0] << 8) | p[1];
+}
+
+static size_t get_be32(const u8 *p)
+{
+	return ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+}
+
+static void put_be32(u8 *p, size_t v)
+{
+	p[0] = (v >> 24) & 0xFF;
+	p[1] = (v >> 16) & 0xFF;
+	p[2] = (v >> 8) & 0xFF;
+	p[3] = v & 0xFF;
+}
+
+static void entry_free(struct cache_entry *e)
+{
+	free(e->container);
+	free(e->key);
+	free(e->name);
+	free(e->data);
+	free(e);
+}
+
+/* Remove entries of 'container', all of them or only those with a
+ * different key (i.e. the token changed), or only the given name. */
+static void cache_drop(const char *container, const char *key, const char *name)
+{
+	struct cache_entry **pe = &entries;
+
+	while (*pe) {
+		struct cache_entry *e = *pe;
+
+		if (!strcmp(e->container, container)
+				&& (name ? !strcmp(e->name, name) : strcmp(e->key, key))) {
+			*pe = e->next;
+			entries_size -= e->len;
+			entry_free(e);
+			continue;
+		}
+		pe = &e->next;
+	}
+}
+
+static void cache_shrink(void)
+{
+	struct cache_entry **pe;
+
+	while (entries && entries_size > opt_max_size) {
+		for (pe = &entries; (*pe)->next; pe = &(*pe)->next)
+			;
+		entries_size -= (*pe)->len;
+		entry_free(*pe);
+		*pe = NULL;
+	}
+}
+
+static const struct cache_entry *
+cache_get(const char *container, const char *key, const char *name)
+{
+	const struct cache_entry *e;
+
+	for (e = entries; e; e = e->next)
+		if (!strcmp(e->container, container) && !strcmp(e->key, key)
+				&& !strcmp(e->name, name))
+			return e;
+	return NULL;
+}
+
+static int cache_put(const char *container, const char *key, const char *name,
+		u8 *data, size_t len)
+{
+	struct cache_entry *e;
+
+	if (len > opt_max_size)
+		return -1;
+
+	cache_drop(container, key, NULL);
+	cache_drop(container, key, name);
+
+	e = calloc(1, sizeof(*e));
+	if (e == NULL)
+		return -1;
+	e->container = strdup(container);
+	e->key = strdup(key);
+	e->name = strdup(name);
+	if (!e->container || !e->key || !e->name) {
+		e->data = NULL;
+		entry_free(e);
+		return -1;
+	}
+	e->data = data;
+	e->len = len;
+	e->next = entries;
+	entries = e;
+	entries_size += len;
+
+	cache_shrink();
+	return 0;
+}
+
+static int recv_all(int fd, u8 *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = recv(fd, buf, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+static int send_all(int fd, const u8 *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = send(fd, buf, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+static int recv_string(int fd, char *str)
+{
+	u8 lenbuf[2];
+	size_t len;
+
+	if (recv_all(fd, lenbuf, sizeof(lenbuf)))
+		return -1;
+	len = get_be16(lenbuf);
+	if (len > SC_PKCS15_CACHE_SERVICE_MAX_STRING || recv_all(fd, (u8 *)str, len))
+		return -1;
+	str[len] = '\0';
+	if (strlen(str) != len)
+		return -1;
+	return 0;
+}
+
+static int peer_allowed(int fd)
+{
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) || cred.uid != getuid())
+		return 0;
+#endif
+	(void)fd;
+	return 1;
+}
+
+static void handle_client(int fd)
+{
+	char container[SC_PKCS15_CACHE_SERVICE_MAX_STRING + 1];
+	char key[SC_PKCS15_CACHE_SERVICE_MAX_STRING + 1];
+	char name[SC_PKCS15_CACHE_SERVICE_MAX_STRING + 1];
+	u8 op, status = SC_PKCS15_CACHE_SERVICE_MISS, lenbuf[4];
+	const struct cache_entry *e;
+	struct timeval tv;
+
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (!peer_allowed(fd))
+		return;
+	if (recv_all(fd, &op, 1) || recv_string(fd, container)
+			|| recv_string(fd, key) || recv_string(fd, name))
+		return;
+
+	switch (op) {
+	case SC_PKCS15_CACHE_SERVICE_GET:
+		e = cache_get(container, key, name);
+		if (verbose)
+			fprintf(stderr, "get %s:%s %s\n", container, name, e ? "hit" : "miss");
+		if (e == NULL) {
+			send_all(fd, &status, 1);
+			break;
+		}
+		status = SC_PKCS15_CACHE_SERVICE_OK;
+		put_be32(lenbuf, e->len);
+		if (send_all(fd, &status, 1) == 0 && send_all(fd, lenbuf, sizeof(lenbuf)) == 0)
+			send_all(fd, e->data, e->len);
+		break;
+	case SC_PKCS15_CACHE_SERVICE_PUT: {
+		size_t len;
+		u8 *data;
+
+		if (recv_all(fd, lenbuf, sizeof(lenbuf)))
+			return;
+		len = get_be32(lenbuf);
+		if (len > SC_PKCS15_CACHE_SERVICE_MAX_DATA)
+			return;
+		data = malloc(len ? len : 1);
+		if (data == NULL)
+			return;
+		if (recv_all(fd, data, len)) {
+			free(data);
+			return;
+		}
+		if (cache_put(container, key, name, data, len) == 0)
+			status = SC_PKCS15_CACHE_SERVICE_OK;
+		else
+			free(data);
+		if (verbose)
+			fprintf(stderr, "put %s:%s (%lu bytes)\n", container, name, (unsigned long)len);
+		send_all(fd, &status, 1);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	terminate = 1;
+}
+
+static int open_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		util_error("socket path %s is too long", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		util_error("socket: %s", strerror(errno));
+		return -1;
+	}
+
+	/* refuse to replace a running instance, but clean up after a dead one */
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		util_error("%s is already served", path);
+		close(fd);
+		return -1;
+	}
+	unlink(path);
+
+	umask(077);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+			|| listen(fd, 16) < 0) {
+		util_error("cannot listen on %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	sc_context_t *ctx = NULL;
+	sc_context_param_t ctx_param;
+	char path[PATH_MAX], dir[PATH_MAX];
+	struct sigaction sa;
+	int c, fd, r;
+
+	while ((c = getopt_long(argc, argv, "s:m:vh", options, (int *) 0)) != -1) {
+		switch (c) {
+		case 's':
+			opt_socket = optarg;
+			break;
+		case 'm':
+			opt_max_size = (size_t)strtoul(optarg, NULL, 10) * 1024;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case 'h':
+		default:
+			util_print_usage_and_die(app_name, options, option_help, NULL);
+		}
+	}
+
+	/* the context is only needed to locate the cache directory */
+	if (opt_socket == NULL) {
+		memset(&ctx_param, 0, sizeof(ctx_param));
+		ctx_param.ver = 0;
+		ctx_param.app_name = app_name;
+		r = sc_context_create(&ctx, &ctx_param);
+		if (r) {
+			fprintf(stderr, "Failed to establish context: %s\n", sc_strerror(r));
+			return 1;
+		}
+		if (verbose > 1) {
+			ctx->debug = verbose;
+			sc_ctx_log_to_file(ctx, "stderr");
+		}
+
+		r = sc_get_cache_dir(ctx, dir, sizeof(dir));
+		if (r == SC_SUCCESS)
+			r = sc_make_cache_dir(ctx);
+		sc_release_context(ctx);
+		if (r != SC_SUCCESS) {
+			fprintf(stderr, "No usable cache directory: %s\n", sc_strerror(r));
+			return 1;
+		}
+		if (strlen(dir) + 1 + strlen(SC_PKCS15_CACHE_SERVICE_SOCKET) >= sizeof(path)) {
+			fprintf(stderr, "Cache directory path too long\n");
+			return 1;
+		}
+		strcpy(path, dir);
+		strcat(path, "/" SC_PKCS15_CACHE_SERVICE_SOCKET);
+		opt_socket = path;
+	}
+
+	fd = open_socket(opt_socket);
+	if (fd < 0)
+		return 1;
+	if (verbose)
+		fprintf(stderr, "listening on %s\n", opt_socket);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	while (!terminate) {
+		int client = accept(fd, NULL, NULL);
+
+		if (client < 0) {
+			if (errno == EINTR)
+				continue;
+			util_error("accept: %s", strerror(errno));
+			break;
+		}
+		handle_client(client);
+		close(client);
+	}
+
+	close(fd);
+	unlink(opt_socket);
+	while (entries)
+		cache_drop(entries->container, "", entries->name);
+
+	return 0;
+}
@@ -25,6 +25,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <errno.h>
+#include <sys/stat.h>
 #ifdef ENABLE_READLINE
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -36,6 +38,7 @@
 #ifdef _WIN32
 #include <io.h>		/* for_setmode() */
 #include <fcntl.h>	/* for _O_TEXT and _O_BINARY */
+#include <direct.h>	/* for mkdir() */
 #endif
 
 #ifdef HAVE_IO_H
@@ -178,8 +181,8 @@ static struct command	cmds[] = {
 		"put",	"<file-id> [<input-file>]",
 		"copy a local file to the card"		},
 	{ do_get,
-		"get",	"<file-id> [<output-file>]",
-		"copy an EF to a local file"		},
+		"get",	"{<file-id> [<output-file>] | -r [<output-dir>]}",
+		"copy an EF, or with -r all files in the current DF, to local files"	},
 	{ do_get_record,
 		"get_record",	"<file-id> <rec-no> [<output-file>]",
 		"copy a record of an EF to a local file"	},
@@ -1410,17 +1413,221 @@ static int do_unblock(int argc, char **argv)
 	return 0;
 }
 
+/* Reads a whole transparent EF. sc_read_binary() splits the read into
+ * chunks as large as card and reader allow. */
+static int read_binary_file(const sc_file_t *file, u8 **data, size_t *len)
+{
+	u8 *buf;
+	int r;
+
+	*data = NULL;
+	*len = 0;
+	if (file->size == 0)
+		return 0;
+	buf = malloc(file->size);
+	if (buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	r = sc_read_binary(card, 0, buf, file->size, 0);
+	if (r < 0) {
+		free(buf);
+		return r;
+	}
+	*data = buf;
+	*len = r;
+	return 0;
+}
+
+/* path of the file 'fid' in the DF at 'parent', like arg_to_path() */
+static int child_path(const sc_path_t *parent, const u8 *fid, sc_path_t *path)
+{
+	if (parent->type == SC_PATH_TYPE_DF_NAME) {
+		if (parent->len > sizeof(path->aid.value))
+			return SC_ERROR_INVALID_ARGUMENTS;
+		memset(path, 0, sizeof(*path));
+		memcpy(path->aid.value, parent->value, parent->len);
+		path->aid.len = parent->len;
+		path->type = SC_PATH_TYPE_FILE_ID;
+	} else {
+		*path = *parent;
+	}
+	return sc_append_path_id(path, fid, 2);
+}
+
+static int make_dir(const char *dirname)
+{
+#ifdef _WIN32
+	if (mkdir(dirname) < 0 && errno != EEXIST) {
+#else
+	if (mkdir(dirname, 0777) < 0 && errno != EEXIST) {
+#endif
+		perror(dirname);
+		return -1;
+	}
+	return 0;
+}
+
+static int write_local_file(const char *filename, const u8 *data, size_t len)
+{
+	FILE *outf = fopen(filename, "wb");
+
+	if (outf == NULL) {
+		perror(filename);
+		return -1;
+	}
+	if (len > 0 && fwrite(data, len, 1, outf) != 1) {
+		perror(filename);
+		fclose(outf);
+		return -1;
+	}
+	fclose(outf);
+	return 0;
+}
+
+struct get_tree_stats {
+	unsigned int files;
+	size_t bytes;
+	unsigned int failed;
+};
+
+/*
+ * Copies all files of the DF at 'df_path', which must be selected, to
+ * the local directory 'dirname': DFs become directories, transparent EFs
+ * files and the records of record EFs files named <file-id>-<rec-no>.
+ * Every file is selected once; only the DF itself is selected again
+ * after descending into one of its sub-DFs.
+ */
+static void get_tree(const sc_path_t *df_path, const sc_file_t *df, const char *dirname,
+		struct get_tree_stats *stats)
+{
+	u8 list[SC_MAX_EXT_APDU_RESP_SIZE];
+	char filename[PATH_MAX];
+	int r, i, count;
+
+	if (make_dir(dirname) != 0) {
+		stats->failed++;
+		return;
+	}
+
+	r = sc_list_files(card, list, sizeof(list));
+	if (r < 0) {
+		fprintf(stderr, "%s: ", dirname);
+		check_ret(r, SC_AC_OP_LIST_FILES, "Unable to receive file listing", df);
+		stats->failed++;
+		return;
+	}
+	count = r;
+
+	for (i = 0; i + 1 < count; i += 2) {
+		sc_path_t path;
+		sc_file_t *file = NULL;
+		u8 *data = NULL;
+		size_t len = 0;
+
+		snprintf(filename, sizeof(filename), "%s/%02X%02X", dirname, list[i], list[i+1]);
+		if (child_path(df_path, list + i, &path) != SC_SUCCESS) {
+			fprintf(stderr, "%s: path too long\n", filename);
+			stats->failed++;
+			continue;
+		}
+		r = sc_select_file(card, &path, &file);
+		if (r || file == NULL) {
+			fprintf(stderr, "%s: unable to select: %s\n", filename, sc_strerror(r));
+			stats->failed++;
+			continue;
+		}
+
+		if (file->type == SC_FILE_TYPE_DF) {
+			get_tree(&path, file, filename, stats);
+			/* continue the listing in this DF */
+			r = sc_select_file(card, df_path, NULL);
+			if (r) {
+				fprintf(stderr, "%s: unable to select: %s\n", dirname, sc_strerror(r));
+				stats->failed++;
+				sc_file_free(file);
+				return;
+			}
+		} else if (file->ef_structure == SC_FILE_EF_TRANSPARENT) {
+			r = read_binary_file(file, &data, &len);
+			if (r < 0) {
+				fprintf(stderr, "%s: ", filename);
+				check_ret(r, SC_AC_OP_READ, "Read failed", file);
+				stats->failed++;
+			} else if (write_local_file(filename, data, len) != 0) {
+				stats->failed++;
+			} else {
+				stats->files++;
+				stats->bytes += len;
+			}
+			free(data);
+		} else {
+			u8 buf[SC_MAX_EXT_APDU_RESP_SIZE];
+			char recname[PATH_MAX + 16];
+			unsigned int rec;
+
+			for (rec = 1; file->record_count == 0 || rec <= file->record_count; rec++) {
+				r = sc_read_record(card, rec, buf, sizeof(buf), SC_RECORD_BY_REC_NR);
+				if (r == SC_ERROR_RECORD_NOT_FOUND)
+					break;
+				if (r < 0) {
+					fprintf(stderr, "%s: ", filename);
+					check_ret(r, SC_AC_OP_READ, "Read failed", file);
+					stats->failed++;
+					break;
+				}
+				snprintf(recname, sizeof(recname), "%s-%u", filename, rec);
+				if (write_local_file(recname, buf, r) != 0) {
+					stats->failed++;
+					break;
+				}
+				stats->files++;
+				stats->bytes += r;
+			}
+		}
+		sc_file_free(file);
+	}
+}
+
+static int do_get_tree(int argc, char **argv)
+{
+	struct get_tree_stats stats;
+	const char *dirname;
+	int r;
+
+	if (argc > 1)
+		return usage(do_get);
+	dirname = (argc == 1) ? argv[0] : path_to_filename(&current_path, '_', 0);
+
+	memset(&stats, 0, sizeof(stats));
+	r = sc_lock(card);
+	if (r == SC_SUCCESS) {
+		get_tree(&current_path, current_file, dirname, &stats);
+		sc_unlock(card);
+	} else {
+		check_ret(r, SC_AC_OP_SELECT, "Unable to lock card", current_file);
+		stats.failed++;
+	}
+	printf("Total of %u files with %"SC_FORMAT_LEN_SIZE_T"u bytes saved to %s",
+			stats.files, stats.bytes, dirname);
+	if (stats.failed)
+		printf(", %u could not be read", stats.failed);
+	printf(".\n");
+
+	select_current_path_or_die();
+	return stats.failed ? -1 : 0;
+}
+
 static int do_get(int argc, char **argv)
 {
-	u8 buf[SC_MAX_EXT_APDU_RESP_SIZE];
+	u8 *data = NULL;
 	int r, err = 1;
 	size_t count = 0;
-	unsigned int idx = 0;
 	sc_path_t path;
 	sc_file_t *file = NULL;
 	char *filename;
 	FILE *outf = NULL;
 
+	if (argc >= 1 && strcmp(argv[0], "-r") == 0)
+		return do_get_tree(argc - 1, argv + 1);
 	if (argc < 1 || argc > 2)
 		return usage(do_get);
 	if (arg_to_path(argv[0], &path, 0) != 0)
@@ -1451,36 +1658,29 @@ static int do_get(int argc, char **argv)
 		fprintf(stderr, "Only transparent working EFs may be read\n");
 		goto err;
 	}
-	count = file->size;
-	while (count) {
-		/* FIXME sc_read_binary does this kind of fetching in a loop already */
-		int c = count > sizeof(buf) ? sizeof(buf) : count;
-
-		r = sc_read_binary(card, idx, buf, c, 0);
-		if (r < 0) {
-			check_ret(r, SC_AC_OP_READ, "Read failed", file);
-			goto err;
-		}
-		if ((r != c) && (card->type != SC_CARD_TYPE_BELPIC_EID)) {
-			fprintf(stderr, "Expecting %d, got only %d bytes.\n", c, r);
-			goto err;
-		}
-		if ((r == 0) && (card->type == SC_CARD_TYPE_BELPIC_EID))
-			break;
-		fwrite(buf, r, 1, outf);
-		idx += r;
-		count -= r;
+	r = read_binary_file(file, &data, &count);
+	if (r < 0) {
+		check_ret(r, SC_AC_OP_READ, "Read failed", file);
+		goto err;
 	}
+	if ((count != file->size) && (card->type != SC_CARD_TYPE_BELPIC_EID)) {
+		fprintf(stderr, "Expecting %"SC_FORMAT_LEN_SIZE_T"u, got only %"SC_FORMAT_LEN_SIZE_T"u bytes.\n",
+				file->size, count);
+		goto err;
+	}
+	if (count > 0)
+		fwrite(data, count, 1, outf);
 	if (outf == stdout) {
 		fwrite("\n", 1, 1, outf);
 	}
 	else {
-		printf("Total of %d bytes read from %s and saved to %s.\n",
-		       idx, argv[0], filename);
+		printf("Total of %"SC_FORMAT_LEN_SIZE_T"u bytes read from %s and saved to %s.\n",
+		       count, argv[0], filename);
 	}
 
 	err = 0;
 err:
+	free(data);
 	sc_file_free(file);
 #ifdef _WIN32
 	if (outf == stdout)
@@ -30,6 +30,23 @@
 static int run_daemon = 0;
 static struct sc_context *ctx = NULL;
 
+#if !defined(_WIN32) && defined(HAVE_SIGACTION) && defined(HAVE_PTHREAD)
+#include <pthread.h>
+
+/* protects ctx and daemon_done against the cancellation thread */
+static pthread_mutex_t ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+static int daemon_done = 0;
+#define LOCK_CTX()	pthread_mutex_lock(&ctx_lock)
+#define UNLOCK_CTX()	pthread_mutex_unlock(&ctx_lock)
+#else
+#define LOCK_CTX()
+#define UNLOCK_CTX()
+#endif
+
+/* back off after errors, e.g. while pcscd is not running */
+#define RETRY_MIN	1000
+#define RETRY_MAX	60000
+
 #ifndef _WIN32
 #include <time.h>
 
@@ -56,31 +73,41 @@ void notify_daemon()
 	unsigned int event;
 	struct sc_reader *event_reader = NULL;
 	void *reader_states = NULL;
-#ifndef __APPLE__
+	unsigned int retry = 0;
+#if defined(_WIN32)
 	/* timeout adjusted to the maximum response time for WM_CLOSE in case
 	 * canceling doesn't work */
 	const int timeout = 20000;
-#else
+#elif defined(__APPLE__)
 	/* lower timeout, because Apple doesn't support hotplug events */
 	const int timeout = 2000;
+#else
+	/* sleep in pcscd until a reader or card changes, the wait is
+	 * interrupted by setup_cancellation() */
+	const int timeout = -1;
 #endif
 
+	LOCK_CTX();
 	r = sc_establish_context(&ctx, "opensc-notify");
+	UNLOCK_CTX();
 	if (r < 0 || !ctx) {
 		fprintf(stderr, "Failed to create initial context: %s", sc_strerror(r));
-		return;
+		goto out;
 	}
 
 	while (run_daemon) {
 
 		r = sc_wait_for_event(ctx, event_mask,
 				&event_reader, &event, timeout, &reader_states);
-		if (r < 0) {
-			if (r == SC_ERROR_NO_READERS_FOUND) {
-				Sleep(timeout);
-				continue;
-			}
+		if (r < 0 && r != SC_ERROR_EVENT_TIMEOUT) {
+			retry = retry ? retry * 2 : RETRY_MIN;
+			if (retry > RETRY_MAX)
+				retry = RETRY_MAX;
+			if (run_daemon)
+				Sleep(retry);
+			continue;
 		}
+		retry = 0;
 
 		if (event_reader) {
 			if (event & SC_EVENT_CARD_REMOVED
@@ -113,12 +140,18 @@ void notify_daemon()
 		}
 	}
 
+out:
+	LOCK_CTX();
 	if (ctx) {
 		/* free `reader_states` */
 		sc_wait_for_event(ctx, 0, NULL, NULL, 0, &reader_states);
 		sc_release_context(ctx);
 		ctx = NULL;
 	}
+#if !defined(_WIN32) && defined(HAVE_SIGACTION) && defined(HAVE_PTHREAD)
+	daemon_done = 1;
+#endif
+	UNLOCK_CTX();
 }
 
 #ifdef _WIN32
@@ -181,7 +214,6 @@ WinMain(HINSTANCE hInstance, HINSTANCE prevInstance, LPSTR lpCmdLine, int nShowC
 
 #if defined(HAVE_SIGACTION) && defined(HAVE_PTHREAD)
 #include <errno.h>
-#include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
 
@@ -204,7 +236,19 @@ static void *cancellation_proc(void *arg)
 			break;
 		}
 	}
-	sc_cancel(ctx);
+	/* The daemon waits without timeout and may be just about to start a
+	 * new wait, so cancel until it has released the context */
+	for (;;) {
+		LOCK_CTX();
+		if (daemon_done) {
+			UNLOCK_CTX();
+			break;
+		}
+		if (ctx)
+			sc_cancel(ctx);
+		UNLOCK_CTX();
+		Sleep(200);
+	}
 	return NULL;
 }
 
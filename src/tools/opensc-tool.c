@@ -28,6 +28,7 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <time.h>
 #include <sys/stat.h>
 
 #include "libopensc/opensc.h"
@@ -52,7 +53,11 @@ enum {
 	OPT_SERIAL = 0x100,
 	OPT_LIST_ALG,
 	OPT_VERSION,
-	OPT_RESET
+	OPT_RESET,
+	OPT_STATS,
+	OPT_DECODE_TRACE,
+	OPT_MONITOR,
+	OPT_SEND_APDUS
 };
 
 static const struct option options[] = {
@@ -67,10 +72,14 @@ static const struct option options[] = {
 	{ "list-drivers",	0, NULL,		'D' },
 	{ "list-files",		0, NULL,		'f' },
 	{ "send-apdu",		1, NULL,		's' },
+	{ "send-apdus",		1, NULL,	OPT_SEND_APDUS },
 	{ "reader",		1, NULL,		'r' },
 	{ "reset",		2, NULL,	OPT_RESET   },
 	{ "card-driver",	1, NULL,		'c' },
 	{ "list-algorithms",    0, NULL,	OPT_LIST_ALG },
+	{ "stats",		0, NULL,	OPT_STATS },
+	{ "decode-apdu-trace",	1, NULL,	OPT_DECODE_TRACE },
+	{ "monitor",		1, NULL,	OPT_MONITOR },
 	{ "wait",		0, NULL,		'w' },
 	{ "verbose",		0, NULL,		'v' },
 	{ NULL, 0, NULL, 0 }
@@ -88,10 +97,14 @@ static const char *option_help[] = {
 	"Lists all installed card drivers",
 	"Recursively lists files stored on card",
 	"Sends an APDU in format AA:BB:CC:DD:EE:FF...",
+	"Sends the APDUs of file <arg> ('-' for stdin) in one transaction and prints their round trip times",
 	"Uses reader number <arg> [0]",
 	"Does card reset of type <cold|warm> [cold]",
 	"Forces the use of driver <arg> [auto-detect; '?' for list]",
 	"Lists algorithms supported by card",
+	"Prints timing statistics of the performed operations",
+	"Decodes the binary APDU trace file <arg>",
+	"Shows the counters of the processes sharing statistics file <arg>",
 	"Wait for a card to be inserted",
 	"Verbose operation. Use several times to enable debug output.",
 };
@@ -99,6 +112,279 @@ static const char *option_help[] = {
 static sc_context_t *ctx = NULL;
 static sc_card_t *card = NULL;
 
+static void print_timing(const char *name, const struct sc_stats_timing *t)
+{
+	static const unsigned long limits[SC_STATS_HISTOGRAM_SIZE] = SC_STATS_HISTOGRAM_LIMITS_US;
+	unsigned int i;
+
+	printf("%-24s count %llu, total %llu us, avg %llu us, max %llu us\n", name,
+			t->count, t->total_us, t->count ? t->total_us / t->count : 0, t->max_us);
+	if (t->count == 0)
+		return;
+	for (i = 0; i < SC_STATS_HISTOGRAM_SIZE; i++) {
+		if (t->histogram[i] == 0)
+			continue;
+		if (limits[i])
+			printf("%24s < %7lu us: %llu\n", "", limits[i], t->histogram[i]);
+		else
+			printf("%24s >= %6lu us: %llu\n", "", limits[i - 1], t->histogram[i]);
+	}
+}
+
+static void print_operation(const char *name, const struct sc_stats_operation *op)
+{
+	if (op->count == 0)
+		return;
+	printf("%-24s %llu calls, %llu APDUs (%.1f avg, %llu max)\n", name,
+			op->count, op->apdus, (double)op->apdus / (double)op->count,
+			op->max_apdus);
+}
+
+static void print_stats(void)
+{
+	struct sc_stats stats;
+	unsigned int i;
+
+	if (sc_ctx_get_stats(ctx, &stats) != SC_SUCCESS)
+		return;
+
+	printf("Statistics:\n");
+	printf("%-24s config %llu us, reader driver %llu us, card drivers %llu us, readers %llu us\n",
+			"Context creation", stats.startup.config_us, stats.startup.reader_init_us,
+			stats.startup.drivers_us, stats.startup.detect_us);
+	print_timing("APDU round trips", &stats.apdu);
+	for (i = 0; i < sc_ctx_get_reader_count(ctx); i++) {
+		sc_reader_t *r = sc_ctx_get_reader(ctx, i);
+		struct sc_stats_timing apdu;
+
+		if (r && sc_reader_get_stats(r, &apdu) == SC_SUCCESS && apdu.count)
+			print_timing(r->name, &apdu);
+	}
+	printf("%-24s %llu\n", "APDU errors", stats.apdu_errors);
+	print_timing("Lock wait", &stats.lock_wait);
+	print_timing("Queue wait", &stats.queue_wait);
+	printf("%-24s %llu (at most %llu)\n", "Queued requests", stats.queue_depth,
+			stats.queue_depth_max);
+	printf("%-24s %llu (%llu from cache)\n", "SELECT FILE", stats.select_count,
+			stats.select_cached);
+	printf("%-24s %llu from cache\n", "SELECT AID", stats.select_aid_cached);
+	printf("%-24s %llu (%llu bytes)\n", "READ BINARY", stats.read_binary_count,
+			stats.read_binary_bytes);
+	printf("%-24s %llu hits, %llu misses\n", "File cache", stats.file_cache_hits,
+			stats.file_cache_misses);
+	printf("Round trips per operation:\n");
+	print_operation("Connect card", &stats.connect);
+	print_operation("PKCS#15 bind", &stats.pkcs15_bind);
+	print_operation("Read binary", &stats.read_binary);
+	print_operation("PIN command", &stats.pin_cmd);
+	print_operation("Compute signature", &stats.compute_signature);
+	print_operation("Decipher", &stats.decipher);
+}
+
+static int compare_trace_records(const void *a, const void *b)
+{
+	const struct sc_apdu_trace_record *ra = *(const struct sc_apdu_trace_record * const *)a;
+	const struct sc_apdu_trace_record *rb = *(const struct sc_apdu_trace_record * const *)b;
+
+	return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+static int decode_apdu_trace(const char *filename)
+{
+	struct sc_apdu_trace_header header;
+	struct sc_apdu_trace_record *records = NULL, **sorted = NULL;
+	unsigned int i, count = 0;
+	int err = 1;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot open '%s': %s\n", filename, strerror(errno));
+		return 1;
+	}
+	if (fread(&header, sizeof header, 1, f) != 1
+			|| memcmp(header.magic, SC_APDU_TRACE_MAGIC, sizeof header.magic) != 0
+			|| header.version != SC_APDU_TRACE_VERSION
+			|| header.record_size != sizeof(struct sc_apdu_trace_record)
+			|| header.capacity == 0) {
+		fprintf(stderr, "'%s' is not an APDU trace of this OpenSC version\n", filename);
+		goto out;
+	}
+	records = calloc(header.capacity, sizeof *records);
+	sorted = calloc(header.capacity, sizeof *sorted);
+	if (records == NULL || sorted == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+	if (fread(records, sizeof *records, header.capacity, f) != header.capacity) {
+		fprintf(stderr, "'%s' is truncated\n", filename);
+		goto out;
+	}
+
+	for (i = 0; i < header.capacity; i++)
+		if (records[i].seq != 0)
+			sorted[count++] = &records[i];
+	qsort(sorted, count, sizeof *sorted, compare_trace_records);
+
+	printf("%u APDUs recorded, %llu overwritten\n", count, header.head - count);
+	for (i = 0; i < count; i++) {
+		const struct sc_apdu_trace_record *rec = sorted[i];
+		unsigned long long when = header.start_time;
+		char date[32] = "";
+		time_t secs;
+		struct tm *tm;
+
+		if (rec->timestamp >= header.start_mono)
+			when += rec->timestamp - header.start_mono;
+		secs = (time_t)(when / 1000000);
+		tm = localtime(&secs);
+		if (tm)
+			strftime(date, sizeof date, "%Y-%m-%d %H:%M:%S", tm);
+
+		printf("%s.%06u %5u [%s] %02X %02X %02X %02X Lc=%u Le=%u -> ",
+				date, (unsigned int)(when % 1000000), rec->pid, rec->reader,
+				rec->cla, rec->ins, rec->p1, rec->p2, rec->lc, rec->le);
+		if (rec->rv < 0)
+			printf("%s", sc_strerror(rec->rv));
+		else
+			printf("%02X %02X, %u bytes", rec->sw1, rec->sw2, rec->resplen);
+		printf(" (%u us)\n", rec->duration_us);
+	}
+	err = 0;
+
+out:
+	free(sorted);
+	free(records);
+	fclose(f);
+	return err;
+}
+
+/* Copies an entry without the writer being in between, see
+ * struct sc_stats_shm_entry */
+static int read_stats_entry(FILE *f, unsigned int i, struct sc_stats_shm_entry *entry)
+{
+	long offset = (long)(sizeof(struct sc_stats_shm_header) + i * sizeof *entry);
+	unsigned long long seq;
+	int tries;
+
+	for (tries = 0; tries < 10; tries++) {
+		if (fseek(f, offset, SEEK_SET) != 0 || fread(entry, sizeof *entry, 1, f) != 1
+				|| fseek(f, offset, SEEK_SET) != 0 || fread(&seq, sizeof seq, 1, f) != 1)
+			return -1;
+		if (seq == entry->seq && !(seq & 1))
+			return 0;
+	}
+	return -1;
+}
+
+static unsigned long long average_us(const struct sc_stats_timing *t)
+{
+	return t->count ? t->total_us / t->count : 0;
+}
+
+static int print_shared_stats(FILE *f)
+{
+	struct sc_stats_shm_entry entry;
+	static struct sc_stats_shm_reader readers[SC_STATS_SHM_PROCESSES * SC_STATS_SHM_READERS];
+	static unsigned int users[SC_STATS_SHM_PROCESSES * SC_STATS_SHM_READERS];
+	unsigned int i, j, k, nreaders = 0;
+
+	printf("%7s %-16s %-16s %-7s %9s %8s %8s %6s %10s %13s %6s %6s\n",
+			"PID", "Process", "App", "State", "APDUs", "Avg us", "Max us",
+			"Errors", "Lock us", "Cache hit/mis", "Signs", "PINs");
+	for (i = 0; i < SC_STATS_SHM_PROCESSES; i++) {
+		char cache[32];
+
+		if (read_stats_entry(f, i, &entry) != 0)
+			return 1;
+		if (entry.pid == 0)
+			continue;
+		snprintf(cache, sizeof cache, "%llu/%llu",
+				entry.stats.file_cache_hits, entry.stats.file_cache_misses);
+		printf("%7u %-16.16s %-16.16s %-7s %9llu %8llu %8llu %6llu %10llu %13s %6llu %6llu\n",
+				entry.pid, entry.process, entry.app_name,
+				entry.exited ? "exited" : "running",
+				entry.stats.apdu.count, average_us(&entry.stats.apdu),
+				entry.stats.apdu.max_us, entry.stats.apdu_errors,
+				entry.stats.lock_wait.total_us, cache,
+				entry.stats.compute_signature.count, entry.stats.pin_cmd.count);
+
+		/* sum up the readers over all processes */
+		for (j = 0; j < entry.nreaders && j < SC_STATS_SHM_READERS; j++) {
+			const struct sc_stats_shm_reader *r = &entry.readers[j];
+
+			for (k = 0; k < nreaders; k++)
+				if (strcmp(readers[k].name, r->name) == 0)
+					break;
+			if (k == nreaders) {
+				memset(&readers[k], 0, sizeof readers[k]);
+				memcpy(readers[k].name, r->name, sizeof readers[k].name);
+				users[k] = 0;
+				nreaders++;
+			}
+			readers[k].apdu.count += r->apdu.count;
+			readers[k].apdu.total_us += r->apdu.total_us;
+			if (r->apdu.max_us > readers[k].apdu.max_us)
+				readers[k].apdu.max_us = r->apdu.max_us;
+			if (r->apdu.count)
+				users[k]++;
+		}
+	}
+
+	printf("\n%-40s %9s %8s %8s %9s\n", "Reader", "APDUs", "Avg us", "Max us", "Processes");
+	for (k = 0; k < nreaders; k++)
+		printf("%-40.40s %9llu %8llu %8llu %9u\n", readers[k].name,
+				readers[k].apdu.count, average_us(&readers[k].apdu),
+				readers[k].apdu.max_us, users[k]);
+	return 0;
+}
+
+static int monitor_shared_stats(const char *filename)
+{
+	struct sc_stats_shm_header header;
+	int err = 1, live = 0;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot open '%s': %s\n", filename, strerror(errno));
+		return 1;
+	}
+	/* every snapshot reads what the processes wrote last */
+	setvbuf(f, NULL, _IONBF, 0);
+	if (fread(&header, sizeof header, 1, f) != 1
+			|| memcmp(header.magic, SC_STATS_SHM_MAGIC, sizeof header.magic) != 0
+			|| header.version != SC_STATS_SHM_VERSION
+			|| header.entry_size != sizeof(struct sc_stats_shm_entry)
+			|| header.capacity != SC_STATS_SHM_PROCESSES) {
+		fprintf(stderr, "'%s' is not a statistics file of this OpenSC version\n", filename);
+		goto out;
+	}
+#ifdef HAVE_UNISTD_H
+	/* refresh until interrupted when watched */
+	live = isatty(STDOUT_FILENO);
+#endif
+
+	do {
+		if (live)
+			printf("\033[H\033[2J");
+		if (print_shared_stats(f) != 0) {
+			fprintf(stderr, "'%s' is truncated\n", filename);
+			goto out;
+		}
+		fflush(stdout);
+#ifdef HAVE_UNISTD_H
+		if (live)
+			sleep(1);
+#endif
+	} while (live);
+	err = 0;
+
+out:
+	fclose(f);
+	return err;
+}
+
 static int opensc_info(void)
 {
 	printf (
@@ -533,6 +819,122 @@ static int send_apdu(void)
 	return 0;
 }
 
+static int compare_latency(const void *a, const void *b)
+{
+	unsigned long long la = *(const unsigned long long *)a;
+	unsigned long long lb = *(const unsigned long long *)b;
+
+	return la < lb ? -1 : la > lb;
+}
+
+/* Sends the APDUs of a file, one per line, within one card transaction */
+static int send_apdu_batch(const char *filename)
+{
+	const size_t line_size = 3 * SC_MAX_EXT_APDU_BUFFER_SIZE + 2;
+	sc_apdu_t apdu;
+	u8 buf[SC_MAX_EXT_APDU_BUFFER_SIZE],
+	  rbuf[SC_MAX_EXT_APDU_BUFFER_SIZE];
+	unsigned long long start, elapsed, total = 0, *latency = NULL, *tmp;
+	size_t count = 0, size = 0, errors = 0, len0, i;
+	unsigned int lineno = 0;
+	char *line, *p;
+	FILE *f;
+	int r, err = 0;
+
+	if (strcmp(filename, "-") == 0)
+		f = stdin;
+	else if ((f = fopen(filename, "r")) == NULL) {
+		fprintf(stderr, "Cannot open %s: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	line = malloc(line_size);
+	if (line == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		err = 1;
+		goto out;
+	}
+
+	r = sc_lock(card);
+	if (r) {
+		fprintf(stderr, "Failed to lock the card: %s\n", sc_strerror(r));
+		err = 1;
+		goto out;
+	}
+	while (fgets(line, (int)line_size, f) != NULL) {
+		lineno++;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		i = strlen(p);
+		while (i > 0 && (p[i - 1] == '\n' || p[i - 1] == '\r'
+					|| p[i - 1] == ' ' || p[i - 1] == '\t'))
+			p[--i] = '\0';
+		if (*p == '\0')
+			continue;
+
+		len0 = sizeof(buf);
+		r = sc_hex_to_bin(p, buf, &len0);
+		if (r == SC_SUCCESS)
+			r = sc_bytes2apdu(card->ctx, buf, len0, &apdu);
+		if (r) {
+			fprintf(stderr, "Line %u: invalid APDU: %s\n", lineno, sc_strerror(r));
+			err = 2;
+			break;
+		}
+		apdu.resp = rbuf;
+		apdu.resplen = sizeof(rbuf);
+
+		start = util_time_us();
+		r = sc_transmit_apdu(card, &apdu);
+		elapsed = util_time_us() - start;
+
+		if (count == size) {
+			size = size ? 2 * size : 256;
+			tmp = realloc(latency, size * sizeof(*latency));
+			if (tmp == NULL) {
+				fprintf(stderr, "Not enough memory\n");
+				err = 1;
+				break;
+			}
+			latency = tmp;
+		}
+		latency[count++] = elapsed;
+		total += elapsed;
+
+		printf("%5u  %02X %02X %02X %02X  ", lineno, buf[0], buf[1], buf[2], buf[3]);
+		if (r) {
+			errors++;
+			printf("%-22s %8llu us\n", sc_strerror(r), elapsed);
+			continue;
+		}
+		printf("SW=%02X%02X %5"SC_FORMAT_LEN_SIZE_T"u bytes     %8llu us\n",
+				apdu.sw1, apdu.sw2, apdu.resplen, elapsed);
+		if (verbose && apdu.resplen)
+			util_hex_dump_asc(stdout, apdu.resp, apdu.resplen, -1);
+	}
+	sc_unlock(card);
+
+	if (count > 0) {
+		qsort(latency, count, sizeof(*latency), compare_latency);
+		printf("%"SC_FORMAT_LEN_SIZE_T"u APDUs (%"SC_FORMAT_LEN_SIZE_T"u failed) in %llu us, %.1f APDUs/s\n",
+				count, errors, total, total ? count * 1e6 / total : 0.0);
+		printf("Round trip (us): min %llu, avg %llu, p50 %llu, p90 %llu, p99 %llu, max %llu\n",
+				latency[0], total / count, latency[(count - 1) * 50 / 100],
+				latency[(count - 1) * 90 / 100], latency[(count - 1) * 99 / 100],
+				latency[count - 1]);
+	}
+	if (errors && !err)
+		err = 1;
+
+out:
+	free(latency);
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return err;
+}
+
 static void print_serial(sc_card_t *in_card)
 {
 	int r;
@@ -693,6 +1095,10 @@ int main(int argc, char *argv[])
 	int do_print_name = 0;
 	int do_list_algorithms = 0;
 	int do_reset = 0;
+	int do_print_stats = 0;
+	const char *opt_trace_file = NULL;
+	const char *opt_monitor_file = NULL;
+	const char *opt_apdu_file = NULL;
 	int action_count = 0;
 	const char *opt_driver = NULL;
 	const char *opt_conf_entry = NULL;
@@ -793,6 +1199,21 @@ int main(int argc, char *argv[])
 			opt_reset_type = optarg;
 			action_count++;
 			break;
+		case OPT_STATS:
+			do_print_stats = 1;
+			break;
+		case OPT_DECODE_TRACE:
+			opt_trace_file = optarg;
+			action_count++;
+			break;
+		case OPT_MONITOR:
+			opt_monitor_file = optarg;
+			action_count++;
+			break;
+		case OPT_SEND_APDUS:
+			opt_apdu_file = optarg;
+			action_count++;
+			break;
 		}
 	}
 	if (action_count == 0)
@@ -808,9 +1229,24 @@ int main(int argc, char *argv[])
 		action_count--;
 	}
 
+	if (opt_trace_file) {
+		if ((err = decode_apdu_trace(opt_trace_file)))
+			goto end;
+		action_count--;
+	}
+	if (opt_monitor_file) {
+		if ((err = monitor_shared_stats(opt_monitor_file)))
+			goto end;
+		action_count--;
+	}
+	if (action_count <= 0)
+		goto end;
+
 	memset(&ctx_param, 0, sizeof(ctx_param));
 	ctx_param.ver      = 0;
 	ctx_param.app_name = app_name;
+	if (do_set_conf_entry)
+		ctx_param.flags |= SC_CTX_FLAG_PRIVATE_CONF;
 
 	r = sc_context_create(&ctx, &ctx_param);
 	if (r) {
@@ -902,6 +1338,11 @@ int main(int argc, char *argv[])
 			goto end;
 		action_count--;
 	}
+	if (opt_apdu_file) {
+		if ((err = send_apdu_batch(opt_apdu_file)))
+			goto end;
+		action_count--;
+	}
 
 	if (do_list_files) {
 		if ((err = list_files()))
@@ -921,6 +1362,8 @@ int main(int argc, char *argv[])
 		action_count--;
 	}
 end:
+	if (do_print_stats && ctx)
+		print_stats();
 	sc_disconnect_card(card);
 	sc_release_context(ctx);
 	return err;
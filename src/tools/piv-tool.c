@@ -54,6 +54,9 @@
 #include "libopensc/cardctl.h"
 #include "libopensc/cards.h"
 #include "libopensc/asn1.h"
+#ifdef ENABLE_ZLIB
+#include "libopensc/compression.h"
+#endif
 #include "util.h"
 #include "libopensc/sc-ossl-compat.h"
 
@@ -69,6 +72,13 @@ enum {
 	OPT_SERIAL = 0x100,
 };
 
+/* how load_cert() gets a compressed certificate */
+enum {
+	CERT_UNCOMPRESSED = 0,
+	CERT_GZIPPED_FILE,	/* the file is gzipped already */
+	CERT_COMPRESS,		/* gzip the certificate before loading it */
+};
+
 static const struct option options[] = {
 	{ "serial",		0, NULL,	OPT_SERIAL  },
 	{ "name",		0, NULL,		'n' },
@@ -77,6 +87,7 @@ static const struct option options[] = {
 	{ "object",		1, NULL,		'O' },
 	{ "cert",		1, NULL,		'C' },
 	{ "compresscert",	1, NULL,		'Z' },
+	{ "manifest",		1, NULL,		'M' },
 	{ "out",		1, NULL, 		'o' },
 	{ "in",			1, NULL, 		'i' },
 	{ "send-apdu",		1, NULL,		's' },
@@ -92,8 +103,9 @@ static const char *option_help[] = {
 	"Authenticate using default 3DES key",
 	"Generate key <ref>:<alg> 9A:06 on card, and output pubkey",
 	"Load an object <containerID> containerID as defined in 800-73 without leading 0x",
-	"Load a cert <ref> where <ref> is 9A,9C,9D or 9E",
+	"Load a cert <ref> where <ref> is 9A,9C,9D,9E or 82-95",
 	"Load a cert that has been gzipped <ref>",
+	"Load all objects and certs listed in file <arg>",
 	"Output file for cert or key",
 	"Input file for cert",
 	"Sends an APDU in format AA:BB:CC:DD:EE:FF...",
@@ -156,6 +168,8 @@ static int load_object(const char * object_id, const char * object_file)
 	}
 	/* leave 8 bits for flags, and pass in total length */
 	r = sc_write_binary(card, 0, der, derlen, derlen<<8);
+	if (r > 0)
+		r = 0;
 
 err:
 	free(der);
@@ -223,6 +237,25 @@ static int load_cert(const char * cert_id, const char * cert_file,
 		p = der;
 		i2d_X509(cert, &p);
 	}
+	if (compress == CERT_COMPRESS) {
+#ifdef ENABLE_ZLIB
+		/* gzip output is at most a few bytes per 16 KiB larger */
+		size_t gzlen = derlen + derlen / 1000 + 64;
+		u8 *gz = malloc(gzlen);
+
+		if (gz == NULL || sc_compress(gz, &gzlen, der, derlen, COMPRESSION_GZIP) != SC_SUCCESS) {
+			fprintf(stderr, "unable to compress cert %s\n", cert_file);
+			free(gz);
+			goto err;
+		}
+		free(der);
+		der = gz;
+		derlen = gzlen;
+#else
+		fprintf(stderr, "built without zlib, cannot compress cert %s\n", cert_file);
+		goto err;
+#endif
+	}
 	sc_hex_to_bin(cert_id, buf,&buflen);
 
 	switch (buf[0]) {
@@ -231,7 +264,14 @@ static int load_cert(const char * cert_id, const char * cert_file,
 		case 0x9d: sc_format_path("0102",&path); break;
 		case 0x9e: sc_format_path("0500",&path); break;
 		default:
-			fprintf(stderr,"cert must be 9A, 9C, 9D or 9E\n");
+			if (buf[0] >= 0x82 && buf[0] <= 0x95) {
+				/* retired key management slots 1 to 20 */
+				u8 id[2] = { 0x10, (u8) (buf[0] - 0x81) };
+
+				sc_path_set(&path, SC_PATH_TYPE_PATH, id, sizeof id, 0, 0);
+				break;
+			}
+			fprintf(stderr,"cert must be 9A, 9C, 9D, 9E or 82-95\n");
 			r = 2;
 			goto err;
 	}
@@ -243,7 +283,10 @@ static int load_cert(const char * cert_id, const char * cert_file,
 	}
 	/* we pass length  and  8 bits of flag to card-piv.c write_binary */
 	/* pass in its a cert and if needs compress */
-	r = sc_write_binary(card, 0, der, derlen, (derlen<<8) | (compress<<4) | 1);
+	r = sc_write_binary(card, 0, der, derlen,
+			(derlen<<8) | ((compress != CERT_UNCOMPRESSED)<<4) | 1);
+	if (r > 0)
+		r = 0;
 
 err:
 	free(der);
@@ -252,6 +295,72 @@ err:
 
 	return r;
 }
+/*
+ * Loads the objects and certs listed in 'manifest_file' in this session,
+ * one per line:
+ *   object <containerID> <file>
+ *   cert <ref> <PEM file> [compress]
+ *   compresscert <ref> <gzipped file>
+ * Empty lines and lines starting with '#' are skipped.
+ */
+static int load_manifest(const char *manifest_file)
+{
+	FILE *fp;
+	char line[1024];
+	unsigned int lineno = 0, loaded = 0;
+	int r = 0;
+
+	if ((fp = fopen(manifest_file, "r")) == NULL) {
+		printf("Cannot open manifest file, %s %s\n",
+				manifest_file, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof line, fp) != NULL) {
+		const char *sep = " \t\r\n";
+		char *kind, *id, *file, *opt;
+		int bad = 0;
+
+		lineno++;
+		kind = strtok(line, sep);
+		if (kind == NULL || *kind == '#')
+			continue;
+		id = strtok(NULL, sep);
+		file = strtok(NULL, sep);
+		opt = strtok(NULL, sep);
+
+		if (id == NULL || file == NULL) {
+			bad = 1;
+		} else if (!strcmp(kind, "object") && opt == NULL) {
+			r = load_object(id, file);
+		} else if (!strcmp(kind, "cert") && (opt == NULL || !strcmp(opt, "compress"))) {
+			r = load_cert(id, file, opt ? CERT_COMPRESS : CERT_UNCOMPRESSED);
+		} else if (!strcmp(kind, "compresscert") && opt == NULL) {
+			r = load_cert(id, file, CERT_GZIPPED_FILE);
+		} else {
+			bad = 1;
+		}
+		if (bad) {
+			fprintf(stderr, "%s:%u: expecting 'object <containerID> <file>', "
+					"'cert <ref> <file> [compress]' or 'compresscert <ref> <file>'\n",
+					manifest_file, lineno);
+			r = 2;
+			break;
+		}
+		if (r) {
+			fprintf(stderr, "%s:%u: loading %s failed\n", manifest_file, lineno, file);
+			break;
+		}
+		loaded++;
+		if (verbose)
+			printf("Loaded %s %s from %s\n", kind, id, file);
+	}
+	fclose(fp);
+
+	printf("Loaded %u objects and certs from %s\n", loaded, manifest_file);
+	return r;
+}
+
 static int admin_mode(const char* admin_info)
 {
 	int r;
@@ -474,6 +583,7 @@ int main(int argc, char *argv[])
 	int do_gen_key = 0;
 	int do_load_cert = 0;
 	int do_load_object = 0;
+	int do_load_manifest = 0;
 	int compress_cert = 0;
 	int do_print_serial = 0;
 	int do_print_name = 0;
@@ -484,10 +594,11 @@ int main(int argc, char *argv[])
 	const char *object_id = NULL;
 	const char *key_info = NULL;
 	const char *admin_info = NULL;
+	const char *manifest_file = NULL;
 	sc_context_param_t ctx_param;
 	char **old_apdus = NULL;
 
-	while ((c = getopt_long(argc, argv, "nA:G:O:Z:C:i:o:r:fvs:c:w", options, (int *) 0)) != -1) {
+	while ((c = getopt_long(argc, argv, "nA:G:O:Z:C:M:i:o:r:fvs:c:w", options, (int *) 0)) != -1) {
 		switch (c) {
 		case OPT_SERIAL:
 			do_print_serial = 1;
@@ -528,13 +639,18 @@ int main(int argc, char *argv[])
 			action_count++;
 			break;
 		case 'Z':
-			compress_cert = 1;
+			compress_cert = CERT_GZIPPED_FILE;
 			/* fall through */
 		case 'C':
 			do_load_cert = 1;
 			cert_id = optarg;
 			action_count++;
 			break;
+		case 'M':
+			do_load_manifest = 1;
+			manifest_file = optarg;
+			action_count++;
+			break;
 		case 'i':
 			in_file = optarg;
 			break;
@@ -640,6 +756,11 @@ int main(int argc, char *argv[])
 			goto end;
 		action_count--;
 	}
+	if (do_load_manifest) {
+		if ((err = load_manifest(manifest_file)))
+			goto end;
+		action_count--;
+	}
 	if (do_print_serial) {
 		if (verbose)
 			printf("Card serial number:");
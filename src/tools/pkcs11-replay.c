@@ -0,0 +1,896 @@
+/*
+ * pkcs11-replay.c: re-issues a call trace of pkcs11-spy
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Reads the JSON lines that pkcs11-spy writes with PKCS11SPY_TRACE and
+ * issues the calls again against a PKCS#11 module, keeping the recorded
+ * pace (or a multiple of it) in one or more threads. Slots, sessions and
+ * objects are mapped to the ones the module returns in the replay; data
+ * is replaced by filler bytes of the recorded length, so the calls
+ * exercise the same paths but results of decryptions and verifications
+ * differ. Calls the trace does not describe fully, like key generation,
+ * are skipped.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "pkcs11/pkcs11.h"
+#include "common/libpkcs11.h"
+#include "util.h"
+
+static const char *app_name = "pkcs11-replay";
+
+static const char *opt_module = DEFAULT_PKCS11_PROVIDER;
+static const char *opt_pin = NULL;
+static double opt_speed = 1.0;
+static unsigned int opt_threads = 1;
+static unsigned int opt_repeat = 1;
+static int verbose = 0;
+
+static const struct option options[] = {
+	{ "module",	1, NULL,	'm' },
+	{ "speed",	1, NULL,	's' },
+	{ "threads",	1, NULL,	't' },
+	{ "repeat",	1, NULL,	'r' },
+	{ "pin",	1, NULL,	'p' },
+	{ "verbose",	0, NULL,	'v' },
+	{ "help",	0, NULL,	'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static const char *option_help[] = {
+	"Specify the module to load (default:" DEFAULT_PKCS11_PROVIDER ")",
+	"Replay <arg> times as fast as recorded, 0 for no pauses [1]",
+	"Replay the trace in <arg> threads at once [1]",
+	"Replay the trace <arg> times in every thread [1]",
+	"PIN for the recorded C_Login calls",
+	"Print calls whose result differs from the trace. Use twice to print every call.",
+	"Print this help message",
+};
+
+enum {
+	K_SKIP,
+	K_INITIALIZE,
+	K_FINALIZE,
+	K_GET_INFO,
+	K_SLOT_LIST,
+	K_SLOT_INFO,
+	K_TOKEN_INFO,
+	K_MECH_LIST,
+	K_MECH_INFO,
+	K_OPEN_SESSION,
+	K_CLOSE_SESSION,
+	K_CLOSE_ALL,
+	K_SESSION_INFO,
+	K_LOGIN,
+	K_LOGOUT,
+	K_FIND_INIT,
+	K_FIND,
+	K_FIND_FINAL,
+	K_GET_ATTR,
+	K_INIT_KEY,	/* (session, mechanism, key) */
+	K_DIGEST_INIT,
+	K_DATA,		/* (session, in, in length, out, out length) */
+	K_IN,		/* (session, in, in length) */
+	K_OUT,		/* (session, out, out length) */
+	K_VERIFY,
+	K_RANDOM
+};
+
+typedef CK_RV (*init_key_fn)(CK_SESSION_HANDLE, CK_MECHANISM_PTR, CK_OBJECT_HANDLE);
+typedef CK_RV (*data_fn)(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+typedef CK_RV (*in_fn)(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG);
+typedef CK_RV (*out_fn)(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG_PTR);
+
+#define FN(name, kind)	{ #name, kind, offsetof(CK_FUNCTION_LIST, name) }
+
+static const struct function {
+	const char *name;
+	int kind;
+	size_t offset;		/* in CK_FUNCTION_LIST */
+} functions[] = {
+	FN(C_Initialize, K_INITIALIZE),
+	FN(C_Finalize, K_FINALIZE),
+	FN(C_GetInfo, K_GET_INFO),
+	FN(C_GetSlotList, K_SLOT_LIST),
+	FN(C_GetSlotInfo, K_SLOT_INFO),
+	FN(C_GetTokenInfo, K_TOKEN_INFO),
+	FN(C_GetMechanismList, K_MECH_LIST),
+	FN(C_GetMechanismInfo, K_MECH_INFO),
+	FN(C_OpenSession, K_OPEN_SESSION),
+	FN(C_CloseSession, K_CLOSE_SESSION),
+	FN(C_CloseAllSessions, K_CLOSE_ALL),
+	FN(C_GetSessionInfo, K_SESSION_INFO),
+	FN(C_Login, K_LOGIN),
+	FN(C_Logout, K_LOGOUT),
+	FN(C_FindObjectsInit, K_FIND_INIT),
+	FN(C_FindObjects, K_FIND),
+	FN(C_FindObjectsFinal, K_FIND_FINAL),
+	FN(C_GetAttributeValue, K_GET_ATTR),
+	FN(C_EncryptInit, K_INIT_KEY),
+	FN(C_DecryptInit, K_INIT_KEY),
+	FN(C_SignInit, K_INIT_KEY),
+	FN(C_SignRecoverInit, K_INIT_KEY),
+	FN(C_VerifyInit, K_INIT_KEY),
+	FN(C_VerifyRecoverInit, K_INIT_KEY),
+	FN(C_DigestInit, K_DIGEST_INIT),
+	FN(C_Encrypt, K_DATA),
+	FN(C_EncryptUpdate, K_DATA),
+	FN(C_Decrypt, K_DATA),
+	FN(C_DecryptUpdate, K_DATA),
+	FN(C_Digest, K_DATA),
+	FN(C_Sign, K_DATA),
+	FN(C_SignRecover, K_DATA),
+	FN(C_VerifyRecover, K_DATA),
+	FN(C_DigestEncryptUpdate, K_DATA),
+	FN(C_DecryptDigestUpdate, K_DATA),
+	FN(C_SignEncryptUpdate, K_DATA),
+	FN(C_DecryptVerifyUpdate, K_DATA),
+	FN(C_DigestUpdate, K_IN),
+	FN(C_SignUpdate, K_IN),
+	FN(C_VerifyUpdate, K_IN),
+	FN(C_VerifyFinal, K_IN),
+	FN(C_SeedRandom, K_IN),
+	FN(C_EncryptFinal, K_OUT),
+	FN(C_DecryptFinal, K_OUT),
+	FN(C_DigestFinal, K_OUT),
+	FN(C_SignFinal, K_OUT),
+	FN(C_Verify, K_VERIFY),
+	FN(C_GenerateRandom, K_RANDOM),
+	/* everything else is counted, but not replayed */
+	FN(C_InitToken, K_SKIP),
+	FN(C_InitPIN, K_SKIP),
+	FN(C_SetPIN, K_SKIP),
+	FN(C_GetOperationState, K_SKIP),
+	FN(C_SetOperationState, K_SKIP),
+	FN(C_CreateObject, K_SKIP),
+	FN(C_CopyObject, K_SKIP),
+	FN(C_DestroyObject, K_SKIP),
+	FN(C_GetObjectSize, K_SKIP),
+	FN(C_SetAttributeValue, K_SKIP),
+	FN(C_DigestKey, K_SKIP),
+	FN(C_GenerateKey, K_SKIP),
+	FN(C_GenerateKeyPair, K_SKIP),
+	FN(C_WrapKey, K_SKIP),
+	FN(C_UnwrapKey, K_SKIP),
+	FN(C_DeriveKey, K_SKIP),
+	FN(C_GetFunctionStatus, K_SKIP),
+	FN(C_CancelFunction, K_SKIP),
+	FN(C_WaitForSlotEvent, K_SKIP),
+};
+
+#define FUNCTION_COUNT	(sizeof(functions) / sizeof(functions[0]))
+
+struct attr {
+	CK_ATTRIBUTE_TYPE type;
+	long len;		/* -1 for a length query */
+	CK_BYTE_PTR value;	/* recorded value, or NULL */
+	CK_ULONG value_len;
+};
+
+struct call {
+	const struct function *fn;
+	unsigned long long t;	/* start in microseconds since the trace began */
+	CK_RV rv;
+	CK_ULONG slot, session, object, key, mech, mparam, flags, user, pin;
+	CK_ULONG in, sig, out, max, present;
+	long obuf;		/* output buffer size, -1 for a length query */
+	CK_ULONG *handles;	/* slots of C_GetSlotList, objects of C_FindObjects */
+	size_t handle_count;
+	struct attr *tmpl;
+	size_t tmpl_count;
+};
+
+static struct call *calls = NULL;
+static size_t call_count = 0;
+
+static CK_FUNCTION_LIST_PTR p11 = NULL;
+
+static struct {
+	unsigned long count;
+	unsigned long errors;
+	unsigned long changed;	/* result differs from the trace */
+	unsigned long skipped;
+	unsigned long long total_us;
+	unsigned long long max_us;
+} results[FUNCTION_COUNT];
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t results_lock = PTHREAD_MUTEX_INITIALIZER;
+#define RESULTS_LOCK()		pthread_mutex_lock(&results_lock)
+#define RESULTS_UNLOCK()	pthread_mutex_unlock(&results_lock)
+#else
+#define RESULTS_LOCK()
+#define RESULTS_UNLOCK()
+#endif
+
+/* handles of the trace and the ones the module returned instead */
+struct handle_map {
+	CK_ULONG *from, *to;
+	size_t count, size;
+};
+
+struct worker {
+	unsigned int id;
+	struct handle_map slots, sessions, objects;
+#ifdef HAVE_PTHREAD
+	pthread_t thread;
+#endif
+};
+
+/*
+ * The trace is written by pkcs11-spy only, so the parser knows its
+ * shape: flat objects of numbers, strings of names and hex digits, arrays
+ * of numbers and arrays of [type,length] or [type,length,"hex"].
+ */
+static const char *
+json_value(const char *line, const char *key)
+{
+	char pattern[32];
+	const char *p;
+
+	snprintf(pattern, sizeof pattern, "\"%s\":", key);
+	p = strstr(line, pattern);
+	return p ? p + strlen(pattern) : NULL;
+}
+
+static int
+json_ulong(const char *line, const char *key, CK_ULONG *value)
+{
+	const char *p = json_value(line, key);
+
+	if (p == NULL)
+		return 0;
+	*value = strtoul(p, NULL, 10);
+	return 1;
+}
+
+static CK_BYTE_PTR
+json_hex(const char *p, CK_ULONG *len)
+{
+	CK_BYTE_PTR value;
+	const char *end = strchr(p, '"');
+	size_t i, n;
+
+	if (end == NULL)
+		return NULL;
+	n = (size_t)(end - p) / 2;
+	value = malloc(n ? n : 1);
+	if (value == NULL)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		unsigned int byte;
+
+		if (sscanf(p + 2 * i, "%2x", &byte) != 1)
+			break;
+		value[i] = (CK_BYTE)byte;
+	}
+	*len = i;
+	return value;
+}
+
+static CK_ULONG *
+json_ulongs(const char *line, const char *key, size_t *count)
+{
+	const char *p = json_value(line, key);
+	CK_ULONG *values = NULL, *tmp;
+	size_t n = 0;
+	char *end;
+
+	*count = 0;
+	if (p == NULL || *p++ != '[')
+		return NULL;
+	while (*p != ']' && *p != '\0') {
+		tmp = realloc(values, (n + 1) * sizeof(CK_ULONG));
+		if (tmp == NULL)
+			break;
+		values = tmp;
+		values[n++] = strtoul(p, &end, 10);
+		if (end == p)
+			break;
+		p = *end == ',' ? end + 1 : end;
+	}
+	*count = n;
+	return values;
+}
+
+static struct attr *
+json_template(const char *line, const char *key, size_t *count)
+{
+	const char *p = json_value(line, key);
+	struct attr *tmpl = NULL, *tmp, *a;
+	size_t n = 0;
+	char *end;
+
+	*count = 0;
+	if (p == NULL || *p++ != '[')
+		return NULL;
+	while (*p == '[') {
+		tmp = realloc(tmpl, (n + 1) * sizeof(struct attr));
+		if (tmp == NULL)
+			break;
+		tmpl = tmp;
+		a = &tmpl[n++];
+		memset(a, 0, sizeof(*a));
+		a->type = strtoul(p + 1, &end, 10);
+		if (*end == ',')
+			a->len = strtol(end + 1, &end, 10);
+		if (end[0] == ',' && end[1] == '"') {
+			a->value = json_hex(end + 2, &a->value_len);
+			end = strchr(end + 2, '"');
+			end = end ? end + 1 : (char *)p + strlen(p);
+		}
+		p = *end == ']' ? end + 1 : end;
+		if (*p == ',')
+			p++;
+	}
+	*count = n;
+	return tmpl;
+}
+
+static int
+parse_call(const char *line, struct call *c)
+{
+	const char *p = json_value(line, "fn");
+	unsigned long long t;
+	size_t i, len;
+	CK_ULONG obuf;
+
+	if (p == NULL || *p++ != '"')
+		return 0;
+	len = strcspn(p, "\"");
+	memset(c, 0, sizeof(*c));
+	for (i = 0; i < FUNCTION_COUNT; i++)
+		if (strlen(functions[i].name) == len && !strncmp(functions[i].name, p, len))
+			c->fn = &functions[i];
+	if (c->fn == NULL)
+		return 0;
+
+	p = json_value(line, "t");
+	if (p == NULL || sscanf(p, "%llu", &t) != 1)
+		return 0;
+	c->t = t;
+	json_ulong(line, "rv", &c->rv);
+	json_ulong(line, "slot", &c->slot);
+	json_ulong(line, "session", &c->session);
+	json_ulong(line, "object", &c->object);
+	json_ulong(line, "key", &c->key);
+	json_ulong(line, "mech", &c->mech);
+	json_ulong(line, "mparam", &c->mparam);
+	json_ulong(line, "flags", &c->flags);
+	json_ulong(line, "user", &c->user);
+	c->pin = 1;
+	json_ulong(line, "pin", &c->pin);
+	json_ulong(line, "in", &c->in);
+	json_ulong(line, "sig", &c->sig);
+	json_ulong(line, "out", &c->out);
+	json_ulong(line, "max", &c->max);
+	json_ulong(line, "present", &c->present);
+	p = json_value(line, "obuf");
+	c->obuf = -1;
+	if (p != NULL && *p != '-' && json_ulong(line, "obuf", &obuf))
+		c->obuf = (long)obuf;
+	if (c->fn->kind == K_SLOT_LIST)
+		c->handles = json_ulongs(line, "slots", &c->handle_count);
+	else if (c->fn->kind == K_FIND)
+		c->handles = json_ulongs(line, "objects", &c->handle_count);
+	if (c->fn->kind == K_FIND_INIT || c->fn->kind == K_GET_ATTR)
+		c->tmpl = json_template(line, "tmpl", &c->tmpl_count);
+	return 1;
+}
+
+static int
+load_trace(FILE *f)
+{
+	char *line = NULL, *tmp;
+	size_t size = 0, len;
+	struct call *ctmp;
+	unsigned long long last = 0, offset = 0;
+
+	for (;;) {
+		len = 0;
+		do {
+			if (size - len < 2) {
+				tmp = realloc(line, size + 8192);
+				if (tmp == NULL)
+					util_fatal("out of memory");
+				line = tmp;
+				size += 8192;
+			}
+			if (fgets(line + len, (int)(size - len), f) == NULL)
+				break;
+			len += strlen(line + len);
+		} while (len > 0 && line[len - 1] != '\n');
+		if (len == 0)
+			break;
+		ctmp = realloc(calls, (call_count + 1) * sizeof(struct call));
+		if (ctmp == NULL)
+			util_fatal("out of memory");
+		calls = ctmp;
+		if (parse_call(line, &calls[call_count])) {
+			/* traces of several runs appended to one file follow each other */
+			if (calls[call_count].t < last)
+				offset += last;
+			last = calls[call_count].t;
+			calls[call_count].t += offset;
+			call_count++;
+		}
+		else if (verbose)
+			util_warn("ignoring line: %.60s", line);
+	}
+	free(line);
+	return ferror(f) ? -1 : 0;
+}
+
+static void
+map_set(struct handle_map *map, CK_ULONG from, CK_ULONG to)
+{
+	size_t i;
+
+	for (i = 0; i < map->count; i++) {
+		if (map->from[i] == from) {
+			map->to[i] = to;
+			return;
+		}
+	}
+	if (map->count == map->size) {
+		size_t size = map->size ? 2 * map->size : 16;
+		CK_ULONG *from_tmp = realloc(map->from, size * sizeof(CK_ULONG));
+		CK_ULONG *to_tmp;
+
+		if (from_tmp == NULL)
+			util_fatal("out of memory");
+		map->from = from_tmp;
+		to_tmp = realloc(map->to, size * sizeof(CK_ULONG));
+		if (to_tmp == NULL)
+			util_fatal("out of memory");
+		map->to = to_tmp;
+		map->size = size;
+	}
+	map->from[map->count] = from;
+	map->to[map->count++] = to;
+}
+
+/* handles the trace saw but the replay did not are passed unchanged */
+static CK_ULONG
+map_get(const struct handle_map *map, CK_ULONG from)
+{
+	size_t i;
+
+	for (i = 0; i < map->count; i++)
+		if (map->from[i] == from)
+			return map->to[i];
+	return from;
+}
+
+static void
+map_remove(struct handle_map *map, CK_ULONG from)
+{
+	size_t i;
+
+	for (i = 0; i < map->count; i++) {
+		if (map->from[i] == from) {
+			map->from[i] = map->from[--map->count];
+			map->to[i] = map->to[map->count];
+			return;
+		}
+	}
+}
+
+static void
+map_free(struct handle_map *map)
+{
+	free(map->from);
+	free(map->to);
+	memset(map, 0, sizeof(*map));
+}
+
+/* a buffer of 'len' filler bytes, at least one byte long */
+static CK_BYTE_PTR
+filler(CK_ULONG len)
+{
+	CK_BYTE_PTR buf = malloc(len ? len : 1);
+
+	if (buf == NULL)
+		util_fatal("out of memory");
+	memset(buf, 0x5a, len ? len : 1);
+	return buf;
+}
+
+#define P11_FN(type, c)	(*(type *)((char *)p11 + (c)->fn->offset))
+
+/* Issues one call of the trace, returns 0 if it was skipped */
+static int
+replay_call(struct worker *w, const struct call *c, CK_RV *rv)
+{
+	CK_SESSION_HANDLE session = map_get(&w->sessions, c->session);
+	CK_SLOT_ID slot = map_get(&w->slots, c->slot);
+	CK_MECHANISM mech;
+	CK_BYTE_PTR in = NULL, out = NULL, param = NULL;
+	CK_ULONG out_len, i;
+	size_t n;
+
+	switch (c->fn->kind) {
+	case K_GET_INFO: {
+		CK_INFO info;
+
+		*rv = p11->C_GetInfo(&info);
+		break;
+	}
+	case K_SLOT_LIST: {
+		CK_SLOT_ID_PTR slots = NULL;
+		CK_ULONG count = c->obuf >= 0 ? (CK_ULONG)c->obuf : 0;
+
+		if (c->obuf >= 0)
+			slots = calloc(count ? count : 1, sizeof(CK_SLOT_ID));
+		*rv = p11->C_GetSlotList((CK_BBOOL)c->present, slots, &count);
+		/* slots are matched by their position in the list */
+		for (i = 0; *rv == CKR_OK && slots != NULL && i < count && i < c->handle_count; i++)
+			map_set(&w->slots, c->handles[i], slots[i]);
+		free(slots);
+		break;
+	}
+	case K_SLOT_INFO: {
+		CK_SLOT_INFO info;
+
+		*rv = p11->C_GetSlotInfo(slot, &info);
+		break;
+	}
+	case K_TOKEN_INFO: {
+		CK_TOKEN_INFO info;
+
+		*rv = p11->C_GetTokenInfo(slot, &info);
+		break;
+	}
+	case K_MECH_LIST: {
+		CK_MECHANISM_TYPE_PTR list = NULL;
+		CK_ULONG count = c->obuf >= 0 ? (CK_ULONG)c->obuf : 0;
+
+		if (c->obuf >= 0)
+			list = calloc(count ? count : 1, sizeof(CK_MECHANISM_TYPE));
+		*rv = p11->C_GetMechanismList(slot, list, &count);
+		free(list);
+		break;
+	}
+	case K_MECH_INFO: {
+		CK_MECHANISM_INFO info;
+
+		*rv = p11->C_GetMechanismInfo(slot, c->mech, &info);
+		break;
+	}
+	case K_OPEN_SESSION: {
+		CK_SESSION_HANDLE h;
+
+		*rv = p11->C_OpenSession(slot, c->flags, NULL, NULL, &h);
+		if (*rv == CKR_OK)
+			map_set(&w->sessions, c->session, h);
+		break;
+	}
+	case K_CLOSE_SESSION:
+		*rv = p11->C_CloseSession(session);
+		map_remove(&w->sessions, c->session);
+		break;
+	case K_CLOSE_ALL:
+		*rv = p11->C_CloseAllSessions(slot);
+		break;
+	case K_SESSION_INFO: {
+		CK_SESSION_INFO info;
+
+		*rv = p11->C_GetSessionInfo(session, &info);
+		break;
+	}
+	case K_LOGIN:
+		if (c->pin && opt_pin == NULL)
+			return 0;
+		*rv = p11->C_Login(session, c->user, c->pin ? (CK_UTF8CHAR_PTR)opt_pin : NULL,
+				c->pin ? (CK_ULONG)strlen(opt_pin) : 0);
+		break;
+	case K_LOGOUT:
+		*rv = p11->C_Logout(session);
+		break;
+	case K_FIND_INIT: {
+		CK_ATTRIBUTE tmpl[32];
+
+		if (c->tmpl_count > sizeof(tmpl) / sizeof(tmpl[0]))
+			return 0;
+		for (n = 0; n < c->tmpl_count; n++) {
+			tmpl[n].type = c->tmpl[n].type;
+			/* without a recorded value the attribute cannot match */
+			if (c->tmpl[n].value == NULL)
+				return 0;
+			tmpl[n].pValue = c->tmpl[n].value;
+			tmpl[n].ulValueLen = c->tmpl[n].value_len;
+		}
+		*rv = p11->C_FindObjectsInit(session, c->tmpl_count ? tmpl : NULL, (CK_ULONG)c->tmpl_count);
+		break;
+	}
+	case K_FIND: {
+		CK_OBJECT_HANDLE_PTR objects = calloc(c->max ? c->max : 1, sizeof(CK_OBJECT_HANDLE));
+		CK_ULONG count = 0;
+
+		if (objects == NULL)
+			util_fatal("out of memory");
+		*rv = p11->C_FindObjects(session, objects, c->max, &count);
+		/* objects are matched by their position in the results */
+		for (i = 0; *rv == CKR_OK && i < count && i < c->handle_count; i++)
+			map_set(&w->objects, c->handles[i], objects[i]);
+		free(objects);
+		break;
+	}
+	case K_FIND_FINAL:
+		*rv = p11->C_FindObjectsFinal(session);
+		break;
+	case K_GET_ATTR: {
+		CK_ATTRIBUTE tmpl[32];
+
+		if (c->tmpl_count > sizeof(tmpl) / sizeof(tmpl[0]))
+			return 0;
+		for (n = 0; n < c->tmpl_count; n++) {
+			tmpl[n].type = c->tmpl[n].type;
+			tmpl[n].pValue = c->tmpl[n].len >= 0 ? filler((CK_ULONG)c->tmpl[n].len) : NULL;
+			tmpl[n].ulValueLen = c->tmpl[n].len >= 0 ? (CK_ULONG)c->tmpl[n].len : 0;
+		}
+		*rv = p11->C_GetAttributeValue(session, map_get(&w->objects, c->object),
+				tmpl, (CK_ULONG)c->tmpl_count);
+		for (n = 0; n < c->tmpl_count; n++)
+			free(tmpl[n].pValue);
+		break;
+	}
+	case K_INIT_KEY:
+	case K_DIGEST_INIT:
+		/* mechanism parameters are not recorded, zeroes have their length */
+		mech.mechanism = c->mech;
+		mech.pParameter = c->mparam ? param = calloc(1, c->mparam) : NULL;
+		mech.ulParameterLen = c->mparam;
+		if (c->fn->kind == K_DIGEST_INIT)
+			*rv = p11->C_DigestInit(session, &mech);
+		else
+			*rv = P11_FN(init_key_fn, c)(session, &mech, map_get(&w->objects, c->key));
+		free(param);
+		break;
+	case K_DATA:
+		in = filler(c->in);
+		out_len = c->obuf >= 0 ? (CK_ULONG)c->obuf : 0;
+		out = c->obuf >= 0 ? filler(out_len) : NULL;
+		*rv = P11_FN(data_fn, c)(session, in, c->in, out, &out_len);
+		break;
+	case K_IN:
+		in = filler(c->in);
+		*rv = P11_FN(in_fn, c)(session, in, c->in);
+		break;
+	case K_OUT:
+		out_len = c->obuf >= 0 ? (CK_ULONG)c->obuf : 0;
+		out = c->obuf >= 0 ? filler(out_len) : NULL;
+		*rv = P11_FN(out_fn, c)(session, out, &out_len);
+		break;
+	case K_VERIFY:
+		in = filler(c->in);
+		out = filler(c->sig);
+		*rv = p11->C_Verify(session, in, c->in, out, c->sig);
+		break;
+	case K_RANDOM:
+		out = filler(c->out);
+		*rv = p11->C_GenerateRandom(session, out, c->out);
+		break;
+	default:
+		/* C_Initialize and C_Finalize are issued once by main() */
+		return 0;
+	}
+	free(in);
+	free(out);
+	return 1;
+}
+
+static void
+record_result(const struct call *c, int issued, CK_RV rv, unsigned long long us)
+{
+	size_t i = (size_t)(c->fn - functions);
+
+	RESULTS_LOCK();
+	if (!issued) {
+		results[i].skipped++;
+	} else {
+		results[i].count++;
+		if (rv != CKR_OK)
+			results[i].errors++;
+		if (rv != c->rv)
+			results[i].changed++;
+		results[i].total_us += us;
+		if (us > results[i].max_us)
+			results[i].max_us = us;
+	}
+	RESULTS_UNLOCK();
+}
+
+static void *
+run_worker(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long long start, elapsed, due, us;
+	unsigned int round;
+	size_t i;
+	CK_RV rv;
+
+	for (round = 0; round < opt_repeat; round++) {
+		start = util_time_us();
+		for (i = 0; i < call_count; i++) {
+			const struct call *c = &calls[i];
+			int issued;
+
+			if (c->fn->kind == K_INITIALIZE || c->fn->kind == K_FINALIZE)
+				continue;
+			if (opt_speed > 0) {
+				due = (unsigned long long)((double)(c->t - calls[0].t) / opt_speed);
+				elapsed = util_time_us() - start;
+				if (due > elapsed)
+					usleep((useconds_t)(due - elapsed));
+			}
+			us = util_time_us();
+			issued = replay_call(w, c, &rv);
+			us = util_time_us() - us;
+			record_result(c, issued, rv, us);
+			if (verbose && issued) {
+				if (verbose > 1 || rv != c->rv)
+					printf("[%u] %s = 0x%lx (traced 0x%lx) %llu us\n", w->id,
+							c->fn->name, (unsigned long)rv, (unsigned long)c->rv, us);
+			}
+		}
+		/* sessions the trace left open are not carried into the next round */
+		for (i = 0; i < w->sessions.count; i++)
+			p11->C_CloseSession(w->sessions.to[i]);
+		map_free(&w->sessions);
+		map_free(&w->objects);
+	}
+	map_free(&w->slots);
+	return NULL;
+}
+
+static void
+print_results(unsigned long long total_us)
+{
+	unsigned long calls_issued = 0;
+	size_t i;
+
+	printf("%-24s %10s %8s %8s %8s %12s %10s %10s\n", "Function", "Calls",
+			"Errors", "Changed", "Skipped", "Total ms", "Avg us", "Max us");
+	for (i = 0; i < FUNCTION_COUNT; i++) {
+		if (!results[i].count && !results[i].skipped)
+			continue;
+		printf("%-24s %10lu %8lu %8lu %8lu %12.3f %10llu %10llu\n", functions[i].name,
+				results[i].count, results[i].errors, results[i].changed,
+				results[i].skipped, (double)results[i].total_us / 1000,
+				results[i].count ? results[i].total_us / results[i].count : 0,
+				results[i].max_us);
+		calls_issued += results[i].count;
+	}
+	printf("%lu calls in %.3f s, %.1f calls/s\n", calls_issued, (double)total_us / 1000000,
+			total_us ? (double)calls_issued * 1000000 / (double)total_us : 0.0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	CK_C_INITIALIZE_ARGS init_args;
+	struct worker *workers;
+	unsigned long long start;
+	void *module;
+	FILE *f;
+	unsigned int i;
+	size_t n;
+	CK_RV rv;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "m:s:t:r:p:vh", options, (int *) 0)) != -1) {
+		switch (c) {
+		case 'm':
+			opt_module = optarg;
+			break;
+		case 's':
+			opt_speed = strtod(optarg, NULL);
+			break;
+		case 't':
+			opt_threads = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			opt_repeat = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			opt_pin = optarg;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case 'h':
+		default:
+			util_print_usage_and_die(app_name, options, option_help, "[trace file]");
+		}
+	}
+	if (opt_threads == 0 || opt_speed < 0)
+		util_print_usage_and_die(app_name, options, option_help, "[trace file]");
+#ifndef HAVE_PTHREAD
+	if (opt_threads > 1)
+		util_fatal("built without thread support, use --threads 1");
+#endif
+
+	if (optind < argc) {
+		f = fopen(argv[optind], "r");
+		if (f == NULL)
+			util_fatal("cannot open %s: %s", argv[optind], strerror(errno));
+	} else {
+		f = stdin;
+	}
+	if (load_trace(f) != 0)
+		util_fatal("cannot read the trace: %s", strerror(errno));
+	if (f != stdin)
+		fclose(f);
+	if (call_count == 0)
+		util_fatal("the trace holds no calls");
+
+	module = C_LoadModule(opt_module, &p11);
+	if (module == NULL)
+		util_fatal("failed to load %s", opt_module);
+	memset(&init_args, 0, sizeof(init_args));
+	init_args.flags = CKF_OS_LOCKING_OK;
+	rv = p11->C_Initialize(opt_threads > 1 ? &init_args : NULL);
+	if (rv != CKR_OK)
+		util_fatal("C_Initialize failed: 0x%lx", (unsigned long)rv);
+
+	workers = calloc(opt_threads, sizeof(struct worker));
+	if (workers == NULL)
+		util_fatal("out of memory");
+	start = util_time_us();
+	for (i = 0; i < opt_threads; i++) {
+		workers[i].id = i;
+#ifdef HAVE_PTHREAD
+		if (opt_threads > 1) {
+			if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0)
+				util_fatal("cannot start thread %u", i);
+			continue;
+		}
+#endif
+		run_worker(&workers[i]);
+	}
+#ifdef HAVE_PTHREAD
+	for (i = 0; opt_threads > 1 && i < opt_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+#endif
+	print_results(util_time_us() - start);
+
+	p11->C_Finalize(NULL);
+	C_UnloadModule(module);
+	free(workers);
+	for (n = 0; n < call_count; n++) {
+		free(calls[n].handles);
+		for (i = 0; i < calls[n].tmpl_count; i++)
+			free(calls[n].tmpl[i].value);
+		free(calls[n].tmpl);
+	}
+	free(calls);
+	return 0;
+}
@@ -29,6 +29,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <pthread.h>
 #else
 #include <windows.h>
 #include <io.h>
@@ -160,7 +161,12 @@ enum {
 	OPT_SIGNATURE_FILE,
 	OPT_ALWAYS_AUTH,
 	OPT_ALLOWED_MECHANISMS,
-	OPT_OBJECT_INDEX
+	OPT_OBJECT_INDEX,
+	OPT_BENCHMARK,
+	OPT_ITERATIONS,
+	OPT_DURATION,
+	OPT_THREADS,
+	OPT_APDU_TRACE
 };
 
 static const struct option options[] = {
@@ -235,6 +241,11 @@ static const struct option options[] = {
 	{ "test-fork",		0, NULL,		OPT_TEST_FORK },
 #endif
 	{ "generate-random",	1, NULL,		OPT_GENERATE_RANDOM },
+	{ "benchmark",		1, NULL,		OPT_BENCHMARK },
+	{ "iterations",		1, NULL,		OPT_ITERATIONS },
+	{ "duration",		1, NULL,		OPT_DURATION },
+	{ "threads",		1, NULL,		OPT_THREADS },
+	{ "apdu-trace",		1, NULL,		OPT_APDU_TRACE },
 
 	{ NULL, 0, NULL, 0 }
 };
@@ -310,7 +321,12 @@ static const char *option_help[] = {
 #ifndef _WIN32
 	"Test forking and calling C_Initialize() in the child",
 #endif
-	"Generate given amount of random data"
+	"Generate given amount of random data",
+	"Repeat an operation and report its speed, <arg>: sign, verify, decrypt, derive, find-objects or random",
+	"Number of benchmark operations per session (default: 100 unless --duration is given)",
+	"Run the benchmark for <arg> seconds",
+	"Number of sessions, each used by its own thread, for the benchmark (default: 1)",
+	"The apdu_trace file of opensc.conf, to count the APDUs sent by the benchmark"
 };
 
 static const char *	app_name = "pkcs11-tool"; /* for utils.c */
@@ -368,6 +384,23 @@ static long	        opt_salt_len = 0;
 static int		opt_salt_len_given = 0; /* 0 - not given, 1 - given with input parameters */
 static int		opt_always_auth = 0;
 
+enum {
+	BENCH_SIGN,
+	BENCH_VERIFY,
+	BENCH_DECRYPT,
+	BENCH_DERIVE,
+	BENCH_FIND_OBJECTS,
+	BENCH_RANDOM
+};
+static const char *bench_names[] = {
+	"sign", "verify", "decrypt", "derive", "find-objects", "random"
+};
+static int		opt_benchmark = -1;
+static unsigned long	opt_iterations = 0;
+static unsigned long	opt_duration = 0;
+static unsigned long	opt_threads = 1;
+static const char *	opt_apdu_trace = NULL;
+
 static void *module = NULL;
 static CK_FUNCTION_LIST_PTR p11 = NULL;
 static CK_SLOT_ID_PTR p11_slots = NULL;
@@ -472,6 +505,8 @@ static void		test_ec(CK_SLOT_ID slot, CK_SESSION_HANDLE session);
 static void		test_fork(void);
 #endif
 static void		generate_random(CK_SESSION_HANDLE session);
+static CK_OBJECT_HANDLE	derive_ec_key(CK_SESSION_HANDLE, CK_OBJECT_HANDLE, CK_MECHANISM_TYPE);
+static void		benchmark(CK_SLOT_ID slot, CK_SESSION_HANDLE session, CK_FLAGS session_flags);
 static CK_RV		find_object_with_attributes(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE *out,
 				CK_ATTRIBUTE *attrs, CK_ULONG attrsLen, CK_ULONG obj_index);
 static CK_ULONG		get_private_key_length(CK_SESSION_HANDLE sess, CK_OBJECT_HANDLE prkey);
@@ -591,6 +626,7 @@ int main(int argc, char * argv[])
 	int do_test_fork = 0;
 #endif
 	int need_session = 0;
+	CK_FLAGS session_flags = 0;
 	int opt_login = 0;
 	int do_init_token = 0;
 	int do_init_pin = 0;
@@ -927,6 +963,31 @@ int main(int argc, char * argv[])
 		case OPT_ALWAYS_AUTH:
 			opt_always_auth = 1;
 			break;
+		case OPT_BENCHMARK:
+			for (opt_benchmark = 0; opt_benchmark <= BENCH_RANDOM; opt_benchmark++)
+				if (strcmp(optarg, bench_names[opt_benchmark]) == 0)
+					break;
+			if (opt_benchmark > BENCH_RANDOM) {
+				fprintf(stderr, "Unsupported benchmark \"%s\"\n", optarg);
+				util_print_usage_and_die(app_name, options, option_help, NULL);
+			}
+			need_session |= opt_benchmark == BENCH_DERIVE ? NEED_SESSION_RW : NEED_SESSION_RO;
+			action_count++;
+			break;
+		case OPT_ITERATIONS:
+			opt_iterations = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_DURATION:
+			opt_duration = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_THREADS:
+			opt_threads = strtoul(optarg, NULL, 0);
+			if (opt_threads == 0)
+				opt_threads = 1;
+			break;
+		case OPT_APDU_TRACE:
+			opt_apdu_trace = optarg;
+			break;
 		case OPT_ALLOWED_MECHANISMS:
 			/* Parse the mechanism list and fail early */
 			s = strtok(optarg, ",");
@@ -972,7 +1033,16 @@ int main(int argc, char * argv[])
 			util_fatal("Failed to load pkcs11 module");
 	}
 
-	rv = p11->C_Initialize(NULL);
+	if (opt_benchmark >= 0 && opt_threads > 1) {
+		/* the benchmark threads call the module concurrently */
+		CK_C_INITIALIZE_ARGS init_args;
+
+		memset(&init_args, 0, sizeof(init_args));
+		init_args.flags = CKF_OS_LOCKING_OK;
+		rv = p11->C_Initialize(&init_args);
+	} else {
+		rv = p11->C_Initialize(NULL);
+	}
 	if (rv == CKR_CRYPTOKI_ALREADY_INITIALIZED)
 		fprintf(stderr, "\n*** Cryptoki library has already been initialized ***\n");
 	else if (rv != CKR_OK)
@@ -1053,7 +1123,8 @@ int main(int argc, char * argv[])
 	if (do_list_mechs)
 		list_mechs(opt_slot);
 
-	if (do_sign || do_decrypt) {
+	if (do_sign || do_decrypt || opt_benchmark == BENCH_SIGN
+			|| opt_benchmark == BENCH_DECRYPT || opt_benchmark == BENCH_DERIVE) {
 		CK_TOKEN_INFO	info;
 
 		get_token_info(opt_slot, &info);
@@ -1067,11 +1138,11 @@ int main(int argc, char * argv[])
 		init_token(opt_slot);
 
 	if (need_session) {
-		int flags = CKF_SERIAL_SESSION;
+		session_flags = CKF_SERIAL_SESSION;
 
 		if (need_session & NEED_SESSION_RW)
-			flags |= CKF_RW_SESSION;
-		rv = p11->C_OpenSession(opt_slot, flags,
+			session_flags |= CKF_RW_SESSION;
+		rv = p11->C_OpenSession(opt_slot, session_flags,
 				NULL, NULL, &session);
 		if (rv != CKR_OK)
 			p11_fatal("C_OpenSession", rv);
@@ -1213,6 +1284,9 @@ int main(int argc, char * argv[])
 		generate_random(session);
 	}
 
+	if (opt_benchmark >= 0)
+		benchmark(opt_slot, session, session_flags);
+
 end:
 	if (session != CK_INVALID_HANDLE) {
 		rv = p11->C_CloseSession(session);
@@ -3726,7 +3800,6 @@ derive_ec_key(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key, CK_MECHANISM_TYPE
 	unsigned char * derp = NULL;
 	size_t  der_size = 0;
 
-	printf("Using derive algorithm 0x%8.8lx %s\n", opt_mechanism, p11_mechanism_to_name(mech_mech));
 	memset(&mech, 0, sizeof(mech));
 	mech.mechanism = mech_mech;
 
@@ -3821,6 +3894,7 @@ derive_key(CK_SLOT_ID slot, CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key)
 		if (!find_mechanism(slot, CKF_DERIVE|CKF_HW, NULL, 0, &opt_mechanism))
 			util_fatal("Derive mechanism not supported");
 
+	printf("Using derive algorithm 0x%8.8lx %s\n", opt_mechanism, p11_mechanism_to_name(opt_mechanism));
 	switch(opt_mechanism) {
 	case CKM_ECDH1_COFACTOR_DERIVE:
 	case CKM_ECDH1_DERIVE:
@@ -6406,6 +6480,320 @@ static void generate_random(CK_SESSION_HANDLE session)
 	free(buf);
 }
 
+/*
+ * Benchmark: repeat one operation in one or more sessions and report the
+ * throughput and the latency distribution. Every thread works in its own
+ * session; the objects and the login state are shared by all sessions.
+ */
+/* number of APDUs recorded so far in the apdu_trace file of opensc.conf */
+static int bench_apdu_count(unsigned long long *count)
+{
+	struct sc_apdu_trace_header header;
+	FILE *f;
+	int ok;
+
+	if (opt_apdu_trace == NULL)
+		return 0;
+	f = fopen(opt_apdu_trace, "rb");
+	if (f == NULL)
+		return 0;
+	ok = fread(&header, sizeof header, 1, f) == 1
+		&& memcmp(header.magic, SC_APDU_TRACE_MAGIC, sizeof header.magic) == 0
+		&& header.version == SC_APDU_TRACE_VERSION;
+	fclose(f);
+	if (ok)
+		*count = header.head;
+	return ok;
+}
+
+struct bench_thread {
+	CK_SESSION_HANDLE session;
+	unsigned long long *latency;	/* microseconds per operation */
+	size_t count, size;
+};
+
+static struct {
+	CK_MECHANISM mech;
+	CK_RSA_PKCS_PSS_PARAMS pss_params;
+	CK_OBJECT_HANDLE key;
+	int always_auth;
+	unsigned char data[1024];
+	CK_ULONG data_len;
+	unsigned char sig[512];
+	CK_ULONG sig_len;
+	unsigned long long deadline;
+} bench;
+
+static void bench_once(CK_SESSION_HANDLE session)
+{
+	unsigned char out[1024];
+	CK_ULONG out_len = sizeof(out);
+	CK_OBJECT_HANDLE handles[16], derived;
+	CK_ULONG found;
+	CK_RV rv;
+
+	switch (opt_benchmark) {
+	case BENCH_SIGN:
+		rv = p11->C_SignInit(session, &bench.mech, bench.key);
+		if (rv != CKR_OK)
+			p11_fatal("C_SignInit", rv);
+		if (bench.always_auth)
+			login(session, CKU_CONTEXT_SPECIFIC);
+		rv = p11->C_Sign(session, bench.data, bench.data_len, out, &out_len);
+		if (rv != CKR_OK)
+			p11_fatal("C_Sign", rv);
+		break;
+	case BENCH_VERIFY:
+		rv = p11->C_VerifyInit(session, &bench.mech, bench.key);
+		if (rv != CKR_OK)
+			p11_fatal("C_VerifyInit", rv);
+		rv = p11->C_Verify(session, bench.data, bench.data_len, bench.sig, bench.sig_len);
+		if (rv != CKR_OK)
+			p11_fatal("C_Verify", rv);
+		break;
+	case BENCH_DECRYPT:
+		rv = p11->C_DecryptInit(session, &bench.mech, bench.key);
+		if (rv != CKR_OK)
+			p11_fatal("C_DecryptInit", rv);
+		if (bench.always_auth)
+			login(session, CKU_CONTEXT_SPECIFIC);
+		rv = p11->C_Decrypt(session, bench.data, bench.data_len, out, &out_len);
+		if (rv != CKR_OK)
+			p11_fatal("C_Decrypt", rv);
+		break;
+	case BENCH_DERIVE:
+		derived = derive_ec_key(session, bench.key, opt_mechanism);
+		p11->C_DestroyObject(session, derived);
+		break;
+	case BENCH_FIND_OBJECTS:
+		rv = p11->C_FindObjectsInit(session, NULL, 0);
+		if (rv != CKR_OK)
+			p11_fatal("C_FindObjectsInit", rv);
+		do {
+			rv = p11->C_FindObjects(session, handles, 16, &found);
+			if (rv != CKR_OK)
+				p11_fatal("C_FindObjects", rv);
+		} while (found > 0);
+		p11->C_FindObjectsFinal(session);
+		break;
+	case BENCH_RANDOM:
+		rv = p11->C_GenerateRandom(session, out, 32);
+		if (rv != CKR_OK)
+			p11_fatal("C_GenerateRandom", rv);
+		break;
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI bench_run(LPVOID arg)
+#else
+static void *bench_run(void *arg)
+#endif
+{
+	struct bench_thread *t = arg;
+	unsigned long long start, now;
+
+	while (opt_iterations == 0 || t->count < opt_iterations) {
+		start = util_time_us();
+		bench_once(t->session);
+		now = util_time_us();
+
+		if (t->count == t->size) {
+			unsigned long long *p;
+
+			t->size = t->size ? 2 * t->size : 256;
+			p = realloc(t->latency, t->size * sizeof(*t->latency));
+			if (p == NULL)
+				util_fatal("Not enough memory for the benchmark results");
+			t->latency = p;
+		}
+		t->latency[t->count++] = now - start;
+		if (bench.deadline && now >= bench.deadline)
+			break;
+	}
+	return 0;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	unsigned long long la = *(const unsigned long long *)a;
+	unsigned long long lb = *(const unsigned long long *)b;
+
+	return la < lb ? -1 : la > lb;
+}
+
+static void bench_prepare(CK_SLOT_ID slot, CK_SESSION_HANDLE session)
+{
+	CK_FLAGS flags = 0;
+	unsigned long hashlen = 0;
+	unsigned char *id = opt_object_id_len ? opt_object_id : NULL;
+	int fd, r;
+
+	switch (opt_benchmark) {
+	case BENCH_SIGN:
+		flags = CKF_SIGN;
+		break;
+	case BENCH_VERIFY:
+		flags = CKF_VERIFY;
+		break;
+	case BENCH_DECRYPT:
+		flags = CKF_DECRYPT;
+		break;
+	case BENCH_DERIVE:
+		flags = CKF_DERIVE;
+		break;
+	default:
+		return;
+	}
+
+	if (!opt_mechanism_used)
+		if (!find_mechanism(slot, flags|CKF_HW, NULL, 0, &opt_mechanism))
+			util_fatal("No mechanism found for the benchmark");
+	fprintf(stderr, "Using mechanism %s\n", p11_mechanism_to_name(opt_mechanism));
+
+	if (opt_benchmark == BENCH_VERIFY) {
+		if (!find_object(session, CKO_PUBLIC_KEY, &bench.key, id, opt_object_id_len, 0)
+				&& !find_object(session, CKO_CERTIFICATE, &bench.key, id, opt_object_id_len, 0))
+			util_fatal("Public key nor certificate not found");
+	} else if (!find_object(session, CKO_PRIVATE_KEY, &bench.key, id, opt_object_id_len, 0)) {
+		util_fatal("Private key not found");
+	}
+	if (opt_benchmark == BENCH_DERIVE) {
+		if (opt_mechanism != CKM_ECDH1_DERIVE && opt_mechanism != CKM_ECDH1_COFACTOR_DERIVE)
+			util_fatal("mechanism not supported for derive");
+		if (opt_input == NULL)
+			util_fatal("The other public key is needed, use --input-file");
+		return;
+	}
+
+	bench.mech.mechanism = opt_mechanism;
+	if (opt_benchmark != BENCH_DECRYPT)
+		hashlen = parse_pss_params(session, bench.key, &bench.mech, &bench.pss_params);
+	bench.always_auth = opt_benchmark != BENCH_VERIFY
+		&& getALWAYS_AUTHENTICATE(session, bench.key);
+
+	if (opt_input != NULL) {
+		if ((fd = open(opt_input, O_RDONLY|O_BINARY)) < 0)
+			util_fatal("Cannot open %s: %m", opt_input);
+		r = read(fd, bench.data, sizeof(bench.data));
+		if (r < 0)
+			util_fatal("Cannot read from %s: %m", opt_input);
+		close(fd);
+		bench.data_len = r;
+	} else if (opt_benchmark == BENCH_DECRYPT) {
+		util_fatal("The data to decrypt is needed, use --input-file");
+	} else {
+		bench.data_len = hashlen ? hashlen : 32;
+		pseudo_randomize(bench.data, bench.data_len);
+	}
+
+	if (opt_benchmark == BENCH_VERIFY) {
+		if (opt_signature_file == NULL)
+			util_fatal("No file with signature provided. Use --signature-file");
+		if ((fd = open(opt_signature_file, O_RDONLY|O_BINARY)) < 0)
+			util_fatal("Cannot open %s: %m", opt_signature_file);
+		r = read(fd, bench.sig, sizeof(bench.sig));
+		if (r < 0)
+			util_fatal("Cannot read from %s: %m", opt_signature_file);
+		close(fd);
+		bench.sig_len = r;
+	}
+}
+
+static void benchmark(CK_SLOT_ID slot, CK_SESSION_HANDLE session, CK_FLAGS session_flags)
+{
+	struct bench_thread *threads;
+	unsigned long long start, elapsed, apdus_before = 0, apdus_after = 0;
+	unsigned long long *all;
+	size_t i, total = 0;
+	CK_RV rv;
+	int have_apdus;
+
+	if (opt_iterations == 0 && opt_duration == 0)
+		opt_iterations = 100;
+	bench_prepare(slot, session);
+
+	threads = calloc(opt_threads, sizeof(*threads));
+	if (threads == NULL)
+		util_fatal("Not enough memory for %lu threads", opt_threads);
+	threads[0].session = session;
+	for (i = 1; i < opt_threads; i++) {
+		rv = p11->C_OpenSession(slot, session_flags, NULL, NULL, &threads[i].session);
+		if (rv != CKR_OK)
+			p11_fatal("C_OpenSession", rv);
+	}
+
+	have_apdus = bench_apdu_count(&apdus_before);
+	start = util_time_us();
+	if (opt_duration)
+		bench.deadline = start + (unsigned long long)opt_duration * 1000000;
+	if (opt_threads == 1) {
+		bench_run(&threads[0]);
+	} else {
+#ifdef _WIN32
+		HANDLE *handles = calloc(opt_threads, sizeof(*handles));
+
+		if (handles == NULL)
+			util_fatal("Not enough memory for %lu threads", opt_threads);
+		for (i = 0; i < opt_threads; i++) {
+			handles[i] = CreateThread(NULL, 0, bench_run, &threads[i], 0, NULL);
+			if (handles[i] == NULL)
+				util_fatal("Cannot create a benchmark thread");
+		}
+		WaitForMultipleObjects((DWORD)opt_threads, handles, TRUE, INFINITE);
+		for (i = 0; i < opt_threads; i++)
+			CloseHandle(handles[i]);
+		free(handles);
+#else
+		pthread_t *ids = calloc(opt_threads, sizeof(*ids));
+
+		if (ids == NULL)
+			util_fatal("Not enough memory for %lu threads", opt_threads);
+		for (i = 0; i < opt_threads; i++)
+			if (pthread_create(&ids[i], NULL, bench_run, &threads[i]) != 0)
+				util_fatal("Cannot create a benchmark thread");
+		for (i = 0; i < opt_threads; i++)
+			pthread_join(ids[i], NULL);
+		free(ids);
+#endif
+	}
+	elapsed = util_time_us() - start;
+	have_apdus = have_apdus && bench_apdu_count(&apdus_after);
+
+	for (i = 0; i < opt_threads; i++)
+		total += threads[i].count;
+	all = malloc((total ? total : 1) * sizeof(*all));
+	if (all == NULL)
+		util_fatal("Not enough memory for the benchmark results");
+	for (total = 0, i = 0; i < opt_threads; i++) {
+		memcpy(all + total, threads[i].latency, threads[i].count * sizeof(*all));
+		total += threads[i].count;
+		free(threads[i].latency);
+		if (i > 0)
+			p11->C_CloseSession(threads[i].session);
+	}
+	free(threads);
+	qsort(all, total, sizeof(*all), compare_latency);
+
+	printf("Benchmark %s: %lu operations in %lu session(s) in %.3f s\n",
+			bench_names[opt_benchmark], (unsigned long)total, opt_threads,
+			elapsed / 1e6);
+	if (total > 0) {
+		printf("  operations/s:  %.2f\n", elapsed ? total * 1e6 / elapsed : 0.0);
+		printf("  latency (ms):  min %.3f, p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+				all[0] / 1e3, all[(total - 1) * 50 / 100] / 1e3,
+				all[(total - 1) * 90 / 100] / 1e3,
+				all[(total - 1) * 99 / 100] / 1e3, all[total - 1] / 1e3);
+		if (have_apdus)
+			printf("  APDUs:         %llu (%.2f per operation)\n",
+					apdus_after - apdus_before,
+					(double)(apdus_after - apdus_before) / total);
+	}
+	if (opt_apdu_trace && !have_apdus)
+		fprintf(stderr, "Cannot read the APDU count from %s\n", opt_apdu_trace);
+	free(all);
+}
+
 static const char *p11_flag_names(struct flag_info *list, CK_FLAGS value)
 {
 	static char	buffer[1024];
@@ -42,7 +42,7 @@
 
 static const char *app_name = "pkcs15-crypt";
 
-static int verbose = 0, opt_wait = 0, opt_raw = 0;
+static int verbose = 0, opt_wait = 0, opt_raw = 0, opt_batch = 0;
 static char * opt_reader;
 static char * opt_pincode = NULL, * opt_key_id = NULL;
 static char * opt_input = NULL, * opt_output = NULL;
@@ -60,6 +60,7 @@ enum {
 	OPT_PKCS1,
 	OPT_BIND_TO_AID,
 	OPT_VERSION,
+	OPT_BATCH,
 };
 
 static const struct option options[] = {
@@ -72,6 +73,7 @@ static const struct option options[] = {
 	{ "output",		1, NULL,		'o' },
 	{ "signature-format",	1, NULL,		'f' },
 	{ "raw",		0, NULL,		'R' },
+	{ "batch",		0, NULL,		OPT_BATCH },
 	{ "sha-1",		0, NULL,		OPT_SHA1 },
 	{ "sha-256",		0, NULL,		OPT_SHA256 },
 	{ "sha-384",		0, NULL,		OPT_SHA384 },
@@ -96,6 +98,7 @@ static const char *option_help[] = {
 	"Outputs to file <arg> (defaults to stdout)",
 	"Format for ECDSA signature <arg>: 'rs' (default), 'sequence', 'openssl'",
 	"Outputs raw 8 bit data",
+	"Processes the files given as arguments, or length-prefixed records from stdin, in one session",
 	"Input file is a SHA-1 hash",
 	"Input file is a SHA-256 hash",
 	"Input file is a SHA-384 hash",
@@ -113,6 +116,9 @@ static sc_context_t *ctx = NULL;
 static sc_card_t *card = NULL;
 static struct sc_pkcs15_card *p15card = NULL;
 
+/* PIN kept in batch mode for keys which need it before every operation */
+static char *batch_pincode = NULL;
+
 static char *readpin_stdin(void)
 {
 	char buf[128];
@@ -141,6 +147,9 @@ static char * get_pin(struct sc_pkcs15_object *obj)
 	if (pinfo->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN)
 		return NULL;
 
+	if (batch_pincode != NULL)
+		return strdup(batch_pincode);
+
 	if (opt_pincode != NULL) {
 		if (strcmp(opt_pincode, "-") == 0)
 			return readpin_stdin();
@@ -161,17 +170,17 @@ static char * get_pin(struct sc_pkcs15_object *obj)
 	}
 }
 
-static int read_input(u8 *buf, int buflen)
+static int read_input(const char *input, u8 *buf, int buflen)
 {
 	FILE *inf;
 	int c;
 
-	if (opt_input==NULL) {
+	if (input==NULL) {
 		inf = stdin;
 	} else {
-		inf = fopen(opt_input, "rb");
+		inf = fopen(input, "rb");
 		if (inf == NULL) {
-			fprintf(stderr, "Unable to open '%s' for reading.\n", opt_input);
+			fprintf(stderr, "Unable to open '%s' for reading.\n", input);
 			return -1;
 		}
 	}
@@ -211,23 +220,15 @@ static int write_output(const u8 *buf, int len)
 	return 0;
 }
 
-static int sign(struct sc_pkcs15_object *obj)
+static int sign_data(struct sc_pkcs15_object *obj, const u8 *in, size_t inlen,
+		u8 *out, size_t *outlen)
 {
-	u8 buf[1024], out[1024];
 	struct sc_pkcs15_prkey_info *key = (struct sc_pkcs15_prkey_info *) obj->data;
-	int r, c, len;
+	int r;
 
-	if (opt_input == NULL) {
-		fprintf(stderr, "No input file specified. Reading from stdin\n");
-	}
-
-	c = read_input(buf, sizeof(buf));
-	if (c < 0)
-		return 2;
-	len = sizeof(out);
 	if (obj->type == SC_PKCS15_TYPE_PRKEY_RSA
 			&& !(opt_crypt_flags & SC_ALGORITHM_RSA_PAD_PKCS1)
-			&& (size_t)c != key->modulus_length/8) {
+			&& inlen != key->modulus_length/8) {
 		fprintf(stderr, "Input has to be exactly %lu bytes, when using no padding.\n",
 			(unsigned long) key->modulus_length/8);
 		return 2;
@@ -237,30 +238,71 @@ static int sign(struct sc_pkcs15_object *obj)
 		return SC_ERROR_NOT_SUPPORTED;
 	}
 
-	r = sc_pkcs15_compute_signature(p15card, obj, opt_crypt_flags, buf, c, out, len);
+	r = sc_pkcs15_compute_signature(p15card, obj, opt_crypt_flags, in, inlen, out, *outlen);
 	if (r < 0) {
 		fprintf(stderr, "Compute signature failed: %s\n", sc_strerror(r));
 		return 1;
 	}
-	len = r;
+	*outlen = r;
 
 	if (obj->type == SC_PKCS15_TYPE_PRKEY_EC)   {
 		if (opt_sig_format &&  (!strcmp(opt_sig_format, "openssl") || !strcmp(opt_sig_format, "sequence")))   {
 			unsigned char *seq;
 			size_t seqlen;
 
-			if (sc_asn1_sig_value_rs_to_sequence(ctx, out, len, &seq, &seqlen))   {
+			if (sc_asn1_sig_value_rs_to_sequence(ctx, out, *outlen, &seq, &seqlen))   {
 				fprintf(stderr, "Failed to convert signature to ASN1 sequence format.\n");
 				return 2;
 			}
 
 			memcpy(out, seq, seqlen);
-			len = seqlen;
+			*outlen = seqlen;
 
 			free(seq);
 		}
 	}
 
+	return 0;
+}
+
+static int decipher_data(struct sc_pkcs15_object *obj, const u8 *in, size_t inlen,
+		u8 *out, size_t *outlen)
+{
+	int r;
+
+	if (!((struct sc_pkcs15_prkey_info *) obj->data)->native) {
+                fprintf(stderr, "Deprecated non-native key detected! Upgrade your smart cards.\n");
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+
+	r = sc_pkcs15_decipher(p15card, obj, opt_crypt_flags & SC_ALGORITHM_RSA_PAD_PKCS1, in, inlen, out, *outlen);
+	if (r < 0) {
+		fprintf(stderr, "Decrypt failed: %s\n", sc_strerror(r));
+		return 1;
+	}
+	*outlen = r;
+
+	return 0;
+}
+
+static int sign(struct sc_pkcs15_object *obj)
+{
+	u8 buf[1024], out[1024];
+	size_t len = sizeof(out);
+	int r, c;
+
+	if (opt_input == NULL) {
+		fprintf(stderr, "No input file specified. Reading from stdin\n");
+	}
+
+	c = read_input(opt_input, buf, sizeof(buf));
+	if (c < 0)
+		return 2;
+
+	r = sign_data(obj, buf, c, out, &len);
+	if (r)
+		return r;
+
 	r = write_output(out, len);
 
 	return r;
@@ -269,27 +311,21 @@ static int sign(struct sc_pkcs15_object *obj)
 static int decipher(struct sc_pkcs15_object *obj)
 {
 	u8 buf[1024], out[1024];
-	int r, c, len;
+	size_t len = sizeof(out);
+	int r, c;
 
 	if (opt_input == NULL) {
 		fprintf(stderr, "No input file specified. Reading from stdin\n");
 	}
-	c = read_input(buf, sizeof(buf));
+	c = read_input(opt_input, buf, sizeof(buf));
 	if (c < 0)
 		return 2;
 
-	len = sizeof(out);
-	if (!((struct sc_pkcs15_prkey_info *) obj->data)->native) {
-                fprintf(stderr, "Deprecated non-native key detected! Upgrade your smart cards.\n");
-		return SC_ERROR_NOT_SUPPORTED;
-	}
+	r = decipher_data(obj, buf, c, out, &len);
+	if (r)
+		return r;
 
-	r = sc_pkcs15_decipher(p15card, obj, opt_crypt_flags & SC_ALGORITHM_RSA_PAD_PKCS1, buf, c, out, len);
-	if (r < 0) {
-		fprintf(stderr, "Decrypt failed: %s\n", sc_strerror(r));
-		return 1;
-	}
-	r = write_output(out, r);
+	r = write_output(out, len);
 
 	return r;
 }
@@ -362,6 +398,13 @@ static int get_key(unsigned int usage, sc_pkcs15_object_t **result)
 		} else
 			r = sc_pkcs15_verify_pin(p15card, pin, (const u8 *)pincode, pincode ? strlen(pincode) : 0);
 
+		if (r == 0 && opt_batch && key->user_consent && pincode && !batch_pincode) {
+			/* the key needs the PIN again for every input */
+			batch_pincode = pincode;
+			pincode = NULL;
+		}
+		if (pincode)
+			sc_mem_clear(pincode, strlen(pincode));
 		free(pincode);
 		if (r) {
 			fprintf(stderr, "PIN code verification failed: %s\n", sc_strerror(r));
@@ -375,6 +418,136 @@ static int get_key(unsigned int usage, sc_pkcs15_object_t **result)
 	return 0;
 }
 
+/*
+ * Reads a record of a 4 byte big-endian length and the data.
+ * Returns 1 for a record, 0 at the end of the input, -1 on errors and
+ * -2 for a record larger than the buffer, which is skipped.
+ */
+static int read_record(FILE *inf, u8 *buf, size_t buflen, size_t *len)
+{
+	u8 hdr[4];
+	size_t n, left;
+
+	n = fread(hdr, 1, sizeof hdr, inf);
+	if (n == 0 && feof(inf))
+		return 0;
+	if (n != sizeof hdr)
+		return -1;
+	*len = (size_t) hdr[0] << 24 | (size_t) hdr[1] << 16 | (size_t) hdr[2] << 8 | hdr[3];
+	if (*len > buflen) {
+		for (left = *len; left > 0; left -= n) {
+			n = fread(buf, 1, left < buflen ? left : buflen, inf);
+			if (n == 0)
+				return -1;
+		}
+		return -2;
+	}
+	if (fread(buf, 1, *len, inf) != *len)
+		return -1;
+	return 1;
+}
+
+static void write_record(FILE *outf, const u8 *buf, size_t len)
+{
+	u8 hdr[4];
+
+	hdr[0] = (u8) (len >> 24);
+	hdr[1] = (u8) (len >> 16);
+	hdr[2] = (u8) (len >> 8);
+	hdr[3] = (u8) len;
+	fwrite(hdr, sizeof hdr, 1, outf);
+	if (len)
+		fwrite(buf, len, 1, outf);
+}
+
+/*
+ * Signs or deciphers every file in 'files', or every record read from
+ * stdin if there are none, with the card bound and the PIN verified
+ * once. The results are written in the order of the inputs: as records
+ * like the input ones with --output or --raw, where failed inputs give
+ * an empty record, otherwise as hex, one line per input. The time spent
+ * on every input is printed to stderr.
+ */
+static int batch(struct sc_pkcs15_object *key, unsigned int usage,
+		int (*op)(struct sc_pkcs15_object *, const u8 *, size_t, u8 *, size_t *),
+		char **files, int file_count)
+{
+	u8 buf[1024], out[1024];
+	char name[32];
+	const char *item;
+	FILE *outf = stdout;
+	int output_binary = (opt_output == NULL && opt_raw == 0 ? 0 : 1);
+	int i, r, c, err = 0, failed = 0;
+	size_t inlen, outlen;
+	unsigned long long start, total = 0;
+
+	if (opt_output != NULL) {
+		outf = fopen(opt_output, "wb");
+		if (outf == NULL) {
+			fprintf(stderr, "Unable to open '%s' for writing.\n", opt_output);
+			return 2;
+		}
+	}
+
+	for (i = 0; file_count == 0 || i < file_count; i++) {
+		if (file_count) {
+			item = files[i];
+			c = read_input(item, buf, sizeof(buf));
+			inlen = c < 0 ? 0 : (size_t) c;
+			r = c < 0 ? 2 : 0;
+		} else {
+			snprintf(name, sizeof name, "#%d", i);
+			item = name;
+			c = read_record(stdin, buf, sizeof(buf), &inlen);
+			if (c == 0)
+				break;
+			if (c == -1) {
+				fprintf(stderr, "%s: truncated input record.\n", item);
+				err = 2;
+				break;
+			}
+			if (c == -2)
+				fprintf(stderr, "%s: input longer than %lu bytes.\n",
+						item, (unsigned long) sizeof(buf));
+			r = c < 0 ? 2 : 0;
+		}
+
+		start = util_time_us();
+		/* the first input uses the PIN verified by the caller */
+		if (r == 0 && i > 0 && key->user_consent)
+			r = get_key(usage, &key);
+		outlen = sizeof(out);
+		if (r == 0)
+			r = op(key, buf, inlen, out, &outlen);
+		start = util_time_us() - start;
+		total += start;
+
+		if (r) {
+			failed++;
+			if (!err)
+				err = r;
+			outlen = 0;
+		}
+		if (output_binary) {
+			write_record(outf, out, outlen);
+		} else if (r == 0) {
+			fprintf(outf, "%s: ", item);
+			util_hex_dump(outf, out, (int) outlen, "");
+			fputc('\n', outf);
+		}
+		fprintf(stderr, "%s: %s, %.3f ms\n", item, r ? "failed" : "done",
+				(double) start / 1000);
+	}
+	fprintf(stderr, "%d input%s, %d failed, %.3f ms\n", i, i == 1 ? "" : "s",
+			failed, (double) total / 1000);
+
+	if (outf != stdout)
+		fclose(outf);
+	else
+		fflush(outf);
+	return err;
+}
+
 int main(int argc, char *argv[])
 {
 	int err = 0, r, c, long_optind = 0;
@@ -423,6 +596,9 @@ int main(int argc, char *argv[])
 		case 'R':
 			opt_raw = 1;
 			break;
+		case OPT_BATCH:
+			opt_batch = 1;
+			break;
 		case OPT_SHA1:
 			opt_crypt_flags |= SC_ALGORITHM_RSA_HASH_SHA1;
 			break;
@@ -466,6 +642,11 @@ int main(int argc, char *argv[])
 		action_count--;
 	}
 
+	if (opt_batch && (do_sign + do_decipher != 1 || opt_input != NULL)) {
+		fprintf(stderr, "--batch needs either --sign or --decipher, and no --input.\n");
+		return 1;
+	}
+
 	if (!(opt_crypt_flags & SC_ALGORITHM_RSA_HASHES))
 		opt_crypt_flags |= SC_ALGORITHM_RSA_HASH_NONE;
 
@@ -508,21 +689,31 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "Found %s!\n", p15card->tokeninfo->label);
 
 	if (do_decipher) {
-		if ((err = get_key(SC_PKCS15_PRKEY_USAGE_DECRYPT|SC_PKCS15_PRKEY_USAGE_UNWRAP, &key))
-		 || (err = decipher(key)))
+		unsigned int usage = SC_PKCS15_PRKEY_USAGE_DECRYPT|SC_PKCS15_PRKEY_USAGE_UNWRAP;
+
+		if ((err = get_key(usage, &key))
+		 || (err = opt_batch ? batch(key, usage, decipher_data, argv + optind, argc - optind)
+				 : decipher(key)))
 			goto end;
 		action_count--;
 	}
 
 	if (do_sign) {
-		if ((err = get_key(SC_PKCS15_PRKEY_USAGE_SIGN|
+		unsigned int usage = SC_PKCS15_PRKEY_USAGE_SIGN|
 				   SC_PKCS15_PRKEY_USAGE_SIGNRECOVER|
-				   SC_PKCS15_PRKEY_USAGE_NONREPUDIATION, &key))
-		 || (err = sign(key)))
+				   SC_PKCS15_PRKEY_USAGE_NONREPUDIATION;
+
+		if ((err = get_key(usage, &key))
+		 || (err = opt_batch ? batch(key, usage, sign_data, argv + optind, argc - optind)
+				 : sign(key)))
 			goto end;
 		action_count--;
 	}
 end:
+	if (batch_pincode) {
+		sc_mem_clear(batch_pincode, strlen(batch_pincode));
+		free(batch_pincode);
+	}
 	if (p15card)
 		sc_pkcs15_unbind(p15card);
 	if (card) {
@@ -38,6 +38,10 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <time.h>
+#endif
 #include <openssl/opensslv.h>
 #include "libopensc/sc-ossl-compat.h"
 #include <openssl/conf.h>
@@ -98,6 +102,8 @@ static int	do_finalize_card(sc_card_t *, struct sc_profile *);
 static int	do_read_data_object(const char *name, u8 **out, size_t *outlen, size_t expected);
 static int	do_store_data_object(struct sc_profile *profile);
 static int	do_sanity_check(struct sc_profile *profile);
+static int	do_provision_card(void);
+static int	do_batch(void);
 
 static int	init_prkeyargs(struct sc_pkcs15init_prkeyargs *);
 static int	init_skeyargs(struct sc_pkcs15init_skeyargs *);
@@ -144,6 +150,7 @@ enum {
 	OPT_MD_CONTAINER_GUID,
 	OPT_VERSION,
 	OPT_USER_CONSENT,
+	OPT_BATCH,
 
 	OPT_PIN1      = 0x10000,	/* don't touch these values */
 	OPT_PUK1      = 0x10001,
@@ -213,6 +220,7 @@ const struct option	options[] = {
 	{ "card-profile",	required_argument, NULL,	'c' },
 	{ "md-container-guid",	required_argument, NULL,	OPT_MD_CONTAINER_GUID},
 	{ "wait",		no_argument, NULL,		'w' },
+	{ "batch",		no_argument, NULL,		OPT_BATCH },
 	{ "help",		no_argument, NULL,		'h' },
 	{ "verbose",		no_argument, NULL,		'v' },
 
@@ -278,6 +286,7 @@ static const char *		option_help[] = {
 	"Specify the card profile to use",
 	"For a new key specify GUID for a MD container",
 	"Wait for card insertion",
+	"Run the actions on the cards in all readers concurrently",
 	"Display this message",
 	"Verbose operation. Use several times to enable debug output.",
 
@@ -347,9 +356,17 @@ struct secret {
 #define SC_PKCS15INIT_TYPE_DATA		16
 #define SC_PKCS15INIT_TYPE_SKEY		32
 
+/* With --batch every card is provisioned by its own thread, which gets
+ * its own copy of the per-card state below */
+#ifdef HAVE_PTHREAD
+#define BATCH_LOCAL	__thread
+#else
+#define BATCH_LOCAL
+#endif
+
 static sc_context_t *	g_ctx = NULL;
-static sc_card_t *		g_card = NULL;
-static struct sc_pkcs15_card *	g_p15card = NULL;
+static BATCH_LOCAL sc_card_t *	g_card = NULL;
+static BATCH_LOCAL struct sc_pkcs15_card *g_p15card = NULL;
 static char *			opt_reader = NULL;
 static unsigned int		opt_actions;
 static int			opt_extractable = 0,
@@ -359,7 +376,8 @@ static int			opt_extractable = 0,
 				opt_no_sopin = 0,
 				opt_use_defkeys = 0,
 				opt_wait = 0,
-				opt_verify_pin = 0;
+				opt_verify_pin = 0,
+				opt_batch = 0;
 static const char *		opt_profile = "pkcs15";
 static char *			opt_card_profile = NULL;
 static char *			opt_infile = NULL;
@@ -371,8 +389,8 @@ static char *			opt_puk_label = NULL;
 static char *			opt_pubkey_label = NULL;
 static char *			opt_secrkey_algo = NULL;
 static char *			opt_cert_label = NULL;
-static const char *		opt_pins[4];
-static char *			pins[4];
+static BATCH_LOCAL const char *	opt_pins[4];
+static BATCH_LOCAL char *	pins[4];
 static char *			opt_serial = NULL;
 static const char *		opt_passphrase = NULL;
 static char *			opt_newkey = NULL;
@@ -445,8 +463,6 @@ static int	get_new_pin(sc_ui_hints_t *, const char *, const char *,
 int
 main(int argc, char **argv)
 {
-	struct sc_profile	*profile = NULL;
-	unsigned int		n;
 	int			r = 0;
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
@@ -483,17 +499,39 @@ main(int argc, char **argv)
 		util_print_usage_and_die(app_name, options, option_help, NULL);
 	}
 
+	if (opt_batch)
+		return do_batch();
+
 	/* Connect to the card */
 	if (!open_reader_and_card(opt_reader))
 		return 1;
 
 	sc_pkcs15init_set_callbacks(&callbacks);
 
+	r = do_provision_card();
+
+	if (g_card) {
+		sc_disconnect_card(g_card);
+	}
+	sc_release_context(g_ctx);
+	return r < 0? 1 : 0;
+}
+
+/*
+ * Run the requested actions on g_card
+ */
+static int
+do_provision_card(void)
+{
+	struct sc_profile	*profile = NULL;
+	unsigned int		n;
+	int			r = 0;
+
 	/* Bind the card-specific operations and load the profile */
 	r = sc_pkcs15init_bind(g_card, opt_profile, opt_card_profile, NULL, &profile);
 	if (r < 0) {
 		printf("Couldn't bind to the card: %s\n", sc_strerror(r));
-		return 1;
+		return r;
 	}
 
 	for (n = 0; n < sizeof(pins)/sizeof(pins[0]); n++) {
@@ -517,7 +555,8 @@ main(int argc, char **argv)
 				aid.len = sizeof(aid.value);
 				if (sc_hex_to_bin(opt_bind_to_aid, aid.value, &aid.len))   {
 					fprintf(stderr, "Invalid AID value: '%s'\n", opt_bind_to_aid);
-					return 1;
+					r = SC_ERROR_INVALID_ARGUMENTS;
+					break;
 				}
 
 				r = sc_pkcs15init_finalize_profile(g_card, profile, &aid);
@@ -627,22 +666,19 @@ main(int argc, char **argv)
 		}
 	}
 
+out:
 	for (n = 0; n < sizeof(pins)/sizeof(pins[0]); n++) {
 		free(pins[n]);
+		pins[n] = NULL;
 	}
-
-out:
 	if (profile) {
 		sc_pkcs15init_unbind(profile);
 	}
 	if (g_p15card) {
 		sc_pkcs15_unbind(g_p15card);
+		g_p15card = NULL;
 	}
-	if (g_card) {
-		sc_disconnect_card(g_card);
-	}
-	sc_release_context(g_ctx);
-	return r < 0? 1 : 0;
+	return r;
 }
 
 static int
@@ -667,6 +703,198 @@ open_reader_and_card(char *reader)
 	return 1;
 }
 
+#ifdef HAVE_PTHREAD
+/*
+ * Batch provisioning: one thread per card, sharing the context
+ */
+struct batch_job {
+	sc_reader_t *	reader;
+	pthread_t	thread;
+	int		r;
+	double		seconds;
+};
+
+static const char *	batch_pins[4];
+static pthread_mutex_t	batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+batch_create_mutex(void **m)
+{
+	pthread_mutex_t *mutex = calloc(1, sizeof(*mutex));
+
+	if (!mutex)
+		return SC_ERROR_OUT_OF_MEMORY;
+	pthread_mutex_init(mutex, NULL);
+	*m = mutex;
+	return SC_SUCCESS;
+}
+
+static int
+batch_lock_mutex(void *m)
+{
+	return pthread_mutex_lock(m) ? SC_ERROR_INTERNAL : SC_SUCCESS;
+}
+
+static int
+batch_unlock_mutex(void *m)
+{
+	return pthread_mutex_unlock(m) ? SC_ERROR_INTERNAL : SC_SUCCESS;
+}
+
+static int
+batch_destroy_mutex(void *m)
+{
+	pthread_mutex_destroy(m);
+	free(m);
+	return SC_SUCCESS;
+}
+
+static sc_thread_context_t batch_thread_ctx = {
+	0, batch_create_mutex, batch_lock_mutex,
+	batch_unlock_mutex, batch_destroy_mutex, NULL
+};
+
+/* Only one card at a time may prompt on the terminal */
+static int
+batch_get_pin_callback(struct sc_profile *profile,
+		int id, const struct sc_pkcs15_auth_info *info,
+		const char *label,
+		u8 *pinbuf, size_t *pinsize)
+{
+	int r;
+
+	pthread_mutex_lock(&batch_lock);
+	r = get_pin_callback(profile, id, info, label, pinbuf, pinsize);
+	pthread_mutex_unlock(&batch_lock);
+	return r;
+}
+
+static int
+batch_get_key_callback(struct sc_profile *profile,
+			int method, int reference,
+			const u8 *def_key, size_t def_key_size,
+			u8 *key_buf, size_t *buf_size)
+{
+	int r;
+
+	pthread_mutex_lock(&batch_lock);
+	r = get_key_callback(profile, method, reference,
+			def_key, def_key_size, key_buf, buf_size);
+	pthread_mutex_unlock(&batch_lock);
+	return r;
+}
+
+static struct sc_pkcs15init_callbacks batch_callbacks = {
+	batch_get_pin_callback,
+	batch_get_key_callback,
+};
+
+static void *
+batch_provision_card(void *arg)
+{
+	struct batch_job *job = arg;
+	struct timespec	start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	memcpy(opt_pins, batch_pins, sizeof(opt_pins));
+
+	/* Card drivers are not prepared to be matched concurrently */
+	pthread_mutex_lock(&batch_lock);
+	job->r = sc_connect_card(job->reader, &g_card);
+	pthread_mutex_unlock(&batch_lock);
+
+	if (job->r == SC_SUCCESS) {
+		job->r = do_provision_card();
+		sc_disconnect_card(g_card);
+		g_card = NULL;
+	} else {
+		fprintf(stderr, "%s: Failed to connect to card: %s\n",
+			job->reader->name, sc_strerror(job->r));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	job->seconds = (end.tv_sec - start.tv_sec)
+		+ (end.tv_nsec - start.tv_nsec) / 1e9;
+	return NULL;
+}
+
+static int
+do_batch(void)
+{
+	struct batch_job *jobs;
+	sc_context_param_t ctx_param;
+	unsigned int	i, nreaders, njobs = 0;
+	int		r, failed = 0;
+
+	if (opt_reader || opt_wait) {
+		fprintf(stderr, "Error: --batch uses all readers with a card present, "
+			"--reader and --wait cannot be used with it\n");
+		return 1;
+	}
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.ver      = 0;
+	ctx_param.app_name = app_name;
+	ctx_param.thread_ctx = &batch_thread_ctx;
+
+	r = sc_context_create(&g_ctx, &ctx_param);
+	if (r) {
+		util_error("Failed to establish context: %s\n", sc_strerror(r));
+		return 1;
+	}
+
+	sc_pkcs15init_set_callbacks(&batch_callbacks);
+	memcpy(batch_pins, opt_pins, sizeof(batch_pins));
+
+	nreaders = sc_ctx_get_reader_count(g_ctx);
+	jobs = calloc(nreaders ? nreaders : 1, sizeof(*jobs));
+	if (!jobs) {
+		sc_release_context(g_ctx);
+		return 1;
+	}
+
+	for (i = 0; i < nreaders; i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(g_ctx, i);
+		struct batch_job *job = &jobs[njobs];
+
+		if (!(sc_detect_card_presence(reader) & SC_READER_CARD_PRESENT))
+			continue;
+
+		job->reader = reader;
+		if (pthread_create(&job->thread, NULL, batch_provision_card, job)) {
+			fprintf(stderr, "%s: Failed to start thread\n", reader->name);
+			failed = 1;
+			continue;
+		}
+		njobs++;
+	}
+	if (!njobs && !failed) {
+		fprintf(stderr, "No smart card present.\n");
+		failed = 1;
+	}
+
+	for (i = 0; i < njobs; i++) {
+		pthread_join(jobs[i].thread, NULL);
+		printf("%s: %s (%.1f s)\n", jobs[i].reader->name,
+			jobs[i].r < 0 ? sc_strerror(jobs[i].r) : "done",
+			jobs[i].seconds);
+		if (jobs[i].r < 0)
+			failed = 1;
+	}
+
+	free(jobs);
+	sc_release_context(g_ctx);
+	return failed;
+}
+#else
+static int
+do_batch(void)
+{
+	fprintf(stderr, "Error: --batch is not supported on this platform\n");
+	return 1;
+}
+#endif
+
 /*
  * Make sure there's no pkcs15 structure on the card
  */
@@ -2770,6 +2998,9 @@ handle_option(const struct option *opt)
 	case 'w':
 		opt_wait = 1;
 		break;
+	case OPT_BATCH:
+		opt_batch = 1;
+		break;
 	case OPT_PIN1: case OPT_PUK1:
 	case OPT_PIN2: case OPT_PUK2:
 		util_get_pin(optarg, &(opt_pins[opt->val & 3]));
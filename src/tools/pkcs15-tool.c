@@ -90,6 +90,8 @@ enum {
 	OPT_PIN_ID,
 	OPT_NO_CACHE,
 	OPT_CLEAR_CACHE,
+	OPT_WARM_CACHE,
+	OPT_VERIFY_CACHE,
 	OPT_LIST_PUB,
 	OPT_READ_PUB,
 #if defined(ENABLE_OPENSSL) && (defined(_WIN32) || defined(HAVE_INTTYPES_H))
@@ -148,6 +150,8 @@ static const struct option options[] = {
 	{ "output",		required_argument, NULL,	'o' },
 	{ "no-cache",		no_argument, NULL,		OPT_NO_CACHE },
 	{ "clear-cache",	no_argument, NULL,		OPT_CLEAR_CACHE },
+	{ "warm-cache",		no_argument, NULL,		OPT_WARM_CACHE },
+	{ "verify-cache",	no_argument, NULL,		OPT_VERIFY_CACHE },
 	{ "auth-id",		required_argument, NULL,	'a' },
 	{ "aid",		required_argument, NULL,	OPT_BIND_TO_AID },
 	{ "wait",		no_argument, NULL,		'w' },
@@ -190,6 +194,8 @@ static const char *option_help[] = {
 	"Outputs to file <arg>",
 	"Disable card caching",
 	"Clear card caching",
+	"Read the public files of the card into the file cache",
+	"Compare the file cache with the card and report stale entries",
 	"The auth ID of the PIN to use",
 	"Specify AID of the on-card PKCS#15 application to bind to (in hexadecimal form)",
 	"Wait for card insertion",
@@ -1364,6 +1370,176 @@ static int clear_cache(void)
 }
 #endif
 
+typedef int (*cached_file_func)(const sc_path_t *path, const char *what);
+
+/* Calls func once for the TokenInfo, the ODF, every DF and the content of
+ * every public certificate, public key and data object, i.e. the files
+ * read from the card while binding and listing the public objects. */
+static int for_each_cacheable_file(cached_file_func func)
+{
+	const unsigned int types[] = {
+		SC_PKCS15_TYPE_CERT_X509, SC_PKCS15_TYPE_PUBKEY, SC_PKCS15_TYPE_DATA_OBJECT
+	};
+	struct sc_pkcs15_object *objs[64];
+	sc_path_t *seen = NULL, *tmp, path;
+	sc_pkcs15_df_t *df;
+	size_t nseen = 0, i;
+	unsigned int t;
+	int r, count, err = 0;
+
+	/* make sure that all DFs have been parsed */
+	for (t = 0; t < NELEMENTS(types); t++)
+		sc_pkcs15_get_objects(p15card, types[t], objs, NELEMENTS(objs));
+
+	for (i = 0, df = NULL; ; i++) {
+		const char *what;
+
+		if (i == 0 && p15card->file_tokeninfo) {
+			path = p15card->file_tokeninfo->path;
+			what = "TokenInfo";
+		} else if (i == 1 && p15card->file_odf) {
+			path = p15card->file_odf->path;
+			what = "ODF";
+		} else if (i < 2) {
+			continue;
+		} else {
+			df = df ? df->next : p15card->df_list;
+			if (df == NULL)
+				break;
+			path = df->path;
+			what = "DF";
+		}
+		if (path.len < 2)
+			continue;
+		tmp = realloc(seen, (nseen + 1) * sizeof(*seen));
+		if (tmp == NULL)
+			goto oom;
+		seen = tmp;
+		seen[nseen++] = path;
+		err |= func(&path, what);
+	}
+
+	for (t = 0; t < NELEMENTS(types); t++) {
+		count = sc_pkcs15_get_objects(p15card, types[t], objs, NELEMENTS(objs));
+		for (r = 0; r < count; r++) {
+			if (objs[r]->flags & SC_PKCS15_CO_FLAG_PRIVATE)
+				continue;
+			switch (types[t]) {
+			case SC_PKCS15_TYPE_CERT_X509:
+				path = ((struct sc_pkcs15_cert_info *) objs[r]->data)->path;
+				break;
+			case SC_PKCS15_TYPE_PUBKEY:
+				path = ((struct sc_pkcs15_pubkey_info *) objs[r]->data)->path;
+				break;
+			default:
+				path = ((struct sc_pkcs15_data_info *) objs[r]->data)->path;
+				break;
+			}
+			if (path.len < 2)
+				continue;
+			/* the whole file, even if the object is only a part of it */
+			path.index = 0;
+			path.count = -1;
+			for (i = 0; i < nseen; i++)
+				if (sc_compare_path(&seen[i], &path))
+					break;
+			if (i < nseen)
+				continue;
+			tmp = realloc(seen, (nseen + 1) * sizeof(*seen));
+			if (tmp == NULL)
+				goto oom;
+			seen = tmp;
+			seen[nseen++] = path;
+			err |= func(&path, objs[r]->label);
+		}
+	}
+
+	free(seen);
+	return err;
+oom:
+	fprintf(stderr, "Out of memory\n");
+	free(seen);
+	return 1;
+}
+
+static int read_file_from_card(const sc_path_t *path, u8 **buf, size_t *len)
+{
+	int use_file_cache = p15card->opts.use_file_cache;
+	int r;
+
+	p15card->opts.use_file_cache = 0;
+	r = sc_pkcs15_read_file(p15card, path, buf, len);
+	p15card->opts.use_file_cache = use_file_cache;
+	return r;
+}
+
+static int warm_cache_file(const sc_path_t *path, const char *what)
+{
+	u8 *buf = NULL;
+	size_t len = 0;
+	int r;
+
+	r = read_file_from_card(path, &buf, &len);
+	if (r == SC_SUCCESS)
+		r = sc_pkcs15_cache_file(p15card, path, buf, len);
+	free(buf);
+
+	printf("%-32s %-24s ", sc_print_path(path), what);
+	if (r < 0) {
+		printf("%s\n", sc_strerror(r));
+		return 1;
+	}
+	printf("%"SC_FORMAT_LEN_SIZE_T"u bytes cached\n", len);
+	return 0;
+}
+
+static int verify_cache_file(const sc_path_t *path, const char *what)
+{
+	u8 *card_buf = NULL, *cache_buf = NULL;
+	size_t card_len = 0, cache_len = 0;
+	int r, err = 1;
+
+	printf("%-32s %-24s ", sc_print_path(path), what);
+	r = sc_pkcs15_read_cached_file(p15card, path, &cache_buf, &cache_len);
+	if (r == SC_ERROR_FILE_NOT_FOUND) {
+		printf("not cached\n");
+		return 1;
+	} else if (r < 0) {
+		printf("%s\n", sc_strerror(r));
+		return 1;
+	}
+
+	r = read_file_from_card(path, &card_buf, &card_len);
+	if (r < 0)
+		printf("cannot read from the card: %s\n", sc_strerror(r));
+	else if (card_len != cache_len || memcmp(card_buf, cache_buf, card_len) != 0)
+		printf("stale\n");
+	else {
+		printf("OK\n");
+		err = 0;
+	}
+	free(card_buf);
+	free(cache_buf);
+	return err;
+}
+
+static int warm_cache(void)
+{
+	if (!p15card->opts.use_file_cache)
+		fprintf(stderr, "Warning: use_file_caching is disabled in opensc.conf, "
+				"the cache will not be used\n");
+	return for_each_cacheable_file(warm_cache_file);
+}
+
+static int verify_cache(void)
+{
+	int err = for_each_cacheable_file(verify_cache_file);
+
+	if (err)
+		fprintf(stderr, "The file cache is not up to date, refresh it with --warm-cache\n");
+	return err;
+}
+
 
 static int verify_pin(void)
 {
@@ -2177,6 +2353,8 @@ int main(int argc, char *argv[])
 	int do_unblock_pin = 0;
 	int do_test_update = 0;
 	int do_test_session_pin = 0;
+	int do_warm_cache = 0;
+	int do_verify_cache = 0;
 	int do_update = 0;
 	int do_print_version = 0;
 	int do_list_info = 0;
@@ -2365,6 +2543,14 @@ int main(int argc, char *argv[])
 			opt_clear_cache = 1;
 			action_count++;
 			break;
+		case OPT_WARM_CACHE:
+			do_warm_cache = 1;
+			action_count++;
+			break;
+		case OPT_VERIFY_CACHE:
+			do_verify_cache = 1;
+			action_count++;
+			break;
 		case 'w':
 			opt_wait = 1;
 			break;
@@ -2531,6 +2717,16 @@ int main(int argc, char *argv[])
 			goto end;
 		action_count--;
 	}
+	if (do_warm_cache) {
+		if ((err = warm_cache()))
+			goto end;
+		action_count--;
+	}
+	if (do_verify_cache) {
+		if ((err = verify_cache()))
+			goto end;
+		action_count--;
+	}
 end:
 	sc_pkcs15_unbind(p15card);
 	sc_disconnect_card(card);
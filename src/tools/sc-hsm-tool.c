@@ -27,6 +27,7 @@
 #include <unistd.h>
 #endif
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
 #include <ctype.h>
 #include <sys/stat.h>
@@ -76,7 +77,9 @@ enum {
 	OPT_BIO2,
 	OPT_PASSWORD,
 	OPT_PASSWORD_SHARES_THRESHOLD,
-	OPT_PASSWORD_SHARES_TOTAL
+	OPT_PASSWORD_SHARES_TOTAL,
+	OPT_WRAP_ALL,
+	OPT_UNWRAP_ALL
 };
 
 static const struct option options[] = {
@@ -88,6 +91,8 @@ static const struct option options[] = {
 #endif
 	{ "wrap-key",				1, NULL,		'W' },
 	{ "unwrap-key",				1, NULL,		'U' },
+	{ "wrap-all",				1, NULL,		OPT_WRAP_ALL },
+	{ "unwrap-all",				1, NULL,		OPT_UNWRAP_ALL },
 	{ "dkek-shares",			1, NULL,		's' },
 	{ "so-pin",					1, NULL,		OPT_SO_PIN },
 	{ "pin",					1, NULL,		OPT_PIN },
@@ -115,6 +120,8 @@ static const char *option_help[] = {
 #endif
 	"Wrap key and save to <filename>",
 	"Unwrap key read from <filename>",
+	"Wrap all keys and save to files key-<ref>.bin in <directory>",
+	"Unwrap all keys read from files key-<ref>.bin in <directory>",
 	"Number of DKEK shares [No DKEK]",
 	"Define security officer PIN (SO-PIN)",
 	"Define user PIN",
@@ -1290,32 +1297,11 @@ static int wrap_with_tag(u8 tag, u8 *indata, size_t inlen, u8 **outdata, size_t
 
 
 
-static int wrap_key(sc_context_t *ctx, sc_card_t *card, int keyid, const char *outf, const char *pin)
+static int verify_user_pin(sc_card_t *card, const char *pin)
 {
-	sc_cardctl_sc_hsm_wrapped_key_t wrapped_key;
 	struct sc_pin_cmd_data data;
-	sc_path_t path;
-	FILE *out = NULL;
-	u8 fid[2];
-	u8 ef_prkd[MAX_PRKD];
-	u8 ef_cert[MAX_CERT];
-	u8 wrapped_key_buff[MAX_KEY];
-	u8 keyblob[MAX_WRAPPED_KEY];
-	u8 *key;
-	u8 *ptr;
 	char *lpin = NULL;
-	size_t key_len;
-	int r, ef_prkd_len, ef_cert_len;
-
-	if ((keyid < 1) || (keyid > 255)) {
-		fprintf(stderr, "Invalid key reference (must be 0 < keyid <= 255)\n");
-		return -1;
-	}
-
-	if (outf == NULL) {
-		fprintf(stderr, "No file name specified for wrapped key\n");
-		return -1;
-	}
+	int r;
 
 	if (pin == NULL) {
 		printf("Enter User PIN : ");
@@ -1334,70 +1320,131 @@ static int wrap_key(sc_context_t *ctx, sc_card_t *card, int keyid, const char *o
 
 	r = sc_pin_cmd(card, &data, NULL);
 
+	if (pin == NULL) {
+		free(lpin);
+	}
+
 	if (r < 0) {
 		fprintf(stderr, "PIN verification failed with %s\n", sc_strerror(r));
 		return -1;
 	}
+	return 0;
+}
 
-	if (pin == NULL) {
-		free(lpin);
-	}
 
-	wrapped_key.key_id = keyid;
-	wrapped_key.wrapped_key = wrapped_key_buff;
-	wrapped_key.wrapped_key_length = sizeof(wrapped_key_buff);
 
-	r = sc_card_ctl(card, SC_CARDCTL_SC_HSM_WRAP_KEY, (void *)&wrapped_key);
+/**
+ * List the file identifiers of the SmartCard-HSM application
+ *
+ * @param card the card
+ * @param fids buffer receiving the file identifiers, two bytes each
+ * @param fidslen the size of fids
+ * @return the number of file identifiers or a negative error code
+ */
+static int list_fids(sc_card_t *card, u8 *fids, size_t fidslen)
+{
+	int r = sc_list_files(card, fids, fidslen);
 
-	if (r == SC_ERROR_INS_NOT_SUPPORTED) {			// Not supported or not initialized for key shares
-		fprintf(stderr, "Card not initialized for key wrap\n");
-		return -1;
+	if (r < 0) {
+		fprintf(stderr, "Listing the files failed with %s\n", sc_strerror(r));
+		return r;
 	}
+	return r / 2;
+}
 
-	if (r < 0) {
-		fprintf(stderr, "sc_card_ctl(*, SC_CARDCTL_SC_HSM_WRAP_KEY, *) failed with %s\n", sc_strerror(r));
-		return -1;
+
+
+static int has_fid(const u8 *fids, int nfids, u8 prefix, u8 id)
+{
+	int i;
+
+	for (i = 0; i < nfids; i++) {
+		if ((fids[2 * i] == prefix) && (fids[2 * i + 1] == id))
+			return 1;
 	}
+	return 0;
+}
 
 
-	fid[0] = PRKD_PREFIX;
-	fid[1] = (unsigned char)keyid;
-	ef_prkd_len = 0;
 
-	/* Try to select a related EF containing the PKCS#15 description of the key */
+static int read_related_ef(sc_card_t *card, u8 prefix, u8 id, u8 *buf, size_t buflen, const char *what)
+{
+	sc_path_t path;
+	u8 fid[2];
+	int r, len = 0;
+
+	fid[0] = prefix;
+	fid[1] = id;
+
 	sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, sizeof(fid), 0, 0);
 	r = sc_select_file(card, &path, NULL);
 
 	if (r == SC_SUCCESS) {
-		ef_prkd_len = sc_read_binary(card, 0, ef_prkd, sizeof(ef_prkd), 0);
+		len = sc_read_binary(card, 0, buf, buflen, 0);
 
-		if (ef_prkd_len < 0) {
-			fprintf(stderr, "Error reading PRKD file %s. Skipping.\n", sc_strerror(ef_prkd_len));
-			ef_prkd_len = 0;
+		if (len < 0) {
+			fprintf(stderr, "Error reading %s %s. Skipping.\n", what, sc_strerror(len));
+			len = 0;
 		} else {
-			ef_prkd_len = determineLength(ef_prkd, ef_prkd_len);
+			len = determineLength(buf, len);
 		}
 	}
+	return len;
+}
 
-	fid[0] = EE_CERTIFICATE_PREFIX;
-	fid[1] = (unsigned char)keyid;
-	ef_cert_len = 0;
 
-	/* Try to select a related EF containing the certificate for the key */
-	sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, sizeof(fid), 0, 0);
-	r = sc_select_file(card, &path, NULL);
 
-	if (r == SC_SUCCESS) {
-		ef_cert_len = sc_read_binary(card, 0, ef_cert, sizeof(ef_cert), 0);
+/**
+ * Wrap a key and save it with its description and certificate
+ *
+ * The user PIN must have been verified.
+ *
+ * @param fids the file identifiers of the application, as listed by
+ *             list_fids(), or NULL to look for the related EFs on the card
+ * @param nfids the number of file identifiers in fids
+ */
+static int wrap_key_to_file(sc_context_t *ctx, sc_card_t *card, int keyid, const char *outf,
+		const u8 *fids, int nfids)
+{
+	sc_cardctl_sc_hsm_wrapped_key_t wrapped_key;
+	FILE *out = NULL;
+	u8 ef_prkd[MAX_PRKD];
+	u8 ef_cert[MAX_CERT];
+	u8 wrapped_key_buff[MAX_KEY];
+	u8 keyblob[MAX_WRAPPED_KEY];
+	u8 *key;
+	u8 *ptr;
+	size_t key_len;
+	int r, ef_prkd_len, ef_cert_len;
 
-		if (ef_cert_len < 0) {
-			fprintf(stderr, "Error reading certificate %s. Skipping\n", sc_strerror(ef_cert_len));
-			ef_cert_len = 0;
-		} else {
-			ef_cert_len = determineLength(ef_cert, ef_cert_len);
-		}
+	wrapped_key.key_id = keyid;
+	wrapped_key.wrapped_key = wrapped_key_buff;
+	wrapped_key.wrapped_key_length = sizeof(wrapped_key_buff);
+
+	r = sc_card_ctl(card, SC_CARDCTL_SC_HSM_WRAP_KEY, (void *)&wrapped_key);
+
+	if (r == SC_ERROR_INS_NOT_SUPPORTED) {			// Not supported or not initialized for key shares
+		fprintf(stderr, "Card not initialized for key wrap\n");
+		return -1;
+	}
+
+	if (r < 0) {
+		fprintf(stderr, "sc_card_ctl(*, SC_CARDCTL_SC_HSM_WRAP_KEY, *) failed with %s\n", sc_strerror(r));
+		return -1;
 	}
 
+	/* Related EF containing the PKCS#15 description of the key */
+	ef_prkd_len = 0;
+	if (!fids || has_fid(fids, nfids, PRKD_PREFIX, (u8)keyid))
+		ef_prkd_len = read_related_ef(card, PRKD_PREFIX, (u8)keyid,
+				ef_prkd, sizeof(ef_prkd), "PRKD file");
+
+	/* Related EF containing the certificate for the key */
+	ef_cert_len = 0;
+	if (!fids || has_fid(fids, nfids, EE_CERTIFICATE_PREFIX, (u8)keyid))
+		ef_cert_len = read_related_ef(card, EE_CERTIFICATE_PREFIX, (u8)keyid,
+				ef_cert, sizeof(ef_cert), "certificate");
+
 	ptr = keyblob;
 
 	// Encode key in octet string object
@@ -1451,6 +1498,67 @@ static int wrap_key(sc_context_t *ctx, sc_card_t *card, int keyid, const char *o
 
 
 
+static int wrap_key(sc_context_t *ctx, sc_card_t *card, int keyid, const char *outf, const char *pin)
+{
+	if ((keyid < 1) || (keyid > 255)) {
+		fprintf(stderr, "Invalid key reference (must be 0 < keyid <= 255)\n");
+		return -1;
+	}
+
+	if (outf == NULL) {
+		fprintf(stderr, "No file name specified for wrapped key\n");
+		return -1;
+	}
+
+	if (verify_user_pin(card, pin))
+		return -1;
+
+	return wrap_key_to_file(ctx, card, keyid, outf, NULL, 0);
+}
+
+
+
+static void wrapped_key_filename(char *buf, size_t buflen, const char *dir, int keyid)
+{
+	snprintf(buf, buflen, "%s/key-%d.bin", dir, keyid);
+}
+
+
+
+/**
+ * Wrap all keys of the card into files key-<key reference>.bin in the
+ * given directory, verifying the PIN and listing the files only once
+ */
+static int wrap_all_keys(sc_context_t *ctx, sc_card_t *card, const char *dir, const char *pin)
+{
+	u8 fids[2 * 512];
+	char filename[PATH_MAX];
+	int i, nfids, count = 0;
+
+	if (verify_user_pin(card, pin))
+		return -1;
+
+	nfids = list_fids(card, fids, sizeof(fids));
+	if (nfids < 0)
+		return -1;
+
+	for (i = 0; i < nfids; i++) {
+		if ((fids[2 * i] != KEY_PREFIX) || (fids[2 * i + 1] == 0))
+			continue;
+
+		wrapped_key_filename(filename, sizeof(filename), dir, fids[2 * i + 1]);
+		if (wrap_key_to_file(ctx, card, fids[2 * i + 1], filename, fids, nfids))
+			return -1;
+		printf("Key %d wrapped into %s\n", fids[2 * i + 1], filename);
+		count++;
+	}
+
+	printf("%d keys wrapped\n", count);
+	return 0;
+}
+
+
+
 static int update_ef(sc_card_t *card, u8 prefix, u8 id, int erase, const u8 *buf, size_t buflen)
 {
 	sc_file_t *file = NULL;
@@ -1490,30 +1598,44 @@ static int update_ef(sc_card_t *card, u8 prefix, u8 id, int erase, const u8 *buf
 
 
 
-static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *pin, int force)
+static int file_exists(sc_card_t *card, const u8 *fids, int nfids, u8 prefix, u8 id)
+{
+	sc_path_t path;
+	u8 fid[2];
+
+	if (fids)
+		return has_fid(fids, nfids, prefix, id);
+
+	fid[0] = prefix;
+	fid[1] = id;
+	sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, sizeof(fid), 0, 0);
+	return sc_select_file(card, &path, NULL) == SC_SUCCESS;
+}
+
+
+
+/**
+ * Import a key with its description and certificate from a file
+ *
+ * @param pin the user PIN, see verify_user_pin()
+ * @param verify whether the PIN still needs to be verified
+ * @param fids the file identifiers of the application, as listed by
+ *             list_fids(), or NULL to look for existing EFs on the card
+ * @param nfids the number of file identifiers in fids
+ */
+static int unwrap_key_from_file(sc_card_t *card, int keyid, const char *inf, const char *pin, int verify,
+		int force, const u8 *fids, int nfids)
 {
 	sc_cardctl_sc_hsm_wrapped_key_t wrapped_key;
-	struct sc_pin_cmd_data data;
 	u8 keyblob[MAX_WRAPPED_KEY];
 	const u8 *ptr,*prkd,*cert;
 	FILE *in = NULL;
 	sc_path_t path;
 	u8 fid[2];
-	char *lpin = NULL;
 	unsigned int cla, tag;
 	int r, keybloblen;
 	size_t len, olen, prkd_len, cert_len;
 
-	if ((keyid < 1) || (keyid > 255)) {
-		fprintf(stderr, "Invalid key reference (must be 0 < keyid <= 255)\n");
-		return -1;
-	}
-
-	if (inf == NULL) {
-		fprintf(stderr, "No file name specified for wrapped key\n");
-		return -1;
-	}
-
 	in = fopen(inf, "rb");
 
 	if (in == NULL) {
@@ -1563,61 +1685,22 @@ static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *p
 		printf("  Certificate\n");
 	}
 
-	if ((prkd_len > 0) && !force) {
-		fid[0] = PRKD_PREFIX;
-		fid[1] = (unsigned char)keyid;
-
-		/* Try to select a related EF containing the PKCS#15 description of the key */
-		sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, sizeof(fid), 0, 0);
-		r = sc_select_file(card, &path, NULL);
-
-		if (r == SC_SUCCESS) {
-			fprintf(stderr, "Found existing private key description in EF with fid %02x%02x. Please remove key first, select unused key reference or use --force.\n", fid[0], fid[1]);
-			return -1;
-		}
-	}
-
-	if ((cert_len > 0) && !force) {
-		fid[0] = EE_CERTIFICATE_PREFIX;
-		fid[1] = (unsigned char)keyid;
-
-		/* Try to select a related EF containing the certificate */
-		sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, sizeof(fid), 0, 0);
-		r = sc_select_file(card, &path, NULL);
-
-		if (r == SC_SUCCESS) {
-			fprintf(stderr, "Found existing certificate in EF with fid %02x%02x. Please remove certificate first, select unused key reference or use --force.\n", fid[0], fid[1]);
-			return -1;
-		}
-	}
-
-	if (pin == NULL) {
-		printf("Enter User PIN : ");
-		util_getpass(&lpin, NULL, stdin);
-		printf("\n");
-	} else {
-		lpin = (char *)pin;
+	if ((prkd_len > 0) && !force
+			&& file_exists(card, fids, nfids, PRKD_PREFIX, (u8)keyid)) {
+		fprintf(stderr, "Found existing private key description in EF with fid %02x%02x. Please remove key first, select unused key reference or use --force.\n", PRKD_PREFIX, keyid);
+		return -1;
 	}
 
-	memset(&data, 0, sizeof(data));
-	data.cmd = SC_PIN_CMD_VERIFY;
-	data.pin_type = SC_AC_CHV;
-	data.pin_reference = ID_USER_PIN;
-	data.pin1.data = (u8 *)lpin;
-	data.pin1.len = strlen(lpin);
-
-	r = sc_pin_cmd(card, &data, NULL);
-
-	if (r < 0) {
-		fprintf(stderr, "PIN verification failed with %s\n", sc_strerror(r));
+	if ((cert_len > 0) && !force
+			&& file_exists(card, fids, nfids, EE_CERTIFICATE_PREFIX, (u8)keyid)) {
+		fprintf(stderr, "Found existing certificate in EF with fid %02x%02x. Please remove certificate first, select unused key reference or use --force.\n", EE_CERTIFICATE_PREFIX, keyid);
 		return -1;
 	}
 
-	if (pin == NULL) {
-		free(lpin);
-	}
+	if (verify && verify_user_pin(card, pin))
+		return -1;
 
-	if (force) {
+	if (force && (!fids || has_fid(fids, nfids, KEY_PREFIX, (u8)keyid))) {
 		fid[0] = KEY_PREFIX;
 		fid[1] = keyid;
 
@@ -1668,6 +1751,58 @@ static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *p
 
 
 
+static int unwrap_key(sc_card_t *card, int keyid, const char *inf, const char *pin, int force)
+{
+	if ((keyid < 1) || (keyid > 255)) {
+		fprintf(stderr, "Invalid key reference (must be 0 < keyid <= 255)\n");
+		return -1;
+	}
+
+	if (inf == NULL) {
+		fprintf(stderr, "No file name specified for wrapped key\n");
+		return -1;
+	}
+
+	return unwrap_key_from_file(card, keyid, inf, pin, 1, force, NULL, 0);
+}
+
+
+
+/**
+ * Import all files key-<key reference>.bin of the given directory under
+ * their key reference, verifying the PIN and listing the files only once
+ */
+static int unwrap_all_keys(sc_card_t *card, const char *dir, const char *pin, int force)
+{
+	u8 fids[2 * 512];
+	char filename[PATH_MAX];
+	struct stat st;
+	int keyid, nfids, count = 0;
+
+	if (verify_user_pin(card, pin))
+		return -1;
+
+	nfids = list_fids(card, fids, sizeof(fids));
+	if (nfids < 0)
+		return -1;
+
+	for (keyid = 1; keyid <= 255; keyid++) {
+		wrapped_key_filename(filename, sizeof(filename), dir, keyid);
+		if (stat(filename, &st) != 0)
+			continue;
+
+		printf("Importing %s as key %d\n", filename, keyid);
+		if (unwrap_key_from_file(card, keyid, filename, pin, 0, force, fids, nfids))
+			return -1;
+		count++;
+	}
+
+	printf("%d keys imported\n", count);
+	return 0;
+}
+
+
+
 int main(int argc, char *argv[])
 {
 	int err = 0, r, c, long_optind = 0;
@@ -1678,6 +1813,8 @@ int main(int argc, char *argv[])
 	int do_create_dkek_share = 0;
 	int do_wrap_key = 0;
 	int do_unwrap_key = 0;
+	int do_wrap_all = 0;
+	int do_unwrap_all = 0;
 	sc_path_t path;
 	sc_file_t *file = NULL;
 	const char *opt_so_pin = NULL;
@@ -1733,6 +1870,16 @@ int main(int argc, char *argv[])
 			opt_filename = optarg;
 			action_count++;
 			break;
+		case OPT_WRAP_ALL:
+			do_wrap_all = 1;
+			opt_filename = optarg;
+			action_count++;
+			break;
+		case OPT_UNWRAP_ALL:
+			do_unwrap_all = 1;
+			opt_filename = optarg;
+			action_count++;
+			break;
 		case OPT_PASSWORD:
 			util_get_pin(optarg, &opt_password);
 			break;
@@ -1835,6 +1982,12 @@ int main(int argc, char *argv[])
 	if (do_unwrap_key && unwrap_key(card, opt_key_reference, opt_filename, opt_pin, opt_force))
 		goto fail;
 
+	if (do_wrap_all && wrap_all_keys(ctx, card, opt_filename, opt_pin))
+		goto fail;
+
+	if (do_unwrap_all && unwrap_all_keys(card, opt_filename, opt_pin, opt_force))
+		goto fail;
+
 	if (action_count == 0) {
 		print_info(card, file);
 	}
@@ -60,6 +60,9 @@ int util_getpass (char **lineptr, size_t *n, FILE *stream);
  */
 size_t util_get_pin(const char *input, const char **pin);
 
+/* Monotonic time stamp in microseconds, for measuring durations */
+unsigned long long util_time_us(void);
+
 #ifdef __cplusplus
 }
 #endif